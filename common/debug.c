@@ -29,9 +29,11 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
 #include "debug.h"
+#include "trace.h"
 #include "libimobiledevice/libimobiledevice.h"
 #include "src/idevice.h"
 
@@ -81,6 +83,9 @@ void debug_info_real(const char *func, const char *file, int line, const char *f
 	va_list args;
 	char *buffer = NULL;
 
+	if (trace_enabled)
+		trace_record(IDEVICE_TRACE_MESSAGE, 0, 0, 0, func, format);
+
 	if (!debug_level)
 		return;
 
@@ -98,32 +103,36 @@ void debug_info_real(const char *func, const char *file, int line, const char *f
 void debug_buffer(const char *data, const int length)
 {
 #ifndef STRIP_DEBUG_CODE
+	static const char hex[] = "0123456789abcdef";
+	char line[80];
 	int i;
 	int j;
 	unsigned char c;
 
 	if (debug_level) {
 		for (i = 0; i < length; i += 16) {
-			fprintf(stderr, "%04x: ", i);
+			/* format a whole line at once instead of printing every byte */
+			char *p = line;
+			p += sprintf(p, "%04x: ", i);
 			for (j = 0; j < 16; j++) {
 				if (i + j >= length) {
-					fprintf(stderr, "   ");
-					continue;
+					memcpy(p, "   ", 3);
+				} else {
+					c = *(data + i + j);
+					p[0] = hex[c >> 4];
+					p[1] = hex[c & 0xf];
+					p[2] = ' ';
 				}
-				fprintf(stderr, "%02x ", *(data + i + j) & 0xff);
+				p += 3;
 			}
-			fprintf(stderr, "  | ");
-			for (j = 0; j < 16; j++) {
-				if (i + j >= length)
-					break;
+			memcpy(p, "  | ", 4);
+			p += 4;
+			for (j = 0; j < 16 && i + j < length; j++) {
 				c = *(data + i + j);
-				if ((c < 32) || (c > 127)) {
-					fprintf(stderr, ".");
-					continue;
-				}
-				fprintf(stderr, "%c", c);
+				*p++ = ((c < 32) || (c > 127)) ? '.' : c;
 			}
-			fprintf(stderr, "\n");
+			*p++ = '\n';
+			fwrite(line, 1, p - line, stderr);
 		}
 		fprintf(stderr, "\n");
 	}
@@ -145,7 +154,7 @@ void debug_buffer_to_file(const char *file, const char *data, const int length)
 void debug_plist_real(const char *func, const char *file, int line, plist_t plist)
 {
 #ifndef STRIP_DEBUG_CODE
-	if (!plist)
+	if (!plist || !debug_level)
 		return;
 
 	char *buffer = NULL;
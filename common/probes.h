@@ -0,0 +1,60 @@
+/*
+ * probes.h
+ * Static tracepoints (USDT) for dynamic tracing tools
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __PROBES_H
+#define __PROBES_H
+
+/*
+ * Probes are emitted into the .note.stapsdt section under the provider
+ * name "libimobiledevice" and compile to a single nop at the probe site,
+ * so they cost nothing unless a tracer (bpftrace, perf, SystemTap) is
+ * attached. Probe names use '__' which tools display as '-'. Arguments
+ * that identify a device are the UDID string, which may be NULL.
+ *
+ * Available probes and their arguments:
+ *   connection__send__start    (udid, len)
+ *   connection__send__done     (udid, len, sent, error)
+ *   connection__receive__start (udid, len, timeout)
+ *   connection__receive__done  (udid, len, received, error)
+ *   ssl__enable__start         (udid)
+ *   ssl__enable__done          (udid, error)
+ *   plist__send                (udid, length, binary, error)
+ *   plist__receive__start      (udid, timeout)
+ *   plist__receive__done       (udid, length, error)
+ *   afc__request               (udid, operation, packet_num, length)
+ *   afc__response              (udid, operation, packet_num, length)
+ *   lockdown__start__service__start (udid, service)
+ *   lockdown__start__service__done  (udid, service, port, error)
+ */
+
+#if defined(ENABLE_PROBES) && defined(HAVE_SYS_SDT_H)
+#include <sys/sdt.h>
+
+#define PROBE1(name, a) DTRACE_PROBE1(libimobiledevice, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(libimobiledevice, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(libimobiledevice, name, a, b, c)
+#define PROBE4(name, a, b, c, d) DTRACE_PROBE4(libimobiledevice, name, a, b, c, d)
+#else
+#define PROBE1(name, a)
+#define PROBE2(name, a, b)
+#define PROBE3(name, a, b, c)
+#define PROBE4(name, a, b, c, d)
+#endif
+
+#endif
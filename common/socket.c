@@ -35,6 +35,7 @@
 #include <ws2tcpip.h>
 #include <windows.h>
 static int wsa_init = 0;
+#define poll WSAPoll
 #else
 #include <sys/socket.h>
 #include <sys/un.h>
@@ -43,6 +44,15 @@ static int wsa_init = 0;
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
+#include <poll.h>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#elif defined(HAVE_SYS_EVENT_H)
+#include <sys/event.h>
+#endif
 #ifdef AF_INET6
 #include <net/if.h>
 #include <ifaddrs.h>
@@ -685,11 +695,15 @@ int socket_connect(const char *addr, uint16_t port)
 
 int socket_check_fd(int fd, fd_mode fdm, unsigned int timeout)
 {
-	fd_set fds;
 	int sret;
 	int eagain;
+#ifdef WIN32
+	fd_set fds;
 	struct timeval to;
 	struct timeval *pto;
+#else
+	struct pollfd pfd;
+#endif
 
 	if (fd < 0) {
 		if (verbose >= 2)
@@ -697,12 +711,32 @@ int socket_check_fd(int fd, fd_mode fdm, unsigned int timeout)
 		return -1;
 	}
 
+#ifdef WIN32
 	FD_ZERO(&fds);
 	FD_SET(fd, &fds);
+#else
+	/* poll() has no FD_SETSIZE limit on the descriptor value */
+	pfd.fd = fd;
+	switch (fdm) {
+	case FDM_READ:
+		pfd.events = POLLIN;
+		break;
+	case FDM_WRITE:
+		pfd.events = POLLOUT;
+		break;
+	case FDM_EXCEPT:
+		pfd.events = POLLPRI;
+		break;
+	default:
+		return -1;
+	}
+#endif
 
 	sret = -1;
 
 	do {
+		eagain = 0;
+#ifdef WIN32
 		if (timeout > 0) {
 			to.tv_sec = (time_t) (timeout / 1000);
 			to.tv_usec = (time_t) ((timeout - (to.tv_sec * 1000)) * 1000);
@@ -710,7 +744,6 @@ int socket_check_fd(int fd, fd_mode fdm, unsigned int timeout)
 		} else {
 			pto = NULL;
 		}
-		eagain = 0;
 		switch (fdm) {
 		case FDM_READ:
 			sret = select(fd + 1, &fds, NULL, NULL, pto);
@@ -724,6 +757,15 @@ int socket_check_fd(int fd, fd_mode fdm, unsigned int timeout)
 		default:
 			return -1;
 		}
+#else
+		pfd.revents = 0;
+		sret = poll(&pfd, 1, (timeout > 0) ? (int)timeout : -1);
+		if (sret > 0 && (pfd.revents & POLLNVAL)) {
+			if (verbose >= 2)
+				fprintf(stderr, "%s: invalid fd %d\n", __func__, fd);
+			return -1;
+		}
+#endif
 
 		if (sret < 0) {
 			switch (errno) {
@@ -753,6 +795,536 @@ int socket_check_fd(int fd, fd_mode fdm, unsigned int timeout)
 	return sret;
 }
 
+struct socket_waiter_entry {
+	int fd;
+	unsigned int events;
+	void *user_data;
+};
+
+struct socket_waiter {
+#if defined(HAVE_SYS_EPOLL_H)
+	int epfd;
+	struct epoll_event *ready;
+#elif defined(HAVE_SYS_EVENT_H)
+	int kqfd;
+	struct kevent *ready;
+#else
+	struct pollfd *pfds;
+#endif
+	int ready_size;
+	struct socket_waiter_entry **entries;
+	int count;
+	int size;
+};
+
+socket_waiter_t socket_waiter_new(void)
+{
+	socket_waiter_t waiter = (socket_waiter_t)calloc(1, sizeof(struct socket_waiter));
+	if (!waiter)
+		return NULL;
+
+#if defined(HAVE_SYS_EPOLL_H)
+	waiter->epfd = epoll_create(16);
+	if (waiter->epfd < 0) {
+		free(waiter);
+		return NULL;
+	}
+	fcntl(waiter->epfd, F_SETFD, FD_CLOEXEC);
+#elif defined(HAVE_SYS_EVENT_H)
+	waiter->kqfd = kqueue();
+	if (waiter->kqfd < 0) {
+		free(waiter);
+		return NULL;
+	}
+	fcntl(waiter->kqfd, F_SETFD, FD_CLOEXEC);
+#endif
+
+	return waiter;
+}
+
+void socket_waiter_free(socket_waiter_t waiter)
+{
+	int i;
+
+	if (!waiter)
+		return;
+
+#if defined(HAVE_SYS_EPOLL_H)
+	close(waiter->epfd);
+#elif defined(HAVE_SYS_EVENT_H)
+	close(waiter->kqfd);
+#else
+	free(waiter->pfds);
+#endif
+	for (i = 0; i < waiter->count; i++) {
+		free(waiter->entries[i]);
+	}
+	free(waiter->entries);
+#if defined(HAVE_SYS_EPOLL_H) || defined(HAVE_SYS_EVENT_H)
+	free(waiter->ready);
+#endif
+	free(waiter);
+}
+
+static int socket_waiter_find(socket_waiter_t waiter, int fd)
+{
+	int i;
+	for (i = 0; i < waiter->count; i++) {
+		if (waiter->entries[i]->fd == fd)
+			return i;
+	}
+	return -1;
+}
+
+/* updates the kernel side registration, or the poll set, of an entry */
+static int socket_waiter_register(socket_waiter_t waiter, int index, unsigned int old_events)
+{
+	struct socket_waiter_entry *entry = waiter->entries[index];
+#if defined(HAVE_SYS_EPOLL_H)
+	struct epoll_event ev;
+	memset(&ev, '\0', sizeof(ev));
+	ev.events = ((entry->events & SOCKET_WAIT_READ) ? EPOLLIN : 0) | ((entry->events & SOCKET_WAIT_WRITE) ? EPOLLOUT : 0);
+	ev.data.ptr = entry;
+	return epoll_ctl(waiter->epfd, (old_events == (unsigned int)-1) ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, entry->fd, &ev);
+#elif defined(HAVE_SYS_EVENT_H)
+	struct kevent kev[2];
+	int n = 0;
+	if (old_events == (unsigned int)-1)
+		old_events = 0;
+	if ((entry->events ^ old_events) & SOCKET_WAIT_READ) {
+		EV_SET(&kev[n++], entry->fd, EVFILT_READ, (entry->events & SOCKET_WAIT_READ) ? EV_ADD : EV_DELETE, 0, 0, entry);
+	}
+	if ((entry->events ^ old_events) & SOCKET_WAIT_WRITE) {
+		EV_SET(&kev[n++], entry->fd, EVFILT_WRITE, (entry->events & SOCKET_WAIT_WRITE) ? EV_ADD : EV_DELETE, 0, 0, entry);
+	}
+	return (n > 0) ? kevent(waiter->kqfd, kev, n, NULL, 0, NULL) : 0;
+#else
+	(void)old_events;
+	waiter->pfds[index].fd = entry->fd;
+	waiter->pfds[index].events = ((entry->events & SOCKET_WAIT_READ) ? POLLIN : 0) | ((entry->events & SOCKET_WAIT_WRITE) ? POLLOUT : 0);
+	waiter->pfds[index].revents = 0;
+	return 0;
+#endif
+}
+
+int socket_waiter_add(socket_waiter_t waiter, int fd, unsigned int events, void *user_data)
+{
+	if (!waiter || fd < 0)
+		return -EINVAL;
+
+	int index = socket_waiter_find(waiter, fd);
+	if (index >= 0) {
+		unsigned int old_events = waiter->entries[index]->events;
+		waiter->entries[index]->events = events;
+		waiter->entries[index]->user_data = user_data;
+		return (socket_waiter_register(waiter, index, old_events) < 0) ? -errno : 0;
+	}
+
+	if (waiter->count >= waiter->size) {
+		int newsize = (waiter->size > 0) ? waiter->size * 2 : 16;
+		struct socket_waiter_entry **newentries = (struct socket_waiter_entry**)realloc(waiter->entries, sizeof(struct socket_waiter_entry*) * newsize);
+		if (!newentries)
+			return -ENOMEM;
+		waiter->entries = newentries;
+#if !defined(HAVE_SYS_EPOLL_H) && !defined(HAVE_SYS_EVENT_H)
+		struct pollfd *newpfds = (struct pollfd*)realloc(waiter->pfds, sizeof(struct pollfd) * newsize);
+		if (!newpfds)
+			return -ENOMEM;
+		waiter->pfds = newpfds;
+#endif
+		waiter->size = newsize;
+	}
+
+	struct socket_waiter_entry *entry = (struct socket_waiter_entry*)malloc(sizeof(struct socket_waiter_entry));
+	if (!entry)
+		return -ENOMEM;
+	entry->fd = fd;
+	entry->events = events;
+	entry->user_data = user_data;
+
+	index = waiter->count;
+	waiter->entries[index] = entry;
+	if (socket_waiter_register(waiter, index, (unsigned int)-1) < 0) {
+		int err = errno;
+		free(entry);
+		return -err;
+	}
+	waiter->count++;
+
+	return 0;
+}
+
+int socket_waiter_remove(socket_waiter_t waiter, int fd)
+{
+	if (!waiter)
+		return -EINVAL;
+
+	int index = socket_waiter_find(waiter, fd);
+	if (index < 0)
+		return -ENOENT;
+
+	struct socket_waiter_entry *entry = waiter->entries[index];
+#if defined(HAVE_SYS_EPOLL_H)
+	struct epoll_event ev;
+	/* fails harmlessly if the fd got closed already */
+	epoll_ctl(waiter->epfd, EPOLL_CTL_DEL, fd, &ev);
+#elif defined(HAVE_SYS_EVENT_H)
+	unsigned int events = entry->events;
+	entry->events = 0;
+	socket_waiter_register(waiter, index, events);
+#endif
+
+	/* keep the set dense by moving the last entry into the gap */
+	waiter->count--;
+	if (index < waiter->count) {
+		waiter->entries[index] = waiter->entries[waiter->count];
+#if !defined(HAVE_SYS_EPOLL_H) && !defined(HAVE_SYS_EVENT_H)
+		waiter->pfds[index] = waiter->pfds[waiter->count];
+#endif
+	}
+	free(entry);
+
+	return 0;
+}
+
+int socket_waiter_wait(socket_waiter_t waiter, struct socket_wait_event *events, int max_events, int timeout)
+{
+	int i;
+	int n = 0;
+
+	if (!waiter || !events || max_events <= 0)
+		return -EINVAL;
+
+	if (waiter->count == 0) {
+		/* nothing to wait for, just sleep */
+#ifdef WIN32
+		Sleep((timeout < 0) ? INFINITE : (DWORD)timeout);
+#else
+		poll(NULL, 0, timeout);
+#endif
+		return 0;
+	}
+
+#if defined(HAVE_SYS_EPOLL_H) || defined(HAVE_SYS_EVENT_H)
+	if (max_events > waiter->ready_size) {
+		void *newready = realloc(waiter->ready, sizeof(*waiter->ready) * max_events);
+		if (!newready)
+			return -ENOMEM;
+		waiter->ready = newready;
+		waiter->ready_size = max_events;
+	}
+#endif
+
+#if defined(HAVE_SYS_EPOLL_H)
+	int r = epoll_wait(waiter->epfd, waiter->ready, max_events, timeout);
+	if (r < 0)
+		return (errno == EINTR) ? 0 : -errno;
+	for (i = 0; i < r; i++) {
+		struct socket_waiter_entry *entry = (struct socket_waiter_entry*)waiter->ready[i].data.ptr;
+		uint32_t ev = waiter->ready[i].events;
+		events[n].fd = entry->fd;
+		events[n].user_data = entry->user_data;
+		events[n].events = ((ev & EPOLLIN) ? SOCKET_WAIT_READ : 0) | ((ev & EPOLLOUT) ? SOCKET_WAIT_WRITE : 0) | ((ev & (EPOLLHUP | EPOLLERR)) ? SOCKET_WAIT_HANGUP : 0);
+		n++;
+	}
+#elif defined(HAVE_SYS_EVENT_H)
+	struct timespec ts;
+	struct timespec *pts = NULL;
+	if (timeout >= 0) {
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (timeout % 1000) * 1000000;
+		pts = &ts;
+	}
+	int r = kevent(waiter->kqfd, NULL, 0, waiter->ready, max_events, pts);
+	if (r < 0)
+		return (errno == EINTR) ? 0 : -errno;
+	for (i = 0; i < r; i++) {
+		struct socket_waiter_entry *entry = (struct socket_waiter_entry*)waiter->ready[i].udata;
+		events[n].fd = entry->fd;
+		events[n].user_data = entry->user_data;
+		events[n].events = ((waiter->ready[i].filter == EVFILT_READ) ? SOCKET_WAIT_READ : SOCKET_WAIT_WRITE) | ((waiter->ready[i].flags & (EV_EOF | EV_ERROR)) ? SOCKET_WAIT_HANGUP : 0);
+		n++;
+	}
+#else
+	int r = poll(waiter->pfds, waiter->count, timeout);
+	if (r < 0)
+		return (errno == EINTR) ? 0 : -errno;
+	for (i = 0; i < waiter->count && n < max_events && r > 0; i++) {
+		short ev = waiter->pfds[i].revents;
+		if (!ev)
+			continue;
+		r--;
+		events[n].fd = waiter->entries[i]->fd;
+		events[n].user_data = waiter->entries[i]->user_data;
+		events[n].events = ((ev & POLLIN) ? SOCKET_WAIT_READ : 0) | ((ev & POLLOUT) ? SOCKET_WAIT_WRITE : 0) | ((ev & (POLLHUP | POLLERR | POLLNVAL)) ? SOCKET_WAIT_HANGUP : 0);
+		n++;
+	}
+#endif
+
+	return n;
+}
+
+#ifndef WIN32
+struct socket_ring_op {
+	int fd;
+	int is_send;
+	char *buf;
+	size_t len;
+	int buf_index;
+	void *user_data;
+};
+
+struct socket_ring {
+#ifdef HAVE_LIBURING
+	struct io_uring ring;
+	struct io_uring_cqe **cqes;
+	unsigned int cqes_size;
+#else
+	/* operations not completed yet, in submission order */
+	struct socket_ring_op *ops;
+	unsigned int ops_count;
+	unsigned int ops_size;
+	struct pollfd *pfds;
+#endif
+	unsigned int depth;
+	unsigned int queued;
+	unsigned int inflight;
+};
+
+socket_ring_t socket_ring_new(unsigned int depth)
+{
+	if (depth == 0)
+		return NULL;
+
+	socket_ring_t ring = (socket_ring_t)calloc(1, sizeof(struct socket_ring));
+	if (!ring)
+		return NULL;
+	ring->depth = depth;
+
+#ifdef HAVE_LIBURING
+	int r = io_uring_queue_init(depth, &ring->ring, 0);
+	if (r < 0) {
+		if (verbose >= 2)
+			fprintf(stderr, "%s: io_uring_queue_init failed: %s\n", __func__, strerror(-r));
+		free(ring);
+		return NULL;
+	}
+#endif
+
+	return ring;
+}
+
+void socket_ring_free(socket_ring_t ring)
+{
+	if (!ring)
+		return;
+
+#ifdef HAVE_LIBURING
+	io_uring_queue_exit(&ring->ring);
+	free(ring->cqes);
+#else
+	free(ring->ops);
+	free(ring->pfds);
+#endif
+	free(ring);
+}
+
+int socket_ring_register_buffers(socket_ring_t ring, const struct iovec *iov, unsigned int count)
+{
+	if (!ring)
+		return -EINVAL;
+
+#ifdef HAVE_LIBURING
+	io_uring_unregister_buffers(&ring->ring);
+	if (!iov || count == 0)
+		return 0;
+	return io_uring_register_buffers(&ring->ring, iov, count);
+#else
+	/* plain buffers work the same without io_uring */
+	return 0;
+#endif
+}
+
+static int socket_ring_queue(socket_ring_t ring, int fd, int is_send, char *buf, size_t len, int buf_index, void *user_data)
+{
+	if (!ring || fd < 0 || !buf)
+		return -EINVAL;
+
+	if (ring->queued + ring->inflight >= ring->depth)
+		return -EBUSY;
+
+#ifdef HAVE_LIBURING
+	struct io_uring_sqe *sqe = io_uring_get_sqe(&ring->ring);
+	if (!sqe)
+		return -EBUSY;
+	if (is_send) {
+		/* send() rather than a fixed write to get MSG_NOSIGNAL */
+		io_uring_prep_send(sqe, fd, buf, len, MSG_NOSIGNAL);
+	} else if (buf_index >= 0) {
+		io_uring_prep_read_fixed(sqe, fd, buf, (unsigned int)len, 0, buf_index);
+	} else {
+		io_uring_prep_recv(sqe, fd, buf, len, 0);
+	}
+	io_uring_sqe_set_data(sqe, user_data);
+#else
+	if (ring->ops_count >= ring->ops_size) {
+		unsigned int newsize = (ring->ops_size > 0) ? ring->ops_size * 2 : 16;
+		struct socket_ring_op *newops = (struct socket_ring_op*)realloc(ring->ops, sizeof(struct socket_ring_op) * newsize);
+		if (!newops)
+			return -ENOMEM;
+		ring->ops = newops;
+		struct pollfd *newpfds = (struct pollfd*)realloc(ring->pfds, sizeof(struct pollfd) * newsize);
+		if (!newpfds)
+			return -ENOMEM;
+		ring->pfds = newpfds;
+		ring->ops_size = newsize;
+	}
+	struct socket_ring_op *op = &ring->ops[ring->ops_count++];
+	op->fd = fd;
+	op->is_send = is_send;
+	op->buf = buf;
+	op->len = len;
+	op->buf_index = buf_index;
+	op->user_data = user_data;
+#endif
+	ring->queued++;
+
+	return 0;
+}
+
+int socket_ring_queue_recv(socket_ring_t ring, int fd, void *buf, size_t len, int buf_index, void *user_data)
+{
+	return socket_ring_queue(ring, fd, 0, (char*)buf, len, buf_index, user_data);
+}
+
+int socket_ring_queue_send(socket_ring_t ring, int fd, const void *buf, size_t len, int buf_index, void *user_data)
+{
+	return socket_ring_queue(ring, fd, 1, (char*)buf, len, buf_index, user_data);
+}
+
+int socket_ring_submit(socket_ring_t ring)
+{
+	if (!ring)
+		return -EINVAL;
+
+	if (ring->queued == 0)
+		return 0;
+
+#ifdef HAVE_LIBURING
+	/* a single system call for everything queued since the last submit */
+	int r = io_uring_submit(&ring->ring);
+	if (r < 0)
+		return r;
+#else
+	int r = (int)ring->queued;
+#endif
+	ring->inflight += ring->queued;
+	ring->queued = 0;
+
+	return r;
+}
+
+int socket_ring_wait(socket_ring_t ring, struct socket_ring_completion *completions, int max_completions, int timeout)
+{
+	int n = 0;
+
+	if (!ring || !completions || max_completions <= 0)
+		return -EINVAL;
+
+	if (ring->queued > 0) {
+		int r = socket_ring_submit(ring);
+		if (r < 0)
+			return r;
+	}
+	if (ring->inflight == 0)
+		return 0;
+
+#ifdef HAVE_LIBURING
+	struct io_uring_cqe *cqe = NULL;
+	int r;
+	if (timeout < 0) {
+		r = io_uring_wait_cqe(&ring->ring, &cqe);
+	} else {
+		struct __kernel_timespec ts;
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (long long)(timeout % 1000) * 1000000;
+		r = io_uring_wait_cqe_timeout(&ring->ring, &cqe, &ts);
+	}
+	if (r == -ETIME || r == -EINTR)
+		return 0;
+	if (r < 0)
+		return r;
+
+	if ((unsigned int)max_completions > ring->cqes_size) {
+		struct io_uring_cqe **newcqes = (struct io_uring_cqe**)realloc(ring->cqes, sizeof(struct io_uring_cqe*) * max_completions);
+		if (!newcqes)
+			return -ENOMEM;
+		ring->cqes = newcqes;
+		ring->cqes_size = max_completions;
+	}
+	/* reap everything that completed without further system calls */
+	unsigned int count = io_uring_peek_batch_cqe(&ring->ring, ring->cqes, max_completions);
+	unsigned int i;
+	for (i = 0; i < count; i++) {
+		completions[n].user_data = io_uring_cqe_get_data(ring->cqes[i]);
+		completions[n].result = ring->cqes[i]->res;
+		n++;
+	}
+	io_uring_cq_advance(&ring->ring, count);
+#else
+	/* emulate the ring by polling for the pending operations */
+	unsigned int i;
+	for (i = 0; i < ring->ops_count; i++) {
+		ring->pfds[i].fd = ring->ops[i].fd;
+		ring->pfds[i].events = (ring->ops[i].is_send) ? POLLOUT : POLLIN;
+		ring->pfds[i].revents = 0;
+	}
+	int r = poll(ring->pfds, ring->ops_count, timeout);
+	if (r < 0)
+		return (errno == EINTR) ? 0 : -errno;
+	if (r == 0)
+		return 0;
+
+	unsigned int kept = 0;
+	for (i = 0; i < ring->ops_count; i++) {
+		struct socket_ring_op *op = &ring->ops[i];
+		int result = 0;
+		int done = 0;
+		if (n < max_completions && ring->pfds[i].revents) {
+			ssize_t s;
+			if (op->is_send) {
+				int flags = MSG_DONTWAIT;
+#ifdef MSG_NOSIGNAL
+				flags |= MSG_NOSIGNAL;
+#endif
+				s = send(op->fd, op->buf, op->len, flags);
+			} else {
+				s = recv(op->fd, op->buf, op->len, MSG_DONTWAIT);
+			}
+			if (s >= 0) {
+				result = (int)s;
+				done = 1;
+			} else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+				result = -errno;
+				done = 1;
+			}
+		}
+		if (done) {
+			completions[n].user_data = op->user_data;
+			completions[n].result = result;
+			n++;
+		} else {
+			ring->ops[kept++] = *op;
+		}
+	}
+	ring->ops_count = kept;
+#endif
+	ring->inflight -= n;
+
+	return n;
+}
+#endif
+
 int socket_accept(int fd, uint16_t port)
 {
 #ifdef WIN32
@@ -779,6 +1351,97 @@ int socket_shutdown(int fd, int how)
 	return shutdown(fd, how);
 }
 
+int socket_set_nodelay(int fd, int enable)
+{
+	int val = (enable) ? 1 : 0;
+	if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (void*)&val, sizeof(int)) == -1) {
+		if (verbose >= 2)
+			fprintf(stderr, "%s: Could not set TCP_NODELAY on socket: %s\n", __func__, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+int socket_set_buffer_sizes(int fd, int sndbuf, int rcvbuf)
+{
+	int res = 0;
+	if (sndbuf > 0 && setsockopt(fd, SOL_SOCKET, SO_SNDBUF, (void*)&sndbuf, sizeof(int)) == -1) {
+		if (verbose >= 2)
+			fprintf(stderr, "%s: Could not set send buffer for socket: %s\n", __func__, strerror(errno));
+		res = -1;
+	}
+	if (rcvbuf > 0 && setsockopt(fd, SOL_SOCKET, SO_RCVBUF, (void*)&rcvbuf, sizeof(int)) == -1) {
+		if (verbose >= 2)
+			fprintf(stderr, "%s: Could not set receive buffer for socket: %s\n", __func__, strerror(errno));
+		res = -1;
+	}
+	return res;
+}
+
+int socket_set_keepalive(int fd, unsigned int idle, unsigned int interval, unsigned int count)
+{
+	int yes = (idle > 0) ? 1 : 0;
+	if (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, (void*)&yes, sizeof(int)) == -1) {
+		if (verbose >= 2)
+			fprintf(stderr, "%s: Could not set SO_KEEPALIVE on socket: %s\n", __func__, strerror(errno));
+		return -1;
+	}
+	if (!yes)
+		return 0;
+
+	/* the timing options are platform specific, use what is there */
+	int val = (int)idle;
+#if defined(TCP_KEEPIDLE)
+	setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, (void*)&val, sizeof(int));
+#elif defined(TCP_KEEPALIVE)
+	setsockopt(fd, IPPROTO_TCP, TCP_KEEPALIVE, (void*)&val, sizeof(int));
+#endif
+#ifdef TCP_KEEPINTVL
+	if (interval > 0) {
+		val = (int)interval;
+		setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, (void*)&val, sizeof(int));
+	}
+#endif
+#ifdef TCP_KEEPCNT
+	if (count > 0) {
+		val = (int)count;
+		setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, (void*)&val, sizeof(int));
+	}
+#endif
+	(void)val;
+
+	return 0;
+}
+
+int socket_get_rtt(int fd, unsigned int *rtt_us, unsigned int *rttvar_us)
+{
+#if defined(__linux__) && defined(TCP_INFO)
+	struct tcp_info info;
+	socklen_t len = sizeof(info);
+	if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, (void*)&info, &len) == -1) {
+		return -1;
+	}
+	*rtt_us = info.tcpi_rtt;
+	*rttvar_us = info.tcpi_rttvar;
+	return 0;
+#elif defined(TCP_CONNECTION_INFO)
+	struct tcp_connection_info info;
+	socklen_t len = sizeof(info);
+	if (getsockopt(fd, IPPROTO_TCP, TCP_CONNECTION_INFO, (void*)&info, &len) == -1) {
+		return -1;
+	}
+	/* reported in milliseconds here */
+	*rtt_us = info.tcpi_srtt * 1000;
+	*rttvar_us = info.tcpi_rttvar * 1000;
+	return 0;
+#else
+	(void)fd;
+	(void)rtt_us;
+	(void)rttvar_us;
+	return -1;
+#endif
+}
+
 int socket_close(int fd) {
 #ifdef WIN32
 	return closesocket(fd);
@@ -830,3 +1493,44 @@ int socket_send(int fd, void *data, size_t length)
 #endif
 	return send(fd, data, length, flags);
 }
+
+#ifndef WIN32
+int socket_sendv(int fd, struct iovec *iov, int iovcnt)
+{
+	struct msghdr msg;
+	int flags = 0;
+#ifdef MSG_NOSIGNAL
+	flags |= MSG_NOSIGNAL;
+#endif
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt;
+	return sendmsg(fd, &msg, flags);
+}
+
+int socket_receivev_timeout(int fd, struct iovec *iov, int iovcnt, unsigned int timeout)
+{
+	struct msghdr msg;
+	int res;
+	int result;
+
+	// check if data is available
+	res = socket_check_fd(fd, FDM_READ, timeout);
+	if (res <= 0) {
+		return res;
+	}
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt;
+	result = recvmsg(fd, &msg, 0);
+	if (result == 0) {
+		if (verbose >= 3)
+			fprintf(stderr, "%s: fd=%d recvmsg returned 0\n", __func__, fd);
+		return -ECONNRESET;
+	}
+	if (result < 0) {
+		return -errno;
+	}
+	return result;
+}
+#endif
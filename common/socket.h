@@ -32,6 +32,21 @@ enum fd_mode {
 };
 typedef enum fd_mode fd_mode;
 
+/* events reported by a socket waiter */
+#define SOCKET_WAIT_READ   (1 << 0)
+#define SOCKET_WAIT_WRITE  (1 << 1)
+#define SOCKET_WAIT_HANGUP (1 << 2)
+
+/* waits on many sockets at once using epoll, kqueue or poll; a waiter must
+ * only be used by one thread at a time */
+typedef struct socket_waiter *socket_waiter_t;
+
+struct socket_wait_event {
+	int fd;
+	unsigned int events;
+	void *user_data;
+};
+
 #ifdef WIN32
 #include <winsock2.h>
 #define SHUT_RD SD_READ
@@ -39,6 +54,7 @@ typedef enum fd_mode fd_mode;
 #define SHUT_RDWR SD_BOTH
 #else
 #include <sys/socket.h>
+#include <sys/uio.h>
 #endif
 
 #ifndef WIN32
@@ -49,6 +65,12 @@ int socket_create(uint16_t port);
 int socket_connect_addr(struct sockaddr *addr, uint16_t port);
 int socket_connect(const char *addr, uint16_t port);
 int socket_check_fd(int fd, fd_mode fdm, unsigned int timeout);
+
+socket_waiter_t socket_waiter_new(void);
+void socket_waiter_free(socket_waiter_t waiter);
+int socket_waiter_add(socket_waiter_t waiter, int fd, unsigned int events, void *user_data);
+int socket_waiter_remove(socket_waiter_t waiter, int fd);
+int socket_waiter_wait(socket_waiter_t waiter, struct socket_wait_event *events, int max_events, int timeout);
 int socket_accept(int fd, uint16_t port);
 
 int socket_shutdown(int fd, int how);
@@ -60,6 +82,36 @@ int socket_receive_timeout(int fd, void *data, size_t size, int flags,
 					 unsigned int timeout);
 
 int socket_send(int fd, void *data, size_t size);
+#ifndef WIN32
+/* batches socket reads and writes, using io_uring when built with liburing
+ * and poll() otherwise; a ring must only be used by one thread at a time.
+ * Partial transfers complete as they are and queued operations may complete
+ * in any order, so the caller must keep at most one operation per connection
+ * and direction in flight, and queue the remainder of a partial transfer
+ * only after its completion was seen. */
+typedef struct socket_ring *socket_ring_t;
+
+struct socket_ring_completion {
+	void *user_data;
+	int result;
+};
+
+socket_ring_t socket_ring_new(unsigned int depth);
+void socket_ring_free(socket_ring_t ring);
+int socket_ring_register_buffers(socket_ring_t ring, const struct iovec *iov, unsigned int count);
+int socket_ring_queue_recv(socket_ring_t ring, int fd, void *buf, size_t len, int buf_index, void *user_data);
+int socket_ring_queue_send(socket_ring_t ring, int fd, const void *buf, size_t len, int buf_index, void *user_data);
+int socket_ring_submit(socket_ring_t ring);
+int socket_ring_wait(socket_ring_t ring, struct socket_ring_completion *completions, int max_completions, int timeout);
+
+int socket_sendv(int fd, struct iovec *iov, int iovcnt);
+int socket_receivev_timeout(int fd, struct iovec *iov, int iovcnt, unsigned int timeout);
+#endif
+
+int socket_set_nodelay(int fd, int enable);
+int socket_set_buffer_sizes(int fd, int sndbuf, int rcvbuf);
+int socket_set_keepalive(int fd, unsigned int idle, unsigned int interval, unsigned int count);
+int socket_get_rtt(int fd, unsigned int *rtt_us, unsigned int *rttvar_us);
 
 void socket_set_verbose(int level);
 
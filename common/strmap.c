@@ -0,0 +1,149 @@
+/*
+ * strmap.c
+ * Constant time lookup of names in static tables.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#ifdef WIN32
+#include <windows.h>
+#endif
+
+#include "strmap.h"
+
+struct strmap_slot {
+	uint32_t hash;
+	int index; /* -1 for an empty slot */
+};
+
+struct strmap_table {
+	uint32_t mask;
+	struct strmap_slot slots[];
+};
+
+static uint32_t strmap_hash(const char *name)
+{
+	uint32_t hash = 2166136261u;
+	while (*name) {
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static const char *strmap_name(const strmap_t *map, int index)
+{
+	return *(const char* const*)((const char*)map->entries + (size_t)index * map->entry_size);
+}
+
+static struct strmap_table *strmap_load(strmap_t *map)
+{
+#ifdef WIN32
+	return (struct strmap_table*)InterlockedCompareExchangePointer((PVOID volatile*)&map->table, NULL, NULL);
+#else
+	return (struct strmap_table*)__atomic_load_n(&map->table, __ATOMIC_ACQUIRE);
+#endif
+}
+
+/* builds the table of a map; the first thread to finish publishes it */
+static struct strmap_table *strmap_build(strmap_t *map)
+{
+	int count = 0;
+	uint32_t size = 8;
+	int i;
+
+	while (strmap_name(map, count)) {
+		count++;
+	}
+	/* at most half full keeps the probe sequences short */
+	while (size < (uint32_t)count * 2) {
+		size <<= 1;
+	}
+
+	struct strmap_table *table = (struct strmap_table*)malloc(sizeof(struct strmap_table) + size * sizeof(struct strmap_slot));
+	if (!table) {
+		return NULL;
+	}
+	table->mask = size - 1;
+	for (i = 0; i < (int)size; i++) {
+		table->slots[i].index = -1;
+	}
+	for (i = 0; i < count; i++) {
+		uint32_t hash = strmap_hash(strmap_name(map, i));
+		uint32_t pos = hash & table->mask;
+		while (table->slots[pos].index >= 0) {
+			pos = (pos + 1) & table->mask;
+		}
+		table->slots[pos].hash = hash;
+		table->slots[pos].index = i;
+	}
+
+	/* the table lives as long as the static array it belongs to */
+#ifdef WIN32
+	struct strmap_table *prev = (struct strmap_table*)InterlockedCompareExchangePointer((PVOID volatile*)&map->table, table, NULL);
+	if (prev) {
+		free(table);
+		table = prev;
+	}
+#else
+	void *prev = NULL;
+	if (!__atomic_compare_exchange_n(&map->table, &prev, table, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		free(table);
+		table = (struct strmap_table*)prev;
+	}
+#endif
+
+	return table;
+}
+
+int strmap_find(strmap_t *map, const char *name)
+{
+	int i;
+
+	if (!map || !name) {
+		return -1;
+	}
+
+	struct strmap_table *table = strmap_load(map);
+	if (!table) {
+		table = strmap_build(map);
+	}
+	if (!table) {
+		/* out of memory, search the array instead */
+		for (i = 0; strmap_name(map, i); i++) {
+			if (!strcmp(strmap_name(map, i), name)) {
+				return i;
+			}
+		}
+		return -1;
+	}
+
+	uint32_t hash = strmap_hash(name);
+	uint32_t pos = hash & table->mask;
+	while (table->slots[pos].index >= 0) {
+		if (table->slots[pos].hash == hash && !strcmp(strmap_name(map, table->slots[pos].index), name)) {
+			return table->slots[pos].index;
+		}
+		pos = (pos + 1) & table->mask;
+	}
+
+	return -1;
+}
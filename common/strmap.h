@@ -0,0 +1,41 @@
+/*
+ * strmap.h
+ * Constant time lookup of names in static tables.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __STRMAP_H
+#define __STRMAP_H
+
+#include <stddef.h>
+
+/*
+ * Looks up names in a static array of structs whose first member is the
+ * const char* name, terminated by an entry with a NULL name. The hash table
+ * is built on first use and shared by all threads afterwards.
+ */
+typedef struct {
+	const void *entries;
+	size_t entry_size;
+	void *volatile table;
+} strmap_t;
+
+#define STRMAP_INIT(entries) { (entries), sizeof((entries)[0]), NULL }
+
+/* returns the index of the entry with the given name, or -1 if there is none */
+int strmap_find(strmap_t *map, const char *name);
+
+#endif
@@ -22,6 +22,10 @@
 #ifdef HAVE_CONFIG_H
 #include <config.h>
 #endif
+#include <stdlib.h>
+#ifndef WIN32
+#include <unistd.h>
+#endif
 #include "thread.h"
 
 int thread_new(THREAD_T *thread, thread_func_t thread_func, void* data)
@@ -138,3 +142,415 @@ void thread_once(thread_once_t *once_control, void (*init_routine)(void))
 	pthread_once(once_control, init_routine);
 #endif
 }
+
+void cond_init(cond_t* cond)
+{
+#ifdef WIN32
+	cond->sem = CreateEvent(NULL, FALSE, FALSE, NULL);
+#else
+	pthread_cond_init(cond, NULL);
+#endif
+}
+
+void cond_destroy(cond_t* cond)
+{
+#ifdef WIN32
+	CloseHandle(cond->sem);
+#else
+	pthread_cond_destroy(cond);
+#endif
+}
+
+int cond_signal(cond_t* cond)
+{
+#ifdef WIN32
+	return SetEvent(cond->sem) ? 0 : -1;
+#else
+	return pthread_cond_signal(cond);
+#endif
+}
+
+int cond_wait(cond_t* cond, mutex_t* mutex)
+{
+#ifdef WIN32
+	/* the event stays signaled until a waiter consumed it, so no wakeup is lost */
+	mutex_unlock(mutex);
+	DWORD res = WaitForSingleObject(cond->sem, INFINITE);
+	mutex_lock(mutex);
+	return (res == WAIT_OBJECT_0) ? 0 : -1;
+#else
+	return pthread_cond_wait(cond, mutex);
+#endif
+}
+
+/* thread pool */
+
+struct thread_task {
+	thread_task_func_t func;
+	void *data;
+	void *result;
+	int done;
+	int detached;
+	mutex_t mutex;
+	cond_t cond;
+};
+
+struct thread_pool_worker {
+	thread_pool_t pool;
+	THREAD_T thread;
+	mutex_t mutex;
+	/* circular buffer; the owner works at the tail, thieves take from the head */
+	thread_task_t *tasks;
+	unsigned int head;
+	unsigned int count;
+	unsigned int size;
+};
+
+struct thread_pool {
+	mutex_t mutex;
+	cond_t cond;
+	unsigned int pending;
+	unsigned int idle;
+	unsigned int next;
+	int quit;
+	unsigned int num_workers;
+	struct thread_pool_worker *workers;
+};
+
+#ifdef WIN32
+static DWORD thread_pool_key;
+#else
+static pthread_key_t thread_pool_key;
+#endif
+static thread_once_t thread_pool_key_once = THREAD_ONCE_INIT;
+
+static void thread_pool_key_init(void)
+{
+#ifdef WIN32
+	thread_pool_key = TlsAlloc();
+#else
+	pthread_key_create(&thread_pool_key, NULL);
+#endif
+}
+
+static struct thread_pool_worker *thread_pool_current_worker(thread_pool_t pool)
+{
+#ifdef WIN32
+	struct thread_pool_worker *worker = (struct thread_pool_worker*)TlsGetValue(thread_pool_key);
+#else
+	struct thread_pool_worker *worker = (struct thread_pool_worker*)pthread_getspecific(thread_pool_key);
+#endif
+	return (worker && worker->pool == pool) ? worker : NULL;
+}
+
+static int thread_pool_push(struct thread_pool_worker *worker, thread_task_t task)
+{
+	mutex_lock(&worker->mutex);
+	if (worker->count >= worker->size) {
+		unsigned int newsize = (worker->size > 0) ? worker->size * 2 : 32;
+		thread_task_t *newtasks = (thread_task_t*)malloc(sizeof(thread_task_t) * newsize);
+		if (!newtasks) {
+			mutex_unlock(&worker->mutex);
+			return -1;
+		}
+		unsigned int i;
+		for (i = 0; i < worker->count; i++) {
+			newtasks[i] = worker->tasks[(worker->head + i) % worker->size];
+		}
+		free(worker->tasks);
+		worker->tasks = newtasks;
+		worker->head = 0;
+		worker->size = newsize;
+	}
+	worker->tasks[(worker->head + worker->count) % worker->size] = task;
+	worker->count++;
+	mutex_unlock(&worker->mutex);
+
+	return 0;
+}
+
+static thread_task_t thread_pool_pop(struct thread_pool_worker *worker, int steal)
+{
+	thread_task_t task = NULL;
+
+	mutex_lock(&worker->mutex);
+	if (worker->count > 0) {
+		if (steal) {
+			task = worker->tasks[worker->head];
+			worker->head = (worker->head + 1) % worker->size;
+		} else {
+			task = worker->tasks[(worker->head + worker->count - 1) % worker->size];
+		}
+		worker->count--;
+	}
+	mutex_unlock(&worker->mutex);
+
+	return task;
+}
+
+/**
+ * Takes a task from the own queue, most recent first, or steals the oldest
+ * task of another worker.
+ */
+static thread_task_t thread_pool_take(thread_pool_t pool, struct thread_pool_worker *self)
+{
+	thread_task_t task = NULL;
+	unsigned int start = (self) ? (unsigned int)(self - pool->workers) : 0;
+	unsigned int i;
+
+	if (self) {
+		task = thread_pool_pop(self, 0);
+	}
+	for (i = 1; !task && i <= pool->num_workers; i++) {
+		struct thread_pool_worker *victim = &pool->workers[(start + i) % pool->num_workers];
+		if (victim != self) {
+			task = thread_pool_pop(victim, 1);
+		}
+	}
+	if (task) {
+		mutex_lock(&pool->mutex);
+		pool->pending--;
+		/* pass the wakeup on if there is more to do */
+		if (pool->pending > 0 && pool->idle > 0) {
+			cond_signal(&pool->cond);
+		}
+		mutex_unlock(&pool->mutex);
+	}
+
+	return task;
+}
+
+static void thread_pool_run_task(thread_task_t task)
+{
+	void *result = task->func(task->data);
+	if (task->detached) {
+		free(task);
+		return;
+	}
+	mutex_lock(&task->mutex);
+	task->result = result;
+	task->done = 1;
+	cond_signal(&task->cond);
+	mutex_unlock(&task->mutex);
+}
+
+static void *thread_pool_worker_func(void *arg)
+{
+	struct thread_pool_worker *worker = (struct thread_pool_worker*)arg;
+	thread_pool_t pool = worker->pool;
+
+#ifdef WIN32
+	TlsSetValue(thread_pool_key, worker);
+#else
+	pthread_setspecific(thread_pool_key, worker);
+#endif
+
+	while (1) {
+		thread_task_t task = thread_pool_take(pool, worker);
+		if (task) {
+			thread_pool_run_task(task);
+			continue;
+		}
+
+		mutex_lock(&pool->mutex);
+		while (pool->pending == 0 && !pool->quit) {
+			pool->idle++;
+			cond_wait(&pool->cond, &pool->mutex);
+			pool->idle--;
+		}
+		if (pool->quit && pool->pending == 0) {
+			/* wake up the next worker to let it exit as well */
+			cond_signal(&pool->cond);
+			mutex_unlock(&pool->mutex);
+			break;
+		}
+		mutex_unlock(&pool->mutex);
+	}
+
+	return NULL;
+}
+
+thread_pool_t thread_pool_new(unsigned int num_workers)
+{
+	unsigned int i;
+
+	if (num_workers == 0)
+		return NULL;
+
+	thread_once(&thread_pool_key_once, thread_pool_key_init);
+
+	thread_pool_t pool = (thread_pool_t)calloc(1, sizeof(struct thread_pool));
+	if (!pool)
+		return NULL;
+	pool->workers = (struct thread_pool_worker*)calloc(num_workers, sizeof(struct thread_pool_worker));
+	if (!pool->workers) {
+		free(pool);
+		return NULL;
+	}
+	mutex_init(&pool->mutex);
+	cond_init(&pool->cond);
+	pool->num_workers = num_workers;
+
+	for (i = 0; i < num_workers; i++) {
+		pool->workers[i].pool = pool;
+		mutex_init(&pool->workers[i].mutex);
+	}
+	for (i = 0; i < num_workers; i++) {
+		if (thread_new(&pool->workers[i].thread, thread_pool_worker_func, &pool->workers[i]) != 0) {
+			pool->workers[i].thread = THREAD_T_NULL;
+		}
+	}
+
+	return pool;
+}
+
+void thread_pool_free(thread_pool_t pool)
+{
+	unsigned int i;
+
+	if (!pool)
+		return;
+
+	mutex_lock(&pool->mutex);
+	pool->quit = 1;
+	cond_signal(&pool->cond);
+	mutex_unlock(&pool->mutex);
+
+	for (i = 0; i < pool->num_workers; i++) {
+		if (pool->workers[i].thread != THREAD_T_NULL) {
+			thread_join(pool->workers[i].thread);
+			thread_free(pool->workers[i].thread);
+		}
+	}
+	for (i = 0; i < pool->num_workers; i++) {
+		free(pool->workers[i].tasks);
+		mutex_destroy(&pool->workers[i].mutex);
+	}
+	free(pool->workers);
+	cond_destroy(&pool->cond);
+	mutex_destroy(&pool->mutex);
+	free(pool);
+}
+
+static thread_pool_t thread_pool_shared_pool = NULL;
+static thread_once_t thread_pool_shared_once = THREAD_ONCE_INIT;
+
+static void thread_pool_shared_init(void)
+{
+	long cpus;
+#ifdef WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	cpus = (long)info.dwNumberOfProcessors;
+#else
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	if (cpus < THREAD_POOL_SHARED_MIN_WORKERS)
+		cpus = THREAD_POOL_SHARED_MIN_WORKERS;
+	if (cpus > THREAD_POOL_SHARED_MAX_WORKERS)
+		cpus = THREAD_POOL_SHARED_MAX_WORKERS;
+	thread_pool_shared_pool = thread_pool_new((unsigned int)cpus);
+}
+
+thread_pool_t thread_pool_shared(void)
+{
+	thread_once(&thread_pool_shared_once, thread_pool_shared_init);
+	return thread_pool_shared_pool;
+}
+
+static thread_task_t thread_pool_queue(thread_pool_t pool, thread_task_func_t func, void *data, int detached)
+{
+	if (!pool || !func)
+		return NULL;
+
+	thread_task_t task = (thread_task_t)calloc(1, sizeof(struct thread_task));
+	if (!task)
+		return NULL;
+	task->func = func;
+	task->data = data;
+	task->detached = detached;
+	if (!detached) {
+		mutex_init(&task->mutex);
+		cond_init(&task->cond);
+	}
+
+	/* tasks queued by a worker stay local until another worker steals them */
+	struct thread_pool_worker *worker = thread_pool_current_worker(pool);
+	mutex_lock(&pool->mutex);
+	if (!worker) {
+		worker = &pool->workers[pool->next++ % pool->num_workers];
+	}
+	/* counted before it is visible, so taking it never underflows */
+	pool->pending++;
+	mutex_unlock(&pool->mutex);
+
+	int res = thread_pool_push(worker, task);
+
+	mutex_lock(&pool->mutex);
+	if (res < 0) {
+		pool->pending--;
+	} else if (pool->idle > 0) {
+		cond_signal(&pool->cond);
+	}
+	mutex_unlock(&pool->mutex);
+
+	if (res < 0) {
+		if (!detached) {
+			cond_destroy(&task->cond);
+			mutex_destroy(&task->mutex);
+		}
+		free(task);
+		return NULL;
+	}
+
+	return task;
+}
+
+thread_task_t thread_pool_submit(thread_pool_t pool, thread_task_func_t func, void *data)
+{
+	return thread_pool_queue(pool, func, data, 0);
+}
+
+int thread_pool_run(thread_pool_t pool, thread_task_func_t func, void *data)
+{
+	return (thread_pool_queue(pool, func, data, 1)) ? 0 : -1;
+}
+
+int thread_task_is_done(thread_task_t task)
+{
+	mutex_lock(&task->mutex);
+	int done = task->done;
+	mutex_unlock(&task->mutex);
+	return done;
+}
+
+void *thread_task_wait(thread_pool_t pool, thread_task_t task)
+{
+	if (!task)
+		return NULL;
+
+	/* a worker waiting for a task runs other tasks meanwhile, so waiting
+	 * inside the pool can't starve it */
+	struct thread_pool_worker *worker = (pool) ? thread_pool_current_worker(pool) : NULL;
+	if (worker) {
+		while (!thread_task_is_done(task)) {
+			thread_task_t other = thread_pool_take(pool, worker);
+			if (!other)
+				break;
+			thread_pool_run_task(other);
+		}
+	}
+
+	mutex_lock(&task->mutex);
+	while (!task->done) {
+		cond_wait(&task->cond, &task->mutex);
+	}
+	void *result = task->result;
+	mutex_unlock(&task->mutex);
+
+	cond_destroy(&task->cond);
+	mutex_destroy(&task->mutex);
+	free(task);
+
+	return result;
+}
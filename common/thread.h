@@ -33,6 +33,9 @@ typedef volatile struct {
 	int state;
 } thread_once_t;
 #define THREAD_ONCE_INIT {0, 0}
+typedef struct {
+	HANDLE sem;
+} cond_t;
 #define THREAD_ID GetCurrentThreadId()
 #define THREAD_T_NULL (THREAD_T)NULL
 #else
@@ -41,6 +44,7 @@ typedef volatile struct {
 typedef pthread_t THREAD_T;
 typedef pthread_mutex_t mutex_t;
 typedef pthread_once_t thread_once_t;
+typedef pthread_cond_t cond_t;
 #define THREAD_ONCE_INIT PTHREAD_ONCE_INIT
 #define THREAD_ID pthread_self()
 #define THREAD_T_NULL (THREAD_T)NULL
@@ -73,4 +77,25 @@ void mutex_unlock(mutex_t* mutex);
 
 void thread_once(thread_once_t *once_control, void (*init_routine)(void));
 
+void cond_init(cond_t* cond);
+void cond_destroy(cond_t* cond);
+int cond_signal(cond_t* cond);
+int cond_wait(cond_t* cond, mutex_t* mutex);
+
+/* limits for the size of the shared pool, which follows the number of CPUs */
+#define THREAD_POOL_SHARED_MIN_WORKERS 2
+#define THREAD_POOL_SHARED_MAX_WORKERS 16
+
+typedef struct thread_pool *thread_pool_t;
+typedef struct thread_task *thread_task_t;
+typedef void* (*thread_task_func_t)(void* data);
+
+thread_pool_t thread_pool_new(unsigned int num_workers);
+void thread_pool_free(thread_pool_t pool);
+thread_pool_t thread_pool_shared(void);
+thread_task_t thread_pool_submit(thread_pool_t pool, thread_task_func_t func, void* data);
+int thread_pool_run(thread_pool_t pool, thread_task_func_t func, void* data);
+int thread_task_is_done(thread_task_t task);
+void* thread_task_wait(thread_pool_t pool, thread_task_t task);
+
 #endif
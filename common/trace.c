@@ -0,0 +1,333 @@
+/*
+ * trace.c
+ * Binary trace ring buffers
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "trace.h"
+#include "thread.h"
+
+/*
+ * Every thread records into its own ring buffer. The head index is only
+ * written by the thread owning the ring and the tail index only by the
+ * side draining it, which is serialized by the mutex, so recording an
+ * event needs no lock. Full rings drop new events and count them.
+ */
+struct trace_ring {
+	idevice_trace_event_t *events;
+	uint32_t mask;
+	uint32_t thread;
+	volatile uint32_t head;
+	volatile uint32_t tail;
+	volatile uint32_t dropped;
+	volatile uint32_t exited;
+	struct trace_ring *next;
+};
+
+volatile int trace_enabled = 0;
+
+static struct {
+	mutex_t mutex;
+	struct trace_ring *rings;
+	uint32_t num_threads;
+	unsigned int events_per_thread;
+	idevice_trace_cb_t callback;
+	void *user_data;
+	unsigned int interval;
+	THREAD_T thread;
+	volatile uint32_t quit;
+} trace;
+static thread_once_t trace_once = THREAD_ONCE_INIT;
+
+#ifdef WIN32
+static DWORD trace_key;
+#else
+static pthread_key_t trace_key;
+#endif
+
+static uint32_t trace_load(volatile uint32_t *value)
+{
+#ifdef WIN32
+	return (uint32_t)InterlockedExchangeAdd((volatile LONG*)value, 0);
+#else
+	return __atomic_load_n(value, __ATOMIC_ACQUIRE);
+#endif
+}
+
+static void trace_store(volatile uint32_t *value, uint32_t newval)
+{
+#ifdef WIN32
+	InterlockedExchange((volatile LONG*)value, (LONG)newval);
+#else
+	__atomic_store_n(value, newval, __ATOMIC_RELEASE);
+#endif
+}
+
+static void trace_add(volatile uint32_t *value, int32_t amount)
+{
+#ifdef WIN32
+	InterlockedExchangeAdd((volatile LONG*)value, (LONG)amount);
+#else
+	__atomic_fetch_add(value, amount, __ATOMIC_ACQ_REL);
+#endif
+}
+
+static uint64_t trace_time_us(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+#ifndef WIN32
+static void trace_thread_exit(void *data)
+{
+	struct trace_ring *ring = (struct trace_ring*)data;
+	/* the ring is freed by the next drain once it is empty */
+	trace_store(&ring->exited, 1);
+}
+#endif
+
+static void trace_init(void)
+{
+	mutex_init(&trace.mutex);
+	trace.rings = NULL;
+	trace.num_threads = 0;
+	trace.events_per_thread = TRACE_DEFAULT_EVENTS_PER_THREAD;
+	trace.thread = THREAD_T_NULL;
+#ifdef WIN32
+	trace_key = TlsAlloc();
+#else
+	pthread_key_create(&trace_key, trace_thread_exit);
+#endif
+}
+
+static struct trace_ring *trace_current_ring(void)
+{
+#ifdef WIN32
+	struct trace_ring *ring = (struct trace_ring*)TlsGetValue(trace_key);
+#else
+	struct trace_ring *ring = (struct trace_ring*)pthread_getspecific(trace_key);
+#endif
+	if (ring)
+		return ring;
+
+	ring = (struct trace_ring*)calloc(1, sizeof(struct trace_ring));
+	if (!ring)
+		return NULL;
+
+	mutex_lock(&trace.mutex);
+	unsigned int size = trace.events_per_thread;
+	ring->events = (idevice_trace_event_t*)malloc(sizeof(idevice_trace_event_t) * size);
+	if (!ring->events) {
+		mutex_unlock(&trace.mutex);
+		free(ring);
+		return NULL;
+	}
+	ring->mask = size - 1;
+	ring->thread = trace.num_threads++;
+	ring->next = trace.rings;
+	trace.rings = ring;
+	mutex_unlock(&trace.mutex);
+
+#ifdef WIN32
+	TlsSetValue(trace_key, ring);
+#else
+	pthread_setspecific(trace_key, ring);
+#endif
+	return ring;
+}
+
+void trace_record(int type, uint64_t op, uint64_t id, uint64_t size, const char *source, const char *message)
+{
+	if (!trace_enabled)
+		return;
+
+	struct trace_ring *ring = trace_current_ring();
+	if (!ring)
+		return;
+
+	uint32_t head = ring->head;
+	if (head - trace_load(&ring->tail) > ring->mask) {
+		trace_add(&ring->dropped, 1);
+		return;
+	}
+
+	idevice_trace_event_t *event = &ring->events[head & ring->mask];
+	event->timestamp = trace_time_us();
+	event->thread = ring->thread;
+	event->type = (uint32_t)type;
+	event->id = id;
+	event->op = op;
+	event->size = size;
+	event->source = source;
+	event->message = message;
+
+	trace_store(&ring->head, head + 1);
+}
+
+/**
+ * Passes the buffered events of all threads to the callback, or just
+ * discards them if callback is NULL. Rings of exited threads are freed.
+ */
+static void trace_drain(idevice_trace_cb_t callback, void *user_data)
+{
+	idevice_trace_event_t batch[TRACE_DRAIN_BATCH];
+
+	mutex_lock(&trace.mutex);
+
+	struct trace_ring **pp = &trace.rings;
+	while (*pp) {
+		struct trace_ring *ring = *pp;
+		/* read before the events, so none recorded before exiting is missed */
+		uint32_t exited = trace_load(&ring->exited);
+		uint32_t tail = ring->tail;
+		uint32_t head = trace_load(&ring->head);
+
+		while (tail != head) {
+			uint32_t count = head - tail;
+			uint32_t i;
+			if (count > TRACE_DRAIN_BATCH)
+				count = TRACE_DRAIN_BATCH;
+			for (i = 0; i < count; i++) {
+				batch[i] = ring->events[(tail + i) & ring->mask];
+			}
+			tail += count;
+			trace_store(&ring->tail, tail);
+			if (callback)
+				callback(batch, count, user_data);
+		}
+
+		uint32_t dropped = trace_load(&ring->dropped);
+		if (dropped > 0) {
+			trace_add(&ring->dropped, -(int32_t)dropped);
+			memset(&batch[0], '\0', sizeof(idevice_trace_event_t));
+			batch[0].timestamp = trace_time_us();
+			batch[0].thread = ring->thread;
+			batch[0].type = IDEVICE_TRACE_DROPPED;
+			batch[0].size = dropped;
+			batch[0].source = "trace_drain";
+			if (callback)
+				callback(batch, 1, user_data);
+		}
+
+		if (exited) {
+			*pp = ring->next;
+			free(ring->events);
+			free(ring);
+			continue;
+		}
+		pp = &ring->next;
+	}
+
+	mutex_unlock(&trace.mutex);
+}
+
+static void *trace_drain_thread(void *arg)
+{
+	while (!trace_load(&trace.quit)) {
+		unsigned int waited = 0;
+		while (!trace_load(&trace.quit) && waited < trace.interval) {
+			unsigned int ms = trace.interval - waited;
+			if (ms > 50)
+				ms = 50;
+#ifdef WIN32
+			Sleep(ms);
+#else
+			usleep(ms * 1000);
+#endif
+			waited += ms;
+		}
+		trace_drain(trace.callback, trace.user_data);
+	}
+	return NULL;
+}
+
+int trace_start(unsigned int events_per_thread, idevice_trace_cb_t callback, unsigned int interval, void *user_data)
+{
+	thread_once(&trace_once, trace_init);
+
+	if (events_per_thread == 0)
+		events_per_thread = TRACE_DEFAULT_EVENTS_PER_THREAD;
+	if (events_per_thread > TRACE_MAX_EVENTS_PER_THREAD)
+		events_per_thread = TRACE_MAX_EVENTS_PER_THREAD;
+	unsigned int size = 1;
+	while (size < events_per_thread)
+		size <<= 1;
+
+	mutex_lock(&trace.mutex);
+	if (trace_enabled || trace.thread != THREAD_T_NULL) {
+		mutex_unlock(&trace.mutex);
+		return -1;
+	}
+	trace.events_per_thread = size;
+	trace.callback = callback;
+	trace.user_data = user_data;
+	trace.interval = (interval > 0) ? interval : 1;
+	trace_store(&trace.quit, 0);
+	if (callback && thread_new(&trace.thread, trace_drain_thread, NULL) != 0) {
+		trace.thread = THREAD_T_NULL;
+		mutex_unlock(&trace.mutex);
+		return -2;
+	}
+	trace_enabled = 1;
+	mutex_unlock(&trace.mutex);
+
+	return 0;
+}
+
+int trace_stop(void)
+{
+	thread_once(&trace_once, trace_init);
+
+	mutex_lock(&trace.mutex);
+	if (!trace_enabled) {
+		mutex_unlock(&trace.mutex);
+		return -1;
+	}
+	trace_enabled = 0;
+	trace_store(&trace.quit, 1);
+	THREAD_T thread = trace.thread;
+	idevice_trace_cb_t callback = trace.callback;
+	void *user_data = trace.user_data;
+	mutex_unlock(&trace.mutex);
+
+	if (thread != THREAD_T_NULL) {
+		thread_join(thread);
+		thread_free(thread);
+		/* hand out what was recorded since the last round */
+		trace_drain(callback, user_data);
+		mutex_lock(&trace.mutex);
+		trace.thread = THREAD_T_NULL;
+		mutex_unlock(&trace.mutex);
+	}
+
+	return 0;
+}
+
+void trace_dump(idevice_trace_cb_t callback, void *user_data)
+{
+	thread_once(&trace_once, trace_init);
+	trace_drain(callback, user_data);
+}
@@ -0,0 +1,51 @@
+/*
+ * trace.h
+ * Binary trace ring buffers
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __TRACE_H
+#define __TRACE_H
+
+#include <stdint.h>
+#include "libimobiledevice/libimobiledevice.h"
+
+#define TRACE_DEFAULT_EVENTS_PER_THREAD 4096
+#define TRACE_MAX_EVENTS_PER_THREAD (1 << 20)
+/* events passed to the callback at once */
+#define TRACE_DRAIN_BATCH 256
+
+extern volatile int trace_enabled;
+
+#if !defined(STRIP_DEBUG_CODE)
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 199901L
+#define TRACE_FUNC __func__
+#else
+#define TRACE_FUNC __FUNCTION__
+#endif
+#define trace_event(type, op, id, size) \
+	do { if (trace_enabled) trace_record(type, (uint64_t)(op), (uint64_t)(id), (uint64_t)(size), TRACE_FUNC, NULL); } while (0)
+#else
+#define trace_event(type, op, id, size)
+#endif
+
+void trace_record(int type, uint64_t op, uint64_t id, uint64_t size, const char *source, const char *message);
+
+int trace_start(unsigned int events_per_thread, idevice_trace_cb_t callback, unsigned int interval, void *user_data);
+int trace_stop(void);
+void trace_dump(idevice_trace_cb_t callback, void *user_data);
+
+#endif
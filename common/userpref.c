@@ -28,11 +28,14 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #ifdef HAVE_SYS_TYPES_H
 #include <sys/types.h>
 #endif
 #ifndef WIN32
 #include <pwd.h>
+#include <fcntl.h>
+#include <sys/file.h>
 #endif
 #include <unistd.h>
 #include <usbmuxd.h>
@@ -67,6 +70,7 @@
 #include "userpref.h"
 #include "debug.h"
 #include "utils.h"
+#include "thread.h"
 
 #ifndef HAVE_OPENSSL
 const ASN1_ARRAY_TYPE pkcs1_asn1_tab[] = {
@@ -99,6 +103,181 @@ const ASN1_ARRAY_TYPE pkcs1_asn1_tab[] = {
 
 static char *__config_dir = NULL;
 
+/* seconds a cached pair record is trusted if the record file can't be checked */
+#define USERPREF_PAIR_RECORD_CACHE_TIMEOUT 10
+
+#if defined(HAVE_OPENSSL) && (OPENSSL_VERSION_NUMBER < 0x10100000L || \
+	(defined(LIBRESSL_VERSION_NUMBER) && (LIBRESSL_VERSION_NUMBER < 0x20700000L)))
+#define X509_up_ref(x) CRYPTO_add(&(x)->references, 1, CRYPTO_LOCK_X509)
+#endif
+
+struct pair_record_cache_entry {
+	char *udid;
+	plist_t pair_record;
+	time_t loaded;
+	int have_stat;
+	time_t mtime;
+	off_t size;
+	/* set for records that don't come from usbmuxd, see userpref_pin_pair_record() */
+	int pinned;
+#ifdef HAVE_OPENSSL
+	int decoded;
+	X509 *root_cert;
+	RSA *root_privkey;
+#endif
+	struct pair_record_cache_entry *next;
+};
+
+static struct pair_record_cache_entry *pair_record_cache = NULL;
+static mutex_t pair_record_cache_mutex;
+static thread_once_t pair_record_cache_once = THREAD_ONCE_INIT;
+
+static void pair_record_cache_init(void)
+{
+	mutex_init(&pair_record_cache_mutex);
+}
+
+static int pair_record_file_stat(const char *udid, struct stat *st)
+{
+	char *path = string_concat(userpref_get_config_dir(), DIR_SEP_S, udid, USERPREF_CONFIG_EXTENSION, NULL);
+	int res = stat(path, st);
+	free(path);
+	return res;
+}
+
+static void pair_record_cache_entry_free(struct pair_record_cache_entry *entry)
+{
+	free(entry->udid);
+	plist_free(entry->pair_record);
+#ifdef HAVE_OPENSSL
+	if (entry->root_cert)
+		X509_free(entry->root_cert);
+	if (entry->root_privkey)
+		RSA_free(entry->root_privkey);
+#endif
+	free(entry);
+}
+
+/**
+ * Looks up a cached pair record that is still valid. Stale entries are
+ * removed. The cache needs to be locked by the caller.
+ */
+static struct pair_record_cache_entry *pair_record_cache_find(const char *udid)
+{
+	struct pair_record_cache_entry **pp = &pair_record_cache;
+	while (*pp && strcmp((*pp)->udid, udid) != 0) {
+		pp = &(*pp)->next;
+	}
+	struct pair_record_cache_entry *entry = *pp;
+	if (!entry || entry->pinned) {
+		return entry;
+	}
+
+	int valid = 0;
+	struct stat st;
+	if (pair_record_file_stat(udid, &st) == 0) {
+		valid = (entry->have_stat && entry->mtime == st.st_mtime && entry->size == st.st_size);
+	} else {
+		valid = (!entry->have_stat && (time(NULL) - entry->loaded) < USERPREF_PAIR_RECORD_CACHE_TIMEOUT);
+	}
+	if (!valid) {
+		debug_info("cached pair record for %s is outdated", udid);
+		*pp = entry->next;
+		pair_record_cache_entry_free(entry);
+		return NULL;
+	}
+
+	return entry;
+}
+
+/**
+ * Stores a copy of the given pair record in the cache.
+ * The cache needs to be locked by the caller.
+ */
+static struct pair_record_cache_entry *pair_record_cache_add(const char *udid, plist_t pair_record, const struct stat *st)
+{
+	struct pair_record_cache_entry *entry = (struct pair_record_cache_entry*)malloc(sizeof(struct pair_record_cache_entry));
+	if (!entry) {
+		return NULL;
+	}
+	entry->udid = strdup(udid);
+	entry->pair_record = plist_copy(pair_record);
+	entry->loaded = time(NULL);
+	entry->have_stat = (st != NULL);
+	entry->mtime = (st) ? st->st_mtime : 0;
+	entry->size = (st) ? st->st_size : 0;
+	entry->pinned = 0;
+#ifdef HAVE_OPENSSL
+	entry->decoded = 0;
+	entry->root_cert = NULL;
+	entry->root_privkey = NULL;
+#endif
+	entry->next = pair_record_cache;
+	pair_record_cache = entry;
+
+	return entry;
+}
+
+/**
+ * Removes the cached pair record for a device, or all cached pair records.
+ *
+ * @param udid The udid of the device or NULL to flush the whole cache.
+ */
+void userpref_invalidate_pair_record_cache(const char *udid)
+{
+	thread_once(&pair_record_cache_once, pair_record_cache_init);
+
+	mutex_lock(&pair_record_cache_mutex);
+	struct pair_record_cache_entry **pp = &pair_record_cache;
+	while (*pp) {
+		struct pair_record_cache_entry *entry = *pp;
+		if (!udid || strcmp(entry->udid, udid) == 0) {
+			*pp = entry->next;
+			pair_record_cache_entry_free(entry);
+		} else {
+			pp = &entry->next;
+		}
+	}
+	mutex_unlock(&pair_record_cache_mutex);
+}
+
+/**
+ * Makes the pair record cache return the given pair record for a device
+ * until the cache is invalidated, without asking usbmuxd. This is used for
+ * devices that usbmuxd doesn't know about, like in-process emulators.
+ *
+ * @param udid The udid of the device
+ * @param pair_record The pair record to use, a copy is stored.
+ */
+void userpref_pin_pair_record(const char *udid, plist_t pair_record)
+{
+	if (!udid || !pair_record)
+		return;
+
+	thread_once(&pair_record_cache_once, pair_record_cache_init);
+
+	mutex_lock(&pair_record_cache_mutex);
+	struct pair_record_cache_entry **pp = &pair_record_cache;
+	while (*pp && strcmp((*pp)->udid, udid) != 0) {
+		pp = &(*pp)->next;
+	}
+	if (*pp && (*pp)->pinned) {
+		/* keep the decoded credentials */
+		mutex_unlock(&pair_record_cache_mutex);
+		return;
+	}
+	if (*pp) {
+		struct pair_record_cache_entry *stale = *pp;
+		*pp = stale->next;
+		pair_record_cache_entry_free(stale);
+	}
+	struct pair_record_cache_entry *entry = pair_record_cache_add(udid, pair_record, NULL);
+	if (entry) {
+		entry->pinned = 1;
+	}
+	mutex_unlock(&pair_record_cache_mutex);
+}
+
 #ifdef WIN32
 static char *userpref_utf16_to_utf8(wchar_t *unistr, long len, long *items_read, long *items_written)
 {
@@ -197,6 +376,147 @@ int userpref_read_system_buid(char **system_buid)
 	return res;
 }
 
+#define PAIRED_UDID_INDEX_HASH_SIZE 1024
+
+struct paired_udid_entry {
+	char *udid;
+	struct paired_udid_entry *next;
+	struct paired_udid_entry *hash_next;
+};
+
+/* index of the pair record files in the config dir, rescanned when the
+ * modification time of the directory changes */
+static struct {
+	int valid;
+	time_t mtime;
+	time_t scanned;
+	unsigned int count;
+	struct paired_udid_entry *first;
+	struct paired_udid_entry *last;
+	struct paired_udid_entry *hash[PAIRED_UDID_INDEX_HASH_SIZE];
+} paired_udid_index;
+static mutex_t paired_udid_index_mutex;
+static thread_once_t paired_udid_index_once = THREAD_ONCE_INIT;
+
+static void paired_udid_index_init(void)
+{
+	mutex_init(&paired_udid_index_mutex);
+}
+
+static unsigned int paired_udid_index_hash(const char *udid)
+{
+	unsigned int hash = 2166136261u;
+	while (*udid) {
+		hash ^= (unsigned char)*udid++;
+		hash *= 16777619u;
+	}
+	return hash % PAIRED_UDID_INDEX_HASH_SIZE;
+}
+
+/* the index mutex must be held by the caller */
+static void paired_udid_index_clear(void)
+{
+	struct paired_udid_entry *entry = paired_udid_index.first;
+	while (entry) {
+		struct paired_udid_entry *next = entry->next;
+		free(entry->udid);
+		free(entry);
+		entry = next;
+	}
+	memset(&paired_udid_index, '\0', sizeof(paired_udid_index));
+}
+
+/* the index mutex must be held by the caller */
+static struct paired_udid_entry *paired_udid_index_find(const char *udid)
+{
+	struct paired_udid_entry *entry;
+	for (entry = paired_udid_index.hash[paired_udid_index_hash(udid)]; entry; entry = entry->hash_next) {
+		if (strcmp(entry->udid, udid) == 0) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+/* the index mutex must be held by the caller */
+static void paired_udid_index_add(const char *name, size_t len)
+{
+	struct paired_udid_entry *entry = (struct paired_udid_entry*)malloc(sizeof(struct paired_udid_entry));
+	if (!entry) {
+		fprintf(stderr, "ERROR: Out of memory\n");
+		return;
+	}
+	entry->udid = (char*)malloc(len+1);
+	if (!entry->udid) {
+		fprintf(stderr, "ERROR: Out of memory\n");
+		free(entry);
+		return;
+	}
+	memcpy(entry->udid, name, len);
+	entry->udid[len] = '\0';
+
+	unsigned int idx = paired_udid_index_hash(entry->udid);
+	entry->hash_next = paired_udid_index.hash[idx];
+	paired_udid_index.hash[idx] = entry;
+
+	entry->next = NULL;
+	if (paired_udid_index.last) {
+		paired_udid_index.last->next = entry;
+	} else {
+		paired_udid_index.first = entry;
+	}
+	paired_udid_index.last = entry;
+	paired_udid_index.count++;
+}
+
+/**
+ * Rescans the config dir if it changed since the index was built.
+ * The index mutex must be held by the caller.
+ */
+static void paired_udid_index_refresh(void)
+{
+	const char *config_path = userpref_get_config_dir();
+	struct stat st;
+	int have_stat = (stat(config_path, &st) == 0);
+
+	/* the directory can still change within the second it was scanned in
+	 * without its mtime changing, so only trust scans from a later second */
+	if (paired_udid_index.valid && have_stat && st.st_mtime == paired_udid_index.mtime && paired_udid_index.scanned > paired_udid_index.mtime) {
+		return;
+	}
+
+	paired_udid_index_clear();
+	paired_udid_index.scanned = time(NULL);
+	paired_udid_index.mtime = (have_stat) ? st.st_mtime : 0;
+
+	DIR *config_dir = opendir(config_path);
+	if (config_dir) {
+		struct dirent *entry;
+		while ((entry = readdir(config_dir))) {
+			if (strcmp(entry->d_name, USERPREF_CONFIG_FILE) == 0) {
+				/* ignore SystemConfiguration.plist */
+				continue;
+			}
+			char *ext = strrchr(entry->d_name, '.');
+			if (ext && (strcmp(ext, USERPREF_CONFIG_EXTENSION) == 0)) {
+				paired_udid_index_add(entry->d_name, strlen(entry->d_name) - strlen(USERPREF_CONFIG_EXTENSION));
+			}
+		}
+		closedir(config_dir);
+	}
+	paired_udid_index.valid = have_stat;
+	debug_info("indexed %u pair records", paired_udid_index.count);
+}
+
+static void paired_udid_index_invalidate(void)
+{
+	thread_once(&paired_udid_index_once, paired_udid_index_init);
+
+	mutex_lock(&paired_udid_index_mutex);
+	paired_udid_index.valid = 0;
+	mutex_unlock(&paired_udid_index_mutex);
+}
+
 /**
  * Fills a list with UDIDs of devices that have been connected to this
  * system before, i.e. for which a public key file exists.
@@ -214,8 +534,6 @@ int userpref_read_system_buid(char **system_buid)
  */
 userpref_error_t userpref_get_paired_udids(char ***list, unsigned int *count)
 {
-	DIR *config_dir;
-	const char *config_path = NULL;
 	unsigned int found = 0;
 
 	if (!list || (list && *list)) {
@@ -226,42 +544,25 @@ userpref_error_t userpref_get_paired_udids(char ***list, unsigned int *count)
 	if (count) {
 		*count = 0;
 	}
-	*list = (char**)malloc(sizeof(char*));
 
-	config_path = userpref_get_config_dir();
-	config_dir = opendir(config_path);
-	if (config_dir) {
-		struct dirent *entry;
-		while ((entry = readdir(config_dir))) {
-			if (strcmp(entry->d_name, USERPREF_CONFIG_FILE) == 0) {
-				/* ignore SystemConfiguration.plist */
-				continue;
-			}
-			char *ext = strrchr(entry->d_name, '.');
-			if (ext && (strcmp(ext, USERPREF_CONFIG_EXTENSION) == 0)) {
-				size_t len = strlen(entry->d_name) - strlen(USERPREF_CONFIG_EXTENSION);
-				char **newlist = (char**)realloc(*list, sizeof(char*) * (found+2));
-				if (!newlist) {
-					fprintf(stderr, "ERROR: Out of memory\n");
-					break;
-				}
-				*list = newlist;
-				char *tmp = (char*)malloc(len+1);
-				if (tmp) {
-					strncpy(tmp, entry->d_name, len);
-					tmp[len] = '\0';
-				}
-				(*list)[found] = tmp;
-				if (!tmp) {
-					fprintf(stderr, "ERROR: Out of memory\n");
-					break;
-				}
-				found++;
+	thread_once(&paired_udid_index_once, paired_udid_index_init);
+
+	mutex_lock(&paired_udid_index_mutex);
+	paired_udid_index_refresh();
+	*list = (char**)malloc(sizeof(char*) * (paired_udid_index.count+1));
+	if (*list) {
+		struct paired_udid_entry *entry;
+		for (entry = paired_udid_index.first; entry; entry = entry->next) {
+			char *tmp = strdup(entry->udid);
+			if (!tmp) {
+				fprintf(stderr, "ERROR: Out of memory\n");
+				break;
 			}
+			(*list)[found++] = tmp;
 		}
-		closedir(config_dir);
+		(*list)[found] = NULL;
 	}
-	(*list)[found] = NULL;
+	mutex_unlock(&paired_udid_index_mutex);
 
 	if (count) {
 		*count = found;
@@ -270,6 +571,30 @@ userpref_error_t userpref_get_paired_udids(char ***list, unsigned int *count)
 	return USERPREF_E_SUCCESS;
 }
 
+/**
+ * Checks if a pair record file exists for a device, without reading it.
+ * Uses an index of the config dir that is only rebuilt when the directory
+ * changed, so it can be called on every device attach.
+ *
+ * @param udid The device UDID as given by the device
+ *
+ * @return 1 if a pair record exists for the device, 0 otherwise.
+ */
+int userpref_has_pair_record(const char *udid)
+{
+	if (!udid)
+		return 0;
+
+	thread_once(&paired_udid_index_once, paired_udid_index_init);
+
+	mutex_lock(&paired_udid_index_mutex);
+	paired_udid_index_refresh();
+	int res = (paired_udid_index_find(udid) != NULL);
+	mutex_unlock(&paired_udid_index_mutex);
+
+	return res;
+}
+
 /**
  * Save a pair record for a device.
  *
@@ -291,6 +616,9 @@ userpref_error_t userpref_save_pair_record(const char *udid, uint32_t device_id,
 
 	free(record_data);
 
+	userpref_invalidate_pair_record_cache(udid);
+	paired_udid_index_invalidate();
+
 	return res == 0 ? USERPREF_E_SUCCESS: USERPREF_E_UNKNOWN_ERROR;
 }
 
@@ -307,6 +635,24 @@ userpref_error_t userpref_read_pair_record(const char *udid, plist_t *pair_recor
 {
 	char* record_data = NULL;
 	uint32_t record_size = 0;
+	struct stat st;
+
+	if (!udid || !pair_record)
+		return USERPREF_E_INVALID_ARG;
+
+	thread_once(&pair_record_cache_once, pair_record_cache_init);
+
+	mutex_lock(&pair_record_cache_mutex);
+	struct pair_record_cache_entry *entry = pair_record_cache_find(udid);
+	if (entry) {
+		*pair_record = plist_copy(entry->pair_record);
+		mutex_unlock(&pair_record_cache_mutex);
+		return USERPREF_E_SUCCESS;
+	}
+	mutex_unlock(&pair_record_cache_mutex);
+
+	/* stat before reading so a concurrent change invalidates the cached copy */
+	int have_stat = (pair_record_file_stat(udid, &st) == 0);
 
 	int res = usbmuxd_read_pair_record(udid, &record_data, &record_size);
 
@@ -326,6 +672,12 @@ userpref_error_t userpref_read_pair_record(const char *udid, plist_t *pair_recor
 
 	free(record_data);
 
+	if (res == 0 && *pair_record) {
+		mutex_lock(&pair_record_cache_mutex);
+		pair_record_cache_add(udid, *pair_record, (have_stat) ? &st : NULL);
+		mutex_unlock(&pair_record_cache_mutex);
+	}
+
 	return res == 0 ? USERPREF_E_SUCCESS: USERPREF_E_UNKNOWN_ERROR;
 }
 
@@ -340,9 +692,101 @@ userpref_error_t userpref_delete_pair_record(const char *udid)
 {
 	int res = usbmuxd_delete_pair_record(udid);
 
+	userpref_invalidate_pair_record_cache(udid);
+	paired_udid_index_invalidate();
+
 	return res == 0 ? USERPREF_E_SUCCESS: USERPREF_E_UNKNOWN_ERROR;
 }
 
+#ifdef HAVE_OPENSSL
+/**
+ * Get the decoded root certificate and private key of the pair record for
+ * a device. They are decoded once and kept with the cached pair record.
+ *
+ * @param udid The udid of the device
+ * @param root_cert Set to a new reference of the root certificate, or NULL
+ *   if the pair record does not contain a valid one. Free with X509_free().
+ * @param root_privkey Set to a new reference of the root private key, or NULL
+ *   if the pair record does not contain a valid one. Free with RSA_free().
+ *
+ * @return USERPREF_E_SUCCESS if the pair record has been read, or
+ *   USERPREF_E_INVALID_CONF if there is no pair record for the device.
+ */
+userpref_error_t userpref_get_root_credentials(const char *udid, X509 **root_cert, RSA **root_privkey)
+{
+	plist_t pair_record = NULL;
+
+	if (!udid || !root_cert || !root_privkey)
+		return USERPREF_E_INVALID_ARG;
+
+	*root_cert = NULL;
+	*root_privkey = NULL;
+
+	userpref_read_pair_record(udid, &pair_record);
+	if (!pair_record)
+		return USERPREF_E_INVALID_CONF;
+
+	mutex_lock(&pair_record_cache_mutex);
+	struct pair_record_cache_entry *entry = pair_record_cache_find(udid);
+	if (entry && entry->decoded) {
+		if (entry->root_cert) {
+			X509_up_ref(entry->root_cert);
+			*root_cert = entry->root_cert;
+		}
+		if (entry->root_privkey) {
+			RSA_up_ref(entry->root_privkey);
+			*root_privkey = entry->root_privkey;
+		}
+		mutex_unlock(&pair_record_cache_mutex);
+		plist_free(pair_record);
+		return USERPREF_E_SUCCESS;
+	}
+	mutex_unlock(&pair_record_cache_mutex);
+
+	key_data_t cert_pem = { NULL, 0 };
+	key_data_t key_pem = { NULL, 0 };
+	X509 *cert = NULL;
+	RSA *key = NULL;
+	BIO *membp;
+
+	if (pair_record_import_crt_with_name(pair_record, USERPREF_ROOT_CERTIFICATE_KEY, &cert_pem) == USERPREF_E_SUCCESS) {
+		membp = BIO_new_mem_buf(cert_pem.data, cert_pem.size);
+		PEM_read_bio_X509(membp, &cert, NULL, NULL);
+		BIO_free(membp);
+	}
+	free(cert_pem.data);
+
+	if (pair_record_import_key_with_name(pair_record, USERPREF_ROOT_PRIVATE_KEY_KEY, &key_pem) == USERPREF_E_SUCCESS) {
+		membp = BIO_new_mem_buf(key_pem.data, key_pem.size);
+		PEM_read_bio_RSAPrivateKey(membp, &key, NULL, NULL);
+		BIO_free(membp);
+	}
+	free(key_pem.data);
+
+	mutex_lock(&pair_record_cache_mutex);
+	entry = pair_record_cache_find(udid);
+	if (entry && !entry->decoded) {
+		entry->decoded = 1;
+		if (cert) {
+			X509_up_ref(cert);
+			entry->root_cert = cert;
+		}
+		if (key) {
+			RSA_up_ref(key);
+			entry->root_privkey = key;
+		}
+	}
+	mutex_unlock(&pair_record_cache_mutex);
+
+	plist_free(pair_record);
+
+	*root_cert = cert;
+	*root_privkey = key;
+
+	return USERPREF_E_SUCCESS;
+}
+#endif
+
 #ifdef HAVE_OPENSSL
 static int X509_add_ext_helper(X509 *cert, int nid, char *value)
 {
@@ -366,6 +810,417 @@ static int X509_add_ext_helper(X509 *cert, int nid, char *value)
 }
 #endif
 
+/* RSA key size used for the root and host keys */
+#define USERPREF_RSA_KEY_BITS 2048
+
+struct key_pool {
+	mutex_t mutex;
+	cond_t cond;
+	THREAD_T thread;
+	int stop;
+	unsigned int size;
+	unsigned int count;
+	key_data_t *keys;
+	char *filename;
+};
+
+static struct key_pool key_pool;
+static thread_once_t key_pool_once = THREAD_ONCE_INIT;
+
+static void key_pool_init(void)
+{
+	memset(&key_pool, '\0', sizeof(struct key_pool));
+	mutex_init(&key_pool.mutex);
+	cond_init(&key_pool.cond);
+	key_pool.thread = THREAD_T_NULL;
+}
+
+/**
+ * Generates a new RSA private key and exports it in PEM format.
+ *
+ * @return 1 on success, 0 otherwise.
+ */
+static int userpref_generate_rsa_key_pem(key_data_t *pem)
+{
+	int res = 0;
+
+	pem->data = NULL;
+	pem->size = 0;
+
+#ifdef HAVE_OPENSSL
+	BIGNUM *e = BN_new();
+	RSA *keypair = RSA_new();
+	BN_set_word(e, 65537);
+	if (RSA_generate_key_ex(keypair, USERPREF_RSA_KEY_BITS, e, NULL)) {
+		BIO *membp = BIO_new(BIO_s_mem());
+		if (PEM_write_bio_RSAPrivateKey(membp, keypair, NULL, NULL, 0, 0, NULL) > 0) {
+			char *bdata = NULL;
+			pem->size = BIO_get_mem_data(membp, &bdata);
+			pem->data = (unsigned char*)malloc(pem->size);
+			if (pem->data) {
+				memcpy(pem->data, bdata, pem->size);
+				res = 1;
+			}
+		}
+		BIO_free(membp);
+	}
+	RSA_free(keypair);
+	BN_free(e);
+#else
+	gnutls_x509_privkey_t privkey;
+	size_t export_size = 0;
+
+	gcry_control(GCRYCTL_ENABLE_QUICK_RANDOM);
+	gnutls_x509_privkey_init(&privkey);
+	if (gnutls_x509_privkey_generate(privkey, GNUTLS_PK_RSA, USERPREF_RSA_KEY_BITS, 0) == GNUTLS_E_SUCCESS) {
+		gnutls_x509_privkey_export(privkey, GNUTLS_X509_FMT_PEM, NULL, &export_size);
+		pem->data = (unsigned char*)malloc(export_size);
+		if (pem->data && gnutls_x509_privkey_export(privkey, GNUTLS_X509_FMT_PEM, pem->data, &export_size) == GNUTLS_E_SUCCESS) {
+			pem->size = export_size;
+			res = 1;
+		} else {
+			free(pem->data);
+			pem->data = NULL;
+		}
+	}
+	gnutls_x509_privkey_deinit(privkey);
+#endif
+
+	return res;
+}
+
+/**
+ * Locks the pool file against other processes using the same file. The
+ * advisory lock is held on a separate lock file since saving replaces the
+ * pool file. The pool needs to be locked.
+ *
+ * @return A descriptor to pass to key_pool_file_unlock(), or -1 if the
+ *   file could not be locked.
+ */
+static int key_pool_file_lock(void)
+{
+	int fd = -1;
+
+	if (!key_pool.filename)
+		return -1;
+
+#ifndef WIN32
+	char *lockname = string_concat(key_pool.filename, ".lock", NULL);
+	fd = open(lockname, O_RDWR | O_CREAT, 0600);
+	if (fd < 0) {
+		debug_info("WARNING: could not open %s: %s", lockname, strerror(errno));
+	} else {
+		while (flock(fd, LOCK_EX) < 0) {
+			if (errno != EINTR) {
+				debug_info("WARNING: could not lock %s: %s", lockname, strerror(errno));
+				close(fd);
+				fd = -1;
+				break;
+			}
+		}
+	}
+	free(lockname);
+#endif
+
+	return fd;
+}
+
+static void key_pool_file_unlock(int fd)
+{
+#ifndef WIN32
+	if (fd >= 0) {
+		flock(fd, LOCK_UN);
+		close(fd);
+	}
+#endif
+}
+
+/**
+ * Writes the keys of the pool to its file. The pool and, if possible, the
+ * pool file need to be locked.
+ */
+static void key_pool_save(void)
+{
+	unsigned int i;
+
+	if (!key_pool.filename)
+		return;
+
+	plist_t keys = plist_new_array();
+	for (i = 0; i < key_pool.count; i++) {
+		plist_array_append_item(keys, plist_new_data((char*)key_pool.keys[i].data, key_pool.keys[i].size));
+	}
+#ifdef WIN32
+	if (!plist_write_to_filename(keys, key_pool.filename, PLIST_FORMAT_BINARY)) {
+		debug_info("WARNING: could not write key pool to %s", key_pool.filename);
+	}
+#else
+	char *data = NULL;
+	uint32_t length = 0;
+	uint32_t written = 0;
+	plist_to_bin(keys, &data, &length);
+
+	/* the file holds private keys, so create it with restricted permissions
+	 * from the start and move it into place once it is complete */
+	char *tmpname = string_concat(key_pool.filename, ".tmp", NULL);
+	unlink(tmpname);
+	int fd = open(tmpname, O_WRONLY | O_CREAT | O_EXCL, 0600);
+	if (fd >= 0) {
+		while (written < length) {
+			ssize_t w = write(fd, data + written, length - written);
+			if (w < 0 && errno == EINTR)
+				continue;
+			if (w <= 0)
+				break;
+			written += (uint32_t)w;
+		}
+		if (close(fd) < 0 || written < length || rename(tmpname, key_pool.filename) < 0) {
+			written = 0;
+			unlink(tmpname);
+		}
+	}
+	if (!data || written < length) {
+		debug_info("WARNING: could not write key pool to %s", key_pool.filename);
+	}
+	free(tmpname);
+	free(data);
+#endif
+	plist_free(keys);
+}
+
+/**
+ * Frees the keys of the pool. The pool needs to be locked.
+ */
+static void key_pool_clear(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < key_pool.count; i++) {
+		free(key_pool.keys[i].data);
+	}
+	free(key_pool.keys);
+	key_pool.keys = NULL;
+	key_pool.count = 0;
+}
+
+/**
+ * Reads saved keys from the pool file and adds them to the pool. The pool
+ * and, if possible, the pool file need to be locked.
+ */
+static void key_pool_load(void)
+{
+	plist_t keys = NULL;
+	uint32_t i;
+
+	if (!key_pool.filename || !plist_read_from_filename(&keys, key_pool.filename))
+		return;
+
+	if (plist_get_node_type(keys) == PLIST_ARRAY) {
+		uint32_t cnt = plist_array_get_size(keys);
+		key_data_t *newkeys = (key_data_t*)realloc(key_pool.keys, sizeof(key_data_t) * (key_pool.count + cnt));
+		if (newkeys) {
+			key_pool.keys = newkeys;
+			for (i = 0; i < cnt; i++) {
+				plist_t node = plist_array_get_item(keys, i);
+				if (plist_get_node_type(node) == PLIST_DATA) {
+					char *data = NULL;
+					uint64_t length = 0;
+					plist_get_data_val(node, &data, &length);
+					if (data && length > 0) {
+						key_pool.keys[key_pool.count].data = (unsigned char*)data;
+						key_pool.keys[key_pool.count].size = (unsigned int)length;
+						key_pool.count++;
+					} else {
+						free(data);
+					}
+				}
+			}
+		}
+	}
+	plist_free(keys);
+
+	debug_info("loaded %u keys from %s", key_pool.count, key_pool.filename);
+}
+
+static void* key_pool_worker(void *arg)
+{
+	mutex_lock(&key_pool.mutex);
+	while (1) {
+		while (!key_pool.stop && key_pool.count >= key_pool.size) {
+			cond_wait(&key_pool.cond, &key_pool.mutex);
+		}
+		if (key_pool.stop) {
+			break;
+		}
+		mutex_unlock(&key_pool.mutex);
+
+		key_data_t pem = { NULL, 0 };
+		int res = userpref_generate_rsa_key_pem(&pem);
+
+		mutex_lock(&key_pool.mutex);
+		if (!res) {
+			debug_info("ERROR: could not generate key for pool");
+			break;
+		}
+		/* other processes may have used the pool file meanwhile */
+		int lockfd = key_pool_file_lock();
+		if (lockfd >= 0) {
+			key_pool_clear();
+			key_pool_load();
+		}
+		key_data_t *newkeys = (key_data_t*)realloc(key_pool.keys, sizeof(key_data_t) * (key_pool.count + 1));
+		if (!newkeys) {
+			key_pool_file_unlock(lockfd);
+			free(pem.data);
+			break;
+		}
+		key_pool.keys = newkeys;
+		key_pool.keys[key_pool.count++] = pem;
+		key_pool_save();
+		key_pool_file_unlock(lockfd);
+	}
+	mutex_unlock(&key_pool.mutex);
+
+	return NULL;
+}
+
+/**
+ * Configures a pool of pre-generated RSA keys that pairing draws from.
+ * A background thread keeps the pool filled up to the given size.
+ *
+ * @param size Number of keys to keep ready, 0 stops generating keys.
+ * @param filename File to persist the pool in to survive restarts, or NULL.
+ *   The file may be shared by several processes, each key is only handed
+ *   out once.
+ *
+ * @return USERPREF_E_SUCCESS on success or USERPREF_E_UNKNOWN_ERROR if the
+ *   generator thread could not be started.
+ */
+userpref_error_t userpref_set_key_pool(unsigned int size, const char *filename)
+{
+	userpref_error_t res = USERPREF_E_SUCCESS;
+
+	thread_once(&key_pool_once, key_pool_init);
+
+	/* stop a running generator first */
+	mutex_lock(&key_pool.mutex);
+	THREAD_T thread = key_pool.thread;
+	key_pool.thread = THREAD_T_NULL;
+	key_pool.stop = 1;
+	cond_signal(&key_pool.cond);
+	mutex_unlock(&key_pool.mutex);
+	if (thread) {
+		thread_join(thread);
+		thread_free(thread);
+	}
+
+	mutex_lock(&key_pool.mutex);
+	key_pool.stop = 0;
+	key_pool.size = size;
+	if (filename && (!key_pool.filename || strcmp(filename, key_pool.filename) != 0)) {
+		free(key_pool.filename);
+		key_pool.filename = strdup(filename);
+		/* keep the keys generated so far along with the saved ones */
+		int lockfd = key_pool_file_lock();
+		key_pool_load();
+		key_pool_save();
+		key_pool_file_unlock(lockfd);
+	} else if (!filename && key_pool.filename) {
+		free(key_pool.filename);
+		key_pool.filename = NULL;
+	}
+	if (size > 0) {
+		if (thread_new(&key_pool.thread, key_pool_worker, NULL) != 0) {
+			key_pool.thread = THREAD_T_NULL;
+			res = USERPREF_E_UNKNOWN_ERROR;
+		}
+	}
+	mutex_unlock(&key_pool.mutex);
+
+	return res;
+}
+
+/**
+ * Takes a pre-generated key from the pool.
+ *
+ * @return 1 if a key was taken, 0 if the pool is empty.
+ */
+static int key_pool_take(key_data_t *pem)
+{
+	int res = 0;
+
+	thread_once(&key_pool_once, key_pool_init);
+
+	mutex_lock(&key_pool.mutex);
+	/* take the key with the pool file locked, so no other process using
+	 * the same file can hand it out as well */
+	int lockfd = key_pool_file_lock();
+	if (lockfd >= 0) {
+		key_pool_clear();
+		key_pool_load();
+	}
+	if (key_pool.count > 0) {
+		*pem = key_pool.keys[--key_pool.count];
+		key_pool_save();
+		/* let the generator refill the pool */
+		cond_signal(&key_pool.cond);
+		res = 1;
+	}
+	key_pool_file_unlock(lockfd);
+	mutex_unlock(&key_pool.mutex);
+
+	return res;
+}
+
+#ifdef HAVE_OPENSSL
+/**
+ * Gets a new RSA key, from the key pool if possible.
+ */
+static RSA* userpref_get_rsa_key(void)
+{
+	RSA *keypair = NULL;
+	key_data_t pem = { NULL, 0 };
+
+	if (key_pool_take(&pem)) {
+		BIO *membp = BIO_new_mem_buf(pem.data, pem.size);
+		PEM_read_bio_RSAPrivateKey(membp, &keypair, NULL, NULL);
+		BIO_free(membp);
+		free(pem.data);
+		if (keypair) {
+			debug_info("using key from key pool");
+			return keypair;
+		}
+	}
+
+	BIGNUM *e = BN_new();
+	keypair = RSA_new();
+	BN_set_word(e, 65537);
+	RSA_generate_key_ex(keypair, USERPREF_RSA_KEY_BITS, e, NULL);
+	BN_free(e);
+
+	return keypair;
+}
+#else
+/**
+ * Fills the given key with a new RSA key, from the key pool if possible.
+ */
+static void userpref_get_rsa_key(gnutls_x509_privkey_t key)
+{
+	key_data_t pem = { NULL, 0 };
+
+	if (key_pool_take(&pem)) {
+		int res = gnutls_x509_privkey_import(key, &pem, GNUTLS_X509_FMT_PEM);
+		free(pem.data);
+		if (res == GNUTLS_E_SUCCESS) {
+			debug_info("using key from key pool");
+			return;
+		}
+	}
+
+	gnutls_x509_privkey_generate(key, GNUTLS_PK_RSA, USERPREF_RSA_KEY_BITS, 0);
+}
+#endif
+
 /**
  * Private function to generate required private keys and certificates.
  *
@@ -391,16 +1246,8 @@ userpref_error_t pair_record_generate_keys_and_certs(plist_t pair_record, key_da
 	debug_info("Generating keys and certificates...");
 
 #ifdef HAVE_OPENSSL
-	BIGNUM *e = BN_new();
-	RSA* root_keypair = RSA_new();
-	RSA* host_keypair = RSA_new();
-
-	BN_set_word(e, 65537);
-
-	RSA_generate_key_ex(root_keypair, 2048, e, NULL);
-	RSA_generate_key_ex(host_keypair, 2048, e, NULL);
-
-	BN_free(e);
+	RSA* root_keypair = userpref_get_rsa_key();
+	RSA* host_keypair = userpref_get_rsa_key();
 
 	EVP_PKEY* root_pkey = EVP_PKEY_new();
 	EVP_PKEY_assign_RSA(root_pkey, root_keypair);
@@ -595,8 +1442,8 @@ userpref_error_t pair_record_generate_keys_and_certs(plist_t pair_record, key_da
 	gnutls_x509_crt_init(&host_cert);
 
 	/* generate root key */
-	gnutls_x509_privkey_generate(root_privkey, GNUTLS_PK_RSA, 2048, 0);
-	gnutls_x509_privkey_generate(host_privkey, GNUTLS_PK_RSA, 2048, 0);
+	userpref_get_rsa_key(root_privkey);
+	userpref_get_rsa_key(host_privkey);
 
 	/* generate certificates */
 	gnutls_x509_crt_set_key(root_cert, root_privkey);
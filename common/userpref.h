@@ -28,6 +28,8 @@
 #endif
 
 #ifdef HAVE_OPENSSL
+#include <openssl/x509.h>
+#include <openssl/rsa.h>
 typedef struct {
 	unsigned char *data;
 	unsigned int size;
@@ -66,7 +68,13 @@ int userpref_read_system_buid(char **system_buid);
 userpref_error_t userpref_read_pair_record(const char *udid, plist_t *pair_record);
 userpref_error_t userpref_save_pair_record(const char *udid, uint32_t device_id, plist_t pair_record);
 userpref_error_t userpref_delete_pair_record(const char *udid);
+void userpref_invalidate_pair_record_cache(const char *udid);
+void userpref_pin_pair_record(const char *udid, plist_t pair_record);
+#ifdef HAVE_OPENSSL
+userpref_error_t userpref_get_root_credentials(const char *udid, X509 **root_cert, RSA **root_privkey);
+#endif
 
+userpref_error_t userpref_set_key_pool(unsigned int size, const char *filename);
 userpref_error_t pair_record_generate_keys_and_certs(plist_t pair_record, key_data_t public_key);
 #ifdef HAVE_OPENSSL
 userpref_error_t pair_record_import_key_with_name(plist_t pair_record, const char* name, key_data_t* key);
@@ -81,8 +89,9 @@ userpref_error_t pair_record_set_host_id(plist_t pair_record, const char* host_i
 userpref_error_t pair_record_get_item_as_key_data(plist_t pair_record, const char* name, key_data_t *value);
 userpref_error_t pair_record_set_item_from_key_data(plist_t pair_record, const char* name, key_data_t *value);
 
+int userpref_has_pair_record(const char *udid);
+
 /* deprecated */
 userpref_error_t userpref_get_paired_udids(char ***list, unsigned int *count);
-int userpref_has_pair_record(const char *udid);
 
 #endif
@@ -33,6 +33,17 @@
 #include <sys/time.h>
 #include <inttypes.h>
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#define HAVE_MMAP 1
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#endif
 
 #include "utils.h"
 
@@ -186,6 +197,85 @@ char *string_build_path(const char *elem, ...)
 	return out;
 }
 
+static int path_builder_reserve(struct path_builder *pb, size_t len)
+{
+	if (len < pb->size)
+		return 0;
+
+	size_t size = pb->size * 2;
+	while (size <= len)
+		size *= 2;
+
+	char *path;
+	if (pb->path == pb->fixed) {
+		path = (char*)malloc(size);
+		if (path)
+			memcpy(path, pb->fixed, pb->len + 1);
+	} else {
+		path = (char*)realloc(pb->path, size);
+	}
+	if (!path)
+		return -1;
+
+	pb->path = path;
+	pb->size = size;
+	return 0;
+}
+
+void path_builder_init(struct path_builder *pb, const char *base)
+{
+	pb->path = pb->fixed;
+	pb->size = sizeof(pb->fixed);
+	pb->len = 0;
+	pb->fixed[0] = '\0';
+	if (base) {
+		size_t len = strlen(base);
+		if (path_builder_reserve(pb, len) == 0) {
+			memcpy(pb->path, base, len + 1);
+			pb->len = len;
+		}
+	}
+}
+
+/**
+ * Appends a path element separated by '/' and returns the resulting path,
+ * which stays valid until the builder is modified again. To go back to the
+ * previous path remember pb->len before and pass it to path_builder_truncate().
+ *
+ * @return The path or NULL if it could not be grown.
+ */
+const char *path_builder_join(struct path_builder *pb, const char *elem)
+{
+	size_t elen = strlen(elem);
+	if (path_builder_reserve(pb, pb->len + 1 + elen) < 0)
+		return NULL;
+
+	pb->path[pb->len++] = '/';
+	memcpy(pb->path + pb->len, elem, elen + 1);
+	pb->len += elen;
+
+	return pb->path;
+}
+
+const char *path_builder_truncate(struct path_builder *pb, size_t len)
+{
+	if (len < pb->len) {
+		pb->len = len;
+		pb->path[len] = '\0';
+	}
+	return pb->path;
+}
+
+void path_builder_free(struct path_builder *pb)
+{
+	if (pb->path != pb->fixed)
+		free(pb->path);
+	pb->path = pb->fixed;
+	pb->size = sizeof(pb->fixed);
+	pb->len = 0;
+	pb->fixed[0] = '\0';
+}
+
 char *string_format_size(uint64_t size)
 {
 	char buf[80];
@@ -247,35 +337,138 @@ char *generate_uuid()
 	return uuid;
 }
 
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+static int buffer_open_file(const char *filename, uint64_t *size)
+{
+	struct stat st;
+	int fd = open(filename, O_RDONLY | O_BINARY);
+	if (fd < 0) {
+		return -1;
+	}
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || (uint64_t)st.st_size > (size_t)-1) {
+		close(fd);
+		return -1;
+	}
+	*size = (uint64_t)st.st_size;
+	return fd;
+}
+
+static int buffer_read_fd_into(int fd, char *buf, uint64_t size)
+{
+	uint64_t got = 0;
+
+	while (got < size) {
+		ssize_t r = read(fd, buf + got, size - got);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			break;
+		got += r;
+	}
+	return (got < size) ? -1 : 0;
+}
+
+static char *buffer_read_fd(int fd, uint64_t size)
+{
+	char *buf = (char*)malloc(size + 1);
+	if (!buf) {
+		return NULL;
+	}
+	if (buffer_read_fd_into(fd, buf, size) != 0) {
+		free(buf);
+		return NULL;
+	}
+	buf[size] = '\0';
+	return buf;
+}
+
 void buffer_read_from_filename(const char *filename, char **buffer, uint64_t *length)
 {
-	FILE *f;
-	uint64_t size;
+	uint64_t size = 0;
+	int fd;
 
 	*length = 0;
 
-	f = fopen(filename, "rb");
-	if (!f) {
+	fd = buffer_open_file(filename, &size);
+	if (fd < 0) {
+		return;
+	}
+	if (size == 0) {
+		close(fd);
 		return;
 	}
 
-	fseek(f, 0, SEEK_END);
-	size = ftell(f);
-	rewind(f);
+	*buffer = buffer_read_fd(fd, size);
+	close(fd);
+	if (*buffer) {
+		*length = size;
+	}
+}
 
+int buffer_map_from_filename(const char *filename, char **buffer, uint64_t *length)
+{
+	uint64_t size = 0;
+	char *data = NULL;
+	int fd;
+
+	*buffer = NULL;
+	*length = 0;
+
+	fd = buffer_open_file(filename, &size);
+	if (fd < 0) {
+		return -1;
+	}
 	if (size == 0) {
-		fclose(f);
-		return;
+		close(fd);
+		return -1;
 	}
 
-	*buffer = (char*)malloc(sizeof(char)*(size+1));
-	if (fread(*buffer, sizeof(char), size, f) != size) {
-		fclose(f);
-		return;
+#ifdef HAVE_MMAP
+	data = (char*)mmap(NULL, (size_t)size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED) {
+		/* the file system can't be mapped (e.g. some network mounts), read
+		 * into an anonymous mapping so buffer_unmap() works the same way */
+		data = (char*)mmap(NULL, (size_t)size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (data == MAP_FAILED) {
+			data = NULL;
+		} else if (buffer_read_fd_into(fd, data, size) != 0) {
+			munmap(data, (size_t)size);
+			data = NULL;
+		}
+	}
+#ifdef MADV_SEQUENTIAL
+	else {
+		madvise(data, (size_t)size, MADV_SEQUENTIAL);
+	}
+#endif
+#else
+	/* no mmap, read the file into memory in one go instead */
+	data = buffer_read_fd(fd, size);
+#endif
+	close(fd);
+
+	if (!data) {
+		return -1;
 	}
-	fclose(f);
 
+	*buffer = data;
 	*length = size;
+
+	return 0;
+}
+
+void buffer_unmap(char *buffer, uint64_t length)
+{
+	if (!buffer)
+		return;
+#ifdef HAVE_MMAP
+	munmap(buffer, (size_t)length);
+#else
+	free(buffer);
+#endif
 }
 
 void buffer_write_to_filename(const char *filename, const char *buffer, uint64_t length)
@@ -292,24 +485,28 @@ void buffer_write_to_filename(const char *filename, const char *buffer, uint64_t
 int plist_read_from_filename(plist_t *plist, const char *filename)
 {
 	char *buffer = NULL;
-	uint64_t length;
+	uint64_t length = 0;
 
 	if (!filename)
 		return 0;
 
-	buffer_read_from_filename(filename, &buffer, &length);
+	/* parse straight from the mapping, large manifests are never copied */
+	if (buffer_map_from_filename(filename, &buffer, &length) != 0) {
+		return 0;
+	}
 
-	if (!buffer) {
+	if (length > UINT32_MAX) {
+		buffer_unmap(buffer, length);
 		return 0;
 	}
 
 	if ((length > 8) && (memcmp(buffer, "bplist00", 8) == 0)) {
-		plist_from_bin(buffer, length, plist);
+		plist_from_bin(buffer, (uint32_t)length, plist);
 	} else {
-		plist_from_xml(buffer, length, plist);
+		plist_from_xml(buffer, (uint32_t)length, plist);
 	}
 
-	free(buffer);
+	buffer_unmap(buffer, length);
 
 	return 1;
 }
@@ -339,192 +536,423 @@ int plist_write_to_filename(plist_t plist, const char *filename, enum plist_form
 static const char base64_str[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 static const char base64_pad = '=';
 
-static char *base64encode(const unsigned char *buf, size_t size)
+/* seconds between the unix epoch and the plist date epoch 2001-01-01 */
+#define PLIST_DATE_EPOCH 978307200
+
+#define PLIST_WRITER_BUFFER_SIZE 65536
+
+enum plist_writer_format {
+	PLIST_WRITER_TEXT,
+	PLIST_WRITER_JSON
+};
+
+/*
+ * Collects the output in a large buffer that is written to the stream when
+ * it is full, or grows the buffer if the output is collected in memory.
+ */
+struct plist_writer {
+	FILE *stream;
+	char *buf;
+	size_t len;
+	size_t size;
+	int failed;
+};
+
+/* a container whose items are being written */
+struct plist_writer_frame {
+	plist_t node;
+	plist_dict_iter iter;
+	uint32_t index;
+	uint32_t count;
+	int level;
+};
+
+static void plist_writer_flush(struct plist_writer *w)
 {
-	if (!buf || !(size > 0)) return NULL;
-	int outlen = (size / 3) * 4;
-	char *outbuf = (char*)malloc(outlen+5); // 4 spare bytes + 1 for '\0'
-	size_t n = 0;
-	size_t m = 0;
-	unsigned char input[3];
-	unsigned int output[4];
-	while (n < size) {
-		input[0] = buf[n];
-		input[1] = (n+1 < size) ? buf[n+1] : 0;
-		input[2] = (n+2 < size) ? buf[n+2] : 0;
-		output[0] = input[0] >> 2;
-		output[1] = ((input[0] & 3) << 4) + (input[1] >> 4);
-		output[2] = ((input[1] & 15) << 2) + (input[2] >> 6);
-		output[3] = input[2] & 63;
-		outbuf[m++] = base64_str[(int)output[0]];
-		outbuf[m++] = base64_str[(int)output[1]];
-		outbuf[m++] = (n+1 < size) ? base64_str[(int)output[2]] : base64_pad;
-		outbuf[m++] = (n+2 < size) ? base64_str[(int)output[3]] : base64_pad;
-		n+=3;
+	if (w->stream && w->len > 0) {
+		if (fwrite(w->buf, 1, w->len, w->stream) != w->len)
+			w->failed = 1;
+		w->len = 0;
 	}
-	outbuf[m] = 0; // 0-termination!
-	return outbuf;
 }
 
-static void plist_node_print_to_stream(plist_t node, int* indent_level, FILE* stream);
-
-static void plist_array_print_to_stream(plist_t node, int* indent_level, FILE* stream)
+static void plist_writer_write(struct plist_writer *w, const char *data, size_t len)
 {
-	/* iterate over items */
-	int i, count;
-	plist_t subnode = NULL;
+	if (w->failed)
+		return;
+	if (w->len + len + 1 > w->size) {
+		if (w->stream) {
+			plist_writer_flush(w);
+			if (len + 1 > w->size) {
+				if (fwrite(data, 1, len, w->stream) != len)
+					w->failed = 1;
+				return;
+			}
+		} else {
+			size_t size = w->size;
+			while (w->len + len + 1 > size)
+				size *= 2;
+			char *buf = (char*)realloc(w->buf, size);
+			if (!buf) {
+				w->failed = 1;
+				return;
+			}
+			w->buf = buf;
+			w->size = size;
+		}
+	}
+	memcpy(w->buf + w->len, data, len);
+	w->len += len;
+	w->buf[w->len] = '\0';
+}
 
-	count = plist_array_get_size(node);
+static void plist_writer_puts(struct plist_writer *w, const char *str)
+{
+	plist_writer_write(w, str, strlen(str));
+}
 
-	for (i = 0; i < count; i++) {
-		subnode = plist_array_get_item(node, i);
-		fprintf(stream, "%*s", *indent_level, "");
-		fprintf(stream, "%d: ", i);
-		plist_node_print_to_stream(subnode, indent_level, stream);
+static void plist_writer_indent(struct plist_writer *w, int level)
+{
+	static const char spaces[] = "                                ";
+	while (level > 0) {
+		int n = (level < (int)sizeof(spaces) - 1) ? level : (int)sizeof(spaces) - 1;
+		plist_writer_write(w, spaces, n);
+		level -= n;
 	}
 }
 
-static void plist_dict_print_to_stream(plist_t node, int* indent_level, FILE* stream)
+static void plist_writer_uint(struct plist_writer *w, uint64_t u)
+{
+	char tmp[24];
+	char *p = tmp + sizeof(tmp);
+	do {
+		*--p = '0' + (char)(u % 10);
+		u /= 10;
+	} while (u);
+	plist_writer_write(w, p, tmp + sizeof(tmp) - p);
+}
+
+/* encodes in chunks straight from the node's data */
+static void plist_writer_base64(struct plist_writer *w, const unsigned char *buf, size_t size)
 {
-	/* iterate over key/value pairs */
-	plist_dict_iter it = NULL;
+	char out[4096];
+	size_t n = 0;
+	size_t m = 0;
+	while (n < size) {
+		unsigned char input[3];
+		input[0] = buf[n];
+		input[1] = (n+1 < size) ? buf[n+1] : 0;
+		input[2] = (n+2 < size) ? buf[n+2] : 0;
+		out[m++] = base64_str[input[0] >> 2];
+		out[m++] = base64_str[((input[0] & 3) << 4) + (input[1] >> 4)];
+		out[m++] = (n+1 < size) ? base64_str[((input[1] & 15) << 2) + (input[2] >> 6)] : base64_pad;
+		out[m++] = (n+2 < size) ? base64_str[input[2] & 63] : base64_pad;
+		n += 3;
+		if (m == sizeof(out)) {
+			plist_writer_write(w, out, m);
+			m = 0;
+		}
+	}
+	plist_writer_write(w, out, m);
+}
 
-	char* key = NULL;
-	plist_t subnode = NULL;
-	plist_dict_new_iter(node, &it);
-	plist_dict_next_item(node, it, &key, &subnode);
-	while (subnode)
-	{
-		fprintf(stream, "%*s", *indent_level, "");
-		fprintf(stream, "%s", key);
-		if (plist_get_node_type(subnode) == PLIST_ARRAY)
-			fprintf(stream, "[%d]: ", plist_array_get_size(subnode));
-		else
-			fprintf(stream, ": ");
-		free(key);
-		key = NULL;
-		plist_node_print_to_stream(subnode, indent_level, stream);
-		plist_dict_next_item(node, it, &key, &subnode);
+static void plist_writer_json_string(struct plist_writer *w, const char *str)
+{
+	const char *p = str;
+	char esc[8];
+
+	plist_writer_write(w, "\"", 1);
+	while (*p) {
+		const char *start = p;
+		while (*p && *p != '"' && *p != '\\' && (unsigned char)*p >= 0x20)
+			p++;
+		plist_writer_write(w, start, p - start);
+		if (!*p)
+			break;
+		switch (*p) {
+		case '"':
+			plist_writer_write(w, "\\\"", 2);
+			break;
+		case '\\':
+			plist_writer_write(w, "\\\\", 2);
+			break;
+		case '\n':
+			plist_writer_write(w, "\\n", 2);
+			break;
+		case '\r':
+			plist_writer_write(w, "\\r", 2);
+			break;
+		case '\t':
+			plist_writer_write(w, "\\t", 2);
+			break;
+		default:
+			snprintf(esc, sizeof(esc), "\\u%04x", (unsigned char)*p);
+			plist_writer_write(w, esc, 6);
+			break;
+		}
+		p++;
 	}
-	free(it);
+	plist_writer_write(w, "\"", 1);
 }
 
-static void plist_node_print_to_stream(plist_t node, int* indent_level, FILE* stream)
+/**
+ * Writes a node that is not a container.
+ */
+static void plist_writer_scalar(struct plist_writer *w, plist_t node, enum plist_writer_format format)
 {
+	char tmp[64];
 	char *s = NULL;
-	char *data = NULL;
-	double d;
-	uint8_t b;
 	uint64_t u = 0;
-	struct timeval tv = { 0, 0 };
-
-	plist_type t;
-
-	if (!node)
-		return;
-
-	t = plist_get_node_type(node);
+	double d = 0;
+	uint8_t b = 0;
+	int json = (format == PLIST_WRITER_JSON);
 
-	switch (t) {
+	switch (plist_get_node_type(node)) {
 	case PLIST_BOOLEAN:
 		plist_get_bool_val(node, &b);
-		fprintf(stream, "%s\n", (b ? "true" : "false"));
+		plist_writer_puts(w, (b) ? "true" : "false");
 		break;
 
 	case PLIST_UINT:
 		plist_get_uint_val(node, &u);
-		fprintf(stream, "%"PRIu64"\n", u);
+		plist_writer_uint(w, u);
 		break;
 
 	case PLIST_REAL:
 		plist_get_real_val(node, &d);
-		fprintf(stream, "%f\n", d);
+		if (!json) {
+			snprintf(tmp, sizeof(tmp), "%f", d);
+		} else if (d != d || d - d != 0) {
+			/* JSON has no representation for NaN or infinity */
+			strcpy(tmp, "null");
+		} else {
+			snprintf(tmp, sizeof(tmp), "%.17g", d);
+		}
+		plist_writer_puts(w, tmp);
 		break;
 
-	case PLIST_STRING:
-		plist_get_string_val(node, &s);
-		fprintf(stream, "%s\n", s);
-		free(s);
-		break;
+	case PLIST_STRING: {
+		const char *str = plist_get_string_ptr(node, NULL);
+		if (json) {
+			plist_writer_json_string(w, (str) ? str : "");
+		} else if (str) {
+			plist_writer_puts(w, str);
+		}
+	} break;
 
 	case PLIST_KEY:
 		plist_get_key_val(node, &s);
-		fprintf(stream, "%s: ", s);
+		if (json) {
+			plist_writer_json_string(w, (s) ? s : "");
+		} else if (s) {
+			plist_writer_puts(w, s);
+		}
 		free(s);
 		break;
 
-	case PLIST_DATA:
-		plist_get_data_val(node, &data, &u);
-		if (u > 0) {
-			s = base64encode((unsigned char*)data, u);
-			free(data);
-			if (s) {
-				fprintf(stream, "%s\n", s);
-				free(s);
-			} else {
-				fprintf(stream, "\n");
-			}
-		} else {
-			fprintf(stream, "\n");
+	case PLIST_DATA: {
+		const char *data = plist_get_data_ptr(node, &u);
+		if (json)
+			plist_writer_write(w, "\"", 1);
+		if (data && u > 0)
+			plist_writer_base64(w, (const unsigned char*)data, u);
+		if (json)
+			plist_writer_write(w, "\"", 1);
+	} break;
+
+	case PLIST_DATE: {
+		int32_t sec = 0;
+		int32_t usec = 0;
+		plist_get_date_val(node, &sec, &usec);
+		time_t ti = (time_t)sec;
+		struct tm *btime = (json) ? (ti += PLIST_DATE_EPOCH, gmtime(&ti)) : localtime(&ti);
+		if (btime && strftime(tmp, sizeof(tmp), "%Y-%m-%dT%H:%M:%SZ", btime) > 0) {
+			if (json)
+				plist_writer_json_string(w, tmp);
+			else
+				plist_writer_puts(w, tmp);
+		} else if (json) {
+			plist_writer_puts(w, "null");
 		}
+	} break;
+
+	default:
+		if (json)
+			plist_writer_puts(w, "null");
 		break;
+	}
+}
+
+/**
+ * Writes a node and all of its children using an explicit stack, so deeply
+ * nested replies don't grow the call stack.
+ *
+ * The text format lists one node per line, children indented by one space
+ * per level, array items prefixed with their index and dictionary entries
+ * with their key.
+ */
+static void plist_writer_node(struct plist_writer *w, plist_t plist, enum plist_writer_format format)
+{
+	struct plist_writer_frame *stack = NULL;
+	int depth = 0;
+	int capacity = 0;
+	plist_t node = plist;
+	int level = 0;
+	int json = (format == PLIST_WRITER_JSON);
+
+	/* in text format the items of the top level container are not indented */
+	if (!json) {
+		plist_type t = plist_get_node_type(node);
+		if (t == PLIST_DICT || t == PLIST_ARRAY)
+			level = -1;
+	}
 
-	case PLIST_DATE:
-		plist_get_date_val(node, (int32_t*)&tv.tv_sec, (int32_t*)&tv.tv_usec);
-		{
-			time_t ti = (time_t)tv.tv_sec;
-			struct tm *btime = localtime(&ti);
-			if (btime) {
-				s = (char*)malloc(24);
- 				memset(s, 0, 24);
-				if (strftime(s, 24, "%Y-%m-%dT%H:%M:%SZ", btime) <= 0) {
-					free (s);
-					s = NULL;
+	while (1) {
+		if (node) {
+			plist_type t = plist_get_node_type(node);
+			if (t == PLIST_DICT || t == PLIST_ARRAY) {
+				if (depth == capacity) {
+					int newcap = (capacity) ? capacity * 2 : 16;
+					struct plist_writer_frame *newstack = (struct plist_writer_frame*)realloc(stack, newcap * sizeof(struct plist_writer_frame));
+					if (!newstack) {
+						w->failed = 1;
+						break;
+					}
+					stack = newstack;
+					capacity = newcap;
 				}
+				struct plist_writer_frame *f = &stack[depth++];
+				f->node = node;
+				f->iter = NULL;
+				f->index = 0;
+				f->count = (t == PLIST_ARRAY) ? plist_array_get_size(node) : 0;
+				f->level = level + 1;
+				if (t == PLIST_DICT)
+					plist_dict_new_iter(node, &f->iter);
+				if (json)
+					plist_writer_write(w, (t == PLIST_DICT) ? "{" : "[", 1);
+				else if (depth > 1 || level >= 0)
+					plist_writer_write(w, "\n", 1);
+			} else {
+				plist_writer_scalar(w, node, format);
+				if (!json && t != PLIST_KEY)
+					plist_writer_write(w, "\n", 1);
 			}
+			node = NULL;
 		}
-		if (s) {
-			fprintf(stream, "%s\n", s);
-			free(s);
-		} else {
-			fprintf(stream, "\n");
+
+		if (depth == 0 || w->failed)
+			break;
+
+		/* get the next child of the innermost container */
+		struct plist_writer_frame *f = &stack[depth-1];
+		plist_t child = NULL;
+		if (f->iter) {
+			char *key = NULL;
+			plist_dict_next_item(f->node, f->iter, &key, &child);
+			if (child) {
+				if (json) {
+					if (f->index > 0)
+						plist_writer_write(w, ",", 1);
+					plist_writer_json_string(w, key);
+					plist_writer_write(w, ":", 1);
+				} else {
+					plist_writer_indent(w, f->level);
+					plist_writer_puts(w, key);
+					if (plist_get_node_type(child) == PLIST_ARRAY) {
+						plist_writer_write(w, "[", 1);
+						plist_writer_uint(w, plist_array_get_size(child));
+						plist_writer_write(w, "]: ", 3);
+					} else {
+						plist_writer_write(w, ": ", 2);
+					}
+				}
+				f->index++;
+			}
+			free(key);
+		} else if (f->index < f->count) {
+			child = plist_array_get_item(f->node, f->index);
+			if (json) {
+				if (f->index > 0)
+					plist_writer_write(w, ",", 1);
+			} else {
+				plist_writer_indent(w, f->level);
+				plist_writer_uint(w, f->index);
+				plist_writer_write(w, ": ", 2);
+			}
+			f->index++;
 		}
-		break;
 
-	case PLIST_ARRAY:
-		fprintf(stream, "\n");
-		(*indent_level)++;
-		plist_array_print_to_stream(node, indent_level, stream);
-		(*indent_level)--;
-		break;
+		if (child) {
+			node = child;
+			level = f->level;
+			continue;
+		}
 
-	case PLIST_DICT:
-		fprintf(stream, "\n");
-		(*indent_level)++;
-		plist_dict_print_to_stream(node, indent_level, stream);
-		(*indent_level)--;
-		break;
+		/* container done */
+		if (json)
+			plist_writer_write(w, (f->iter) ? "}" : "]", 1);
+		free(f->iter);
+		depth--;
+	}
 
-	default:
-		break;
+	while (depth > 0) {
+		free(stack[--depth].iter);
 	}
+	free(stack);
 }
 
-void plist_print_to_stream(plist_t plist, FILE* stream)
+static void plist_write_to_stream(plist_t plist, FILE* stream, enum plist_writer_format format)
 {
-	int indent = 0;
+	struct plist_writer w;
 
 	if (!plist || !stream)
 		return;
 
-	switch (plist_get_node_type(plist)) {
-	case PLIST_DICT:
-		plist_dict_print_to_stream(plist, &indent, stream);
-		break;
-	case PLIST_ARRAY:
-		plist_array_print_to_stream(plist, &indent, stream);
-		break;
-	default:
-		plist_node_print_to_stream(plist, &indent, stream);
+	w.stream = stream;
+	w.len = 0;
+	w.size = PLIST_WRITER_BUFFER_SIZE;
+	w.failed = 0;
+	w.buf = (char*)malloc(w.size);
+	if (!w.buf)
+		return;
+
+	plist_writer_node(&w, plist, format);
+	plist_writer_flush(&w);
+	free(w.buf);
+}
+
+void plist_print_to_stream(plist_t plist, FILE* stream)
+{
+	plist_write_to_stream(plist, stream, PLIST_WRITER_TEXT);
+}
+
+void plist_print_json_to_stream(plist_t plist, FILE* stream)
+{
+	plist_write_to_stream(plist, stream, PLIST_WRITER_JSON);
+}
+
+char *plist_to_json_string(plist_t plist)
+{
+	struct plist_writer w;
+
+	if (!plist)
+		return NULL;
+
+	w.stream = NULL;
+	w.len = 0;
+	w.size = 256;
+	w.failed = 0;
+	w.buf = (char*)malloc(w.size);
+	if (!w.buf)
+		return NULL;
+	w.buf[0] = '\0';
+
+	plist_writer_node(&w, plist, PLIST_WRITER_JSON);
+	if (w.failed) {
+		free(w.buf);
+		return NULL;
 	}
+
+	return w.buf;
 }
@@ -48,9 +48,31 @@ char *string_format_size(uint64_t size);
 char *string_toupper(char *str);
 char *generate_uuid(void);
 
+#define PATH_BUILDER_FIXED_SIZE 512
+
+/* Reusable path buffer for building many paths below a common base without
+ * allocating. Paths that don't fit the inline storage move to the heap.
+ * A path_builder must not be copied once initialized. */
+struct path_builder {
+	char *path;
+	size_t len;
+	size_t size;
+	char fixed[PATH_BUILDER_FIXED_SIZE];
+};
+
+void path_builder_init(struct path_builder *pb, const char *base);
+const char *path_builder_join(struct path_builder *pb, const char *elem);
+const char *path_builder_truncate(struct path_builder *pb, size_t len);
+void path_builder_free(struct path_builder *pb);
+
 void buffer_read_from_filename(const char *filename, char **buffer, uint64_t *length);
 void buffer_write_to_filename(const char *filename, const char *buffer, uint64_t length);
 
+/* Maps a file read-only, falling back to reading it where mapping is not
+ * possible. Returns 0 on success; release the buffer with buffer_unmap(). */
+int buffer_map_from_filename(const char *filename, char **buffer, uint64_t *length);
+void buffer_unmap(char *buffer, uint64_t length);
+
 enum plist_format_t {
 	PLIST_FORMAT_XML,
 	PLIST_FORMAT_BINARY
@@ -60,5 +82,7 @@ int plist_read_from_filename(plist_t *plist, const char *filename);
 int plist_write_to_filename(plist_t plist, const char *filename, enum plist_format_t format);
 
 void plist_print_to_stream(plist_t plist, FILE* stream);
+void plist_print_json_to_stream(plist_t plist, FILE* stream);
+char *plist_to_json_string(plist_t plist);
 
 #endif
@@ -1,4 +1,7 @@
-cdef extern from "libimobiledevice/afc.h":
+from cpython.buffer cimport PyObject_GetBuffer, PyBuffer_Release, PyBUF_WRITABLE, PyBUF_SIMPLE
+from cpython.bytes cimport PyBytes_FromStringAndSize, PyBytes_AS_STRING
+
+cdef extern from "libimobiledevice/afc.h" nogil:
     cdef struct afc_client_private:
         pass
     ctypedef afc_client_private *afc_client_t
@@ -123,44 +126,94 @@ cdef class AfcFile(Base):
         self.close()
 
     cpdef close(self):
-        self.handle_error(afc_file_close(self._client._c_client, self._c_handle))
+        cdef:
+            afc_error_t err
+            afc_client_t c_client = self._client._c_client
+        with nogil:
+            err = afc_file_close(c_client, self._c_handle)
+        self.handle_error(err)
 
     cpdef lock(self, int operation):
-        self.handle_error(afc_file_lock(self._client._c_client, self._c_handle, <afc_lock_op_t>operation))
+        cdef:
+            afc_error_t err
+            afc_client_t c_client = self._client._c_client
+        with nogil:
+            err = afc_file_lock(c_client, self._c_handle, <afc_lock_op_t>operation)
+        self.handle_error(err)
 
     cpdef seek(self, int64_t offset, int whence):
-        self.handle_error(afc_file_seek(self._client._c_client, self._c_handle, offset, whence))
+        cdef:
+            afc_error_t err
+            afc_client_t c_client = self._client._c_client
+        with nogil:
+            err = afc_file_seek(c_client, self._c_handle, offset, whence)
+        self.handle_error(err)
 
     cpdef uint64_t tell(self):
-        cdef uint64_t position
-        self.handle_error(afc_file_tell(self._client._c_client, self._c_handle, &position))
+        cdef:
+            afc_error_t err
+            afc_client_t c_client = self._client._c_client
+            uint64_t position
+        with nogil:
+            err = afc_file_tell(c_client, self._c_handle, &position)
+        self.handle_error(err)
         return position
 
     cpdef truncate(self, uint64_t newsize):
-        self.handle_error(afc_file_truncate(self._client._c_client, self._c_handle, newsize))
+        cdef:
+            afc_error_t err
+            afc_client_t c_client = self._client._c_client
+        with nogil:
+            err = afc_file_truncate(c_client, self._c_handle, newsize)
+        self.handle_error(err)
+
+    cdef uint32_t _read_into(self, char* c_data, uint32_t size) except? 0:
+        cdef:
+            afc_error_t err
+            afc_client_t c_client = self._client._c_client
+            uint32_t bytes_read = 0
+        with nogil:
+            err = afc_file_read(c_client, self._c_handle, c_data, size, &bytes_read)
+        self.handle_error(err)
+        return bytes_read
 
     cpdef bytes read(self, uint32_t size):
         cdef:
             uint32_t bytes_read
-            char* c_data = <char *>malloc(size)
-            bytes result
+            bytes result = PyBytes_FromStringAndSize(NULL, size)
+        # read straight into the new bytes object, only a short read copies
+        bytes_read = self._read_into(PyBytes_AS_STRING(result), size)
+        if bytes_read < size:
+            result = result[:bytes_read]
+        return result
+
+    cpdef uint32_t readinto(self, object buf):
+        """Reads into a writable buffer like a bytearray or memoryview.
+
+        Returns the number of bytes read, which is 0 at the end of the file.
+        """
+        cdef:
+            Py_buffer view
+            uint32_t size
+        PyObject_GetBuffer(buf, &view, PyBUF_SIMPLE | PyBUF_WRITABLE)
         try:
-            self.handle_error(afc_file_read(self._client._c_client, self._c_handle, c_data, size, &bytes_read))
-            result = c_data[:bytes_read]
-            return result
-        except BaseError, e:
-            raise
+            size = <uint32_t>view.len if view.len < 0xffffffff else 0xffffffff
+            if size == 0:
+                return 0
+            return self._read_into(<char*>view.buf, size)
         finally:
-            free(c_data)
+            PyBuffer_Release(&view)
 
     cpdef uint32_t write(self, bytes data):
         cdef:
+            afc_error_t err
+            afc_client_t c_client = self._client._c_client
             uint32_t bytes_written
             char* c_data = data
-        try:
-            self.handle_error(afc_file_write(self._client._c_client, self._c_handle, c_data, len(data), &bytes_written))
-        except BaseError, e:
-            raise
+            uint32_t length = len(data)
+        with nogil:
+            err = afc_file_write(c_client, self._c_handle, c_data, length, &bytes_written)
+        self.handle_error(err)
 
         return bytes_written
 
@@ -172,13 +225,17 @@ cdef class AfcClient(BaseService):
     cdef afc_client_t _c_client
 
     def __cinit__(self, iDevice device = None, LockdownServiceDescriptor descriptor = None, *args, **kwargs):
+        cdef afc_error_t err
         if (device is not None and descriptor is not None):
-            self.handle_error(afc_client_new(device._c_dev, descriptor._c_service_descriptor, &(self._c_client)))
+            with nogil:
+                err = afc_client_new(device._c_dev, descriptor._c_service_descriptor, &(self._c_client))
+            self.handle_error(err)
     
     def __dealloc__(self):
         cdef afc_error_t err
         if self._c_client is not NULL:
-            err = afc_client_free(self._c_client)
+            with nogil:
+                err = afc_client_free(self._c_client)
             self.handle_error(err)
 
     cdef BaseError _error(self, int16_t ret):
@@ -191,7 +248,8 @@ cdef class AfcClient(BaseService):
             bytes info
             int i = 0
             list result = []
-        err = afc_get_device_info(self._c_client, &infos)
+        with nogil:
+            err = afc_get_device_info(self._c_client, &infos)
         try:
             self.handle_error(err)
         except BaseError, e:
@@ -212,9 +270,11 @@ cdef class AfcClient(BaseService):
             afc_error_t err
             char** dir_list = NULL
             bytes f
+            char* c_directory = directory
             int i = 0
             list result = []
-        err = afc_read_directory(self._c_client, directory, &dir_list)
+        with nogil:
+            err = afc_read_directory(self._c_client, c_directory, &dir_list)
         try:
             self.handle_error(err)
         except BaseError, e:
@@ -232,7 +292,9 @@ cdef class AfcClient(BaseService):
 
     cpdef AfcFile open(self, bytes filename, bytes mode=b'r'):
         cdef:
+            afc_error_t err
             afc_file_mode_t c_mode
+            char* c_filename = filename
             uint64_t handle
             AfcFile f
         if mode == <bytes>'r':
@@ -250,7 +312,9 @@ cdef class AfcClient(BaseService):
         else:
             raise ValueError("mode string must be 'r', 'r+', 'w', 'w+', 'a', or 'a+'")
 
-        self.handle_error(afc_file_open(self._c_client, filename, c_mode, &handle))
+        with nogil:
+            err = afc_file_open(self._c_client, c_filename, c_mode, &handle)
+        self.handle_error(err)
         f = AfcFile.__new__(AfcFile)
         f._c_handle = handle
         f._client = self
@@ -260,12 +324,16 @@ cdef class AfcClient(BaseService):
 
     cpdef list get_file_info(self, bytes path):
         cdef:
+            afc_error_t err
+            char* c_path = path
             list result = []
             char** c_result = NULL
             int i = 0
             bytes info
         try:
-            self.handle_error(afc_get_file_info(self._c_client, path, &c_result))
+            with nogil:
+                err = afc_get_file_info(self._c_client, c_path, &c_result)
+            self.handle_error(err)
         except BaseError, e:
             raise
         finally:
@@ -280,32 +348,69 @@ cdef class AfcClient(BaseService):
         return result
 
     cpdef remove_path(self, bytes path):
-        self.handle_error(afc_remove_path(self._c_client, path))
+        cdef:
+            afc_error_t err
+            char* c_path = path
+        with nogil:
+            err = afc_remove_path(self._c_client, c_path)
+        self.handle_error(err)
 
     cpdef rename_path(self, bytes f, bytes t):
-        self.handle_error(afc_rename_path(self._c_client, f, t))
+        cdef:
+            afc_error_t err
+            char* c_from = f
+            char* c_to = t
+        with nogil:
+            err = afc_rename_path(self._c_client, c_from, c_to)
+        self.handle_error(err)
 
     cpdef make_directory(self, bytes d):
-        self.handle_error(afc_make_directory(self._c_client, d))
+        cdef:
+            afc_error_t err
+            char* c_dir = d
+        with nogil:
+            err = afc_make_directory(self._c_client, c_dir)
+        self.handle_error(err)
 
     cpdef truncate(self, bytes path, uint64_t newsize):
-        self.handle_error(afc_truncate(self._c_client, path, newsize))
+        cdef:
+            afc_error_t err
+            char* c_path = path
+        with nogil:
+            err = afc_truncate(self._c_client, c_path, newsize)
+        self.handle_error(err)
+
+    cdef _make_link(self, afc_link_type_t linktype, bytes source, bytes link_name):
+        cdef:
+            afc_error_t err
+            char* c_source = source
+            char* c_link_name = link_name
+        with nogil:
+            err = afc_make_link(self._c_client, linktype, c_source, c_link_name)
+        self.handle_error(err)
 
     cpdef link(self, bytes source, bytes link_name):
-        self.handle_error(afc_make_link(self._c_client, AFC_HARDLINK, source, link_name))
+        self._make_link(AFC_HARDLINK, source, link_name)
 
     cpdef symlink(self, bytes source, bytes link_name):
-        self.handle_error(afc_make_link(self._c_client, AFC_SYMLINK, source, link_name))
+        self._make_link(AFC_SYMLINK, source, link_name)
 
     cpdef set_file_time(self, bytes path, uint64_t mtime):
-        self.handle_error(afc_set_file_time(self._c_client, path, mtime))
+        cdef:
+            afc_error_t err
+            char* c_path = path
+        with nogil:
+            err = afc_set_file_time(self._c_client, c_path, mtime)
+        self.handle_error(err)
 
 cdef class Afc2Client(AfcClient):
     __service_name__ = "com.apple.afc2"
 
     cpdef AfcFile open(self, bytes filename, bytes mode=b'r'):
         cdef:
+            afc_error_t err
             afc_file_mode_t c_mode
+            char* c_filename = filename
             uint64_t handle
             AfcFile f
         if mode == <bytes>'r':
@@ -323,7 +428,9 @@ cdef class Afc2Client(AfcClient):
         else:
             raise ValueError("mode string must be 'r', 'r+', 'w', 'w+', 'a', or 'a+'")
 
-        self.handle_error(afc_file_open(self._c_client, filename, c_mode, &handle))
+        with nogil:
+            err = afc_file_open(self._c_client, c_filename, c_mode, &handle)
+        self.handle_error(err)
         f = AfcFile.__new__(AfcFile)
         f._c_handle = handle
         f._client = <AfcClient>self
@@ -1,4 +1,4 @@
-cdef extern from "libimobiledevice/debugserver.h":
+cdef extern from "libimobiledevice/debugserver.h" nogil:
     cdef struct debugserver_client_private:
         pass
     ctypedef debugserver_client_private *debugserver_client_t
@@ -23,6 +23,7 @@ cdef extern from "libimobiledevice/debugserver.h":
     debugserver_error_t debugserver_client_receive_response(debugserver_client_t client, char** response, size_t* response_size)
     debugserver_error_t debugserver_client_set_argv(debugserver_client_t client, int argc, char* argv[], char** response)
     debugserver_error_t debugserver_client_set_environment_hex_encoded(debugserver_client_t client, const char* env, char** response)
+    debugserver_error_t debugserver_client_launch(debugserver_client_t client, int argc, char* argv[], char* env[], char** response)
 
     debugserver_error_t debugserver_command_new(const char* name, int argc, const char* argv[], debugserver_command_t* command)
     debugserver_error_t debugserver_command_free(debugserver_command_t command)
@@ -59,11 +60,14 @@ cdef class DebugServerCommand(Base):
 
     def __init__(self, bytes name, int argc = 0, argv = None, *args, **kwargs):
         cdef:
+            debugserver_error_t err
             char* c_name = name
             char** c_argv = to_cstring_array(argv)
 
         try:
-            self.handle_error(debugserver_command_new(c_name, argc, c_argv, &self._c_command))
+            with nogil:
+                err = debugserver_command_new(c_name, argc, c_argv, &self._c_command)
+            self.handle_error(err)
         except BaseError, e:
             raise
         finally:
@@ -78,7 +82,8 @@ cdef class DebugServerCommand(Base):
     cdef free(self):
         cdef debugserver_error_t err
         if self._c_command is not NULL:
-            err = debugserver_command_free(self._c_command)
+            with nogil:
+                err = debugserver_command_free(self._c_command)
             self.handle_error(err)
 
     cdef inline BaseError _error(self, int16_t ret):
@@ -90,13 +95,17 @@ cdef class DebugServerClient(BaseService):
     cdef debugserver_client_t _c_client
 
     def __cinit__(self, iDevice device = None, LockdownServiceDescriptor descriptor = None, *args, **kwargs):
+        cdef debugserver_error_t err
         if (device is not None and descriptor is not None):
-            self.handle_error(debugserver_client_new(device._c_dev, descriptor._c_service_descriptor, &(self._c_client)))
+            with nogil:
+                err = debugserver_client_new(device._c_dev, descriptor._c_service_descriptor, &(self._c_client))
+            self.handle_error(err)
     
     def __dealloc__(self):
         cdef debugserver_error_t err
         if self._c_client is not NULL:
-            err = debugserver_client_free(self._c_client)
+            with nogil:
+                err = debugserver_client_free(self._c_client)
             self.handle_error(err)
 
     cdef BaseError _error(self, int16_t ret):
@@ -104,22 +113,27 @@ cdef class DebugServerClient(BaseService):
 
     cpdef uint32_t send(self, bytes data):
         cdef:
+            debugserver_error_t err
             uint32_t bytes_send
             char* c_data = data
-        try:
-            self.handle_error(debugserver_client_send(self._c_client, c_data, len(data), &bytes_send))
-        except BaseError, e:
-            raise
+            uint32_t c_size = len(data)
+        with nogil:
+            err = debugserver_client_send(self._c_client, c_data, c_size, &bytes_send)
+        self.handle_error(err)
 
         return bytes_send
 
     cpdef bytes send_command(self, DebugServerCommand command):
         cdef:
+            debugserver_error_t err
+            debugserver_command_t c_command = command._c_command
             char* c_response = NULL
             bytes result
 
         try:
-            self.handle_error(debugserver_client_send_command(self._c_client, command._c_command, &c_response, NULL))
+            with nogil:
+                err = debugserver_client_send_command(self._c_client, c_command, &c_response, NULL)
+            self.handle_error(err)
             if c_response:
                 result = c_response
                 return result
@@ -132,12 +146,15 @@ cdef class DebugServerClient(BaseService):
 
     cpdef bytes receive(self, uint32_t size):
         cdef:
+            debugserver_error_t err
             uint32_t bytes_received
             char* c_data = <char *>malloc(size)
             bytes result
 
         try:
-            self.handle_error(debugserver_client_receive(self._c_client, c_data, size, &bytes_received))
+            with nogil:
+                err = debugserver_client_receive(self._c_client, c_data, size, &bytes_received)
+            self.handle_error(err)
             result = c_data[:bytes_received]
             return result
         except BaseError, e:
@@ -147,12 +164,15 @@ cdef class DebugServerClient(BaseService):
 
     cpdef bytes receive_with_timeout(self, uint32_t size, unsigned int timeout):
         cdef:
+            debugserver_error_t err
             uint32_t bytes_received
             char* c_data = <char *>malloc(size)
             bytes result
 
         try:
-            self.handle_error(debugserver_client_receive_with_timeout(self._c_client, c_data, size, &bytes_received, timeout))
+            with nogil:
+                err = debugserver_client_receive_with_timeout(self._c_client, c_data, size, &bytes_received, timeout)
+            self.handle_error(err)
             result = c_data[:bytes_received]
             return result
         except BaseError, e:
@@ -162,11 +182,14 @@ cdef class DebugServerClient(BaseService):
 
     cpdef bytes receive_response(self):
         cdef:
+            debugserver_error_t err
             char* c_response = NULL
             bytes result
 
         try:
-            self.handle_error(debugserver_client_receive_response(self._c_client, &c_response, NULL))
+            with nogil:
+                err = debugserver_client_receive_response(self._c_client, &c_response, NULL)
+            self.handle_error(err)
             if c_response:
                 result = c_response
                 return result
@@ -179,12 +202,15 @@ cdef class DebugServerClient(BaseService):
 
     cpdef bytes set_argv(self, int argc, argv):
         cdef:
+            debugserver_error_t err
             char** c_argv = to_cstring_array(argv)
             char* c_response = NULL
             bytes result
 
         try:
-            self.handle_error(debugserver_client_set_argv(self._c_client, argc, c_argv, &c_response))
+            with nogil:
+                err = debugserver_client_set_argv(self._c_client, argc, c_argv, &c_response)
+            self.handle_error(err)
             if c_response:
                 result = c_response
                 return result
@@ -198,12 +224,15 @@ cdef class DebugServerClient(BaseService):
 
     cpdef bytes set_environment_hex_encoded(self, bytes env):
         cdef:
+            debugserver_error_t err
             char* c_env = env
             char* c_response = NULL
             bytes result
 
         try:
-            self.handle_error(debugserver_client_set_environment_hex_encoded(self._c_client, c_env, &c_response))
+            with nogil:
+                err = debugserver_client_set_environment_hex_encoded(self._c_client, c_env, &c_response)
+            self.handle_error(err)
             if c_response:
                 result = c_response
                 return result
@@ -214,6 +243,31 @@ cdef class DebugServerClient(BaseService):
         finally:
             free(c_response)
 
+    cpdef launch(self, argv, env=None):
+        cdef:
+            debugserver_error_t err
+            int argc = len(argv)
+            char** c_argv = to_cstring_array(argv)
+            char** c_env = NULL
+            char* c_response = NULL
+            int i
+
+        try:
+            if env:
+                c_env = <char **>malloc((len(env) + 1) * sizeof(char *))
+                for i in range(len(env)):
+                    c_env[i] = PyString_AsString(env[i])
+                c_env[len(env)] = NULL
+            with nogil:
+                err = debugserver_client_launch(self._c_client, argc, c_argv, c_env, &c_response)
+            self.handle_error(err)
+        except BaseError, e:
+            raise
+        finally:
+            free(c_argv)
+            free(c_env)
+            free(c_response)
+
     cpdef bytes encode_string(self, bytes buffer):
         cdef:
             char *c_buffer = buffer
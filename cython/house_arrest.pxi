@@ -1,4 +1,4 @@
-cdef extern from "libimobiledevice/house_arrest.h":
+cdef extern from "libimobiledevice/house_arrest.h" nogil:
     cdef struct house_arrest_client_private:
         pass
     ctypedef house_arrest_client_private *house_arrest_client_t
@@ -37,28 +37,44 @@ cdef class HouseArrestClient(PropertyListService):
     cdef house_arrest_client_t _c_client
 
     def __cinit__(self, iDevice device not None, LockdownServiceDescriptor descriptor, *args, **kwargs):
-        self.handle_error(house_arrest_client_new(device._c_dev, descriptor._c_service_descriptor, &self._c_client))
+        cdef house_arrest_error_t err
+        with nogil:
+            err = house_arrest_client_new(device._c_dev, descriptor._c_service_descriptor, &self._c_client)
+        self.handle_error(err)
 
     def __dealloc__(self):
         cdef house_arrest_error_t err
         if self._c_client is not NULL:
-            err = house_arrest_client_free(self._c_client)
+            with nogil:
+                err = house_arrest_client_free(self._c_client)
             self.handle_error(err)
 
     cdef inline BaseError _error(self, int16_t ret):
         return HouseArrestError(ret)
 
     cpdef send_request(self, plist.Node message):
-        self.handle_error(house_arrest_send_request(self._c_client, message._c_node))
+        cdef:
+            house_arrest_error_t err
+            plist.plist_t c_message = message._c_node
+        with nogil:
+            err = house_arrest_send_request(self._c_client, c_message)
+        self.handle_error(err)
 
     cpdef send_command(self, bytes command, bytes appid):
-        self.handle_error(house_arrest_send_command(self._c_client, command, appid))
+        cdef:
+            house_arrest_error_t err
+            char* c_command = command
+            char* c_appid = appid
+        with nogil:
+            err = house_arrest_send_command(self._c_client, c_command, c_appid)
+        self.handle_error(err)
 
     cpdef plist.Node get_result(self):
         cdef:
             plist.plist_t c_node = NULL
             house_arrest_error_t err
-        err = house_arrest_get_result(self._c_client, &c_node)
+        with nogil:
+            err = house_arrest_get_result(self._c_client, &c_node)
         try:
             self.handle_error(err)
             return plist.plist_t_to_node(c_node)
@@ -72,7 +88,8 @@ cdef class HouseArrestClient(PropertyListService):
             afc_client_t c_afc_client = NULL
             AfcClient result
             afc_error_t err
-        err = afc_client_new_from_house_arrest_client(self._c_client, &c_afc_client)
+        with nogil:
+            err = afc_client_new_from_house_arrest_client(self._c_client, &c_afc_client)
         try:
             result = AfcClient.__new__(AfcClient)
             result._c_client = c_afc_client
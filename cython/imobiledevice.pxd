@@ -45,6 +45,7 @@ cdef class iDeviceConnection(Base):
     cpdef bytes receive_timeout(self, uint32_t max_len, unsigned int timeout)
     cpdef bytes receive(self, max_len)
     cpdef disconnect(self)
+    cpdef cancel(self)
 
 cdef class iDevice(Base):
     cdef idevice_t _c_dev
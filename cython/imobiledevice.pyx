@@ -31,7 +31,7 @@ cdef class Base:
 
     cdef BaseError _error(self, int16_t ret): pass
 
-cdef extern from "libimobiledevice/libimobiledevice.h":
+cdef extern from "libimobiledevice/libimobiledevice.h" nogil:
     ctypedef enum idevice_error_t:
         IDEVICE_E_SUCCESS = 0
         IDEVICE_E_INVALID_ARG = -1
@@ -40,6 +40,8 @@ cdef extern from "libimobiledevice/libimobiledevice.h":
         IDEVICE_E_NOT_ENOUGH_DATA = -4
         IDEVICE_E_SSL_ERROR = -6
         IDEVICE_E_TIMEOUT = -7
+        IDEVICE_E_DEVICE_DETACHED = -8
+        IDEVICE_E_CANCELLED = -9
     cdef enum idevice_options:
         IDEVICE_LOOKUP_USBMUX = 1 << 1
         IDEVICE_LOOKUP_NETWORK = 1 << 2
@@ -60,6 +62,7 @@ cdef extern from "libimobiledevice/libimobiledevice.h":
     idevice_error_t idevice_connection_send(idevice_connection_t connection, char *data, uint32_t len, uint32_t *sent_bytes)
     idevice_error_t idevice_connection_receive_timeout(idevice_connection_t connection, char *data, uint32_t len, uint32_t *recv_bytes, unsigned int timeout)
     idevice_error_t idevice_connection_receive(idevice_connection_t connection, char *data, uint32_t len, uint32_t *recv_bytes)
+    idevice_error_t idevice_connection_cancel(idevice_connection_t connection)
 
 cdef class iDeviceError(BaseError):
     def __init__(self, *args, **kwargs):
@@ -70,7 +73,9 @@ cdef class iDeviceError(BaseError):
             IDEVICE_E_NO_DEVICE: 'No device',
             IDEVICE_E_NOT_ENOUGH_DATA: 'Not enough data',
             IDEVICE_E_SSL_ERROR: 'SSL Error',
-            IDEVICE_E_TIMEOUT: 'Connection timeout'
+            IDEVICE_E_TIMEOUT: 'Connection timeout',
+            IDEVICE_E_DEVICE_DETACHED: 'Device detached',
+            IDEVICE_E_CANCELLED: 'Cancelled'
         }
         BaseError.__init__(self, *args, **kwargs)
 
@@ -100,11 +105,23 @@ cdef void idevice_event_cb(const_idevice_event_t c_event, void *user_data) with
     (<object>user_data)(event)
 
 def event_subscribe(object callback):
-    cdef iDeviceError err = iDeviceError(idevice_event_subscribe(idevice_event_cb, <void*>callback))
+    cdef:
+        idevice_error_t c_err
+        void* c_user_data = <void*>callback
+        iDeviceError err
+    with nogil:
+        c_err = idevice_event_subscribe(idevice_event_cb, c_user_data)
+    err = iDeviceError(c_err)
     if err: raise err
 
 def event_unsubscribe():
-    cdef iDeviceError err = iDeviceError(idevice_event_unsubscribe())
+    cdef:
+        idevice_error_t c_err
+        iDeviceError err
+    # the event thread may be waiting for the GIL to deliver an event
+    with nogil:
+        c_err = idevice_event_unsubscribe()
+    err = iDeviceError(c_err)
     if err: raise err
 
 def get_device_list():
@@ -113,8 +130,12 @@ def get_device_list():
         int count
         list result
         bytes device
-        iDeviceError err = iDeviceError(idevice_get_device_list(&devices, &count))
+        idevice_error_t c_err
+        iDeviceError err
 
+    with nogil:
+        c_err = idevice_get_device_list(&devices, &count)
+    err = iDeviceError(c_err)
     if err:
         if devices != NULL:
             idevice_device_list_free(devices)
@@ -135,12 +156,15 @@ cdef class iDeviceConnection(Base):
 
     cpdef bytes receive_timeout(self, uint32_t max_len, unsigned int timeout):
         cdef:
+            idevice_error_t err
             uint32_t bytes_received
             char* c_data = <char *>malloc(max_len)
             bytes result
 
         try:
-            self.handle_error(idevice_connection_receive_timeout(self._c_connection, c_data, max_len, &bytes_received, timeout))
+            with nogil:
+                err = idevice_connection_receive_timeout(self._c_connection, c_data, max_len, &bytes_received, timeout)
+            self.handle_error(err)
             result = c_data[:bytes_received]
             return result
         except BaseError, e:
@@ -150,12 +174,16 @@ cdef class iDeviceConnection(Base):
 
     cpdef bytes receive(self, max_len):
         cdef:
+            idevice_error_t err
+            uint32_t c_max_len = max_len
             uint32_t bytes_received
-            char* c_data = <char *>malloc(max_len)
+            char* c_data = <char *>malloc(c_max_len)
             bytes result
 
         try:
-            self.handle_error(idevice_connection_receive(self._c_connection, c_data, max_len, &bytes_received))
+            with nogil:
+                err = idevice_connection_receive(self._c_connection, c_data, c_max_len, &bytes_received)
+            self.handle_error(err)
             result = c_data[:bytes_received]
             return result
         except BaseError, e:
@@ -165,7 +193,14 @@ cdef class iDeviceConnection(Base):
 
     cpdef disconnect(self):
         cdef idevice_error_t err
-        err = idevice_disconnect(self._c_connection)
+        with nogil:
+            err = idevice_disconnect(self._c_connection)
+        self.handle_error(err)
+
+    cpdef cancel(self):
+        cdef idevice_error_t err
+        with nogil:
+            err = idevice_connection_cancel(self._c_connection)
         self.handle_error(err)
 
     cdef BaseError _error(self, int16_t ret):
@@ -175,16 +210,23 @@ from libc.stdlib cimport *
 
 cdef class iDevice(Base):
     def __cinit__(self, object udid=None, *args, **kwargs):
-        cdef char* c_udid = NULL
+        cdef:
+            idevice_error_t err
+            char* c_udid = NULL
         if isinstance(udid, basestring):
             c_udid = <bytes>udid
         elif udid is not None:
             raise TypeError("iDevice's constructor takes a string or None as the udid argument")
-        self.handle_error(idevice_new(&self._c_dev, c_udid))
+        with nogil:
+            err = idevice_new(&self._c_dev, c_udid)
+        self.handle_error(err)
 
     def __dealloc__(self):
+        cdef idevice_error_t err
         if self._c_dev is not NULL:
-            self.handle_error(idevice_free(self._c_dev))
+            with nogil:
+                err = idevice_free(self._c_dev)
+            self.handle_error(err)
 
     cdef BaseError _error(self, int16_t ret):
         return iDeviceError(ret)
@@ -194,7 +236,8 @@ cdef class iDevice(Base):
             idevice_error_t err
             idevice_connection_t c_conn = NULL
             iDeviceConnection conn
-        err = idevice_connect(self._c_dev, port, &c_conn)
+        with nogil:
+            err = idevice_connect(self._c_dev, port, &c_conn)
         try:
             self.handle_error(err)
 
@@ -274,6 +317,184 @@ cdef class PropertyListService(BaseService):
 cdef class DeviceLinkService(PropertyListService):
     pass
 
+from libc.string cimport memcpy, strlen
+from cpython.pythread cimport PyThread_type_lock, PyThread_allocate_lock, PyThread_free_lock, \
+    PyThread_acquire_lock, PyThread_release_lock, WAIT_LOCK
+
+cdef struct native_queue_t:
+    PyThread_type_lock lock
+    char* data
+    size_t length
+    size_t size
+    size_t max_size
+    uint64_t dropped
+    bint signaled
+    void* owner
+
+cdef void native_queue_wake(void* owner) with gil:
+    try:
+        (<NativeQueue>owner)._wake()
+    except Exception:
+        pass
+
+cdef void native_queue_push(native_queue_t* queue, const_char_ptr data, uint32_t length) nogil:
+    # Called from the capture threads of the library. Items are appended as
+    # length prefixed records and the owner is only woken up (taking the GIL)
+    # when the queue turns non-empty, so the consumer is signaled per batch.
+    cdef:
+        size_t needed
+        size_t size
+        char* grown
+        bint wake = 0
+    PyThread_acquire_lock(queue.lock, WAIT_LOCK)
+    needed = queue.length + sizeof(uint32_t) + length
+    if needed > queue.max_size:
+        queue.dropped += 1
+    else:
+        if needed > queue.size:
+            size = queue.size if queue.size > 0 else 4096
+            while size < needed:
+                size *= 2
+            grown = <char*>realloc(queue.data, size)
+            if grown == NULL:
+                queue.dropped += 1
+                PyThread_release_lock(queue.lock)
+                return
+            queue.data = grown
+            queue.size = size
+        memcpy(queue.data + queue.length, &length, sizeof(uint32_t))
+        memcpy(queue.data + queue.length + sizeof(uint32_t), data, length)
+        queue.length = needed
+        if not queue.signaled:
+            queue.signaled = 1
+            wake = 1
+    PyThread_release_lock(queue.lock)
+    if wake:
+        native_queue_wake(queue.owner)
+
+cdef class NativeQueue:
+    """
+    Queue filled by a native callback without holding the GIL.
+
+    wake_callback is invoked from the producing thread whenever the queue
+    turns non-empty; drain() returns everything queued so far at once.
+    """
+    cdef native_queue_t _c_queue
+    cdef public object wake_callback
+
+    def __cinit__(self, size_t max_size=1048576, *args, **kwargs):
+        self._c_queue.lock = PyThread_allocate_lock()
+        if self._c_queue.lock == NULL:
+            raise MemoryError()
+        self._c_queue.max_size = max_size
+        self._c_queue.owner = <void*>self
+
+    def __dealloc__(self):
+        if self._c_queue.data != NULL:
+            free(self._c_queue.data)
+        if self._c_queue.lock != NULL:
+            PyThread_free_lock(self._c_queue.lock)
+
+    cdef _wake(self):
+        if self.wake_callback is not None:
+            self.wake_callback()
+
+    cpdef list drain(self):
+        cdef:
+            char* data
+            size_t length
+            size_t offset = 0
+            uint32_t item_length
+            list result = []
+        # the producer never waits for the GIL while holding the lock
+        PyThread_acquire_lock(self._c_queue.lock, WAIT_LOCK)
+        data = self._c_queue.data
+        length = self._c_queue.length
+        self._c_queue.data = NULL
+        self._c_queue.length = 0
+        self._c_queue.size = 0
+        self._c_queue.signaled = 0
+        PyThread_release_lock(self._c_queue.lock)
+        try:
+            while offset < length:
+                memcpy(&item_length, data + offset, sizeof(uint32_t))
+                offset += sizeof(uint32_t)
+                result.append(data[offset:offset + item_length])
+                offset += item_length
+        finally:
+            free(data)
+        return result
+
+    property dropped:
+        def __get__(self):
+            return self._c_queue.dropped
+
+class NativeQueueIterator(object):
+    """
+    Asynchronous iterator over the items of a NativeQueue for use with asyncio.
+
+    The event loop is only woken up once per batch of queued items. close()
+    ends the iteration after the remaining items have been returned.
+    """
+    def __init__(self, NativeQueue queue not None, stop=None, loop=None):
+        import asyncio, collections
+        self._queue = queue
+        self._stop = stop
+        self._loop = loop if loop is not None else asyncio.get_event_loop()
+        self._pending = collections.deque()
+        self._waiter = None
+        self._closed = False
+        queue.wake_callback = self._wake
+
+    def _wake(self):
+        # runs on the capture thread
+        try:
+            self._loop.call_soon_threadsafe(self._on_wake)
+        except RuntimeError:
+            # event loop already closed
+            pass
+
+    def _on_wake(self):
+        waiter = self._waiter
+        if waiter is not None and waiter.done():
+            waiter = self._waiter = None
+        if waiter is not None:
+            self._deliver(waiter)
+
+    def _deliver(self, future):
+        if not self._pending:
+            self._pending.extend(self._queue.drain())
+        if self._pending:
+            self._waiter = None
+            future.set_result(self._pending.popleft())
+        elif self._closed:
+            self._waiter = None
+            future.set_exception(StopAsyncIteration())
+        else:
+            self._waiter = future
+
+    def __aiter__(self):
+        return self
+
+    def __anext__(self):
+        future = self._loop.create_future()
+        self._deliver(future)
+        return future
+
+    @property
+    def dropped(self):
+        return self._queue.dropped
+
+    def close(self):
+        if self._closed:
+            return
+        self._closed = True
+        if self._stop is not None:
+            self._stop()
+        self._queue.wake_callback = None
+        if self._waiter is not None and not self._waiter.done():
+            self._deliver(self._waiter)
+
 include "lockdown.pxi"
 include "mobilesync.pxi"
 include "notification_proxy.pxi"
@@ -292,3 +513,4 @@ include "misagent.pxi"
 include "house_arrest.pxi"
 include "restore.pxi"
 include "debugserver.pxi"
+include "syslog_relay.pxi"
@@ -1,4 +1,4 @@
-cdef extern from "libimobiledevice/misagent.h":
+cdef extern from "libimobiledevice/misagent.h" nogil:
     cdef struct misagent_client_private:
         pass
     ctypedef misagent_client_private *misagent_client_t
@@ -36,27 +36,35 @@ cdef class MisagentClient(PropertyListService):
     cdef misagent_client_t _c_client
 
     def __cinit__(self, iDevice device not None, LockdownServiceDescriptor descriptor, *args, **kwargs):
-        self.handle_error(misagent_client_new(device._c_dev, descriptor._c_service_descriptor, &self._c_client))
+        cdef misagent_error_t err
+        with nogil:
+            err = misagent_client_new(device._c_dev, descriptor._c_service_descriptor, &self._c_client)
+        self.handle_error(err)
 
     def __dealloc__(self):
         cdef misagent_error_t err
         if self._c_client is not NULL:
-            err = misagent_client_free(self._c_client)
+            with nogil:
+                err = misagent_client_free(self._c_client)
             self.handle_error(err)
 
     cdef inline BaseError _error(self, int16_t ret):
         return MisagentError(ret)
 
     cpdef install(self, plist.Node profile):
-        cdef misagent_error_t err
-        err = misagent_install(self._c_client, profile._c_node)
+        cdef:
+            misagent_error_t err
+            plist.plist_t c_profile = profile._c_node
+        with nogil:
+            err = misagent_install(self._c_client, c_profile)
         self.handle_error(err)
 
     cpdef plist.Node copy(self):
         cdef:
             plist.plist_t c_node = NULL
             misagent_error_t err
-        err = misagent_copy(self._c_client, &c_node)
+        with nogil:
+            err = misagent_copy(self._c_client, &c_node)
         try:
             self.handle_error(err)
             return plist.plist_t_to_node(c_node)
@@ -66,8 +74,11 @@ cdef class MisagentClient(PropertyListService):
             raise
 
     cpdef remove(self, bytes profile_id):
-        cdef misagent_error_t err
-        err = misagent_remove(self._c_client, profile_id)
+        cdef:
+            misagent_error_t err
+            char* c_profile_id = profile_id
+        with nogil:
+            err = misagent_remove(self._c_client, c_profile_id)
         self.handle_error(err)
 
     cpdef int get_status_code(self):
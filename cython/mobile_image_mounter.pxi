@@ -1,4 +1,4 @@
-cdef extern from "libimobiledevice/mobile_image_mounter.h":
+cdef extern from "libimobiledevice/mobile_image_mounter.h" nogil:
     cdef struct mobile_image_mounter_client_private:
         pass
     ctypedef mobile_image_mounter_client_private *mobile_image_mounter_client_t
@@ -32,12 +32,16 @@ cdef class MobileImageMounterClient(PropertyListService):
     cdef mobile_image_mounter_client_t _c_client
 
     def __cinit__(self, iDevice device not None, LockdownServiceDescriptor descriptor, *args, **kwargs):
-        self.handle_error(mobile_image_mounter_new(device._c_dev, descriptor._c_service_descriptor, &self._c_client))
+        cdef mobile_image_mounter_error_t err
+        with nogil:
+            err = mobile_image_mounter_new(device._c_dev, descriptor._c_service_descriptor, &self._c_client)
+        self.handle_error(err)
     
     def __dealloc__(self):
         cdef mobile_image_mounter_error_t err
         if self._c_client is not NULL:
-            err = mobile_image_mounter_free(self._c_client)
+            with nogil:
+                err = mobile_image_mounter_free(self._c_client)
             self.handle_error(err)
 
     cdef inline BaseError _error(self, int16_t ret):
@@ -47,7 +51,9 @@ cdef class MobileImageMounterClient(PropertyListService):
         cdef:
             plist.plist_t c_node = NULL
             mobile_image_mounter_error_t err
-        err = mobile_image_mounter_lookup_image(self._c_client, image_type, &c_node)
+            char* c_image_type = image_type
+        with nogil:
+            err = mobile_image_mounter_lookup_image(self._c_client, c_image_type, &c_node)
 
         try:
             self.handle_error(err)
@@ -61,8 +67,13 @@ cdef class MobileImageMounterClient(PropertyListService):
         cdef:
             plist.plist_t c_node = NULL
             mobile_image_mounter_error_t err
-        err = mobile_image_mounter_mount_image(self._c_client, image_path, image_signature, len(image_signature),
-                                               image_type, &c_node)
+            char* c_image_path = image_path
+            char* c_image_signature = image_signature
+            uint16_t c_signature_size = len(image_signature)
+            char* c_image_type = image_type
+        with nogil:
+            err = mobile_image_mounter_mount_image(self._c_client, c_image_path, c_image_signature, c_signature_size,
+                                                   c_image_type, &c_node)
 
         try:
             self.handle_error(err)
@@ -74,5 +85,6 @@ cdef class MobileImageMounterClient(PropertyListService):
 
     cpdef hangup(self):
         cdef mobile_image_mounter_error_t err
-        err = mobile_image_mounter_hangup(self._c_client)
+        with nogil:
+            err = mobile_image_mounter_hangup(self._c_client)
         self.handle_error(err)
@@ -1,4 +1,4 @@
-cdef extern from "libimobiledevice/mobilebackup.h":
+cdef extern from "libimobiledevice/mobilebackup.h" nogil:
     cdef struct mobilebackup_client_private:
         pass
     ctypedef mobilebackup_client_private *mobilebackup_client_t
@@ -51,37 +51,64 @@ cdef class MobileBackupClient(PropertyListService):
     cdef mobilebackup_client_t _c_client
 
     def __cinit__(self, iDevice device not None, LockdownServiceDescriptor descriptor, *args, **kwargs):
-        self.handle_error(mobilebackup_client_new(device._c_dev, descriptor._c_service_descriptor, &self._c_client))
+        cdef mobilebackup_error_t err
+        with nogil:
+            err = mobilebackup_client_new(device._c_dev, descriptor._c_service_descriptor, &self._c_client)
+        self.handle_error(err)
 
     def __dealloc__(self):
         cdef mobilebackup_error_t err
         if self._c_client is not NULL:
-            err = mobilebackup_client_free(self._c_client)
+            with nogil:
+                err = mobilebackup_client_free(self._c_client)
             self.handle_error(err)
 
     cdef inline BaseError _error(self, int16_t ret):
         return MobileBackupError(ret)
 
     cdef inline int16_t _send(self, plist.plist_t node):
-        return mobilebackup_send(self._c_client, node)
+        cdef mobilebackup_error_t err
+        with nogil:
+            err = mobilebackup_send(self._c_client, node)
+        return err
 
     cdef inline int16_t _receive(self, plist.plist_t* node):
-        return mobilebackup_receive(self._c_client, node)
+        cdef mobilebackup_error_t err
+        with nogil:
+            err = mobilebackup_receive(self._c_client, node)
+        return err
 
     cdef request_backup(self, plist.Node backup_manifest, bytes base_path, bytes proto_version):
-        self.handle_error(mobilebackup_request_backup(self._c_client, backup_manifest._c_node, base_path, proto_version))
+        cdef:
+            mobilebackup_error_t err
+            plist.plist_t c_backup_manifest = backup_manifest._c_node
+            char* c_base_path = base_path
+            char* c_proto_version = proto_version
+        with nogil:
+            err = mobilebackup_request_backup(self._c_client, c_backup_manifest, c_base_path, c_proto_version)
+        self.handle_error(err)
 
     cdef send_backup_file_received(self):
-        self.handle_error(mobilebackup_send_backup_file_received(self._c_client))
+        cdef mobilebackup_error_t err
+        with nogil:
+            err = mobilebackup_send_backup_file_received(self._c_client)
+        self.handle_error(err)
 
     cdef request_restore(self, plist.Node backup_manifest, int flags, proto_version):
-        self.handle_error(mobilebackup_request_restore(self._c_client, backup_manifest._c_node, <mobilebackup_flags_t>flags, proto_version))
+        cdef:
+            mobilebackup_error_t err
+            plist.plist_t c_backup_manifest = backup_manifest._c_node
+            char* c_proto_version = proto_version
+        with nogil:
+            err = mobilebackup_request_restore(self._c_client, c_backup_manifest, <mobilebackup_flags_t>flags, c_proto_version)
+        self.handle_error(err)
 
     cpdef plist.Node receive_restore_file_received(self):
         cdef:
             plist.plist_t c_node = NULL
             mobilebackup_error_t err
-        err = mobilebackup_receive_restore_file_received(self._c_client, &c_node)
+        with nogil:
+            err = mobilebackup_receive_restore_file_received(self._c_client, &c_node)
         try:
             self.handle_error(err)
             return plist.plist_t_to_node(c_node)
@@ -94,7 +121,8 @@ cdef class MobileBackupClient(PropertyListService):
         cdef:
             plist.plist_t c_node = NULL
             mobilebackup_error_t err
-        err = mobilebackup_receive_restore_application_received(self._c_client, &c_node)
+        with nogil:
+            err = mobilebackup_receive_restore_application_received(self._c_client, &c_node)
         try:
             self.handle_error(err)
             return plist.plist_t_to_node(c_node)
@@ -104,7 +132,15 @@ cdef class MobileBackupClient(PropertyListService):
             raise
 
     cdef send_restore_complete(self):
-        self.handle_error(mobilebackup_send_restore_complete(self._c_client))
+        cdef mobilebackup_error_t err
+        with nogil:
+            err = mobilebackup_send_restore_complete(self._c_client)
+        self.handle_error(err)
 
     cdef send_error(self, bytes reason):
-        self.handle_error(mobilebackup_send_error(self._c_client, reason))
+        cdef:
+            mobilebackup_error_t err
+            char* c_reason = reason
+        with nogil:
+            err = mobilebackup_send_error(self._c_client, c_reason)
+        self.handle_error(err)
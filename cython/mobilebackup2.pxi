@@ -1,4 +1,4 @@
-cdef extern from "libimobiledevice/mobilebackup2.h":
+cdef extern from "libimobiledevice/mobilebackup2.h" nogil:
     cdef struct mobilebackup2_client_private:
         pass
     ctypedef mobilebackup2_client_private *mobilebackup2_client_t
@@ -47,26 +47,37 @@ cdef class MobileBackup2Client(PropertyListService):
     cdef mobilebackup2_client_t _c_client
 
     def __cinit__(self, iDevice device not None, LockdownServiceDescriptor descriptor, *args, **kwargs):
-        self.handle_error(mobilebackup2_client_new(device._c_dev, descriptor._c_service_descriptor, &self._c_client))
+        cdef mobilebackup2_error_t err
+        with nogil:
+            err = mobilebackup2_client_new(device._c_dev, descriptor._c_service_descriptor, &self._c_client)
+        self.handle_error(err)
 
     def __dealloc__(self):
         cdef mobilebackup2_error_t err
         if self._c_client is not NULL:
-            err = mobilebackup2_client_free(self._c_client)
+            with nogil:
+                err = mobilebackup2_client_free(self._c_client)
             self.handle_error(err)
 
     cdef inline BaseError _error(self, int16_t ret):
         return MobileBackup2Error(ret)
 
     cdef send_message(self, bytes message, plist.Node options):
-        self.handle_error(mobilebackup2_send_message(self._c_client, message, options._c_node))
+        cdef:
+            mobilebackup2_error_t err
+            char* c_message = message
+            plist.plist_t c_options = options._c_node
+        with nogil:
+            err = mobilebackup2_send_message(self._c_client, c_message, c_options)
+        self.handle_error(err)
 
     cdef tuple receive_message(self):
         cdef:
             char* dlmessage = NULL
             plist.plist_t c_node = NULL
             mobilebackup2_error_t err
-        err = mobilebackup2_receive_message(self._c_client, &c_node, &dlmessage)
+        with nogil:
+            err = mobilebackup2_receive_message(self._c_client, &c_node, &dlmessage)
         try:
             self.handle_error(err)
             return (plist.plist_t_to_node(c_node), <bytes>dlmessage)
@@ -81,7 +92,9 @@ cdef class MobileBackup2Client(PropertyListService):
         cdef:
             uint32_t bytes = 0
             mobilebackup2_error_t err
-        err = mobilebackup2_send_raw(self._c_client, data, length, &bytes)
+            char* c_data = data
+        with nogil:
+            err = mobilebackup2_send_raw(self._c_client, c_data, length, &bytes)
         try:
             self.handle_error(err)
             return <bint>bytes
@@ -92,7 +105,9 @@ cdef class MobileBackup2Client(PropertyListService):
         cdef:
             uint32_t bytes = 0
             mobilebackup2_error_t err
-        err = mobilebackup2_receive_raw(self._c_client, data, length, &bytes)
+            char* c_data = data
+        with nogil:
+            err = mobilebackup2_receive_raw(self._c_client, c_data, length, &bytes)
         try:
             self.handle_error(err)
             return <bint>bytes
@@ -104,7 +119,10 @@ cdef class MobileBackup2Client(PropertyListService):
             double[::1] temp = None
             double remote_version = 0.0
             mobilebackup2_error_t err
-        err = mobilebackup2_version_exchange(self._c_client, &local_versions[0], len(local_versions), &remote_version)
+            double* c_local_versions = &local_versions[0]
+            char c_count = <char>local_versions.shape[0]
+        with nogil:
+            err = mobilebackup2_version_exchange(self._c_client, c_local_versions, c_count, &remote_version)
         try:
             self.handle_error(err)
             return <float>remote_version
@@ -112,7 +130,21 @@ cdef class MobileBackup2Client(PropertyListService):
             raise
 
     cdef send_request(self, bytes request, bytes target_identifier, bytes source_identifier, plist.Node options):
-        self.handle_error(mobilebackup2_send_request(self._c_client, request, target_identifier, source_identifier, options._c_node))
+        cdef:
+            mobilebackup2_error_t err
+            char* c_request = request
+            char* c_target_identifier = target_identifier
+            char* c_source_identifier = source_identifier
+            plist.plist_t c_options = options._c_node
+        with nogil:
+            err = mobilebackup2_send_request(self._c_client, c_request, c_target_identifier, c_source_identifier, c_options)
+        self.handle_error(err)
 
     cdef send_status_response(self, int status_code, bytes status1, plist.Node status2):
-        self.handle_error(mobilebackup2_send_status_response(self._c_client, status_code, status1, status2._c_node))
+        cdef:
+            mobilebackup2_error_t err
+            char* c_status1 = status1
+            plist.plist_t c_status2 = status2._c_node
+        with nogil:
+            err = mobilebackup2_send_status_response(self._c_client, status_code, c_status1, c_status2)
+        self.handle_error(err)
@@ -1,4 +1,4 @@
-cdef extern from "libimobiledevice/notification_proxy.h":
+cdef extern from "libimobiledevice/notification_proxy.h" nogil:
     cdef struct np_client_private:
         pass
     ctypedef np_client_private *np_client_t
@@ -70,9 +70,12 @@ NP_ITDBPREP_DID_END = C_NP_ITDBPREP_DID_END
 NP_LANGUAGE_CHANGED = C_NP_LANGUAGE_CHANGED
 NP_ADDRESS_BOOK_PREF_CHANGED = C_NP_ADDRESS_BOOK_PREF_CHANGED
 
-cdef void np_notify_cb(const_char_ptr notification, void *py_callback):
+cdef void np_notify_cb(const_char_ptr notification, void *py_callback) with gil:
     (<object>py_callback)(notification)
 
+cdef void np_queue_notify_cb(const_char_ptr notification, void *queue) nogil:
+    native_queue_push(<native_queue_t*>queue, notification, strlen(notification))
+
 cdef class NotificationProxyError(BaseError):
     def __init__(self, *args, **kwargs):
         self._lookup_table = {
@@ -87,24 +90,72 @@ cdef class NotificationProxyError(BaseError):
 cdef class NotificationProxyClient(PropertyListService):
     __service_name__ = "com.apple.mobile.notification_proxy"
     cdef np_client_t _c_client
+    cdef object _notify_callback
 
     def __cinit__(self, iDevice device not None, LockdownServiceDescriptor descriptor, *args, **kwargs):
-        self.handle_error(np_client_new(device._c_dev, descriptor._c_service_descriptor, &self._c_client))
+        cdef np_error_t err
+        with nogil:
+            err = np_client_new(device._c_dev, descriptor._c_service_descriptor, &self._c_client)
+        self.handle_error(err)
 
     def __dealloc__(self):
         cdef np_error_t err
         if self._c_client is not NULL:
-            err = np_client_free(self._c_client)
+            with nogil:
+                err = np_client_free(self._c_client)
             self.handle_error(err)
 
     cdef inline BaseError _error(self, int16_t ret):
         return NotificationProxyError(ret)
 
     cpdef set_notify_callback(self, object callback):
-        self.handle_error(np_set_notify_callback(self._c_client, np_notify_cb, <void*>callback))
+        cdef:
+            np_error_t err
+            np_notify_cb_t c_notify_cb = NULL
+            void* c_user_data = NULL
+        if callback is not None:
+            c_notify_cb = np_notify_cb
+            c_user_data = <void*>callback
+        # the notifier thread may be waiting for the GIL to deliver a notification
+        with nogil:
+            err = np_set_notify_callback(self._c_client, c_notify_cb, c_user_data)
+        self.handle_error(err)
+        self._notify_callback = callback
+
+    cpdef notifications(self, size_t max_queued=65536, object loop=None):
+        """
+        Returns an asynchronous iterator over the received notifications,
+        replacing any callback set with set_notify_callback(). Notifications
+        are queued natively and the event loop is woken up once per batch.
+        Closing the iterator removes the callback again.
+        """
+        cdef:
+            np_error_t err
+            NativeQueue queue = NativeQueue(max_queued)
+            void* c_user_data = <void*>&queue._c_queue
+        iterator = NativeQueueIterator(queue, self.stop_notifications, loop)
+        with nogil:
+            err = np_set_notify_callback(self._c_client, np_queue_notify_cb, c_user_data)
+        self.handle_error(err)
+        # keeps the queue alive while the notifier thread uses it
+        self._notify_callback = queue
+        return iterator
+
+    cpdef stop_notifications(self):
+        self.set_notify_callback(None)
 
     cpdef observe_notification(self, bytes notification):
-        self.handle_error(np_observe_notification(self._c_client, notification))
+        cdef:
+            np_error_t err
+            char* c_notification = notification
+        with nogil:
+            err = np_observe_notification(self._c_client, c_notification)
+        self.handle_error(err)
 
     cpdef post_notification(self, bytes notification):
-        self.handle_error(np_post_notification(self._c_client, notification))
+        cdef:
+            np_error_t err
+            char* c_notification = notification
+        with nogil:
+            err = np_post_notification(self._c_client, c_notification)
+        self.handle_error(err)
@@ -1,4 +1,4 @@
-cdef extern from "libimobiledevice/sbservices.h":
+cdef extern from "libimobiledevice/sbservices.h" nogil:
     cdef struct sbservices_client_private:
         pass
     ctypedef sbservices_client_private *sbservices_client_t
@@ -12,6 +12,7 @@ cdef extern from "libimobiledevice/sbservices.h":
     sbservices_error_t sbservices_client_free(sbservices_client_t client)
     sbservices_error_t sbservices_get_icon_state(sbservices_client_t client, plist.plist_t *state, char *format_version)
     sbservices_error_t sbservices_set_icon_state(sbservices_client_t client, plist.plist_t newstate)
+    sbservices_error_t sbservices_set_icon_state_cache(sbservices_client_t client, unsigned int max_age)
     sbservices_error_t sbservices_get_icon_pngdata(sbservices_client_t client, char *bundleId, char **pngdata, uint64_t *pngsize)
 
 cdef class SpringboardServicesError(BaseError):
@@ -31,12 +32,17 @@ cdef class SpringboardServicesClient(PropertyListService):
     cdef char* format_version
 
     def __cinit__(self, iDevice device not None, LockdownServiceDescriptor descriptor, *args, **kwargs):
-        self.handle_error(sbservices_client_new(device._c_dev, descriptor._c_service_descriptor, &self._c_client))
+        cdef sbservices_error_t err
+        with nogil:
+            err = sbservices_client_new(device._c_dev, descriptor._c_service_descriptor, &self._c_client)
+        self.handle_error(err)
         self.format_version = "2"
     
     def __dealloc__(self):
+        cdef sbservices_error_t err
         if self._c_client is not NULL:
-            err = sbservices_client_free(self._c_client)
+            with nogil:
+                err = sbservices_client_free(self._c_client)
             self.handle_error(err)
 
     cdef inline BaseError _error(self, int16_t ret):
@@ -53,7 +59,8 @@ cdef class SpringboardServicesClient(PropertyListService):
             cdef:
                 plist.plist_t c_node = NULL
                 sbservices_error_t err
-            err = sbservices_get_icon_state(self._c_client, &c_node, self.format_version)
+            with nogil:
+                err = sbservices_get_icon_state(self._c_client, &c_node, self.format_version)
             try:
                 self.handle_error(err)
 
@@ -63,14 +70,27 @@ cdef class SpringboardServicesClient(PropertyListService):
                     plist.plist_free(c_node)
                 raise
         def __set__(self, plist.Node newstate not None):
-            self.handle_error(sbservices_set_icon_state(self._c_client, newstate._c_node))
+            cdef:
+                sbservices_error_t err
+                plist.plist_t c_newstate = newstate._c_node
+            with nogil:
+                err = sbservices_set_icon_state(self._c_client, c_newstate)
+            self.handle_error(err)
+
+    cpdef set_icon_state_cache(self, unsigned int max_age):
+        cdef sbservices_error_t err
+        with nogil:
+            err = sbservices_set_icon_state_cache(self._c_client, max_age)
+        self.handle_error(err)
 
     cpdef bytes get_pngdata(self, bytes bundleId):
         cdef:
             char* pngdata = NULL
             uint64_t pngsize
             sbservices_error_t err
-        err = sbservices_get_icon_pngdata(self._c_client, bundleId, &pngdata, &pngsize)
+            char* c_bundleId = bundleId
+        with nogil:
+            err = sbservices_get_icon_pngdata(self._c_client, c_bundleId, &pngdata, &pngsize)
         try:
             self.handle_error(err)
 
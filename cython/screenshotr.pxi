@@ -1,4 +1,4 @@
-cdef extern from "libimobiledevice/screenshotr.h":
+cdef extern from "libimobiledevice/screenshotr.h" nogil:
     cdef struct screenshotr_client_private:
         pass
     ctypedef screenshotr_client_private *screenshotr_client_t
@@ -36,12 +36,16 @@ cdef class ScreenshotrClient(DeviceLinkService):
     cdef screenshotr_client_t _c_client
 
     def __cinit__(self, iDevice device not None, LockdownServiceDescriptor descriptor, *args, **kwargs):
-        self.handle_error(screenshotr_client_new(device._c_dev, descriptor._c_service_descriptor, &self._c_client))
+        cdef screenshotr_error_t err
+        with nogil:
+            err = screenshotr_client_new(device._c_dev, descriptor._c_service_descriptor, &self._c_client)
+        self.handle_error(err)
 
     def __dealloc__(self):
         cdef screenshotr_error_t err
         if self._c_client is not NULL:
-            err = screenshotr_client_free(self._c_client)
+            with nogil:
+                err = screenshotr_client_free(self._c_client)
             self.handle_error(err)
 
     cpdef bytes take_screenshot(self):
@@ -51,7 +55,8 @@ cdef class ScreenshotrClient(DeviceLinkService):
             bytes result
             screenshotr_error_t err
 
-        err = screenshotr_take_screenshot(self._c_client, &c_data, &data_size)
+        with nogil:
+            err = screenshotr_take_screenshot(self._c_client, &c_data, &data_size)
         try:
             self.handle_error(err)
 
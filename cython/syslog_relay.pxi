@@ -0,0 +1,114 @@
+cdef extern from "libimobiledevice/syslog_relay.h" nogil:
+    cdef struct syslog_relay_client_private:
+        pass
+    ctypedef syslog_relay_client_private *syslog_relay_client_t
+
+    ctypedef enum syslog_relay_error_t:
+        SYSLOG_RELAY_E_SUCCESS = 0
+        SYSLOG_RELAY_E_INVALID_ARG = -1
+        SYSLOG_RELAY_E_MUX_ERROR = -2
+        SYSLOG_RELAY_E_SSL_ERROR = -3
+        SYSLOG_RELAY_E_NOT_ENOUGH_DATA = -4
+        SYSLOG_RELAY_E_TIMEOUT = -5
+        SYSLOG_RELAY_E_UNKNOWN_ERROR = -256
+
+    ctypedef void (*syslog_relay_receive_data_cb_t)(const_char_ptr data, uint32_t length, void *user_data)
+
+    ctypedef struct syslog_relay_stats_t:
+        uint64_t bytes_received
+        uint64_t bytes_dropped
+        uint32_t buffer_size
+        uint32_t buffer_used
+
+    syslog_relay_error_t syslog_relay_client_new(idevice_t device, lockdownd_service_descriptor_t service, syslog_relay_client_t * client)
+    syslog_relay_error_t syslog_relay_client_free(syslog_relay_client_t client)
+
+    syslog_relay_error_t syslog_relay_start_capture_lines(syslog_relay_client_t client, syslog_relay_receive_data_cb_t callback, void* user_data)
+    syslog_relay_error_t syslog_relay_stop_capture(syslog_relay_client_t client)
+    syslog_relay_error_t syslog_relay_set_buffer_size(syslog_relay_client_t client, uint32_t size)
+    syslog_relay_error_t syslog_relay_get_stats(syslog_relay_client_t client, syslog_relay_stats_t *stats)
+
+cdef void syslog_relay_queue_line_cb(const_char_ptr data, uint32_t length, void *user_data) nogil:
+    native_queue_push(<native_queue_t*>user_data, data, length)
+
+cdef class SyslogRelayError(BaseError):
+    def __init__(self, *args, **kwargs):
+        self._lookup_table = {
+            SYSLOG_RELAY_E_SUCCESS: "Success",
+            SYSLOG_RELAY_E_INVALID_ARG: "Invalid argument",
+            SYSLOG_RELAY_E_MUX_ERROR: "MUX error",
+            SYSLOG_RELAY_E_SSL_ERROR: "SSL Error",
+            SYSLOG_RELAY_E_NOT_ENOUGH_DATA: 'Not enough data',
+            SYSLOG_RELAY_E_TIMEOUT: 'Connection timeout',
+            SYSLOG_RELAY_E_UNKNOWN_ERROR: "Unknown error"
+        }
+        BaseError.__init__(self, *args, **kwargs)
+
+cdef class SyslogRelayClient(BaseService):
+    __service_name__ = "com.apple.syslog_relay"
+    cdef syslog_relay_client_t _c_client
+    cdef NativeQueue _queue
+
+    def __cinit__(self, iDevice device not None, LockdownServiceDescriptor descriptor, *args, **kwargs):
+        cdef syslog_relay_error_t err
+        with nogil:
+            err = syslog_relay_client_new(device._c_dev, descriptor._c_service_descriptor, &self._c_client)
+        self.handle_error(err)
+
+    def __dealloc__(self):
+        cdef syslog_relay_error_t err
+        if self._c_client is not NULL:
+            # stops a running capture before the queue goes away
+            with nogil:
+                err = syslog_relay_client_free(self._c_client)
+            self.handle_error(err)
+
+    cdef inline BaseError _error(self, int16_t ret):
+        return SyslogRelayError(ret)
+
+    cpdef set_buffer_size(self, uint32_t size):
+        cdef syslog_relay_error_t err
+        with nogil:
+            err = syslog_relay_set_buffer_size(self._c_client, size)
+        self.handle_error(err)
+
+    cpdef lines(self, size_t max_queued=1048576, object loop=None):
+        """
+        Starts capturing the syslog and returns an asynchronous iterator over
+        its lines. Lines are queued natively while the event loop is busy,
+        up to max_queued bytes; lines that do not fit are dropped and counted
+        in the iterator's dropped attribute. Closing the iterator stops the
+        capture.
+        """
+        cdef:
+            syslog_relay_error_t err
+            NativeQueue queue = NativeQueue(max_queued)
+            void* c_user_data = <void*>&queue._c_queue
+        iterator = NativeQueueIterator(queue, self.stop_capture, loop)
+        with nogil:
+            err = syslog_relay_start_capture_lines(self._c_client, syslog_relay_queue_line_cb, c_user_data)
+        self.handle_error(err)
+        self._queue = queue
+        return iterator
+
+    cpdef stop_capture(self):
+        cdef syslog_relay_error_t err
+        # the capture thread may be waiting for the GIL to wake up the consumer
+        with nogil:
+            err = syslog_relay_stop_capture(self._c_client)
+        self._queue = None
+        self.handle_error(err)
+
+    property stats:
+        def __get__(self):
+            cdef:
+                syslog_relay_error_t err
+                syslog_relay_stats_t stats
+            err = syslog_relay_get_stats(self._c_client, &stats)
+            self.handle_error(err)
+            return {
+                'bytes_received': stats.bytes_received,
+                'bytes_dropped': stats.bytes_dropped,
+                'buffer_size': stats.buffer_size,
+                'buffer_used': stats.buffer_used
+            }
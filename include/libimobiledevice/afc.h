@@ -30,6 +30,7 @@ extern "C" {
 
 #include <libimobiledevice/libimobiledevice.h>
 #include <libimobiledevice/lockdown.h>
+#include <libimobiledevice/service.h>
 
 #define AFC_SERVICE_NAME "com.apple.afc"
 
@@ -89,9 +90,109 @@ typedef enum {
 	AFC_LOCK_UN = 8 | 4  /**< unlock */
 } afc_lock_op_t;
 
+/** File types reported by afc_get_file_info_struct() and afc_walk() */
+typedef enum {
+	AFC_FILE_TYPE_UNKNOWN = 0,
+	AFC_FILE_TYPE_REGULAR,      /**< S_IFREG */
+	AFC_FILE_TYPE_DIRECTORY,    /**< S_IFDIR */
+	AFC_FILE_TYPE_SYMLINK,      /**< S_IFLNK */
+	AFC_FILE_TYPE_CHAR_DEVICE,  /**< S_IFCHR */
+	AFC_FILE_TYPE_BLOCK_DEVICE, /**< S_IFBLK */
+	AFC_FILE_TYPE_FIFO,         /**< S_IFIFO */
+	AFC_FILE_TYPE_SOCKET        /**< S_IFSOCK */
+} afc_file_type_t;
+
+/** File information as reported by afc_get_file_info_struct() and afc_walk() */
+typedef struct {
+	uint64_t size;         /**< Size in bytes */
+	uint64_t blocks;       /**< Number of allocated blocks */
+	uint64_t mtime;        /**< Modification time in nanoseconds since the epoch */
+	uint64_t birthtime;    /**< Creation time in nanoseconds since the epoch */
+	uint32_t nlink;        /**< Number of hard links */
+	afc_file_type_t type;  /**< File type */
+} afc_stat_t;
+
+/**
+ * Callback invoked by afc_walk() for each path found.
+ *
+ * @return 0 to continue, a positive value to not descend into the
+ *     directory just reported, or a negative value to stop walking.
+ */
+typedef int (*afc_walk_cb_t)(const char *path, const afc_stat_t *st, void *user_data);
+
+/**
+ * Callback invoked by afc_read_files() for each file.
+ *
+ * @param path The path of the file.
+ * @param error AFC_E_SUCCESS if the file was read or the error that occurred.
+ * @param data The contents of the file, only valid during the callback.
+ * @param length The size of the contents.
+ *
+ * @return 0 to continue or a non-zero value to stop reading.
+ */
+typedef int (*afc_read_files_cb_t)(const char *path, afc_error_t error, const char *data, uint32_t length, void *user_data);
+
+/** Flags for afc_copy_to_host() and afc_copy_from_host() */
+typedef enum {
+	AFC_COPY_PRESERVE_MTIME = 1 << 0, /**< copy the modification time along with the contents */
+	AFC_COPY_RESUME         = 1 << 1  /**< resume from the size of the partially copied target instead of the given offset */
+} afc_copy_flags_t;
+
+/** Progress of afc_remove_tree() */
+typedef struct {
+	uint64_t files_removed;   /**< Number of files and links removed so far */
+	uint64_t dirs_removed;    /**< Number of directories removed so far */
+	uint64_t bytes_removed;   /**< Total size of the files removed so far */
+	uint64_t elapsed_ms;      /**< Milliseconds since the removal started */
+	uint32_t errors;          /**< Number of paths that could not be removed */
+	afc_error_t first_error;  /**< Error of the first path that could not be removed */
+	int server_side;          /**< 1 if the device removed the tree by itself, the counters are 0 then */
+} afc_remove_progress_t;
+
+/**
+ * Callback reporting the progress of afc_remove_tree().
+ *
+ * @return 0 to continue, or non-zero to stop removing.
+ */
+typedef int (*afc_remove_progress_cb_t)(const afc_remove_progress_t *progress, void *user_data);
+
 typedef struct afc_client_private afc_client_private;
 typedef afc_client_private *afc_client_t; /**< The client handle. */
 
+typedef struct afc_transfer_private afc_transfer_private;
+typedef afc_transfer_private *afc_transfer_t; /**< The transfer engine handle. */
+
+typedef struct afc_async_private afc_async_private;
+typedef afc_async_private *afc_async_t; /**< The asynchronous client handle. */
+
+typedef struct afc_dir_private afc_dir_private;
+typedef afc_dir_private *afc_dir_t; /**< A directory listing opened with afc_dir_open(). */
+
+/**
+ * Completion callback of an asynchronous AFC operation. It is invoked from
+ * the receive thread of the asynchronous client, so it should not block.
+ * The data is only valid during the callback, see the individual
+ * operations for what it contains.
+ */
+typedef void (*afc_async_cb_t)(afc_error_t error, const char *data, uint32_t length, void *user_data);
+
+/** Aggregate progress of an afc_transfer_run() */
+typedef struct {
+	uint64_t bytes_total;  /**< Bytes to transfer in total */
+	uint64_t bytes_done;   /**< Bytes transferred so far */
+	uint32_t files_total;  /**< Number of files to transfer */
+	uint32_t files_done;   /**< Number of files transferred completely */
+	uint32_t files_failed; /**< Number of files that failed to transfer */
+} afc_transfer_progress_t;
+
+/**
+ * Callback reporting the progress of afc_transfer_run(). It is invoked from
+ * the worker threads, but never concurrently.
+ *
+ * @return 0 to continue, or non-zero to cancel the transfer.
+ */
+typedef int (*afc_transfer_progress_cb_t)(const afc_transfer_progress_t *progress, void *user_data);
+
 /* Interface */
 
 /**
@@ -129,6 +230,42 @@ afc_error_t afc_client_start_service(idevice_t device, afc_client_t* client, con
  */
 afc_error_t afc_client_free(afc_client_t client);
 
+/**
+ * Enables or disables caching of file information and directory listings.
+ * Results of afc_get_file_info(), afc_get_file_info_struct() and
+ * afc_read_directory() are then answered from memory until they expire.
+ * Changes made through the same client, e.g. by afc_file_write(),
+ * afc_remove_path(), afc_rename_path() or afc_make_directory(), drop the
+ * affected entries right away. Changes made by the device itself or through
+ * other clients only become visible after the entries expired.
+ *
+ * @note Operations submitted through an afc_async_t bypass the cache.
+ *
+ * @param client The AFC client to configure.
+ * @param ttl The time in milliseconds results are kept, or 0 to disable
+ *     the cache (the default).
+ * @param max_size The maximum amount of memory in bytes the cache may use,
+ *     or 0 for the default of 4 MiB. Least recently used entries are
+ *     dropped first.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value. Any entries
+ *     cached so far are dropped.
+ */
+afc_error_t afc_client_set_cache(afc_client_t client, uint32_t ttl, uint32_t max_size);
+
+/**
+ * Gets the service client an AFC client communicates through, for example
+ * to query its I/O statistics with service_client_get_stats(). It stays
+ * owned by the AFC client.
+ *
+ * @param client The AFC client.
+ * @param service_client Pointer that will be set to the service client.
+ *
+ * @return AFC_E_SUCCESS on success or AFC_E_INVALID_ARG if an argument is
+ *     NULL.
+ */
+afc_error_t afc_client_get_service_client(afc_client_t client, service_client_t *service_client);
+
 /**
  * Get device information for a connected client. The device information
  * returned is the device model as well as the free space, the total capacity
@@ -156,6 +293,45 @@ afc_error_t afc_get_device_info(afc_client_t client, char ***device_information)
  */
 afc_error_t afc_read_directory(afc_client_t client, const char *path, char ***directory_information);
 
+/**
+ * Gets a directory listing to iterate with afc_dir_next(). Unlike
+ * afc_read_directory() this doesn't build a list with a copy of every name;
+ * the names are returned in place from the reply of the device, which is the
+ * only allocation. The iterator doesn't use the client, which can be used
+ * for other requests while iterating.
+ *
+ * @param client The client to get a directory listing from.
+ * @param path The directory for listing. (must be a fully-qualified path)
+ * @param dir Pointer that will be set to the directory listing. Free with
+ *        afc_dir_close().
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+afc_error_t afc_dir_open(afc_client_t client, const char *path, afc_dir_t *dir);
+
+/**
+ * Gets the next entry of a directory listing, skipping "." and "..".
+ *
+ * @param dir The directory listing opened with afc_dir_open().
+ * @param name Pointer that will be set to the name of the next entry, or to
+ *        NULL after the last one. The name stays valid until the listing is
+ *        closed.
+ *
+ * @return AFC_E_SUCCESS on success or AFC_E_INVALID_ARG if an argument is
+ *     NULL.
+ */
+afc_error_t afc_dir_next(afc_dir_t dir, const char **name);
+
+/**
+ * Frees a directory listing opened with afc_dir_open(), along with the
+ * names returned by afc_dir_next().
+ *
+ * @param dir The directory listing to free.
+ *
+ * @return AFC_E_SUCCESS on success or AFC_E_INVALID_ARG if dir is NULL.
+ */
+afc_error_t afc_dir_close(afc_dir_t dir);
+
 /**
  * Gets information about a specific file.
  *
@@ -169,6 +345,73 @@ afc_error_t afc_read_directory(afc_client_t client, const char *path, char ***di
  */
 afc_error_t afc_get_file_info(afc_client_t client, const char *path, char ***file_information);
 
+/**
+ * Gets information about a specific file, parsed into an afc_stat_t.
+ * Unlike afc_get_file_info() this does not allocate memory, except for the
+ * link target if requested.
+ *
+ * @param client The client to use to get the information of the file.
+ * @param path The fully-qualified path to the file.
+ * @param st Pointer to an afc_stat_t that will be filled with the file
+ *        information.
+ * @param link_target If not NULL, will be set to a newly allocated string
+ *        with the target of a symbolic link, or NULL if the file is not a
+ *        symbolic link. Free with free().
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+afc_error_t afc_get_file_info_struct(afc_client_t client, const char *path, afc_stat_t *st, char **link_target);
+
+/**
+ * Walks the directory tree below the given path and reports every entry
+ * along with its file information, starting with the path itself.
+ *
+ * Directory listings and file information requests are pipelined so that
+ * up to max_pending requests are in flight at the same time instead of
+ * waiting a round trip for every single entry. Results are passed to the
+ * callback in batches without holding the client lock, so the callback may
+ * use the client itself, for example to read the file just reported.
+ * Entries that vanish or cannot be accessed while walking are skipped.
+ *
+ * @param client The client to use.
+ * @param path The fully-qualified path to start at.
+ * @param max_pending Maximum number of requests in flight, or 0 for a
+ *        default value.
+ * @param callback Callback invoked for every entry.
+ * @param user_data Custom pointer passed to the callback.
+ *
+ * @return AFC_E_SUCCESS on success, AFC_E_INVALID_ARG when one or more
+ *     parameters are invalid or an AFC_E_* error value if path could not
+ *     be accessed or the connection failed. Stopping the walk from the
+ *     callback is not an error.
+ */
+afc_error_t afc_walk(afc_client_t client, const char *path, unsigned int max_pending, afc_walk_cb_t callback, void *user_data);
+
+/**
+ * Reads a list of files completely with open, read and close requests of
+ * many files kept in flight at the same time, instead of waiting several
+ * round trips per file. Meant for large numbers of small files, since every
+ * file is read into memory as a whole before it is passed to the callback.
+ *
+ * Results are passed to the callback in rounds without holding the client
+ * lock, so the callback may use the client itself.
+ *
+ * @param client The client to use.
+ * @param paths The fully-qualified paths of the files to read.
+ * @param count The number of paths.
+ * @param max_pending Maximum number of requests in flight, or 0 for a
+ *        default value.
+ * @param callback Callback invoked once for every file, in the order the
+ *        files complete, unless reading was stopped or the connection failed.
+ * @param user_data Custom pointer passed to the callback.
+ *
+ * @return AFC_E_SUCCESS on success, AFC_E_INVALID_ARG when one or more
+ *     parameters are invalid or an AFC_E_* error value if the connection
+ *     failed. Failures of individual files are only reported through the
+ *     callback. Stopping from the callback is not an error.
+ */
+afc_error_t afc_read_files(afc_client_t client, const char **paths, unsigned int count, unsigned int max_pending, afc_read_files_cb_t callback, void *user_data);
+
 /**
  * Opens a file on the device.
  *
@@ -216,6 +459,31 @@ afc_error_t afc_file_lock(afc_client_t client, uint64_t handle, afc_lock_op_t op
  */
 afc_error_t afc_file_read(afc_client_t client, uint64_t handle, char *data, uint32_t length, uint32_t *bytes_read);
 
+/**
+ * Attempts to read the given number of bytes from the given file, keeping
+ * multiple read requests in flight to avoid waiting one round trip per chunk.
+ * The data is delivered in file order starting at the current file position.
+ *
+ * @param client The relevant AFC client
+ * @param handle File handle of a previously opened file
+ * @param data The pointer to the memory region to store the read data
+ * @param length The number of bytes to read
+ * @param chunk_size The size of each individual read request, or 0 to let
+ *        the client pick it. It then starts at the FSBlockSize of the device
+ *        and is adjusted to the throughput observed by earlier transfers.
+ * @param max_pending The maximum number of outstanding read requests, or 0
+ *        to use the default.
+ * @param bytes_read The number of bytes actually read. This is less than
+ *        length if the end of the file has been reached. If a read request
+ *        fails, it is set to the number of bytes delivered in order before
+ *        the failed chunk.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value. On error the
+ *         file position on the device is undefined, seek to the offset
+ *         after the delivered data before reading again.
+ */
+afc_error_t afc_file_read_pipelined(afc_client_t client, uint64_t handle, char *data, uint32_t length, uint32_t chunk_size, uint32_t max_pending, uint32_t *bytes_read);
+
 /**
  * Writes a given number of bytes to a file.
  *
@@ -229,6 +497,26 @@ afc_error_t afc_file_read(afc_client_t client, uint64_t handle, char *data, uint
  */
 afc_error_t afc_file_write(afc_client_t client, uint64_t handle, const char *data, uint32_t length, uint32_t *bytes_written);
 
+/**
+ * Sets how many file writes may be outstanding on a client. With a window
+ * larger than 1, afc_file_write() returns as soon as the data has been sent
+ * and the status replies are collected while later writes are sent. A
+ * failed write is reported by the next afc_file_write() or afc_file_close()
+ * for the same file. Any other operation on the client first collects all
+ * outstanding replies.
+ *
+ * @note Windowed writes can't be used while an afc_async_t is attached
+ *     to the client.
+ *
+ * @param client The client to set the write window for.
+ * @param window The number of writes that may be in flight, 0 or 1 to wait
+ *     for every write to complete (the default), at most 32.
+ *
+ * @return AFC_E_SUCCESS on success, AFC_E_OBJECT_BUSY if window is larger
+ *     than 1 while an afc_async_t is attached, or an AFC_E_* error value.
+ */
+afc_error_t afc_file_set_write_window(afc_client_t client, unsigned int window);
+
 /**
  * Seeks to a given position of a pre-opened file on the device.
  *
@@ -344,6 +632,26 @@ afc_error_t afc_set_file_time(afc_client_t client, const char *path, uint64_t mt
  */
 afc_error_t afc_remove_path_and_contents(afc_client_t client, const char *path);
 
+/**
+ * Deletes a file or directory including possible contents, like
+ * afc_remove_path_and_contents(), on any device. If the device does not
+ * support removing a tree by itself, the tree is walked with afc_walk()
+ * and removed files first, then directories deepest first, with many
+ * pipelined remove requests in flight instead of one round trip per path.
+ * Paths that cannot be removed are skipped and counted.
+ *
+ * @param client The client to use.
+ * @param path The path to delete. (must be a fully-qualified path)
+ * @param callback Callback reporting progress periodically and once the
+ *        removal is done, or NULL.
+ * @param user_data Custom pointer passed to the callback.
+ *
+ * @return AFC_E_SUCCESS on success, AFC_E_OP_INTERRUPTED if the callback
+ *         stopped the removal, or the AFC_E_* error value of the first path
+ *         that could not be removed.
+ */
+afc_error_t afc_remove_tree(afc_client_t client, const char *path, afc_remove_progress_cb_t callback, void *user_data);
+
 /* Helper functions */
 
 /**
@@ -359,6 +667,56 @@ afc_error_t afc_remove_path_and_contents(afc_client_t client, const char *path);
  */
 afc_error_t afc_get_device_info_key(afc_client_t client, const char *key, char **value);
 
+/**
+ * Copies a file from the device to a host file descriptor, using large
+ * pipelined reads. The data is written at the same offset in the host file
+ * as it has in the device file, and the host file is truncated to the size
+ * of the device file afterwards.
+ *
+ * @param client The client to use.
+ * @param device_path The fully-qualified path of a regular file on the device.
+ * @param fd A host file descriptor opened for writing.
+ * @param offset The offset to resume copying from, 0 to copy the whole file.
+ *        Ignored with AFC_COPY_RESUME, which resumes from the size of the
+ *        host file.
+ * @param flags Bitwise or'ed afc_copy_flags_t values.
+ * @param bytes_copied If not NULL, set to the number of bytes copied, also
+ *        on error so a later call can resume.
+ *
+ * When resuming, the data in front of the offset is read back and compared
+ * with the host file, and blocks that differ are copied again.
+ *
+ * @return AFC_E_SUCCESS on success, AFC_E_INVALID_ARG if device_path is not
+ *         a regular file, AFC_E_IO_ERROR if writing to the host file failed,
+ *         or another AFC_E_* error value.
+ */
+afc_error_t afc_copy_to_host(afc_client_t client, const char *device_path, int fd, uint64_t offset, uint32_t flags, uint64_t *bytes_copied);
+
+/**
+ * Copies a host file to the device, sending it in pipelined writes straight
+ * from a memory mapping of the file where available. Unless resuming, the
+ * device file is created or truncated.
+ *
+ * @param client The client to use.
+ * @param fd A file descriptor of a regular host file opened for reading.
+ * @param device_path The fully-qualified path to store the file at.
+ * @param offset The offset to resume copying from, 0 to copy the whole file.
+ *        Ignored with AFC_COPY_RESUME, which resumes from the size of the
+ *        device file.
+ * @param flags Bitwise or'ed afc_copy_flags_t values. With
+ *        AFC_COPY_PRESERVE_MTIME the modification time is set with
+ *        afc_set_file_time().
+ * @param bytes_copied If not NULL, set to the number of bytes copied.
+ *
+ * When resuming, the data in front of the offset is read back from the
+ * device and compared with the host file, and blocks that differ are sent
+ * again. The device file is truncated to the size of the host file.
+ *
+ * @return AFC_E_SUCCESS on success, AFC_E_INVALID_ARG if fd is not a regular
+ *         file, or another AFC_E_* error value.
+ */
+afc_error_t afc_copy_from_host(afc_client_t client, int fd, const char *device_path, uint64_t offset, uint32_t flags, uint64_t *bytes_copied);
+
 /**
  * Frees up a char dictionary as returned by some AFC functions.
  *
@@ -368,6 +726,258 @@ afc_error_t afc_get_device_info_key(afc_client_t client, const char *key, char *
  */
 afc_error_t afc_dictionary_free(char **dictionary);
 
+/* Parallel transfers */
+
+/**
+ * Creates a transfer engine with a pool of connections to the AFC service
+ * of the device. Files added to the engine are transferred in parallel
+ * over all connections, large files in ranges, so that a single large
+ * file is not limited to the throughput of one connection either.
+ *
+ * @param device The device to connect to.
+ * @param num_connections The number of AFC connections to open, 0 for a
+ *        default of 4. If fewer connections can be opened, the engine
+ *        works with the ones it got.
+ * @param label The label to use for communication. Usually the program name.
+ * @param transfer Pointer that will be set to the new transfer engine.
+ *        Must be freed using afc_transfer_free() after use.
+ *
+ * @return AFC_E_SUCCESS on success, or an AFC_E_* error code if not even
+ *         one connection could be opened.
+ */
+afc_error_t afc_transfer_new(idevice_t device, unsigned int num_connections, const char *label, afc_transfer_t *transfer);
+
+/**
+ * Creates a transfer engine with a pool of AFC connections to the container
+ * of an app, vended by the house_arrest service.
+ *
+ * @param device The device to connect to.
+ * @param bundle_id The bundle identifier of the app.
+ * @param command The house_arrest command to use, "VendContainer" or
+ *        "VendDocuments". NULL defaults to "VendContainer".
+ * @param num_connections The number of connections to open, 0 for a
+ *        default of 4.
+ * @param label The label to use for communication. Usually the program name.
+ * @param transfer Pointer that will be set to the new transfer engine.
+ *        Must be freed using afc_transfer_free() after use.
+ *
+ * @return AFC_E_SUCCESS on success, AFC_E_PERM_DENIED if the device refused
+ *         to vend the container, or an AFC_E_* error code otherwise.
+ */
+afc_error_t afc_transfer_new_with_house_arrest(idevice_t device, const char *bundle_id, const char *command, unsigned int num_connections, const char *label, afc_transfer_t *transfer);
+
+/**
+ * Closes all connections of a transfer engine and frees it.
+ *
+ * @param transfer The transfer engine to free.
+ *
+ * @return AFC_E_SUCCESS on success or AFC_E_INVALID_ARG if transfer is NULL.
+ */
+afc_error_t afc_transfer_free(afc_transfer_t transfer);
+
+/**
+ * Adds a file to download from the device to the next afc_transfer_run().
+ *
+ * @param transfer The transfer engine to use.
+ * @param device_path The fully-qualified path of a regular file on the device.
+ * @param local_path The local path to store the file at. It is created or
+ *        overwritten.
+ *
+ * @return AFC_E_SUCCESS on success, AFC_E_INVALID_ARG if device_path is not
+ *         a regular file, or an AFC_E_* error code if it can't be accessed.
+ */
+afc_error_t afc_transfer_add_download(afc_transfer_t transfer, const char *device_path, const char *local_path);
+
+/**
+ * Adds a file to upload to the device to the next afc_transfer_run().
+ *
+ * @param transfer The transfer engine to use.
+ * @param local_path The path of a regular local file.
+ * @param device_path The fully-qualified path to store the file at on the
+ *        device. It is created or overwritten.
+ *
+ * @return AFC_E_SUCCESS on success or AFC_E_INVALID_ARG if local_path is not
+ *         a regular file.
+ */
+afc_error_t afc_transfer_add_upload(afc_transfer_t transfer, const char *local_path, const char *device_path);
+
+/**
+ * Transfers all files added to the engine and waits until they are done.
+ * Whole files, and ranges of large files, are distributed over the
+ * connections; a connection running out of work takes over pending work of
+ * the busiest one. After returning, further files can be added for another
+ * run.
+ *
+ * @param transfer The transfer engine to use.
+ * @param progress_cb Callback to report progress to, or NULL.
+ * @param user_data Custom pointer passed to the callback.
+ *
+ * @return AFC_E_SUCCESS if all files have been transferred,
+ *         AFC_E_OP_INTERRUPTED if the transfer got cancelled, or the
+ *         AFC_E_* error code of the first file that failed. The other files
+ *         are still transferred in that case.
+ */
+afc_error_t afc_transfer_run(afc_transfer_t transfer, afc_transfer_progress_cb_t progress_cb, void *user_data);
+
+/**
+ * Gets the aggregate progress of the current or last run, for example to
+ * poll it from another thread.
+ *
+ * @param transfer The transfer engine to use.
+ * @param progress Pointer to an afc_transfer_progress_t to fill in.
+ *
+ * @return AFC_E_SUCCESS on success or AFC_E_INVALID_ARG if a parameter is NULL.
+ */
+afc_error_t afc_transfer_get_progress(afc_transfer_t transfer, afc_transfer_progress_t *progress);
+
+/**
+ * Cancels a running afc_transfer_run() from another thread. Transfers in
+ * progress are stopped after the current chunk.
+ *
+ * @param transfer The transfer engine to cancel.
+ *
+ * @return AFC_E_SUCCESS on success or AFC_E_INVALID_ARG if transfer is NULL.
+ */
+afc_error_t afc_transfer_cancel(afc_transfer_t transfer);
+
+/**
+ * Creates an asynchronous client on top of an AFC client. Operations
+ * submitted through it return right after the request has been sent and
+ * complete through a callback once the response arrived, so several
+ * threads can have requests in flight over the same connection.
+ *
+ * @note The synchronous afc_* functions must not be used on the AFC client
+ *     while the asynchronous client exists, as they would receive the
+ *     responses meant for it.
+ * @note Connections with SSL enabled are not supported.
+ *
+ * @param client The AFC client to use. It must outlive the asynchronous client.
+ * @param async Pointer that will be set to the newly allocated asynchronous client.
+ *
+ * @return AFC_E_SUCCESS on success, AFC_E_INVALID_ARG if a parameter is
+ *         NULL, AFC_E_OBJECT_BUSY if the client already has an asynchronous
+ *         client or a write window larger than 1, AFC_E_OP_NOT_SUPPORTED if
+ *         the connection uses SSL, or AFC_E_UNKNOWN_ERROR if the receive
+ *         thread could not be started.
+ */
+afc_error_t afc_async_new(afc_client_t client, afc_async_t *async);
+
+/**
+ * Frees an asynchronous client. Waits until all operations in flight have
+ * completed, new operations can't be submitted anymore meanwhile.
+ *
+ * @param async The asynchronous client to free.
+ *
+ * @return AFC_E_SUCCESS on success or AFC_E_INVALID_ARG if async is NULL.
+ */
+afc_error_t afc_async_free(afc_async_t async);
+
+/**
+ * Asynchronously gets information about a file or directory. On success the
+ * callback's data points to an afc_stat_t.
+ *
+ * @param async The asynchronous client to use.
+ * @param path The path to get information about.
+ * @param callback The completion callback.
+ * @param user_data Custom pointer passed to the callback.
+ *
+ * @return AFC_E_SUCCESS if the request has been sent, or an AFC_E_* error
+ *         value. The callback is only invoked if the request has been sent.
+ */
+afc_error_t afc_async_get_file_info(afc_async_t async, const char *path, afc_async_cb_t callback, void *user_data);
+
+/**
+ * Asynchronously reads a directory. On success the callback's data holds
+ * the NUL terminated names of the entries, one after another.
+ *
+ * @param async The asynchronous client to use.
+ * @param path The directory to read.
+ * @param callback The completion callback.
+ * @param user_data Custom pointer passed to the callback.
+ *
+ * @return AFC_E_SUCCESS if the request has been sent, or an AFC_E_* error value.
+ */
+afc_error_t afc_async_read_directory(afc_async_t async, const char *path, afc_async_cb_t callback, void *user_data);
+
+/**
+ * Asynchronously creates a directory.
+ *
+ * @param async The asynchronous client to use.
+ * @param path The directory to create.
+ * @param callback The completion callback.
+ * @param user_data Custom pointer passed to the callback.
+ *
+ * @return AFC_E_SUCCESS if the request has been sent, or an AFC_E_* error value.
+ */
+afc_error_t afc_async_make_directory(afc_async_t async, const char *path, afc_async_cb_t callback, void *user_data);
+
+/**
+ * Asynchronously removes a file or an empty directory.
+ *
+ * @param async The asynchronous client to use.
+ * @param path The path to remove.
+ * @param callback The completion callback.
+ * @param user_data Custom pointer passed to the callback.
+ *
+ * @return AFC_E_SUCCESS if the request has been sent, or an AFC_E_* error value.
+ */
+afc_error_t afc_async_remove_path(afc_async_t async, const char *path, afc_async_cb_t callback, void *user_data);
+
+/**
+ * Asynchronously opens a file. On success the callback's data holds the
+ * 8 byte file handle.
+ *
+ * @param async The asynchronous client to use.
+ * @param filename The file to open.
+ * @param file_mode The mode to open the file with.
+ * @param callback The completion callback.
+ * @param user_data Custom pointer passed to the callback.
+ *
+ * @return AFC_E_SUCCESS if the request has been sent, or an AFC_E_* error value.
+ */
+afc_error_t afc_async_file_open(afc_async_t async, const char *filename, afc_file_mode_t file_mode, afc_async_cb_t callback, void *user_data);
+
+/**
+ * Asynchronously reads from an open file, at its current position. On
+ * success the callback's data holds the bytes read.
+ *
+ * @param async The asynchronous client to use.
+ * @param handle File handle of a previously opened file.
+ * @param length The number of bytes to read.
+ * @param callback The completion callback.
+ * @param user_data Custom pointer passed to the callback.
+ *
+ * @return AFC_E_SUCCESS if the request has been sent, or an AFC_E_* error value.
+ */
+afc_error_t afc_async_file_read(afc_async_t async, uint64_t handle, uint32_t length, afc_async_cb_t callback, void *user_data);
+
+/**
+ * Asynchronously writes to an open file, at its current position. The data
+ * is sent before this function returns and doesn't have to be kept.
+ *
+ * @param async The asynchronous client to use.
+ * @param handle File handle of a previously opened file.
+ * @param data The data to write.
+ * @param length The number of bytes to write.
+ * @param callback The completion callback.
+ * @param user_data Custom pointer passed to the callback.
+ *
+ * @return AFC_E_SUCCESS if the request has been sent, or an AFC_E_* error value.
+ */
+afc_error_t afc_async_file_write(afc_async_t async, uint64_t handle, const char *data, uint32_t length, afc_async_cb_t callback, void *user_data);
+
+/**
+ * Asynchronously closes a file.
+ *
+ * @param async The asynchronous client to use.
+ * @param handle File handle of a previously opened file.
+ * @param callback The completion callback.
+ * @param user_data Custom pointer passed to the callback.
+ *
+ * @return AFC_E_SUCCESS if the request has been sent, or an AFC_E_* error value.
+ */
+afc_error_t afc_async_file_close(afc_async_t async, uint64_t handle, afc_async_cb_t callback, void *user_data);
+
 #ifdef __cplusplus
 }
 #endif
@@ -51,6 +51,9 @@ typedef enum {
 typedef struct companion_proxy_client_private companion_proxy_client_private;
 typedef companion_proxy_client_private *companion_proxy_client_t; /**< The client handle. */
 
+typedef struct companion_proxy_session_private companion_proxy_session_private;
+typedef companion_proxy_session_private *companion_proxy_session_t; /**< The session handle. */
+
 typedef void (*companion_proxy_device_event_cb_t) (plist_t event, void* userdata);
 
 /**
@@ -139,8 +142,13 @@ companion_proxy_error_t companion_proxy_get_device_registry(companion_proxy_clie
  * @note The event parameter that gets passed to the callback function is
  *  freed internally after returning from the callback. The consumer needs
  *  to make a copy if required.
+ * @note Events of all listening clients are delivered on one shared thread,
+ *  so the callback must not block, and must not call
+ *  companion_proxy_stop_listening_for_devices() or
+ *  companion_proxy_client_free().
  *
  * @return COMPANION_PROXY_E_SUCCESS on success,
+ *  COMPANION_PROXY_E_OP_IN_PROGRESS if the client is already listening,
  *  or a COMPANION_PROXY_E_* error code otherwise.
  */
 companion_proxy_error_t companion_proxy_start_listening_for_devices(companion_proxy_client_t client, companion_proxy_device_event_cb_t callback, void* userdata);
@@ -201,6 +209,98 @@ companion_proxy_error_t companion_proxy_start_forwarding_service_port(companion_
  */
 companion_proxy_error_t companion_proxy_stop_forwarding_service_port(companion_proxy_client_t client, uint16_t remote_port);
 
+/* Sessions */
+
+/**
+ * Creates a long-lived session with the companion_proxy service.
+ *
+ * A session keeps one connection for port forwarding open, so forwarded
+ * ports stay valid across calls, and caches registry values. Cached values
+ * are dropped whenever a pairing event arrives; if the device does not
+ * deliver events, values are not cached.
+ *
+ * @param device The device to connect to. Must stay valid for the
+ *    lifetime of the session.
+ * @param label The label to use for communication. Usually the program name.
+ * @param session Pointer that will point to a newly allocated
+ *    companion_proxy_session_t upon successful return. Must be freed using
+ *    companion_proxy_session_free() after use.
+ *
+ * @return COMPANION_PROXY_E_SUCCESS on success,
+ *  or a COMPANION_PROXY_E_* error code otherwise.
+ */
+companion_proxy_error_t companion_proxy_session_new(idevice_t device, const char* label, companion_proxy_session_t* session);
+
+/**
+ * Stops all ports forwarded by the session and frees it.
+ *
+ * @param session The companion_proxy session to free.
+ *
+ * @return COMPANION_PROXY_E_SUCCESS on success,
+ *  or a COMPANION_PROXY_E_* error code otherwise.
+ */
+companion_proxy_error_t companion_proxy_session_free(companion_proxy_session_t session);
+
+/**
+ * Sets a callback that receives the pairing events of the session.
+ *
+ * @param session The companion_proxy session
+ * @param callback The callback, or NULL to stop delivering events
+ * @param userdata Pointer passed to the callback
+ *
+ * @note The callback runs on the shared event thread and must not block.
+ *
+ * @return COMPANION_PROXY_E_SUCCESS on success, or
+ *  COMPANION_PROXY_E_UNKNOWN_ERROR if the device does not deliver events.
+ */
+companion_proxy_error_t companion_proxy_session_set_event_callback(companion_proxy_session_t session, companion_proxy_device_event_cb_t callback, void* userdata);
+
+/**
+ * Returns a value for the given key, from the cache if possible.
+ *
+ * @see companion_proxy_get_value_from_registry
+ *
+ * @param session The companion_proxy session
+ * @param companion_udid UDID of the (paired) companion device
+ * @param key The key to retrieve the value for
+ * @param value Pointer that will receive a copy of the value. Must be
+ *    freed with plist_free() after use.
+ *
+ * @return COMPANION_PROXY_E_SUCCESS on success,
+ *  COMPANION_PROXY_E_UNSUPPORTED_KEY if the companion device doesn't support the given key,
+ *  or a COMPANION_PROXY_E_* error code otherwise.
+ */
+companion_proxy_error_t companion_proxy_session_get_value(companion_proxy_session_t session, const char* companion_udid, const char* key, plist_t* value);
+
+/**
+ * Forwards a service port on the companion device, reusing an existing
+ * forward of the session for the same port and service.
+ *
+ * @see companion_proxy_start_forwarding_service_port
+ *
+ * @param session The companion_proxy session
+ * @param remote_port remote port
+ * @param service_name The name of the service that shall be forwarded
+ * @param forward_port Pointer that will receive the port accessible via USB/Network on the idevice
+ * @param options PLIST_DICT with additional options, see
+ *    companion_proxy_start_forwarding_service_port()
+ *
+ * @return COMPANION_PROXY_E_SUCCESS on success,
+ *  or a COMPANION_PROXY_E_* error code otherwise.
+ */
+companion_proxy_error_t companion_proxy_session_forward_port(companion_proxy_session_t session, uint16_t remote_port, const char* service_name, uint16_t* forward_port, plist_t options);
+
+/**
+ * Stops forwarding a service port of the session.
+ *
+ * @param session The companion_proxy session
+ * @param remote_port remote port
+ *
+ * @return COMPANION_PROXY_E_SUCCESS on success,
+ *  or a COMPANION_PROXY_E_* error code otherwise.
+ */
+companion_proxy_error_t companion_proxy_session_stop_forwarding(companion_proxy_session_t session, uint16_t remote_port);
+
 #ifdef __cplusplus
 }
 #endif
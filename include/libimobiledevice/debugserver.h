@@ -92,7 +92,9 @@ debugserver_error_t debugserver_client_start_service(idevice_t device, debugserv
 debugserver_error_t debugserver_client_free(debugserver_client_t client);
 
 /**
- * Sends raw data using the given debugserver service client.
+ * Sends raw data using the given debugserver service client. As the data
+ * might change the state of the inferior, cached register values are
+ * discarded.
  *
  * @param client The debugserver client to use for sending
  * @param data Data to send
@@ -123,6 +125,38 @@ debugserver_error_t debugserver_client_send(debugserver_client_t client, const c
  */
 debugserver_error_t debugserver_client_receive_with_timeout(debugserver_client_t client, char *data, uint32_t size, uint32_t *received, unsigned int timeout);
 
+/**
+ * Gets the file descriptor of the connection used by the given debugserver
+ * client, so it can be waited on together with other file descriptors.
+ *
+ * @note The file descriptor must only be used to wait for events. Data has
+ *    to be sent and received with the debugserver_client_* functions.
+ *    Data buffered by debugserver_client_receive_response() is not
+ *    reported by the file descriptor.
+ *
+ * @param client The debugserver client
+ * @param fd Pointer to an int that will be set to the file descriptor
+ *
+ * @return DEBUGSERVER_E_SUCCESS on success, DEBUGSERVER_E_INVALID_ARG
+ *      when client or fd is NULL, or DEBUGSERVER_E_UNKNOWN_ERROR when the
+ *      connection has no file descriptor.
+ */
+debugserver_error_t debugserver_client_get_fd(debugserver_client_t client, int *fd);
+
+/**
+ * Checks if data can be received from the debugserver client without its
+ * file descriptor becoming readable, like buffered responses or data an
+ * SSL connection already decrypted.
+ *
+ * @param client The debugserver client
+ * @param pending Pointer to an int that will be set to 1 if data is
+ *    pending, or 0 otherwise
+ *
+ * @return DEBUGSERVER_E_SUCCESS on success, or DEBUGSERVER_E_INVALID_ARG
+ *      when client or pending is NULL.
+ */
+debugserver_error_t debugserver_client_has_pending_data(debugserver_client_t client, int *pending);
+
 /**
  * Receives raw data from the debugserver service.
  *
@@ -153,6 +187,10 @@ debugserver_error_t debugserver_client_send_command(debugserver_client_t client,
 /**
  * Receives and parses response of debugserver service.
  *
+ * Escaped characters in the response, as used by binary packets, are
+ * resolved, so the response can contain NUL bytes; use response_size to
+ * get its length.
+ *
  * @param client The debugserver client
  * @param response Response received for last command (can be NULL to ignore)
  * @param response_size Pointer to receive response size. Set to NULL to ignore.
@@ -189,6 +227,109 @@ debugserver_error_t debugserver_client_set_ack_mode(debugserver_client_t client,
  */
 debugserver_error_t debugserver_client_set_argv(debugserver_client_t client, int argc, char* argv[], char** response);
 
+/**
+ * Sets the environment and argv of an app and launches it. The
+ * QEnvironmentHexEncoded, 'A' and qLaunchSuccess packets are sent at once
+ * and their replies are checked afterwards, so the setup costs a single
+ * round trip. For this ack mode is disabled first if it is still on.
+ *
+ * @param client The debugserver client
+ * @param argc Number of arguments
+ * @param argv Array starting with the executable to be run followed by its arguments
+ * @param env NULL terminated array of NAME=VALUE strings, or NULL
+ * @param response The first reply that was not "OK" if the launch failed
+ *    (can be NULL to ignore). It has to be freed by the caller.
+ *
+ * @return DEBUGSERVER_E_SUCCESS if every packet was answered with "OK",
+ *  DEBUGSERVER_E_INVALID_ARG when client or argv is NULL or argc is 0,
+ *  DEBUGSERVER_E_RESPONSE_ERROR if the debugserver reported an error,
+ *  DEBUGSERVER_E_TIMEOUT if a reply did not arrive in time,
+ *  or an DEBUGSERVER_E_* error code otherwise.
+ */
+debugserver_error_t debugserver_client_launch(debugserver_client_t client, int argc, char* argv[], char* env[], char** response);
+
+/**
+ * Reads memory of the inferior. Large reads are split into requests that
+ * fit the maximum packet size of the debugserver; with ACK mode disabled
+ * several of them are kept in flight at once. Binary 'x' requests are used
+ * if the debugserver supports them, hex encoded 'm' requests otherwise.
+ *
+ * @param client The debugserver client
+ * @param address Address to start reading at
+ * @param size Number of bytes to read
+ * @param data Buffer of at least size bytes that receives the memory
+ * @param bytes_read Pointer that will be set to the number of bytes read.
+ *    This is less than size if the readable memory ended before.
+ *
+ * @return DEBUGSERVER_E_SUCCESS if any memory could be read,
+ *  DEBUGSERVER_E_INVALID_ARG when an argument is NULL or size is 0,
+ *  DEBUGSERVER_E_RESPONSE_ERROR if the memory could not be read at all,
+ *  or an DEBUGSERVER_E_* error code otherwise.
+ */
+debugserver_error_t debugserver_client_read_memory(debugserver_client_t client, uint64_t address, uint32_t size, char *data, uint32_t *bytes_read);
+
+/**
+ * Reads all general registers of a thread with a single 'g' request.
+ * The result is cached until the inferior is resumed or another command is
+ * sent with debugserver_client_send_command().
+ *
+ * @param client The debugserver client
+ * @param thread_id The thread to read the registers of, or 0 for the
+ *    current thread
+ * @param data Pointer that will be set to a newly allocated buffer with
+ *    the raw register contents in target byte order. Bytes that are not
+ *    available are set to 0. It has to be freed by the caller.
+ * @param size Pointer that will be set to the size of the register data
+ *
+ * @return DEBUGSERVER_E_SUCCESS on success,
+ *  DEBUGSERVER_E_INVALID_ARG when an argument is NULL,
+ *  DEBUGSERVER_E_RESPONSE_ERROR if the debugserver reported an error,
+ *  or an DEBUGSERVER_E_* error code otherwise.
+ */
+debugserver_error_t debugserver_client_read_registers(debugserver_client_t client, uint64_t thread_id, char **data, size_t *size);
+
+/**
+ * Reads a list of registers of a thread with 'p' requests, which are sent
+ * at once when ACK mode is disabled. Values are cached like with
+ * debugserver_client_read_registers().
+ *
+ * @param client The debugserver client
+ * @param thread_id The thread to read the registers of, or 0 for the
+ *    current thread
+ * @param regnums Array of register numbers to read
+ * @param count Number of entries in regnums
+ * @param values Array of count pointers that will be set to newly
+ *    allocated buffers with the raw register contents. They have to be
+ *    freed by the caller.
+ * @param sizes Array of count entries that will be set to the sizes of
+ *    the register values
+ *
+ * @return DEBUGSERVER_E_SUCCESS if all registers were read,
+ *  DEBUGSERVER_E_INVALID_ARG when an argument is NULL or count is 0,
+ *  DEBUGSERVER_E_RESPONSE_ERROR if the debugserver reported an error,
+ *  or an DEBUGSERVER_E_* error code otherwise. On error no values are
+ *  returned.
+ */
+debugserver_error_t debugserver_client_read_register_list(debugserver_client_t client, uint64_t thread_id, const uint32_t *regnums, uint32_t count, char **values, size_t *sizes);
+
+/**
+ * Resumes the inferior with a 'vCont' request and discards all cached
+ * register values.
+ *
+ * @param client The debugserver client
+ * @param actions The actions without the "vCont;" prefix, e.g. "c" or
+ *    "s:1f03;c"
+ * @param response Stop reply if it arrived within a second (can be NULL
+ *    to ignore). Otherwise it has to be read later with
+ *    debugserver_client_receive_response().
+ * @param response_size Pointer to receive response size. Set to NULL to ignore.
+ *
+ * @return DEBUGSERVER_E_SUCCESS on success,
+ *  DEBUGSERVER_E_INVALID_ARG when client or actions is NULL,
+ *  or an DEBUGSERVER_E_* error code otherwise.
+ */
+debugserver_error_t debugserver_client_vcont(debugserver_client_t client, const char *actions, char **response, size_t *response_size);
+
 /**
  * Adds or sets an environment variable.
  *
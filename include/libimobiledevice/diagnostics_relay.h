@@ -56,6 +56,22 @@ typedef enum {
 typedef struct diagnostics_relay_client_private diagnostics_relay_client_private;
 typedef diagnostics_relay_client_private *diagnostics_relay_client_t; /**< The client handle. */
 
+typedef struct diagnostics_relay_sampler_private diagnostics_relay_sampler_private;
+typedef diagnostics_relay_sampler_private *diagnostics_relay_sampler_t; /**< The sampler handle. */
+
+/**
+ * Callback delivering the values of a sampler query that changed since the
+ * previous sample. The first sample delivers all values.
+ *
+ * @param query_id The identifier returned when the query was added.
+ * @param changes A PLIST_DICT with the new or changed values by key.
+ * @param removed A PLIST_ARRAY with the keys that disappeared, or NULL.
+ * @param user_data Custom pointer passed to the sampler.
+ *
+ * @note The plists are owned by the sampler and only valid during the call.
+ */
+typedef void (*diagnostics_relay_sampler_cb_t)(unsigned int query_id, plist_t changes, plist_t removed, void *user_data);
+
 /**
  * Connects to the diagnostics_relay service on the specified device.
  *
@@ -174,12 +190,138 @@ diagnostics_relay_error_t diagnostics_relay_shutdown(diagnostics_relay_client_t
  */
 diagnostics_relay_error_t diagnostics_relay_request_diagnostics(diagnostics_relay_client_t client, const char* type, plist_t* diagnostics);
 
+/**
+ * Query one or more MobileGestalt keys.
+ *
+ * Values of keys that can't change for a device, like the serial number,
+ * the chip ID or the product type, are cached by UDID after they have been
+ * received once. Only the other keys are requested from the device then,
+ * and no request is sent at all if every key is cached.
+ *
+ * @param client The diagnostics_relay client
+ * @param keys A PLIST_ARRAY with the keys to query.
+ * @param result A pointer to plist_t that will be set to a PLIST_DICT with
+ *     the values wrapped in a "MobileGestalt" dictionary. Has to be freed
+ *     using plist_free().
+ *
+ * @return DIAGNOSTICS_RELAY_E_SUCCESS on success,
+ *  DIAGNOSTICS_RELAY_E_INVALID_ARG when client is NULL or keys is not a
+ *  PLIST_ARRAY, DIAGNOSTICS_RELAY_E_PLIST_ERROR if the device did not
+ *  acknowledge the request
+ */
 diagnostics_relay_error_t diagnostics_relay_query_mobilegestalt(diagnostics_relay_client_t client, plist_t keys, plist_t* result);
 
+/**
+ * Drops the cached immutable MobileGestalt values of a device.
+ *
+ * @param udid The UDID of the device, or NULL to drop the values of all devices.
+ *
+ * @return DIAGNOSTICS_RELAY_E_SUCCESS
+ */
+diagnostics_relay_error_t diagnostics_relay_mobilegestalt_cache_flush(const char *udid);
+
 diagnostics_relay_error_t diagnostics_relay_query_ioregistry_entry(diagnostics_relay_client_t client, const char* entry_name, const char* entry_class, plist_t* result);
 
 diagnostics_relay_error_t diagnostics_relay_query_ioregistry_plane(diagnostics_relay_client_t client, const char* plane, plist_t* result);
 
+/**
+ * Creates a sampler that polls a set of queries over a diagnostics_relay
+ * connection. All queries of a sample are sent at once before the first
+ * response is read, and only values that changed since the previous sample
+ * are delivered.
+ *
+ * @param client The diagnostics_relay client to use. It must not be used
+ *     otherwise while a sample is taken and must outlive the sampler.
+ * @param sampler Pointer that will be set to the newly allocated sampler.
+ *
+ * @return DIAGNOSTICS_RELAY_E_SUCCESS on success or
+ *     DIAGNOSTICS_RELAY_E_INVALID_ARG if a parameter is NULL.
+ */
+diagnostics_relay_error_t diagnostics_relay_sampler_new(diagnostics_relay_client_t client, diagnostics_relay_sampler_t *sampler);
+
+/**
+ * Stops a sampler if it is running and frees it.
+ *
+ * @param sampler The sampler to free.
+ *
+ * @return DIAGNOSTICS_RELAY_E_SUCCESS on success or
+ *     DIAGNOSTICS_RELAY_E_INVALID_ARG if sampler is NULL.
+ */
+diagnostics_relay_error_t diagnostics_relay_sampler_free(diagnostics_relay_sampler_t sampler);
+
+/**
+ * Adds an IORegistry entry query to a sampler, like
+ * diagnostics_relay_query_ioregistry_entry(). The properties of the entry
+ * are compared individually.
+ *
+ * @param sampler The sampler to add the query to.
+ * @param entry_name The IORegistry entry name to query, or NULL.
+ * @param entry_class The IORegistry class to query, or NULL.
+ * @param query_id Pointer that will be set to the identifier of the query
+ *     passed to the callback, or NULL.
+ *
+ * @return DIAGNOSTICS_RELAY_E_SUCCESS on success or
+ *     DIAGNOSTICS_RELAY_E_INVALID_ARG if both entry_name and entry_class
+ *     are NULL.
+ */
+diagnostics_relay_error_t diagnostics_relay_sampler_add_ioregistry_entry(diagnostics_relay_sampler_t sampler, const char* entry_name, const char* entry_class, unsigned int *query_id);
+
+/**
+ * Adds a MobileGestalt query to a sampler, like
+ * diagnostics_relay_query_mobilegestalt(). The keys are compared
+ * individually.
+ *
+ * @param sampler The sampler to add the query to.
+ * @param keys A PLIST_ARRAY with the MobileGestalt keys to query.
+ * @param query_id Pointer that will be set to the identifier of the query
+ *     passed to the callback, or NULL.
+ *
+ * @return DIAGNOSTICS_RELAY_E_SUCCESS on success or
+ *     DIAGNOSTICS_RELAY_E_INVALID_ARG if keys is not a PLIST_ARRAY.
+ */
+diagnostics_relay_error_t diagnostics_relay_sampler_add_mobilegestalt(diagnostics_relay_sampler_t sampler, plist_t keys, unsigned int *query_id);
+
+/**
+ * Takes a single sample of all queries and delivers the changes before
+ * returning.
+ *
+ * @param sampler The sampler to use.
+ * @param callback The callback to deliver changes to.
+ * @param user_data Custom pointer passed to the callback.
+ *
+ * @return DIAGNOSTICS_RELAY_E_SUCCESS on success,
+ *     DIAGNOSTICS_RELAY_E_INVALID_ARG if the sampler is running, or
+ *     DIAGNOSTICS_RELAY_E_MUX_ERROR if the connection failed. Queries the
+ *     device rejected are skipped.
+ */
+diagnostics_relay_error_t diagnostics_relay_sampler_sample(diagnostics_relay_sampler_t sampler, diagnostics_relay_sampler_cb_t callback, void *user_data);
+
+/**
+ * Starts taking samples periodically on a separate thread, the first one
+ * right away. The callback is invoked from that thread.
+ *
+ * @param sampler The sampler to start.
+ * @param interval_ms The time between two samples in milliseconds.
+ * @param callback The callback to deliver changes to.
+ * @param user_data Custom pointer passed to the callback.
+ *
+ * @return DIAGNOSTICS_RELAY_E_SUCCESS on success,
+ *     DIAGNOSTICS_RELAY_E_INVALID_ARG if a parameter is invalid or the
+ *     sampler is running already, or DIAGNOSTICS_RELAY_E_UNKNOWN_ERROR if
+ *     the thread could not be started.
+ */
+diagnostics_relay_error_t diagnostics_relay_sampler_start(diagnostics_relay_sampler_t sampler, unsigned int interval_ms, diagnostics_relay_sampler_cb_t callback, void *user_data);
+
+/**
+ * Stops a sampler started with diagnostics_relay_sampler_start().
+ *
+ * @param sampler The sampler to stop.
+ *
+ * @return DIAGNOSTICS_RELAY_E_SUCCESS on success, or the error that made
+ *     the sampler stop by itself.
+ */
+diagnostics_relay_error_t diagnostics_relay_sampler_stop(diagnostics_relay_sampler_t sampler);
+
 #ifdef __cplusplus
 }
 #endif
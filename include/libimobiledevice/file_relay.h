@@ -43,12 +43,42 @@ typedef enum {
 	FILE_RELAY_E_INVALID_SOURCE    = -4,
 	FILE_RELAY_E_STAGING_EMPTY     = -5,
 	FILE_RELAY_E_PERMISSION_DENIED = -6,
+	FILE_RELAY_E_ARCHIVE_ERROR     = -7,
+	FILE_RELAY_E_ABORTED           = -8,
 	FILE_RELAY_E_UNKNOWN_ERROR     = -256
 } file_relay_error_t;
 
 typedef struct file_relay_client_private file_relay_client_private;
 typedef file_relay_client_private *file_relay_client_t; /**< The client handle. */
 
+/** An entry of the archive delivered by file_relay_stream_sources() */
+typedef struct {
+	const char *path;        /**< Path of the entry within the archive */
+	uint32_t mode;           /**< File type and permissions, as in st_mode */
+	uint32_t uid;            /**< Owner user id */
+	uint32_t gid;            /**< Owner group id */
+	uint64_t mtime;          /**< Modification time in seconds since the epoch */
+	uint64_t size;           /**< Size of the contents in bytes */
+	const char *link_target; /**< Target of a symbolic link, NULL for other entries */
+} file_relay_entry_t;
+
+/**
+ * Callback invoked by file_relay_stream_sources() when an entry starts.
+ *
+ * @return 0 to receive the contents of the entry, a positive value to skip
+ *     them, or a negative value to abort.
+ */
+typedef int (*file_relay_entry_cb_t)(const file_relay_entry_t *entry, void *user_data);
+
+/**
+ * Callback invoked by file_relay_stream_sources() with the contents of an
+ * entry, in order and in chunks as they arrive. It is invoked once more
+ * with a length of 0 when the entry is complete.
+ *
+ * @return 0 to continue, or a negative value to abort.
+ */
+typedef int (*file_relay_data_cb_t)(const file_relay_entry_t *entry, const char *data, uint32_t length, void *user_data);
+
 /**
  * Connects to the file_relay service on the specified device.
  *
@@ -158,6 +188,34 @@ file_relay_error_t file_relay_request_sources(file_relay_client_t client, const
  */
 file_relay_error_t file_relay_request_sources_timeout(file_relay_client_t client, const char **sources, idevice_connection_t *connection, unsigned int timeout);
 
+/**
+ * Requests data for the given sources and decodes the archive while it is
+ * still arriving, so that it doesn't need to be stored anywhere first. The
+ * gzip compressed cpio stream is received on a separate thread while the
+ * calling thread decompresses and parses it and invokes the callbacks for
+ * every entry.
+ *
+ * @param client The connected file_relay client. The device closes the
+ *     connection after sending the archive, so only file_relay_client_free()
+ *     can be used on the client afterwards.
+ * @param sources A NULL-terminated list of sources to retrieve, see
+ *     file_relay_request_sources() for valid sources.
+ * @param timeout Maximum time in milliseconds to wait for the device to
+ *     answer the request or to send further data.
+ * @param entry_cb Callback invoked when an entry starts.
+ * @param data_cb Callback receiving the contents of the entries, or NULL.
+ * @param user_data Custom pointer passed to the callbacks.
+ *
+ * @return FILE_RELAY_E_SUCCESS if the whole archive has been received,
+ *     FILE_RELAY_E_ABORTED if a callback aborted, FILE_RELAY_E_ARCHIVE_ERROR
+ *     if the archive is corrupt or truncated, FILE_RELAY_E_MUX_ERROR if
+ *     receiving failed, or one of the errors of
+ *     file_relay_request_sources_timeout(). FILE_RELAY_E_UNKNOWN_ERROR is
+ *     also returned, without requesting anything, if libimobiledevice was
+ *     built without zlib.
+ */
+file_relay_error_t file_relay_stream_sources(file_relay_client_t client, const char **sources, unsigned int timeout, file_relay_entry_cb_t entry_cb, file_relay_data_cb_t data_cb, void *user_data);
+
 #ifdef __cplusplus
 }
 #endif
@@ -47,6 +47,9 @@ typedef enum {
 typedef struct heartbeat_client_private heartbeat_client_private;
 typedef heartbeat_client_private *heartbeat_client_t; /**< The client handle. */
 
+/** Reports the estimated round trip time after each answered heartbeat, or the error once the link to the device was lost. */
+typedef void (*heartbeat_keepalive_cb_t)(const char *udid, heartbeat_error_t status, uint32_t rtt_ms, void *user_data);
+
 /**
  * Connects to the heartbeat service on the specified device.
  *
@@ -129,6 +132,59 @@ heartbeat_error_t heartbeat_receive(heartbeat_client_t client, plist_t * plist);
  */
 heartbeat_error_t heartbeat_receive_with_timeout(heartbeat_client_t client, plist_t * plist, uint32_t timeout_ms);
 
+/* Keepalive */
+
+/**
+ * Connects to the heartbeat service of a device and keeps answering its
+ * heartbeat requests in the background, so a network connected device does
+ * not drop the connection. A single thread serves all devices of the
+ * process; it runs only while at least one device is registered and only
+ * wakes up when a request arrives or a link is about to time out.
+ *
+ * The round trip time is estimated from how much later than announced the
+ * next request arrives after an answer, and smoothed over several requests.
+ *
+ * @note The callback is invoked from the keepalive thread and must not
+ *    call any heartbeat_keepalive_* function. After reporting an error the
+ *    device is removed from the keepalive.
+ *
+ * @param udid The UDID of the device.
+ * @param options Lookup options passed to idevice_new_with_options(),
+ *    usually IDEVICE_LOOKUP_NETWORK.
+ * @param callback Optional callback receiving the round trip time after
+ *    each answered request and the error when the link got lost.
+ * @param user_data Custom pointer passed to the callback function.
+ *
+ * @return HEARTBEAT_E_SUCCESS on success or if the device is kept alive
+ *      already, HEARTBEAT_E_INVALID_ARG when udid is NULL, or an error code
+ *      if connecting to the device failed.
+ */
+heartbeat_error_t heartbeat_keepalive_add(const char *udid, enum idevice_options options, heartbeat_keepalive_cb_t callback, void *user_data);
+
+/**
+ * Disconnects from the heartbeat service of a device and stops keeping it
+ * alive.
+ *
+ * @param udid The UDID of the device.
+ *
+ * @return HEARTBEAT_E_SUCCESS on success, HEARTBEAT_E_INVALID_ARG when udid
+ *      is NULL or the device is not kept alive.
+ */
+heartbeat_error_t heartbeat_keepalive_remove(const char *udid);
+
+/**
+ * Returns the current round trip time estimate of a device kept alive.
+ *
+ * @param udid The UDID of the device.
+ * @param rtt_ms Pointer that will be set to the round trip time in
+ *    milliseconds.
+ *
+ * @return HEARTBEAT_E_SUCCESS on success, HEARTBEAT_E_NOT_ENOUGH_DATA if no
+ *      request was answered twice yet, or HEARTBEAT_E_INVALID_ARG when a
+ *      parameter is NULL or the device is not kept alive.
+ */
+heartbeat_error_t heartbeat_keepalive_get_rtt(const char *udid, uint32_t *rtt_ms);
+
 #ifdef __cplusplus
 }
 #endif
@@ -47,6 +47,9 @@ typedef enum {
 typedef struct house_arrest_client_private house_arrest_client_private;
 typedef house_arrest_client_private *house_arrest_client_t; /**< The client handle. */
 
+typedef struct house_arrest_pool_private house_arrest_pool_private;
+typedef house_arrest_pool_private *house_arrest_pool_t; /**< The AFC session pool handle. */
+
 /* Interface */
 
 /**
@@ -172,6 +175,78 @@ house_arrest_error_t house_arrest_get_result(house_arrest_client_t client, plist
  */
 afc_error_t afc_client_new_from_house_arrest_client(house_arrest_client_t client, afc_client_t *afc_client);
 
+/**
+ * Creates a pool that keeps vended AFC sessions for reuse, keyed by
+ * device, bundle identifier and command. Acquiring a session that is idle
+ * in the pool skips starting the house_arrest service and the vend round
+ * trip. The pool is thread safe.
+ *
+ * @param idle_timeout_ms Milliseconds after which an idle session is
+ *     closed, or 0 for the default of 30 seconds.
+ * @param pool Pointer that will be set to the newly allocated pool.
+ *
+ * @return HOUSE_ARREST_E_SUCCESS on success, HOUSE_ARREST_E_INVALID_ARG if
+ *     pool is NULL, or HOUSE_ARREST_E_UNKNOWN_ERROR if out of memory.
+ */
+house_arrest_error_t house_arrest_pool_new(unsigned int idle_timeout_ms, house_arrest_pool_t *pool);
+
+/**
+ * Closes all sessions of a pool and frees it. Sessions still acquired are
+ * closed as well, so all of them should have been released before.
+ *
+ * @param pool The pool to free.
+ *
+ * @return HOUSE_ARREST_E_SUCCESS on success or HOUSE_ARREST_E_INVALID_ARG
+ *     if pool is NULL.
+ */
+house_arrest_error_t house_arrest_pool_free(house_arrest_pool_t pool);
+
+/**
+ * Gets an AFC client for the sandbox of an application, reusing an idle
+ * session of the pool if there is one, or vending a new one. The client
+ * belongs to the caller until it gets handed back with
+ * house_arrest_pool_release(), it must not be freed with afc_client_free().
+ *
+ * @param pool The pool to use.
+ * @param device The device the application is installed on.
+ * @param bundle_id The bundle identifier of the application.
+ * @param command The vend command, "VendContainer" or "VendDocuments".
+ *     NULL means "VendContainer".
+ * @param label The label to use for communication with lockdownd, or NULL.
+ * @param afc_client Pointer that will be set to the AFC client.
+ *
+ * @return AFC_E_SUCCESS on success, AFC_E_INVALID_ARG if a parameter is
+ *     invalid, AFC_E_PERM_DENIED if the device refused to vend the
+ *     container, or another AFC_E_* error code.
+ */
+afc_error_t house_arrest_pool_acquire(house_arrest_pool_t pool, idevice_t device, const char *bundle_id, const char *command, const char *label, afc_client_t *afc_client);
+
+/**
+ * Hands an AFC client obtained with house_arrest_pool_acquire() back to the
+ * pool. Sessions idle for longer than the idle timeout are closed.
+ *
+ * @param pool The pool the client was acquired from.
+ * @param afc_client The AFC client to release.
+ * @param reusable 0 if the connection failed and the session has to be
+ *     closed, non-zero to keep it for reuse.
+ *
+ * @return HOUSE_ARREST_E_SUCCESS on success or HOUSE_ARREST_E_INVALID_ARG
+ *     if a parameter is NULL or the client doesn't belong to the pool.
+ */
+house_arrest_error_t house_arrest_pool_release(house_arrest_pool_t pool, afc_client_t afc_client, int reusable);
+
+/**
+ * Closes the idle sessions of a device, for example after it got
+ * disconnected.
+ *
+ * @param pool The pool to use.
+ * @param udid The UDID of the device, or NULL to close all idle sessions.
+ *
+ * @return HOUSE_ARREST_E_SUCCESS on success or HOUSE_ARREST_E_INVALID_ARG
+ *     if pool is NULL.
+ */
+house_arrest_error_t house_arrest_pool_flush(house_arrest_pool_t pool, const char *udid);
+
 #ifdef __cplusplus
 }
 #endif
@@ -110,9 +110,15 @@ typedef enum {
 typedef struct instproxy_client_private instproxy_client_private;
 typedef instproxy_client_private *instproxy_client_t; /**< The client handle. */
 
+typedef struct instproxy_app_cache_private instproxy_app_cache_private;
+typedef instproxy_app_cache_private *instproxy_app_cache_t; /**< The application list cache handle. */
+
 /** Reports the status response of the given command */
 typedef void (*instproxy_status_cb_t) (plist_t command, plist_t status, void *user_data);
 
+/** Reports a page of applications found by instproxy_browse_pages(). The page is freed after the callback returns. */
+typedef void (*instproxy_browse_page_cb_t) (plist_t page, uint64_t current_index, uint64_t total, void *user_data);
+
 /* Interface */
 
 /**
@@ -154,6 +160,42 @@ instproxy_error_t instproxy_client_start_service(idevice_t device, instproxy_cli
  */
 instproxy_error_t instproxy_client_free(instproxy_client_t client);
 
+/**
+ * Configures the executor that runs the status loops of asynchronous
+ * commands (like instproxy_install()) of all clients. Instead of a thread
+ * per command, a small set of worker threads takes turns waiting for status
+ * messages of all pending commands. Workers are only started while commands
+ * are pending.
+ *
+ * @param max_workers Maximum number of worker threads, or 0 for the
+ *        default of 4.
+ * @param poll_timeout Time in milliseconds a worker waits for a status
+ *        message of one command before moving on to the next, or 0 for the
+ *        default of 100.
+ * @param command_timeout Time in milliseconds without any status message
+ *        after which a command is given up, or 0 to wait indefinitely
+ *        (default). The status callback then receives a status with the
+ *        error "TimedOut". Likewise it receives the error "ConnectionLost"
+ *        if receiving from the device fails.
+ *
+ * @return INSTPROXY_E_SUCCESS
+ */
+instproxy_error_t instproxy_set_status_executor(unsigned int max_workers, unsigned int poll_timeout, unsigned int command_timeout);
+
+/**
+ * Cancels the pending asynchronous command of the given client. The command
+ * can't be aborted on the device, but no further status updates are
+ * processed; the status callback receives a final status with the error
+ * "Cancelled". Since the device may still send status messages for the
+ * command, the client should be freed rather than reused afterwards.
+ *
+ * @param client The connected installation_proxy client
+ *
+ * @return INSTPROXY_E_SUCCESS on success or INSTPROXY_E_INVALID_ARG if
+ *         client is NULL.
+ */
+instproxy_error_t instproxy_cancel(instproxy_client_t client);
+
 /**
  * List installed applications. This function runs synchronously.
  *
@@ -191,6 +233,34 @@ instproxy_error_t instproxy_browse(instproxy_client_t client, plist_t client_opt
  */
 instproxy_error_t instproxy_browse_with_callback(instproxy_client_t client, plist_t client_options, instproxy_status_cb_t status_cb, void *user_data);
 
+/**
+ * List installed applications page by page. This function runs synchronously
+ * and passes every page to the callback as soon as it has been received,
+ * so the full list never has to be held in memory.
+ *
+ * If client_options contain "ReturnAttributes", the applications passed to
+ * the callback only contain the requested attributes, even with firmware
+ * versions that ignore the option and return all of them.
+ *
+ * @param client The connected installation_proxy client
+ * @param client_options The client options to use, as PLIST_DICT, or NULL.
+ *        Valid client options include:
+ *          "ApplicationType" -> "System"
+ *          "ApplicationType" -> "User"
+ *          "ApplicationType" -> "Internal"
+ *          "ApplicationType" -> "Any"
+ *          "ReturnAttributes" -> PLIST_ARRAY of attribute names
+ * @param page_cb Callback function that will be called with a PLIST_ARRAY
+ *        of PLIST_DICT for each page of applications, the index of the first
+ *        application in the page, and the total number of applications.
+ *        Passing a callback is required.
+ * @param user_data Callback data passed to page_cb.
+ *
+ * @return INSTPROXY_E_SUCCESS on success or an INSTPROXY_E_* error value if
+ *         an error occurred.
+ */
+instproxy_error_t instproxy_browse_pages(instproxy_client_t client, plist_t client_options, instproxy_browse_page_cb_t page_cb, void *user_data);
+
 /**
  * Lookup information about specific applications from the device.
  *
@@ -475,6 +545,17 @@ void instproxy_client_options_add(plist_t client_options, ...);
  */
 void instproxy_client_options_set_return_attributes(plist_t client_options, ...);
 
+/**
+ * Adds attributes to the given client_options to filter browse results,
+ * like instproxy_client_options_set_return_attributes() but taking the
+ * attributes as an array, for lists built at runtime.
+ *
+ * @param client_options The client options to modify.
+ * @param attributes An array of attribute names that MUST have a
+ *        terminating NULL entry.
+ */
+void instproxy_client_options_set_return_attributes_list(plist_t client_options, const char **attributes);
+
 /**
  * Frees client_options plist.
  *
@@ -497,6 +578,89 @@ void instproxy_client_options_free(plist_t client_options);
  */
 instproxy_error_t instproxy_client_get_path_for_bundle_identifier(instproxy_client_t client, const char* bundle_id, char** path);
 
+/**
+ * Creates a new application list cache. The cache holds the result of the
+ * last instproxy_app_cache_browse() for every device and can be shared
+ * between clients and threads.
+ *
+ * @param cache Pointer that will point to a newly allocated
+ *        instproxy_app_cache_t upon successful return.
+ *
+ * @return INSTPROXY_E_SUCCESS on success, INSTPROXY_E_INVALID_ARG when
+ *         cache is NULL, or INSTPROXY_E_UNKNOWN_ERROR otherwise.
+ */
+instproxy_error_t instproxy_app_cache_new(instproxy_app_cache_t *cache);
+
+/**
+ * Frees an application list cache.
+ *
+ * @param cache The application list cache to free.
+ *
+ * @return INSTPROXY_E_SUCCESS on success or INSTPROXY_E_INVALID_ARG when
+ *         cache is NULL.
+ */
+instproxy_error_t instproxy_app_cache_free(instproxy_app_cache_t cache);
+
+/**
+ * Replaces the contents of an application list cache with the contents of
+ * a file written by instproxy_app_cache_save().
+ *
+ * @param cache The application list cache to load into.
+ * @param path Path of the file to read.
+ *
+ * @return INSTPROXY_E_SUCCESS on success, INSTPROXY_E_INVALID_ARG when an
+ *         argument is NULL, or INSTPROXY_E_UNKNOWN_ERROR when the file could
+ *         not be read.
+ */
+instproxy_error_t instproxy_app_cache_load(instproxy_app_cache_t cache, const char *path);
+
+/**
+ * Writes the contents of an application list cache to a file, so it can be
+ * reused by a later process.
+ *
+ * @param cache The application list cache to save.
+ * @param path Path of the file to write.
+ *
+ * @return INSTPROXY_E_SUCCESS on success, INSTPROXY_E_INVALID_ARG when an
+ *         argument is NULL, or INSTPROXY_E_UNKNOWN_ERROR when the file could
+ *         not be written.
+ */
+instproxy_error_t instproxy_app_cache_save(instproxy_app_cache_t cache, const char *path);
+
+/**
+ * Drops the cached applications of a device, or of all devices.
+ *
+ * @param cache The application list cache to use.
+ * @param udid The UDID of the device, or NULL for all devices.
+ *
+ * @return INSTPROXY_E_SUCCESS on success or INSTPROXY_E_INVALID_ARG when
+ *         cache is NULL.
+ */
+instproxy_error_t instproxy_app_cache_invalidate(instproxy_app_cache_t cache, const char *udid);
+
+/**
+ * List installed applications like instproxy_browse(), using a cache of the
+ * previous result for the device.
+ *
+ * Only CFBundleIdentifier, CFBundleVersion and CFBundleShortVersionString
+ * of all applications are fetched from the device. The full information is
+ * only looked up for applications that are new or whose version changed;
+ * all others are taken from the cache. The cache is then updated with the
+ * new result.
+ *
+ * @param cache The application list cache to use.
+ * @param client The connected installation_proxy client
+ * @param client_options The client options to use, as PLIST_DICT, or NULL.
+ *        See instproxy_browse(). Cached results are only reused for the
+ *        same client options.
+ * @param result Pointer that will be set to a plist that will hold an array
+ *        of PLIST_DICT holding information about the applications found.
+ *
+ * @return INSTPROXY_E_SUCCESS on success or an INSTPROXY_E_* error value if
+ *         an error occurred.
+ */
+instproxy_error_t instproxy_app_cache_browse(instproxy_app_cache_t cache, instproxy_client_t client, plist_t client_options, plist_t *result);
+
 #ifdef __cplusplus
 }
 #endif
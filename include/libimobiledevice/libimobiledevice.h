@@ -43,7 +43,9 @@ typedef enum {
 	IDEVICE_E_NO_DEVICE       = -3,
 	IDEVICE_E_NOT_ENOUGH_DATA = -4,
 	IDEVICE_E_SSL_ERROR       = -6,
-	IDEVICE_E_TIMEOUT         = -7
+	IDEVICE_E_TIMEOUT         = -7,
+	IDEVICE_E_DEVICE_DETACHED = -8,
+	IDEVICE_E_CANCELLED       = -9
 } idevice_error_t;
 
 typedef struct idevice_private idevice_private;
@@ -72,6 +74,42 @@ struct idevice_info {
 };
 typedef struct idevice_info* idevice_info_t;
 
+/** Describes one buffer used for vectored I/O on a connection */
+typedef struct {
+	char *data;   /**< Pointer to the buffer. */
+	uint32_t len; /**< Size of the buffer in bytes. */
+} idevice_iovec_t;
+
+typedef struct idevice_io_ring_private idevice_io_ring_private;
+typedef idevice_io_ring_private *idevice_io_ring_t; /**< Batched I/O handle. */
+
+/** Reports a completed operation of an I/O ring. bytes is the number of bytes sent, or the number of bytes received. */
+typedef void (*idevice_io_cb_t)(idevice_connection_t connection, idevice_error_t error, uint32_t bytes, void *user_data);
+
+typedef struct idevice_forward_private idevice_forward_private;
+typedef idevice_forward_private *idevice_forward_t; /**< Port forwarder handle. */
+
+/** Transport settings applied to connections to network devices */
+typedef struct {
+	int nodelay;                 /**< Disable Nagle's algorithm, so small requests are sent right away. */
+	uint32_t bandwidth;          /**< Expected throughput in bytes per second. Used with rtt to size the socket buffers, 0 keeps the default sizes. */
+	uint32_t rtt;                /**< Expected round trip time in milliseconds. */
+	uint32_t keepalive_idle;     /**< Seconds without traffic before TCP keepalive probes are sent, 0 disables keepalive. */
+	uint32_t keepalive_interval; /**< Seconds between keepalive probes, 0 for the system default. */
+	uint32_t keepalive_count;    /**< Unanswered probes before the connection is dropped, 0 for the system default. */
+} idevice_network_profile_t;
+
+/** Traffic counters of a connection */
+typedef struct {
+	uint64_t bytes_sent;     /**< Payload bytes sent, not counting SSL overhead. */
+	uint64_t bytes_received; /**< Payload bytes received, not counting SSL overhead. */
+	uint64_t duration;       /**< Milliseconds since the connection was established. */
+	uint64_t send_rate;      /**< Average bytes sent per second. */
+	uint64_t receive_rate;   /**< Average bytes received per second. */
+	uint32_t rtt;            /**< Smoothed round trip time in microseconds as measured by the TCP stack, 0 if not available. */
+	uint32_t rtt_var;        /**< Round trip time variance in microseconds, 0 if not available. */
+} idevice_connection_stats_t;
+
 /* discovery (events/asynchronous) */
 /** The event type for device add or removal */
 enum idevice_event_type {
@@ -92,6 +130,76 @@ typedef struct {
 /** Callback to notifiy if a device was added or removed. */
 typedef void (*idevice_event_cb_t) (const idevice_event_t *event, void *user_data);
 
+/** Options for idevice_events_subscribe(), in addition to the connection
+ *  types of idevice_options */
+enum idevice_events_options {
+	IDEVICE_EVENTS_REPORT_EXISTING = 1 << 8 /**< report devices already connected as IDEVICE_DEVICE_ADD events */
+};
+
+typedef struct idevice_subscription_private idevice_subscription_private;
+typedef idevice_subscription_private *idevice_subscription_t; /**< The event subscription handle. */
+
+/** Types of trace events */
+typedef enum {
+	IDEVICE_TRACE_SEND = 1,      /**< Data was sent on a connection, id is the connection, size the number of bytes */
+	IDEVICE_TRACE_RECEIVE,       /**< Data was received on a connection, id is the connection, size the number of bytes */
+	IDEVICE_TRACE_OP_START,      /**< A protocol request was sent, op and id identify it, size is its length */
+	IDEVICE_TRACE_OP_END,        /**< A protocol response was received, op and id identify it, size is its length */
+	IDEVICE_TRACE_MESSAGE,       /**< A debug message, message is its format string */
+	IDEVICE_TRACE_DROPPED        /**< size events of the thread were dropped as its buffer was full */
+} idevice_trace_event_type_t;
+
+/** A trace event, see idevice_trace_start() */
+typedef struct {
+	uint64_t timestamp;   /**< Time of the event in microseconds since the epoch */
+	uint32_t thread;      /**< Number of the thread, in the order the threads recorded their first event */
+	uint32_t type;        /**< The idevice_trace_event_type_t of the event */
+	uint64_t id;          /**< Connection, packet number or request number, depending on the source */
+	uint64_t op;          /**< Protocol operation code, depending on the source */
+	uint64_t size;        /**< Size in bytes, or number of events for IDEVICE_TRACE_DROPPED */
+	const char *source;   /**< Name of the function that recorded the event */
+	const char *message;  /**< Format string of an IDEVICE_TRACE_MESSAGE event, NULL otherwise */
+} idevice_trace_event_t;
+
+/**
+ * Callback receiving recorded trace events. The strings of the events are
+ * static and stay valid.
+ *
+ * @param events Array of events of a single thread, oldest first.
+ * @param count Number of events in the array.
+ * @param user_data Custom pointer passed to idevice_trace_start() or
+ *     idevice_trace_dump().
+ */
+typedef void (*idevice_trace_cb_t)(const idevice_trace_event_t *events, unsigned int count, void *user_data);
+
+/**
+ * Allocator used for the message buffers of the library, see
+ * idevice_set_allocator(). realloc is called with a non-NULL pointer only,
+ * and all functions receive user_data as last argument.
+ */
+typedef struct {
+	void *(*malloc)(size_t size, void *user_data);
+	void *(*realloc)(void *ptr, size_t size, void *user_data);
+	void (*free)(void *ptr, void *user_data);
+	void *user_data;
+} idevice_allocator_t;
+
+/** Cipher preferences for SSL enabled connections, see idevice_set_cipher_policy() */
+typedef enum {
+	IDEVICE_CIPHER_POLICY_DEFAULT = 0, /**< the order of the TLS library */
+	IDEVICE_CIPHER_POLICY_AES_GCM,     /**< AES-GCM first, usually fastest with AES instructions */
+	IDEVICE_CIPHER_POLICY_CHACHA20,    /**< ChaCha20-Poly1305 first, usually fastest without AES instructions */
+	IDEVICE_CIPHER_POLICY_AES_CBC      /**< AES-CBC first, up to TLS 1.2 only as TLS 1.3 has no CBC suites */
+} idevice_cipher_policy_t;
+
+/** Memory counters, see idevice_get_memory_stats() */
+typedef struct {
+	uint64_t bytes;        /**< Bytes currently allocated */
+	uint64_t peak_bytes;   /**< Highest number of bytes allocated at once */
+	uint64_t blocks;       /**< Number of buffers currently allocated */
+	uint64_t allocations;  /**< Total number of allocations and reallocations */
+} idevice_memory_stats_t;
+
 /* functions */
 
 /**
@@ -101,6 +209,51 @@ typedef void (*idevice_event_cb_t) (const idevice_event_t *event, void *user_dat
  */
 void idevice_set_debug_level(int level);
 
+/**
+ * Starts recording binary trace events. Unlike debug output nothing is
+ * formatted or written while tracing: every thread appends fixed-size
+ * records to its own ring buffer, which a background thread periodically
+ * passes to the callback. Debug messages are recorded with their format
+ * string only, while tracing is enabled.
+ *
+ * @param events_per_thread Capacity of the ring buffer of each thread,
+ *     rounded up to a power of 2, or 0 for a default of 4096. It applies to
+ *     threads recording their first event after this call. When a buffer is
+ *     full further events of the thread are dropped and counted.
+ * @param callback Callback that receives the events, or NULL to only
+ *     collect them for idevice_trace_dump().
+ * @param interval Time in milliseconds between passing events to the
+ *     callback, ignored if callback is NULL.
+ * @param user_data Custom pointer passed to the callback.
+ *
+ * @return IDEVICE_E_SUCCESS on success, IDEVICE_E_INVALID_ARG if tracing
+ *     is already enabled or IDEVICE_E_UNKNOWN_ERROR if the background
+ *     thread could not be started.
+ */
+idevice_error_t idevice_trace_start(unsigned int events_per_thread, idevice_trace_cb_t callback, unsigned int interval, void *user_data);
+
+/**
+ * Stops recording trace events. Events still buffered are passed to the
+ * callback given to idevice_trace_start(), if any.
+ *
+ * @return IDEVICE_E_SUCCESS on success or IDEVICE_E_INVALID_ARG if tracing
+ *     is not enabled.
+ */
+idevice_error_t idevice_trace_stop(void);
+
+/**
+ * Passes all currently buffered trace events to the given callback and
+ * removes them from the buffers. This works whether tracing is enabled or
+ * not, so events can be collected after idevice_trace_stop() too.
+ *
+ * @param callback Callback that receives the events.
+ * @param user_data Custom pointer passed to the callback.
+ *
+ * @return IDEVICE_E_SUCCESS on success or IDEVICE_E_INVALID_ARG if
+ *     callback is NULL.
+ */
+idevice_error_t idevice_trace_dump(idevice_trace_cb_t callback, void *user_data);
+
 /**
  * Register a callback function that will be called when device add/remove
  * events occur.
@@ -121,6 +274,65 @@ idevice_error_t idevice_event_subscribe(idevice_event_cb_t callback, void *user_
  */
 idevice_error_t idevice_event_unsubscribe(void);
 
+/**
+ * Subscribes to device add/remove events. Any number of subscriptions can
+ * exist at the same time; all of them are served from a single usbmuxd
+ * subscription, the one of the device registry, which is enabled for as
+ * long as subscriptions exist.
+ *
+ * Each subscription has its own queue and thread the callback is invoked
+ * from, and only receives the events it is interested in. A slow callback
+ * therefore does not delay the events of other subscriptions.
+ *
+ * @param subscription Pointer that will be set to the new subscription
+ *   handle. Must be released with idevice_events_unsubscribe().
+ * @param callback Callback function to call.
+ * @param user_data Application-specific data passed as parameter
+ *   to the callback function.
+ * @param udid Only report events of the device with this UDID, or NULL to
+ *   report the events of all devices.
+ * @param options Bitwise or'ed IDEVICE_LOOKUP_USBMUX and
+ *   IDEVICE_LOOKUP_NETWORK to select the connection types to report,
+ *   0 reports both. Add IDEVICE_EVENTS_REPORT_EXISTING to start with an
+ *   IDEVICE_DEVICE_ADD event for each matching device already connected.
+ *
+ * @return IDEVICE_E_SUCCESS on success, IDEVICE_E_INVALID_ARG if
+ *   subscription or callback is NULL, IDEVICE_E_NO_DEVICE if usbmuxd is not
+ *   running, or IDEVICE_E_UNKNOWN_ERROR otherwise.
+ */
+idevice_error_t idevice_events_subscribe(idevice_subscription_t *subscription, idevice_event_cb_t callback, void *user_data, const char *udid, int options);
+
+/**
+ * Releases a subscription created with idevice_events_subscribe(). Events
+ * still queued for the subscription are discarded. Must not be called from
+ * the callback of the subscription itself.
+ *
+ * @param subscription The subscription to release.
+ *
+ * @return IDEVICE_E_SUCCESS on success or IDEVICE_E_INVALID_ARG if
+ *   subscription is not a valid subscription.
+ */
+idevice_error_t idevice_events_unsubscribe(idevice_subscription_t subscription);
+
+/**
+ * Enables or disables the device registry. While enabled, the library keeps
+ * track of the devices known to usbmuxd by subscribing to its device events.
+ * idevice_get_device_list(), idevice_get_device_list_extended() and
+ * idevice_new_with_options() are then served from the registry instead of
+ * sending a request to usbmuxd each time. Devices that are not in the
+ * registry are still looked up with usbmuxd by idevice_new_with_options().
+ *
+ * The registry is independent of idevice_event_subscribe(). It stays
+ * enabled while subscriptions created with idevice_events_subscribe() exist.
+ *
+ * @param enable Non-zero to enable the registry, 0 to disable it
+ *
+ * @return IDEVICE_E_SUCCESS on success, IDEVICE_E_NO_DEVICE if usbmuxd is
+ *   not running, or IDEVICE_E_UNKNOWN_ERROR if subscribing to device events
+ *   failed.
+ */
+idevice_error_t idevice_set_device_registry(int enable);
+
 /* discovery (synchronous) */
 
 /**
@@ -220,6 +432,29 @@ idevice_error_t idevice_free(idevice_t device);
 
 /* connection/disconnection */
 
+/**
+ * Configures a pool of idle service connections for the given device.
+ * When enabled, the connection of a service client started with one of the
+ * *_client_start_service() helpers is kept open when the client is freed,
+ * and handed to the next client for the same service without contacting
+ * lockdownd, connecting through usbmuxd or performing a TLS handshake again.
+ * Only connections of services without session state are pooled, which are
+ * diagnostics_relay, springboardservices and installation_proxy.
+ * Before a pooled connection is reused it is checked to have no pending data
+ * and not to be closed by the device, so services that end the session when
+ * their client is freed will just not benefit from the pool.
+ *
+ * @param device The device to configure the pool for
+ * @param max_idle Maximum number of idle connections to keep for the device.
+ *   Pass 0 to disable the pool and close all pooled connections.
+ * @param idle_timeout Number of seconds after which an idle connection is
+ *   closed, or 0 to keep idle connections open until they are used.
+ *
+ * @return IDEVICE_E_SUCCESS on success, IDEVICE_E_INVALID_ARG when device is
+ *   NULL.
+ */
+idevice_error_t idevice_set_connection_pool(idevice_t device, unsigned int max_idle, unsigned int idle_timeout);
+
 /**
  * Set up a connection to the given device.
  *
@@ -256,6 +491,22 @@ idevice_error_t idevice_disconnect(idevice_connection_t connection);
  */
 idevice_error_t idevice_connection_send(idevice_connection_t connection, const char *data, uint32_t len, uint32_t *sent_bytes);
 
+/**
+ * Send data from multiple buffers to a device via the given connection.
+ * The buffers are sent in order as one contiguous stream, which allows
+ * protocol headers and payload to go out with a single write over plain
+ * connections, and to be coalesced into full records over SSL.
+ *
+ * @param connection The connection to send data over.
+ * @param iov Array of buffers to send.
+ * @param iovcnt Number of entries in iov.
+ * @param sent_bytes Pointer to an uint32_t that will be filled
+ *   with the number of bytes actually sent.
+ *
+ * @return IDEVICE_E_SUCCESS if ok, otherwise an error code.
+ */
+idevice_error_t idevice_connection_sendv(idevice_connection_t connection, const idevice_iovec_t *iov, int iovcnt, uint32_t *sent_bytes);
+
 /**
  * Receive data from a device via the given connection.
  * This function will return after the given timeout even if no data has been
@@ -273,6 +524,24 @@ idevice_error_t idevice_connection_send(idevice_connection_t connection, const c
  */
 idevice_error_t idevice_connection_receive_timeout(idevice_connection_t connection, char *data, uint32_t len, uint32_t *recv_bytes, unsigned int timeout);
 
+/**
+ * Receive data from a device into multiple buffers via the given connection.
+ * The buffers are filled in order as one contiguous stream. Unlike
+ * idevice_connection_receive_timeout() this function only returns
+ * successfully once all buffers have been filled completely.
+ *
+ * @param connection The connection to receive data from.
+ * @param iov Array of buffers that will be filled with the received data.
+ * @param iovcnt Number of entries in iov.
+ * @param recv_bytes Number of bytes actually received. On error this is the
+ *   number of bytes received before the error occurred.
+ * @param timeout Timeout in milliseconds to wait for more data before
+ *   giving up.
+ *
+ * @return IDEVICE_E_SUCCESS if ok, otherwise an error code.
+ */
+idevice_error_t idevice_connection_receivev(idevice_connection_t connection, idevice_iovec_t *iov, int iovcnt, uint32_t *recv_bytes, unsigned int timeout);
+
 /**
  * Receive data from a device via the given connection.
  * This function is like idevice_connection_receive_timeout, but with a
@@ -288,6 +557,50 @@ idevice_error_t idevice_connection_receive_timeout(idevice_connection_t connecti
  */
 idevice_error_t idevice_connection_receive(idevice_connection_t connection, char *data, uint32_t len, uint32_t *recv_bytes);
 
+/**
+ * Set the size of the receive buffer of the given connection.
+ * When a receive buffer is set, small reads are served from memory and the
+ * buffer is refilled with as much data as is available in a single read,
+ * which avoids one system call per tiny read. Buffered receives only return
+ * fewer bytes than requested if no more data arrives within the timeout.
+ *
+ * @param connection The connection to configure.
+ * @param size Size of the receive buffer in bytes, or 0 to disable buffering
+ *   (the default).
+ *
+ * @return IDEVICE_E_SUCCESS if ok, IDEVICE_E_INVALID_ARG if size is smaller
+ *   than the amount of currently buffered data, otherwise an error code.
+ */
+idevice_error_t idevice_connection_set_receive_buffer_size(idevice_connection_t connection, uint32_t size);
+
+/**
+ * Get the number of bytes that can be read from the receive buffer of the
+ * given connection without accessing the underlying connection.
+ *
+ * @param connection The connection to query.
+ * @param available Pointer to an uint32_t that will be set to the number of
+ *   buffered bytes.
+ *
+ * @return IDEVICE_E_SUCCESS if ok, otherwise an error code.
+ */
+idevice_error_t idevice_connection_get_available(idevice_connection_t connection, uint32_t *available);
+
+/**
+ * Look at data from the given connection without consuming it.
+ * This requires a receive buffer set with
+ * idevice_connection_set_receive_buffer_size().
+ *
+ * @param connection The connection to peek at.
+ * @param data Buffer that will be filled with the peeked data.
+ * @param len Number of bytes to peek at. Must not exceed the size of the
+ *   receive buffer.
+ * @param peeked_bytes Number of bytes actually copied to data.
+ * @param timeout Timeout in milliseconds to wait for more data.
+ *
+ * @return IDEVICE_E_SUCCESS if ok, otherwise an error code.
+ */
+idevice_error_t idevice_connection_peek(idevice_connection_t connection, char *data, uint32_t len, uint32_t *peeked_bytes, unsigned int timeout);
+
 /**
  * Enables SSL for the given connection.
  *
@@ -323,6 +636,38 @@ idevice_error_t idevice_connection_disable_ssl(idevice_connection_t connection);
  */
 idevice_error_t idevice_connection_disable_bypass_ssl(idevice_connection_t connection, uint8_t sslBypass);
 
+/**
+ * Sets which ciphers SSL enabled connections to a device offer first. The
+ * device picks the cipher from the offered ones, so it may still choose
+ * another one; idevice_get_cipher() tells which one it picked. Older
+ * devices that only speak TLS 1.0 always use AES-CBC. Changing the policy
+ * drops the TLS session kept for resumption, so the next connection
+ * negotiates the cipher again.
+ *
+ * @param device The device to configure, or NULL to set the policy of
+ *   devices created afterwards.
+ * @param policy The cipher policy to use.
+ *
+ * @return IDEVICE_E_SUCCESS if ok, IDEVICE_E_INVALID_ARG when policy is not
+ *   a valid policy.
+ */
+idevice_error_t idevice_set_cipher_policy(idevice_t device, idevice_cipher_policy_t policy);
+
+/**
+ * Gets the name of the cipher negotiated by the most recent SSL handshake
+ * with a device, e.g. to compare the throughput of the cipher policies.
+ *
+ * @param device The device to query.
+ * @param name Pointer that will be set to a newly allocated string with the
+ *   name of the cipher as reported by the TLS library. Must be freed with
+ *   free().
+ *
+ * @return IDEVICE_E_SUCCESS if ok, IDEVICE_E_INVALID_ARG when a parameter
+ *   is NULL, or IDEVICE_E_NOT_ENOUGH_DATA if no SSL connection to the
+ *   device was established yet.
+ */
+idevice_error_t idevice_get_cipher(idevice_t device, char **name);
+
 
 /**
  * Get the underlying file descriptor for a connection
@@ -334,6 +679,260 @@ idevice_error_t idevice_connection_disable_bypass_ssl(idevice_connection_t conne
  */
 idevice_error_t idevice_connection_get_fd(idevice_connection_t connection, int *fd);
 
+/**
+ * Aborts a connection. Sends and receives blocked in other threads return
+ * right away with IDEVICE_E_CANCELLED, and so does any later I/O. The
+ * connection still has to be closed with idevice_disconnect().
+ *
+ * @note Connections are aborted the same way with IDEVICE_E_DEVICE_DETACHED
+ *   as soon as their device is removed, if device events are received
+ *   because idevice_event_subscribe(), idevice_events_subscribe() or
+ *   idevice_set_device_registry() are in use.
+ *
+ * @param connection The connection to abort. It must not be disconnected
+ *   while this is called.
+ *
+ * @return IDEVICE_E_SUCCESS if ok, IDEVICE_E_INVALID_ARG when connection is
+ *   NULL.
+ */
+idevice_error_t idevice_connection_cancel(idevice_connection_t connection);
+
+/**
+ * Set the transport settings for connections to a network device.
+ * The profile is applied to all connections made afterwards with
+ * idevice_connect() and has no effect for devices connected through USB.
+ * By default Nagle's algorithm is disabled, socket buffers are 128KB and
+ * TCP keepalive is off.
+ *
+ * @param device The device to configure.
+ * @param profile The settings to use, copied. Pass NULL to restore the
+ *   defaults.
+ *
+ * @return IDEVICE_E_SUCCESS if ok, IDEVICE_E_INVALID_ARG when device is NULL.
+ */
+idevice_error_t idevice_set_network_profile(idevice_t device, const idevice_network_profile_t *profile);
+
+/**
+ * Apply transport settings to an established network connection.
+ *
+ * @param connection The connection to configure.
+ * @param profile The settings to apply.
+ *
+ * @return IDEVICE_E_SUCCESS if ok, IDEVICE_E_INVALID_ARG when a parameter
+ *   is NULL or the connection is not a network connection, or
+ *   IDEVICE_E_UNKNOWN_ERROR if a setting could not be applied.
+ */
+idevice_error_t idevice_connection_set_network_profile(idevice_connection_t connection, const idevice_network_profile_t *profile);
+
+/**
+ * Get the traffic counters and, for network connections, the round trip
+ * time measured by the TCP stack.
+ *
+ * @param connection The connection to query.
+ * @param stats Pointer to a structure that will be filled with the counters.
+ *
+ * @return IDEVICE_E_SUCCESS if ok, IDEVICE_E_INVALID_ARG when a parameter is
+ *   NULL.
+ */
+idevice_error_t idevice_connection_get_stats(idevice_connection_t connection, idevice_connection_stats_t *stats);
+
+/* memory */
+
+/**
+ * Sets the allocator used for message buffers, such as the receive buffers
+ * of connections and services, of devices created afterwards and of
+ * buffers not associated with a device. Buffers are always released with
+ * the allocator they were allocated with. Memory allocated by libplist is
+ * not affected.
+ *
+ * @param allocator The allocator to use, copied, or NULL to use malloc().
+ *
+ * @return IDEVICE_E_SUCCESS if ok, IDEVICE_E_INVALID_ARG if the allocator
+ *   lacks a function.
+ */
+idevice_error_t idevice_set_allocator(const idevice_allocator_t *allocator);
+
+/**
+ * Sets the allocator used for the message buffers of one device, e.g. to
+ * give every device its own arena. Applies to buffers allocated after
+ * this call.
+ *
+ * @param device The device to configure.
+ * @param allocator The allocator to use, copied, or NULL to use the one
+ *   set with idevice_set_allocator().
+ *
+ * @return IDEVICE_E_SUCCESS if ok, IDEVICE_E_INVALID_ARG when device is
+ *   NULL or the allocator lacks a function.
+ */
+idevice_error_t idevice_set_device_allocator(idevice_t device, const idevice_allocator_t *allocator);
+
+/**
+ * Gets the memory counters of the message buffers of a device, or of the
+ * whole library. The counters of a device cover the buffers allocated for
+ * it, including those of its connections and services.
+ *
+ * @param device The device to query, or NULL for the totals of the library.
+ * @param stats Pointer to a structure that will be filled with the counters.
+ *
+ * @return IDEVICE_E_SUCCESS if ok, IDEVICE_E_INVALID_ARG when stats is NULL.
+ */
+idevice_error_t idevice_get_memory_stats(idevice_t device, idevice_memory_stats_t *stats);
+
+/* batched I/O */
+
+/**
+ * Creates an I/O ring that sends and receives data on many plain
+ * connections with few system calls. Operations are queued, handed to the
+ * kernel together with idevice_io_ring_submit() and completed by
+ * idevice_io_ring_dispatch(), which invokes their callbacks. When built with
+ * liburing on Linux this uses io_uring, otherwise a poll() based emulation
+ * with the same behavior.
+ *
+ * @note A ring must only be used from one thread at a time. Callbacks are
+ *   invoked from idevice_io_ring_dispatch() and may queue new operations.
+ *   Not available on Windows.
+ *
+ * @param depth Maximum number of operations pending at the same time.
+ * @param ring Pointer that will be set to the new ring.
+ *
+ * @return IDEVICE_E_SUCCESS if ok, IDEVICE_E_INVALID_ARG when a parameter is
+ *   invalid, or IDEVICE_E_UNKNOWN_ERROR if the ring could not be set up.
+ */
+idevice_error_t idevice_io_ring_new(unsigned int depth, idevice_io_ring_t *ring);
+
+/**
+ * Frees an I/O ring. Pending operations are dropped without invoking their
+ * callbacks, so the ring should be drained first.
+ *
+ * @param ring The ring to free.
+ *
+ * @return IDEVICE_E_SUCCESS if ok, IDEVICE_E_INVALID_ARG when ring is NULL.
+ */
+idevice_error_t idevice_io_ring_free(idevice_io_ring_t ring);
+
+/**
+ * Registers buffers with the kernel so receives into them don't have to map
+ * the memory for each operation. This is meant for long lived payload
+ * buffers, like the ones used for AFC file data or backup transfers.
+ * Replaces any previously registered buffers.
+ *
+ * @param ring The ring to register the buffers with.
+ * @param buffers The buffers to register, or NULL to unregister all.
+ * @param count Number of entries in buffers.
+ *
+ * @return IDEVICE_E_SUCCESS if ok, otherwise an error code.
+ */
+idevice_error_t idevice_io_ring_register_buffers(idevice_io_ring_t ring, const idevice_iovec_t *buffers, int count);
+
+/**
+ * Queues sending data over a connection. The operation completes once all
+ * data was sent. Operations of the same connection and direction are
+ * carried out in the order they were queued.
+ *
+ * @param ring The ring to queue the operation on.
+ * @param connection A connection without SSL and without a receive buffer.
+ * @param data The data to send. Must stay valid until completion.
+ * @param len Number of bytes to send.
+ * @param buffer_index Index of the registered buffer data lies in, or -1.
+ * @param callback Callback that is invoked on completion.
+ * @param user_data Custom pointer passed to the callback.
+ *
+ * @return IDEVICE_E_SUCCESS if ok, IDEVICE_E_INVALID_ARG when a parameter is
+ *   invalid or the connection uses SSL, or IDEVICE_E_UNKNOWN_ERROR when the
+ *   ring is full.
+ */
+idevice_error_t idevice_io_ring_queue_send(idevice_io_ring_t ring, idevice_connection_t connection, const char *data, uint32_t len, int buffer_index, idevice_io_cb_t callback, void *user_data);
+
+/**
+ * Queues receiving data from a connection. The operation completes as soon
+ * as any data arrived, like a single read. Operations of the same connection
+ * and direction are carried out in the order they were queued.
+ *
+ * @param ring The ring to queue the operation on.
+ * @param connection A connection without SSL and without a receive buffer.
+ * @param data Buffer for the received data. Must stay valid until completion.
+ * @param len Size of the buffer.
+ * @param buffer_index Index of the registered buffer data lies in, or -1.
+ * @param callback Callback that is invoked on completion. It gets
+ *   IDEVICE_E_UNKNOWN_ERROR when the connection was closed.
+ * @param user_data Custom pointer passed to the callback.
+ *
+ * @return IDEVICE_E_SUCCESS if ok, IDEVICE_E_INVALID_ARG when a parameter is
+ *   invalid or the connection uses SSL, or IDEVICE_E_UNKNOWN_ERROR when the
+ *   ring is full.
+ */
+idevice_error_t idevice_io_ring_queue_receive(idevice_io_ring_t ring, idevice_connection_t connection, char *data, uint32_t len, int buffer_index, idevice_io_cb_t callback, void *user_data);
+
+/**
+ * Hands all queued operations to the kernel with a single system call.
+ *
+ * @param ring The ring to submit.
+ *
+ * @return IDEVICE_E_SUCCESS if ok, otherwise an error code.
+ */
+idevice_error_t idevice_io_ring_submit(idevice_io_ring_t ring);
+
+/**
+ * Submits queued operations, waits for completions and invokes the
+ * callbacks of all operations that completed.
+ *
+ * @param ring The ring to dispatch.
+ * @param timeout Milliseconds to wait for the first completion, 0 to wait
+ *   forever.
+ * @param completed Optional pointer that will be set to the number of
+ *   completed operations.
+ *
+ * @return IDEVICE_E_SUCCESS if ok, IDEVICE_E_TIMEOUT if nothing completed
+ *   in time, otherwise an error code.
+ */
+idevice_error_t idevice_io_ring_dispatch(idevice_io_ring_t ring, unsigned int timeout, int *completed);
+
+/* port forwarding */
+
+/**
+ * Creates a port forwarder. A forwarder relays the connections to any
+ * number of local ports to ports of devices from a single thread, without
+ * a thread per connection. On Linux the data is moved with splice() and
+ * never copied to user space.
+ *
+ * @param forward Pointer that will be set to the new forwarder.
+ *
+ * @return IDEVICE_E_SUCCESS if ok, IDEVICE_E_INVALID_ARG when forward is
+ *   NULL, or IDEVICE_E_UNKNOWN_ERROR if the forwarding thread could not be
+ *   started.
+ */
+idevice_error_t idevice_forward_new(idevice_forward_t *forward);
+
+/**
+ * Starts listening on a local port and forwards each connection accepted
+ * there to a port of the device, like iproxy does.
+ *
+ * @note The device must not be freed before the forwarder. Unlike the
+ *   forwarding itself, connecting to the device is done synchronously when
+ *   a connection is accepted.
+ *
+ * @param forward The forwarder to add the port to.
+ * @param device The device to forward the connections to.
+ * @param local_port Port to listen on at 127.0.0.1, 0 to pick a free one.
+ * @param device_port Port on the device to connect to.
+ * @param bound_port Optional pointer that will be set to the port listened
+ *   on, useful when local_port is 0.
+ *
+ * @return IDEVICE_E_SUCCESS if ok, IDEVICE_E_INVALID_ARG when a parameter is
+ *   invalid, or IDEVICE_E_UNKNOWN_ERROR if the port could not be bound.
+ */
+idevice_error_t idevice_forward_add(idevice_forward_t forward, idevice_t device, uint16_t local_port, uint16_t device_port, uint16_t *bound_port);
+
+/**
+ * Stops a port forwarder, closes all forwarded connections and frees it.
+ *
+ * @param forward The forwarder to free.
+ *
+ * @return IDEVICE_E_SUCCESS if ok, IDEVICE_E_INVALID_ARG when forward is
+ *   NULL.
+ */
+idevice_error_t idevice_forward_free(idevice_forward_t forward);
+
 /* misc */
 
 /**
@@ -99,6 +99,14 @@ struct lockdownd_service_descriptor {
 };
 typedef struct lockdownd_service_descriptor *lockdownd_service_descriptor_t;
 
+/** A device to perform a handshake with in lockdownd_client_new_with_handshake_multi() */
+struct lockdownd_handshake_entry {
+	idevice_t device;          /**< The device, set by the caller */
+	lockdownd_client_t client; /**< Set to the connected client on success, NULL otherwise */
+	lockdownd_error_t error;   /**< Set to the result of the handshake */
+};
+typedef struct lockdownd_handshake_entry lockdownd_handshake_entry_t;
+
 /* Interface */
 
 /**
@@ -122,6 +130,8 @@ lockdownd_error_t lockdownd_client_new(idevice_t device, lockdownd_client_t *cli
  * Creates a new lockdownd client for the device and starts initial handshake.
  * The handshake consists out of query_type, validate_pair, pair and
  * start_session calls. It uses the internal pairing record management.
+ * The result of query_type and the device version are remembered on the
+ * device handle, so later clients for the same handle skip those requests.
  *
  * @note The device disconnects automatically if the lockdown connection idles
  *  for more than 10 seconds. Make sure to call lockdownd_client_free() as soon
@@ -137,6 +147,76 @@ lockdownd_error_t lockdownd_client_new(idevice_t device, lockdownd_client_t *cli
  */
 lockdownd_error_t lockdownd_client_new_with_handshake(idevice_t device, lockdownd_client_t *client, const char *label);
 
+/**
+ * Performs the handshake of lockdownd_client_new_with_handshake() for many
+ * devices at once, including pairing and pair validation where needed.
+ * The handshakes run in parallel on a pool of threads, so the round trips
+ * and key generation of the devices overlap.
+ *
+ * @note Each device may only appear once in entries. Combined with
+ *  lockdownd_set_pairing_key_pool() pairing many new devices becomes
+ *  bound by the round trips only.
+ *
+ * @param entries The devices to perform the handshake with. For each entry
+ *  client and error are set to the result for its device.
+ * @param count The number of entries
+ * @param label The label to use for communication. Usually the program name.
+ *  Pass NULL to disable sending the label in requests to lockdownd.
+ * @param max_parallel The maximum number of handshakes to run at the same
+ *  time, or 0 to run all of them at once
+ *
+ * @return LOCKDOWN_E_SUCCESS if the handshake succeeded for all devices,
+ *  LOCKDOWN_E_INVALID_ARG when entries is NULL or count is 0, or the error
+ *  of the first entry that failed otherwise
+ */
+lockdownd_error_t lockdownd_client_new_with_handshake_multi(lockdownd_handshake_entry_t *entries, unsigned int count, const char *label, unsigned int max_parallel);
+
+/**
+ * Enables or disables reusing a single lockdown session for starting
+ * services on the given device with the *_client_start_service() helpers.
+ * Without reuse, every service start performs a full lockdown handshake
+ * including a TLS session start. With reuse, the first service start
+ * establishes a session that is kept open and shared by later service
+ * starts for the same device handle, also across threads. The session is
+ * closed when reuse is disabled again or the device handle is freed.
+ *
+ * @param device The device to configure
+ * @param enable Non-zero to enable session reuse, 0 to disable it
+ *
+ * @return LOCKDOWN_E_SUCCESS on success, LOCKDOWN_E_INVALID_ARG when device
+ *     is NULL
+ */
+lockdownd_error_t lockdownd_set_session_reuse(idevice_t device, int enable);
+
+/**
+ * Enables or disables caching of immutable and slow-changing values of the
+ * global domain, like UniqueChipID, ProductType or DeviceName, for the given
+ * device. While enabled, lockdownd_get_value() and lockdownd_get_values()
+ * return cached values without querying the device. Each value stays valid
+ * for a fixed time depending on how often it can change; hardware
+ * identifiers never expire. Setting or removing a value of the global domain
+ * drops its cached copy.
+ *
+ * @param device The device to configure
+ * @param enable Non-zero to enable the cache, 0 to disable and clear it
+ *
+ * @return LOCKDOWN_E_SUCCESS on success, LOCKDOWN_E_INVALID_ARG when device
+ *     is NULL
+ */
+lockdownd_error_t lockdownd_set_value_cache(idevice_t device, int enable);
+
+/**
+ * Drops a value from the value cache of the given device so that the next
+ * query will fetch it from the device again.
+ *
+ * @param device The device to invalidate the cached value for
+ * @param key The key of the value to drop, or NULL to drop all cached values
+ *
+ * @return LOCKDOWN_E_SUCCESS on success, LOCKDOWN_E_INVALID_ARG when device
+ *     is NULL
+ */
+lockdownd_error_t lockdownd_invalidate_value_cache(idevice_t device, const char *key);
+
 /**
  * Closes the lockdownd client session if one is running and frees up the
  * lockdownd_client struct.
@@ -171,6 +251,33 @@ lockdownd_error_t lockdownd_query_type(lockdownd_client_t client, char **type);
  */
 lockdownd_error_t lockdownd_get_value(lockdownd_client_t client, const char *domain, const char *key, plist_t *value);
 
+/**
+ * Retrieves multiple preferences at once. The GetValue requests for all
+ * domain/key pairs are pipelined over the session instead of waiting for
+ * each response before sending the next request, so querying many values
+ * costs about one round trip to the device.
+ *
+ * Values of the global domain are stored in the top level of the resulting
+ * dictionary, values of other domains in a dictionary named after the
+ * domain. If a key is NULL, all values of the domain are stored in the
+ * respective level. Values that the device refuses to return, e.g. because
+ * they are missing or prohibited, are left out of the result.
+ *
+ * @param client An initialized lockdownd client.
+ * @param domains Array of count domains to query on, with NULL entries for
+ *    the global domain
+ * @param keys Array of count key names to request, with NULL entries to query
+ *    for all keys of the respective domain
+ * @param count Number of domain/key pairs to query
+ * @param values Pointer that will be set to a plist dictionary holding the
+ *    retrieved values. Must be freed with plist_free() by the caller.
+ *
+ * @return LOCKDOWN_E_SUCCESS on success, LOCKDOWN_E_INVALID_ARG when client
+ *    or values is NULL, or an error code if the communication with the
+ *    device failed.
+ */
+lockdownd_error_t lockdownd_get_values(lockdownd_client_t client, const char **domains, const char **keys, unsigned int count, plist_t *values);
+
 /**
  * Sets a preferences value using a plist and optional by domain and/or key name.
  *
@@ -349,6 +456,25 @@ lockdownd_error_t lockdownd_validate_pair(lockdownd_client_t client, lockdownd_p
  */
 lockdownd_error_t lockdownd_unpair(lockdownd_client_t client, lockdownd_pair_record_t pair_record);
 
+/**
+ * Configures a pool of pre-generated RSA keys for the host and root keys
+ * that are created when pairing with the internal pairing record management.
+ * A background thread keeps the pool filled, which reduces the time a
+ * lockdownd_pair() call needs to generate the pair record to almost the
+ * time of its round trip to the device. The pool is shared by all clients
+ * of the process.
+ *
+ * @param size Number of keys to keep ready. Pass 0 to stop generating keys;
+ *    keys already in the pool will still be used.
+ * @param filename File to persist the generated keys in so they survive
+ *    process restarts, or NULL to only keep them in memory. The file is only
+ *    readable by its owner since it contains private keys.
+ *
+ * @return LOCKDOWN_E_SUCCESS on success, or LOCKDOWN_E_UNKNOWN_ERROR when
+ *    the key generator could not be started.
+ */
+lockdownd_error_t lockdownd_set_pairing_key_pool(unsigned int size, const char *filename);
+
 /**
  * Activates the device. Only works within an open session.
  * The ActivationRecord plist dictionary must be obtained using the
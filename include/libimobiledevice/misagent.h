@@ -151,6 +151,33 @@ misagent_error_t misagent_copy_all(misagent_client_t client, plist_t* profiles);
  */
 misagent_error_t misagent_remove(misagent_client_t client, const char* profileID);
 
+/**
+ * Makes the installed provisioning profiles match a given set. The UUIDs of
+ * the installed profiles are fetched with a single request, and only the
+ * profiles that are missing are installed, and with remove_unlisted the
+ * ones that are not in the set removed. These requests are sent without
+ * waiting for each response.
+ *
+ * @param client The connected misagent to use.
+ * @param profiles A PLIST_DICT with the UUIDs of the wanted profiles as
+ *    keys. Each value is either the profile data (PLIST_DATA) or the path
+ *    to a .mobileprovision file (PLIST_STRING), which is only read if the
+ *    profile has to be installed.
+ * @param remove_unlisted 1 to remove the installed profiles that are not
+ *    in profiles, 0 to keep them.
+ * @param installed Set to the number of profiles that were installed, may
+ *    be NULL.
+ * @param removed Set to the number of profiles that were removed, may be
+ *    NULL.
+ *
+ * @return MISAGENT_E_SUCCESS on success, MISAGENT_E_INVALID_ARG when
+ *     client or profiles is invalid or a profile file can't be read,
+ *     MISAGENT_E_REQUEST_FAILED if the device refused an install or
+ *     removal (see misagent_get_status_code() for the first failure), or
+ *     an MISAGENT_E_* error code otherwise.
+ */
+misagent_error_t misagent_sync(misagent_client_t client, plist_t profiles, int remove_unlisted, unsigned int *installed, unsigned int *removed);
+
 /**
  * Retrieves the status code from the last operation.
  *
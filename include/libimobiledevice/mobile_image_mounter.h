@@ -47,6 +47,9 @@ typedef enum {
 typedef struct mobile_image_mounter_client_private mobile_image_mounter_client_private;
 typedef mobile_image_mounter_client_private *mobile_image_mounter_client_t; /**< The client handle. */
 
+typedef struct mobile_image_mounter_image_private mobile_image_mounter_image_private;
+typedef mobile_image_mounter_image_private *mobile_image_mounter_image_t; /**< Handle of an image loaded into memory. */
+
 /** callback for image upload */
 typedef ssize_t (*mobile_image_mounter_upload_cb_t) (void* buffer, size_t length, void *user_data);
 
@@ -128,6 +131,43 @@ mobile_image_mounter_error_t mobile_image_mounter_lookup_image(mobile_image_moun
  */
 mobile_image_mounter_error_t mobile_image_mounter_upload_image(mobile_image_mounter_client_t client, const char *image_type, size_t image_size, const char *signature, uint16_t signature_size, mobile_image_mounter_upload_cb_t upload_cb, void* userdata);
 
+/**
+ * Uploads an image from an open file with an optional signature to the
+ * device. Where supported, the file is memory mapped and sent in large
+ * writes directly from the mapping, avoiding the copies of
+ * mobile_image_mounter_upload_image().
+ *
+ * @param client The connected mobile_image_mounter client.
+ * @param image_type Type of image that is being uploaded.
+ * @param fd File descriptor of the image file, opened for reading. The
+ *    whole file is uploaded. The descriptor is not closed.
+ * @param signature Buffer with a signature of the image being uploaded. If
+ *    NULL, no signature will be used.
+ * @param signature_size Total size of the image signature buffer. If 0, no
+ *    signature will be used.
+ *
+ * @return MOBILE_IMAGE_MOUNTER_E_SUCCESS on succes, or a
+ *    MOBILE_IMAGE_MOUNTER_E_* error code otherwise.
+ */
+mobile_image_mounter_error_t mobile_image_mounter_upload_image_fd(mobile_image_mounter_client_t client, const char *image_type, int fd, const char *signature, uint16_t signature_size);
+
+/**
+ * Uploads an image file with an optional signature to the device, like
+ * mobile_image_mounter_upload_image_fd().
+ *
+ * @param client The connected mobile_image_mounter client.
+ * @param image_type Type of image that is being uploaded.
+ * @param image_path Path of the image file on the host.
+ * @param signature Buffer with a signature of the image being uploaded. If
+ *    NULL, no signature will be used.
+ * @param signature_size Total size of the image signature buffer. If 0, no
+ *    signature will be used.
+ *
+ * @return MOBILE_IMAGE_MOUNTER_E_SUCCESS on succes, or a
+ *    MOBILE_IMAGE_MOUNTER_E_* error code otherwise.
+ */
+mobile_image_mounter_error_t mobile_image_mounter_upload_image_file(mobile_image_mounter_client_t client, const char *image_type, const char *image_path, const char *signature, uint16_t signature_size);
+
 /**
  * Mounts an image on the device.
  *
@@ -164,6 +204,71 @@ mobile_image_mounter_error_t mobile_image_mounter_mount_image(mobile_image_mount
  */
 mobile_image_mounter_error_t mobile_image_mounter_hangup(mobile_image_mounter_client_t client);
 
+/**
+ * Loads an image and its signature into memory, so they can be mounted on
+ * any number of devices without reading them again. Images are shared in
+ * the process: loading the same files again returns the same handle until
+ * it has been freed as often as it was loaded.
+ *
+ * @param image_path Path of the image file on the host.
+ * @param signature_path Path of the image signature file on the host.
+ * @param image Pointer that will be set to the image handle.
+ *
+ * @return MOBILE_IMAGE_MOUNTER_E_SUCCESS on success,
+ *    MOBILE_IMAGE_MOUNTER_E_INVALID_ARG when the files can't be read, or
+ *    MOBILE_IMAGE_MOUNTER_E_UNKNOWN_ERROR otherwise.
+ */
+mobile_image_mounter_error_t mobile_image_mounter_image_load(const char *image_path, const char *signature_path, mobile_image_mounter_image_t *image);
+
+/**
+ * Releases an image loaded with mobile_image_mounter_image_load().
+ *
+ * @param image The image to release.
+ *
+ * @return MOBILE_IMAGE_MOUNTER_E_SUCCESS on success, or
+ *    MOBILE_IMAGE_MOUNTER_E_INVALID_ARG when image is NULL.
+ */
+mobile_image_mounter_error_t mobile_image_mounter_image_free(mobile_image_mounter_image_t image);
+
+/**
+ * Mounts a loaded image unless the device reports an image with the same
+ * signature as already mounted, in which case nothing is uploaded.
+ *
+ * @param client The connected mobile_image_mounter client.
+ * @param image The image to mount.
+ * @param image_type Type of the image, usually "Developer".
+ * @param uploaded Pointer that will be set to 1 if the image had to be
+ *    uploaded and mounted, or 0 if it was already mounted. Can be NULL.
+ *
+ * @return MOBILE_IMAGE_MOUNTER_E_SUCCESS if the image is mounted, or a
+ *    MOBILE_IMAGE_MOUNTER_E_* error code otherwise.
+ */
+mobile_image_mounter_error_t mobile_image_mounter_mount_loaded_image(mobile_image_mounter_client_t client, mobile_image_mounter_image_t image, const char *image_type, int *uploaded);
+
+/**
+ * Mounts a loaded image on a number of devices in parallel, like
+ * mobile_image_mounter_mount_loaded_image(). Every device gets its own
+ * connection, and devices that already have the image mounted are only
+ * looked up.
+ *
+ * @param image The image to mount.
+ * @param image_type Type of the image, usually "Developer".
+ * @param udids Array of UDIDs of the devices to mount the image on.
+ * @param count Number of entries in udids.
+ * @param max_parallel Maximum number of devices handled at the same time,
+ *    or 0 to handle all at once.
+ * @param errors Array of count entries that will receive the result for
+ *    each device. Can be NULL.
+ * @param uploaded Array of count entries that will be set to 1 for each
+ *    device the image had to be uploaded to. Can be NULL.
+ *
+ * @return MOBILE_IMAGE_MOUNTER_E_SUCCESS on success, or
+ *    MOBILE_IMAGE_MOUNTER_E_COMMAND_FAILED if mounting failed on at least
+ *    one device (see errors), or another MOBILE_IMAGE_MOUNTER_E_* error
+ *    code otherwise.
+ */
+mobile_image_mounter_error_t mobile_image_mounter_mount_image_on_devices(mobile_image_mounter_image_t image, const char *image_type, const char **udids, unsigned int count, unsigned int max_parallel, mobile_image_mounter_error_t *errors, int *uploaded);
+
 #ifdef __cplusplus
 }
 #endif
@@ -46,6 +46,38 @@ typedef enum {
 typedef struct mobileactivation_client_private mobileactivation_client_private;
 typedef mobileactivation_client_private *mobileactivation_client_t; /**< The client handle. */
 
+/** Steps of a session mode activation, see mobileactivation_activate_multi() */
+typedef enum {
+	MOBILEACTIVATION_STEP_CONNECT,         /**< connecting to the mobileactivation service */
+	MOBILEACTIVATION_STEP_SESSION_INFO,    /**< mobileactivation_create_activation_session_info() */
+	MOBILEACTIVATION_STEP_HANDSHAKE,       /**< the handshake callback of the server */
+	MOBILEACTIVATION_STEP_ACTIVATION_INFO, /**< mobileactivation_create_activation_info_with_session() */
+	MOBILEACTIVATION_STEP_ACTIVATION,      /**< the activation callback of the server */
+	MOBILEACTIVATION_STEP_ACTIVATE,        /**< mobileactivation_activate_with_session() */
+	MOBILEACTIVATION_STEP_DONE             /**< the device was activated */
+} mobileactivation_step_t;
+
+/**
+ * Performs the server exchanges of a session mode activation. Both
+ * callbacks may be called from several threads at the same time, each
+ * time for a different device.
+ */
+typedef struct {
+	/** Sends the session info of a device to drmHandshake and sets handshake_response to the response */
+	mobileactivation_error_t (*handshake)(idevice_t device, plist_t session_info, plist_t *handshake_response, void *user_data);
+	/** Sends the activation info of a device to deviceActivation and sets activation_record and headers to the response */
+	mobileactivation_error_t (*activation)(idevice_t device, plist_t activation_info, plist_t *activation_record, plist_t *headers, void *user_data);
+	void *user_data; /**< Custom pointer passed to the callbacks */
+} mobileactivation_server_t;
+
+/** A device to activate in mobileactivation_activate_multi() */
+struct mobileactivation_activation_entry {
+	idevice_t device;               /**< The device, set by the caller */
+	mobileactivation_step_t step;   /**< Set to the step that failed, or MOBILEACTIVATION_STEP_DONE */
+	mobileactivation_error_t error; /**< Set to the result of the activation */
+};
+typedef struct mobileactivation_activation_entry mobileactivation_activation_entry_t;
+
 /**
  * Connects to the mobileactivation service on the specified device.
  *
@@ -184,6 +216,34 @@ mobileactivation_error_t mobileactivation_activate_with_session(mobileactivation
  */
 mobileactivation_error_t mobileactivation_deactivate(mobileactivation_client_t client);
 
+/**
+ * Activates many devices in 'session' mode at once. Each device goes
+ * through mobileactivation_create_activation_session_info(), the handshake
+ * with the server, mobileactivation_create_activation_info_with_session(),
+ * the activation request to the server and finally
+ * mobileactivation_activate_with_session(), using a single connection to
+ * its mobileactivation service for all steps. The devices run in parallel
+ * on a pool of threads, so the steps on some devices overlap with the
+ * server round trips of others.
+ *
+ * @note Each device may only appear once in entries. Enabling
+ *  lockdownd_set_session_reuse() for the devices saves the lockdown
+ *  handshake if other services are started afterwards.
+ *
+ * @param entries The devices to activate. For each entry step and error
+ *  are set to the result for its device.
+ * @param count The number of entries
+ * @param server The callbacks performing the server exchanges
+ * @param label The label to use for communication. Usually the program name.
+ * @param max_parallel The maximum number of devices to activate at the same
+ *  time, or 0 to activate all of them at once
+ *
+ * @return MOBILEACTIVATION_E_SUCCESS if all devices were activated,
+ *  MOBILEACTIVATION_E_INVALID_ARG when entries or server is NULL or count
+ *  is 0, or the error of the first entry that failed otherwise
+ */
+mobileactivation_error_t mobileactivation_activate_multi(mobileactivation_activation_entry_t *entries, unsigned int count, const mobileactivation_server_t *server, const char *label, unsigned int max_parallel);
+
 #ifdef __cplusplus
 }
 #endif
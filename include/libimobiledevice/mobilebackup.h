@@ -106,6 +106,26 @@ mobilebackup_error_t mobilebackup_client_free(mobilebackup_client_t client);
  */
 mobilebackup_error_t mobilebackup_receive(mobilebackup_client_t client, plist_t *plist);
 
+/**
+ * Polls the device for mobilebackup data like mobilebackup_receive() and,
+ * if a DLSendFile message was received, returns a pointer to the file data
+ * hunk it carries so it can be written out without copying it.
+ *
+ * @param client The mobilebackup client
+ * @param message A pointer to the location where the received plist should
+ *    be stored. The caller has to free it using plist_free() once the data
+ *    is not needed anymore.
+ * @param data Set to the file data hunk of a DLSendFile message, or NULL if
+ *    a different message was received. The data is owned by message.
+ * @param length Set to the length of the file data hunk.
+ *
+ * @return MOBILEBACKUP_E_SUCCESS on success, MOBILEBACKUP_E_INVALID_ARG if
+ *    one of the parameters is invalid, MOBILEBACKUP_E_PLIST_ERROR if a
+ *    DLSendFile message without file data was received, or an error code
+ *    of the underlying receive operation.
+ */
+mobilebackup_error_t mobilebackup_receive_file_hunk(mobilebackup_client_t client, plist_t *message, const char **data, uint64_t *length);
+
 /**
  * Sends mobilebackup data to the device
  *
@@ -144,6 +144,26 @@ mobilebackup2_error_t mobilebackup2_receive_message(mobilebackup2_client_t clien
  */
 mobilebackup2_error_t mobilebackup2_send_raw(mobilebackup2_client_t client, const char *data, uint32_t length, uint32_t *bytes);
 
+/**
+ * Send binary data from multiple buffers to the device.
+ * The buffers are sent in order as one contiguous stream, which allows
+ * to send a chunk header together with its payload.
+ *
+ * @note This function returns MOBILEBACKUP2_E_SUCCESS even if less than the
+ *     requested length has been sent. The fourth parameter is required and
+ *     must be checked to ensure if the whole data has been sent.
+ *
+ * @param client The MobileBackup client to send to.
+ * @param iov Array of buffers to send
+ * @param iovcnt Number of entries in iov
+ * @param bytes Number of bytes actually sent
+ *
+ * @return MOBILEBACKUP2_E_SUCCESS if any data was successfully sent,
+ *     MOBILEBACKUP2_E_INVALID_ARG if one of the parameters is invalid,
+ *     or MOBILEBACKUP2_E_MUX_ERROR if sending of the data failed.
+ */
+mobilebackup2_error_t mobilebackup2_send_rawv(mobilebackup2_client_t client, const idevice_iovec_t *iov, int iovcnt, uint32_t *bytes);
+
 /**
  * Receive binary from the device.
  *
@@ -68,6 +68,34 @@ typedef struct {
 } mobilesync_anchors;
 typedef mobilesync_anchors *mobilesync_anchors_t; /**< Anchors used by the device and computer. */
 
+/**
+ * Callback invoked by mobilesync_receive_changes_with_callback() for each
+ * batch of changed entities received from the device.
+ *
+ * @param entities The changed entity records as a PLIST_DICT. The plist is
+ *     owned by the library and freed after the callback returns, use
+ *     plist_copy() to keep (parts of) it.
+ * @param is_last_record 1 if this is the last batch of the session.
+ * @param actions Additional flags sent along with the batch as a PLIST_DICT
+ *     or NULL. Owned by the library like entities.
+ *
+ * @return 0 to continue or a non-zero value to cancel the session.
+ */
+typedef int (*mobilesync_receive_changes_cb_t)(plist_t entities, uint8_t is_last_record, plist_t actions, void *user_data);
+
+/**
+ * Callback invoked by mobilesync_send_changes_with_callback() to fill the
+ * next batch of changed entities sent to the device.
+ *
+ * @param entities An empty PLIST_DICT to add up to max_records entity
+ *     records to. It is owned by the library and freed once it was sent.
+ * @param max_records The maximum number of records to add to entities.
+ * @param is_last_record Set this to 1 if no further batches follow.
+ *
+ * @return 0 to continue or a non-zero value to cancel the session.
+ */
+typedef int (*mobilesync_send_changes_cb_t)(plist_t entities, uint32_t max_records, uint8_t *is_last_record, void *user_data);
+
 /* Interface */
 
 /**
@@ -236,6 +264,28 @@ mobilesync_error_t mobilesync_clear_all_records_on_device(mobilesync_client_t cl
  */
 mobilesync_error_t mobilesync_receive_changes(mobilesync_client_t client, plist_t *entities, uint8_t *is_last_record, plist_t *actions);
 
+/**
+ * Receives all changed entities of the currently set data class from the
+ * device, passing each batch to a callback instead of returning copies.
+ *
+ * Every batch is acknowledged as soon as it has been received so the device
+ * can prepare the next batch while the callback processes the current one.
+ * This replaces calling mobilesync_receive_changes() and
+ * mobilesync_acknowledge_changes_from_device() in a loop.
+ *
+ * @param client The mobilesync client
+ * @param callback The callback to invoke for each batch
+ * @param user_data User data passed to the callback
+ *
+ * @retval MOBILESYNC_E_SUCCESS on success
+ * @retval MOBILESYNC_E_INVALID_ARG if one of the parameters is invalid
+ * @retval MOBILESYNC_E_PLIST_ERROR if a received plist is not of valid form
+ * @retval MOBILESYNC_E_CANCELLED if the device explicitly cancelled the
+ * session or the callback returned non-zero, in which case the session has
+ * been cancelled using mobilesync_cancel()
+ */
+mobilesync_error_t mobilesync_receive_changes_with_callback(mobilesync_client_t client, mobilesync_receive_changes_cb_t callback, void *user_data);
+
 /**
  * Acknowledges to the device that the changes have been merged on the computer
  *
@@ -300,6 +350,38 @@ mobilesync_error_t mobilesync_send_changes(mobilesync_client_t client, plist_t e
  */
 mobilesync_error_t mobilesync_remap_identifiers(mobilesync_client_t client, plist_t *mapping);
 
+/**
+ * Sends changed entities of the currently set data class to the device in
+ * batches that are filled on demand by a callback, and collects the
+ * remapped identifiers the device reports for each batch.
+ *
+ * Up to window batches are sent before the remapped identifiers for the
+ * first of them are awaited, so the device does not sit idle while the
+ * next batch is prepared and sent. This replaces calling
+ * mobilesync_send_changes() and mobilesync_remap_identifiers() in a loop.
+ *
+ * @param client The mobilesync client
+ * @param batch_size The maximum number of records per batch, 0 for a default
+ * @param window The maximum number of batches awaiting their remapped
+ *    identifiers, 0 for a default
+ * @param actions Additional actions for the device created with
+ *    mobilesync_actions_new() to pass with every batch, or NULL
+ * @param callback The callback to invoke to fill each batch
+ * @param user_data User data passed to the callback
+ * @param mapping A pointer to store a PLIST_DICT with all identifier
+ *    remappings reported by the device, or NULL to discard them
+ *
+ * @retval MOBILESYNC_E_SUCCESS on success
+ * @retval MOBILESYNC_E_INVALID_ARG if one of the parameters is invalid
+ * @retval MOBILESYNC_E_PLIST_ERROR if a received plist is not of valid form
+ * @retval MOBILESYNC_E_WRONG_DIRECTION if the current sync direction does
+ * not permit this call
+ * @retval MOBILESYNC_E_CANCELLED if the device explicitly cancelled the
+ * session or the callback returned non-zero, in which case the session has
+ * been cancelled using mobilesync_cancel()
+ */
+mobilesync_error_t mobilesync_send_changes_with_callback(mobilesync_client_t client, uint32_t batch_size, uint32_t window, plist_t actions, mobilesync_send_changes_cb_t callback, void *user_data, plist_t *mapping);
+
 /* Helper */
 
 /**
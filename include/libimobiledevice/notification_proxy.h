@@ -89,6 +89,15 @@ typedef np_client_private *np_client_t; /**< The client handle. */
 /** Reports which notification was received. */
 typedef void (*np_notify_cb_t) (const char *notification, void *user_data);
 
+/** Reports a batch of notifications that were received together. */
+typedef void (*np_notify_batch_cb_t) (const char **notifications, int count, void *user_data);
+
+typedef struct np_hub_subscription_private np_hub_subscription_private;
+typedef np_hub_subscription_private *np_hub_subscription_t; /**< A subscription to the notification hub. */
+
+/** Reports which notification a device of a notification hub subscription sent. */
+typedef void (*np_hub_cb_t) (const char *udid, const char *notification, void *user_data);
+
 /* Interface */
 
 /**
@@ -168,8 +177,8 @@ np_error_t np_observe_notifications(np_client_t client, const char **notificatio
 /**
  * This function allows an application to define a callback function that will
  * be called when a notification has been received.
- * It will start a thread that polls for notifications and calls the callback
- * function if a notification has been received.
+ * It will start a thread that waits for notifications and calls the callback
+ * function as soon as a notification has been received.
  * In case of an error condition when polling for notifications - e.g. device
  * disconnect - the thread will call the callback function with an empty
  * notification "" and terminate itself.
@@ -189,6 +198,76 @@ np_error_t np_observe_notifications(np_client_t client, const char **notificatio
  */
 np_error_t np_set_notify_callback(np_client_t client, np_notify_cb_t notify_cb, void *userdata);
 
+/**
+ * This function allows an application to define a callback function that will
+ * be called with all notifications that have been received together.
+ * Like np_set_notify_callback it starts a thread that waits for notifications,
+ * but instead of calling the callback once per notification it passes all
+ * notifications that are already available at once.
+ * In case of an error condition when waiting for notifications - e.g. device
+ * disconnect - the thread will call the callback function with a single empty
+ * notification "" and terminate itself.
+ *
+ * @param client the NP client
+ * @param notify_cb pointer to a callback function or NULL to de-register a
+ *        previously set callback function.
+ * @param user_data Pointer that will be passed to the callback function as
+ *        user data. If notify_cb is NULL, this parameter is ignored.
+ *
+ * @note Only one callback function can be registered at the same time;
+ *       any previously set callback function will be removed automatically.
+ *       The notification strings are only valid during the callback.
+ *
+ * @return NP_E_SUCCESS when the callback was successfully registered,
+ *         NP_E_INVALID_ARG when client is NULL, or NP_E_UNKNOWN_ERROR when
+ *         the callback thread could no be created.
+ */
+np_error_t np_set_notify_batch_callback(np_client_t client, np_notify_batch_cb_t notify_cb, void *user_data);
+
+/* Hub */
+
+/**
+ * Subscribes to notifications of a device through the process-wide
+ * notification hub. All subscriptions for the same device share a single
+ * notification_proxy connection and notifier thread; the device is only
+ * asked to observe notifications no other subscription observes already,
+ * and every notification received is passed to all subscriptions that
+ * want it. The connection is closed with the last subscription.
+ *
+ * If the connection to the device is lost, every subscription of the
+ * device is called with an empty notification "" and receives nothing
+ * afterwards; it must still be released with np_hub_unsubscribe().
+ *
+ * @note The callback is invoked from the notifier thread of the device
+ *    without any lock of the hub held. It must not call any np_hub_*
+ *    function for a subscription of the same device.
+ *
+ * @param udid The UDID of the device.
+ * @param options Lookup options passed to idevice_new_with_options().
+ * @param notification_spec The notifications to receive, as an array of
+ *    const char* with a terminating NULL entry, or NULL to receive any
+ *    notification observed for the device by any subscription.
+ * @param callback Callback function receiving the notifications.
+ * @param user_data Custom pointer passed to the callback function.
+ * @param subscription Pointer that will be set to the new subscription.
+ *
+ * @return NP_E_SUCCESS on success, NP_E_INVALID_ARG when udid, callback or
+ *    subscription is NULL, or an error code if connecting to the device or
+ *    observing the notifications failed.
+ */
+np_error_t np_hub_subscribe(const char *udid, enum idevice_options options, const char **notification_spec, np_hub_cb_t callback, void *user_data, np_hub_subscription_t *subscription);
+
+/**
+ * Ends a subscription to the notification hub. Once this function returns,
+ * the callback of the subscription is neither running nor called again.
+ *
+ * @param subscription The subscription to end.
+ *
+ * @return NP_E_SUCCESS on success or NP_E_INVALID_ARG when subscription is
+ *    NULL.
+ */
+np_error_t np_hub_unsubscribe(np_hub_subscription_t subscription);
+
 #ifdef __cplusplus
 }
 #endif
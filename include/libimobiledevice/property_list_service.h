@@ -29,6 +29,7 @@ extern "C" {
 #endif
 
 #include <libimobiledevice/lockdown.h>
+#include <libimobiledevice/service.h>
 
 /* Error Codes */
 typedef enum {
@@ -39,12 +40,24 @@ typedef enum {
 	PROPERTY_LIST_SERVICE_E_SSL_ERROR       = -4,
 	PROPERTY_LIST_SERVICE_E_RECEIVE_TIMEOUT = -5,
 	PROPERTY_LIST_SERVICE_E_NOT_ENOUGH_DATA = -6,
+	PROPERTY_LIST_SERVICE_E_DEVICE_DETACHED = -7,
+	PROPERTY_LIST_SERVICE_E_CANCELLED       = -8,
 	PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR   = -256
 } property_list_service_error_t;
 
 typedef struct property_list_service_client_private property_list_service_private;
 typedef property_list_service_private* property_list_service_client_t; /**< The client handle. */
 
+/** Called with the response to a request sent by property_list_service_send_receive_pipelined(). The response is freed after the callback returns. */
+typedef void (*property_list_service_response_cb_t)(plist_t response, void *user_data);
+
+/** A request for property_list_service_send_receive_pipelined(). */
+typedef struct {
+	plist_t request; /**< The plist to send */
+	property_list_service_response_cb_t callback; /**< Called with the response to the request, may be NULL */
+	void *user_data; /**< User data passed to the callback */
+} property_list_service_request_t;
+
 /* Interface */
 
 /**
@@ -117,12 +130,90 @@ property_list_service_error_t property_list_service_send_binary_plist(property_l
  */
 property_list_service_error_t property_list_service_receive_plist_with_timeout(property_list_service_client_t client, plist_t *plist, unsigned int timeout);
 
+/**
+ * Receives a single message using the given property list service client
+ * without parsing it, so the caller can decide if and how to parse it.
+ *
+ * The returned data points into the receive buffer of the client, which is
+ * reused for later messages. It stays valid until the next message is
+ * received with this client or the client is freed.
+ *
+ * @param client The property list service client to use for receiving
+ * @param data Pointer that will be set to the received message data
+ * @param length Pointer that will be set to the length of the message
+ * @param timeout Maximum time in milliseconds to wait for data.
+ *
+ * @return PROPERTY_LIST_SERVICE_E_SUCCESS on success,
+ *      PROPERTY_LIST_SERVICE_E_INVALID_ARG when an argument is NULL,
+ *      PROPERTY_LIST_SERVICE_E_RECEIVE_TIMEOUT when the connection times out,
+ *      PROPERTY_LIST_SERVICE_E_PLIST_ERROR when the message is larger than
+ *      the maximum message size, PROPERTY_LIST_SERVICE_E_MUX_ERROR when a
+ *      communication error occurs, or PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR
+ *      when an unspecified error occurs.
+ */
+property_list_service_error_t property_list_service_receive_raw_with_timeout(property_list_service_client_t client, const char **data, uint32_t *length, unsigned int timeout);
+
+/**
+ * Receives a dictionary plist and looks up a data node in it, without
+ * copying the data out of the plist.
+ *
+ * The returned data is owned by the received plist. It stays valid as long
+ * as the plist is alive, and the caller keeps it by holding on to the plist
+ * instead of duplicating the data with plist_get_data_val().
+ *
+ * @param client The property list service client to use for receiving
+ * @param plist Pointer that will be set to the received plist. It has to be
+ *      freed by the caller with plist_free().
+ * @param key The key of the data node in the received dictionary
+ * @param data Pointer that will be set to the contents of the data node
+ * @param length Pointer that will be set to the length of the data
+ * @param timeout Maximum time in milliseconds to wait for data.
+ *
+ * @return PROPERTY_LIST_SERVICE_E_SUCCESS on success,
+ *      PROPERTY_LIST_SERVICE_E_INVALID_ARG when an argument is NULL,
+ *      PROPERTY_LIST_SERVICE_E_PLIST_ERROR when the received plist is not a
+ *      dictionary or doesn't contain a data node for the given key, or an
+ *      error code from property_list_service_receive_plist_with_timeout().
+ *      On error *plist is set to NULL.
+ */
+property_list_service_error_t property_list_service_receive_plist_data(property_list_service_client_t client, plist_t *plist, const char *key, const char **data, uint64_t *length, unsigned int timeout);
+
+/**
+ * Sets the maximum size of a message the given property list service client
+ * accepts. Messages announcing a larger size are rejected before any memory
+ * is allocated for them. The default is 128 MB.
+ *
+ * @param client The property list service client
+ * @param size Maximum message size in bytes, or 0 for no limit
+ *
+ * @return PROPERTY_LIST_SERVICE_E_SUCCESS on success,
+ *      PROPERTY_LIST_SERVICE_E_INVALID_ARG when client is NULL.
+ */
+property_list_service_error_t property_list_service_set_max_message_size(property_list_service_client_t client, uint32_t size);
+
+/**
+ * Sets an adaptive timeout policy for receiving plists without an explicit
+ * timeout on the given property list service client, see
+ * service_client_set_timeout_policy().
+ *
+ * @param client The property list service client
+ * @param op_class Name of the kind of operations, or NULL for "default"
+ * @param policy The policy to use, or NULL for the fixed default timeout
+ *
+ * @return PROPERTY_LIST_SERVICE_E_SUCCESS on success,
+ *      PROPERTY_LIST_SERVICE_E_INVALID_ARG when client is NULL or the policy
+ *      is invalid, or PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR when memory could
+ *      not be allocated.
+ */
+property_list_service_error_t property_list_service_set_timeout_policy(property_list_service_client_t client, const char *op_class, const service_timeout_policy_t *policy);
+
 /**
  * Receives a plist using the given property list service client.
  * Binary or XML plists are automatically handled.
  *
  * This function is like property_list_service_receive_plist_with_timeout
- *   using a timeout of 10 seconds.
+ *   using a timeout of 30 seconds, or the timeout derived from the policy set
+ *   with property_list_service_set_timeout_policy().
  * @see property_list_service_receive_plist_with_timeout
  *
  * @param client The property list service client to use for receiving
@@ -140,6 +231,32 @@ property_list_service_error_t property_list_service_receive_plist_with_timeout(p
  */
 property_list_service_error_t property_list_service_receive_plist(property_list_service_client_t client, plist_t *plist);
 
+/**
+ * Sends a number of requests and receives their responses in order, without
+ * waiting for each response before sending the next request. Services that
+ * answer every request with exactly one response, like lockdownd or
+ * SpringBoardServices, save one round trip per request this way.
+ *
+ * At most window requests are in flight at any time, so neither side blocks
+ * on a full socket buffer. The callback of each request is invoked with the
+ * response to it as soon as it arrives.
+ *
+ * @param client The property list service client to use
+ * @param requests Array of requests to send
+ * @param count Number of requests in the array
+ * @param binary 1 to send the requests as binary plists, 0 for XML
+ * @param window Maximum number of requests in flight, or 0 for the default
+ *     of 16
+ * @param timeout Maximum time in milliseconds to wait for each response.
+ *
+ * @return PROPERTY_LIST_SERVICE_E_SUCCESS when all responses have been
+ *      received, PROPERTY_LIST_SERVICE_E_INVALID_ARG when an argument is
+ *      invalid, or the error of the first failed send or receive operation.
+ *      After an error the responses to requests still in flight are lost and
+ *      the connection should not be used for further requests.
+ */
+property_list_service_error_t property_list_service_send_receive_pipelined(property_list_service_client_t client, property_list_service_request_t *requests, unsigned int count, int binary, unsigned int window, unsigned int timeout);
+
 /**
  * Enable SSL for the given property list service client.
  *
@@ -165,6 +282,20 @@ property_list_service_error_t property_list_service_enable_ssl(property_list_ser
  */
 property_list_service_error_t property_list_service_disable_ssl(property_list_service_client_t client);
 
+/**
+ * Gets the service client a property list service client communicates
+ * through, for example to query its I/O statistics with
+ * service_client_get_stats(). It stays owned by the property list service
+ * client.
+ *
+ * @param client The property list service client.
+ * @param service_client Pointer that will be set to the service client.
+ *
+ * @return PROPERTY_LIST_SERVICE_E_SUCCESS on success or
+ *     PROPERTY_LIST_SERVICE_E_INVALID_ARG if an argument is NULL.
+ */
+property_list_service_error_t property_list_service_get_service_client(property_list_service_client_t client, service_client_t *service_client);
+
 #ifdef __cplusplus
 }
 #endif
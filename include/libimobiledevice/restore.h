@@ -39,12 +39,36 @@ typedef enum {
 	RESTORE_E_MUX_ERROR            = -3,
 	RESTORE_E_NOT_ENOUGH_DATA      = -4,
 	RESTORE_E_RECEIVE_TIMEOUT      = -5,
+	RESTORE_E_OP_IN_PROGRESS       = -6,
 	RESTORE_E_UNKNOWN_ERROR        = -256
 } restored_error_t;
 
 typedef struct restored_client_private restored_client_private;
 typedef restored_client_private *restored_client_t; /**< The client handle. */
 
+/** Kinds of messages restored sends during a restore */
+typedef enum {
+	RESTORED_MESSAGE_PROGRESS,     /**< ProgressMsg, see operation and progress */
+	RESTORED_MESSAGE_STATUS,       /**< StatusMsg, see status */
+	RESTORED_MESSAGE_DATA_REQUEST, /**< DataRequestMsg, see data_type */
+	RESTORED_MESSAGE_OTHER,        /**< any other message, see msg_type */
+	RESTORED_MESSAGE_DISCONNECTED  /**< the connection to restored was lost */
+} restored_message_type_t;
+
+/** A decoded message received from restored */
+typedef struct {
+	restored_message_type_t type;
+	const char *msg_type;  /**< MsgType of the message, NULL if it has none */
+	uint64_t operation;    /**< Operation of a progress message */
+	int progress;          /**< Progress of a progress message in percent, or -1 if not given */
+	uint64_t status;       /**< Status of a status message, 0 means success */
+	const char *data_type; /**< DataType of a data request, NULL if not given */
+	plist_t message;       /**< The message as received, NULL if disconnected */
+} restored_message_t;
+
+/** Reports a message received from restored by the shared message pump. */
+typedef void (*restored_message_cb_t)(restored_client_t client, const restored_message_t *message, void *user_data);
+
 /* Interface */
 
 /**
@@ -172,6 +196,48 @@ restored_error_t restored_reboot(restored_client_t client);
  */
 void restored_client_set_label(restored_client_t client, const char *label);
 
+/* Monitoring */
+
+/**
+ * Starts passing the messages restored sends to a callback. A single thread
+ * serves all monitored clients of the process; it waits for any of their
+ * connections to become readable, decodes each message once and passes it
+ * to the callback of the client. The thread runs only while at least one
+ * client is monitored.
+ *
+ * While a client is monitored, restored_receive() must not be used with
+ * it. Requests can still be sent with restored_send(), also from within
+ * the callback.
+ *
+ * @note The callback is invoked from the monitor thread and must not call
+ *    restored_start_monitoring() or restored_stop_monitoring(). Everything
+ *    that takes long, like sending the data a device requests, should be
+ *    handed over to another thread so other devices are not held up. After
+ *    reporting RESTORED_MESSAGE_DISCONNECTED the client is no longer
+ *    monitored.
+ *
+ * @param client The restored client
+ * @param callback Callback function receiving the messages.
+ * @param user_data Custom pointer passed to the callback function.
+ *
+ * @return RESTORE_E_SUCCESS on success, RESTORE_E_INVALID_ARG when client
+ *  or callback is NULL, RESTORE_E_OP_IN_PROGRESS if the client is monitored
+ *  already, or RESTORE_E_UNKNOWN_ERROR if the monitor could not be started.
+ */
+restored_error_t restored_start_monitoring(restored_client_t client, restored_message_cb_t callback, void *user_data);
+
+/**
+ * Stops passing the messages of a client to the callback set with
+ * restored_start_monitoring(). Once this function returns, the callback is
+ * neither running nor called again for this client.
+ *
+ * @param client The restored client
+ *
+ * @return RESTORE_E_SUCCESS on success or RESTORE_E_INVALID_ARG when client
+ *  is NULL
+ */
+restored_error_t restored_stop_monitoring(restored_client_t client);
+
 #ifdef __cplusplus
 }
 #endif
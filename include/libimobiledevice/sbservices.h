@@ -56,6 +56,15 @@ typedef enum {
 typedef struct sbservices_client_private sbservices_client_private;
 typedef sbservices_client_private *sbservices_client_t; /**< The client handle. */
 
+/** Reports the icon of an app requested with sbservices_get_icons_pngdata(). pngdata is NULL and pngsize 0 if the device didn't return an icon. The data is only valid until the callback returns. */
+/**
+ * Callback that modifies an icon state in place, see sbservices_update_icon_state().
+ * Returns 0 to apply the changes or non-zero to discard them.
+ */
+typedef int (*sbservices_icon_state_cb_t)(plist_t state, void *user_data);
+
+typedef void (*sbservices_icon_cb_t)(const char *bundle_id, const char *pngdata, uint64_t pngsize, void *user_data);
+
 /* Interface */
 
 /**
@@ -109,6 +118,10 @@ sbservices_error_t sbservices_client_free(sbservices_client_t client);
  *     supported since iOS 4.0 so for older firmware versions this must be set
  *     to NULL.
  *
+ * @note If the icon state cache is enabled with
+ *     sbservices_set_icon_state_cache(), a copy of the cached state is
+ *     returned while it is recent enough.
+ *
  * @return SBSERVICES_E_SUCCESS on success, SBSERVICES_E_INVALID_ARG when
  *     client or state is invalid, or an SBSERVICES_E_* error code otherwise.
  */
@@ -120,11 +133,50 @@ sbservices_error_t sbservices_get_icon_state(sbservices_client_t client, plist_t
  * @param client The connected sbservices client to use.
  * @param newstate A plist containing the new iconstate.
  *
+ * @note If the icon state cache is enabled and holds a recent state with
+ *     the same fingerprint, the state is not sent again.
+ *
  * @return SBSERVICES_E_SUCCESS on success, SBSERVICES_E_INVALID_ARG when
  *     client or newstate is NULL, or an SBSERVICES_E_* error code otherwise.
  */
 sbservices_error_t sbservices_set_icon_state(sbservices_client_t client, plist_t newstate);
 
+/**
+ * Enables caching of the icon state in the client.
+ *
+ * The state received by sbservices_get_icon_state() or sent with
+ * sbservices_set_icon_state() is kept, and returned by the former for up
+ * to max_age seconds instead of transferring the whole layout again. A hash
+ * of the state serves as a fingerprint to skip sending a state the device
+ * already has. Changes made on the device itself are not noticed until the
+ * cached state expires.
+ *
+ * @param client The connected sbservices client to use.
+ * @param max_age Maximum age of the cached state in seconds, or 0 to
+ *     disable the cache (the default).
+ *
+ * @return SBSERVICES_E_SUCCESS on success, or SBSERVICES_E_INVALID_ARG when
+ *     client is NULL.
+ */
+sbservices_error_t sbservices_set_icon_state_cache(sbservices_client_t client, unsigned int max_age);
+
+/**
+ * Gets the icon state, lets a callback modify it and sends it back only if
+ * the layout actually changed.
+ *
+ * @param client The connected sbservices client to use.
+ * @param format_version The formatVersion to request the state in, see
+ *     sbservices_get_icon_state().
+ * @param callback Function that modifies the state in place.
+ * @param user_data Custom pointer passed to the callback.
+ * @param changed Pointer that will be set to 1 if a new state was sent, or
+ *     0 otherwise. Can be NULL.
+ *
+ * @return SBSERVICES_E_SUCCESS on success, SBSERVICES_E_INVALID_ARG when
+ *     client or callback is NULL, or an SBSERVICES_E_* error code otherwise.
+ */
+sbservices_error_t sbservices_update_icon_state(sbservices_client_t client, const char *format_version, sbservices_icon_state_cb_t callback, void *user_data, int *changed);
+
 /**
  * Get the icon of the specified app as PNG data.
  *
@@ -142,6 +194,47 @@ sbservices_error_t sbservices_set_icon_state(sbservices_client_t client, plist_t
  */
 sbservices_error_t sbservices_get_icon_pngdata(sbservices_client_t client, const char *bundleId, char **pngdata, uint64_t *pngsize);
 
+/**
+ * Get the icons of a number of apps as PNG data.
+ *
+ * The requests for all icons are pipelined, and every icon is passed to the
+ * callback as soon as it has been received. Icons found in the icon cache
+ * of the client (see sbservices_set_icon_cache_dir()) are reported without
+ * contacting the device, icons fetched from the device are added to it.
+ *
+ * @note The callback is invoked with the client locked and must not use
+ *     the same client.
+ *
+ * @param client The connected sbservices client to use.
+ * @param bundle_ids Array of bundle identifiers of the apps to retrieve the
+ *     icons for.
+ * @param versions Array with the bundle version of each app, used as part
+ *     of the icon cache key. Can be NULL, or contain NULL entries, to
+ *     bypass the cache for all or individual apps.
+ * @param count Number of entries in bundle_ids (and versions).
+ * @param callback Function that will be called with every icon.
+ * @param user_data Custom pointer passed to the callback.
+ *
+ * @return SBSERVICES_E_SUCCESS on success, SBSERVICES_E_INVALID_ARG when
+ *     client, bundle_ids, or callback are invalid, or an SBSERVICES_E_* error
+ *     code otherwise. After an error, some of the icons may not have been
+ *     reported.
+ */
+sbservices_error_t sbservices_get_icons_pngdata(sbservices_client_t client, const char **bundle_ids, const char **versions, unsigned int count, sbservices_icon_cb_t callback, void *user_data);
+
+/**
+ * Sets a directory in which icons retrieved with sbservices_get_icons_pngdata()
+ * are cached, keyed by bundle identifier and bundle version. The directory
+ * must exist and can be shared between clients and devices.
+ *
+ * @param client The sbservices client to use.
+ * @param path Path of the cache directory, or NULL to disable the cache.
+ *
+ * @return SBSERVICES_E_SUCCESS on success, SBSERVICES_E_INVALID_ARG when
+ *     client is NULL.
+ */
+sbservices_error_t sbservices_set_icon_cache_dir(sbservices_client_t client, const char *path);
+
 /**
  * Gets the interface orientation of the device.
  *
@@ -49,6 +49,27 @@ typedef enum {
 typedef struct screenshotr_client_private screenshotr_client_private;
 typedef screenshotr_client_private *screenshotr_client_t; /**< The client handle. */
 
+/** Timing information about a streamed frame. All times are in milliseconds. */
+typedef struct {
+	uint64_t index;     /**< Number of the frame in the stream, starting at 0 */
+	uint64_t timestamp; /**< Time the frame was received, since the epoch */
+	uint32_t latency;   /**< Time from requesting the frame until it arrived */
+	uint32_t interval;  /**< Time since the previous frame arrived, 0 for the first frame */
+} screenshotr_frame_info_t;
+
+/**
+ * Callback invoked for every frame of a screenshot stream.
+ * The image data is only valid until the callback returns.
+ *
+ * @param imgdata The image data, usually in TIFF or PNG format.
+ * @param imgsize Size of the image data.
+ * @param info Timing information about the frame.
+ * @param user_data The user data passed to screenshotr_start_stream.
+ *
+ * @return 0 to continue streaming, any other value to stop the stream.
+ */
+typedef int (*screenshotr_frame_cb_t)(const char *imgdata, uint64_t imgsize, const screenshotr_frame_info_t *info, void *user_data);
+
 
 /**
  * Connects to the screenshotr service on the specified device.
@@ -110,6 +131,49 @@ screenshotr_error_t screenshotr_client_free(screenshotr_client_t client);
  */
 screenshotr_error_t screenshotr_take_screenshot(screenshotr_client_t client, char **imgdata, uint64_t *imgsize);
 
+/**
+ * Starts streaming screenshots in a background thread. The next screenshot
+ * is requested while the current one is handed to the callback, so the
+ * device captures frames while the client processes them.
+ *
+ * @note The callback is invoked from the stream thread and must not call
+ *    screenshotr_stop_stream; it can return non-zero to end the stream.
+ *    No other screenshotr function can be used while the stream is running.
+ *
+ * @param client The connection screenshotr service client.
+ * @param fps Maximum number of frames per second to request.
+ * @param callback Callback invoked for every frame.
+ * @param user_data Pointer passed to the callback.
+ *
+ * @return SCREENSHOTR_E_SUCCESS on success, SCREENSHOTR_E_INVALID_ARG if
+ *    one or more parameters are invalid or a stream is already running,
+ *    or another error code otherwise.
+ */
+screenshotr_error_t screenshotr_start_stream(screenshotr_client_t client, unsigned int fps, screenshotr_frame_cb_t callback, void *user_data);
+
+/**
+ * Changes the maximum number of frames per second of a running stream,
+ * taking effect with the next frame. Can be called from the stream callback,
+ * e.g. to slow down while the screen content doesn't change.
+ *
+ * @param client The connection screenshotr service client.
+ * @param fps Maximum number of frames per second to request.
+ *
+ * @return SCREENSHOTR_E_SUCCESS on success, or SCREENSHOTR_E_INVALID_ARG if
+ *    one or more parameters are invalid.
+ */
+screenshotr_error_t screenshotr_stream_set_fps(screenshotr_client_t client, unsigned int fps);
+
+/**
+ * Stops a screenshot stream and waits for the stream thread to finish.
+ *
+ * @param client The connection screenshotr service client.
+ *
+ * @return SCREENSHOTR_E_SUCCESS if no stream was running or it ended
+ *    without error, or the error that ended the stream.
+ */
+screenshotr_error_t screenshotr_stop_stream(screenshotr_client_t client);
+
 #ifdef __cplusplus
 }
 #endif
@@ -39,12 +39,48 @@ typedef enum {
 	SERVICE_E_START_SERVICE_ERROR = -5,
 	SERVICE_E_NOT_ENOUGH_DATA     = -6,
 	SERVICE_E_TIMEOUT             = -7,
+	SERVICE_E_DEVICE_DETACHED     = -8,
+	SERVICE_E_CANCELLED           = -9,
 	SERVICE_E_UNKNOWN_ERROR       = -256
 } service_error_t;
 
 typedef struct service_client_private service_client_private;
 typedef service_client_private* service_client_t; /**< The client handle. */
 
+/** Number of buckets of a latency histogram */
+#define SERVICE_STATS_HISTOGRAM_BUCKETS 16
+/** Upper bound in microseconds of the first histogram bucket, each further
+ * bucket doubles it. The last bucket counts everything above. */
+#define SERVICE_STATS_HISTOGRAM_BASE 64
+
+/** Latency histogram */
+typedef struct {
+	uint64_t count;  /**< Number of operations */
+	uint64_t sum;    /**< Total time of all operations in microseconds */
+	uint64_t buckets[SERVICE_STATS_HISTOGRAM_BUCKETS]; /**< Operations that took up to SERVICE_STATS_HISTOGRAM_BASE << index microseconds, not cumulative */
+} service_latency_histogram_t;
+
+/** I/O statistics of a service client, see service_client_enable_stats() */
+typedef struct {
+	uint64_t bytes_sent;      /**< Bytes sent */
+	uint64_t bytes_received;  /**< Bytes received */
+	uint64_t sends;           /**< Number of send operations */
+	uint64_t receives;        /**< Number of receive operations that returned data */
+	uint64_t errors;          /**< Number of failed send or receive operations */
+	uint64_t timeouts;        /**< Number of receive operations that timed out */
+	uint64_t timeout_time;    /**< Time spent in receive operations that timed out, in microseconds */
+	service_latency_histogram_t send_latency;     /**< Duration of send operations */
+	service_latency_histogram_t receive_latency;  /**< Duration of receive operations that returned data */
+	service_latency_histogram_t request_latency;  /**< Time from the first send after a receive until the next data is received */
+} service_stats_t;
+
+/** Adaptive receive timeout policy, see service_client_set_timeout_policy() */
+typedef struct {
+	unsigned int floor;           /**< Lowest timeout in milliseconds */
+	unsigned int ceiling;         /**< Highest timeout in milliseconds, also used as long as no round trip has been measured */
+	unsigned int variance_factor; /**< Multiple of the round trip time variation added to the smoothed round trip time, 4 if 0 */
+} service_timeout_policy_t;
+
 #define SERVICE_CONSTRUCTOR(x) (int32_t (*)(idevice_t, lockdownd_service_descriptor_t, void**))(x)
 
 /* Interface */
@@ -107,6 +143,21 @@ service_error_t service_client_free(service_client_t client);
  */
 service_error_t service_send(service_client_t client, const char *data, uint32_t size, uint32_t *sent);
 
+/**
+ * Sends data from multiple buffers using the given service client.
+ *
+ * @param client The service client to use for sending.
+ * @param iov Array of buffers to send in order
+ * @param iovcnt Number of entries in iov
+ * @param sent Number of bytes sent (can be NULL to ignore)
+ *
+ * @return SERVICE_E_SUCCESS on success,
+ *      SERVICE_E_INVALID_ARG when one or more parameters are
+ *      invalid, or SERVICE_E_UNKNOWN_ERROR when an unspecified
+ *      error occurs.
+ */
+service_error_t service_sendv(service_client_t client, const idevice_iovec_t *iov, int iovcnt, uint32_t *sent);
+
 /**
  * Receives data using the given service client with specified timeout.
  *
@@ -179,6 +230,75 @@ service_error_t service_disable_ssl(service_client_t client);
  */
 service_error_t service_disable_bypass_ssl(service_client_t client, uint8_t sslBypass);
 
+/**
+ * Enables or disables collecting I/O statistics for the given service
+ * client. Collecting is disabled by default. Enabling it again resets the
+ * statistics. Traffic of clients built on top of the service client, like
+ * property list services or AFC, is included.
+ *
+ * @note This must not be called while another thread uses the client.
+ *
+ * @param client The service client.
+ * @param enable 1 to enable collecting statistics, 0 to disable it.
+ *
+ * @return SERVICE_E_SUCCESS on success, SERVICE_E_INVALID_ARG if client is
+ *     NULL, or SERVICE_E_UNKNOWN_ERROR if memory could not be allocated.
+ */
+service_error_t service_client_enable_stats(service_client_t client, int enable);
+
+/**
+ * Gets a snapshot of the I/O statistics of a service client. This may be
+ * called from any thread while the client is in use.
+ *
+ * @param client The service client.
+ * @param stats Pointer to a service_stats_t that will be filled in.
+ *
+ * @return SERVICE_E_SUCCESS on success, SERVICE_E_INVALID_ARG if client or
+ *     stats is NULL or collecting statistics is not enabled for the client.
+ */
+service_error_t service_client_get_stats(service_client_t client, service_stats_t *stats);
+
+/**
+ * Sets a policy that derives the timeout of receive operations that don't
+ * take an explicit timeout, like service_receive(), from the measured
+ * round trip times instead of using a fixed default. The time from the
+ * first send after a receive until the next data arrives is tracked as a
+ * smoothed mean and variation per device and operation class, and the
+ * timeout is the mean plus variance_factor times the variation, clamped
+ * to the floor and ceiling of the policy. Each timeout doubles the next
+ * one until a reply is measured again.
+ *
+ * Clients of the same device that use the same operation class share the
+ * measurements, so a new client starts with the estimate of earlier ones.
+ * Receive operations with an explicit timeout are measured but keep
+ * their timeout.
+ *
+ * @note This must not be called while another thread uses the client.
+ *
+ * @param client The service client.
+ * @param op_class Name of the kind of operations, for example the
+ *     service name, or NULL to use "default".
+ * @param policy The policy to use, or NULL to go back to the fixed
+ *     default timeouts.
+ *
+ * @return SERVICE_E_SUCCESS on success, SERVICE_E_INVALID_ARG if client is
+ *     NULL or the floor of the policy is above its ceiling, or
+ *     SERVICE_E_UNKNOWN_ERROR if memory could not be allocated.
+ */
+service_error_t service_client_set_timeout_policy(service_client_t client, const char *op_class, const service_timeout_policy_t *policy);
+
+/**
+ * Gets the timeout that the next receive operation without an explicit
+ * timeout will use.
+ *
+ * @param client The service client.
+ * @param timeout Pointer that will be set to the timeout in milliseconds.
+ *
+ * @return SERVICE_E_SUCCESS on success or SERVICE_E_INVALID_ARG if client
+ *     or timeout is NULL.
+ */
+service_error_t service_client_get_timeout(service_client_t client, unsigned int *timeout);
+
 #ifdef __cplusplus
 }
 #endif
@@ -50,6 +50,24 @@ typedef syslog_relay_client_private *syslog_relay_client_t; /**< The client hand
 /** Receives each character received from the device. */
 typedef void (*syslog_relay_receive_cb_t)(char c, void *user_data);
 
+/** Receives a block of data or a complete log line received from the device.
+ *  The data is only valid for the duration of the callback. */
+typedef void (*syslog_relay_receive_data_cb_t)(const char *data, uint32_t length, void *user_data);
+
+/** Capture statistics of a syslog_relay client. */
+typedef struct {
+	uint64_t bytes_received; /**< Bytes received from the device since the capture was started. */
+	uint64_t bytes_dropped;  /**< Bytes discarded because the ring buffer was full. */
+	uint32_t buffer_size;    /**< Size of the ring buffer in use, 0 if capturing without one. */
+	uint32_t buffer_used;    /**< Bytes currently waiting in the ring buffer. */
+} syslog_relay_stats_t;
+
+typedef struct syslog_relay_aggregator_private syslog_relay_aggregator_private;
+typedef syslog_relay_aggregator_private *syslog_relay_aggregator_t; /**< The aggregator handle. */
+
+/** Receives log lines of all devices of an aggregator. data is NULL when the connection to the device ended. */
+typedef void (*syslog_relay_aggregator_cb_t)(const char *udid, const char *data, uint32_t length, void *user_data);
+
 /* Interface */
 
 /**
@@ -130,6 +148,46 @@ syslog_relay_error_t syslog_relay_start_capture(syslog_relay_client_t client, sy
  */
 syslog_relay_error_t syslog_relay_start_capture_raw(syslog_relay_client_t client, syslog_relay_receive_cb_t callback, void* user_data);
 
+/**
+ * Starts capturing the syslog of the device, passing complete log lines to
+ * the callback. The data is read from the device in large blocks and each
+ * line is passed without further copying, excluding its NUL terminator. The line is
+ * however NUL terminated so it can be used as a C string, and usually ends
+ * with a newline character.
+ *
+ * Use syslog_relay_stop_capture() to stop receiving the syslog.
+ *
+ * @param client The syslog_relay client to use
+ * @param callback Callback to receive each line from the syslog.
+ * @param user_data Custom pointer passed to the callback function.
+ *
+ * @return SYSLOG_RELAY_E_SUCCESS on success,
+ *      SYSLOG_RELAY_E_INVALID_ARG when one or more parameters are
+ *      invalid or SYSLOG_RELAY_E_UNKNOWN_ERROR when an unspecified
+ *      error occurs or a syslog capture has already been started.
+ */
+syslog_relay_error_t syslog_relay_start_capture_lines(syslog_relay_client_t client, syslog_relay_receive_data_cb_t callback, void* user_data);
+
+/**
+ * Starts capturing the *raw* syslog of the device, passing each block of
+ * data as it has been received to the callback.
+ * This function is like syslog_relay_start_capture_raw with the difference
+ * that the callback is invoked once per received block instead of once per
+ * character.
+ *
+ * Use syslog_relay_stop_capture() to stop receiving the syslog.
+ *
+ * @param client The syslog_relay client to use
+ * @param callback Callback to receive each block of data from the syslog.
+ * @param user_data Custom pointer passed to the callback function.
+ *
+ * @return SYSLOG_RELAY_E_SUCCESS on success,
+ *      SYSLOG_RELAY_E_INVALID_ARG when one or more parameters are
+ *      invalid or SYSLOG_RELAY_E_UNKNOWN_ERROR when an unspecified
+ *      error occurs or a syslog capture has already been started.
+ */
+syslog_relay_error_t syslog_relay_start_capture_raw_data(syslog_relay_client_t client, syslog_relay_receive_data_cb_t callback, void* user_data);
+
 /**
  * Stops capturing the syslog of the device.
  *
@@ -144,6 +202,38 @@ syslog_relay_error_t syslog_relay_start_capture_raw(syslog_relay_client_t client
  */
 syslog_relay_error_t syslog_relay_stop_capture(syslog_relay_client_t client);
 
+/**
+ * Sets the size of the ring buffer used by the next capture.
+ *
+ * While capturing, the data received from the device is stored in a ring
+ * buffer and passed to the callback by a separate delivery thread, so that
+ * a slow callback does not stop the data from being read from the device.
+ * If the ring buffer is full, newly received data is discarded and counted
+ * in the capture statistics. For line based capture modes the line that got
+ * cut off is terminated and data is skipped up to the next line.
+ * The default size is 1 MiB.
+ *
+ * @param client The syslog_relay client to use
+ * @param size The size of the ring buffer in bytes, rounded up to a power
+ *    of two. Pass 0 to receive and deliver the data in the same thread.
+ *
+ * @return SYSLOG_RELAY_E_SUCCESS on success,
+ *      SYSLOG_RELAY_E_INVALID_ARG when client is NULL or
+ *      SYSLOG_RELAY_E_UNKNOWN_ERROR when a capture is running.
+ */
+syslog_relay_error_t syslog_relay_set_buffer_size(syslog_relay_client_t client, uint32_t size);
+
+/**
+ * Retrieves the statistics of the current or last syslog capture.
+ *
+ * @param client The syslog_relay client to use
+ * @param stats Pointer to a syslog_relay_stats_t that will be filled in.
+ *
+ * @return SYSLOG_RELAY_E_SUCCESS on success or
+ *      SYSLOG_RELAY_E_INVALID_ARG when one or more parameters are invalid.
+ */
+syslog_relay_error_t syslog_relay_get_stats(syslog_relay_client_t client, syslog_relay_stats_t *stats);
+
 /* Receiving */
 
 /**
@@ -177,6 +267,65 @@ syslog_relay_error_t syslog_relay_receive_with_timeout(syslog_relay_client_t cli
  */
 syslog_relay_error_t syslog_relay_receive(syslog_relay_client_t client, char *data, uint32_t size, uint32_t *received);
 
+/* Aggregator */
+
+/**
+ * Creates an aggregator that captures the syslog of any number of devices
+ * from a single thread. All log lines are passed to one callback, together
+ * with the UDID of the device they came from.
+ *
+ * @note The callback is invoked from the aggregator thread without any
+ *    lock held. It may add or remove devices, but must not free the
+ *    aggregator.
+ *
+ * @param callback Callback that receives the log lines without the
+ *    terminating NUL byte, or NULL data when a device disconnected.
+ * @param user_data Custom pointer passed to the callback function.
+ * @param aggregator Pointer that will be set to the new aggregator.
+ *
+ * @return SYSLOG_RELAY_E_SUCCESS on success, SYSLOG_RELAY_E_INVALID_ARG
+ *      when one or more parameters are invalid, or
+ *      SYSLOG_RELAY_E_UNKNOWN_ERROR if the thread could not be started.
+ */
+syslog_relay_error_t syslog_relay_aggregator_new(syslog_relay_aggregator_cb_t callback, void *user_data, syslog_relay_aggregator_t *aggregator);
+
+/**
+ * Stops an aggregator, disconnects from all devices and frees it.
+ *
+ * @param aggregator The aggregator to free.
+ *
+ * @return SYSLOG_RELAY_E_SUCCESS on success, or SYSLOG_RELAY_E_INVALID_ARG
+ *      when aggregator is NULL.
+ */
+syslog_relay_error_t syslog_relay_aggregator_free(syslog_relay_aggregator_t aggregator);
+
+/**
+ * Connects to the syslog_relay service of a device and adds it to the
+ * aggregator. This is usually called for IDEVICE_DEVICE_ADD events
+ * received through idevice_event_subscribe().
+ *
+ * @param aggregator The aggregator to add the device to.
+ * @param udid The UDID of the device.
+ * @param options Lookup options passed to idevice_new_with_options().
+ *
+ * @return SYSLOG_RELAY_E_SUCCESS on success or if the device was added
+ *      already, SYSLOG_RELAY_E_INVALID_ARG when one or more parameters are
+ *      invalid, or an error code if connecting to the device failed.
+ */
+syslog_relay_error_t syslog_relay_aggregator_add_device(syslog_relay_aggregator_t aggregator, const char *udid, enum idevice_options options);
+
+/**
+ * Disconnects a device and removes it from the aggregator.
+ *
+ * @param aggregator The aggregator to remove the device from.
+ * @param udid The UDID of the device.
+ *
+ * @return SYSLOG_RELAY_E_SUCCESS on success, SYSLOG_RELAY_E_INVALID_ARG
+ *      when one or more parameters are invalid or the device is not part
+ *      of the aggregator.
+ */
+syslog_relay_error_t syslog_relay_aggregator_remove_device(syslog_relay_aggregator_t aggregator, const char *udid);
+
 #ifdef __cplusplus
 }
 #endif
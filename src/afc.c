@@ -28,10 +28,19 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#define HAVE_MMAP 1
+#endif
 
 #include "afc.h"
 #include "idevice.h"
 #include "common/debug.h"
+#include "common/trace.h"
+#include "common/probes.h"
 #include "endianness.h"
 
 /**
@@ -56,6 +65,76 @@ static void afc_unlock(afc_client_t client)
 	mutex_unlock(&client->mutex);
 }
 
+/*
+ * Packet buffers of freed clients are kept for reuse by new clients, so
+ * that workloads opening many short-lived clients, e.g. through
+ * house_arrest, don't allocate a packet buffer each time. New buffers are
+ * sized to the largest buffer any client needed so far, up to
+ * AFC_PACKET_POOL_MAX_EXTRA.
+ */
+static struct {
+	mutex_t mutex;
+	AFCPacket *packets[AFC_PACKET_POOL_SIZE];
+	uint32_t extra[AFC_PACKET_POOL_SIZE];
+	unsigned int count;
+	uint32_t high_water;
+} afc_packet_pool;
+
+static thread_once_t afc_packet_pool_once = THREAD_ONCE_INIT;
+
+static void afc_packet_pool_init(void)
+{
+	mutex_init(&afc_packet_pool.mutex);
+	afc_packet_pool.high_water = AFC_PACKET_EXTRA_MIN;
+}
+
+static void afc_packet_pool_update_high_water(uint32_t extra)
+{
+	if (extra > AFC_PACKET_POOL_MAX_EXTRA)
+		extra = AFC_PACKET_POOL_MAX_EXTRA;
+	mutex_lock(&afc_packet_pool.mutex);
+	if (extra > afc_packet_pool.high_water)
+		afc_packet_pool.high_water = extra;
+	mutex_unlock(&afc_packet_pool.mutex);
+}
+
+static AFCPacket *afc_packet_pool_get(uint32_t *extra)
+{
+	AFCPacket *packet = NULL;
+
+	thread_once(&afc_packet_pool_once, afc_packet_pool_init);
+
+	mutex_lock(&afc_packet_pool.mutex);
+	if (afc_packet_pool.count > 0) {
+		afc_packet_pool.count--;
+		packet = afc_packet_pool.packets[afc_packet_pool.count];
+		*extra = afc_packet_pool.extra[afc_packet_pool.count];
+	} else {
+		*extra = afc_packet_pool.high_water;
+	}
+	mutex_unlock(&afc_packet_pool.mutex);
+
+	if (!packet) {
+		packet = (AFCPacket*)malloc(sizeof(AFCPacket) + *extra);
+	}
+
+	return packet;
+}
+
+static void afc_packet_pool_put(AFCPacket *packet, uint32_t extra)
+{
+	mutex_lock(&afc_packet_pool.mutex);
+	if (afc_packet_pool.count < AFC_PACKET_POOL_SIZE && extra <= AFC_PACKET_POOL_MAX_EXTRA) {
+		afc_packet_pool.packets[afc_packet_pool.count] = packet;
+		afc_packet_pool.extra[afc_packet_pool.count] = extra;
+		afc_packet_pool.count++;
+		packet = NULL;
+	}
+	mutex_unlock(&afc_packet_pool.mutex);
+
+	free(packet);
+}
+
 /**
  * Makes a connection to the AFC service on the device using the given
  * connection.
@@ -78,8 +157,7 @@ LIBIMOBILEDEVICE_API afc_error_t afc_client_new_with_service_client(service_clie
 	client_loc->free_parent = 0;
 
 	/* allocate a packet */
-	client_loc->packet_extra = 1024;
-	client_loc->afc_packet = (AFCPacket *) malloc(sizeof(AFCPacket) + client_loc->packet_extra);
+	client_loc->afc_packet = afc_packet_pool_get(&client_loc->packet_extra);
 	if (!client_loc->afc_packet) {
 		free(client_loc);
 		return AFC_E_NO_MEM;
@@ -89,6 +167,22 @@ LIBIMOBILEDEVICE_API afc_error_t afc_client_new_with_service_client(service_clie
 	client_loc->afc_packet->this_length = 0;
 	memcpy(client_loc->afc_packet->magic, AFC_MAGIC, AFC_MAGIC_LEN);
 	mutex_init(&client_loc->mutex);
+	client_loc->write_window = 0;
+	client_loc->write_pending = 0;
+	client_loc->async = NULL;
+	client_loc->write_error = AFC_E_SUCCESS;
+	client_loc->write_error_handle = 0;
+	client_loc->chunk_size = 0;
+	client_loc->chunk_min = 0;
+	client_loc->chunk_settled = 0;
+	client_loc->chunk_best_rate = 0;
+	client_loc->chunk_sample_start = 0;
+	client_loc->chunk_sample_bytes = 0;
+	client_loc->chunk_sample_ops = 0;
+	client_loc->cache = NULL;
+
+	/* serve packet headers and status responses from memory */
+	idevice_connection_set_receive_buffer_size(service_client->connection, AFC_RECEIVE_BUFFER_SIZE);
 
 	*client = client_loc;
 	return AFC_E_SUCCESS;
@@ -120,16 +214,23 @@ LIBIMOBILEDEVICE_API afc_error_t afc_client_start_service(idevice_t device, afc_
 	return err;
 }
 
+static void afc_write_window_drain(afc_client_t client, unsigned int keep);
+static void afc_cache_free(struct afc_cache *cache);
+
 LIBIMOBILEDEVICE_API afc_error_t afc_client_free(afc_client_t client)
 {
 	if (!client || !client->afc_packet)
 		return AFC_E_INVALID_ARG;
 
+	if (client->write_pending > 0 && client->parent) {
+		afc_write_window_drain(client, 0);
+	}
 	if (client->free_parent && client->parent) {
 		service_client_free(client->parent);
 		client->parent = NULL;
 	}
-	free(client->afc_packet);
+	afc_packet_pool_put(client->afc_packet, client->packet_extra);
+	afc_cache_free(client->cache);
 	mutex_destroy(&client->mutex);
 	free(client);
 	return AFC_E_SUCCESS;
@@ -148,7 +249,7 @@ LIBIMOBILEDEVICE_API afc_error_t afc_client_free(afc_client_t client)
  *
  * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
  */
-static afc_error_t afc_dispatch_packet(afc_client_t client, uint64_t operation, uint32_t data_length, const char* payload, uint32_t payload_length, uint32_t *bytes_sent)
+static afc_error_t afc_dispatch_packet_nowait(afc_client_t client, uint64_t operation, uint32_t data_length, const char* payload, uint32_t payload_length, uint32_t *bytes_sent)
 {
 	uint32_t sent = 0;
 
@@ -166,19 +267,12 @@ static afc_error_t afc_dispatch_packet(afc_client_t client, uint64_t operation,
 	client->afc_packet->this_length = sizeof(AFCPacket) + data_length;
 
 	debug_info("packet length = %i", client->afc_packet->this_length);
+	trace_event(IDEVICE_TRACE_OP_START, operation, client->afc_packet->packet_num, client->afc_packet->entire_length);
+	PROBE4(afc__request, IDEVICE_CONNECTION_UDID(client->parent->connection), operation, client->afc_packet->packet_num, client->afc_packet->entire_length);
 
-	/* send AFC packet header and data */
+	/* send AFC packet header, data and payload at once */
 	AFCPacket_to_LE(client->afc_packet);
 	debug_buffer((char*)client->afc_packet, sizeof(AFCPacket) + data_length);
-	sent = 0;
-	service_send(client->parent, (void*)client->afc_packet, sizeof(AFCPacket) + data_length, &sent);
-	AFCPacket_from_LE(client->afc_packet);
-	*bytes_sent += sent;
-	if (sent < sizeof(AFCPacket) + data_length) {
-		return AFC_E_SUCCESS;
-	}
-
-	sent = 0;
 	if (payload_length > 0) {
 		if (payload_length > 256) {
 			debug_info("packet payload follows (256/%u)", payload_length);
@@ -187,26 +281,137 @@ static afc_error_t afc_dispatch_packet(afc_client_t client, uint64_t operation,
 			debug_info("packet payload follows");
 			debug_buffer(payload, payload_length);
 		}
-		service_send(client->parent, payload, payload_length, &sent);
 	}
-	*bytes_sent += sent;
-	if (sent < payload_length) {
-		return AFC_E_SUCCESS;
+	idevice_iovec_t iov[2];
+	iov[0].data = (char*)client->afc_packet;
+	iov[0].len = sizeof(AFCPacket) + data_length;
+	iov[1].data = (char*)payload;
+	iov[1].len = payload_length;
+	sent = 0;
+	service_sendv(client->parent, iov, (payload_length > 0) ? 2 : 1, &sent);
+	AFCPacket_from_LE(client->afc_packet);
+	*bytes_sent = sent;
+
+	return AFC_E_SUCCESS;
+}
+
+static afc_error_t afc_receive_response(afc_client_t client, uint64_t packet_num, char **bytes, uint32_t *bytes_recv);
+
+/**
+ * Collects status replies of windowed writes until at most keep of them are
+ * still outstanding. The first failure is kept and reported by the next
+ * write to or close of the affected file. The client has to be locked.
+ */
+static void afc_write_window_drain(afc_client_t client, unsigned int keep)
+{
+	while (client->write_pending > keep) {
+		uint32_t bytes = 0;
+		uint64_t packet_num = client->afc_packet->packet_num - client->write_pending + 1;
+		afc_error_t err = afc_receive_response(client, packet_num, NULL, &bytes);
+		client->write_pending--;
+		if (err == AFC_E_SUCCESS)
+			continue;
+		debug_info("windowed write %llu failed, error %d", (unsigned long long)packet_num, err);
+		if (client->write_error == AFC_E_SUCCESS) {
+			client->write_error = err;
+			client->write_error_handle = client->write_handles[packet_num % AFC_WRITE_MAX_WINDOW];
+		}
+		if (err == AFC_E_OP_HEADER_INVALID || err == AFC_E_MUX_ERROR || err == AFC_E_NOT_ENOUGH_DATA) {
+			/* the stream is out of sync, the remaining replies are lost */
+			client->write_pending = 0;
+		}
+	}
+}
+
+/**
+ * Returns and clears a failure of an earlier windowed write to the given
+ * file. The client has to be locked.
+ */
+static afc_error_t afc_write_window_error(afc_client_t client, uint64_t handle)
+{
+	afc_error_t err = AFC_E_SUCCESS;
+	if (client->write_error != AFC_E_SUCCESS && client->write_error_handle == handle) {
+		err = client->write_error;
+		client->write_error = AFC_E_SUCCESS;
+		client->write_error_handle = 0;
+	}
+	return err;
+}
+
+/**
+ * Dispatches an AFC packet over a client after collecting the replies of
+ * any windowed writes still in flight, so the response to this packet is
+ * the next one on the stream. See afc_dispatch_packet_nowait().
+ */
+static afc_error_t afc_dispatch_packet(afc_client_t client, uint64_t operation, uint32_t data_length, const char* payload, uint32_t payload_length, uint32_t *bytes_sent)
+{
+	if (client && client->afc_packet && client->write_pending > 0) {
+		afc_write_window_drain(client, 0);
+	}
+	return afc_dispatch_packet_nowait(client, operation, data_length, payload, payload_length, bytes_sent);
+}
+
+/**
+ * Receives and validates the AFC header of the response for a specific
+ * packet number.
+ *
+ * @param client The client to receive data on.
+ * @param packet_num The packet number of the request the response belongs to.
+ * @param header Pointer to an AFCPacket that will be filled with the header
+ *     in host byte order.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+static afc_error_t afc_receive_header(afc_client_t client, uint64_t packet_num, AFCPacket *header)
+{
+	uint32_t bytes = 0;
+
+	/* first, read the AFC header */
+	service_receive(client->parent, (char*)header, sizeof(AFCPacket), &bytes);
+	AFCPacket_from_LE(header);
+	if (bytes == 0) {
+		debug_info("Just didn't get enough.");
+		return AFC_E_MUX_ERROR;
+	} else if (bytes < sizeof(AFCPacket)) {
+		debug_info("Did not even get the AFCPacket header");
+		return AFC_E_MUX_ERROR;
+	}
+
+	trace_event(IDEVICE_TRACE_OP_END, header->operation, header->packet_num, header->entire_length);
+	PROBE4(afc__response, IDEVICE_CONNECTION_UDID(client->parent->connection), header->operation, header->packet_num, header->entire_length);
+
+	/* check if it's a valid AFC header */
+	if (strncmp(header->magic, AFC_MAGIC, AFC_MAGIC_LEN)) {
+		debug_info("Invalid AFC packet received (magic != " AFC_MAGIC ")!");
+	}
+
+	/* check if it has the correct packet number */
+	if (header->packet_num != packet_num) {
+		/* otherwise print a warning but do not abort */
+		debug_info("ERROR: Unexpected packet number (%lld != %lld) aborting.", header->packet_num, packet_num);
+		return AFC_E_OP_HEADER_INVALID;
+	}
+
+	if (header->this_length < sizeof(AFCPacket) || header->entire_length < header->this_length) {
+		debug_info("Invalid AFCPacket header received!");
+		return AFC_E_OP_HEADER_INVALID;
 	}
 
 	return AFC_E_SUCCESS;
 }
 
 /**
- * Receives data through an AFC client and sets a variable to the received data.
+ * Receives the response for a specific packet number through an AFC client
+ * and sets a variable to the received data.
  *
  * @param client The client to receive data on.
+ * @param packet_num The packet number of the request the response belongs to.
  * @param bytes The char* to point to the newly-received data.
  * @param bytes_recv How much data was received.
  *
  * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
  */
-static afc_error_t afc_receive_data(afc_client_t client, char **bytes, uint32_t *bytes_recv)
+static afc_error_t afc_receive_response(afc_client_t client, uint64_t packet_num, char **bytes, uint32_t *bytes_recv)
 {
 	AFCPacket header;
 	uint32_t entire_len = 0;
@@ -214,6 +419,7 @@ static afc_error_t afc_receive_data(afc_client_t client, char **bytes, uint32_t
 	uint32_t current_count = 0;
 	uint64_t param1 = -1;
 	char* dump_here = NULL;
+	afc_error_t ret;
 
 	if (bytes_recv) {
 		*bytes_recv = 0;
@@ -222,34 +428,13 @@ static afc_error_t afc_receive_data(afc_client_t client, char **bytes, uint32_t
 		*bytes = NULL;
 	}
 
-	/* first, read the AFC header */
-	service_receive(client->parent, (char*)&header, sizeof(AFCPacket), bytes_recv);
-	AFCPacket_from_LE(&header);
-	if (*bytes_recv == 0) {
-		debug_info("Just didn't get enough.");
-		return AFC_E_MUX_ERROR;
-	} else if (*bytes_recv < sizeof(AFCPacket)) {
-		debug_info("Did not even get the AFCPacket header");
-		return AFC_E_MUX_ERROR;
-	}
-
-	/* check if it's a valid AFC header */
-	if (strncmp(header.magic, AFC_MAGIC, AFC_MAGIC_LEN)) {
-		debug_info("Invalid AFC packet received (magic != " AFC_MAGIC ")!");
-	}
-
-	/* check if it has the correct packet number */
-	if (header.packet_num != client->afc_packet->packet_num) {
-		/* otherwise print a warning but do not abort */
-		debug_info("ERROR: Unexpected packet number (%lld != %lld) aborting.", header.packet_num, client->afc_packet->packet_num);
-		return AFC_E_OP_HEADER_INVALID;
+	ret = afc_receive_header(client, packet_num, &header);
+	if (ret != AFC_E_SUCCESS) {
+		return ret;
 	}
 
 	/* then, read the attached packet */
-	if (header.this_length < sizeof(AFCPacket)) {
-		debug_info("Invalid AFCPacket header received!");
-		return AFC_E_OP_HEADER_INVALID;
-	} else if ((header.this_length == header.entire_length)
+	if ((header.this_length == header.entire_length)
 			&& header.entire_length == sizeof(AFCPacket)) {
 		debug_info("Empty AFCPacket received!");
 		*bytes_recv = 0;
@@ -309,36 +494,41 @@ static afc_error_t afc_receive_data(afc_client_t client, char **bytes, uint32_t
 	}
 
 	/* check operation types */
-	if (header.operation == AFC_OP_STATUS) {
-		/* status response */
-		debug_info("got a status response, code=%lld", param1);
-
-		if (param1 != AFC_E_SUCCESS) {
-			/* error status */
-			/* free buffer */
+	switch (header.operation) {
+		case AFC_OP_STATUS:
+			/* status response */
+			debug_info("got a status response, code=%lld", param1);
+
+			if (param1 != AFC_E_SUCCESS) {
+				/* error status */
+				/* free buffer */
+				free(dump_here);
+				return (afc_error_t)param1;
+			}
+			break;
+		case AFC_OP_DATA:
+			/* data response */
+			debug_info("got a data response");
+			break;
+		case AFC_OP_FILE_OPEN_RES:
+			/* file handle response */
+			debug_info("got a file handle response, handle=%lld", param1);
+			break;
+		case AFC_OP_FILE_TELL_RES:
+			/* tell response */
+			debug_info("got a tell response, position=%lld", param1);
+			break;
+		default:
+			/* unknown operation code received */
 			free(dump_here);
-			return (afc_error_t)param1;
-		}
-	} else if (header.operation == AFC_OP_DATA) {
-		/* data response */
-		debug_info("got a data response");
-	} else if (header.operation == AFC_OP_FILE_OPEN_RES) {
-		/* file handle response */
-		debug_info("got a file handle response, handle=%lld", param1);
-	} else if (header.operation == AFC_OP_FILE_TELL_RES) {
-		/* tell response */
-		debug_info("got a tell response, position=%lld", param1);
-	} else {
-		/* unknown operation code received */
-		free(dump_here);
-		*bytes_recv = 0;
+			*bytes_recv = 0;
 
-		debug_info("WARNING: Unknown operation code received 0x%llx param1=%lld", header.operation, param1);
+			debug_info("WARNING: Unknown operation code received 0x%llx param1=%lld", header.operation, param1);
 #ifndef WIN32
-		fprintf(stderr, "%s: WARNING: Unknown operation code received 0x%llx param1=%lld", __func__, (long long)header.operation, (long long)param1);
+			fprintf(stderr, "%s: WARNING: Unknown operation code received 0x%llx param1=%lld", __func__, (long long)header.operation, (long long)param1);
 #endif
 
-		return AFC_E_OP_NOT_SUPPORTED;
+			return AFC_E_OP_NOT_SUPPORTED;
 	}
 
 	if (bytes) {
@@ -351,6 +541,123 @@ static afc_error_t afc_receive_data(afc_client_t client, char **bytes, uint32_t
 	return AFC_E_SUCCESS;
 }
 
+/**
+ * Receives the response for a specific packet number through an AFC client.
+ * The payload of a data response is read directly into the given buffer
+ * without intermediate allocation. Non-data responses (status or errors) are
+ * read into a small scratch buffer only.
+ *
+ * @param client The client to receive data on.
+ * @param packet_num The packet number of the request the response belongs to.
+ * @param data The buffer to receive the payload into.
+ * @param length The size of the buffer. Payload exceeding this size is
+ *     discarded.
+ * @param bytes_recv How much data was stored in the buffer.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+static afc_error_t afc_receive_data_into(afc_client_t client, uint64_t packet_num, char *data, uint32_t length, uint32_t *bytes_recv)
+{
+	AFCPacket header;
+	char scratch[AFC_SCRATCH_BUFFER_SIZE];
+	uint32_t payload_len = 0;
+	uint32_t status_len = 0;
+	uint32_t current_count = 0;
+	uint32_t bytes = 0;
+	uint64_t param1 = -1;
+	afc_error_t ret;
+
+	*bytes_recv = 0;
+
+	ret = afc_receive_header(client, packet_num, &header);
+	if (ret != AFC_E_SUCCESS) {
+		return ret;
+	}
+
+	payload_len = (uint32_t)header.entire_length - sizeof(AFCPacket);
+
+	debug_info("received AFC packet, full len=%lld, this len=%lld, operation=0x%llx", header.entire_length, header.this_length, header.operation);
+
+	if (payload_len == 0) {
+		debug_info("Empty AFCPacket received!");
+		return (header.operation == AFC_OP_DATA) ? AFC_E_SUCCESS : AFC_E_IO_ERROR;
+	}
+
+	/* read the payload straight into the caller's buffer if it is data */
+	if (header.operation == AFC_OP_DATA) {
+		uint32_t wanted = (payload_len > length) ? length : payload_len;
+		while (current_count < wanted) {
+			bytes = 0;
+			service_receive(client->parent, data + current_count, wanted - current_count, &bytes);
+			if (bytes == 0) {
+				debug_info("Error receiving data (read %u, size %u)", current_count, payload_len);
+				*bytes_recv = current_count;
+				return AFC_E_NOT_ENOUGH_DATA;
+			}
+			current_count += bytes;
+		}
+		*bytes_recv = current_count;
+	}
+
+	/* consume whatever is left of the packet */
+	while (current_count < payload_len) {
+		/* keep the first bytes of non-data responses for status evaluation */
+		uint32_t keep = (status_len > sizeof(uint64_t)) ? sizeof(uint64_t) : status_len;
+		uint32_t chunk = payload_len - current_count;
+		if (chunk > sizeof(scratch) - keep) {
+			chunk = sizeof(scratch) - keep;
+		}
+		bytes = 0;
+		service_receive(client->parent, scratch + keep, chunk, &bytes);
+		if (bytes == 0) {
+			debug_info("Error receiving data (read %u, size %u)", current_count, payload_len);
+			return AFC_E_NOT_ENOUGH_DATA;
+		}
+		if (header.operation != AFC_OP_DATA) {
+			status_len = keep + bytes;
+		}
+		current_count += bytes;
+	}
+
+	if (header.operation == AFC_OP_DATA) {
+		debug_info("got a data response");
+		if (payload_len > length) {
+			debug_info("WARNING: discarded %u bytes of excess data", payload_len - length);
+		}
+		return AFC_E_SUCCESS;
+	}
+
+	if (status_len >= sizeof(uint64_t)) {
+		param1 = le64toh(*(uint64_t*)scratch);
+	}
+
+	if (header.operation == AFC_OP_STATUS) {
+		debug_info("got a status response, code=%lld", param1);
+		if (param1 != AFC_E_SUCCESS) {
+			return (afc_error_t)param1;
+		}
+		return AFC_E_SUCCESS;
+	}
+
+	debug_info("WARNING: Unknown operation code received 0x%llx param1=%lld", header.operation, param1);
+	return AFC_E_OP_NOT_SUPPORTED;
+}
+
+/**
+ * Receives data through an AFC client and sets a variable to the received data.
+ * The response is expected for the most recently dispatched packet.
+ *
+ * @param client The client to receive data on.
+ * @param bytes The char* to point to the newly-received data.
+ * @param bytes_recv How much data was received.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+static afc_error_t afc_receive_data(afc_client_t client, char **bytes, uint32_t *bytes_recv)
+{
+	return afc_receive_response(client, client->afc_packet->packet_num, bytes, bytes_recv);
+}
+
 /**
  * Returns counts of null characters within a string.
  */
@@ -398,78 +705,504 @@ static char **make_strings_list(char *tokens, uint32_t length)
 static int _afc_check_packet_buffer(afc_client_t client, uint32_t data_len)
 {
 	if (data_len > client->packet_extra) {
-		client->packet_extra = (data_len & ~8) + 8;
-		AFCPacket* newpkt = (AFCPacket*)realloc(client->afc_packet, sizeof(AFCPacket) + client->packet_extra);
+		/* grow geometrically so that alternating sizes don't realloc each time */
+		uint32_t new_extra = client->packet_extra * 2;
+		if (new_extra < data_len) {
+			new_extra = (data_len + AFC_PACKET_EXTRA_MIN - 1) & ~(AFC_PACKET_EXTRA_MIN - 1);
+		}
+		AFCPacket* newpkt = (AFCPacket*)realloc(client->afc_packet, sizeof(AFCPacket) + new_extra);
 		if (!newpkt) {
 			return -1;
 		}
 		client->afc_packet = newpkt;
+		client->packet_extra = new_extra;
+		afc_packet_pool_update_high_water(new_extra);
 	}
 	return 0;
 }
 
 #define AFC_PACKET_DATA_PTR ((char*)client->afc_packet + sizeof(AFCPacket))
 
-LIBIMOBILEDEVICE_API afc_error_t afc_read_directory(afc_client_t client, const char *path, char ***directory_information)
+static uint64_t afc_time_us(void)
 {
-	uint32_t bytes = 0;
-	char *data = NULL, **list_loc = NULL;
-	afc_error_t ret = AFC_E_UNKNOWN_ERROR;
-
-	if (!client || !path || !directory_information || (directory_information && *directory_information))
-		return AFC_E_INVALID_ARG;
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
 
-	afc_lock(client);
+/*
+ * Optional cache of GetFileInfo and ReadDir results. Entries are hashed by
+ * kind and normalized path, expire after the configured TTL and are evicted
+ * least recently used first once the configured size is exceeded.
+ * Operations changing the device file system through the same client drop
+ * the affected entries. All functions expect the client to be locked.
+ */
 
-	uint32_t data_len = (uint32_t)strlen(path)+1;
-	if (_afc_check_packet_buffer(client, data_len) < 0) {
-		afc_unlock(client);
-		debug_info("Failed to realloc packet buffer");
-		return AFC_E_NO_MEM;
+/**
+ * Returns a copy of the path without leading, trailing and repeated slashes,
+ * the root directory becomes an empty string.
+ */
+static char *afc_cache_key(const char *path)
+{
+	char *key = (char*)malloc(strlen(path) + 1);
+	char *p = key;
+	if (!key)
+		return NULL;
+	while (*path) {
+		if (*path == '/') {
+			while (*path == '/')
+				path++;
+			if (*path && p > key)
+				*p++ = '/';
+			continue;
+		}
+		*p++ = *path++;
 	}
+	*p = '\0';
+	return key;
+}
 
-	/* Send the command */
-	memcpy(AFC_PACKET_DATA_PTR, path, data_len);
-	ret = afc_dispatch_packet(client, AFC_OP_READ_DIR, data_len, NULL, 0, &bytes);
-	if (ret != AFC_E_SUCCESS) {
-		afc_unlock(client);
-		return AFC_E_NOT_ENOUGH_DATA;
-	}
-	/* Receive the data */
-	ret = afc_receive_data(client, &data, &bytes);
-	if (ret != AFC_E_SUCCESS) {
-		if (data)
-			free(data);
-		afc_unlock(client);
-		return ret;
+static unsigned int afc_cache_hash(int kind, const char *key)
+{
+	unsigned int hash = 2166136261u ^ (unsigned int)kind;
+	while (*key) {
+		hash ^= (unsigned char)*key++;
+		hash *= 16777619u;
 	}
-	/* Parse the data */
-	list_loc = make_strings_list(data, bytes);
-	if (data)
-		free(data);
-
-	afc_unlock(client);
-	*directory_information = list_loc;
+	return hash;
+}
 
-	return ret;
+static size_t afc_cache_entry_size(struct afc_cache_entry *entry)
+{
+	return sizeof(struct afc_cache_entry) + strlen(entry->path) + 1 + entry->length;
 }
 
-LIBIMOBILEDEVICE_API afc_error_t afc_get_device_info(afc_client_t client, char ***device_information)
+static void afc_cache_unlink(struct afc_cache *cache, struct afc_cache_entry *entry)
 {
-	uint32_t bytes = 0;
-	char *data = NULL, **list = NULL;
-	afc_error_t ret = AFC_E_UNKNOWN_ERROR;
+	if (entry->lru_prev)
+		entry->lru_prev->lru_next = entry->lru_next;
+	else
+		cache->lru_first = entry->lru_next;
+	if (entry->lru_next)
+		entry->lru_next->lru_prev = entry->lru_prev;
+	else
+		cache->lru_last = entry->lru_prev;
+	entry->lru_prev = entry->lru_next = NULL;
+}
 
-	if (!client || !device_information)
-		return AFC_E_INVALID_ARG;
+static void afc_cache_link_first(struct afc_cache *cache, struct afc_cache_entry *entry)
+{
+	entry->lru_prev = NULL;
+	entry->lru_next = cache->lru_first;
+	if (cache->lru_first)
+		cache->lru_first->lru_prev = entry;
+	else
+		cache->lru_last = entry;
+	cache->lru_first = entry;
+}
 
-	afc_lock(client);
+static void afc_cache_remove_entry(struct afc_cache *cache, struct afc_cache_entry *entry)
+{
+	struct afc_cache_entry **pp = &cache->hash[entry->hash % AFC_CACHE_HASH_SIZE];
+	while (*pp && *pp != entry)
+		pp = &(*pp)->hash_next;
+	if (*pp)
+		*pp = entry->hash_next;
+	afc_cache_unlink(cache, entry);
+	cache->size -= afc_cache_entry_size(entry);
+	free(entry->path);
+	free(entry->data);
+	free(entry);
+}
 
-	/* Send the command */
-	ret = afc_dispatch_packet(client, AFC_OP_GET_DEVINFO, 0, NULL, 0, &bytes);
-	if (ret != AFC_E_SUCCESS) {
-		afc_unlock(client);
-		return AFC_E_NOT_ENOUGH_DATA;
+static void afc_cache_free(struct afc_cache *cache)
+{
+	if (!cache)
+		return;
+	while (cache->lru_first)
+		afc_cache_remove_entry(cache, cache->lru_first);
+	while (cache->handles) {
+		struct afc_cache_handle *h = cache->handles;
+		cache->handles = h->next;
+		free(h->path);
+		free(h);
+	}
+	free(cache);
+}
+
+static struct afc_cache_entry *afc_cache_find(struct afc_cache *cache, int kind, const char *key)
+{
+	unsigned int hash = afc_cache_hash(kind, key);
+	struct afc_cache_entry *entry = cache->hash[hash % AFC_CACHE_HASH_SIZE];
+	while (entry) {
+		if (entry->hash == hash && entry->kind == kind && !strcmp(entry->path, key))
+			return entry;
+		entry = entry->hash_next;
+	}
+	return NULL;
+}
+
+/**
+ * Looks up a cached result. Expired entries are dropped.
+ *
+ * @return The entry or NULL if there is no valid one.
+ */
+static struct afc_cache_entry *afc_cache_lookup(afc_client_t client, int kind, const char *path)
+{
+	struct afc_cache *cache = client->cache;
+	if (!cache)
+		return NULL;
+
+	char *key = afc_cache_key(path);
+	if (!key)
+		return NULL;
+	struct afc_cache_entry *entry = afc_cache_find(cache, kind, key);
+	free(key);
+	if (!entry)
+		return NULL;
+
+	if (afc_time_us() >= entry->expires) {
+		afc_cache_remove_entry(cache, entry);
+		return NULL;
+	}
+	afc_cache_unlink(cache, entry);
+	afc_cache_link_first(cache, entry);
+	debug_info("cache hit for %s", entry->path);
+	return entry;
+}
+
+/**
+ * Stores the result of a GetFileInfo or ReadDir request. The data is copied.
+ */
+static void afc_cache_store(afc_client_t client, int kind, const char *path, afc_error_t error, const char *data, uint32_t length)
+{
+	struct afc_cache *cache = client->cache;
+	if (!cache)
+		return;
+
+	char *key = afc_cache_key(path);
+	if (!key)
+		return;
+	struct afc_cache_entry *entry = afc_cache_find(cache, kind, key);
+	if (entry)
+		afc_cache_remove_entry(cache, entry);
+
+	size_t size = sizeof(struct afc_cache_entry) + strlen(key) + 1 + length;
+	if (size > cache->max_size / 4) {
+		/* don't let a single huge directory push out everything else */
+		free(key);
+		return;
+	}
+
+	entry = (struct afc_cache_entry*)calloc(1, sizeof(struct afc_cache_entry));
+	if (!entry) {
+		free(key);
+		return;
+	}
+	if (length > 0) {
+		entry->data = (char*)malloc(length);
+		if (!entry->data) {
+			free(entry);
+			free(key);
+			return;
+		}
+		memcpy(entry->data, data, length);
+	}
+	entry->kind = kind;
+	entry->path = key;
+	entry->hash = afc_cache_hash(kind, key);
+	entry->error = error;
+	entry->length = length;
+	entry->expires = afc_time_us() + (uint64_t)cache->ttl * 1000;
+
+	while (cache->lru_last && cache->size + size > cache->max_size)
+		afc_cache_remove_entry(cache, cache->lru_last);
+
+	entry->hash_next = cache->hash[entry->hash % AFC_CACHE_HASH_SIZE];
+	cache->hash[entry->hash % AFC_CACHE_HASH_SIZE] = entry;
+	afc_cache_link_first(cache, entry);
+	cache->size += size;
+}
+
+/**
+ * Drops the cached information about a path that got changed.
+ *
+ * @param flags AFC_CACHE_INVALIDATE_PARENT if the path got created or
+ *     removed, so the listing of its directory changed, and
+ *     AFC_CACHE_INVALIDATE_TREE if everything below it is affected as well.
+ */
+static void afc_cache_invalidate(afc_client_t client, const char *path, int flags)
+{
+	struct afc_cache *cache = client->cache;
+	struct afc_cache_entry *entry;
+	if (!cache || !path)
+		return;
+
+	char *key = afc_cache_key(path);
+	if (!key)
+		return;
+	entry = afc_cache_find(cache, AFC_CACHE_FILE_INFO, key);
+	if (entry)
+		afc_cache_remove_entry(cache, entry);
+	entry = afc_cache_find(cache, AFC_CACHE_DIRECTORY, key);
+	if (entry)
+		afc_cache_remove_entry(cache, entry);
+
+	if (flags & AFC_CACHE_INVALIDATE_TREE) {
+		size_t len = strlen(key);
+		entry = cache->lru_first;
+		while (entry) {
+			struct afc_cache_entry *next = entry->lru_next;
+			if (len == 0 || (!strncmp(entry->path, key, len) && entry->path[len] == '/'))
+				afc_cache_remove_entry(cache, entry);
+			entry = next;
+		}
+	}
+
+	if ((flags & AFC_CACHE_INVALIDATE_PARENT) && *key) {
+		char *slash = strrchr(key, '/');
+		if (slash)
+			*slash = '\0';
+		else
+			*key = '\0';
+		entry = afc_cache_find(cache, AFC_CACHE_DIRECTORY, key);
+		if (entry)
+			afc_cache_remove_entry(cache, entry);
+	}
+	free(key);
+}
+
+/**
+ * Remembers the path of a file opened for writing, so writes through the
+ * handle can invalidate it.
+ */
+static void afc_cache_track_handle(afc_client_t client, uint64_t handle, const char *path)
+{
+	struct afc_cache *cache = client->cache;
+	if (!cache)
+		return;
+	struct afc_cache_handle *h = (struct afc_cache_handle*)malloc(sizeof(struct afc_cache_handle));
+	if (!h)
+		return;
+	h->path = strdup(path);
+	if (!h->path) {
+		free(h);
+		return;
+	}
+	h->handle = handle;
+	h->next = cache->handles;
+	cache->handles = h;
+}
+
+/**
+ * Drops the cached information about the file behind a handle.
+ *
+ * @param untrack Non-zero if the handle got closed.
+ */
+static void afc_cache_invalidate_handle(afc_client_t client, uint64_t handle, int untrack)
+{
+	struct afc_cache *cache = client->cache;
+	if (!cache)
+		return;
+	struct afc_cache_handle **pp = &cache->handles;
+	while (*pp && (*pp)->handle != handle)
+		pp = &(*pp)->next;
+	if (!*pp)
+		return;
+	struct afc_cache_handle *h = *pp;
+	afc_cache_invalidate(client, h->path, 0);
+	if (untrack) {
+		*pp = h->next;
+		free(h->path);
+		free(h);
+	}
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_client_set_cache(afc_client_t client, uint32_t ttl, uint32_t max_size)
+{
+	if (!client)
+		return AFC_E_INVALID_ARG;
+
+	struct afc_cache *cache = NULL;
+	if (ttl > 0) {
+		cache = (struct afc_cache*)calloc(1, sizeof(struct afc_cache));
+		if (!cache)
+			return AFC_E_NO_MEM;
+		cache->ttl = ttl;
+		cache->max_size = (max_size > 0) ? max_size : AFC_CACHE_DEFAULT_MAX_SIZE;
+	}
+
+	afc_lock(client);
+	struct afc_cache *old = client->cache;
+	if (old && cache) {
+		/* keep knowing about files already opened for writing */
+		cache->handles = old->handles;
+		old->handles = NULL;
+	}
+	client->cache = cache;
+	afc_unlock(client);
+
+	afc_cache_free(old);
+
+	return AFC_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_client_get_service_client(afc_client_t client, service_client_t *service_client)
+{
+	if (!client || !client->parent || !service_client)
+		return AFC_E_INVALID_ARG;
+	*service_client = client->parent;
+	return AFC_E_SUCCESS;
+}
+
+/**
+ * Receives the NUL separated names of a directory listing as one buffer,
+ * from the cache if possible. The caller must free() it.
+ */
+static afc_error_t afc_read_directory_data(afc_client_t client, const char *path, char **data, uint32_t *length)
+{
+	uint32_t bytes = 0;
+	afc_error_t ret = AFC_E_UNKNOWN_ERROR;
+
+	*data = NULL;
+	*length = 0;
+
+	afc_lock(client);
+
+	struct afc_cache_entry *cached = afc_cache_lookup(client, AFC_CACHE_DIRECTORY, path);
+	if (cached) {
+		if (cached->length > 0) {
+			*data = (char*)malloc(cached->length);
+			if (!*data) {
+				afc_unlock(client);
+				return AFC_E_NO_MEM;
+			}
+			memcpy(*data, cached->data, cached->length);
+			*length = cached->length;
+		}
+		afc_unlock(client);
+		return AFC_E_SUCCESS;
+	}
+
+	uint32_t data_len = (uint32_t)strlen(path)+1;
+	if (_afc_check_packet_buffer(client, data_len) < 0) {
+		afc_unlock(client);
+		debug_info("Failed to realloc packet buffer");
+		return AFC_E_NO_MEM;
+	}
+
+	/* Send the command */
+	memcpy(AFC_PACKET_DATA_PTR, path, data_len);
+	ret = afc_dispatch_packet(client, AFC_OP_READ_DIR, data_len, NULL, 0, &bytes);
+	if (ret != AFC_E_SUCCESS) {
+		afc_unlock(client);
+		return AFC_E_NOT_ENOUGH_DATA;
+	}
+	/* Receive the data */
+	ret = afc_receive_data(client, data, &bytes);
+	if (ret != AFC_E_SUCCESS) {
+		free(*data);
+		*data = NULL;
+		afc_unlock(client);
+		return ret;
+	}
+	afc_cache_store(client, AFC_CACHE_DIRECTORY, path, ret, *data, bytes);
+	*length = bytes;
+
+	afc_unlock(client);
+
+	return ret;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_read_directory(afc_client_t client, const char *path, char ***directory_information)
+{
+	uint32_t bytes = 0;
+	char *data = NULL;
+
+	if (!client || !path || !directory_information || (directory_information && *directory_information))
+		return AFC_E_INVALID_ARG;
+
+	afc_error_t ret = afc_read_directory_data(client, path, &data, &bytes);
+	if (ret != AFC_E_SUCCESS)
+		return ret;
+
+	/* Parse the data */
+	*directory_information = make_strings_list(data, bytes);
+	free(data);
+
+	return ret;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_dir_open(afc_client_t client, const char *path, afc_dir_t *dir)
+{
+	if (!client || !path || !dir)
+		return AFC_E_INVALID_ARG;
+
+	afc_dir_t d = (afc_dir_t)calloc(1, sizeof(struct afc_dir_private));
+	if (!d)
+		return AFC_E_NO_MEM;
+
+	afc_error_t ret = afc_read_directory_data(client, path, &d->data, &d->length);
+	if (ret != AFC_E_SUCCESS) {
+		free(d);
+		return ret;
+	}
+	*dir = d;
+
+	return AFC_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_dir_next(afc_dir_t dir, const char **name)
+{
+	if (!dir || !name)
+		return AFC_E_INVALID_ARG;
+
+	*name = NULL;
+	while (dir->offset < dir->length) {
+		const char *entry = dir->data + dir->offset;
+		const char *end = (const char*)memchr(entry, '\0', dir->length - dir->offset);
+		if (!end) {
+			/* a name without terminator is not a complete entry */
+			dir->offset = dir->length;
+			break;
+		}
+		dir->offset += (uint32_t)(end - entry) + 1;
+		if (!strcmp(entry, ".") || !strcmp(entry, "..") || *entry == '\0')
+			continue;
+		*name = entry;
+		break;
+	}
+
+	return AFC_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_dir_close(afc_dir_t dir)
+{
+	if (!dir)
+		return AFC_E_INVALID_ARG;
+
+	free(dir->data);
+	free(dir);
+
+	return AFC_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_get_device_info(afc_client_t client, char ***device_information)
+{
+	uint32_t bytes = 0;
+	char *data = NULL, **list = NULL;
+	afc_error_t ret = AFC_E_UNKNOWN_ERROR;
+
+	if (!client || !device_information)
+		return AFC_E_INVALID_ARG;
+
+	afc_lock(client);
+
+	/* Send the command */
+	ret = afc_dispatch_packet(client, AFC_OP_GET_DEVINFO, 0, NULL, 0, &bytes);
+	if (ret != AFC_E_SUCCESS) {
+		afc_unlock(client);
+		return AFC_E_NOT_ENOUGH_DATA;
 	}
 	/* Receive the data */
 	ret = afc_receive_data(client, &data, &bytes);
@@ -549,6 +1282,9 @@ LIBIMOBILEDEVICE_API afc_error_t afc_remove_path(afc_client_t client, const char
 	if (ret == AFC_E_UNKNOWN_ERROR)
 		ret = AFC_E_DIR_NOT_EMPTY;
 
+	if (ret == AFC_E_SUCCESS)
+		afc_cache_invalidate(client, path, AFC_CACHE_INVALIDATE_PARENT | AFC_CACHE_INVALIDATE_TREE);
+
 	afc_unlock(client);
 
 	return ret;
@@ -585,6 +1321,11 @@ LIBIMOBILEDEVICE_API afc_error_t afc_rename_path(afc_client_t client, const char
 	/* Receive response */
 	ret = afc_receive_data(client, NULL, &bytes);
 
+	if (ret == AFC_E_SUCCESS) {
+		afc_cache_invalidate(client, from, AFC_CACHE_INVALIDATE_PARENT | AFC_CACHE_INVALIDATE_TREE);
+		afc_cache_invalidate(client, to, AFC_CACHE_INVALIDATE_PARENT | AFC_CACHE_INVALIDATE_TREE);
+	}
+
 	afc_unlock(client);
 
 	return ret;
@@ -617,11 +1358,68 @@ LIBIMOBILEDEVICE_API afc_error_t afc_make_directory(afc_client_t client, const c
 	/* Receive response */
 	ret = afc_receive_data(client, NULL, &bytes);
 
+	if (ret == AFC_E_SUCCESS)
+		afc_cache_invalidate(client, path, AFC_CACHE_INVALIDATE_PARENT);
+
 	afc_unlock(client);
 
 	return ret;
 }
 
+/**
+ * Fills an afc_stat_t from the key/value list of a GetFileInfo response.
+ * The link target is only copied if link_target is not NULL.
+ */
+static void afc_parse_stat(const char *data, uint32_t length, afc_stat_t *st, char **link_target)
+{
+	const char *end = data + length;
+	const char *key = data;
+
+	memset(st, '\0', sizeof(afc_stat_t));
+
+	while (key < end) {
+		const char *key_end = (const char*)memchr(key, '\0', end - key);
+		if (!key_end || key_end + 1 >= end)
+			break;
+		const char *val = key_end + 1;
+		const char *val_end = (const char*)memchr(val, '\0', end - val);
+		if (!val_end)
+			break;
+
+		if (!strcmp(key, "st_size")) {
+			st->size = strtoull(val, NULL, 10);
+		} else if (!strcmp(key, "st_blocks")) {
+			st->blocks = strtoull(val, NULL, 10);
+		} else if (!strcmp(key, "st_nlink")) {
+			st->nlink = (uint32_t)strtoul(val, NULL, 10);
+		} else if (!strcmp(key, "st_mtime")) {
+			st->mtime = strtoull(val, NULL, 10);
+		} else if (!strcmp(key, "st_birthtime")) {
+			st->birthtime = strtoull(val, NULL, 10);
+		} else if (!strcmp(key, "st_ifmt")) {
+			if (!strcmp(val, "S_IFREG")) {
+				st->type = AFC_FILE_TYPE_REGULAR;
+			} else if (!strcmp(val, "S_IFDIR")) {
+				st->type = AFC_FILE_TYPE_DIRECTORY;
+			} else if (!strcmp(val, "S_IFLNK")) {
+				st->type = AFC_FILE_TYPE_SYMLINK;
+			} else if (!strcmp(val, "S_IFCHR")) {
+				st->type = AFC_FILE_TYPE_CHAR_DEVICE;
+			} else if (!strcmp(val, "S_IFBLK")) {
+				st->type = AFC_FILE_TYPE_BLOCK_DEVICE;
+			} else if (!strcmp(val, "S_IFIFO")) {
+				st->type = AFC_FILE_TYPE_FIFO;
+			} else if (!strcmp(val, "S_IFSOCK")) {
+				st->type = AFC_FILE_TYPE_SOCKET;
+			}
+		} else if (link_target && !strcmp(key, "LinkTarget")) {
+			free(*link_target);
+			*link_target = strdup(val);
+		}
+		key = val_end + 1;
+	}
+}
+
 LIBIMOBILEDEVICE_API afc_error_t afc_get_file_info(afc_client_t client, const char *path, char ***file_information)
 {
 	char *received = NULL;
@@ -633,6 +1431,14 @@ LIBIMOBILEDEVICE_API afc_error_t afc_get_file_info(afc_client_t client, const ch
 
 	afc_lock(client);
 
+	struct afc_cache_entry *cached = afc_cache_lookup(client, AFC_CACHE_FILE_INFO, path);
+	if (cached) {
+		if (cached->error == AFC_E_SUCCESS)
+			*file_information = make_strings_list(cached->data, cached->length);
+		afc_unlock(client);
+		return cached->error;
+	}
+
 	uint32_t data_len = (uint32_t)strlen(path)+1;
 	if (_afc_check_packet_buffer(client, data_len) < 0) {
 		afc_unlock(client);
@@ -652,6 +1458,9 @@ LIBIMOBILEDEVICE_API afc_error_t afc_get_file_info(afc_client_t client, const ch
 
 	/* Receive data */
 	ret = afc_receive_data(client, &received, &bytes);
+	if (ret == AFC_E_SUCCESS || ret == AFC_E_OBJECT_NOT_FOUND) {
+		afc_cache_store(client, AFC_CACHE_FILE_INFO, path, ret, received, (ret == AFC_E_SUCCESS) ? bytes : 0);
+	}
 	if (received) {
 		*file_information = make_strings_list(received, bytes);
 		free(received);
@@ -662,21 +1471,29 @@ LIBIMOBILEDEVICE_API afc_error_t afc_get_file_info(afc_client_t client, const ch
 	return ret;
 }
 
-LIBIMOBILEDEVICE_API afc_error_t afc_file_open(afc_client_t client, const char *filename, afc_file_mode_t file_mode, uint64_t *handle)
+LIBIMOBILEDEVICE_API afc_error_t afc_get_file_info_struct(afc_client_t client, const char *path, afc_stat_t *st, char **link_target)
 {
-	if (!client || !client->parent || !client->afc_packet)
-		return AFC_E_INVALID_ARG;
-
-	//uint64_t file_mode_loc = htole64(file_mode);
+	char buf[AFC_FILE_INFO_BUFFER_SIZE];
 	uint32_t bytes = 0;
 	afc_error_t ret = AFC_E_UNKNOWN_ERROR;
 
-	/* set handle to 0 so in case an error occurs, the handle is invalid */
-	*handle = 0;
+	if (!client || !client->parent || !client->afc_packet || !path || !st)
+		return AFC_E_INVALID_ARG;
+
+	if (link_target)
+		*link_target = NULL;
 
 	afc_lock(client);
 
-	uint32_t data_len = (uint32_t)(strlen(filename)+1 + 8);
+	struct afc_cache_entry *cached = afc_cache_lookup(client, AFC_CACHE_FILE_INFO, path);
+	if (cached) {
+		if (cached->error == AFC_E_SUCCESS)
+			afc_parse_stat(cached->data, cached->length, st, link_target);
+		afc_unlock(client);
+		return cached->error;
+	}
+
+	uint32_t data_len = (uint32_t)strlen(path)+1;
 	if (_afc_check_packet_buffer(client, data_len) < 0) {
 		afc_unlock(client);
 		debug_info("Failed to realloc packet buffer");
@@ -684,430 +1501,2039 @@ LIBIMOBILEDEVICE_API afc_error_t afc_file_open(afc_client_t client, const char *
 	}
 
 	/* Send command */
-	//memcpy(AFC_PACKET_DATA_PTR, &file_mode_loc, 8);
-	*(uint64_t*)(AFC_PACKET_DATA_PTR) = htole64(file_mode);
-	memcpy(AFC_PACKET_DATA_PTR + 8, filename, data_len-8);
-	ret = afc_dispatch_packet(client, AFC_OP_FILE_OPEN, data_len, NULL, 0, &bytes);
+	memcpy(AFC_PACKET_DATA_PTR, path, data_len);
+	ret = afc_dispatch_packet(client, AFC_OP_GET_FILE_INFO, data_len, NULL, 0, &bytes);
 	if (ret != AFC_E_SUCCESS) {
-		debug_info("Didn't receive a response to the command");
 		afc_unlock(client);
 		return AFC_E_NOT_ENOUGH_DATA;
 	}
-	/* Receive the data */
-	char* data = NULL;
-	ret = afc_receive_data(client, &data, &bytes);
-	if ((ret == AFC_E_SUCCESS) && (bytes > 0) && data) {
-		afc_unlock(client);
 
-		/* Get the file handle */
-		memcpy(handle, data, sizeof(uint64_t));
-		free(data);
-		return ret;
+	/* Receive the reply into the stack buffer and parse it in place */
+	ret = afc_receive_data_into(client, client->afc_packet->packet_num, buf, sizeof(buf), &bytes);
+	if (ret == AFC_E_SUCCESS) {
+		afc_parse_stat(buf, bytes, st, link_target);
+	}
+	if (ret == AFC_E_SUCCESS || ret == AFC_E_OBJECT_NOT_FOUND) {
+		afc_cache_store(client, AFC_CACHE_FILE_INFO, path, ret, buf, (ret == AFC_E_SUCCESS) ? bytes : 0);
 	}
-	/* in case memory was allocated but no data received or an error occurred */
-	free(data);
-
-	debug_info("Didn't get any further data");
 
 	afc_unlock(client);
 
 	return ret;
 }
 
-LIBIMOBILEDEVICE_API afc_error_t afc_file_read(afc_client_t client, uint64_t handle, char *data, uint32_t length, uint32_t *bytes_read)
+static struct afc_walk_item *afc_walk_item_new(int operation, char *path)
 {
-	char *input = NULL;
-	uint32_t current_count = 0, bytes_loc = 0;
-	struct readinfo {
-		uint64_t handle;
-		uint64_t size;
-	};
-	afc_error_t ret = AFC_E_SUCCESS;
+	struct afc_walk_item *item = (struct afc_walk_item*)malloc(sizeof(struct afc_walk_item));
+	if (!item) {
+		free(path);
+		return NULL;
+	}
+	item->operation = operation;
+	item->path = path;
+	item->packet_num = 0;
+	item->next = NULL;
+	return item;
+}
 
-	if (!client || !client->afc_packet || !client->parent || handle == 0)
-		return AFC_E_INVALID_ARG;
-	debug_info("called for length %i", length);
+static void afc_walk_item_free(struct afc_walk_item *item)
+{
+	free(item->path);
+	free(item);
+}
 
-	//uint32_t data_len = 8 + 8;
+static void afc_walk_queue_push(struct afc_walk_queue *queue, struct afc_walk_item *item)
+{
+	item->next = NULL;
+	if (queue->last) {
+		queue->last->next = item;
+	} else {
+		queue->first = item;
+	}
+	queue->last = item;
+	queue->count++;
+}
 
-	afc_lock(client);
+static struct afc_walk_item *afc_walk_queue_pop(struct afc_walk_queue *queue)
+{
+	struct afc_walk_item *item = queue->first;
+	if (item) {
+		queue->first = item->next;
+		if (!queue->first)
+			queue->last = NULL;
+		queue->count--;
+		item->next = NULL;
+	}
+	return item;
+}
 
-	/* Send the read command */
-	struct readinfo* readinfo = (struct readinfo*)(AFC_PACKET_DATA_PTR);
-	readinfo->handle = handle;
-	readinfo->size = htole64(length);
-	ret = afc_dispatch_packet(client, AFC_OP_FILE_READ, sizeof(struct readinfo), NULL, 0, &bytes_loc);
+static void afc_walk_queue_clear(struct afc_walk_queue *queue)
+{
+	struct afc_walk_item *item;
+	while ((item = afc_walk_queue_pop(queue)) != NULL) {
+		afc_walk_item_free(item);
+	}
+}
+
+/**
+ * Queues a stat request for every entry of a ReadDir response.
+ */
+static afc_error_t afc_walk_add_entries(struct afc_walk_queue *todo, const char *dir, const char *data, uint32_t length)
+{
+	const char *end = data + length;
+	const char *name = data;
+	size_t dir_len = strlen(dir);
+	int need_sep = (dir_len == 0 || dir[dir_len-1] != '/');
+
+	while (name < end) {
+		const char *name_end = (const char*)memchr(name, '\0', end - name);
+		if (!name_end)
+			break;
+		size_t name_len = name_end - name;
+		if (name_len > 0 && strcmp(name, ".") != 0 && strcmp(name, "..") != 0) {
+			char *path = (char*)malloc(dir_len + need_sep + name_len + 1);
+			if (!path)
+				return AFC_E_NO_MEM;
+			memcpy(path, dir, dir_len);
+			if (need_sep)
+				path[dir_len] = '/';
+			memcpy(path + dir_len + need_sep, name, name_len + 1);
+			struct afc_walk_item *item = afc_walk_item_new(AFC_OP_GET_FILE_INFO, path);
+			if (!item)
+				return AFC_E_NO_MEM;
+			afc_walk_queue_push(todo, item);
+		}
+		name = name_end + 1;
+	}
+
+	return AFC_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_walk(afc_client_t client, const char *path, unsigned int max_pending, afc_walk_cb_t callback, void *user_data)
+{
+	struct afc_walk_queue todo = { NULL, NULL, 0 };
+	struct afc_walk_queue pending = { NULL, NULL, 0 };
+	struct afc_walk_queue done = { NULL, NULL, 0 };
+	struct afc_walk_item *item;
+	afc_error_t ret = AFC_E_SUCCESS;
+	uint64_t root_packet_num = 0;
+	int stop = 0;
+
+	if (!client || !client->parent || !client->afc_packet || !path || !callback)
+		return AFC_E_INVALID_ARG;
+
+	if (max_pending == 0)
+		max_pending = AFC_WALK_MAX_PENDING;
+
+	item = afc_walk_item_new(AFC_OP_GET_FILE_INFO, strdup(path));
+	if (!item || !item->path) {
+		if (item)
+			afc_walk_item_free(item);
+		return AFC_E_NO_MEM;
+	}
+	afc_walk_queue_push(&todo, item);
+
+	while (!stop && todo.count > 0) {
+		afc_lock(client);
+
+		/* keep up to max_pending requests in flight until a batch of
+		 * results is ready to be passed to the callback */
+		while (1) {
+			while (ret == AFC_E_SUCCESS && todo.count > 0 && pending.count < max_pending && done.count + pending.count < AFC_WALK_BATCH_SIZE) {
+				uint32_t bytes = 0;
+				item = afc_walk_queue_pop(&todo);
+				uint32_t data_len = (uint32_t)strlen(item->path)+1;
+				if (_afc_check_packet_buffer(client, data_len) < 0) {
+					debug_info("Failed to realloc packet buffer");
+					afc_walk_item_free(item);
+					ret = AFC_E_NO_MEM;
+					break;
+				}
+				memcpy(AFC_PACKET_DATA_PTR, item->path, data_len);
+				if (afc_dispatch_packet(client, item->operation, data_len, NULL, 0, &bytes) != AFC_E_SUCCESS || bytes < sizeof(AFCPacket) + data_len) {
+					debug_info("Failed to send request for %s", item->path);
+					afc_walk_item_free(item);
+					ret = AFC_E_NOT_ENOUGH_DATA;
+					break;
+				}
+				item->packet_num = client->afc_packet->packet_num;
+				if (root_packet_num == 0)
+					root_packet_num = item->packet_num;
+				afc_walk_queue_push(&pending, item);
+			}
+
+			item = afc_walk_queue_pop(&pending);
+			if (!item)
+				break;
+
+			char *data = NULL;
+			uint32_t bytes = 0;
+			afc_error_t err = afc_receive_response(client, item->packet_num, &data, &bytes);
+			if (err == AFC_E_OP_HEADER_INVALID || err == AFC_E_MUX_ERROR || err == AFC_E_NOT_ENOUGH_DATA) {
+				/* the stream is out of sync, don't try to read further responses */
+				free(data);
+				afc_walk_item_free(item);
+				afc_walk_queue_clear(&pending);
+				ret = err;
+				break;
+			}
+			if (ret != AFC_E_SUCCESS) {
+				/* just drain the remaining responses */
+				free(data);
+				afc_walk_item_free(item);
+				continue;
+			}
+			if (err != AFC_E_SUCCESS) {
+				/* entries might vanish or not be accessible while walking */
+				if (item->packet_num == root_packet_num) {
+					ret = err;
+				} else {
+					debug_info("Skipping %s, error %d", item->path, err);
+				}
+				free(data);
+				afc_walk_item_free(item);
+				continue;
+			}
+
+			if (item->operation == AFC_OP_READ_DIR) {
+				ret = afc_walk_add_entries(&todo, item->path, data, bytes);
+				afc_walk_item_free(item);
+			} else {
+				afc_parse_stat(data, bytes, &item->st, NULL);
+				afc_walk_queue_push(&done, item);
+			}
+			free(data);
+		}
+
+		afc_unlock(client);
+
+		/* pass the results on without holding the lock, so the callback
+		 * can use the client itself */
+		while ((item = afc_walk_queue_pop(&done)) != NULL) {
+			int cb_ret = (stop) ? -1 : callback(item->path, &item->st, user_data);
+			if (cb_ret < 0) {
+				stop = 1;
+			} else if (cb_ret == 0 && item->st.type == AFC_FILE_TYPE_DIRECTORY && ret == AFC_E_SUCCESS) {
+				item->operation = AFC_OP_READ_DIR;
+				afc_walk_queue_push(&todo, item);
+				continue;
+			}
+			afc_walk_item_free(item);
+		}
+
+		if (ret != AFC_E_SUCCESS)
+			break;
+	}
+
+	afc_walk_queue_clear(&todo);
+
+	return ret;
+}
+
+static void afc_read_files_push(struct afc_read_files_item **first, struct afc_read_files_item **last, struct afc_read_files_item *item)
+{
+	item->next = NULL;
+	if (*last)
+		(*last)->next = item;
+	else
+		*first = item;
+	*last = item;
+}
+
+static struct afc_read_files_item *afc_read_files_pop(struct afc_read_files_item **first, struct afc_read_files_item **last)
+{
+	struct afc_read_files_item *item = *first;
+	if (item) {
+		*first = item->next;
+		if (!*first)
+			*last = NULL;
+		item->next = NULL;
+	}
+	return item;
+}
+
+static void afc_read_files_item_free(struct afc_read_files_item *item)
+{
+	if (item) {
+		free(item->data);
+		free(item);
+	}
+}
+
+/**
+ * Sends the next request for a file, which is a read until the end of the
+ * file has been reached or an error occurred, and a close afterwards.
+ * The client has to be locked.
+ */
+static afc_error_t afc_read_files_dispatch(afc_client_t client, struct afc_read_files_item *item, struct afc_read_files_op *op)
+{
+	struct readinfo {
+		uint64_t handle;
+		uint64_t size;
+	};
+	uint32_t bytes = 0;
+
+	op->item = item;
+	op->size = 0;
+
+	if (!item->eof && item->error == AFC_E_SUCCESS) {
+		uint32_t size = (item->length < AFC_READ_FILES_FIRST_READ) ? AFC_READ_FILES_FIRST_READ : item->length;
+		if (size > AFC_CHUNK_MAX_SIZE)
+			size = AFC_CHUNK_MAX_SIZE;
+		if (item->capacity - item->length < size) {
+			char *data = (char*)realloc(item->data, item->length + size);
+			if (!data) {
+				item->error = AFC_E_NO_MEM;
+				return afc_read_files_dispatch(client, item, op);
+			}
+			item->data = data;
+			item->capacity = item->length + size;
+		}
+		struct readinfo* readinfo = (struct readinfo*)(AFC_PACKET_DATA_PTR);
+		readinfo->handle = item->handle;
+		readinfo->size = htole64(size);
+		op->operation = AFC_OP_FILE_READ;
+		op->size = size;
+		if (afc_dispatch_packet(client, AFC_OP_FILE_READ, sizeof(struct readinfo), NULL, 0, &bytes) != AFC_E_SUCCESS || bytes < sizeof(AFCPacket) + sizeof(struct readinfo))
+			return AFC_E_NOT_ENOUGH_DATA;
+	} else {
+		*(uint64_t*)(AFC_PACKET_DATA_PTR) = item->handle;
+		op->operation = AFC_OP_FILE_CLOSE;
+		if (afc_dispatch_packet(client, AFC_OP_FILE_CLOSE, 8, NULL, 0, &bytes) != AFC_E_SUCCESS || bytes < sizeof(AFCPacket) + 8)
+			return AFC_E_NOT_ENOUGH_DATA;
+	}
+	op->packet_num = client->afc_packet->packet_num;
+
+	return AFC_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_read_files(afc_client_t client, const char **paths, unsigned int count, unsigned int max_pending, afc_read_files_cb_t callback, void *user_data)
+{
+	struct afc_read_files_op ops[AFC_READ_FILES_MAX_PENDING];
+	struct afc_read_files_item *ready = NULL, *ready_last = NULL;
+	struct afc_read_files_item *done = NULL, *done_last = NULL;
+	struct afc_read_files_item *item;
+	unsigned int next = 0;
+	afc_error_t ret = AFC_E_SUCCESS;
+	int broken = 0;
+	int stop = 0;
+
+	if (!client || !client->parent || !client->afc_packet || (!paths && count > 0) || !callback)
+		return AFC_E_INVALID_ARG;
+
+	if (max_pending == 0 || max_pending > AFC_READ_FILES_MAX_PENDING)
+		max_pending = AFC_READ_FILES_MAX_PENDING;
+
+	while (!stop && ret == AFC_E_SUCCESS && next < count) {
+		unsigned int head = 0;
+		unsigned int pending = 0;
+		unsigned int active = 0;
+		unsigned int done_count = 0;
+		uint64_t done_bytes = 0;
+
+		afc_lock(client);
+
+		/* files are finished completely before the lock is released, so no
+		 * other request gets between the outstanding ones */
+		while (!broken) {
+			while (pending < max_pending) {
+				struct afc_read_files_op *op = &ops[(head + pending) % AFC_READ_FILES_MAX_PENDING];
+				item = afc_read_files_pop(&ready, &ready_last);
+				if (item) {
+					if (afc_read_files_dispatch(client, item, op) != AFC_E_SUCCESS) {
+						debug_info("Failed to send request for %s", paths[item->index]);
+						afc_read_files_item_free(item);
+						ret = AFC_E_NOT_ENOUGH_DATA;
+						broken = 1;
+						break;
+					}
+					pending++;
+					continue;
+				}
+				if (ret != AFC_E_SUCCESS || next >= count || active + done_count >= AFC_READ_FILES_BATCH_SIZE || done_bytes >= AFC_READ_FILES_BATCH_BYTES)
+					break;
+
+				const char *path = paths[next];
+				uint32_t data_len = (uint32_t)(8 + strlen(path) + 1);
+				uint32_t bytes = 0;
+				item = (struct afc_read_files_item*)calloc(1, sizeof(struct afc_read_files_item));
+				if (!item || _afc_check_packet_buffer(client, data_len) < 0) {
+					free(item);
+					ret = AFC_E_NO_MEM;
+					break;
+				}
+				item->index = next++;
+				*(uint64_t*)(AFC_PACKET_DATA_PTR) = htole64(AFC_FOPEN_RDONLY);
+				memcpy(AFC_PACKET_DATA_PTR + 8, path, data_len - 8);
+				if (afc_dispatch_packet(client, AFC_OP_FILE_OPEN, data_len, NULL, 0, &bytes) != AFC_E_SUCCESS || bytes < sizeof(AFCPacket) + data_len) {
+					debug_info("Failed to send open request for %s", path);
+					free(item);
+					ret = AFC_E_NOT_ENOUGH_DATA;
+					broken = 1;
+					break;
+				}
+				op->operation = AFC_OP_FILE_OPEN;
+				op->packet_num = client->afc_packet->packet_num;
+				op->size = 0;
+				op->item = item;
+				pending++;
+				active++;
+			}
+			if (broken || pending == 0)
+				break;
+
+			/* handle the reply to the oldest outstanding request */
+			struct afc_read_files_op *op = &ops[head];
+			head = (head + 1) % AFC_READ_FILES_MAX_PENDING;
+			pending--;
+			item = op->item;
+
+			afc_error_t err;
+			uint32_t bytes = 0;
+			if (op->operation == AFC_OP_FILE_OPEN) {
+				char *data = NULL;
+				err = afc_receive_response(client, op->packet_num, &data, &bytes);
+				if (err == AFC_E_SUCCESS && (bytes < sizeof(uint64_t) || !data))
+					err = AFC_E_IO_ERROR;
+				if (err == AFC_E_SUCCESS)
+					memcpy(&item->handle, data, sizeof(uint64_t));
+				free(data);
+			} else if (op->operation == AFC_OP_FILE_READ) {
+				err = afc_receive_data_into(client, op->packet_num, item->data + item->length, op->size, &bytes);
+			} else {
+				err = afc_receive_response(client, op->packet_num, NULL, &bytes);
+			}
+
+			if (err == AFC_E_OP_HEADER_INVALID || err == AFC_E_MUX_ERROR || err == AFC_E_NOT_ENOUGH_DATA) {
+				/* the stream is out of sync, the remaining replies are lost */
+				afc_read_files_item_free(item);
+				ret = err;
+				broken = 1;
+				break;
+			}
+
+			if (op->operation == AFC_OP_FILE_OPEN) {
+				if (err != AFC_E_SUCCESS) {
+					/* nothing to close */
+					item->error = err;
+					active--;
+					done_count++;
+					afc_read_files_push(&done, &done_last, item);
+				} else {
+					afc_read_files_push(&ready, &ready_last, item);
+				}
+			} else if (op->operation == AFC_OP_FILE_READ) {
+				if (err != AFC_E_SUCCESS) {
+					item->error = err;
+				} else {
+					item->length += bytes;
+					if (bytes < op->size)
+						item->eof = 1;
+				}
+				afc_read_files_push(&ready, &ready_last, item);
+			} else {
+				if (err != AFC_E_SUCCESS && item->error == AFC_E_SUCCESS)
+					item->error = err;
+				active--;
+				done_count++;
+				done_bytes += item->length;
+				afc_read_files_push(&done, &done_last, item);
+			}
+		}
+
+		if (broken) {
+			/* files still in progress can't be finished anymore */
+			while ((item = afc_read_files_pop(&ready, &ready_last)) != NULL)
+				afc_read_files_item_free(item);
+			while (pending > 0) {
+				afc_read_files_item_free(ops[head].item);
+				head = (head + 1) % AFC_READ_FILES_MAX_PENDING;
+				pending--;
+			}
+		}
+
+		afc_unlock(client);
+
+		/* pass the results on without holding the lock, so the callback
+		 * can use the client itself */
+		while ((item = afc_read_files_pop(&done, &done_last)) != NULL) {
+			int ok = (item->error == AFC_E_SUCCESS);
+			if (!stop && callback(paths[item->index], item->error, (ok) ? item->data : NULL, (ok) ? item->length : 0, user_data) != 0)
+				stop = 1;
+			afc_read_files_item_free(item);
+		}
+	}
+
+	return ret;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_file_open(afc_client_t client, const char *filename, afc_file_mode_t file_mode, uint64_t *handle)
+{
+	if (!client || !client->parent || !client->afc_packet)
+		return AFC_E_INVALID_ARG;
+
+	//uint64_t file_mode_loc = htole64(file_mode);
+	uint32_t bytes = 0;
+	afc_error_t ret = AFC_E_UNKNOWN_ERROR;
+
+	/* set handle to 0 so in case an error occurs, the handle is invalid */
+	*handle = 0;
+
+	afc_lock(client);
+
+	uint32_t data_len = (uint32_t)(strlen(filename)+1 + 8);
+	if (_afc_check_packet_buffer(client, data_len) < 0) {
+		afc_unlock(client);
+		debug_info("Failed to realloc packet buffer");
+		return AFC_E_NO_MEM;
+	}
+
+	/* Send command */
+	//memcpy(AFC_PACKET_DATA_PTR, &file_mode_loc, 8);
+	*(uint64_t*)(AFC_PACKET_DATA_PTR) = htole64(file_mode);
+	memcpy(AFC_PACKET_DATA_PTR + 8, filename, data_len-8);
+	ret = afc_dispatch_packet(client, AFC_OP_FILE_OPEN, data_len, NULL, 0, &bytes);
 	if (ret != AFC_E_SUCCESS) {
+		debug_info("Didn't receive a response to the command");
 		afc_unlock(client);
 		return AFC_E_NOT_ENOUGH_DATA;
 	}
 	/* Receive the data */
-	ret = afc_receive_data(client, &input, &bytes_loc);
-	debug_info("afc_receive_data returned error: %d", ret);
+	char* data = NULL;
+	ret = afc_receive_data(client, &data, &bytes);
+	if ((ret == AFC_E_SUCCESS) && (bytes > 0) && data) {
+		/* Get the file handle */
+		memcpy(handle, data, sizeof(uint64_t));
+		free(data);
+
+		if (file_mode != AFC_FOPEN_RDONLY) {
+			/* the file might have been created or truncated */
+			afc_cache_invalidate(client, filename, AFC_CACHE_INVALIDATE_PARENT);
+			afc_cache_track_handle(client, *handle, filename);
+		}
+
+		afc_unlock(client);
+		return ret;
+	}
+	/* in case memory was allocated but no data received or an error occurred */
+	free(data);
+
+	debug_info("Didn't get any further data");
+
+	afc_unlock(client);
+
+	return ret;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_file_read(afc_client_t client, uint64_t handle, char *data, uint32_t length, uint32_t *bytes_read)
+{
+	uint32_t bytes_loc = 0;
+	struct readinfo {
+		uint64_t handle;
+		uint64_t size;
+	};
+	afc_error_t ret = AFC_E_SUCCESS;
+
+	if (!client || !client->afc_packet || !client->parent || handle == 0)
+		return AFC_E_INVALID_ARG;
+	debug_info("called for length %i", length);
+
+	afc_lock(client);
+
+	/* Send the read command */
+	struct readinfo* readinfo = (struct readinfo*)(AFC_PACKET_DATA_PTR);
+	readinfo->handle = handle;
+	readinfo->size = htole64(length);
+	ret = afc_dispatch_packet(client, AFC_OP_FILE_READ, sizeof(struct readinfo), NULL, 0, &bytes_loc);
+	if (ret != AFC_E_SUCCESS) {
+		afc_unlock(client);
+		return AFC_E_NOT_ENOUGH_DATA;
+	}
+	/* Receive the data directly into the caller's buffer */
+	ret = afc_receive_data_into(client, client->afc_packet->packet_num, data, length, &bytes_loc);
+	debug_info("afc_receive_data_into returned error: %d", ret);
 	debug_info("bytes returned: %i", bytes_loc);
+	afc_unlock(client);
+	if (ret != AFC_E_SUCCESS) {
+		return ret;
+	}
+	*bytes_read = bytes_loc;
+	return ret;
+}
+
+/*
+ * Adaptive chunk size for the high-level transfer helpers. It starts at the
+ * FSBlockSize the device reports and is doubled as long as that raises the
+ * measured throughput noticeably. Once it stops paying off the previous size
+ * is kept, until the throughput drops far enough that probing again makes
+ * sense. Requests taking longer than AFC_CHUNK_MAX_LATENCY halve it.
+ */
+
+/**
+ * Sets the starting chunk size from the device's FSBlockSize, if that
+ * didn't happen yet. The client must not be locked.
+ */
+static void afc_chunk_policy_init(afc_client_t client)
+{
+	char *value = NULL;
+	uint32_t block_size = 0;
+
+	afc_lock(client);
+	block_size = client->chunk_size;
+	afc_unlock(client);
+	if (block_size > 0)
+		return;
+
+	if (afc_get_device_info_key(client, "FSBlockSize", &value) == AFC_E_SUCCESS && value) {
+		block_size = (uint32_t)strtoul(value, NULL, 10);
+	}
+	free(value);
+	if (block_size == 0) {
+		block_size = AFC_CHUNK_DEFAULT_SIZE;
+	} else if (block_size < AFC_CHUNK_MIN_SIZE) {
+		block_size = AFC_CHUNK_MIN_SIZE;
+	} else if (block_size > AFC_CHUNK_MAX_SIZE) {
+		block_size = AFC_CHUNK_MAX_SIZE;
+	}
+	debug_info("starting with a chunk size of %u", block_size);
+
+	afc_lock(client);
+	if (client->chunk_size == 0) {
+		client->chunk_size = block_size;
+		client->chunk_min = block_size;
+	}
+	afc_unlock(client);
+}
+
+/**
+ * Starts a new throughput sample, so idle time between transfers is not
+ * accounted. The client has to be locked.
+ */
+static void afc_chunk_sample_begin(afc_client_t client)
+{
+	client->chunk_sample_start = afc_time_us();
+	client->chunk_sample_bytes = 0;
+	client->chunk_sample_ops = 0;
+}
+
+/**
+ * Accounts a completed request of a transfer and adjusts the chunk size
+ * once a sample is complete. The client has to be locked.
+ */
+static void afc_chunk_sample_add(afc_client_t client, uint32_t bytes)
+{
+	client->chunk_sample_bytes += bytes;
+	if (++client->chunk_sample_ops < AFC_CHUNK_SAMPLE_OPS)
+		return;
+
+	uint64_t now = afc_time_us();
+	uint64_t elapsed = (now > client->chunk_sample_start) ? now - client->chunk_sample_start : 1;
+	uint64_t rate = client->chunk_sample_bytes * 1000000 / elapsed;
+	uint64_t latency = elapsed / client->chunk_sample_ops;
+	uint32_t size = client->chunk_size;
+
+	if (latency > AFC_CHUNK_MAX_LATENCY) {
+		if (size / 2 >= client->chunk_min)
+			size /= 2;
+		client->chunk_settled = 1;
+		client->chunk_best_rate = rate;
+	} else if (!client->chunk_settled) {
+		if (rate > client->chunk_best_rate + client->chunk_best_rate / 10) {
+			client->chunk_best_rate = rate;
+			if (size * 2 <= AFC_CHUNK_MAX_SIZE) {
+				size *= 2;
+			} else {
+				client->chunk_settled = 1;
+			}
+		} else {
+			/* the last increase didn't pay off */
+			if (size / 2 >= client->chunk_min)
+				size /= 2;
+			client->chunk_settled = 1;
+		}
+	} else if (rate < client->chunk_best_rate / 2) {
+		/* conditions changed, probe again from here */
+		client->chunk_settled = 0;
+		client->chunk_best_rate = rate;
+	}
+
+	if (size != client->chunk_size) {
+		debug_info("chunk size %u -> %u at %llu bytes/s, %llu us per request", client->chunk_size, size, (unsigned long long)rate, (unsigned long long)latency);
+		client->chunk_size = size;
+	}
+	client->chunk_sample_start = now;
+	client->chunk_sample_bytes = 0;
+	client->chunk_sample_ops = 0;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_file_read_pipelined(afc_client_t client, uint64_t handle, char *data, uint32_t length, uint32_t chunk_size, uint32_t max_pending, uint32_t *bytes_read)
+{
+	struct readinfo {
+		uint64_t handle;
+		uint64_t size;
+	};
+	uint32_t current_count = 0;
+	uint32_t requested = 0;
+	uint32_t pending = 0;
+	uint32_t bytes_loc = 0;
+	int eof = 0;
+	afc_error_t ret = AFC_E_SUCCESS;
+
+	if (!client || !client->afc_packet || !client->parent || !data || !bytes_read || handle == 0)
+		return AFC_E_INVALID_ARG;
+
+	*bytes_read = 0;
+
+	int adaptive = (chunk_size == 0);
+	if (adaptive)
+		afc_chunk_policy_init(client);
+	if (max_pending == 0)
+		max_pending = AFC_READ_MAX_PENDING;
+
+	debug_info("called for length %u, chunk size %u, max pending %u", length, chunk_size, max_pending);
+
+	afc_lock(client);
+
+	if (adaptive)
+		afc_chunk_sample_begin(client);
+
+	while (current_count < length) {
+		/* keep the pipeline filled */
+		while (!eof && ret == AFC_E_SUCCESS && pending < max_pending && requested < length) {
+			if (adaptive)
+				chunk_size = client->chunk_size;
+			uint32_t size = (length - requested > chunk_size) ? chunk_size : length - requested;
+			struct readinfo* readinfo = (struct readinfo*)(AFC_PACKET_DATA_PTR);
+			readinfo->handle = handle;
+			readinfo->size = htole64(size);
+			if (afc_dispatch_packet(client, AFC_OP_FILE_READ, sizeof(struct readinfo), NULL, 0, &bytes_loc) != AFC_E_SUCCESS || bytes_loc < sizeof(AFCPacket) + sizeof(struct readinfo)) {
+				debug_info("Failed to send read request");
+				ret = AFC_E_NOT_ENOUGH_DATA;
+				break;
+			}
+			requested += size;
+			pending++;
+		}
+
+		if (pending == 0) {
+			break;
+		}
+
+		/* receive the response for the oldest outstanding request */
+		uint64_t packet_num = client->afc_packet->packet_num - pending + 1;
+		afc_error_t err;
+		if (ret != AFC_E_SUCCESS || eof) {
+			/* just drain the remaining responses */
+			err = afc_receive_data_into(client, packet_num, NULL, 0, &bytes_loc);
+		} else {
+			err = afc_receive_data_into(client, packet_num, data + current_count, length - current_count, &bytes_loc);
+		}
+		pending--;
+		if (err != AFC_E_SUCCESS) {
+			if (err == AFC_E_OP_HEADER_INVALID || err == AFC_E_MUX_ERROR || err == AFC_E_NOT_ENOUGH_DATA) {
+				/* the stream is out of sync, don't try to read further responses */
+				ret = err;
+				break;
+			}
+			if (ret == AFC_E_SUCCESS) {
+				ret = err;
+			}
+			continue;
+		}
+		if (ret != AFC_E_SUCCESS || eof) {
+			continue;
+		}
+		if (bytes_loc == 0) {
+			eof = 1;
+		} else {
+			current_count += bytes_loc;
+			if (adaptive)
+				afc_chunk_sample_add(client, bytes_loc);
+		}
+	}
+
+	afc_unlock(client);
+
+	/* the device file position has moved past every requested chunk, so a
+	 * failed chunk must not be hidden behind a short successful read */
+	*bytes_read = current_count;
+	return ret;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_file_write(afc_client_t client, uint64_t handle, const char *data, uint32_t length, uint32_t *bytes_written)
+{
+	uint32_t current_count = 0;
+	uint32_t bytes_loc = 0;
+	afc_error_t ret = AFC_E_SUCCESS;
+
+	if (!client || !client->afc_packet || !client->parent || !bytes_written || (handle == 0))
+		return AFC_E_INVALID_ARG;
+
+	uint32_t data_len = 8;
+
+	afc_lock(client);
+
+	*bytes_written = 0;
+	ret = afc_write_window_error(client, handle);
+	if (ret != AFC_E_SUCCESS) {
+		afc_unlock(client);
+		return ret;
+	}
+
+	debug_info("Write length: %i", length);
+
+	afc_cache_invalidate_handle(client, handle, 0);
+
+	*(uint64_t*)(AFC_PACKET_DATA_PTR) = handle;
+	if (client->write_window > 1) {
+		/* don't wait for the status, it is collected once the window is full */
+		ret = afc_dispatch_packet_nowait(client, AFC_OP_FILE_WRITE, data_len, data, length, &bytes_loc);
+	} else {
+		ret = afc_dispatch_packet(client, AFC_OP_FILE_WRITE, data_len, data, length, &bytes_loc);
+	}
+
+	if (bytes_loc > sizeof(AFCPacket) + 8) {
+		current_count += bytes_loc - (sizeof(AFCPacket) + 8);
+	}
+
+	if (ret != AFC_E_SUCCESS) {
+		afc_unlock(client);
+		*bytes_written = current_count;
+		return AFC_E_SUCCESS;
+	}
+
+	if (client->write_window > 1) {
+		client->write_handles[client->afc_packet->packet_num % AFC_WRITE_MAX_WINDOW] = handle;
+		client->write_pending++;
+		if (bytes_loc < sizeof(AFCPacket) + data_len + length) {
+			debug_info("Failed to send write request");
+			afc_unlock(client);
+			*bytes_written = current_count;
+			return AFC_E_NOT_ENOUGH_DATA;
+		}
+		afc_write_window_drain(client, client->write_window - 1);
+		afc_unlock(client);
+		*bytes_written = current_count;
+		return AFC_E_SUCCESS;
+	}
+
+	ret = afc_receive_data(client, NULL, &bytes_loc);
+	afc_unlock(client);
+	if (ret != AFC_E_SUCCESS) {
+		debug_info("uh oh?");
+	}
+	*bytes_written = current_count;
+	return ret;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_file_set_write_window(afc_client_t client, unsigned int window)
+{
+	if (!client || !client->afc_packet || window > AFC_WRITE_MAX_WINDOW)
+		return AFC_E_INVALID_ARG;
+
+	afc_lock(client);
+	if (client->async && window > 1) {
+		/* the receive thread would race with collecting the status replies */
+		afc_unlock(client);
+		return AFC_E_OBJECT_BUSY;
+	}
+	if (window < client->write_pending) {
+		afc_write_window_drain(client, window);
+	}
+	client->write_window = window;
+	afc_unlock(client);
+
+	return AFC_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_file_close(afc_client_t client, uint64_t handle)
+{
+	uint32_t bytes = 0;
+	afc_error_t ret = AFC_E_UNKNOWN_ERROR;
+
+	if (!client || (handle == 0))
+		return AFC_E_INVALID_ARG;
+
+	uint32_t data_len = 8;
+
+	afc_lock(client);
+
+	debug_info("File handle %i", handle);
+
+	/* Send command */
+	*(uint64_t*)(AFC_PACKET_DATA_PTR) = handle;
+	ret = afc_dispatch_packet(client, AFC_OP_FILE_CLOSE, data_len, NULL, 0, &bytes);
+
+	if (ret != AFC_E_SUCCESS) {
+		afc_unlock(client);
+		return AFC_E_UNKNOWN_ERROR;
+	}
+
+	/* Receive the response */
+	ret = afc_receive_data(client, NULL, &bytes);
+
+	/* the size and modification time are final now */
+	afc_cache_invalidate_handle(client, handle, 1);
+
+	/* report a failed windowed write that was not reported yet */
+	afc_error_t write_err = afc_write_window_error(client, handle);
+	if (ret == AFC_E_SUCCESS)
+		ret = write_err;
+
+	afc_unlock(client);
+
+	return ret;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_file_lock(afc_client_t client, uint64_t handle, afc_lock_op_t operation)
+{
+	uint32_t bytes = 0;
+	struct lockinfo {
+		uint64_t handle;
+		uint64_t op;
+	};
+	afc_error_t ret = AFC_E_UNKNOWN_ERROR;
+
+	if (!client || (handle == 0))
+		return AFC_E_INVALID_ARG;
+
+	afc_lock(client);
+
+	debug_info("file handle %i", handle);
+
+	/* Send command */
+	struct lockinfo* lockinfo = (struct lockinfo*)(AFC_PACKET_DATA_PTR);
+	lockinfo->handle = handle;
+	lockinfo->op = htole64(operation);
+	ret = afc_dispatch_packet(client, AFC_OP_FILE_LOCK, sizeof(struct lockinfo), NULL, 0, &bytes);
+	if (ret != AFC_E_SUCCESS) {
+		afc_unlock(client);
+		debug_info("could not send lock command");
+		return AFC_E_UNKNOWN_ERROR;
+	}
+	/* Receive the response */
+	ret = afc_receive_data(client, NULL, &bytes);
+
+	afc_unlock(client);
+
+	return ret;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_file_seek(afc_client_t client, uint64_t handle, int64_t offset, int whence)
+{
+	uint32_t bytes = 0;
+	struct seekinfo {
+		uint64_t handle;
+		uint64_t whence;
+		int64_t offset;
+	};
+	afc_error_t ret = AFC_E_UNKNOWN_ERROR;
+
+	if (!client || (handle == 0))
+		return AFC_E_INVALID_ARG;
+
+	afc_lock(client);
+
+	/* Send the command */
+	struct seekinfo* seekinfo = (struct seekinfo*)(AFC_PACKET_DATA_PTR);
+	seekinfo->handle = handle;
+	seekinfo->whence = htole64(whence);
+	seekinfo->offset = (int64_t)htole64(offset);
+	ret = afc_dispatch_packet(client, AFC_OP_FILE_SEEK, sizeof(struct seekinfo), NULL, 0, &bytes);
+
+	if (ret != AFC_E_SUCCESS) {
+		afc_unlock(client);
+		return AFC_E_NOT_ENOUGH_DATA;
+	}
+	/* Receive response */
+	ret = afc_receive_data(client, NULL, &bytes);
+
+	afc_unlock(client);
+
+	return ret;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_file_tell(afc_client_t client, uint64_t handle, uint64_t *position)
+{
+	char *buffer = NULL;
+	uint32_t bytes = 0;
+	afc_error_t ret = AFC_E_UNKNOWN_ERROR;
+
+	if (!client || (handle == 0))
+		return AFC_E_INVALID_ARG;
+
+	uint32_t data_len = 8;
+
+	afc_lock(client);
+
+	/* Send the command */
+	*(uint64_t*)(AFC_PACKET_DATA_PTR) = handle;
+	ret = afc_dispatch_packet(client, AFC_OP_FILE_TELL, data_len, NULL, 0, &bytes);
+	if (ret != AFC_E_SUCCESS) {
+		afc_unlock(client);
+		return AFC_E_NOT_ENOUGH_DATA;
+	}
+
+	/* Receive the data */
+	ret = afc_receive_data(client, &buffer, &bytes);
+	if (bytes > 0 && buffer) {
+		/* Get the position */
+		memcpy(position, buffer, sizeof(uint64_t));
+		*position = le64toh(*position);
+	}
+	free(buffer);
+
+	afc_unlock(client);
+
+	return ret;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_file_truncate(afc_client_t client, uint64_t handle, uint64_t newsize)
+{
+	uint32_t bytes = 0;
+	struct truncinfo {
+		uint64_t handle;
+		uint64_t newsize;
+	};
+	afc_error_t ret = AFC_E_UNKNOWN_ERROR;
+
+	if (!client || (handle == 0))
+		return AFC_E_INVALID_ARG;
+
+	afc_lock(client);
+
+	/* Send command */
+	struct truncinfo* truncinfo = (struct truncinfo*)(AFC_PACKET_DATA_PTR);
+	truncinfo->handle = handle;
+	truncinfo->newsize = htole64(newsize);
+	ret = afc_dispatch_packet(client, AFC_OP_FILE_SET_SIZE, sizeof(struct truncinfo), NULL, 0, &bytes);
+
+	if (ret != AFC_E_SUCCESS) {
+		afc_unlock(client);
+		return AFC_E_NOT_ENOUGH_DATA;
+	}
+	/* Receive response */
+	ret = afc_receive_data(client, NULL, &bytes);
+
+	if (ret == AFC_E_SUCCESS)
+		afc_cache_invalidate_handle(client, handle, 0);
+
+	afc_unlock(client);
+
+	return ret;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_truncate(afc_client_t client, const char *path, uint64_t newsize)
+{
+	if (!client || !path || !client->afc_packet || !client->parent)
+		return AFC_E_INVALID_ARG;
+
+	uint32_t bytes = 0;
+	afc_error_t ret = AFC_E_UNKNOWN_ERROR;
+
+	afc_lock(client);
+
+	uint32_t data_len = 8 + (uint32_t)(strlen(path)+1);
+	if (_afc_check_packet_buffer(client, data_len) < 0) {
+		afc_unlock(client);
+		debug_info("Failed to realloc packet buffer");
+		return AFC_E_NO_MEM;
+	}
+
+	/* Send command */
+	*(uint64_t*)(AFC_PACKET_DATA_PTR) = htole64(newsize);
+	memcpy(AFC_PACKET_DATA_PTR + 8, path, data_len-8);
+	ret = afc_dispatch_packet(client, AFC_OP_TRUNCATE, data_len, NULL, 0, &bytes);
 	if (ret != AFC_E_SUCCESS) {
 		afc_unlock(client);
-		return ret;
-	} else if (bytes_loc == 0) {
-		if (input)
-			free(input);
-		afc_unlock(client);
-		*bytes_read = current_count;
-		/* FIXME: check that's actually a success */
-		return ret;
-	} else {
-		if (input) {
-			debug_info("%d", bytes_loc);
-			memcpy(data + current_count, input, (bytes_loc > length) ? length : bytes_loc);
-			free(input);
-			input = NULL;
-			current_count += (bytes_loc > length) ? length : bytes_loc;
-		}
+		return AFC_E_NOT_ENOUGH_DATA;
 	}
+	/* Receive response */
+	ret = afc_receive_data(client, NULL, &bytes);
+
+	if (ret == AFC_E_SUCCESS)
+		afc_cache_invalidate(client, path, 0);
+
 	afc_unlock(client);
-	*bytes_read = current_count;
+
 	return ret;
 }
 
-LIBIMOBILEDEVICE_API afc_error_t afc_file_write(afc_client_t client, uint64_t handle, const char *data, uint32_t length, uint32_t *bytes_written)
+LIBIMOBILEDEVICE_API afc_error_t afc_make_link(afc_client_t client, afc_link_type_t linktype, const char *target, const char *linkname)
 {
-	uint32_t current_count = 0;
-	uint32_t bytes_loc = 0;
-	afc_error_t ret = AFC_E_SUCCESS;
-
-	if (!client || !client->afc_packet || !client->parent || !bytes_written || (handle == 0))
+	if (!client || !target || !linkname || !client->afc_packet || !client->parent)
 		return AFC_E_INVALID_ARG;
 
-	uint32_t data_len = 8;
+	uint32_t bytes = 0;
+	uint64_t type = htole64(linktype);
+	afc_error_t ret = AFC_E_UNKNOWN_ERROR;
 
-	afc_lock(client);
+	size_t target_len = strlen(target);
+	size_t link_len = strlen(linkname);
 
-	debug_info("Write length: %i", length);
+	afc_lock(client);
 
-	*(uint64_t*)(AFC_PACKET_DATA_PTR) = handle;
-	ret = afc_dispatch_packet(client, AFC_OP_FILE_WRITE, data_len, data, length, &bytes_loc);
+	uint32_t data_len = 8 + target_len + 1 + link_len + 1;
+	if (_afc_check_packet_buffer(client, data_len) < 0) {
+		afc_unlock(client);
+		debug_info("Failed to realloc packet buffer");
+		return AFC_E_NO_MEM;
+	}
 
-	current_count += bytes_loc - (sizeof(AFCPacket) + 8);
+	debug_info("link type: %lld", type);
+	debug_info("target: %s, length:%d", target, target_len);
+	debug_info("linkname: %s, length:%d", linkname, link_len);
 
+	/* Send command */
+	*(uint64_t*)(AFC_PACKET_DATA_PTR) = htole64(linktype);
+	memcpy(AFC_PACKET_DATA_PTR + 8, target, target_len + 1);
+	memcpy(AFC_PACKET_DATA_PTR + 8 + target_len + 1, linkname, link_len + 1);
+	ret = afc_dispatch_packet(client, AFC_OP_MAKE_LINK, data_len, NULL, 0, &bytes);
 	if (ret != AFC_E_SUCCESS) {
 		afc_unlock(client);
-		*bytes_written = current_count;
-		return AFC_E_SUCCESS;
+		return AFC_E_NOT_ENOUGH_DATA;
 	}
+	/* Receive response */
+	ret = afc_receive_data(client, NULL, &bytes);
+
+	if (ret == AFC_E_SUCCESS)
+		afc_cache_invalidate(client, linkname, AFC_CACHE_INVALIDATE_PARENT);
 
-	ret = afc_receive_data(client, NULL, &bytes_loc);
 	afc_unlock(client);
-	if (ret != AFC_E_SUCCESS) {
-		debug_info("uh oh?");
-	}
-	*bytes_written = current_count;
+
 	return ret;
 }
 
-LIBIMOBILEDEVICE_API afc_error_t afc_file_close(afc_client_t client, uint64_t handle)
+LIBIMOBILEDEVICE_API afc_error_t afc_set_file_time(afc_client_t client, const char *path, uint64_t mtime)
 {
-	uint32_t bytes = 0;
-	afc_error_t ret = AFC_E_UNKNOWN_ERROR;
-
-	if (!client || (handle == 0))
+	if (!client || !path || !client->afc_packet || !client->parent)
 		return AFC_E_INVALID_ARG;
 
-	uint32_t data_len = 8;
+	uint32_t bytes = 0;
+	afc_error_t ret = AFC_E_UNKNOWN_ERROR;
 
 	afc_lock(client);
 
-	debug_info("File handle %i", handle);
+	uint32_t data_len = 8 + strlen(path) + 1;
+	if (_afc_check_packet_buffer(client, data_len) < 0) {
+		afc_unlock(client);
+		debug_info("Failed to realloc packet buffer");
+		return AFC_E_NO_MEM;
+	}
 
 	/* Send command */
-	*(uint64_t*)(AFC_PACKET_DATA_PTR) = handle;
-	ret = afc_dispatch_packet(client, AFC_OP_FILE_CLOSE, data_len, NULL, 0, &bytes);
-
+	*(uint64_t*)(AFC_PACKET_DATA_PTR) = htole64(mtime);
+	memcpy(AFC_PACKET_DATA_PTR + 8, path, data_len-8);
+	ret = afc_dispatch_packet(client, AFC_OP_SET_FILE_MOD_TIME, data_len, NULL, 0, &bytes);
 	if (ret != AFC_E_SUCCESS) {
 		afc_unlock(client);
-		return AFC_E_UNKNOWN_ERROR;
+		return AFC_E_NOT_ENOUGH_DATA;
 	}
-
-	/* Receive the response */
+	/* Receive response */
 	ret = afc_receive_data(client, NULL, &bytes);
 
+	if (ret == AFC_E_SUCCESS)
+		afc_cache_invalidate(client, path, 0);
+
 	afc_unlock(client);
 
 	return ret;
 }
 
-LIBIMOBILEDEVICE_API afc_error_t afc_file_lock(afc_client_t client, uint64_t handle, afc_lock_op_t operation)
+LIBIMOBILEDEVICE_API afc_error_t afc_remove_path_and_contents(afc_client_t client, const char *path)
 {
 	uint32_t bytes = 0;
-	struct lockinfo {
-		uint64_t handle;
-		uint64_t op;
-	};
 	afc_error_t ret = AFC_E_UNKNOWN_ERROR;
 
-	if (!client || (handle == 0))
+	if (!client || !path || !client->afc_packet || !client->parent)
 		return AFC_E_INVALID_ARG;
 
 	afc_lock(client);
 
-	debug_info("file handle %i", handle);
+	uint32_t data_len = strlen(path) + 1;
+	if (_afc_check_packet_buffer(client, data_len) < 0) {
+		afc_unlock(client);
+		debug_info("Failed to realloc packet buffer");
+		return AFC_E_NO_MEM;
+	}
 
 	/* Send command */
-	struct lockinfo* lockinfo = (struct lockinfo*)(AFC_PACKET_DATA_PTR);
-	lockinfo->handle = handle;
-	lockinfo->op = htole64(operation);
-	ret = afc_dispatch_packet(client, AFC_OP_FILE_LOCK, sizeof(struct lockinfo), NULL, 0, &bytes);
+	memcpy(AFC_PACKET_DATA_PTR, path, data_len);
+	ret = afc_dispatch_packet(client, AFC_OP_REMOVE_PATH_AND_CONTENTS, data_len, NULL, 0, &bytes);
 	if (ret != AFC_E_SUCCESS) {
 		afc_unlock(client);
-		debug_info("could not send lock command");
-		return AFC_E_UNKNOWN_ERROR;
+		return AFC_E_NOT_ENOUGH_DATA;
 	}
-	/* Receive the response */
+	/* Receive response */
 	ret = afc_receive_data(client, NULL, &bytes);
 
+	if (ret == AFC_E_SUCCESS)
+		afc_cache_invalidate(client, path, AFC_CACHE_INVALIDATE_PARENT | AFC_CACHE_INVALIDATE_TREE);
+
+	afc_unlock(client);
+
+	return ret;
+}
+
+static uint64_t afc_time_ms(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+struct afc_remove_state {
+	afc_remove_progress_t progress;
+	uint64_t start_time;
+	afc_remove_progress_cb_t callback;
+	void *user_data;
+	/* collected by the walk, removed afterwards */
+	char **files;
+	uint64_t *file_sizes;
+	unsigned int num_files;
+	char **dirs;
+	unsigned int num_dirs;
+	unsigned int capacity_files;
+	unsigned int capacity_dirs;
+	int no_mem;
+};
+
+static int afc_remove_report(struct afc_remove_state *state)
+{
+	state->progress.elapsed_ms = afc_time_ms() - state->start_time;
+	if (state->callback && state->callback(&state->progress, state->user_data) != 0) {
+		return -1;
+	}
+	return 0;
+}
+
+static int afc_remove_collect_cb(const char *path, const afc_stat_t *st, void *user_data)
+{
+	struct afc_remove_state *state = (struct afc_remove_state*)user_data;
+	char *copy = strdup(path);
+
+	if (!copy) {
+		state->no_mem = 1;
+		return -1;
+	}
+	if (st->type == AFC_FILE_TYPE_DIRECTORY) {
+		if (state->num_dirs == state->capacity_dirs) {
+			unsigned int capacity = (state->capacity_dirs) ? state->capacity_dirs * 2 : 256;
+			char **dirs = (char**)realloc(state->dirs, sizeof(char*) * capacity);
+			if (!dirs) {
+				free(copy);
+				state->no_mem = 1;
+				return -1;
+			}
+			state->dirs = dirs;
+			state->capacity_dirs = capacity;
+		}
+		state->dirs[state->num_dirs++] = copy;
+	} else {
+		if (state->num_files == state->capacity_files) {
+			unsigned int capacity = (state->capacity_files) ? state->capacity_files * 2 : 1024;
+			char **files = (char**)realloc(state->files, sizeof(char*) * capacity);
+			uint64_t *sizes = (files) ? (uint64_t*)realloc(state->file_sizes, sizeof(uint64_t) * capacity) : NULL;
+			if (files)
+				state->files = files;
+			if (!files || !sizes) {
+				free(copy);
+				state->no_mem = 1;
+				return -1;
+			}
+			state->file_sizes = sizes;
+			state->capacity_files = capacity;
+		}
+		state->file_sizes[state->num_files] = st->size;
+		state->files[state->num_files++] = copy;
+	}
+
+	return 0;
+}
+
+/**
+ * Removes the given paths with up to AFC_REMOVE_MAX_PENDING RemovePath
+ * requests in flight. The paths are removed in the given order, or in
+ * reverse order if reverse is set.
+ */
+static afc_error_t afc_remove_paths_pipelined(afc_client_t client, char **paths, const uint64_t *sizes, unsigned int count, int reverse, struct afc_remove_state *state)
+{
+	unsigned int sent = 0;
+	unsigned int received = 0;
+	unsigned int since_report = 0;
+	afc_error_t ret = AFC_E_SUCCESS;
+	int cancel = 0;
+
+	while (received < count) {
+		afc_lock(client);
+		while (!cancel && ret == AFC_E_SUCCESS && sent < count && sent - received < AFC_REMOVE_MAX_PENDING) {
+			const char *path = paths[(reverse) ? count - 1 - sent : sent];
+			uint32_t data_len = (uint32_t)strlen(path)+1;
+			uint32_t bytes = 0;
+			if (_afc_check_packet_buffer(client, data_len) < 0) {
+				debug_info("Failed to realloc packet buffer");
+				ret = AFC_E_NO_MEM;
+				break;
+			}
+			memcpy(AFC_PACKET_DATA_PTR, path, data_len);
+			if (afc_dispatch_packet(client, AFC_OP_REMOVE_PATH, data_len, NULL, 0, &bytes) != AFC_E_SUCCESS || bytes < sizeof(AFCPacket) + data_len) {
+				debug_info("Failed to send remove request for %s", path);
+				ret = AFC_E_NOT_ENOUGH_DATA;
+				break;
+			}
+			sent++;
+		}
+		if (received == sent) {
+			afc_unlock(client);
+			break;
+		}
+
+		unsigned int idx = (reverse) ? count - 1 - received : received;
+		uint32_t bytes = 0;
+		afc_error_t err = afc_receive_response(client, client->afc_packet->packet_num - (sent - received) + 1, NULL, &bytes);
+		afc_unlock(client);
+		received++;
+		if (err == AFC_E_OP_HEADER_INVALID || err == AFC_E_MUX_ERROR || err == AFC_E_NOT_ENOUGH_DATA) {
+			/* the stream is out of sync, don't try to read further replies */
+			return err;
+		}
+		if (err == AFC_E_SUCCESS) {
+			if (sizes) {
+				state->progress.files_removed++;
+				state->progress.bytes_removed += sizes[idx];
+			} else {
+				state->progress.dirs_removed++;
+			}
+		} else if (err != AFC_E_OBJECT_NOT_FOUND) {
+			debug_info("Could not remove %s, error %d", paths[idx], err);
+			state->progress.errors++;
+			if (state->progress.first_error == AFC_E_SUCCESS)
+				state->progress.first_error = err;
+		}
+
+		if (!cancel && ++since_report >= AFC_REMOVE_REPORT_INTERVAL) {
+			since_report = 0;
+			if (afc_remove_report(state) < 0) {
+				/* stop sending, just collect the outstanding replies */
+				cancel = 1;
+				ret = AFC_E_OP_INTERRUPTED;
+			}
+		}
+	}
+
+	return ret;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_remove_tree(afc_client_t client, const char *path, afc_remove_progress_cb_t callback, void *user_data)
+{
+	struct afc_remove_state state;
+	afc_error_t ret;
+	unsigned int i;
+
+	if (!client || !path || !client->afc_packet || !client->parent)
+		return AFC_E_INVALID_ARG;
+
+	memset(&state, '\0', sizeof(state));
+	state.start_time = afc_time_ms();
+	state.callback = callback;
+	state.user_data = user_data;
+	state.progress.first_error = AFC_E_SUCCESS;
+
+	/* let the device do the work if it can */
+	ret = afc_remove_path_and_contents(client, path);
+	if (ret != AFC_E_OP_NOT_SUPPORTED && ret != AFC_E_UNKNOWN_PACKET_TYPE) {
+		state.progress.server_side = 1;
+		if (ret != AFC_E_SUCCESS && ret != AFC_E_OBJECT_NOT_FOUND) {
+			state.progress.errors = 1;
+			state.progress.first_error = ret;
+		}
+		afc_remove_report(&state);
+		return ret;
+	}
+
+	debug_info("Device does not support recursive removal, removing %s entry by entry", path);
+
+	ret = afc_walk(client, path, 0, afc_remove_collect_cb, &state);
+	if (ret == AFC_E_SUCCESS && state.no_mem)
+		ret = AFC_E_NO_MEM;
+
+	/* files first, then directories deepest first, which is the reverse
+	 * of the breadth first order they were found in */
+	if (ret == AFC_E_SUCCESS)
+		ret = afc_remove_paths_pipelined(client, state.files, state.file_sizes, state.num_files, 0, &state);
+	if (ret == AFC_E_SUCCESS)
+		ret = afc_remove_paths_pipelined(client, state.dirs, NULL, state.num_dirs, 1, &state);
+
+	if (ret == AFC_E_SUCCESS) {
+		if (afc_remove_report(&state) < 0)
+			ret = AFC_E_OP_INTERRUPTED;
+		else
+			ret = state.progress.first_error;
+	}
+
+	/* entries were removed below the path even if it failed halfway */
+	afc_lock(client);
+	afc_cache_invalidate(client, path, AFC_CACHE_INVALIDATE_PARENT | AFC_CACHE_INVALIDATE_TREE);
 	afc_unlock(client);
 
-	return ret;
+	for (i = 0; i < state.num_files; i++)
+		free(state.files[i]);
+	free(state.files);
+	free(state.file_sizes);
+	for (i = 0; i < state.num_dirs; i++)
+		free(state.dirs[i]);
+	free(state.dirs);
+
+	return ret;
+}
+
+/**
+ * Writes the whole buffer to the host file at the given offset.
+ *
+ * @return 0 on success or -1 on error.
+ */
+static int afc_host_pwrite(int fd, const char *data, uint32_t length, uint64_t offset)
+{
+	uint32_t written = 0;
+
+#ifdef WIN32
+	if (lseek(fd, (off_t)offset, SEEK_SET) < 0)
+		return -1;
+#endif
+	while (written < length) {
+#ifdef WIN32
+		ssize_t w = write(fd, data + written, length - written);
+#else
+		ssize_t w = pwrite(fd, data + written, length - written, (off_t)(offset + written));
+#endif
+		if (w <= 0)
+			return -1;
+		written += (uint32_t)w;
+	}
+
+	return 0;
+}
+
+/**
+ * Reads from the host file at the given offset.
+ *
+ * @return The number of bytes read, or -1 on error.
+ */
+static int64_t afc_host_pread(int fd, char *data, uint32_t length, uint64_t offset)
+{
+	uint32_t got = 0;
+
+#ifdef WIN32
+	if (lseek(fd, (off_t)offset, SEEK_SET) < 0)
+		return -1;
+#endif
+	while (got < length) {
+#ifdef WIN32
+		ssize_t r = read(fd, data + got, length - got);
+#else
+		ssize_t r = pread(fd, data + got, length - got, (off_t)(offset + got));
+#endif
+		if (r < 0)
+			return -1;
+		if (r == 0)
+			break;
+		got += (uint32_t)r;
+	}
+
+	return got;
+}
+
+/**
+ * Compares the blocks in front of the resume offset on the device and on
+ * the host and moves the offset back past blocks that differ, so that a
+ * corrupted tail of an interrupted transfer gets copied again. If the data
+ * keeps differing the transfer starts over.
+ *
+ * @param handle A handle of the device file opened for reading.
+ *
+ * @return The offset to resume from.
+ */
+static uint64_t afc_copy_verify_offset(afc_client_t client, uint64_t handle, int fd, uint64_t offset)
+{
+	char *device_block = (char*)malloc(AFC_COPY_VERIFY_BLOCK_SIZE);
+	char *host_block = (char*)malloc(AFC_COPY_VERIFY_BLOCK_SIZE);
+	int verified = 0;
+	int i;
+
+	for (i = 0; device_block && host_block && offset > 0 && i < AFC_COPY_VERIFY_MAX_BLOCKS; i++) {
+		uint32_t length = (offset > AFC_COPY_VERIFY_BLOCK_SIZE) ? AFC_COPY_VERIFY_BLOCK_SIZE : (uint32_t)offset;
+		uint64_t start = offset - length;
+		uint32_t device_len = 0;
+
+		if (afc_file_seek(client, handle, (int64_t)start, SEEK_SET) != AFC_E_SUCCESS
+		    || afc_file_read_pipelined(client, handle, device_block, length, 0, 0, &device_len) != AFC_E_SUCCESS) {
+			break;
+		}
+		if (device_len == length && afc_host_pread(fd, host_block, length, start) == length
+		    && memcmp(device_block, host_block, length) == 0) {
+			verified = 1;
+			break;
+		}
+		debug_info("Data in front of offset %llu differs, copying it again", (unsigned long long)offset);
+		offset = start;
+	}
+	free(device_block);
+	free(host_block);
+
+	return (verified) ? offset : 0;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_copy_to_host(afc_client_t client, const char *device_path, int fd, uint64_t offset, uint32_t flags, uint64_t *bytes_copied)
+{
+	afc_stat_t st;
+	uint64_t handle = 0;
+	uint64_t position = offset;
+	char *buf = NULL;
+	afc_error_t ret;
+
+	if (!client || !device_path || fd < 0)
+		return AFC_E_INVALID_ARG;
+
+	if (bytes_copied)
+		*bytes_copied = 0;
+
+	ret = afc_get_file_info_struct(client, device_path, &st, NULL);
+	if (ret != AFC_E_SUCCESS)
+		return ret;
+	if (st.type != AFC_FILE_TYPE_REGULAR)
+		return AFC_E_INVALID_ARG;
+
+	ret = afc_file_open(client, device_path, AFC_FOPEN_RDONLY, &handle);
+	if (ret != AFC_E_SUCCESS)
+		return ret;
+
+	if (flags & AFC_COPY_RESUME) {
+		/* continue where a previous attempt stopped */
+		struct stat host_st;
+		offset = (fstat(fd, &host_st) == 0 && host_st.st_size > 0) ? (uint64_t)host_st.st_size : 0;
+	}
+	if (offset > st.size)
+		offset = st.size;
+	if (offset > 0) {
+		offset = afc_copy_verify_offset(client, handle, fd, offset);
+	}
+	position = offset;
+
+	ret = afc_file_seek(client, handle, (int64_t)position, SEEK_SET);
+
+	if (ret == AFC_E_SUCCESS && position < st.size) {
+		buf = (char*)malloc(AFC_COPY_BUFFER_SIZE);
+		if (!buf)
+			ret = AFC_E_NO_MEM;
+	}
+
+	while (ret == AFC_E_SUCCESS && position < st.size) {
+		uint64_t remaining = st.size - position;
+		uint32_t amount = (remaining > AFC_COPY_BUFFER_SIZE) ? AFC_COPY_BUFFER_SIZE : (uint32_t)remaining;
+		uint32_t bytes_read = 0;
+
+		ret = afc_file_read_pipelined(client, handle, buf, amount, 0, AFC_COPY_MAX_PENDING, &bytes_read);
+		/* keep the data delivered before a failed chunk, so a resumed copy
+		 * continues at the right offset */
+		if (bytes_read > 0 && afc_host_pwrite(fd, buf, bytes_read, position) < 0) {
+			debug_info("Could not write to host file");
+			ret = AFC_E_IO_ERROR;
+			break;
+		}
+		position += bytes_read;
+		if (ret != AFC_E_SUCCESS || bytes_read == 0)
+			break;
+	}
+	free(buf);
+	afc_file_close(client, handle);
+
+	if (bytes_copied)
+		*bytes_copied = (position > offset) ? position - offset : 0;
+
+	if (ret != AFC_E_SUCCESS)
+		return ret;
+
+	if (position < st.size) {
+		debug_info("%s got shorter while copying", device_path);
+		return AFC_E_IO_ERROR;
+	}
+
+	/* drop stale data of a previous, larger version of the file */
+	if (ftruncate(fd, (off_t)st.size) < 0) {
+		debug_info("Could not truncate host file");
+	}
+
+#ifndef WIN32
+	if (flags & AFC_COPY_PRESERVE_MTIME) {
+		struct timeval times[2];
+		times[0].tv_sec = times[1].tv_sec = (time_t)(st.mtime / 1000000000);
+		times[0].tv_usec = times[1].tv_usec = (suseconds_t)((st.mtime % 1000000000) / 1000);
+		if (futimes(fd, times) < 0) {
+			debug_info("Could not set modification time of host file");
+		}
+	}
+#endif
+
+	return AFC_E_SUCCESS;
 }
 
-LIBIMOBILEDEVICE_API afc_error_t afc_file_seek(afc_client_t client, uint64_t handle, int64_t offset, int whence)
+/**
+ * Sends write requests for the given data in chunks of the adaptive chunk
+ * size, keeping up to AFC_COPY_MAX_PENDING of them in flight before
+ * collecting the replies.
+ */
+static afc_error_t afc_file_write_pipelined(afc_client_t client, uint64_t handle, const char *data, uint64_t length)
 {
-	uint32_t bytes = 0;
-	struct seekinfo {
-		uint64_t handle;
-		uint64_t whence;
-		int64_t offset;
-	};
-	afc_error_t ret = AFC_E_UNKNOWN_ERROR;
+	uint64_t sent = 0;
+	unsigned int pending = 0;
+	uint32_t sizes[AFC_COPY_MAX_PENDING];
+	afc_error_t ret = AFC_E_SUCCESS;
 
-	if (!client || (handle == 0))
-		return AFC_E_INVALID_ARG;
+	afc_chunk_policy_init(client);
 
 	afc_lock(client);
 
-	/* Send the command */
-	struct seekinfo* seekinfo = (struct seekinfo*)(AFC_PACKET_DATA_PTR);
-	seekinfo->handle = handle;
-	seekinfo->whence = htole64(whence);
-	seekinfo->offset = (int64_t)htole64(offset);
-	ret = afc_dispatch_packet(client, AFC_OP_FILE_SEEK, sizeof(struct seekinfo), NULL, 0, &bytes);
+	afc_chunk_sample_begin(client);
+
+	while (sent < length || pending > 0) {
+		while (ret == AFC_E_SUCCESS && sent < length && pending < AFC_COPY_MAX_PENDING) {
+			uint32_t chunk_size = client->chunk_size;
+			uint32_t amount = (length - sent > chunk_size) ? chunk_size : (uint32_t)(length - sent);
+			uint32_t bytes = 0;
+			*(uint64_t*)(AFC_PACKET_DATA_PTR) = handle;
+			if (afc_dispatch_packet(client, AFC_OP_FILE_WRITE, 8, data + sent, amount, &bytes) != AFC_E_SUCCESS || bytes < sizeof(AFCPacket) + 8 + amount) {
+				debug_info("Failed to send write request");
+				ret = AFC_E_NOT_ENOUGH_DATA;
+				break;
+			}
+			sizes[client->afc_packet->packet_num % AFC_COPY_MAX_PENDING] = amount;
+			sent += amount;
+			pending++;
+		}
+		if (pending == 0)
+			break;
 
-	if (ret != AFC_E_SUCCESS) {
-		afc_unlock(client);
-		return AFC_E_NOT_ENOUGH_DATA;
+		uint32_t bytes = 0;
+		uint64_t packet_num = client->afc_packet->packet_num - pending + 1;
+		afc_error_t err = afc_receive_response(client, packet_num, NULL, &bytes);
+		pending--;
+		if (err == AFC_E_SUCCESS) {
+			afc_chunk_sample_add(client, sizes[packet_num % AFC_COPY_MAX_PENDING]);
+		} else if (ret == AFC_E_SUCCESS) {
+			ret = err;
+		}
+		if (err == AFC_E_OP_HEADER_INVALID || err == AFC_E_MUX_ERROR || err == AFC_E_NOT_ENOUGH_DATA) {
+			/* the stream is out of sync, don't try to read further replies */
+			break;
+		}
 	}
-	/* Receive response */
-	ret = afc_receive_data(client, NULL, &bytes);
 
 	afc_unlock(client);
 
 	return ret;
 }
 
-LIBIMOBILEDEVICE_API afc_error_t afc_file_tell(afc_client_t client, uint64_t handle, uint64_t *position)
+LIBIMOBILEDEVICE_API afc_error_t afc_copy_from_host(afc_client_t client, int fd, const char *device_path, uint64_t offset, uint32_t flags, uint64_t *bytes_copied)
 {
-	char *buffer = NULL;
-	uint32_t bytes = 0;
-	afc_error_t ret = AFC_E_UNKNOWN_ERROR;
+	struct stat st;
+	uint64_t handle = 0;
+	uint64_t position = offset;
+	uint64_t size;
+	afc_error_t ret;
 
-	if (!client || (handle == 0))
+	if (!client || !device_path || fd < 0)
 		return AFC_E_INVALID_ARG;
 
-	uint32_t data_len = 8;
+	if (bytes_copied)
+		*bytes_copied = 0;
 
-	afc_lock(client);
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+		debug_info("Host file is not a regular file");
+		return AFC_E_INVALID_ARG;
+	}
+	size = (uint64_t)st.st_size;
 
-	/* Send the command */
-	*(uint64_t*)(AFC_PACKET_DATA_PTR) = handle;
-	ret = afc_dispatch_packet(client, AFC_OP_FILE_TELL, data_len, NULL, 0, &bytes);
-	if (ret != AFC_E_SUCCESS) {
-		afc_unlock(client);
-		return AFC_E_NOT_ENOUGH_DATA;
+	if (flags & AFC_COPY_RESUME) {
+		/* continue where a previous attempt stopped */
+		afc_stat_t device_st;
+		offset = (afc_get_file_info_struct(client, device_path, &device_st, NULL) == AFC_E_SUCCESS && device_st.type == AFC_FILE_TYPE_REGULAR) ? device_st.size : 0;
 	}
+	if (offset > size)
+		offset = size;
 
-	/* Receive the data */
-	ret = afc_receive_data(client, &buffer, &bytes);
-	if (bytes > 0 && buffer) {
-		/* Get the position */
-		memcpy(position, buffer, sizeof(uint64_t));
-		*position = le64toh(*position);
+	/* only truncate the device file if not resuming */
+	int resuming = (offset > 0);
+	ret = afc_file_open(client, device_path, (resuming) ? AFC_FOPEN_RW : AFC_FOPEN_WRONLY, &handle);
+	if (ret != AFC_E_SUCCESS)
+		return ret;
+
+	if (offset > 0) {
+		offset = afc_copy_verify_offset(client, handle, fd, offset);
 	}
-	free(buffer);
+	position = offset;
+
+	ret = afc_file_seek(client, handle, (int64_t)position, SEEK_SET);
+
+#ifdef HAVE_MMAP
+	if (ret == AFC_E_SUCCESS && position < size) {
+		/* send straight from the mapped file, mapped from a page boundary */
+		uint64_t map_offset = position & ~((uint64_t)sysconf(_SC_PAGESIZE) - 1);
+		size_t map_size = (size_t)(size - map_offset);
+		char *map = (char*)mmap(NULL, map_size, PROT_READ, MAP_SHARED, fd, (off_t)map_offset);
+		if (map == MAP_FAILED) {
+			debug_info("Could not map host file");
+			ret = AFC_E_IO_ERROR;
+		} else {
+#ifdef MADV_SEQUENTIAL
+			madvise(map, map_size, MADV_SEQUENTIAL);
+#endif
+			ret = afc_file_write_pipelined(client, handle, map + (position - map_offset), size - position);
+			if (ret == AFC_E_SUCCESS)
+				position = size;
+			munmap(map, map_size);
+		}
+	}
+#else
+	char *buf = NULL;
+	if (ret == AFC_E_SUCCESS && position < size) {
+		buf = (char*)malloc(AFC_COPY_BUFFER_SIZE);
+		if (!buf)
+			ret = AFC_E_NO_MEM;
+		else if (lseek(fd, (off_t)position, SEEK_SET) < 0)
+			ret = AFC_E_IO_ERROR;
+	}
+	while (ret == AFC_E_SUCCESS && position < size) {
+		uint64_t remaining = size - position;
+		uint32_t amount = (remaining > AFC_COPY_BUFFER_SIZE) ? AFC_COPY_BUFFER_SIZE : (uint32_t)remaining;
+		uint32_t got = 0;
+		while (got < amount) {
+			ssize_t r = read(fd, buf + got, amount - got);
+			if (r <= 0)
+				break;
+			got += (uint32_t)r;
+		}
+		if (got == 0) {
+			ret = AFC_E_IO_ERROR;
+			break;
+		}
+		ret = afc_file_write_pipelined(client, handle, buf, got);
+		if (ret == AFC_E_SUCCESS)
+			position += got;
+	}
+	free(buf);
+#endif
 
-	afc_unlock(client);
+	if (ret == AFC_E_SUCCESS && resuming) {
+		/* drop stale data of a previous, larger version of the file */
+		ret = afc_file_truncate(client, handle, size);
+	}
+	afc_file_close(client, handle);
+
+	if (bytes_copied)
+		*bytes_copied = (position > offset) ? position - offset : 0;
+
+	if (ret != AFC_E_SUCCESS)
+		return ret;
+
+	if (flags & AFC_COPY_PRESERVE_MTIME) {
+#ifdef WIN32
+		uint64_t mtime = (uint64_t)st.st_mtime * 1000000000;
+#elif defined(__APPLE__)
+		uint64_t mtime = (uint64_t)st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+		uint64_t mtime = (uint64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+		ret = afc_set_file_time(client, device_path, mtime);
+		if (ret != AFC_E_SUCCESS) {
+			debug_info("Could not set modification time of %s, error %d", device_path, ret);
+		}
+	}
 
 	return ret;
 }
 
-LIBIMOBILEDEVICE_API afc_error_t afc_file_truncate(afc_client_t client, uint64_t handle, uint64_t newsize)
+/**
+ * Completes all operations still in flight with the given error. The
+ * asynchronous client has to be locked; it is unlocked while the callbacks
+ * run.
+ */
+static void afc_async_fail_pending(afc_async_t async, afc_error_t error)
 {
-	uint32_t bytes = 0;
-	struct truncinfo {
-		uint64_t handle;
-		uint64_t newsize;
-	};
-	afc_error_t ret = AFC_E_UNKNOWN_ERROR;
-
-	if (!client || (handle == 0))
-		return AFC_E_INVALID_ARG;
+	while (async->pending) {
+		struct afc_async_op *op = async->pending;
+		async->pending = op->next;
+		if (!async->pending)
+			async->pending_last = NULL;
+		mutex_unlock(&async->mutex);
+		op->callback(error, NULL, 0, op->user_data);
+		free(op);
+		mutex_lock(&async->mutex);
+	}
+}
 
-	afc_lock(client);
+static void* afc_async_receive_thread(void *arg)
+{
+	afc_async_t async = (afc_async_t)arg;
 
-	/* Send command */
-	struct truncinfo* truncinfo = (struct truncinfo*)(AFC_PACKET_DATA_PTR);
-	truncinfo->handle = handle;
-	truncinfo->newsize = htole64(newsize);
-	ret = afc_dispatch_packet(client, AFC_OP_FILE_SET_SIZE, sizeof(struct truncinfo), NULL, 0, &bytes);
+	mutex_lock(&async->mutex);
+	while (1) {
+		while (!async->pending && !async->quit) {
+			cond_wait(&async->cond, &async->mutex);
+		}
+		if (!async->pending)
+			break;
 
-	if (ret != AFC_E_SUCCESS) {
-		afc_unlock(client);
-		return AFC_E_NOT_ENOUGH_DATA;
+		/* the device answers in order, so the next response belongs to
+		 * the oldest operation in flight */
+		struct afc_async_op *op = async->pending;
+		mutex_unlock(&async->mutex);
+
+		char *data = NULL;
+		uint32_t bytes = 0;
+		afc_error_t ret = afc_receive_response(async->client, op->packet_num, &data, &bytes);
+
+		mutex_lock(&async->mutex);
+		async->pending = op->next;
+		if (!async->pending)
+			async->pending_last = NULL;
+		mutex_unlock(&async->mutex);
+
+		if (ret == AFC_E_SUCCESS && op->operation == AFC_OP_GET_FILE_INFO) {
+			afc_stat_t st;
+			afc_parse_stat(data, bytes, &st, NULL);
+			op->callback(ret, (const char*)&st, sizeof(afc_stat_t), op->user_data);
+		} else {
+			op->callback(ret, data, bytes, op->user_data);
+		}
+		free(data);
+		free(op);
+
+		mutex_lock(&async->mutex);
+		if (ret == AFC_E_MUX_ERROR || ret == AFC_E_NOT_ENOUGH_DATA || ret == AFC_E_OP_HEADER_INVALID) {
+			/* the connection can't be used anymore */
+			debug_info("receiving failed with error %d, failing all pending operations", ret);
+			async->error = ret;
+			afc_async_fail_pending(async, ret);
+		}
 	}
-	/* Receive response */
-	ret = afc_receive_data(client, NULL, &bytes);
-
-	afc_unlock(client);
+	mutex_unlock(&async->mutex);
 
-	return ret;
+	return NULL;
 }
 
-LIBIMOBILEDEVICE_API afc_error_t afc_truncate(afc_client_t client, const char *path, uint64_t newsize)
+LIBIMOBILEDEVICE_API afc_error_t afc_async_new(afc_client_t client, afc_async_t *async)
 {
-	if (!client || !path || !client->afc_packet || !client->parent)
+	if (!client || !client->parent || !client->afc_packet || !async)
 		return AFC_E_INVALID_ARG;
 
-	uint32_t bytes = 0;
-	afc_error_t ret = AFC_E_UNKNOWN_ERROR;
+	if (client->parent->connection->ssl_data) {
+		/* the receive thread reads without the client lock, which would
+		 * race SSL_read against the SSL_write of the submitting threads */
+		debug_info("asynchronous clients are not supported over SSL");
+		return AFC_E_OP_NOT_SUPPORTED;
+	}
 
-	afc_lock(client);
+	afc_async_t async_loc = (afc_async_t)calloc(1, sizeof(struct afc_async_private));
+	if (!async_loc)
+		return AFC_E_NO_MEM;
 
-	uint32_t data_len = 8 + (uint32_t)(strlen(path)+1);
-	if (_afc_check_packet_buffer(client, data_len) < 0) {
+	async_loc->client = client;
+	async_loc->error = AFC_E_SUCCESS;
+	mutex_init(&async_loc->mutex);
+	cond_init(&async_loc->cond);
+
+	afc_lock(client);
+	if (client->async || client->write_window > 1) {
+		/* only one receiver of the responses at a time */
 		afc_unlock(client);
-		debug_info("Failed to realloc packet buffer");
-		return AFC_E_NO_MEM;
+		cond_destroy(&async_loc->cond);
+		mutex_destroy(&async_loc->mutex);
+		free(async_loc);
+		return AFC_E_OBJECT_BUSY;
+	}
+	if (client->write_pending > 0) {
+		afc_write_window_drain(client, 0);
 	}
+	client->async = async_loc;
+	afc_unlock(client);
 
-	/* Send command */
-	*(uint64_t*)(AFC_PACKET_DATA_PTR) = htole64(newsize);
-	memcpy(AFC_PACKET_DATA_PTR + 8, path, data_len-8);
-	ret = afc_dispatch_packet(client, AFC_OP_TRUNCATE, data_len, NULL, 0, &bytes);
-	if (ret != AFC_E_SUCCESS) {
+	if (thread_new(&async_loc->thread, afc_async_receive_thread, async_loc) != 0) {
+		afc_lock(client);
+		client->async = NULL;
 		afc_unlock(client);
-		return AFC_E_NOT_ENOUGH_DATA;
+		cond_destroy(&async_loc->cond);
+		mutex_destroy(&async_loc->mutex);
+		free(async_loc);
+		return AFC_E_UNKNOWN_ERROR;
 	}
-	/* Receive response */
-	ret = afc_receive_data(client, NULL, &bytes);
 
-	afc_unlock(client);
+	*async = async_loc;
 
-	return ret;
+	return AFC_E_SUCCESS;
 }
 
-LIBIMOBILEDEVICE_API afc_error_t afc_make_link(afc_client_t client, afc_link_type_t linktype, const char *target, const char *linkname)
+LIBIMOBILEDEVICE_API afc_error_t afc_async_free(afc_async_t async)
 {
-	if (!client || !target || !linkname || !client->afc_packet || !client->parent)
+	if (!async)
 		return AFC_E_INVALID_ARG;
 
+	mutex_lock(&async->mutex);
+	async->quit = 1;
+	cond_signal(&async->cond);
+	mutex_unlock(&async->mutex);
+
+	thread_join(async->thread);
+	thread_free(async->thread);
+
+	afc_lock(async->client);
+	async->client->async = NULL;
+	afc_unlock(async->client);
+
+	cond_destroy(&async->cond);
+	mutex_destroy(&async->mutex);
+	free(async);
+
+	return AFC_E_SUCCESS;
+}
+
+/**
+ * Sends a request and queues the operation for the receive thread. The AFC
+ * client is only locked while sending, the round trip happens without it.
+ */
+static afc_error_t afc_async_submit(afc_async_t async, uint64_t operation, const char *data, uint32_t data_length, const char *payload, uint32_t payload_length, afc_async_cb_t callback, void *user_data)
+{
+	afc_client_t client = async->client;
 	uint32_t bytes = 0;
-	uint64_t type = htole64(linktype);
-	afc_error_t ret = AFC_E_UNKNOWN_ERROR;
 
-	size_t target_len = strlen(target);
-	size_t link_len = strlen(linkname);
+	struct afc_async_op *op = (struct afc_async_op*)malloc(sizeof(struct afc_async_op));
+	if (!op)
+		return AFC_E_NO_MEM;
+	op->operation = (int)operation;
+	op->callback = callback;
+	op->user_data = user_data;
+	op->next = NULL;
 
 	afc_lock(client);
 
-	uint32_t data_len = 8 + target_len + 1 + link_len + 1;
-	if (_afc_check_packet_buffer(client, data_len) < 0) {
+	mutex_lock(&async->mutex);
+	afc_error_t ret = (async->quit) ? AFC_E_INVALID_ARG : async->error;
+	mutex_unlock(&async->mutex);
+	if (ret != AFC_E_SUCCESS) {
+		afc_unlock(client);
+		free(op);
+		return ret;
+	}
+
+	if (_afc_check_packet_buffer(client, data_length) < 0) {
 		afc_unlock(client);
+		free(op);
 		debug_info("Failed to realloc packet buffer");
 		return AFC_E_NO_MEM;
 	}
+	memcpy(AFC_PACKET_DATA_PTR, data, data_length);
 
-	debug_info("link type: %lld", type);
-	debug_info("target: %s, length:%d", target, target_len);
-	debug_info("linkname: %s, length:%d", linkname, link_len);
-
-	/* Send command */
-	*(uint64_t*)(AFC_PACKET_DATA_PTR) = htole64(linktype);
-	memcpy(AFC_PACKET_DATA_PTR + 8, target, target_len + 1);
-	memcpy(AFC_PACKET_DATA_PTR + 8 + target_len + 1, linkname, link_len + 1);
-	ret = afc_dispatch_packet(client, AFC_OP_MAKE_LINK, data_len, NULL, 0, &bytes);
+	ret = afc_dispatch_packet(client, operation, data_length, payload, payload_length, &bytes);
+	if (ret == AFC_E_SUCCESS && bytes < sizeof(AFCPacket) + data_length + payload_length) {
+		debug_info("Failed to send request");
+		ret = AFC_E_MUX_ERROR;
+	}
 	if (ret != AFC_E_SUCCESS) {
 		afc_unlock(client);
-		return AFC_E_NOT_ENOUGH_DATA;
+		free(op);
+		return ret;
 	}
-	/* Receive response */
-	ret = afc_receive_data(client, NULL, &bytes);
+	op->packet_num = client->afc_packet->packet_num;
+
+	/* queued before unlocking, so the queue has the order of the requests */
+	mutex_lock(&async->mutex);
+	if (async->pending_last) {
+		async->pending_last->next = op;
+	} else {
+		async->pending = op;
+	}
+	async->pending_last = op;
+	cond_signal(&async->cond);
+	mutex_unlock(&async->mutex);
 
 	afc_unlock(client);
 
-	return ret;
+	return AFC_E_SUCCESS;
 }
 
-LIBIMOBILEDEVICE_API afc_error_t afc_set_file_time(afc_client_t client, const char *path, uint64_t mtime)
+static afc_error_t afc_async_submit_path(afc_async_t async, uint64_t operation, const char *path, afc_async_cb_t callback, void *user_data)
 {
-	if (!client || !path || !client->afc_packet || !client->parent)
+	if (!async || !path || !callback)
 		return AFC_E_INVALID_ARG;
 
-	uint32_t bytes = 0;
-	afc_error_t ret = AFC_E_UNKNOWN_ERROR;
+	return afc_async_submit(async, operation, path, (uint32_t)strlen(path) + 1, NULL, 0, callback, user_data);
+}
 
-	afc_lock(client);
+LIBIMOBILEDEVICE_API afc_error_t afc_async_get_file_info(afc_async_t async, const char *path, afc_async_cb_t callback, void *user_data)
+{
+	return afc_async_submit_path(async, AFC_OP_GET_FILE_INFO, path, callback, user_data);
+}
 
-	uint32_t data_len = 8 + strlen(path) + 1;
-	if (_afc_check_packet_buffer(client, data_len) < 0) {
-		afc_unlock(client);
-		debug_info("Failed to realloc packet buffer");
-		return AFC_E_NO_MEM;
-	}
+LIBIMOBILEDEVICE_API afc_error_t afc_async_read_directory(afc_async_t async, const char *path, afc_async_cb_t callback, void *user_data)
+{
+	return afc_async_submit_path(async, AFC_OP_READ_DIR, path, callback, user_data);
+}
 
-	/* Send command */
-	*(uint64_t*)(AFC_PACKET_DATA_PTR) = htole64(mtime);
-	memcpy(AFC_PACKET_DATA_PTR + 8, path, data_len-8);
-	ret = afc_dispatch_packet(client, AFC_OP_SET_FILE_MOD_TIME, data_len, NULL, 0, &bytes);
-	if (ret != AFC_E_SUCCESS) {
-		afc_unlock(client);
-		return AFC_E_NOT_ENOUGH_DATA;
-	}
-	/* Receive response */
-	ret = afc_receive_data(client, NULL, &bytes);
+LIBIMOBILEDEVICE_API afc_error_t afc_async_make_directory(afc_async_t async, const char *path, afc_async_cb_t callback, void *user_data)
+{
+	return afc_async_submit_path(async, AFC_OP_MAKE_DIR, path, callback, user_data);
+}
 
-	afc_unlock(client);
+LIBIMOBILEDEVICE_API afc_error_t afc_async_remove_path(afc_async_t async, const char *path, afc_async_cb_t callback, void *user_data)
+{
+	return afc_async_submit_path(async, AFC_OP_REMOVE_PATH, path, callback, user_data);
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_async_file_open(afc_async_t async, const char *filename, afc_file_mode_t file_mode, afc_async_cb_t callback, void *user_data)
+{
+	if (!async || !filename || !callback)
+		return AFC_E_INVALID_ARG;
+
+	uint32_t data_len = (uint32_t)strlen(filename) + 1 + 8;
+	char *data = (char*)malloc(data_len);
+	if (!data)
+		return AFC_E_NO_MEM;
+	uint64_t mode_loc = htole64(file_mode);
+	memcpy(data, &mode_loc, 8);
+	memcpy(data + 8, filename, data_len - 8);
+
+	afc_error_t ret = afc_async_submit(async, AFC_OP_FILE_OPEN, data, data_len, NULL, 0, callback, user_data);
+	free(data);
 
 	return ret;
 }
 
-LIBIMOBILEDEVICE_API afc_error_t afc_remove_path_and_contents(afc_client_t client, const char *path)
+LIBIMOBILEDEVICE_API afc_error_t afc_async_file_read(afc_async_t async, uint64_t handle, uint32_t length, afc_async_cb_t callback, void *user_data)
 {
-	uint32_t bytes = 0;
-	afc_error_t ret = AFC_E_UNKNOWN_ERROR;
-
-	if (!client || !path || !client->afc_packet || !client->parent)
+	if (!async || handle == 0 || !callback)
 		return AFC_E_INVALID_ARG;
 
-	afc_lock(client);
+	char data[16];
+	uint64_t size_loc = htole64((uint64_t)length);
+	memcpy(data, &handle, 8);
+	memcpy(data + 8, &size_loc, 8);
 
-	uint32_t data_len = strlen(path) + 1;
-	if (_afc_check_packet_buffer(client, data_len) < 0) {
-		afc_unlock(client);
-		debug_info("Failed to realloc packet buffer");
-		return AFC_E_NO_MEM;
-	}
+	return afc_async_submit(async, AFC_OP_FILE_READ, data, sizeof(data), NULL, 0, callback, user_data);
+}
 
-	/* Send command */
-	memcpy(AFC_PACKET_DATA_PTR, path, data_len);
-	ret = afc_dispatch_packet(client, AFC_OP_REMOVE_PATH_AND_CONTENTS, data_len, NULL, 0, &bytes);
-	if (ret != AFC_E_SUCCESS) {
-		afc_unlock(client);
-		return AFC_E_NOT_ENOUGH_DATA;
-	}
-	/* Receive response */
-	ret = afc_receive_data(client, NULL, &bytes);
+LIBIMOBILEDEVICE_API afc_error_t afc_async_file_write(afc_async_t async, uint64_t handle, const char *data, uint32_t length, afc_async_cb_t callback, void *user_data)
+{
+	if (!async || handle == 0 || (!data && length > 0) || !callback)
+		return AFC_E_INVALID_ARG;
 
-	afc_unlock(client);
+	return afc_async_submit(async, AFC_OP_FILE_WRITE, (const char*)&handle, 8, data, length, callback, user_data);
+}
 
-	return ret;
+LIBIMOBILEDEVICE_API afc_error_t afc_async_file_close(afc_async_t async, uint64_t handle, afc_async_cb_t callback, void *user_data)
+{
+	if (!async || handle == 0 || !callback)
+		return AFC_E_INVALID_ARG;
+
+	return afc_async_submit(async, AFC_OP_FILE_CLOSE, (const char*)&handle, 8, NULL, 0, callback, user_data);
 }
 
 LIBIMOBILEDEVICE_API afc_error_t afc_dictionary_free(char **dictionary)
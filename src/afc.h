@@ -26,6 +26,7 @@
 #include <stdint.h>
 
 #include "libimobiledevice/afc.h"
+#include "libimobiledevice/house_arrest.h"
 #include "service.h"
 #include "endianness.h"
 #include "common/thread.h"
@@ -50,15 +51,242 @@ typedef struct {
 	(x)->packet_num    = le64toh((x)->packet_num); \
 	(x)->operation     = le64toh((x)->operation);
 
+/* default number of outstanding requests for pipelined reads */
+#define AFC_READ_MAX_PENDING (4)
+
+/* bounds of the adaptive chunk size, it starts at the device's FSBlockSize */
+#define AFC_CHUNK_MIN_SIZE (4096)
+#define AFC_CHUNK_MAX_SIZE (1024*1024)
+/* starting chunk size if the device doesn't report FSBlockSize */
+#define AFC_CHUNK_DEFAULT_SIZE (65536)
+/* number of completed requests per throughput sample */
+#define AFC_CHUNK_SAMPLE_OPS (8)
+/* the chunk size is reduced if a single request takes longer than this (us) */
+#define AFC_CHUNK_MAX_LATENCY (100000)
+
+/* size of the connection receive buffer, larger reads bypass it */
+/* requests and buffer used by afc_copy_to_host() and afc_copy_from_host() */
+#define AFC_COPY_MAX_PENDING (4)
+#define AFC_COPY_BUFFER_SIZE (4*1024*1024)
+
+/* blocks compared in front of the offset when resuming a copy */
+#define AFC_COPY_VERIFY_BLOCK_SIZE (65536)
+#define AFC_COPY_VERIFY_MAX_BLOCKS (4)
+
+#define AFC_REMOVE_MAX_PENDING (32)
+/* number of removals between two progress reports */
+#define AFC_REMOVE_REPORT_INTERVAL (256)
+
+#define AFC_WALK_MAX_PENDING (16)
+#define AFC_WALK_BATCH_SIZE (256)
+
+#define AFC_RECEIVE_BUFFER_SIZE (4096)
+
+/* size of the stack buffer used to consume status and error responses */
+#define AFC_SCRATCH_BUFFER_SIZE (256)
+
+/* packet buffer space for request data, grown in multiples of this */
+#define AFC_PACKET_EXTRA_MIN (1024)
+
+/* number and maximum size of packet buffers kept for reuse */
+#define AFC_PACKET_POOL_SIZE (16)
+#define AFC_PACKET_POOL_MAX_EXTRA (65536)
+
+/* enough for all file information including a link target of PATH_MAX */
+#define AFC_FILE_INFO_BUFFER_SIZE (4096)
+
+/* maximum number of windowed writes with an outstanding status reply */
+#define AFC_WRITE_MAX_WINDOW (32)
+
+/* attribute and directory cache */
+#define AFC_CACHE_HASH_SIZE (256)
+#define AFC_CACHE_DEFAULT_MAX_SIZE (4*1024*1024)
+
+enum {
+	AFC_CACHE_FILE_INFO = 0,
+	AFC_CACHE_DIRECTORY = 1
+};
+
+#define AFC_CACHE_INVALIDATE_PARENT (1 << 0)
+#define AFC_CACHE_INVALIDATE_TREE   (1 << 1)
+
+struct afc_cache_entry {
+	int kind;
+	char *path;
+	unsigned int hash;
+	afc_error_t error;
+	char *data;
+	uint32_t length;
+	uint64_t expires;
+	struct afc_cache_entry *hash_next;
+	struct afc_cache_entry *lru_prev;
+	struct afc_cache_entry *lru_next;
+};
+
+struct afc_cache_handle {
+	uint64_t handle;
+	char *path;
+	struct afc_cache_handle *next;
+};
+
+struct afc_cache {
+	uint32_t ttl;
+	size_t max_size;
+	size_t size;
+	struct afc_cache_entry *hash[AFC_CACHE_HASH_SIZE];
+	struct afc_cache_entry *lru_first;
+	struct afc_cache_entry *lru_last;
+	struct afc_cache_handle *handles;
+};
+
 struct afc_client_private {
 	service_client_t parent;
 	AFCPacket *afc_packet;
 	uint32_t packet_extra;
 	mutex_t mutex;
 	int free_parent;
+	unsigned int write_window;
+	unsigned int write_pending;
+	/* receives all responses while attached, rules out windowed writes */
+	struct afc_async_private *async;
+	uint64_t write_handles[AFC_WRITE_MAX_WINDOW];
+	afc_error_t write_error;
+	uint64_t write_error_handle;
+	uint32_t chunk_size;
+	uint32_t chunk_min;
+	int chunk_settled;
+	uint64_t chunk_best_rate;
+	uint64_t chunk_sample_start;
+	uint64_t chunk_sample_bytes;
+	unsigned int chunk_sample_ops;
+	struct afc_cache *cache;
+};
+
+struct afc_dir_private {
+	/* the reply of the device, names are returned from it in place */
+	char *data;
+	uint32_t length;
+	uint32_t offset;
 };
 
 /* AFC Operations */
+struct afc_walk_item {
+	int operation;
+	char *path;
+	uint64_t packet_num;
+	afc_stat_t st;
+	struct afc_walk_item *next;
+};
+
+struct afc_walk_queue {
+	struct afc_walk_item *first;
+	struct afc_walk_item *last;
+	unsigned int count;
+};
+
+/* requests in flight and results per callback round of afc_read_files() */
+#define AFC_READ_FILES_MAX_PENDING (32)
+#define AFC_READ_FILES_BATCH_SIZE (64)
+#define AFC_READ_FILES_BATCH_BYTES (4*1024*1024)
+/* size of the first read request for each file */
+#define AFC_READ_FILES_FIRST_READ (65536)
+
+struct afc_read_files_item {
+	unsigned int index;
+	uint64_t handle;
+	char *data;
+	uint32_t length;
+	uint32_t capacity;
+	afc_error_t error;
+	int eof;
+	struct afc_read_files_item *next;
+};
+
+struct afc_read_files_op {
+	uint64_t packet_num;
+	int operation;
+	uint32_t size;
+	struct afc_read_files_item *item;
+};
+
+#define AFC_TRANSFER_DEFAULT_CONNECTIONS (4)
+#define AFC_TRANSFER_MAX_CONNECTIONS (16)
+
+/* files larger than this are split into ranges of this size */
+#define AFC_TRANSFER_RANGE_SIZE (8*1024*1024)
+
+#define AFC_TRANSFER_BUFFER_SIZE (1024*1024)
+
+enum afc_transfer_direction {
+	AFC_TRANSFER_DOWNLOAD,
+	AFC_TRANSFER_UPLOAD
+};
+
+struct afc_transfer_file {
+	enum afc_transfer_direction direction;
+	char *device_path;
+	char *local_path;
+	uint64_t size;
+	unsigned int units_left;
+	afc_error_t error;
+	struct afc_transfer_file *next;
+};
+
+struct afc_transfer_unit {
+	struct afc_transfer_file *file;
+	uint64_t offset;
+	uint64_t length;
+};
+
+struct afc_transfer_worker {
+	afc_transfer_t transfer;
+	afc_client_t client;
+	house_arrest_client_t house_arrest;
+	THREAD_T thread;
+	char *buffer;
+	/* deque of units, the owner takes from the head, thieves from the tail */
+	struct afc_transfer_unit **units;
+	unsigned int head;
+	unsigned int tail;
+};
+
+struct afc_transfer_private {
+	struct afc_transfer_worker *workers;
+	unsigned int num_workers;
+	struct afc_transfer_file *files;
+	struct afc_transfer_file *files_last;
+	unsigned int num_files;
+	struct afc_transfer_unit *units;
+	unsigned int num_units;
+	mutex_t mutex;
+	mutex_t progress_mutex;
+	afc_transfer_progress_t progress;
+	afc_transfer_progress_cb_t progress_cb;
+	void *user_data;
+	afc_error_t error;
+	int cancel;
+	int running;
+};
+
+struct afc_async_op {
+	uint64_t packet_num;
+	int operation;
+	afc_async_cb_t callback;
+	void *user_data;
+	struct afc_async_op *next;
+};
+
+struct afc_async_private {
+	afc_client_t client;
+	THREAD_T thread;
+	mutex_t mutex;
+	cond_t cond;
+	struct afc_async_op *pending;
+	struct afc_async_op *pending_last;
+	afc_error_t error;
+	int quit;
+};
+
 enum {
 	AFC_OP_INVALID                   = 0x00000000,	/* Invalid */
 	AFC_OP_STATUS                    = 0x00000001,	/* Status */
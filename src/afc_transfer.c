@@ -0,0 +1,687 @@
+/*
+ * afc_transfer.c
+ * Parallel file transfers over a pool of AFC connections.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <plist/plist.h>
+
+#include "afc.h"
+#include "common/debug.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+/*
+ * Every file is split into units, the whole file or ranges of
+ * AFC_TRANSFER_RANGE_SIZE bytes for large files. Each worker owns one AFC
+ * connection and a deque of units; it takes units from the front of its
+ * own deque, so the ranges of a file are transferred in order, and steals
+ * from the back of the fullest deque once its own is empty.
+ */
+
+static afc_transfer_t afc_transfer_alloc(unsigned int num_connections)
+{
+	afc_transfer_t transfer = (afc_transfer_t)calloc(1, sizeof(struct afc_transfer_private));
+	if (!transfer)
+		return NULL;
+
+	transfer->workers = (struct afc_transfer_worker*)calloc(num_connections, sizeof(struct afc_transfer_worker));
+	if (!transfer->workers) {
+		free(transfer);
+		return NULL;
+	}
+	mutex_init(&transfer->mutex);
+	mutex_init(&transfer->progress_mutex);
+
+	return transfer;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_transfer_new(idevice_t device, unsigned int num_connections, const char *label, afc_transfer_t *transfer)
+{
+	unsigned int i;
+
+	if (!device || !transfer)
+		return AFC_E_INVALID_ARG;
+
+	if (num_connections == 0)
+		num_connections = AFC_TRANSFER_DEFAULT_CONNECTIONS;
+	if (num_connections > AFC_TRANSFER_MAX_CONNECTIONS)
+		num_connections = AFC_TRANSFER_MAX_CONNECTIONS;
+
+	afc_transfer_t transfer_loc = afc_transfer_alloc(num_connections);
+	if (!transfer_loc)
+		return AFC_E_NO_MEM;
+
+	for (i = 0; i < num_connections; i++) {
+		afc_error_t err = afc_client_start_service(device, &transfer_loc->workers[i].client, label);
+		if (err != AFC_E_SUCCESS) {
+			debug_info("Could not start AFC connection %u, error %d", i, err);
+			if (i == 0) {
+				afc_transfer_free(transfer_loc);
+				return err;
+			}
+			/* work with the connections we got */
+			break;
+		}
+		transfer_loc->num_workers++;
+	}
+
+	*transfer = transfer_loc;
+
+	return AFC_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_transfer_new_with_house_arrest(idevice_t device, const char *bundle_id, const char *command, unsigned int num_connections, const char *label, afc_transfer_t *transfer)
+{
+	unsigned int i;
+	afc_error_t err = AFC_E_SUCCESS;
+
+	if (!device || !bundle_id || !transfer)
+		return AFC_E_INVALID_ARG;
+
+	if (!command)
+		command = "VendContainer";
+	if (num_connections == 0)
+		num_connections = AFC_TRANSFER_DEFAULT_CONNECTIONS;
+	if (num_connections > AFC_TRANSFER_MAX_CONNECTIONS)
+		num_connections = AFC_TRANSFER_MAX_CONNECTIONS;
+
+	afc_transfer_t transfer_loc = afc_transfer_alloc(num_connections);
+	if (!transfer_loc)
+		return AFC_E_NO_MEM;
+
+	for (i = 0; i < num_connections; i++) {
+		struct afc_transfer_worker *worker = &transfer_loc->workers[i];
+		plist_t dict = NULL;
+
+		err = AFC_E_UNKNOWN_ERROR;
+		if (house_arrest_client_start_service(device, &worker->house_arrest, label) != HOUSE_ARREST_E_SUCCESS) {
+			debug_info("Could not start house_arrest connection %u", i);
+		} else if (house_arrest_send_command(worker->house_arrest, command, bundle_id) != HOUSE_ARREST_E_SUCCESS || house_arrest_get_result(worker->house_arrest, &dict) != HOUSE_ARREST_E_SUCCESS) {
+			debug_info("Could not send %s command for %s", command, bundle_id);
+		} else if (plist_dict_get_item(dict, "Error")) {
+			debug_info("Device refused %s for %s", command, bundle_id);
+			err = AFC_E_PERM_DENIED;
+		} else {
+			err = afc_client_new_from_house_arrest_client(worker->house_arrest, &worker->client);
+		}
+		plist_free(dict);
+
+		if (err != AFC_E_SUCCESS) {
+			if (worker->house_arrest) {
+				house_arrest_client_free(worker->house_arrest);
+				worker->house_arrest = NULL;
+			}
+			if (i == 0) {
+				afc_transfer_free(transfer_loc);
+				return err;
+			}
+			break;
+		}
+		transfer_loc->num_workers++;
+	}
+
+	*transfer = transfer_loc;
+
+	return AFC_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_transfer_free(afc_transfer_t transfer)
+{
+	unsigned int i;
+
+	if (!transfer)
+		return AFC_E_INVALID_ARG;
+
+	for (i = 0; i < transfer->num_workers; i++) {
+		afc_client_free(transfer->workers[i].client);
+		if (transfer->workers[i].house_arrest) {
+			house_arrest_client_free(transfer->workers[i].house_arrest);
+		}
+		free(transfer->workers[i].units);
+	}
+	free(transfer->workers);
+
+	while (transfer->files) {
+		struct afc_transfer_file *next = transfer->files->next;
+		free(transfer->files->device_path);
+		free(transfer->files->local_path);
+		free(transfer->files);
+		transfer->files = next;
+	}
+	free(transfer->units);
+
+	mutex_destroy(&transfer->progress_mutex);
+	mutex_destroy(&transfer->mutex);
+	free(transfer);
+
+	return AFC_E_SUCCESS;
+}
+
+static afc_error_t afc_transfer_add(afc_transfer_t transfer, enum afc_transfer_direction direction, const char *device_path, const char *local_path, uint64_t size)
+{
+	struct afc_transfer_file *file = (struct afc_transfer_file*)calloc(1, sizeof(struct afc_transfer_file));
+	if (!file)
+		return AFC_E_NO_MEM;
+
+	file->direction = direction;
+	file->device_path = strdup(device_path);
+	file->local_path = strdup(local_path);
+	file->size = size;
+	file->error = AFC_E_SUCCESS;
+	if (!file->device_path || !file->local_path) {
+		free(file->device_path);
+		free(file->local_path);
+		free(file);
+		return AFC_E_NO_MEM;
+	}
+
+	if (transfer->files_last) {
+		transfer->files_last->next = file;
+	} else {
+		transfer->files = file;
+	}
+	transfer->files_last = file;
+	transfer->num_files++;
+
+	return AFC_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_transfer_add_download(afc_transfer_t transfer, const char *device_path, const char *local_path)
+{
+	afc_stat_t st;
+
+	if (!transfer || !device_path || !local_path || transfer->running)
+		return AFC_E_INVALID_ARG;
+
+	afc_error_t err = afc_get_file_info_struct(transfer->workers[0].client, device_path, &st, NULL);
+	if (err != AFC_E_SUCCESS) {
+		debug_info("Could not get file information for %s, error %d", device_path, err);
+		return err;
+	}
+	if (st.type != AFC_FILE_TYPE_REGULAR) {
+		debug_info("%s is not a regular file", device_path);
+		return AFC_E_INVALID_ARG;
+	}
+
+	return afc_transfer_add(transfer, AFC_TRANSFER_DOWNLOAD, device_path, local_path, st.size);
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_transfer_add_upload(afc_transfer_t transfer, const char *local_path, const char *device_path)
+{
+	struct stat st;
+
+	if (!transfer || !device_path || !local_path || transfer->running)
+		return AFC_E_INVALID_ARG;
+
+	if (stat(local_path, &st) != 0 || !S_ISREG(st.st_mode)) {
+		debug_info("%s is not a regular file", local_path);
+		return AFC_E_INVALID_ARG;
+	}
+
+	return afc_transfer_add(transfer, AFC_TRANSFER_UPLOAD, device_path, local_path, (uint64_t)st.st_size);
+}
+
+/**
+ * Accounts for transferred bytes and notifies the progress callback.
+ *
+ * @return 0 to continue, or -1 if the transfer got cancelled.
+ */
+static int afc_transfer_update_progress(afc_transfer_t transfer, uint64_t bytes, int file_done, int file_failed)
+{
+	afc_transfer_progress_t progress;
+	int cancel;
+
+	/* serializes the callback and keeps the reported progress monotonic */
+	mutex_lock(&transfer->progress_mutex);
+
+	mutex_lock(&transfer->mutex);
+	transfer->progress.bytes_done += bytes;
+	if (file_done)
+		transfer->progress.files_done++;
+	if (file_failed)
+		transfer->progress.files_failed++;
+	progress = transfer->progress;
+	mutex_unlock(&transfer->mutex);
+
+	if (transfer->progress_cb && transfer->progress_cb(&progress, transfer->user_data) != 0) {
+		mutex_lock(&transfer->mutex);
+		transfer->cancel = 1;
+		mutex_unlock(&transfer->mutex);
+	}
+
+	mutex_lock(&transfer->mutex);
+	cancel = transfer->cancel;
+	mutex_unlock(&transfer->mutex);
+
+	mutex_unlock(&transfer->progress_mutex);
+
+	return (cancel) ? -1 : 0;
+}
+
+static afc_error_t afc_transfer_download_unit(struct afc_transfer_worker *worker, struct afc_transfer_unit *unit)
+{
+	struct afc_transfer_file *file = unit->file;
+	uint64_t handle = 0;
+	uint64_t remaining = unit->length;
+	afc_error_t err;
+	int fd;
+
+	err = afc_file_open(worker->client, file->device_path, AFC_FOPEN_RDONLY, &handle);
+	if (err != AFC_E_SUCCESS) {
+		debug_info("Could not open %s, error %d", file->device_path, err);
+		return err;
+	}
+	if (unit->offset > 0) {
+		err = afc_file_seek(worker->client, handle, (int64_t)unit->offset, SEEK_SET);
+		if (err != AFC_E_SUCCESS) {
+			afc_file_close(worker->client, handle);
+			return err;
+		}
+	}
+
+	fd = open(file->local_path, O_WRONLY | O_BINARY);
+	if (fd < 0 || lseek(fd, (off_t)unit->offset, SEEK_SET) < 0) {
+		debug_info("Could not open %s for writing", file->local_path);
+		if (fd >= 0)
+			close(fd);
+		afc_file_close(worker->client, handle);
+		return AFC_E_IO_ERROR;
+	}
+
+	while (remaining > 0) {
+		uint32_t amount = (remaining > AFC_TRANSFER_BUFFER_SIZE) ? AFC_TRANSFER_BUFFER_SIZE : (uint32_t)remaining;
+		uint32_t bytes_read = 0;
+		uint32_t written = 0;
+
+		err = afc_file_read_pipelined(worker->client, handle, worker->buffer, amount, 0, 0, &bytes_read);
+		if (err != AFC_E_SUCCESS)
+			break;
+		if (bytes_read == 0) {
+			debug_info("%s got shorter while downloading", file->device_path);
+			err = AFC_E_IO_ERROR;
+			break;
+		}
+		while (written < bytes_read) {
+			ssize_t w = write(fd, worker->buffer + written, bytes_read - written);
+			if (w <= 0)
+				break;
+			written += (uint32_t)w;
+		}
+		if (written < bytes_read) {
+			debug_info("Could not write to %s", file->local_path);
+			err = AFC_E_IO_ERROR;
+			break;
+		}
+		remaining -= bytes_read;
+		if (afc_transfer_update_progress(worker->transfer, bytes_read, 0, 0) < 0) {
+			err = AFC_E_OP_INTERRUPTED;
+			break;
+		}
+	}
+
+	close(fd);
+	afc_file_close(worker->client, handle);
+
+	return err;
+}
+
+static afc_error_t afc_transfer_upload_unit(struct afc_transfer_worker *worker, struct afc_transfer_unit *unit)
+{
+	struct afc_transfer_file *file = unit->file;
+	uint64_t handle = 0;
+	uint64_t remaining = unit->length;
+	afc_error_t err;
+	int fd;
+
+	fd = open(file->local_path, O_RDONLY | O_BINARY);
+	if (fd < 0 || lseek(fd, (off_t)unit->offset, SEEK_SET) < 0) {
+		debug_info("Could not open %s for reading", file->local_path);
+		if (fd >= 0)
+			close(fd);
+		return AFC_E_IO_ERROR;
+	}
+
+	/* the file got created before, don't truncate it */
+	err = afc_file_open(worker->client, file->device_path, AFC_FOPEN_RW, &handle);
+	if (err != AFC_E_SUCCESS) {
+		debug_info("Could not open %s, error %d", file->device_path, err);
+		close(fd);
+		return err;
+	}
+	if (unit->offset > 0) {
+		err = afc_file_seek(worker->client, handle, (int64_t)unit->offset, SEEK_SET);
+	}
+
+	while (err == AFC_E_SUCCESS && remaining > 0) {
+		uint32_t amount = (remaining > AFC_TRANSFER_BUFFER_SIZE) ? AFC_TRANSFER_BUFFER_SIZE : (uint32_t)remaining;
+		uint32_t got = 0;
+		uint32_t written = 0;
+
+		while (got < amount) {
+			ssize_t r = read(fd, worker->buffer + got, amount - got);
+			if (r <= 0)
+				break;
+			got += (uint32_t)r;
+		}
+		if (got < amount) {
+			debug_info("%s got shorter while uploading", file->local_path);
+			err = AFC_E_IO_ERROR;
+			break;
+		}
+		while (err == AFC_E_SUCCESS && written < got) {
+			uint32_t bytes_written = 0;
+			err = afc_file_write(worker->client, handle, worker->buffer + written, got - written, &bytes_written);
+			if (err == AFC_E_SUCCESS && bytes_written == 0)
+				err = AFC_E_IO_ERROR;
+			written += bytes_written;
+		}
+		if (err != AFC_E_SUCCESS)
+			break;
+		remaining -= got;
+		if (afc_transfer_update_progress(worker->transfer, got, 0, 0) < 0) {
+			err = AFC_E_OP_INTERRUPTED;
+			break;
+		}
+	}
+
+	afc_file_close(worker->client, handle);
+	close(fd);
+
+	return err;
+}
+
+/**
+ * Takes the next unit from the worker's own deque, or steals one from the
+ * back of the fullest deque of the other workers.
+ */
+static struct afc_transfer_unit *afc_transfer_next_unit(struct afc_transfer_worker *worker)
+{
+	afc_transfer_t transfer = worker->transfer;
+	struct afc_transfer_unit *unit = NULL;
+	unsigned int i;
+
+	mutex_lock(&transfer->mutex);
+	if (transfer->cancel) {
+		mutex_unlock(&transfer->mutex);
+		return NULL;
+	}
+	if (worker->head < worker->tail) {
+		unit = worker->units[worker->head++];
+	} else {
+		struct afc_transfer_worker *victim = NULL;
+		for (i = 0; i < transfer->num_workers; i++) {
+			struct afc_transfer_worker *w = &transfer->workers[i];
+			if (w->tail - w->head > 0 && (!victim || w->tail - w->head > victim->tail - victim->head)) {
+				victim = w;
+			}
+		}
+		if (victim) {
+			unit = victim->units[--victim->tail];
+			debug_info("Stole a unit of %s at offset %llu", unit->file->device_path, (unsigned long long)unit->offset);
+		}
+	}
+	mutex_unlock(&transfer->mutex);
+
+	return unit;
+}
+
+static void* afc_transfer_worker_thread(void *arg)
+{
+	struct afc_transfer_worker *worker = (struct afc_transfer_worker*)arg;
+	afc_transfer_t transfer = worker->transfer;
+	struct afc_transfer_unit *unit;
+
+	while ((unit = afc_transfer_next_unit(worker)) != NULL) {
+		struct afc_transfer_file *file = unit->file;
+		afc_error_t err = AFC_E_SUCCESS;
+		int file_done = 0;
+		int file_failed = 0;
+
+		mutex_lock(&transfer->mutex);
+		int skip = (file->error != AFC_E_SUCCESS);
+		mutex_unlock(&transfer->mutex);
+
+		if (!skip && unit->length > 0) {
+			if (file->direction == AFC_TRANSFER_DOWNLOAD) {
+				err = afc_transfer_download_unit(worker, unit);
+			} else {
+				err = afc_transfer_upload_unit(worker, unit);
+			}
+		}
+
+		mutex_lock(&transfer->mutex);
+		if (err != AFC_E_SUCCESS && file->error == AFC_E_SUCCESS) {
+			file->error = err;
+			file_failed = 1;
+			if (transfer->error == AFC_E_SUCCESS && err != AFC_E_OP_INTERRUPTED)
+				transfer->error = err;
+		}
+		if (--file->units_left == 0 && file->error == AFC_E_SUCCESS) {
+			file_done = 1;
+		}
+		mutex_unlock(&transfer->mutex);
+
+		if (file_done || file_failed) {
+			afc_transfer_update_progress(transfer, 0, file_done, file_failed);
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Creates the target of a transfer so that ranges can be written to it
+ * independently.
+ */
+static afc_error_t afc_transfer_create_target(afc_transfer_t transfer, struct afc_transfer_file *file)
+{
+	if (file->direction == AFC_TRANSFER_DOWNLOAD) {
+		int fd = open(file->local_path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+		if (fd < 0) {
+			debug_info("Could not create %s", file->local_path);
+			return AFC_E_IO_ERROR;
+		}
+		close(fd);
+	} else {
+		uint64_t handle = 0;
+		afc_error_t err = afc_file_open(transfer->workers[0].client, file->device_path, AFC_FOPEN_WRONLY, &handle);
+		if (err != AFC_E_SUCCESS) {
+			debug_info("Could not create %s, error %d", file->device_path, err);
+			return err;
+		}
+		afc_file_close(transfer->workers[0].client, handle);
+	}
+	return AFC_E_SUCCESS;
+}
+
+/**
+ * Splits the files into units and distributes them over the workers,
+ * always to the worker with the least bytes assigned so far.
+ */
+static afc_error_t afc_transfer_schedule(afc_transfer_t transfer)
+{
+	struct afc_transfer_file *file;
+	uint64_t *assigned;
+	unsigned int num_units = 0;
+	unsigned int i, u = 0;
+
+	for (file = transfer->files; file; file = file->next) {
+		file->units_left = (file->size > AFC_TRANSFER_RANGE_SIZE) ? (unsigned int)((file->size + AFC_TRANSFER_RANGE_SIZE - 1) / AFC_TRANSFER_RANGE_SIZE) : 1;
+		num_units += file->units_left;
+	}
+
+	free(transfer->units);
+	transfer->units = (struct afc_transfer_unit*)malloc(sizeof(struct afc_transfer_unit) * (num_units ? num_units : 1));
+	assigned = (uint64_t*)calloc(transfer->num_workers, sizeof(uint64_t));
+	if (!transfer->units || !assigned) {
+		free(assigned);
+		return AFC_E_NO_MEM;
+	}
+	for (i = 0; i < transfer->num_workers; i++) {
+		struct afc_transfer_worker *worker = &transfer->workers[i];
+		free(worker->units);
+		worker->units = (struct afc_transfer_unit**)malloc(sizeof(struct afc_transfer_unit*) * (num_units ? num_units : 1));
+		worker->head = worker->tail = 0;
+		if (!worker->units) {
+			free(assigned);
+			return AFC_E_NO_MEM;
+		}
+	}
+
+	for (file = transfer->files; file; file = file->next) {
+		unsigned int target = 0;
+		uint64_t offset = 0;
+		for (i = 1; i < transfer->num_workers; i++) {
+			if (assigned[i] < assigned[target])
+				target = i;
+		}
+		assigned[target] += file->size;
+		for (i = 0; i < file->units_left; i++) {
+			struct afc_transfer_unit *unit = &transfer->units[u++];
+			unit->file = file;
+			unit->offset = offset;
+			unit->length = (file->size - offset > AFC_TRANSFER_RANGE_SIZE) ? AFC_TRANSFER_RANGE_SIZE : file->size - offset;
+			offset += unit->length;
+			transfer->workers[target].units[transfer->workers[target].tail++] = unit;
+		}
+	}
+	transfer->num_units = num_units;
+	free(assigned);
+
+	return AFC_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_transfer_run(afc_transfer_t transfer, afc_transfer_progress_cb_t progress_cb, void *user_data)
+{
+	struct afc_transfer_file *file;
+	unsigned int i;
+	afc_error_t err;
+
+	if (!transfer || transfer->running)
+		return AFC_E_INVALID_ARG;
+
+	memset(&transfer->progress, '\0', sizeof(afc_transfer_progress_t));
+	transfer->progress_cb = progress_cb;
+	transfer->user_data = user_data;
+	transfer->cancel = 0;
+	transfer->error = AFC_E_SUCCESS;
+
+	for (file = transfer->files; file; file = file->next) {
+		file->error = afc_transfer_create_target(transfer, file);
+		transfer->progress.bytes_total += file->size;
+		transfer->progress.files_total++;
+		if (file->error != AFC_E_SUCCESS) {
+			transfer->progress.files_failed++;
+			if (transfer->error == AFC_E_SUCCESS)
+				transfer->error = file->error;
+		}
+	}
+
+	err = afc_transfer_schedule(transfer);
+	if (err != AFC_E_SUCCESS)
+		return err;
+
+	transfer->running = 1;
+	for (i = 0; i < transfer->num_workers; i++) {
+		struct afc_transfer_worker *worker = &transfer->workers[i];
+		worker->transfer = transfer;
+		worker->thread = THREAD_T_NULL;
+		worker->buffer = (char*)malloc(AFC_TRANSFER_BUFFER_SIZE);
+		if (!worker->buffer || thread_new(&worker->thread, afc_transfer_worker_thread, worker) != 0) {
+			/* the other workers will steal the units of this one */
+			debug_info("Could not start worker %u", i);
+			worker->thread = THREAD_T_NULL;
+		}
+	}
+
+	/* make sure somebody does the work if no thread could be started */
+	int started = 0;
+	for (i = 0; i < transfer->num_workers; i++) {
+		if (transfer->workers[i].thread)
+			started++;
+	}
+	if (started == 0) {
+		if (transfer->workers[0].buffer) {
+			afc_transfer_worker_thread(&transfer->workers[0]);
+		} else {
+			transfer->error = AFC_E_NO_MEM;
+		}
+	}
+
+	for (i = 0; i < transfer->num_workers; i++) {
+		struct afc_transfer_worker *worker = &transfer->workers[i];
+		if (worker->thread) {
+			thread_join(worker->thread);
+			thread_free(worker->thread);
+			worker->thread = THREAD_T_NULL;
+		}
+		free(worker->buffer);
+		worker->buffer = NULL;
+	}
+	transfer->running = 0;
+
+	/* the files are transferred, drop them so the engine can be reused */
+	while (transfer->files) {
+		struct afc_transfer_file *next = transfer->files->next;
+		free(transfer->files->device_path);
+		free(transfer->files->local_path);
+		free(transfer->files);
+		transfer->files = next;
+	}
+	transfer->files_last = NULL;
+	transfer->num_files = 0;
+
+	if (transfer->cancel)
+		return AFC_E_OP_INTERRUPTED;
+
+	return transfer->error;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_transfer_get_progress(afc_transfer_t transfer, afc_transfer_progress_t *progress)
+{
+	if (!transfer || !progress)
+		return AFC_E_INVALID_ARG;
+
+	mutex_lock(&transfer->mutex);
+	*progress = transfer->progress;
+	mutex_unlock(&transfer->mutex);
+
+	return AFC_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_transfer_cancel(afc_transfer_t transfer)
+{
+	if (!transfer)
+		return AFC_E_INVALID_ARG;
+
+	mutex_lock(&transfer->mutex);
+	transfer->cancel = 1;
+	mutex_unlock(&transfer->mutex);
+
+	return AFC_E_SUCCESS;
+}
@@ -24,6 +24,17 @@
 #endif
 #include <string.h>
 #include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#ifdef WIN32
+#include <winsock2.h>
+#include <windows.h>
+#define poll WSAPoll
+#else
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#endif
 #include <plist/plist.h>
 
 #include "companion_proxy.h"
@@ -83,7 +94,7 @@ LIBIMOBILEDEVICE_API companion_proxy_error_t companion_proxy_client_new(idevice_
 
 	companion_proxy_client_t client_loc = (companion_proxy_client_t) malloc(sizeof(struct companion_proxy_client_private));
 	client_loc->parent = plclient;
-	client_loc->event_thread = THREAD_T_NULL;
+	client_loc->listener = NULL;
 
 	*client = client_loc;
 
@@ -103,15 +114,8 @@ LIBIMOBILEDEVICE_API companion_proxy_error_t companion_proxy_client_free(compani
 	if (!client)
 		return COMPANION_PROXY_E_INVALID_ARG;
 
-	property_list_service_client_t parent = client->parent;
-	client->parent = NULL;
-	if (client->event_thread) {
-		debug_info("joining event thread");
-		thread_join(client->event_thread);
-		thread_free(client->event_thread);
-		client->event_thread = THREAD_T_NULL;
-	}
-	companion_proxy_error_t err = companion_proxy_error(property_list_service_client_free(parent));
+	companion_proxy_stop_listening_for_devices(client);
+	companion_proxy_error_t err = companion_proxy_error(property_list_service_client_free(client->parent));
 	free(client);
 
 	return err;
@@ -184,45 +188,174 @@ LIBIMOBILEDEVICE_API companion_proxy_error_t companion_proxy_get_device_registry
 	return res;
 }
 
-struct companion_proxy_cb_data {
-	companion_proxy_client_t client;
-	companion_proxy_device_event_cb_t cbfunc;
-	void* user_data;
-};
+#ifdef WIN32
+/* there is no pollable wakeup pipe, pick up changes periodically instead */
+#define COMPANION_PROXY_EVENTS_MAX_WAIT 1000
+#endif
 
-static void* companion_proxy_event_thread(void* arg)
-{
-	struct companion_proxy_cb_data* data = (struct companion_proxy_cb_data*)arg;
-	companion_proxy_client_t client = data->client;
-	companion_proxy_error_t res;
+/*
+ * All clients listening for device events are served by one thread that
+ * waits for any of their connections to become readable, instead of a
+ * thread per client that polls its connection.
+ */
+static struct {
+	mutex_t mutex;
+	THREAD_T thread;
+	int running;
+	struct companion_proxy_listener *listeners;
+#ifndef WIN32
+	int wakeup[2];
+#endif
+} companion_events;
+static thread_once_t companion_events_once = THREAD_ONCE_INIT;
 
-	plist_t command = plist_new_dict();
-	plist_dict_set_item(command, "Command", plist_new_string("StartListeningForDevices"));
-	res = companion_proxy_send(client, command);
-	plist_free(command);
+static void companion_events_init(void)
+{
+	mutex_init(&companion_events.mutex);
+	companion_events.thread = THREAD_T_NULL;
+#ifndef WIN32
+	if (pipe(companion_events.wakeup) == 0) {
+		fcntl(companion_events.wakeup[0], F_SETFL, O_NONBLOCK);
+		fcntl(companion_events.wakeup[1], F_SETFL, O_NONBLOCK);
+	} else {
+		companion_events.wakeup[0] = companion_events.wakeup[1] = -1;
+	}
+#endif
+}
 
-	if (res != COMPANION_PROXY_E_SUCCESS) {
-		free(data);
-		client->event_thread = THREAD_T_NULL;
-		return NULL;
+/* makes the event thread pick up added or removed listeners */
+static void companion_events_wakeup(void)
+{
+#ifndef WIN32
+	if (companion_events.wakeup[1] >= 0) {
+		char c = 0;
+		if (write(companion_events.wakeup[1], &c, 1) < 0) {
+			/* the pipe is full, so the thread wakes up anyway */
+		}
 	}
+#endif
+}
 
-	while (client && client->parent) {
+/**
+ * Delivers all events that arrived on the connection of a listener.
+ *
+ * @return 0 on success or -1 if the connection failed.
+ */
+static int companion_events_read(struct companion_proxy_listener *listener)
+{
+	property_list_service_client_t parent = listener->client->parent;
+
+	do {
 		plist_t node = NULL;
-		res = companion_proxy_error(property_list_service_receive_plist_with_timeout(client->parent, &node, 1000));
-		if (res != COMPANION_PROXY_E_SUCCESS && res != COMPANION_PROXY_E_TIMEOUT) {
-			debug_info("could not receive plist, error %d", res);
+		/* the connection is readable, so the timeout doesn't matter here */
+		property_list_service_error_t perr = property_list_service_receive_plist_with_timeout(parent, &node, 1);
+		if (perr == PROPERTY_LIST_SERVICE_E_RECEIVE_TIMEOUT) {
 			break;
+		} else if (perr != PROPERTY_LIST_SERVICE_E_SUCCESS || !node) {
+			debug_info("could not receive plist, error %d", perr);
+			plist_free(node);
+			return -1;
 		}
+		listener->callback(node, listener->user_data);
+		plist_free(node);
+		/* decrypted data can be pending that the fd doesn't report */
+	} while (parent->parent->connection->ssl_data);
 
-		if (node) {
-			data->cbfunc(node, data->user_data);
+	return 0;
+}
+
+static void* companion_events_thread(void* arg)
+{
+	struct pollfd *pfds = NULL;
+	unsigned int pfds_size = 0;
+
+	debug_info("Running");
+
+	while (1) {
+		struct companion_proxy_listener *listener;
+		unsigned int n = 0;
+		unsigned int first = 0;
+
+		mutex_lock(&companion_events.mutex);
+		if (!companion_events.listeners) {
+			/* started again by the next companion_proxy_start_listening_for_devices() */
+			companion_events.running = 0;
+			mutex_unlock(&companion_events.mutex);
+			break;
 		}
-		plist_free(node);
+		for (listener = companion_events.listeners; listener; listener = listener->next) {
+			n++;
+		}
+		n++;
+		if (n > pfds_size) {
+			struct pollfd *newpfds = (struct pollfd*)realloc(pfds, sizeof(struct pollfd) * n);
+			if (!newpfds) {
+				mutex_unlock(&companion_events.mutex);
+				debug_info("ERROR: out of memory");
+				poll(NULL, 0, 1000);
+				continue;
+			}
+			pfds = newpfds;
+			pfds_size = n;
+		}
+		n = 0;
+#ifndef WIN32
+		if (companion_events.wakeup[0] >= 0) {
+			pfds[n].fd = companion_events.wakeup[0];
+			pfds[n].events = POLLIN;
+			pfds[n].revents = 0;
+			n++;
+			first = n;
+		}
+#endif
+		for (listener = companion_events.listeners; listener; listener = listener->next) {
+			pfds[n].fd = listener->fd;
+			pfds[n].events = POLLIN;
+			pfds[n].revents = 0;
+			listener->pfd_index = n++;
+		}
+		mutex_unlock(&companion_events.mutex);
+
+#ifdef WIN32
+		int timeout = COMPANION_PROXY_EVENTS_MAX_WAIT;
+#else
+		int timeout = (companion_events.wakeup[0] >= 0) ? -1 : 1000;
+#endif
+		int ready = poll(pfds, n, timeout);
+		if (ready < 0) {
+			if (errno != EINTR)
+				debug_info("poll failed: %s", strerror(errno));
+			continue;
+		}
+#ifndef WIN32
+		if (first > 0 && ready > 0 && (pfds[0].revents & POLLIN)) {
+			char buf[64];
+			while (read(companion_events.wakeup[0], buf, sizeof(buf)) > 0);
+		}
+#endif
+		if (ready == 0)
+			continue;
+
+		mutex_lock(&companion_events.mutex);
+		struct companion_proxy_listener **prev = &companion_events.listeners;
+		while ((listener = *prev) != NULL) {
+			/* listeners added while waiting have no poll entry yet */
+			if (listener->pfd_index >= (int)first && (pfds[listener->pfd_index].revents & (POLLIN | POLLHUP | POLLERR))) {
+				if (companion_events_read(listener) < 0) {
+					*prev = listener->next;
+					listener->client->listener = NULL;
+					free(listener);
+					continue;
+				}
+			}
+			prev = &listener->next;
+		}
+		mutex_unlock(&companion_events.mutex);
 	}
 
-	client->event_thread = THREAD_T_NULL;
-	free(data);
+	free(pfds);
+
+	debug_info("Exiting");
 
 	return NULL;
 }
@@ -233,37 +366,90 @@ LIBIMOBILEDEVICE_API companion_proxy_error_t companion_proxy_start_listening_for
 		return COMPANION_PROXY_E_INVALID_ARG;
 	}
 
-	if (client->event_thread) {
+	thread_once(&companion_events_once, companion_events_init);
+
+	mutex_lock(&companion_events.mutex);
+	int listening = (client->listener != NULL);
+	mutex_unlock(&companion_events.mutex);
+	if (listening) {
 		return COMPANION_PROXY_E_OP_IN_PROGRESS;
 	}
 
-	companion_proxy_error_t res = COMPANION_PROXY_E_UNKNOWN_ERROR;
-	struct companion_proxy_cb_data *data = (struct companion_proxy_cb_data*)malloc(sizeof(struct companion_proxy_cb_data));
-	if (data) {
-		data->client = client;
-		data->cbfunc = callback;
-		data->user_data = userdata;
-
-		if (thread_new(&client->event_thread, companion_proxy_event_thread, data) == 0) {
-			res = COMPANION_PROXY_E_SUCCESS;
-		} else {
-			free(data);
+	struct companion_proxy_listener *listener = (struct companion_proxy_listener*)calloc(1, sizeof(struct companion_proxy_listener));
+	if (!listener) {
+		return COMPANION_PROXY_E_UNKNOWN_ERROR;
+	}
+	listener->client = client;
+	listener->pfd_index = -1;
+	listener->callback = callback;
+	listener->user_data = userdata;
+	if (idevice_connection_get_fd(client->parent->parent->connection, &listener->fd) != IDEVICE_E_SUCCESS) {
+		free(listener);
+		return COMPANION_PROXY_E_UNKNOWN_ERROR;
+	}
+
+	plist_t command = plist_new_dict();
+	plist_dict_set_item(command, "Command", plist_new_string("StartListeningForDevices"));
+	companion_proxy_error_t res = companion_proxy_send(client, command);
+	plist_free(command);
+	if (res != COMPANION_PROXY_E_SUCCESS) {
+		free(listener);
+		return res;
+	}
+
+	mutex_lock(&companion_events.mutex);
+	listener->next = companion_events.listeners;
+	companion_events.listeners = listener;
+	client->listener = listener;
+	if (!companion_events.running) {
+		/* a previous thread is done with the lock already and just exits */
+		if (companion_events.thread != THREAD_T_NULL) {
+			thread_join(companion_events.thread);
+			thread_free(companion_events.thread);
+			companion_events.thread = THREAD_T_NULL;
 		}
+		if (thread_new(&companion_events.thread, companion_events_thread, NULL) != 0) {
+			companion_events.thread = THREAD_T_NULL;
+			companion_events.listeners = listener->next;
+			client->listener = NULL;
+			mutex_unlock(&companion_events.mutex);
+			free(listener);
+			return COMPANION_PROXY_E_UNKNOWN_ERROR;
+		}
+		companion_events.running = 1;
+	} else {
+		companion_events_wakeup();
 	}
-	return res;
+	mutex_unlock(&companion_events.mutex);
+
+	return COMPANION_PROXY_E_SUCCESS;
 }
 
 LIBIMOBILEDEVICE_API companion_proxy_error_t companion_proxy_stop_listening_for_devices(companion_proxy_client_t client)
 {
-	property_list_service_client_t parent = client->parent;
-	client->parent = NULL;
-	if (client->event_thread) {
-		debug_info("joining event thread");
-		thread_join(client->event_thread);
-		thread_free(client->event_thread);
-		client->event_thread = THREAD_T_NULL;
-	}
-	client->parent = parent;
+	if (!client) {
+		return COMPANION_PROXY_E_INVALID_ARG;
+	}
+
+	thread_once(&companion_events_once, companion_events_init);
+
+	/* callbacks run with the lock held, so none is running after this */
+	mutex_lock(&companion_events.mutex);
+	struct companion_proxy_listener *listener = client->listener;
+	if (listener) {
+		struct companion_proxy_listener **prev;
+		for (prev = &companion_events.listeners; *prev; prev = &(*prev)->next) {
+			if (*prev == listener) {
+				*prev = listener->next;
+				break;
+			}
+		}
+		client->listener = NULL;
+		companion_events_wakeup();
+	}
+	mutex_unlock(&companion_events.mutex);
+	free(listener);
+
 	return COMPANION_PROXY_E_SUCCESS;
 }
 
@@ -379,3 +565,216 @@ LIBIMOBILEDEVICE_API companion_proxy_error_t companion_proxy_stop_forwarding_ser
 
 	return res;
 }
+
+static void companion_proxy_session_event_cb(plist_t event, void* userdata)
+{
+	companion_proxy_session_t session = (companion_proxy_session_t)userdata;
+
+	/* any pairing change can make cached registry values stale */
+	mutex_lock(&session->cache_mutex);
+	session->generation++;
+	plist_free(session->registry_cache);
+	session->registry_cache = plist_new_dict();
+	companion_proxy_device_event_cb_t callback = session->callback;
+	void *user_data = session->user_data;
+	mutex_unlock(&session->cache_mutex);
+
+	if (callback) {
+		callback(event, user_data);
+	}
+}
+
+LIBIMOBILEDEVICE_API companion_proxy_error_t companion_proxy_session_new(idevice_t device, const char* label, companion_proxy_session_t* session)
+{
+	if (!device || !session) {
+		return COMPANION_PROXY_E_INVALID_ARG;
+	}
+
+	companion_proxy_session_t session_loc = (companion_proxy_session_t)calloc(1, sizeof(struct companion_proxy_session_private));
+	if (!session_loc) {
+		return COMPANION_PROXY_E_UNKNOWN_ERROR;
+	}
+	session_loc->device = device;
+	session_loc->label = (label) ? strdup(label) : NULL;
+	mutex_init(&session_loc->request_mutex);
+	mutex_init(&session_loc->cache_mutex);
+	session_loc->forwards = plist_new_dict();
+
+	companion_proxy_error_t res = companion_proxy_client_start_service(device, &session_loc->client, label);
+	if (res != COMPANION_PROXY_E_SUCCESS) {
+		companion_proxy_session_free(session_loc);
+		return res;
+	}
+
+	if (companion_proxy_client_start_service(device, &session_loc->events, label) == COMPANION_PROXY_E_SUCCESS) {
+		session_loc->registry_cache = plist_new_dict();
+		if (companion_proxy_start_listening_for_devices(session_loc->events, companion_proxy_session_event_cb, session_loc) != COMPANION_PROXY_E_SUCCESS) {
+			plist_free(session_loc->registry_cache);
+			session_loc->registry_cache = NULL;
+		}
+	}
+	if (!session_loc->registry_cache) {
+		/* without events there is no way to tell when cached values go stale */
+		debug_info("could not listen for device events, registry values will not be cached");
+		companion_proxy_client_free(session_loc->events);
+		session_loc->events = NULL;
+	}
+
+	*session = session_loc;
+
+	return COMPANION_PROXY_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API companion_proxy_error_t companion_proxy_session_free(companion_proxy_session_t session)
+{
+	if (!session) {
+		return COMPANION_PROXY_E_INVALID_ARG;
+	}
+
+	if (session->events) {
+		companion_proxy_client_free(session->events);
+		session->events = NULL;
+	}
+
+	if (session->client) {
+		plist_dict_iter iter = NULL;
+		plist_dict_new_iter(session->forwards, &iter);
+		if (iter) {
+			char *key = NULL;
+			plist_t node = NULL;
+			do {
+				plist_dict_next_item(session->forwards, iter, &key, &node);
+				if (key) {
+					companion_proxy_stop_forwarding_service_port(session->client, (uint16_t)strtoul(key, NULL, 10));
+					free(key);
+					key = NULL;
+				}
+			} while (node);
+			free(iter);
+		}
+		companion_proxy_client_free(session->client);
+	}
+
+	plist_free(session->forwards);
+	plist_free(session->registry_cache);
+	mutex_destroy(&session->request_mutex);
+	mutex_destroy(&session->cache_mutex);
+	free(session->label);
+	free(session);
+
+	return COMPANION_PROXY_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API companion_proxy_error_t companion_proxy_session_set_event_callback(companion_proxy_session_t session, companion_proxy_device_event_cb_t callback, void* userdata)
+{
+	if (!session) {
+		return COMPANION_PROXY_E_INVALID_ARG;
+	}
+
+	mutex_lock(&session->cache_mutex);
+	session->callback = callback;
+	session->user_data = userdata;
+	mutex_unlock(&session->cache_mutex);
+
+	return (session->events) ? COMPANION_PROXY_E_SUCCESS : COMPANION_PROXY_E_UNKNOWN_ERROR;
+}
+
+LIBIMOBILEDEVICE_API companion_proxy_error_t companion_proxy_session_get_value(companion_proxy_session_t session, const char* companion_udid, const char* key, plist_t* value)
+{
+	if (!session || !companion_udid || !key || !value) {
+		return COMPANION_PROXY_E_INVALID_ARG;
+	}
+
+	unsigned int generation = 0;
+	mutex_lock(&session->cache_mutex);
+	if (session->registry_cache) {
+		plist_t node = plist_access_path(session->registry_cache, 2, companion_udid, key);
+		if (node) {
+			*value = plist_copy(node);
+			mutex_unlock(&session->cache_mutex);
+			return COMPANION_PROXY_E_SUCCESS;
+		}
+	}
+	generation = session->generation;
+	mutex_unlock(&session->cache_mutex);
+
+	/* the device closes the connection after the reply, so the persistent
+	 * client used for forwarding is not used for registry lookups */
+	companion_proxy_client_t client = NULL;
+	companion_proxy_error_t res = companion_proxy_client_start_service(session->device, &client, session->label);
+	if (res != COMPANION_PROXY_E_SUCCESS) {
+		return res;
+	}
+	res = companion_proxy_get_value_from_registry(client, companion_udid, key, value);
+	companion_proxy_client_free(client);
+	if (res != COMPANION_PROXY_E_SUCCESS) {
+		return res;
+	}
+
+	mutex_lock(&session->cache_mutex);
+	/* an event in the meantime might have made the value stale already */
+	if (session->registry_cache && session->generation == generation) {
+		plist_t device_values = plist_dict_get_item(session->registry_cache, companion_udid);
+		if (!device_values) {
+			device_values = plist_new_dict();
+			plist_dict_set_item(session->registry_cache, companion_udid, device_values);
+		}
+		plist_dict_set_item(device_values, key, plist_copy(*value));
+	}
+	mutex_unlock(&session->cache_mutex);
+
+	return res;
+}
+
+LIBIMOBILEDEVICE_API companion_proxy_error_t companion_proxy_session_forward_port(companion_proxy_session_t session, uint16_t remote_port, const char* service_name, uint16_t* forward_port, plist_t options)
+{
+	if (!session || !forward_port) {
+		return COMPANION_PROXY_E_INVALID_ARG;
+	}
+
+	char portkey[8];
+	snprintf(portkey, sizeof(portkey), "%u", remote_port);
+
+	mutex_lock(&session->request_mutex);
+	plist_t forward = plist_dict_get_item(session->forwards, portkey);
+	if (forward) {
+		plist_t node = plist_dict_get_item(forward, "ForwardedServiceName");
+		if ((!service_name && !node) || (service_name && node && !plist_string_val_compare(node, service_name))) {
+			uint64_t u64val = 0;
+			plist_get_uint_val(plist_dict_get_item(forward, "CompanionProxyServicePort"), &u64val);
+			*forward_port = (uint16_t)u64val;
+			mutex_unlock(&session->request_mutex);
+			return COMPANION_PROXY_E_SUCCESS;
+		}
+	}
+
+	companion_proxy_error_t res = companion_proxy_start_forwarding_service_port(session->client, remote_port, service_name, forward_port, options);
+	if (res == COMPANION_PROXY_E_SUCCESS) {
+		forward = plist_new_dict();
+		if (service_name) {
+			plist_dict_set_item(forward, "ForwardedServiceName", plist_new_string(service_name));
+		}
+		plist_dict_set_item(forward, "CompanionProxyServicePort", plist_new_uint(*forward_port));
+		plist_dict_set_item(session->forwards, portkey, forward);
+	}
+	mutex_unlock(&session->request_mutex);
+
+	return res;
+}
+
+LIBIMOBILEDEVICE_API companion_proxy_error_t companion_proxy_session_stop_forwarding(companion_proxy_session_t session, uint16_t remote_port)
+{
+	if (!session) {
+		return COMPANION_PROXY_E_INVALID_ARG;
+	}
+
+	char portkey[8];
+	snprintf(portkey, sizeof(portkey), "%u", remote_port);
+
+	mutex_lock(&session->request_mutex);
+	companion_proxy_error_t res = companion_proxy_stop_forwarding_service_port(session->client, remote_port);
+	plist_dict_remove_item(session->forwards, portkey);
+	mutex_unlock(&session->request_mutex);
+
+	return res;
+}
@@ -26,9 +26,33 @@
 #include "property_list_service.h"
 #include "common/thread.h"
 
+/* listens for device events of a client on the shared event thread */
+struct companion_proxy_listener {
+	companion_proxy_client_t client;
+	int fd;
+	int pfd_index;
+	companion_proxy_device_event_cb_t callback;
+	void *user_data;
+	struct companion_proxy_listener *next;
+};
+
 struct companion_proxy_client_private {
 	property_list_service_client_t parent;
-	THREAD_T event_thread;
+	struct companion_proxy_listener *listener;
+};
+
+struct companion_proxy_session_private {
+	idevice_t device;
+	char *label;
+	companion_proxy_client_t client;
+	companion_proxy_client_t events;
+	mutex_t request_mutex;
+	plist_t forwards;
+	mutex_t cache_mutex;
+	plist_t registry_cache;
+	unsigned int generation;
+	companion_proxy_device_event_cb_t callback;
+	void *user_data;
 };
 
 #endif
@@ -25,6 +25,7 @@
 #endif
 #include <string.h>
 #include <stdlib.h>
+#include <ctype.h>
 #define _GNU_SOURCE 1
 #define __USE_GNU 1
 #include <stdio.h>
@@ -85,6 +86,14 @@ LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_new(idevice_t device
 	debugserver_client_t client_loc = (debugserver_client_t) malloc(sizeof(struct debugserver_client_private));
 	client_loc->parent = parent;
 	client_loc->noack_mode = 0;
+	client_loc->recv_buffer = NULL;
+	client_loc->recv_size = 0;
+	client_loc->recv_len = 0;
+	client_loc->recv_pos = 0;
+	client_loc->max_packet_size = 0;
+	client_loc->binary_read_unsupported = 0;
+	client_loc->selected_thread = 0;
+	client_loc->register_cache = NULL;
 
 	*client = client_loc;
 
@@ -99,27 +108,40 @@ LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_start_service(idevic
 	return err;
 }
 
+static void debugserver_client_invalidate_registers(debugserver_client_t client)
+{
+	while (client->register_cache) {
+		struct debugserver_register_cache *entry = client->register_cache;
+		client->register_cache = entry->next;
+		free(entry->data);
+		free(entry);
+	}
+	client->selected_thread = 0;
+}
+
 LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_free(debugserver_client_t client)
 {
 	if (!client)
 		return DEBUGSERVER_E_INVALID_ARG;
 
+	debugserver_client_invalidate_registers(client);
 	debugserver_error_t err = debugserver_error(service_client_free(client->parent));
 	client->parent = NULL;
+	idevice_memory_free(client->recv_buffer);
 	free(client);
 
 	return err;
 }
 
-LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_send(debugserver_client_t client, const char* data, uint32_t size, uint32_t *sent)
+/**
+ * Sends data without touching the register cache, for packets whose
+ * effect on the inferior the caller knows.
+ */
+static debugserver_error_t debugserver_client_send_internal(debugserver_client_t client, const char* data, uint32_t size, uint32_t *sent)
 {
 	debugserver_error_t res = DEBUGSERVER_E_UNKNOWN_ERROR;
 	int bytes = 0;
 
-	if (!client || !data || (size == 0)) {
-		return DEBUGSERVER_E_INVALID_ARG;
-	}
-
 	debug_info("sending %d bytes", size);
 	res = debugserver_error(service_send(client->parent, data, size, (uint32_t*)&bytes));
 	if (bytes <= 0) {
@@ -132,6 +154,18 @@ LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_send(debugserver_cli
 	return res;
 }
 
+LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_send(debugserver_client_t client, const char* data, uint32_t size, uint32_t *sent)
+{
+	if (!client || !data || (size == 0)) {
+		return DEBUGSERVER_E_INVALID_ARG;
+	}
+
+	/* raw data might be anything, including packets resuming the inferior */
+	debugserver_client_invalidate_registers(client);
+
+	return debugserver_client_send_internal(client, data, size, sent);
+}
+
 LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_receive_with_timeout(debugserver_client_t client, char* data, uint32_t size, uint32_t *received, unsigned int timeout)
 {
 	debugserver_error_t res = DEBUGSERVER_E_UNKNOWN_ERROR;
@@ -141,6 +175,18 @@ LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_receive_with_timeout
 		return DEBUGSERVER_E_INVALID_ARG;
 	}
 
+	if (client->recv_len > client->recv_pos) {
+		/* hand out data buffered while reading responses first */
+		uint32_t avail = client->recv_len - client->recv_pos;
+		bytes = (avail < size) ? avail : size;
+		memcpy(data, client->recv_buffer + client->recv_pos, bytes);
+		client->recv_pos += bytes;
+		if (received) {
+			*received = (uint32_t)bytes;
+		}
+		return DEBUGSERVER_E_SUCCESS;
+	}
+
 	res = debugserver_error(service_receive_with_timeout(client->parent, data, size, (uint32_t*)&bytes, timeout));
 	if (bytes <= 0) {
 		debug_info("Could not read data, error %d", res);
@@ -157,6 +203,27 @@ LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_receive(debugserver_
 	return debugserver_client_receive_with_timeout(client, data, size, received, 1000);
 }
 
+LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_get_fd(debugserver_client_t client, int *fd)
+{
+	if (!client || !client->parent || !fd)
+		return DEBUGSERVER_E_INVALID_ARG;
+
+	if (idevice_connection_get_fd(client->parent->connection, fd) != IDEVICE_E_SUCCESS)
+		return DEBUGSERVER_E_UNKNOWN_ERROR;
+
+	return DEBUGSERVER_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_has_pending_data(debugserver_client_t client, int *pending)
+{
+	if (!client || !client->parent || !pending)
+		return DEBUGSERVER_E_INVALID_ARG;
+
+	*pending = (client->recv_len > client->recv_pos) || idevice_connection_has_pending_data(client->parent->connection);
+
+	return DEBUGSERVER_E_SUCCESS;
+}
+
 LIBIMOBILEDEVICE_API debugserver_error_t debugserver_command_new(const char* name, int argc, char* argv[], debugserver_command_t* command)
 {
 	int i;
@@ -241,25 +308,6 @@ static uint32_t debugserver_get_checksum_for_buffer(const char* buffer, uint32_t
 	return checksum;
 }
 
-static int debugserver_response_is_checksum_valid(const char* response, uint32_t size)
-{
-	uint32_t checksum = 0;
-	if ((size - DEBUGSERVER_CHECKSUM_HASH_LENGTH - 1) > 0)
-		checksum = debugserver_get_checksum_for_buffer(&response[1], size - DEBUGSERVER_CHECKSUM_HASH_LENGTH - 1);
-
-	debug_info("checksum: 0x%x", checksum);
-
-	if ((unsigned)debugserver_hex2int(response[size - 2]) != DEBUGSERVER_HEX_DECODE_FIRST_BYTE(checksum))
-		return 0;
-
-	if ((unsigned)debugserver_hex2int(response[size - 1]) != DEBUGSERVER_HEX_DECODE_SECOND_BYTE(checksum))
-		return 0;
-
-	debug_info("valid checksum");
-
-	return 1;
-}
-
 LIBIMOBILEDEVICE_API void debugserver_encode_string(const char* buffer, char** encoded_buffer, uint32_t* encoded_length)
 {
 	uint32_t position;
@@ -326,13 +374,13 @@ static void debugserver_format_command(const char* prefix, const char* command,
 static debugserver_error_t debugserver_client_send_ack(debugserver_client_t client)
 {
 	debug_info("sending ACK");
-	return debugserver_client_send(client, "+", sizeof(char), NULL);
+	return debugserver_client_send_internal(client, "+", sizeof(char), NULL);
 }
 
 static debugserver_error_t debugserver_client_send_noack(debugserver_client_t client)
 {
 	debug_info("sending !ACK");
-	return debugserver_client_send(client, "-", sizeof(char), NULL);
+	return debugserver_client_send_internal(client, "-", sizeof(char), NULL);
 }
 
 LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_set_ack_mode(debugserver_client_t client, int enabled)
@@ -347,140 +395,179 @@ LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_set_ack_mode(debugse
 	return DEBUGSERVER_E_SUCCESS;
 }
 
-static int debugserver_client_receive_internal_check(debugserver_client_t client, char* received_char)
+/**
+ * Reads whatever is available from the device into the receive buffer of
+ * the client, growing it if it is full.
+ */
+static debugserver_error_t debugserver_client_fill_buffer(debugserver_client_t client, unsigned int timeout)
 {
-	debugserver_error_t res = DEBUGSERVER_E_SUCCESS;
-	int did_receive_char = 0;
-	char buffer = 0;
+	if (client->recv_pos > 0) {
+		/* move unconsumed data to the front to make room */
+		memmove(client->recv_buffer, client->recv_buffer + client->recv_pos, client->recv_len - client->recv_pos);
+		client->recv_len -= client->recv_pos;
+		client->recv_pos = 0;
+	}
+	if (client->recv_len == client->recv_size) {
+		uint32_t newsize = (client->recv_size) ? client->recv_size * 2 : DEBUGSERVER_RECV_BUFFER_SIZE;
+		char *newbuf = (char*)idevice_memory_realloc(client->parent->connection->arena, client->recv_buffer, newsize);
+		if (!newbuf) {
+			debug_info("ERROR: out of memory");
+			return DEBUGSERVER_E_UNKNOWN_ERROR;
+		}
+		client->recv_buffer = newbuf;
+		client->recv_size = newsize;
+	}
+
 	uint32_t bytes = 0;
+	debugserver_error_t res = debugserver_error(service_receive_with_timeout(client->parent, client->recv_buffer + client->recv_len, client->recv_size - client->recv_len, &bytes, timeout));
+	if (bytes == 0) {
+		return (res == DEBUGSERVER_E_SUCCESS) ? DEBUGSERVER_E_TIMEOUT : res;
+	}
+	client->recv_len += bytes;
 
-	/* we loop here as we expect an answer */
-	res = debugserver_client_receive_with_timeout(client, &buffer, sizeof(char), &bytes, 1000);
-	if (res == DEBUGSERVER_E_SUCCESS && received_char[0] != 0) {
-		if (memcmp(&buffer, received_char, sizeof(char)) == 0) {
-			did_receive_char = 1;
-		}
-	} else {
-		did_receive_char = 0;
+	return DEBUGSERVER_E_SUCCESS;
+}
+
+/**
+ * Makes sure at least count unconsumed bytes are in the receive buffer.
+ */
+static debugserver_error_t debugserver_client_buffer_ensure(debugserver_client_t client, uint32_t count, unsigned int timeout)
+{
+	debugserver_error_t res = DEBUGSERVER_E_SUCCESS;
+	while (client->recv_len - client->recv_pos < count) {
+		res = debugserver_client_fill_buffer(client, timeout);
+		if (res != DEBUGSERVER_E_SUCCESS)
+			break;
 	}
+	return res;
+}
 
-	if (!did_receive_char) {
-		memcpy(received_char, &buffer, sizeof(char));
+/**
+ * Copies a packet payload, resolving '}' escapes as used by binary packets.
+ *
+ * @return The length of the unescaped payload.
+ */
+static uint32_t debugserver_unescape_payload(const char *payload, uint32_t length, char *out)
+{
+	const char *p = payload;
+	const char *end = payload + length;
+	char *o = out;
+
+	while (p < end) {
+		const char *esc = memchr(p, '}', end - p);
+		if (!esc) {
+			memcpy(o, p, end - p);
+			o += end - p;
+			break;
+		}
+		memcpy(o, p, esc - p);
+		o += esc - p;
+		if (esc + 1 >= end) {
+			break;
+		}
+		*o++ = esc[1] ^ 0x20;
+		p = esc + 2;
 	}
 
-	return did_receive_char;
+	return (uint32_t)(o - out);
 }
 
 LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_receive_response(debugserver_client_t client, char** response, size_t* response_size)
 {
 	debugserver_error_t res = DEBUGSERVER_E_SUCCESS;
 
-	int should_receive = 1;
-	int skip_prefix = 0;
-	char* command_prefix = strdup("$");
-
-	char* buffer = NULL;
-	uint32_t buffer_size = 0;
-	uint32_t buffer_capacity = 0;
+	if (!client)
+		return DEBUGSERVER_E_INVALID_ARG;
 
 	if (response)
 		*response = NULL;
+	if (response_size)
+		*response_size = 0;
 
-	if (!client->noack_mode) {
-		char ack[2] = {'+', '\0'};
-		debug_info("attempting to receive ACK %c", *ack);
-		should_receive = debugserver_client_receive_internal_check(client, ack);
-		debug_info("received char: %c", *ack);
-		if (strncmp(ack, command_prefix, sizeof(char)) == 0) {
-			should_receive = 1;
-			skip_prefix = 1;
-			buffer = malloc(1024);
-			buffer_capacity = 1024;
-			strcpy(buffer, command_prefix);
-			buffer_size += sizeof(char);
-			debug_info("received ACK");
+	/* no response at all is not an error */
+	if (debugserver_client_buffer_ensure(client, 1, 1000) != DEBUGSERVER_E_SUCCESS) {
+		return DEBUGSERVER_E_SUCCESS;
+	}
+
+	if (!client->noack_mode && client->recv_buffer[client->recv_pos] == '+') {
+		debug_info("received ACK");
+		client->recv_pos++;
+		if (debugserver_client_buffer_ensure(client, 1, 1000) != DEBUGSERVER_E_SUCCESS) {
+			return DEBUGSERVER_E_SUCCESS;
 		}
 	}
 
-	debug_info("should_receive: %d, skip_prefix: %d", should_receive, skip_prefix);
+	if (client->recv_buffer[client->recv_pos] != '$') {
+		debug_info("unexpected char %c instead of packet start", client->recv_buffer[client->recv_pos]);
+		client->recv_pos++;
+		return DEBUGSERVER_E_SUCCESS;
+	}
 
-	if (should_receive && !skip_prefix) {
-		debug_info("attempting to receive prefix");
-		should_receive = debugserver_client_receive_internal_check(client, command_prefix);
-		debug_info("received command_prefix: %c", *command_prefix);
-		if (should_receive) {
-			if (buffer) {
-				strcpy(buffer, command_prefix);
+	/* find the end of the packet; '#' is always escaped in the payload */
+	uint32_t scan = 1;
+	uint32_t hash_off = 0;
+	while (1) {
+		uint32_t avail = client->recv_len - client->recv_pos;
+		if (!hash_off && scan < avail) {
+			char *packet = client->recv_buffer + client->recv_pos;
+			char *hash = (char*)memchr(packet + scan, '#', avail - scan);
+			if (hash) {
+				hash_off = (uint32_t)(hash - packet);
 			} else {
-				buffer = malloc(1024);
-				buffer_capacity = 1024;
-				strcpy(buffer, command_prefix);
-				buffer_size += sizeof(char);
+				scan = avail;
 			}
 		}
+		if (hash_off && avail >= hash_off + DEBUGSERVER_CHECKSUM_HASH_LENGTH) {
+			break;
+		}
+		res = debugserver_client_fill_buffer(client, 1000);
+		if (res != DEBUGSERVER_E_SUCCESS) {
+			debug_info("ERROR: incomplete packet, error %d", res);
+			return res;
+		}
 	}
 
-	debug_info("buffer: %*s, should_receive: %d, skip_prefix: %d", buffer_size, buffer, should_receive, skip_prefix);
+	const char *payload = client->recv_buffer + client->recv_pos + 1;
+	const char *hash = client->recv_buffer + client->recv_pos + hash_off;
+	uint32_t payload_length = hash_off - 1;
+	client->recv_pos += hash_off + DEBUGSERVER_CHECKSUM_HASH_LENGTH;
 
-	if (should_receive) {
-		uint32_t checksum_length = DEBUGSERVER_CHECKSUM_HASH_LENGTH;
-		int receiving_checksum_response = 0;
-		debug_info("attempting to read up response until checksum");
+	debug_info("validating response checksum...");
+	int valid = 1;
+	if (!client->noack_mode) {
+		uint32_t checksum = debugserver_get_checksum_for_buffer(payload, payload_length);
+		valid = ((unsigned)debugserver_hex2int(hash[1]) == DEBUGSERVER_HEX_DECODE_FIRST_BYTE(checksum)
+		      && (unsigned)debugserver_hex2int(hash[2]) == DEBUGSERVER_HEX_DECODE_SECOND_BYTE(checksum));
+	}
 
-		while ((checksum_length > 0)) {
-			char data[2] = {'#', '\0'};
-			if (debugserver_client_receive_internal_check(client, data)) {
-				receiving_checksum_response = 1;
-			}
-			if (receiving_checksum_response) {
-				checksum_length--;
+	if (valid) {
+		if (response) {
+			/* assemble response string */
+			*response = (char*)malloc(payload_length + 1);
+			if (!*response) {
+				return DEBUGSERVER_E_UNKNOWN_ERROR;
 			}
-			if (buffer_size + 1 >= buffer_capacity) {
-				char* newbuffer = realloc(buffer, buffer_capacity+1024);
-				if (!newbuffer) {
-					return DEBUGSERVER_E_UNKNOWN_ERROR;
-				}
-				buffer = newbuffer;
-				buffer[buffer_capacity] = '\0';
-				buffer_capacity += 1024;
-			}
-			strcat(buffer, data);
-			buffer_size += sizeof(char);
+			uint32_t resp_size = debugserver_unescape_payload(payload, payload_length, *response);
+			(*response)[resp_size] = '\0';
+			if (response_size) *response_size = resp_size;
 		}
-		debug_info("validating response checksum...");
-		if (client->noack_mode || debugserver_response_is_checksum_valid(buffer, buffer_size)) {
-			if (response) {
-				/* assemble response string */
-				uint32_t resp_size = sizeof(char) * (buffer_size - DEBUGSERVER_CHECKSUM_HASH_LENGTH - 1);
-				*response = (char*)malloc(resp_size + 1);
-				memcpy(*response, buffer + 1, resp_size);
-				(*response)[resp_size] = '\0';
-				if (response_size) *response_size = resp_size;
-			}
-			if (!client->noack_mode) {
-				/* confirm valid command */
-				debugserver_client_send_ack(client);
-			}
-		} else {
-			/* response was invalid */
-			res = DEBUGSERVER_E_RESPONSE_ERROR;
-			if (!client->noack_mode) {
-				/* report invalid command */
-				debugserver_client_send_noack(client);
-			}
+		if (!client->noack_mode) {
+			/* confirm valid command */
+			debugserver_client_send_ack(client);
+		}
+	} else {
+		/* response was invalid */
+		res = DEBUGSERVER_E_RESPONSE_ERROR;
+		if (!client->noack_mode) {
+			/* report invalid command */
+			debugserver_client_send_noack(client);
 		}
 	}
 
-	if (response) {
+	if (response && *response) {
 		debug_info("response: %s", *response);
 	}
 
-	if (buffer)
-		free(buffer);
-
-	if (command_prefix)
-		free(command_prefix);
-
 	return res;
 }
 
@@ -503,12 +590,15 @@ LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_send_command(debugse
 
 	debug_info("command_arguments(%d): %s", command->argc, command_arguments);
 
+	/* any command might change the state of the inferior */
+	debugserver_client_invalidate_registers(client);
+
 	/* encode command arguments, add checksum if required and assemble entire command */
 	debugserver_format_command("$", command->name, command_arguments, 1, &send_buffer, &send_buffer_size);
 
 	debug_info("sending encoded command: %s", send_buffer);
 
-	res = debugserver_client_send(client, send_buffer, send_buffer_size, &bytes);
+	res = debugserver_client_send_internal(client, send_buffer, send_buffer_size, &bytes);
 	debug_info("command result: %d", res);
 	if (res != DEBUGSERVER_E_SUCCESS) {
 		goto cleanup;
@@ -540,6 +630,389 @@ cleanup:
 	return res;
 }
 
+/**
+ * Sends a single packet with the given contents, without waiting for the
+ * response.
+ */
+static debugserver_error_t debugserver_client_send_packet(debugserver_client_t client, const char *packet)
+{
+	char *send_buffer = NULL;
+	uint32_t send_buffer_size = 0;
+
+	debugserver_format_command("$", packet, NULL, 1, &send_buffer, &send_buffer_size);
+	debugserver_error_t res = debugserver_client_send_internal(client, send_buffer, send_buffer_size, NULL);
+	free(send_buffer);
+
+	return res;
+}
+
+/**
+ * Sends a packet and receives its response. Unlike
+ * debugserver_client_receive_response() a missing response is an error.
+ */
+static debugserver_error_t debugserver_client_request(debugserver_client_t client, const char *packet, char **response, size_t *response_size)
+{
+	debugserver_error_t res = debugserver_client_send_packet(client, packet);
+	if (res != DEBUGSERVER_E_SUCCESS)
+		return res;
+
+	res = debugserver_client_receive_response(client, response, response_size);
+	if (res == DEBUGSERVER_E_SUCCESS && !*response)
+		res = DEBUGSERVER_E_TIMEOUT;
+
+	return res;
+}
+
+/**
+ * Checks for an error reply "Exx" with a two digit hex error number. Only
+ * meaningful for replies that are hex encoded otherwise, as those never
+ * have an odd length.
+ */
+static int debugserver_response_is_error(const char *response, size_t size)
+{
+	return (size == 3 && response[0] == 'E' && isxdigit((unsigned char)response[1]) && isxdigit((unsigned char)response[2]));
+}
+
+/**
+ * Receives and discards the responses to requests still in flight.
+ */
+static void debugserver_client_drain_responses(debugserver_client_t client, uint32_t count)
+{
+	while (count-- > 0) {
+		char *response = NULL;
+		if (debugserver_client_receive_response(client, &response, NULL) != DEBUGSERVER_E_SUCCESS || !response)
+			break;
+		free(response);
+	}
+}
+
+static struct debugserver_register_cache *debugserver_client_find_register(debugserver_client_t client, uint64_t thread_id, int32_t regnum)
+{
+	struct debugserver_register_cache *entry;
+	for (entry = client->register_cache; entry; entry = entry->next) {
+		if (entry->thread_id == thread_id && entry->regnum == regnum)
+			return entry;
+	}
+	return NULL;
+}
+
+static void debugserver_client_cache_register(debugserver_client_t client, uint64_t thread_id, int32_t regnum, const char *data, size_t size)
+{
+	struct debugserver_register_cache *entry = (struct debugserver_register_cache*)malloc(sizeof(struct debugserver_register_cache));
+	if (!entry)
+		return;
+	entry->data = (char*)malloc(size ? size : 1);
+	if (!entry->data) {
+		free(entry);
+		return;
+	}
+	memcpy(entry->data, data, size);
+	entry->size = size;
+	entry->thread_id = thread_id;
+	entry->regnum = regnum;
+	entry->next = client->register_cache;
+	client->register_cache = entry;
+}
+
+/**
+ * Decodes register contents from hex notation. Bytes the debugserver
+ * reports as unavailable ("xx") are set to 0.
+ */
+static size_t debugserver_decode_register_data(const char *encoded, size_t encoded_length, char *out)
+{
+	size_t i;
+	for (i = 0; i + 1 < encoded_length; i += 2) {
+		if (encoded[i] == 'x') {
+			out[i / 2] = 0;
+		} else {
+			out[i / 2] = (char)(debugserver_hex2int(encoded[i]) << 4 | debugserver_hex2int(encoded[i + 1]));
+		}
+	}
+	return encoded_length / 2;
+}
+
+/**
+ * Makes the given thread the one for subsequent register accesses.
+ */
+static debugserver_error_t debugserver_client_select_thread(debugserver_client_t client, uint64_t thread_id)
+{
+	if (thread_id == 0 || client->selected_thread == thread_id)
+		return DEBUGSERVER_E_SUCCESS;
+
+	char packet[32];
+	char *response = NULL;
+	size_t response_size = 0;
+	snprintf(packet, sizeof(packet), "Hg%llx", (unsigned long long)thread_id);
+	debugserver_error_t res = debugserver_client_request(client, packet, &response, &response_size);
+	if (res == DEBUGSERVER_E_SUCCESS && strcmp(response, "OK") != 0) {
+		debug_info("ERROR: could not select thread %llx: %s", (unsigned long long)thread_id, response);
+		res = DEBUGSERVER_E_RESPONSE_ERROR;
+	}
+	free(response);
+	if (res == DEBUGSERVER_E_SUCCESS)
+		client->selected_thread = thread_id;
+
+	return res;
+}
+
+/**
+ * Gets the maximum packet size the debugserver accepts, asking it once.
+ */
+static uint32_t debugserver_client_get_max_packet_size(debugserver_client_t client)
+{
+	if (client->max_packet_size > 0)
+		return client->max_packet_size;
+
+	client->max_packet_size = DEBUGSERVER_DEFAULT_PACKET_SIZE;
+
+	char *response = NULL;
+	size_t response_size = 0;
+	if (debugserver_client_request(client, "qSupported", &response, &response_size) == DEBUGSERVER_E_SUCCESS) {
+		const char *p = strstr(response, "PacketSize=");
+		if (p) {
+			unsigned long size = strtoul(p + 11, NULL, 16);
+			if (size > 64)
+				client->max_packet_size = (uint32_t)size;
+		}
+	}
+	free(response);
+	debug_info("max packet size: %u", client->max_packet_size);
+
+	return client->max_packet_size;
+}
+
+LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_read_memory(debugserver_client_t client, uint64_t address, uint32_t size, char *data, uint32_t *bytes_read)
+{
+	if (!client || !data || !bytes_read || size == 0)
+		return DEBUGSERVER_E_INVALID_ARG;
+
+	*bytes_read = 0;
+
+	/* leave room for the packet framing and hex encoding of 'm' replies */
+	uint32_t chunk = (debugserver_client_get_max_packet_size(client) - 16) / 2;
+	/* ack mode needs every packet confirmed, so nothing can be pipelined */
+	uint32_t window = (client->noack_mode) ? DEBUGSERVER_MEMORY_READ_WINDOW : 1;
+	uint32_t requested = 0;
+	uint32_t received = 0;
+	uint32_t in_flight = 0;
+	debugserver_error_t res = DEBUGSERVER_E_SUCCESS;
+
+	while (received < size) {
+		int binary = !client->binary_read_unsupported;
+
+		/* keep a number of requests in flight */
+		while (requested < size && in_flight < window) {
+			char packet[48];
+			uint32_t length = (size - requested < chunk) ? size - requested : chunk;
+			snprintf(packet, sizeof(packet), "%c%llx,%x", (binary) ? 'x' : 'm', (unsigned long long)(address + requested), length);
+			res = debugserver_client_send_packet(client, packet);
+			if (res != DEBUGSERVER_E_SUCCESS)
+				break;
+			requested += length;
+			in_flight++;
+		}
+		if (in_flight == 0)
+			break;
+
+		uint32_t expected = (size - received < chunk) ? size - received : chunk;
+		char *response = NULL;
+		size_t response_size = 0;
+		res = debugserver_client_receive_response(client, &response, &response_size);
+		in_flight--;
+		if (res == DEBUGSERVER_E_SUCCESS && !response)
+			res = DEBUGSERVER_E_TIMEOUT;
+		if (res != DEBUGSERVER_E_SUCCESS)
+			break;
+
+		/* binary data of the requested length can look like an error reply */
+		if (!(binary && response_size == expected) && debugserver_response_is_error(response, response_size)) {
+			debug_info("memory read at 0x%llx failed: %s", (unsigned long long)(address + received), response);
+			free(response);
+			res = DEBUGSERVER_E_RESPONSE_ERROR;
+			break;
+		}
+
+		uint32_t got = 0;
+		if (binary) {
+			if (response_size == 0 && received == 0 && !client->binary_read_unsupported) {
+				/* empty reply: 'x' is not supported, start over with 'm' */
+				debug_info("binary memory reads not supported");
+				free(response);
+				debugserver_client_drain_responses(client, in_flight);
+				in_flight = 0;
+				requested = 0;
+				client->binary_read_unsupported = 1;
+				continue;
+			}
+			got = (response_size < expected) ? (uint32_t)response_size : expected;
+			memcpy(data + received, response, got);
+		} else {
+			size_t hexlen = (response_size / 2 < expected) ? response_size : expected * 2;
+			got = (uint32_t)debugserver_decode_register_data(response, hexlen, data + received);
+		}
+		free(response);
+		received += got;
+
+		if (got < expected) {
+			/* the memory ends here, later requests fail anyway */
+			break;
+		}
+	}
+
+	debugserver_client_drain_responses(client, in_flight);
+
+	*bytes_read = received;
+	if (received > 0 && res == DEBUGSERVER_E_RESPONSE_ERROR)
+		res = DEBUGSERVER_E_SUCCESS;
+
+	return res;
+}
+
+LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_read_registers(debugserver_client_t client, uint64_t thread_id, char **data, size_t *size)
+{
+	if (!client || !data || !size)
+		return DEBUGSERVER_E_INVALID_ARG;
+
+	*data = NULL;
+	*size = 0;
+
+	struct debugserver_register_cache *entry = debugserver_client_find_register(client, thread_id, -1);
+	if (!entry) {
+		debugserver_error_t res = debugserver_client_select_thread(client, thread_id);
+		if (res != DEBUGSERVER_E_SUCCESS)
+			return res;
+
+		char *response = NULL;
+		size_t response_size = 0;
+		res = debugserver_client_request(client, "g", &response, &response_size);
+		if (res != DEBUGSERVER_E_SUCCESS)
+			return res;
+		if (response_size == 0 || debugserver_response_is_error(response, response_size)) {
+			free(response);
+			return DEBUGSERVER_E_RESPONSE_ERROR;
+		}
+		/* decoding in place is fine, it never overtakes the input */
+		size_t length = debugserver_decode_register_data(response, response_size, response);
+		debugserver_client_cache_register(client, thread_id, -1, response, length);
+		*data = response;
+		*size = length;
+		return DEBUGSERVER_E_SUCCESS;
+	}
+
+	*data = (char*)malloc(entry->size ? entry->size : 1);
+	if (!*data)
+		return DEBUGSERVER_E_UNKNOWN_ERROR;
+	memcpy(*data, entry->data, entry->size);
+	*size = entry->size;
+
+	return DEBUGSERVER_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_read_register_list(debugserver_client_t client, uint64_t thread_id, const uint32_t *regnums, uint32_t count, char **values, size_t *sizes)
+{
+	if (!client || !regnums || !values || !sizes || count == 0)
+		return DEBUGSERVER_E_INVALID_ARG;
+
+	uint32_t i;
+	for (i = 0; i < count; i++) {
+		values[i] = NULL;
+		sizes[i] = 0;
+	}
+
+	debugserver_error_t res = debugserver_client_select_thread(client, thread_id);
+	if (res != DEBUGSERVER_E_SUCCESS)
+		return res;
+
+	uint32_t window = (client->noack_mode) ? count : 1;
+	uint32_t next = 0;
+	uint32_t in_flight = 0;
+	/* marks the registers a request was sent for */
+	char *requested = (char*)calloc(count, 1);
+	if (!requested)
+		return DEBUGSERVER_E_UNKNOWN_ERROR;
+
+	for (i = 0; i < count && res == DEBUGSERVER_E_SUCCESS; i++) {
+		struct debugserver_register_cache *entry = (requested[i]) ? NULL : debugserver_client_find_register(client, thread_id, (int32_t)regnums[i]);
+		if (entry) {
+			values[i] = (char*)malloc(entry->size ? entry->size : 1);
+			if (!values[i]) {
+				res = DEBUGSERVER_E_UNKNOWN_ERROR;
+				break;
+			}
+			memcpy(values[i], entry->data, entry->size);
+			sizes[i] = entry->size;
+			continue;
+		}
+
+		/* send requests for the following uncached registers up front */
+		if (next <= i)
+			next = i;
+		while (next < count && in_flight < window) {
+			if (debugserver_client_find_register(client, thread_id, (int32_t)regnums[next])) {
+				next++;
+				continue;
+			}
+			char packet[16];
+			snprintf(packet, sizeof(packet), "p%x", regnums[next]);
+			res = debugserver_client_send_packet(client, packet);
+			if (res != DEBUGSERVER_E_SUCCESS)
+				break;
+			requested[next++] = 1;
+			in_flight++;
+		}
+		if (res != DEBUGSERVER_E_SUCCESS)
+			break;
+
+		char *response = NULL;
+		size_t response_size = 0;
+		res = debugserver_client_receive_response(client, &response, &response_size);
+		in_flight--;
+		if (res == DEBUGSERVER_E_SUCCESS && !response)
+			res = DEBUGSERVER_E_TIMEOUT;
+		if (res != DEBUGSERVER_E_SUCCESS)
+			break;
+		if (response_size == 0 || debugserver_response_is_error(response, response_size)) {
+			debug_info("could not read register %u: %s", regnums[i], response);
+			free(response);
+			res = DEBUGSERVER_E_RESPONSE_ERROR;
+			break;
+		}
+		sizes[i] = debugserver_decode_register_data(response, response_size, response);
+		values[i] = response;
+		debugserver_client_cache_register(client, thread_id, (int32_t)regnums[i], response, sizes[i]);
+	}
+
+	debugserver_client_drain_responses(client, in_flight);
+	free(requested);
+
+	if (res != DEBUGSERVER_E_SUCCESS) {
+		for (i = 0; i < count; i++) {
+			free(values[i]);
+			values[i] = NULL;
+			sizes[i] = 0;
+		}
+	}
+
+	return res;
+}
+
+LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_vcont(debugserver_client_t client, const char *actions, char **response, size_t *response_size)
+{
+	if (!client || !actions)
+		return DEBUGSERVER_E_INVALID_ARG;
+
+	/* the inferior runs, cached state is stale from here on */
+	debugserver_client_invalidate_registers(client);
+
+	char *packet = string_concat("vCont;", actions, NULL);
+	debugserver_error_t res = debugserver_client_send_packet(client, packet);
+	free(packet);
+	if (res != DEBUGSERVER_E_SUCCESS)
+		return res;
+
+	return debugserver_client_receive_response(client, response, response_size);
+}
+
 LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_set_environment_hex_encoded(debugserver_client_t client, const char* env, char** response)
 {
 	if (!client || !env)
@@ -559,12 +1032,13 @@ LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_set_environment_hex_
 	return result;
 }
 
-LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_set_argv(debugserver_client_t client, int argc, char* argv[], char** response)
+/**
+ * Builds the payload of an 'A' packet that sets the argv of the inferior.
+ *
+ * @return The payload, to be freed by the caller.
+ */
+static char *debugserver_format_argv(int argc, char* argv[])
 {
-	if (!client || !argc)
-		return DEBUGSERVER_E_INVALID_ARG;
-
-	debugserver_error_t result = DEBUGSERVER_E_UNKNOWN_ERROR;
 	char *pkt = NULL;
 	int pkt_len = 0;
 	int i = 0;
@@ -618,6 +1092,17 @@ LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_set_argv(debugserver
 
 	pkt[0] = 'A';
 
+	return pkt;
+}
+
+LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_set_argv(debugserver_client_t client, int argc, char* argv[], char** response)
+{
+	if (!client || !argc)
+		return DEBUGSERVER_E_INVALID_ARG;
+
+	debugserver_error_t result = DEBUGSERVER_E_UNKNOWN_ERROR;
+	char *pkt = debugserver_format_argv(argc, argv);
+
 	debugserver_command_t command = NULL;
 	debugserver_command_new(pkt, 0, NULL, &command);
 	result = debugserver_client_send_command(client, command, response, NULL);
@@ -628,3 +1113,126 @@ LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_set_argv(debugserver
 
 	return result;
 }
+
+/**
+ * Appends a framed packet to a buffer of packets to be sent at once.
+ */
+static void debugserver_append_packet(char **buffer, uint32_t *length, const char *command, const char *arguments)
+{
+	char *packet = NULL;
+	uint32_t size = 0;
+
+	debugserver_format_command("$", command, arguments, 1, &packet, &size);
+	char *grown = (char*)realloc(*buffer, *length + size);
+	if (grown) {
+		memcpy(grown + *length, packet, size);
+		*buffer = grown;
+		*length += size;
+	}
+	free(packet);
+}
+
+/**
+ * Receives a response, waiting up to the given number of seconds for it
+ * to arrive. A missing response is an error.
+ */
+static debugserver_error_t debugserver_client_receive_response_wait(debugserver_client_t client, char **response, size_t *response_size, unsigned int seconds)
+{
+	debugserver_error_t res;
+	do {
+		/* each attempt waits about a second for the reply to start */
+		res = debugserver_client_receive_response(client, response, response_size);
+	} while (res == DEBUGSERVER_E_SUCCESS && !*response && seconds-- > 1);
+
+	if (res == DEBUGSERVER_E_SUCCESS && !*response)
+		res = DEBUGSERVER_E_TIMEOUT;
+
+	return res;
+}
+
+LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_launch(debugserver_client_t client, int argc, char* argv[], char* env[], char** response)
+{
+	if (!client || argc <= 0 || !argv)
+		return DEBUGSERVER_E_INVALID_ARG;
+
+	if (response)
+		*response = NULL;
+
+	debugserver_error_t res = DEBUGSERVER_E_SUCCESS;
+	char *reply = NULL;
+	size_t reply_size = 0;
+
+	/* without acks the packets can be sent back to back */
+	if (!client->noack_mode) {
+		res = debugserver_client_request(client, "QStartNoAckMode", &reply, &reply_size);
+		if (res != DEBUGSERVER_E_SUCCESS) {
+			return res;
+		}
+		if (strcmp(reply, "OK") != 0) {
+			debug_info("ERROR: could not disable ack mode: %s", reply);
+			if (response)
+				*response = reply;
+			else
+				free(reply);
+			return DEBUGSERVER_E_RESPONSE_ERROR;
+		}
+		free(reply);
+		reply = NULL;
+		debugserver_client_set_ack_mode(client, 0);
+	}
+
+	/* the inferior changes, nothing cached applies anymore */
+	debugserver_client_invalidate_registers(client);
+
+	char *buffer = NULL;
+	uint32_t length = 0;
+	uint32_t count = 0;
+	int i;
+	for (i = 0; env && env[i]; i++) {
+		debug_info("environment[%d] = \"%s\"", i, env[i]);
+		debugserver_append_packet(&buffer, &length, "QEnvironmentHexEncoded:", env[i]);
+		count++;
+	}
+	char *pkt = debugserver_format_argv(argc, argv);
+	debugserver_append_packet(&buffer, &length, pkt, NULL);
+	free(pkt);
+	count++;
+	debugserver_append_packet(&buffer, &length, "qLaunchSuccess", NULL);
+	count++;
+
+	debug_info("sending %u launch packets in %u bytes", count, length);
+	res = debugserver_client_send_internal(client, buffer, length, NULL);
+	free(buffer);
+	if (res != DEBUGSERVER_E_SUCCESS) {
+		return res;
+	}
+
+	/* check all replies in order, keeping the first failure */
+	uint32_t received = 0;
+	while (received < count) {
+		/* qLaunchSuccess is only answered once the app has been spawned */
+		unsigned int wait = (received == count - 1) ? DEBUGSERVER_LAUNCH_TIMEOUT : 1;
+		res = debugserver_client_receive_response_wait(client, &reply, &reply_size, wait);
+		if (res != DEBUGSERVER_E_SUCCESS)
+			break;
+		received++;
+		if (strcmp(reply, "OK") != 0) {
+			debug_info("ERROR: launch packet %u failed: %s", received - 1, reply);
+			res = DEBUGSERVER_E_RESPONSE_ERROR;
+			break;
+		}
+		free(reply);
+		reply = NULL;
+	}
+
+	if (received < count && res != DEBUGSERVER_E_TIMEOUT) {
+		debugserver_client_drain_responses(client, count - received);
+	}
+
+	if (response)
+		*response = reply;
+	else
+		free(reply);
+
+	return res;
+}
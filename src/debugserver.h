@@ -26,10 +26,31 @@
 #include "service.h"
 
 #define DEBUGSERVER_CHECKSUM_HASH_LENGTH 0x3
+#define DEBUGSERVER_RECV_BUFFER_SIZE 65536
+#define DEBUGSERVER_DEFAULT_PACKET_SIZE 1024
+#define DEBUGSERVER_MEMORY_READ_WINDOW 8
+/* seconds to wait for the reply to qLaunchSuccess */
+#define DEBUGSERVER_LAUNCH_TIMEOUT 30
+
+struct debugserver_register_cache {
+	uint64_t thread_id;
+	int32_t regnum; /* -1 for the full register set */
+	char *data;
+	size_t size;
+	struct debugserver_register_cache *next;
+};
 
 struct debugserver_client_private {
 	service_client_t parent;
 	int noack_mode;
+	char *recv_buffer;
+	uint32_t recv_size;
+	uint32_t recv_len;
+	uint32_t recv_pos;
+	uint32_t max_packet_size;
+	int binary_read_unsupported;
+	uint64_t selected_thread;
+	struct debugserver_register_cache *register_cache;
 };
 
 struct debugserver_command_private {
@@ -376,11 +376,15 @@ device_link_service_error_t device_link_service_receive_message(device_link_serv
 }
 
 /**
- * Receives a DLMessageProcessMessage plist.
+ * Receives a DLMessageProcessMessage plist without copying the contents out
+ * of the received message.
  *
  * @param client The connected device link service client used for receiving.
+ * @param envelope Pointer to a plist that will be set to the received
+ *    message upon successful return. It has to be freed by the caller.
  * @param message Pointer to a plist that will be set to the contents of the
- *    message contents upon successful return.
+ *    message upon successful return. It is part of envelope and must not
+ *    be freed.
  *
  * @return DEVICE_LINK_SERVICE_E_SUCCESS when a DLMessageProcessMessage was
  *    received, DEVICE_LINK_SERVICE_E_INVALID_ARG when client or message is
@@ -388,11 +392,14 @@ device_link_service_error_t device_link_service_receive_message(device_link_serv
  *    invalid or is not a DLMessageProcessMessage,
  *    or DEVICE_LINK_SERVICE_E_MUX_ERROR if receiving from device fails.
  */
-device_link_service_error_t device_link_service_receive_process_message(device_link_service_client_t client, plist_t *message)
+device_link_service_error_t device_link_service_receive_process_message_envelope(device_link_service_client_t client, plist_t *envelope, plist_t *message)
 {
-	if (!client || !client->parent || !message)
+	if (!client || !client->parent || !envelope || !message)
 		return DEVICE_LINK_SERVICE_E_INVALID_ARG;
 
+	*envelope = NULL;
+	*message = NULL;
+
 	plist_t pmsg = NULL;
 	device_link_service_error_t err = device_link_error(property_list_service_receive_plist(client->parent, &pmsg));
 	if (err != DEVICE_LINK_SERVICE_E_SUCCESS) {
@@ -417,10 +424,11 @@ device_link_service_error_t device_link_service_receive_process_message(device_l
 
 	plist_t msg_loc = plist_array_get_item(pmsg, 1);
 	if (msg_loc) {
-		*message = plist_copy(msg_loc);
+		*envelope = pmsg;
+		*message = msg_loc;
+		pmsg = NULL;
 		err = DEVICE_LINK_SERVICE_E_SUCCESS;
 	} else {
-		*message = NULL;
 		err = DEVICE_LINK_SERVICE_E_PLIST_ERROR;
 	}
 
@@ -433,6 +441,80 @@ leave:
 	return err;
 }
 
+/**
+ * Receives a DLMessageProcessMessage plist and looks up a data node in the
+ * contained message, without copying the data.
+ *
+ * @param client The connected device link service client used for receiving.
+ * @param key The key of the data node in the message dictionary.
+ * @param envelope Pointer to a plist that will be set to the received
+ *    message upon successful return. The data belongs to it, so it has to
+ *    be kept alive while the data is in use and freed by the caller after.
+ * @param data Pointer that will be set to the contents of the data node.
+ * @param length Pointer that will be set to the length of the data.
+ *
+ * @return DEVICE_LINK_SERVICE_E_SUCCESS on success,
+ *    DEVICE_LINK_SERVICE_E_INVALID_ARG when an argument is invalid,
+ *    DEVICE_LINK_SERVICE_E_PLIST_ERROR if the received plist is not a
+ *    DLMessageProcessMessage or the message has no data node for key,
+ *    or DEVICE_LINK_SERVICE_E_MUX_ERROR if receiving from device fails.
+ */
+device_link_service_error_t device_link_service_receive_process_message_data(device_link_service_client_t client, const char *key, plist_t *envelope, const char **data, uint64_t *length)
+{
+	if (!key || !data || !length)
+		return DEVICE_LINK_SERVICE_E_INVALID_ARG;
+
+	*data = NULL;
+	*length = 0;
+
+	plist_t msg = NULL;
+	device_link_service_error_t err = device_link_service_receive_process_message_envelope(client, envelope, &msg);
+	if (err != DEVICE_LINK_SERVICE_E_SUCCESS) {
+		return err;
+	}
+
+	plist_t node = (plist_get_node_type(msg) == PLIST_DICT) ? plist_dict_get_item(msg, key) : NULL;
+	if (!node || plist_get_node_type(node) != PLIST_DATA) {
+		debug_info("no data node for key %s in DLMessageProcessMessage", key);
+		plist_free(*envelope);
+		*envelope = NULL;
+		return DEVICE_LINK_SERVICE_E_PLIST_ERROR;
+	}
+
+	*data = plist_get_data_ptr(node, length);
+
+	return DEVICE_LINK_SERVICE_E_SUCCESS;
+}
+
+/**
+ * Receives a DLMessageProcessMessage plist.
+ *
+ * @param client The connected device link service client used for receiving.
+ * @param message Pointer to a plist that will be set to the contents of the
+ *    message contents upon successful return.
+ *
+ * @return DEVICE_LINK_SERVICE_E_SUCCESS when a DLMessageProcessMessage was
+ *    received, DEVICE_LINK_SERVICE_E_INVALID_ARG when client or message is
+ *    invalid, DEVICE_LINK_SERVICE_E_PLIST_ERROR if the received plist is
+ *    invalid or is not a DLMessageProcessMessage,
+ *    or DEVICE_LINK_SERVICE_E_MUX_ERROR if receiving from device fails.
+ */
+device_link_service_error_t device_link_service_receive_process_message(device_link_service_client_t client, plist_t *message)
+{
+	if (!client || !client->parent || !message)
+		return DEVICE_LINK_SERVICE_E_INVALID_ARG;
+
+	plist_t envelope = NULL;
+	plist_t msg_loc = NULL;
+	device_link_service_error_t err = device_link_service_receive_process_message_envelope(client, &envelope, &msg_loc);
+	if (err == DEVICE_LINK_SERVICE_E_SUCCESS) {
+		*message = plist_copy(msg_loc);
+		plist_free(envelope);
+	}
+
+	return err;
+}
+
 /**
  * Generic device link service send function.
  *
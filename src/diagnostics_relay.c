@@ -24,8 +24,14 @@
 #endif
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <sys/time.h>
+#ifdef WIN32
+#include <windows.h>
+#endif
 #include "diagnostics_relay.h"
 #include "property_list_service.h"
+#include "idevice.h"
 #include "common/debug.h"
 
 #define RESULT_SUCCESS 0
@@ -328,48 +334,195 @@ LIBIMOBILEDEVICE_API diagnostics_relay_error_t diagnostics_relay_request_diagnos
 	return ret;
 }
 
+/*
+ * MobileGestalt values that can't change for a device are cached by UDID
+ * for the lifetime of the process, so that repeated queries only ask the
+ * device for the remaining keys.
+ */
+static const char *diagnostics_relay_immutable_gestalt_keys[] = {
+	"BluetoothAddress",
+	"BoardId",
+	"ChipID",
+	"CPUArchitecture",
+	"DieId",
+	"EthernetMacAddress",
+	"HardwareModel",
+	"HardwarePlatform",
+	"InternationalMobileEquipmentIdentity",
+	"MLBSerialNumber",
+	"MobileEquipmentIdentifier",
+	"ModelNumber",
+	"ProductType",
+	"SerialNumber",
+	"UniqueChipID",
+	"UniqueDeviceID",
+	"WifiAddress",
+	NULL
+};
+
+static struct {
+	mutex_t mutex;
+	plist_t devices;
+} diagnostics_relay_gestalt_cache;
+
+static thread_once_t diagnostics_relay_gestalt_cache_once = THREAD_ONCE_INIT;
+
+static void diagnostics_relay_gestalt_cache_init(void)
+{
+	mutex_init(&diagnostics_relay_gestalt_cache.mutex);
+	diagnostics_relay_gestalt_cache.devices = plist_new_dict();
+}
+
+static int diagnostics_relay_gestalt_key_is_immutable(const char *key)
+{
+	int i;
+	for (i = 0; diagnostics_relay_immutable_gestalt_keys[i]; i++) {
+		if (!strcmp(diagnostics_relay_immutable_gestalt_keys[i], key))
+			return 1;
+	}
+	return 0;
+}
+
 LIBIMOBILEDEVICE_API diagnostics_relay_error_t diagnostics_relay_query_mobilegestalt(diagnostics_relay_client_t client, plist_t keys, plist_t* result)
 {
 	if (!client || plist_get_node_type(keys) != PLIST_ARRAY || result == NULL)
 		return DIAGNOSTICS_RELAY_E_INVALID_ARG;
 
 	diagnostics_relay_error_t ret = DIAGNOSTICS_RELAY_E_UNKNOWN_ERROR;
-
-	plist_t dict = plist_new_dict();
-	plist_dict_set_item(dict,"MobileGestaltKeys", plist_copy(keys));
-	plist_dict_set_item(dict,"Request", plist_new_string("MobileGestalt"));
-	ret = diagnostics_relay_send(client, dict);
-	plist_free(dict);
-	dict = NULL;
-
-	ret = diagnostics_relay_receive(client, &dict);
-	if (!dict) {
-		return DIAGNOSTICS_RELAY_E_PLIST_ERROR;
+	const char *udid = client->parent->parent->connection->device->udid;
+	uint32_t i, num_keys = plist_array_get_size(keys);
+
+	*result = NULL;
+
+	thread_once(&diagnostics_relay_gestalt_cache_once, diagnostics_relay_gestalt_cache_init);
+
+	/* take what is known already, only ask the device for the rest */
+	plist_t cached = plist_new_dict();
+	plist_t fetch = plist_new_array();
+	mutex_lock(&diagnostics_relay_gestalt_cache.mutex);
+	plist_t device_cache = (udid) ? plist_dict_get_item(diagnostics_relay_gestalt_cache.devices, udid) : NULL;
+	for (i = 0; i < num_keys; i++) {
+		plist_t key_node = plist_array_get_item(keys, i);
+		const char *key = (plist_get_node_type(key_node) == PLIST_STRING) ? plist_get_string_ptr(key_node, NULL) : NULL;
+		plist_t value = (key && device_cache) ? plist_dict_get_item(device_cache, key) : NULL;
+		if (value) {
+			plist_dict_set_item(cached, key, plist_copy(value));
+		} else {
+			plist_array_append_item(fetch, plist_copy(key_node));
+		}
 	}
+	mutex_unlock(&diagnostics_relay_gestalt_cache.mutex);
 
-	int check = diagnostics_relay_check_result(dict);
-	if (check == RESULT_SUCCESS) {
+	plist_t values = NULL;
+	if (plist_array_get_size(fetch) == 0) {
+		debug_info("all %u keys served from cache", num_keys);
+		values = plist_new_dict();
+		plist_dict_set_item(values, "Status", plist_new_string("Success"));
 		ret = DIAGNOSTICS_RELAY_E_SUCCESS;
-	} else if (check == RESULT_UNKNOWN_REQUEST) {
-		ret = DIAGNOSTICS_RELAY_E_UNKNOWN_REQUEST;
 	} else {
-		ret = DIAGNOSTICS_RELAY_E_UNKNOWN_ERROR;
-	}
+		plist_t dict = plist_new_dict();
+		plist_dict_set_item(dict,"MobileGestaltKeys", fetch);
+		fetch = NULL;
+		plist_dict_set_item(dict,"Request", plist_new_string("MobileGestalt"));
+		ret = diagnostics_relay_send(client, dict);
+		plist_free(dict);
+		dict = NULL;
 
-	if (ret != DIAGNOSTICS_RELAY_E_SUCCESS) {
+		ret = diagnostics_relay_receive(client, &dict);
+		if (!dict) {
+			plist_free(cached);
+			return DIAGNOSTICS_RELAY_E_PLIST_ERROR;
+		}
+
+		int check = diagnostics_relay_check_result(dict);
+		if (check == RESULT_SUCCESS) {
+			ret = DIAGNOSTICS_RELAY_E_SUCCESS;
+		} else if (check == RESULT_UNKNOWN_REQUEST) {
+			ret = DIAGNOSTICS_RELAY_E_UNKNOWN_REQUEST;
+		} else {
+			ret = DIAGNOSTICS_RELAY_E_UNKNOWN_ERROR;
+		}
+
+		if (ret != DIAGNOSTICS_RELAY_E_SUCCESS) {
+			plist_free(dict);
+			plist_free(cached);
+			return ret;
+		}
+
+		plist_t value_node = plist_dict_get_item(dict, "Diagnostics");
+		if (value_node) {
+			*result = plist_copy(value_node);
+		}
 		plist_free(dict);
-		return ret;
+
+		values = (*result) ? plist_dict_get_item(*result, "MobileGestalt") : NULL;
+		if (!values || plist_get_node_type(values) != PLIST_DICT) {
+			/* unexpected layout, don't touch it */
+			plist_free(cached);
+			return ret;
+		}
+
+		/* remember the immutable values the device just reported */
+		if (udid) {
+			mutex_lock(&diagnostics_relay_gestalt_cache.mutex);
+			device_cache = plist_dict_get_item(diagnostics_relay_gestalt_cache.devices, udid);
+			for (i = 0; i < num_keys; i++) {
+				plist_t key_node = plist_array_get_item(keys, i);
+				const char *key = (plist_get_node_type(key_node) == PLIST_STRING) ? plist_get_string_ptr(key_node, NULL) : NULL;
+				plist_t value = (key) ? plist_dict_get_item(values, key) : NULL;
+				if (!value || !diagnostics_relay_gestalt_key_is_immutable(key))
+					continue;
+				if (!device_cache) {
+					device_cache = plist_new_dict();
+					plist_dict_set_item(diagnostics_relay_gestalt_cache.devices, udid, device_cache);
+				}
+				plist_dict_set_item(device_cache, key, plist_copy(value));
+			}
+			mutex_unlock(&diagnostics_relay_gestalt_cache.mutex);
+		}
 	}
 
-	plist_t value_node = plist_dict_get_item(dict, "Diagnostics");
-	if (value_node) {
-		*result = plist_copy(value_node);
+	/* merge the cached values into the result */
+	plist_dict_iter iter = NULL;
+	char *key = NULL;
+	plist_t val = NULL;
+	plist_dict_new_iter(cached, &iter);
+	do {
+		key = NULL;
+		val = NULL;
+		plist_dict_next_item(cached, iter, &key, &val);
+		if (key) {
+			plist_dict_set_item(values, key, plist_copy(val));
+			free(key);
+		}
+	} while (val);
+	free(iter);
+	plist_free(cached);
+
+	if (!*result) {
+		*result = plist_new_dict();
+		plist_dict_set_item(*result, "MobileGestalt", values);
 	}
 
-	plist_free(dict);
 	return ret;
 }
 
+LIBIMOBILEDEVICE_API diagnostics_relay_error_t diagnostics_relay_mobilegestalt_cache_flush(const char *udid)
+{
+	thread_once(&diagnostics_relay_gestalt_cache_once, diagnostics_relay_gestalt_cache_init);
+
+	mutex_lock(&diagnostics_relay_gestalt_cache.mutex);
+	if (udid) {
+		plist_dict_remove_item(diagnostics_relay_gestalt_cache.devices, udid);
+	} else {
+		plist_free(diagnostics_relay_gestalt_cache.devices);
+		diagnostics_relay_gestalt_cache.devices = plist_new_dict();
+	}
+	mutex_unlock(&diagnostics_relay_gestalt_cache.mutex);
+
+	return DIAGNOSTICS_RELAY_E_SUCCESS;
+}
+
 LIBIMOBILEDEVICE_API diagnostics_relay_error_t diagnostics_relay_query_ioregistry_entry(diagnostics_relay_client_t client, const char* entry_name, const char* entry_class, plist_t* result)
 {
 	if (!client || (entry_name == NULL && entry_class == NULL) || result == NULL)
@@ -456,3 +609,352 @@ LIBIMOBILEDEVICE_API diagnostics_relay_error_t diagnostics_relay_query_ioregistr
 	plist_free(dict);
 	return ret;
 }
+
+LIBIMOBILEDEVICE_API diagnostics_relay_error_t diagnostics_relay_sampler_new(diagnostics_relay_client_t client, diagnostics_relay_sampler_t *sampler)
+{
+	if (!client || !sampler)
+		return DIAGNOSTICS_RELAY_E_INVALID_ARG;
+
+	diagnostics_relay_sampler_t sampler_loc = (diagnostics_relay_sampler_t)calloc(1, sizeof(struct diagnostics_relay_sampler_private));
+	if (!sampler_loc)
+		return DIAGNOSTICS_RELAY_E_UNKNOWN_ERROR;
+
+	sampler_loc->client = client;
+	sampler_loc->thread = THREAD_T_NULL;
+	sampler_loc->error = DIAGNOSTICS_RELAY_E_SUCCESS;
+	mutex_init(&sampler_loc->mutex);
+
+	*sampler = sampler_loc;
+
+	return DIAGNOSTICS_RELAY_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API diagnostics_relay_error_t diagnostics_relay_sampler_free(diagnostics_relay_sampler_t sampler)
+{
+	unsigned int i;
+
+	if (!sampler)
+		return DIAGNOSTICS_RELAY_E_INVALID_ARG;
+
+	diagnostics_relay_sampler_stop(sampler);
+
+	for (i = 0; i < sampler->num_queries; i++) {
+		plist_free(sampler->queries[i].request);
+		plist_free(sampler->queries[i].previous);
+	}
+	free(sampler->queries);
+	mutex_destroy(&sampler->mutex);
+	free(sampler);
+
+	return DIAGNOSTICS_RELAY_E_SUCCESS;
+}
+
+static diagnostics_relay_error_t diagnostics_relay_sampler_add(diagnostics_relay_sampler_t sampler, plist_t request, unsigned int *query_id)
+{
+	mutex_lock(&sampler->mutex);
+	struct diagnostics_relay_sampler_query *queries = (struct diagnostics_relay_sampler_query*)realloc(sampler->queries, sizeof(struct diagnostics_relay_sampler_query) * (sampler->num_queries + 1));
+	if (!queries) {
+		mutex_unlock(&sampler->mutex);
+		plist_free(request);
+		return DIAGNOSTICS_RELAY_E_UNKNOWN_ERROR;
+	}
+	sampler->queries = queries;
+	queries[sampler->num_queries].request = request;
+	queries[sampler->num_queries].previous = NULL;
+	if (query_id)
+		*query_id = sampler->num_queries;
+	sampler->num_queries++;
+	mutex_unlock(&sampler->mutex);
+
+	return DIAGNOSTICS_RELAY_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API diagnostics_relay_error_t diagnostics_relay_sampler_add_ioregistry_entry(diagnostics_relay_sampler_t sampler, const char* entry_name, const char* entry_class, unsigned int *query_id)
+{
+	if (!sampler || (entry_name == NULL && entry_class == NULL))
+		return DIAGNOSTICS_RELAY_E_INVALID_ARG;
+
+	plist_t dict = plist_new_dict();
+	if (entry_name)
+		plist_dict_set_item(dict,"EntryName", plist_new_string(entry_name));
+	if (entry_class)
+		plist_dict_set_item(dict,"EntryClass", plist_new_string(entry_class));
+	plist_dict_set_item(dict,"Request", plist_new_string("IORegistry"));
+
+	return diagnostics_relay_sampler_add(sampler, dict, query_id);
+}
+
+LIBIMOBILEDEVICE_API diagnostics_relay_error_t diagnostics_relay_sampler_add_mobilegestalt(diagnostics_relay_sampler_t sampler, plist_t keys, unsigned int *query_id)
+{
+	if (!sampler || plist_get_node_type(keys) != PLIST_ARRAY)
+		return DIAGNOSTICS_RELAY_E_INVALID_ARG;
+
+	plist_t dict = plist_new_dict();
+	plist_dict_set_item(dict,"MobileGestaltKeys", plist_copy(keys));
+	plist_dict_set_item(dict,"Request", plist_new_string("MobileGestalt"));
+
+	return diagnostics_relay_sampler_add(sampler, dict, query_id);
+}
+
+/**
+ * Compares two plists by value, including the contents of containers.
+ */
+static int diagnostics_relay_plist_equal(plist_t a, plist_t b)
+{
+	plist_type type = plist_get_node_type(a);
+	if (type != plist_get_node_type(b))
+		return 0;
+
+	if (type == PLIST_DICT) {
+		plist_dict_iter iter = NULL;
+		char *key = NULL;
+		plist_t val = NULL;
+		int equal = 1;
+		if (plist_dict_get_size(a) != plist_dict_get_size(b))
+			return 0;
+		plist_dict_new_iter(a, &iter);
+		do {
+			key = NULL;
+			val = NULL;
+			plist_dict_next_item(a, iter, &key, &val);
+			if (key) {
+				plist_t other = plist_dict_get_item(b, key);
+				if (!other || !diagnostics_relay_plist_equal(val, other))
+					equal = 0;
+				free(key);
+			}
+		} while (val && equal);
+		free(iter);
+		return equal;
+	} else if (type == PLIST_ARRAY) {
+		uint32_t i, count = plist_array_get_size(a);
+		if (count != plist_array_get_size(b))
+			return 0;
+		for (i = 0; i < count; i++) {
+			if (!diagnostics_relay_plist_equal(plist_array_get_item(a, i), plist_array_get_item(b, i)))
+				return 0;
+		}
+		return 1;
+	}
+
+	return (plist_compare_node_value(a, b)) ? 1 : 0;
+}
+
+/**
+ * Gets the values to compare from a response. The diagnostics are wrapped
+ * in a dictionary named after the request, e.g. IORegistry.
+ */
+static plist_t diagnostics_relay_sampler_values(plist_t response)
+{
+	plist_t values = plist_dict_get_item(response, "Diagnostics");
+	if (!values || plist_get_node_type(values) != PLIST_DICT)
+		return NULL;
+
+	if (plist_dict_get_size(values) == 1) {
+		plist_dict_iter iter = NULL;
+		char *key = NULL;
+		plist_t inner = NULL;
+		plist_dict_new_iter(values, &iter);
+		plist_dict_next_item(values, iter, &key, &inner);
+		free(key);
+		free(iter);
+		if (inner && plist_get_node_type(inner) == PLIST_DICT)
+			values = inner;
+	}
+
+	return values;
+}
+
+static void diagnostics_relay_sampler_diff(plist_t previous, plist_t current, plist_t *changes, plist_t *removed)
+{
+	plist_dict_iter iter = NULL;
+	char *key = NULL;
+	plist_t val = NULL;
+
+	*changes = plist_new_dict();
+	*removed = NULL;
+
+	plist_dict_new_iter(current, &iter);
+	do {
+		key = NULL;
+		val = NULL;
+		plist_dict_next_item(current, iter, &key, &val);
+		if (key) {
+			plist_t prev = (previous) ? plist_dict_get_item(previous, key) : NULL;
+			if (!prev || !diagnostics_relay_plist_equal(prev, val)) {
+				plist_dict_set_item(*changes, key, plist_copy(val));
+			}
+			free(key);
+		}
+	} while (val);
+	free(iter);
+
+	if (!previous)
+		return;
+
+	iter = NULL;
+	plist_dict_new_iter(previous, &iter);
+	do {
+		key = NULL;
+		val = NULL;
+		plist_dict_next_item(previous, iter, &key, &val);
+		if (key) {
+			if (!plist_dict_get_item(current, key)) {
+				if (!*removed)
+					*removed = plist_new_array();
+				plist_array_append_item(*removed, plist_new_string(key));
+			}
+			free(key);
+		}
+	} while (val);
+	free(iter);
+}
+
+static diagnostics_relay_error_t diagnostics_relay_sampler_take(diagnostics_relay_sampler_t sampler, diagnostics_relay_sampler_cb_t callback, void *user_data)
+{
+	diagnostics_relay_error_t ret = DIAGNOSTICS_RELAY_E_SUCCESS;
+	unsigned int i, sent = 0;
+
+	mutex_lock(&sampler->mutex);
+	unsigned int num_queries = sampler->num_queries;
+	if (num_queries == 0) {
+		mutex_unlock(&sampler->mutex);
+		return DIAGNOSTICS_RELAY_E_SUCCESS;
+	}
+
+	plist_t *changes = (plist_t*)calloc(num_queries, sizeof(plist_t));
+	plist_t *removed = (plist_t*)calloc(num_queries, sizeof(plist_t));
+	if (!changes || !removed) {
+		mutex_unlock(&sampler->mutex);
+		free(changes);
+		free(removed);
+		return DIAGNOSTICS_RELAY_E_UNKNOWN_ERROR;
+	}
+
+	/* send all requests before reading the first response */
+	for (i = 0; i < num_queries; i++) {
+		if (diagnostics_relay_send(sampler->client, sampler->queries[i].request) != DIAGNOSTICS_RELAY_E_SUCCESS) {
+			ret = DIAGNOSTICS_RELAY_E_MUX_ERROR;
+			break;
+		}
+		sent++;
+	}
+
+	for (i = 0; i < sent; i++) {
+		plist_t dict = NULL;
+		if (diagnostics_relay_receive(sampler->client, &dict) != DIAGNOSTICS_RELAY_E_SUCCESS) {
+			plist_free(dict);
+			ret = DIAGNOSTICS_RELAY_E_MUX_ERROR;
+			break;
+		}
+		plist_t values = (diagnostics_relay_check_result(dict) == RESULT_SUCCESS) ? diagnostics_relay_sampler_values(dict) : NULL;
+		if (!values) {
+			debug_info("query %u failed, skipping", i);
+			plist_free(dict);
+			continue;
+		}
+		struct diagnostics_relay_sampler_query *query = &sampler->queries[i];
+		diagnostics_relay_sampler_diff(query->previous, values, &changes[i], &removed[i]);
+		plist_free(query->previous);
+		query->previous = plist_copy(values);
+		plist_free(dict);
+	}
+	mutex_unlock(&sampler->mutex);
+
+	for (i = 0; i < num_queries; i++) {
+		if (changes[i] && (plist_dict_get_size(changes[i]) > 0 || removed[i])) {
+			callback(i, changes[i], removed[i], user_data);
+		}
+		plist_free(changes[i]);
+		plist_free(removed[i]);
+	}
+	free(changes);
+	free(removed);
+
+	return ret;
+}
+
+LIBIMOBILEDEVICE_API diagnostics_relay_error_t diagnostics_relay_sampler_sample(diagnostics_relay_sampler_t sampler, diagnostics_relay_sampler_cb_t callback, void *user_data)
+{
+	if (!sampler || !callback || sampler->thread)
+		return DIAGNOSTICS_RELAY_E_INVALID_ARG;
+
+	return diagnostics_relay_sampler_take(sampler, callback, user_data);
+}
+
+static uint64_t diagnostics_relay_time_ms(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static void* diagnostics_relay_sampler_thread(void *arg)
+{
+	diagnostics_relay_sampler_t sampler = (diagnostics_relay_sampler_t)arg;
+	uint64_t next_due = diagnostics_relay_time_ms();
+
+	while (!sampler->stop) {
+		diagnostics_relay_error_t ret = diagnostics_relay_sampler_take(sampler, sampler->callback, sampler->user_data);
+		if (ret != DIAGNOSTICS_RELAY_E_SUCCESS) {
+			debug_info("sampling failed with error %d, stopping", ret);
+			sampler->error = ret;
+			break;
+		}
+
+		next_due += sampler->interval;
+		uint64_t now = diagnostics_relay_time_ms();
+		if (next_due < now) {
+			/* fell behind, don't sample in a burst to catch up */
+			next_due = now;
+		}
+		while (!sampler->stop && now < next_due) {
+			uint64_t ms = next_due - now;
+			if (ms > 50)
+				ms = 50;
+#ifdef WIN32
+			Sleep((DWORD)ms);
+#else
+			usleep((useconds_t)(ms * 1000));
+#endif
+			now = diagnostics_relay_time_ms();
+		}
+	}
+
+	return NULL;
+}
+
+LIBIMOBILEDEVICE_API diagnostics_relay_error_t diagnostics_relay_sampler_start(diagnostics_relay_sampler_t sampler, unsigned int interval_ms, diagnostics_relay_sampler_cb_t callback, void *user_data)
+{
+	if (!sampler || interval_ms == 0 || !callback || sampler->thread)
+		return DIAGNOSTICS_RELAY_E_INVALID_ARG;
+
+	sampler->interval = interval_ms;
+	sampler->callback = callback;
+	sampler->user_data = user_data;
+	sampler->stop = 0;
+	sampler->error = DIAGNOSTICS_RELAY_E_SUCCESS;
+
+	if (thread_new(&sampler->thread, diagnostics_relay_sampler_thread, sampler) != 0) {
+		sampler->thread = THREAD_T_NULL;
+		return DIAGNOSTICS_RELAY_E_UNKNOWN_ERROR;
+	}
+
+	return DIAGNOSTICS_RELAY_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API diagnostics_relay_error_t diagnostics_relay_sampler_stop(diagnostics_relay_sampler_t sampler)
+{
+	if (!sampler)
+		return DIAGNOSTICS_RELAY_E_INVALID_ARG;
+
+	if (!sampler->thread)
+		return DIAGNOSTICS_RELAY_E_SUCCESS;
+
+	sampler->stop = 1;
+	thread_join(sampler->thread);
+	thread_free(sampler->thread);
+	sampler->thread = THREAD_T_NULL;
+
+	return sampler->error;
+}
@@ -24,9 +24,28 @@
 
 #include "libimobiledevice/diagnostics_relay.h"
 #include "property_list_service.h"
+#include "common/thread.h"
 
 struct diagnostics_relay_client_private {
 	property_list_service_client_t parent;
 };
 
+struct diagnostics_relay_sampler_query {
+	plist_t request;
+	plist_t previous;
+};
+
+struct diagnostics_relay_sampler_private {
+	diagnostics_relay_client_t client;
+	struct diagnostics_relay_sampler_query *queries;
+	unsigned int num_queries;
+	mutex_t mutex;
+	THREAD_T thread;
+	unsigned int interval;
+	volatile int stop;
+	diagnostics_relay_error_t error;
+	diagnostics_relay_sampler_cb_t callback;
+	void *user_data;
+};
+
 #endif
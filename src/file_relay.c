@@ -24,6 +24,9 @@
 #endif
 #include <string.h>
 #include <stdlib.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
 #include "file_relay.h"
 #include "property_list_service.h"
 #include "common/debug.h"
@@ -163,3 +166,388 @@ LIBIMOBILEDEVICE_API file_relay_error_t file_relay_request_sources(file_relay_cl
 {
 	return file_relay_request_sources_timeout(client, sources, connection, 60000);
 }
+
+#ifdef HAVE_ZLIB
+static void* file_relay_stream_receive_thread(void *arg)
+{
+	struct file_relay_stream *stream = (struct file_relay_stream*)arg;
+	unsigned int idle = 0;
+
+	mutex_lock(&stream->mutex);
+	while (!stream->quit) {
+		if (stream->count == FILE_RELAY_STREAM_NUM_BUFFERS) {
+			cond_wait(&stream->cond, &stream->mutex);
+			continue;
+		}
+		struct file_relay_stream_buffer *buffer = &stream->buffers[(stream->head + stream->count) % FILE_RELAY_STREAM_NUM_BUFFERS];
+		mutex_unlock(&stream->mutex);
+
+		/* poll in short intervals to notice when the decoder is done */
+		uint32_t recvd = 0;
+		idevice_error_t ret = idevice_connection_receive_timeout(stream->connection, buffer->data, FILE_RELAY_STREAM_BUFFER_SIZE, &recvd, FILE_RELAY_STREAM_POLL_INTERVAL);
+
+		mutex_lock(&stream->mutex);
+		if (recvd > 0) {
+			idle = 0;
+			buffer->length = recvd;
+			stream->count++;
+			cond_signal(&stream->cond);
+		} else if (ret == IDEVICE_E_TIMEOUT) {
+			idle += FILE_RELAY_STREAM_POLL_INTERVAL;
+			if (idle >= stream->timeout) {
+				debug_info("ERROR: No data received for %u ms", idle);
+				stream->error = FILE_RELAY_E_MUX_ERROR;
+				break;
+			}
+		} else {
+			/* the device closes the connection after the archive */
+			debug_info("receive returned %d, end of stream", ret);
+			break;
+		}
+	}
+	stream->eof = 1;
+	cond_signal(&stream->cond);
+	mutex_unlock(&stream->mutex);
+
+	return NULL;
+}
+
+static int file_relay_cpio_parse_number(const char *field, unsigned int len, int base, uint64_t *value)
+{
+	unsigned int i;
+	*value = 0;
+	for (i = 0; i < len; i++) {
+		int digit;
+		char c = field[i];
+		if (c >= '0' && c <= '9') {
+			digit = c - '0';
+		} else if (base == 16 && c >= 'a' && c <= 'f') {
+			digit = c - 'a' + 10;
+		} else if (base == 16 && c >= 'A' && c <= 'F') {
+			digit = c - 'A' + 10;
+		} else {
+			return -1;
+		}
+		if (digit >= base)
+			return -1;
+		*value = *value * base + digit;
+	}
+	return 0;
+}
+
+/**
+ * Parses a complete odc (070707) or newc (070701/070702) header.
+ */
+static int file_relay_cpio_parse_header(struct file_relay_cpio *cpio)
+{
+	uint64_t mode, uid, gid, mtime, namesize, filesize;
+	const char *h = cpio->header;
+
+	if (cpio->newc) {
+		if (file_relay_cpio_parse_number(h + 14, 8, 16, &mode) < 0
+		 || file_relay_cpio_parse_number(h + 22, 8, 16, &uid) < 0
+		 || file_relay_cpio_parse_number(h + 30, 8, 16, &gid) < 0
+		 || file_relay_cpio_parse_number(h + 46, 8, 16, &mtime) < 0
+		 || file_relay_cpio_parse_number(h + 54, 8, 16, &filesize) < 0
+		 || file_relay_cpio_parse_number(h + 94, 8, 16, &namesize) < 0)
+			return -1;
+	} else {
+		if (file_relay_cpio_parse_number(h + 18, 6, 8, &mode) < 0
+		 || file_relay_cpio_parse_number(h + 24, 6, 8, &uid) < 0
+		 || file_relay_cpio_parse_number(h + 30, 6, 8, &gid) < 0
+		 || file_relay_cpio_parse_number(h + 48, 11, 8, &mtime) < 0
+		 || file_relay_cpio_parse_number(h + 59, 6, 8, &namesize) < 0
+		 || file_relay_cpio_parse_number(h + 65, 11, 8, &filesize) < 0)
+			return -1;
+	}
+	if (namesize == 0 || namesize > FILE_RELAY_CPIO_MAX_NAME)
+		return -1;
+
+	cpio->name_size = (uint32_t)namesize;
+	cpio->name_len = 0;
+	cpio->pad_left = (cpio->newc) ? (4 - (110 + cpio->name_size) % 4) % 4 : 0;
+	cpio->data_left = filesize;
+	cpio->data_pad = (cpio->newc) ? (uint32_t)((4 - filesize % 4) % 4) : 0;
+
+	memset(&cpio->entry, '\0', sizeof(file_relay_entry_t));
+	cpio->entry.path = cpio->name;
+	cpio->entry.mode = (uint32_t)mode;
+	cpio->entry.uid = (uint32_t)uid;
+	cpio->entry.gid = (uint32_t)gid;
+	cpio->entry.mtime = mtime;
+	cpio->entry.size = filesize;
+
+	return 0;
+}
+
+/**
+ * Feeds decompressed archive data to the cpio parser.
+ *
+ * @return 0 if more data is expected, 1 once the trailer has been reached,
+ *     or a FILE_RELAY_E_* error value.
+ */
+static int file_relay_cpio_feed(struct file_relay_cpio *cpio, const char *data, uint32_t length)
+{
+	uint32_t n;
+	int r;
+
+	while (1) {
+		switch (cpio->state) {
+		case FILE_RELAY_CPIO_HEADER:
+			if (length == 0)
+				return 0;
+			n = ((cpio->header_len < 6) ? 6 : cpio->header_size) - cpio->header_len;
+			if (n > length)
+				n = length;
+			memcpy(cpio->header + cpio->header_len, data, n);
+			cpio->header_len += n;
+			data += n;
+			length -= n;
+			if (cpio->header_len == 6) {
+				if (!memcmp(cpio->header, "070707", 6)) {
+					cpio->newc = 0;
+					cpio->header_size = 76;
+				} else if (!memcmp(cpio->header, "070701", 6) || !memcmp(cpio->header, "070702", 6)) {
+					cpio->newc = 1;
+					cpio->header_size = 110;
+				} else {
+					debug_info("ERROR: Invalid cpio magic");
+					return FILE_RELAY_E_ARCHIVE_ERROR;
+				}
+			} else if (cpio->header_len > 6 && cpio->header_len == cpio->header_size) {
+				if (file_relay_cpio_parse_header(cpio) < 0) {
+					debug_info("ERROR: Invalid cpio header");
+					return FILE_RELAY_E_ARCHIVE_ERROR;
+				}
+				cpio->state = FILE_RELAY_CPIO_NAME;
+			}
+			break;
+		case FILE_RELAY_CPIO_NAME:
+			if (cpio->name_len < cpio->name_size) {
+				if (length == 0)
+					return 0;
+				n = cpio->name_size - cpio->name_len;
+				if (n > length)
+					n = length;
+				memcpy(cpio->name + cpio->name_len, data, n);
+				cpio->name_len += n;
+				data += n;
+				length -= n;
+				break;
+			}
+			if (cpio->pad_left > 0) {
+				if (length == 0)
+					return 0;
+				n = (cpio->pad_left < length) ? cpio->pad_left : length;
+				cpio->pad_left -= n;
+				data += n;
+				length -= n;
+				break;
+			}
+			cpio->name[cpio->name_size-1] = '\0';
+			if (!strcmp(cpio->name, "TRAILER!!!")) {
+				cpio->state = FILE_RELAY_CPIO_DONE;
+				break;
+			}
+			if ((cpio->entry.mode & 0170000) == 0120000) {
+				if (cpio->data_left >= FILE_RELAY_CPIO_MAX_LINK) {
+					debug_info("ERROR: Link target too long");
+					return FILE_RELAY_E_ARCHIVE_ERROR;
+				}
+				cpio->name_len = 0;
+				cpio->state = FILE_RELAY_CPIO_LINK;
+				break;
+			}
+			r = cpio->entry_cb(&cpio->entry, cpio->user_data);
+			if (r < 0)
+				return FILE_RELAY_E_ABORTED;
+			cpio->skip = (r > 0 || !cpio->data_cb);
+			cpio->state = FILE_RELAY_CPIO_DATA;
+			break;
+		case FILE_RELAY_CPIO_LINK:
+			if (cpio->name_len < cpio->entry.size) {
+				if (length == 0)
+					return 0;
+				n = (uint32_t)cpio->entry.size - cpio->name_len;
+				if (n > length)
+					n = length;
+				memcpy(cpio->link + cpio->name_len, data, n);
+				cpio->name_len += n;
+				data += n;
+				length -= n;
+				break;
+			}
+			cpio->link[cpio->name_len] = '\0';
+			cpio->entry.link_target = cpio->link;
+			cpio->data_left = 0;
+			if (cpio->entry_cb(&cpio->entry, cpio->user_data) < 0)
+				return FILE_RELAY_E_ABORTED;
+			cpio->pad_left = cpio->data_pad;
+			cpio->state = FILE_RELAY_CPIO_PAD;
+			break;
+		case FILE_RELAY_CPIO_DATA:
+			if (cpio->data_left > 0) {
+				if (length == 0)
+					return 0;
+				n = (cpio->data_left < length) ? (uint32_t)cpio->data_left : length;
+				if (!cpio->skip && cpio->data_cb(&cpio->entry, data, n, cpio->user_data) < 0)
+					return FILE_RELAY_E_ABORTED;
+				cpio->data_left -= n;
+				data += n;
+				length -= n;
+				break;
+			}
+			if (!cpio->skip && cpio->data_cb(&cpio->entry, NULL, 0, cpio->user_data) < 0)
+				return FILE_RELAY_E_ABORTED;
+			cpio->pad_left = cpio->data_pad;
+			cpio->state = FILE_RELAY_CPIO_PAD;
+			break;
+		case FILE_RELAY_CPIO_PAD:
+			if (cpio->pad_left > 0) {
+				if (length == 0)
+					return 0;
+				n = (cpio->pad_left < length) ? cpio->pad_left : length;
+				cpio->pad_left -= n;
+				data += n;
+				length -= n;
+				break;
+			}
+			cpio->header_len = 0;
+			cpio->state = FILE_RELAY_CPIO_HEADER;
+			break;
+		case FILE_RELAY_CPIO_DONE:
+		default:
+			return 1;
+		}
+	}
+}
+
+LIBIMOBILEDEVICE_API file_relay_error_t file_relay_stream_sources(file_relay_client_t client, const char **sources, unsigned int timeout, file_relay_entry_cb_t entry_cb, file_relay_data_cb_t data_cb, void *user_data)
+{
+	idevice_connection_t connection = NULL;
+	struct file_relay_stream *stream = NULL;
+	struct file_relay_cpio *cpio = NULL;
+	char *out = NULL;
+	z_stream zs;
+	int done = 0;
+
+	if (!client || !client->parent || !sources || !sources[0] || !entry_cb) {
+		return FILE_RELAY_E_INVALID_ARG;
+	}
+
+	/* set up everything first, a requested archive has to be read */
+	stream = (struct file_relay_stream*)calloc(1, sizeof(struct file_relay_stream));
+	cpio = (struct file_relay_cpio*)calloc(1, sizeof(struct file_relay_cpio));
+	out = (char*)malloc(FILE_RELAY_STREAM_BUFFER_SIZE);
+	memset(&zs, '\0', sizeof(zs));
+	if (!stream || !cpio || !out || inflateInit2(&zs, 16 + MAX_WBITS) != Z_OK) {
+		free(stream);
+		free(cpio);
+		free(out);
+		return FILE_RELAY_E_UNKNOWN_ERROR;
+	}
+
+	file_relay_error_t err = file_relay_request_sources_timeout(client, sources, &connection, timeout);
+	if (err != FILE_RELAY_E_SUCCESS) {
+		inflateEnd(&zs);
+		free(stream);
+		free(cpio);
+		free(out);
+		return err;
+	}
+
+	cpio->entry_cb = entry_cb;
+	cpio->data_cb = data_cb;
+	cpio->user_data = user_data;
+
+	stream->connection = connection;
+	stream->timeout = timeout;
+	stream->error = FILE_RELAY_E_SUCCESS;
+	mutex_init(&stream->mutex);
+	cond_init(&stream->cond);
+	if (thread_new(&stream->thread, file_relay_stream_receive_thread, stream) != 0) {
+		/* let the device finish sending, so it cleans up the archive */
+		uint32_t recvd;
+		do {
+			recvd = 0;
+			idevice_connection_receive_timeout(connection, out, FILE_RELAY_STREAM_BUFFER_SIZE, &recvd, timeout);
+		} while (recvd > 0);
+		err = FILE_RELAY_E_UNKNOWN_ERROR;
+		goto leave;
+	}
+
+	/* decompress and parse while the receive thread fetches the next data */
+	mutex_lock(&stream->mutex);
+	while (!done) {
+		while (stream->count == 0 && !stream->eof) {
+			cond_wait(&stream->cond, &stream->mutex);
+		}
+		if (stream->count == 0)
+			break;
+		struct file_relay_stream_buffer *buffer = &stream->buffers[stream->head];
+		mutex_unlock(&stream->mutex);
+
+		zs.next_in = (Bytef*)buffer->data;
+		zs.avail_in = buffer->length;
+		do {
+			zs.next_out = (Bytef*)out;
+			zs.avail_out = FILE_RELAY_STREAM_BUFFER_SIZE;
+			int zr = inflate(&zs, Z_NO_FLUSH);
+			if (zr != Z_OK && zr != Z_STREAM_END && zr != Z_BUF_ERROR) {
+				debug_info("ERROR: inflate failed (%d)", zr);
+				err = FILE_RELAY_E_ARCHIVE_ERROR;
+				done = 1;
+				break;
+			}
+			int r = file_relay_cpio_feed(cpio, out, FILE_RELAY_STREAM_BUFFER_SIZE - zs.avail_out);
+			if (r != 0) {
+				err = (r == 1) ? FILE_RELAY_E_SUCCESS : (file_relay_error_t)r;
+				done = 1;
+				break;
+			}
+			if (zr == Z_STREAM_END) {
+				debug_info("ERROR: Archive ended before the trailer");
+				err = FILE_RELAY_E_ARCHIVE_ERROR;
+				done = 1;
+				break;
+			}
+		} while (zs.avail_in > 0 || zs.avail_out == 0);
+
+		mutex_lock(&stream->mutex);
+		stream->head = (stream->head + 1) % FILE_RELAY_STREAM_NUM_BUFFERS;
+		stream->count--;
+		cond_signal(&stream->cond);
+	}
+	if (!done) {
+		/* the stream ended without the trailer */
+		err = (stream->error != FILE_RELAY_E_SUCCESS) ? stream->error : FILE_RELAY_E_ARCHIVE_ERROR;
+	}
+	stream->quit = 1;
+	cond_signal(&stream->cond);
+	mutex_unlock(&stream->mutex);
+
+	thread_join(stream->thread);
+	thread_free(stream->thread);
+
+leave:
+	inflateEnd(&zs);
+	cond_destroy(&stream->cond);
+	mutex_destroy(&stream->mutex);
+	free(stream);
+	free(cpio);
+	free(out);
+
+	return err;
+}
+#else
+LIBIMOBILEDEVICE_API file_relay_error_t file_relay_stream_sources(file_relay_client_t client, const char **sources, unsigned int timeout, file_relay_entry_cb_t entry_cb, file_relay_data_cb_t data_cb, void *user_data)
+{
+	if (!client || !client->parent || !sources || !sources[0] || !entry_cb) {
+		return FILE_RELAY_E_INVALID_ARG;
+	}
+
+	/* nothing is requested, so there is no archive left unread */
+	debug_info("ERROR: libimobiledevice was built without zlib, archives can't be decoded");
+	return FILE_RELAY_E_UNKNOWN_ERROR;
+}
+#endif
@@ -24,9 +24,65 @@
 
 #include "libimobiledevice/file_relay.h"
 #include "property_list_service.h"
+#include "common/thread.h"
 
 struct file_relay_client_private {
 	property_list_service_client_t parent;
 };
 
+#define FILE_RELAY_STREAM_BUFFER_SIZE 0x10000
+#define FILE_RELAY_STREAM_NUM_BUFFERS 8
+#define FILE_RELAY_STREAM_POLL_INTERVAL 500
+#define FILE_RELAY_CPIO_MAX_NAME 4096
+#define FILE_RELAY_CPIO_MAX_LINK 4096
+
+struct file_relay_stream_buffer {
+	char data[FILE_RELAY_STREAM_BUFFER_SIZE];
+	uint32_t length;
+};
+
+/* compressed data handed from the receive thread to the decoder */
+struct file_relay_stream {
+	idevice_connection_t connection;
+	unsigned int timeout;
+	struct file_relay_stream_buffer buffers[FILE_RELAY_STREAM_NUM_BUFFERS];
+	unsigned int head;
+	unsigned int count;
+	int eof;
+	int quit;
+	file_relay_error_t error;
+	mutex_t mutex;
+	cond_t cond;
+	THREAD_T thread;
+};
+
+enum file_relay_cpio_state {
+	FILE_RELAY_CPIO_HEADER = 0,
+	FILE_RELAY_CPIO_NAME,
+	FILE_RELAY_CPIO_LINK,
+	FILE_RELAY_CPIO_DATA,
+	FILE_RELAY_CPIO_PAD,
+	FILE_RELAY_CPIO_DONE
+};
+
+struct file_relay_cpio {
+	enum file_relay_cpio_state state;
+	int newc;
+	char header[110];
+	uint32_t header_len;
+	uint32_t header_size;
+	char name[FILE_RELAY_CPIO_MAX_NAME];
+	uint32_t name_size;
+	uint32_t name_len;
+	char link[FILE_RELAY_CPIO_MAX_LINK];
+	uint64_t data_left;
+	uint32_t pad_left;
+	uint32_t data_pad;
+	int skip;
+	file_relay_entry_t entry;
+	file_relay_entry_cb_t entry_cb;
+	file_relay_data_cb_t data_cb;
+	void *user_data;
+};
+
 #endif
@@ -24,9 +24,31 @@
 
 #include "libimobiledevice/heartbeat.h"
 #include "property_list_service.h"
+#include "common/thread.h"
+
+/* interval assumed until the device announced its own */
+#define HEARTBEAT_KEEPALIVE_DEFAULT_INTERVAL 10000
+/* extra time granted on top of two intervals before a link counts as lost */
+#define HEARTBEAT_KEEPALIVE_GRACE_PERIOD 5000
 
 struct heartbeat_client_private {
 	property_list_service_client_t parent;
 };
 
+struct heartbeat_keepalive_entry {
+	char *udid;
+	idevice_t device;
+	heartbeat_client_t client;
+	int fd;
+	int pfd_index;
+	uint64_t interval;
+	uint64_t last_seen;
+	uint64_t polo_sent;
+	uint32_t rtt;
+	int have_rtt;
+	heartbeat_keepalive_cb_t callback;
+	void *user_data;
+	struct heartbeat_keepalive_entry *next;
+};
+
 #endif
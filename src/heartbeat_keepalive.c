@@ -0,0 +1,436 @@
+/*
+ * heartbeat_keepalive.c
+ * Answers the heartbeat requests of many devices from a single thread.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/time.h>
+#ifdef WIN32
+#include <winsock2.h>
+#include <windows.h>
+#define poll WSAPoll
+#else
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#endif
+#include <plist/plist.h>
+
+#include "heartbeat.h"
+#include "idevice.h"
+#include "common/debug.h"
+
+#ifdef WIN32
+/* there is no pollable wakeup pipe, pick up changes periodically instead */
+#define HEARTBEAT_KEEPALIVE_MAX_WAIT 1000
+#endif
+
+static struct {
+	mutex_t mutex;
+	THREAD_T thread;
+	int running;
+	struct heartbeat_keepalive_entry *entries;
+#ifndef WIN32
+	int wakeup[2];
+#endif
+} heartbeat_keepalive;
+static thread_once_t heartbeat_keepalive_once = THREAD_ONCE_INIT;
+
+static void heartbeat_keepalive_init(void)
+{
+	mutex_init(&heartbeat_keepalive.mutex);
+	heartbeat_keepalive.thread = THREAD_T_NULL;
+#ifndef WIN32
+	if (pipe(heartbeat_keepalive.wakeup) == 0) {
+		fcntl(heartbeat_keepalive.wakeup[0], F_SETFL, O_NONBLOCK);
+		fcntl(heartbeat_keepalive.wakeup[1], F_SETFL, O_NONBLOCK);
+	} else {
+		heartbeat_keepalive.wakeup[0] = heartbeat_keepalive.wakeup[1] = -1;
+	}
+#endif
+}
+
+static uint64_t heartbeat_keepalive_time_ms(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+/* makes the keepalive thread pick up added or removed devices */
+static void heartbeat_keepalive_wakeup(void)
+{
+#ifndef WIN32
+	if (heartbeat_keepalive.wakeup[1] >= 0) {
+		char c = 0;
+		if (write(heartbeat_keepalive.wakeup[1], &c, 1) < 0) {
+			/* the pipe is full, so the thread wakes up anyway */
+		}
+	}
+#endif
+}
+
+static void heartbeat_keepalive_entry_free(struct heartbeat_keepalive_entry *entry)
+{
+	if (entry->client)
+		heartbeat_client_free(entry->client);
+	if (entry->device)
+		idevice_free(entry->device);
+	free(entry->udid);
+	free(entry);
+}
+
+static struct heartbeat_keepalive_entry *heartbeat_keepalive_find(const char *udid)
+{
+	struct heartbeat_keepalive_entry *entry;
+	for (entry = heartbeat_keepalive.entries; entry; entry = entry->next) {
+		if (strcmp(entry->udid, udid) == 0)
+			return entry;
+	}
+	return NULL;
+}
+
+static uint64_t heartbeat_keepalive_deadline(struct heartbeat_keepalive_entry *entry)
+{
+	return entry->last_seen + entry->interval * 2 + HEARTBEAT_KEEPALIVE_GRACE_PERIOD;
+}
+
+/**
+ * Answers a heartbeat request and updates the round trip time estimate.
+ */
+static heartbeat_error_t heartbeat_keepalive_handle(struct heartbeat_keepalive_entry *entry, plist_t message, uint64_t now)
+{
+	plist_t node = plist_dict_get_item(message, "Command");
+	if (!node || plist_get_node_type(node) != PLIST_STRING || plist_string_val_compare(node, "Marco") != 0) {
+		/* nothing to answer */
+		entry->last_seen = now;
+		return HEARTBEAT_E_SUCCESS;
+	}
+
+	uint64_t interval = entry->interval;
+	node = plist_dict_get_item(message, "Interval");
+	if (node && plist_get_node_type(node) == PLIST_UINT) {
+		uint64_t val = 0;
+		plist_get_uint_val(node, &val);
+		if (val > 0)
+			interval = val * 1000;
+	}
+
+	/* the device asks again after the announced interval once it got the answer */
+	if (entry->polo_sent) {
+		uint64_t expected = entry->polo_sent + entry->interval;
+		uint32_t sample = (now > expected) ? (uint32_t)(now - expected) : 0;
+		if (entry->have_rtt) {
+			entry->rtt = (entry->rtt * 7 + sample) / 8;
+		} else {
+			entry->rtt = sample;
+			entry->have_rtt = 1;
+		}
+	}
+	entry->interval = interval;
+	entry->last_seen = now;
+
+	plist_t polo = plist_new_dict();
+	plist_dict_set_item(polo, "Command", plist_new_string("Polo"));
+	heartbeat_error_t res = heartbeat_send(entry->client, polo);
+	plist_free(polo);
+	if (res != HEARTBEAT_E_SUCCESS) {
+		debug_info("Could not answer heartbeat of %s, error %d", entry->udid, res);
+		return res;
+	}
+	entry->polo_sent = heartbeat_keepalive_time_ms();
+
+	if (entry->callback && entry->have_rtt)
+		entry->callback(entry->udid, HEARTBEAT_E_SUCCESS, entry->rtt, entry->user_data);
+
+	return HEARTBEAT_E_SUCCESS;
+}
+
+/**
+ * Handles all requests that arrived on the connection of a device.
+ */
+static heartbeat_error_t heartbeat_keepalive_read(struct heartbeat_keepalive_entry *entry)
+{
+	idevice_connection_t connection = entry->client->parent->parent->connection;
+	heartbeat_error_t res = HEARTBEAT_E_SUCCESS;
+
+	do {
+		plist_t message = NULL;
+		/* the connection is readable, so the timeout doesn't matter here */
+		property_list_service_error_t perr = property_list_service_receive_plist_with_timeout(entry->client->parent, &message, 1);
+		if (perr == PROPERTY_LIST_SERVICE_E_RECEIVE_TIMEOUT) {
+			break;
+		} else if (perr != PROPERTY_LIST_SERVICE_E_SUCCESS || !message) {
+			debug_info("Connection to heartbeat of %s interrupted", entry->udid);
+			plist_free(message);
+			return HEARTBEAT_E_MUX_ERROR;
+		}
+		debug_plist(message);
+		res = heartbeat_keepalive_handle(entry, message, heartbeat_keepalive_time_ms());
+		plist_free(message);
+		/* decrypted data can be pending that the fd doesn't report */
+	} while (res == HEARTBEAT_E_SUCCESS && connection->ssl_data);
+
+	return res;
+}
+
+static void *heartbeat_keepalive_thread(void *arg)
+{
+	struct pollfd *pfds = NULL;
+	unsigned int pfds_size = 0;
+
+	debug_info("Running");
+
+	while (1) {
+		struct heartbeat_keepalive_entry *entry;
+		unsigned int n = 0;
+		unsigned int first = 0;
+		uint64_t next_deadline = 0;
+
+		mutex_lock(&heartbeat_keepalive.mutex);
+		if (!heartbeat_keepalive.entries) {
+			/* started again by the next heartbeat_keepalive_add() */
+			heartbeat_keepalive.running = 0;
+			mutex_unlock(&heartbeat_keepalive.mutex);
+			break;
+		}
+		for (entry = heartbeat_keepalive.entries; entry; entry = entry->next) {
+			n++;
+		}
+		n++;
+		if (n > pfds_size) {
+			struct pollfd *newpfds = (struct pollfd*)realloc(pfds, sizeof(struct pollfd) * n);
+			if (!newpfds) {
+				mutex_unlock(&heartbeat_keepalive.mutex);
+				debug_info("ERROR: out of memory");
+				poll(NULL, 0, HEARTBEAT_KEEPALIVE_GRACE_PERIOD);
+				continue;
+			}
+			pfds = newpfds;
+			pfds_size = n;
+		}
+		n = 0;
+#ifndef WIN32
+		if (heartbeat_keepalive.wakeup[0] >= 0) {
+			pfds[n].fd = heartbeat_keepalive.wakeup[0];
+			pfds[n].events = POLLIN;
+			pfds[n].revents = 0;
+			n++;
+			first = n;
+		}
+#endif
+		for (entry = heartbeat_keepalive.entries; entry; entry = entry->next) {
+			pfds[n].fd = entry->fd;
+			pfds[n].events = POLLIN;
+			pfds[n].revents = 0;
+			entry->pfd_index = n++;
+			uint64_t deadline = heartbeat_keepalive_deadline(entry);
+			if (next_deadline == 0 || deadline < next_deadline)
+				next_deadline = deadline;
+		}
+		mutex_unlock(&heartbeat_keepalive.mutex);
+
+		/* sleep until a request arrives or the first link times out */
+		uint64_t now = heartbeat_keepalive_time_ms();
+		uint64_t wait = (next_deadline > now) ? next_deadline - now : 0;
+#ifdef WIN32
+		if (wait > HEARTBEAT_KEEPALIVE_MAX_WAIT)
+			wait = HEARTBEAT_KEEPALIVE_MAX_WAIT;
+#else
+		if (heartbeat_keepalive.wakeup[0] < 0 && wait > HEARTBEAT_KEEPALIVE_GRACE_PERIOD)
+			wait = HEARTBEAT_KEEPALIVE_GRACE_PERIOD;
+#endif
+		int ready = poll(pfds, n, (int)wait);
+		if (ready < 0) {
+			if (errno != EINTR)
+				debug_info("poll failed: %s", strerror(errno));
+			ready = 0;
+		}
+#ifndef WIN32
+		if (first > 0 && ready > 0 && (pfds[0].revents & POLLIN)) {
+			char buf[64];
+			while (read(heartbeat_keepalive.wakeup[0], buf, sizeof(buf)) > 0);
+		}
+#endif
+
+		mutex_lock(&heartbeat_keepalive.mutex);
+		now = heartbeat_keepalive_time_ms();
+		struct heartbeat_keepalive_entry **prev = &heartbeat_keepalive.entries;
+		while ((entry = *prev) != NULL) {
+			heartbeat_error_t res = HEARTBEAT_E_SUCCESS;
+			/* devices added while waiting have no poll entry yet */
+			if (ready > 0 && entry->pfd_index >= (int)first && (pfds[entry->pfd_index].revents & (POLLIN | POLLHUP | POLLERR))) {
+				res = heartbeat_keepalive_read(entry);
+			}
+			if (res == HEARTBEAT_E_SUCCESS && now > heartbeat_keepalive_deadline(entry)) {
+				debug_info("No heartbeat from %s for %llu ms", entry->udid, (unsigned long long)(now - entry->last_seen));
+				res = HEARTBEAT_E_TIMEOUT;
+			}
+			if (res != HEARTBEAT_E_SUCCESS) {
+				*prev = entry->next;
+				if (entry->callback)
+					entry->callback(entry->udid, res, entry->rtt, entry->user_data);
+				heartbeat_keepalive_entry_free(entry);
+				continue;
+			}
+			prev = &entry->next;
+		}
+		mutex_unlock(&heartbeat_keepalive.mutex);
+	}
+
+	free(pfds);
+
+	debug_info("Exiting");
+
+	return NULL;
+}
+
+LIBIMOBILEDEVICE_API heartbeat_error_t heartbeat_keepalive_add(const char *udid, enum idevice_options options, heartbeat_keepalive_cb_t callback, void *user_data)
+{
+	if (!udid)
+		return HEARTBEAT_E_INVALID_ARG;
+
+	thread_once(&heartbeat_keepalive_once, heartbeat_keepalive_init);
+
+	mutex_lock(&heartbeat_keepalive.mutex);
+	int known = (heartbeat_keepalive_find(udid) != NULL);
+	mutex_unlock(&heartbeat_keepalive.mutex);
+	if (known)
+		return HEARTBEAT_E_SUCCESS;
+
+	struct heartbeat_keepalive_entry *entry = (struct heartbeat_keepalive_entry*)calloc(1, sizeof(struct heartbeat_keepalive_entry));
+	if (!entry)
+		return HEARTBEAT_E_UNKNOWN_ERROR;
+	entry->udid = strdup(udid);
+	entry->pfd_index = -1;
+	entry->interval = HEARTBEAT_KEEPALIVE_DEFAULT_INTERVAL;
+	entry->callback = callback;
+	entry->user_data = user_data;
+	if (!entry->udid) {
+		heartbeat_keepalive_entry_free(entry);
+		return HEARTBEAT_E_UNKNOWN_ERROR;
+	}
+
+	/* connect without holding the lock, this takes a while */
+	if (idevice_new_with_options(&entry->device, udid, options) != IDEVICE_E_SUCCESS) {
+		debug_info("Device %s not found", udid);
+		heartbeat_keepalive_entry_free(entry);
+		return HEARTBEAT_E_MUX_ERROR;
+	}
+	heartbeat_error_t res = heartbeat_client_start_service(entry->device, &entry->client, "heartbeat_keepalive");
+	if (res != HEARTBEAT_E_SUCCESS) {
+		debug_info("Could not start heartbeat on %s, error %d", udid, res);
+		heartbeat_keepalive_entry_free(entry);
+		return res;
+	}
+	if (idevice_connection_get_fd(entry->client->parent->parent->connection, &entry->fd) != IDEVICE_E_SUCCESS) {
+		heartbeat_keepalive_entry_free(entry);
+		return HEARTBEAT_E_UNKNOWN_ERROR;
+	}
+	entry->last_seen = heartbeat_keepalive_time_ms();
+
+	mutex_lock(&heartbeat_keepalive.mutex);
+	if (heartbeat_keepalive_find(udid)) {
+		/* added concurrently */
+		mutex_unlock(&heartbeat_keepalive.mutex);
+		heartbeat_keepalive_entry_free(entry);
+		return HEARTBEAT_E_SUCCESS;
+	}
+	entry->next = heartbeat_keepalive.entries;
+	heartbeat_keepalive.entries = entry;
+	if (!heartbeat_keepalive.running) {
+		/* a previous thread is done with the lock already and just exits */
+		if (heartbeat_keepalive.thread != THREAD_T_NULL) {
+			thread_join(heartbeat_keepalive.thread);
+			thread_free(heartbeat_keepalive.thread);
+			heartbeat_keepalive.thread = THREAD_T_NULL;
+		}
+		if (thread_new(&heartbeat_keepalive.thread, heartbeat_keepalive_thread, NULL) != 0) {
+			heartbeat_keepalive.thread = THREAD_T_NULL;
+			heartbeat_keepalive.entries = entry->next;
+			mutex_unlock(&heartbeat_keepalive.mutex);
+			heartbeat_keepalive_entry_free(entry);
+			return HEARTBEAT_E_UNKNOWN_ERROR;
+		}
+		heartbeat_keepalive.running = 1;
+	} else {
+		heartbeat_keepalive_wakeup();
+	}
+	mutex_unlock(&heartbeat_keepalive.mutex);
+
+	debug_info("Keeping %s alive", udid);
+
+	return HEARTBEAT_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API heartbeat_error_t heartbeat_keepalive_remove(const char *udid)
+{
+	if (!udid)
+		return HEARTBEAT_E_INVALID_ARG;
+
+	thread_once(&heartbeat_keepalive_once, heartbeat_keepalive_init);
+
+	struct heartbeat_keepalive_entry *entry = NULL;
+	struct heartbeat_keepalive_entry **prev;
+
+	mutex_lock(&heartbeat_keepalive.mutex);
+	for (prev = &heartbeat_keepalive.entries; *prev; prev = &(*prev)->next) {
+		if (strcmp((*prev)->udid, udid) == 0) {
+			entry = *prev;
+			*prev = entry->next;
+			break;
+		}
+	}
+	if (entry)
+		heartbeat_keepalive_wakeup();
+	mutex_unlock(&heartbeat_keepalive.mutex);
+
+	if (!entry)
+		return HEARTBEAT_E_INVALID_ARG;
+
+	heartbeat_keepalive_entry_free(entry);
+
+	return HEARTBEAT_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API heartbeat_error_t heartbeat_keepalive_get_rtt(const char *udid, uint32_t *rtt_ms)
+{
+	if (!udid || !rtt_ms)
+		return HEARTBEAT_E_INVALID_ARG;
+
+	thread_once(&heartbeat_keepalive_once, heartbeat_keepalive_init);
+
+	heartbeat_error_t res = HEARTBEAT_E_INVALID_ARG;
+	mutex_lock(&heartbeat_keepalive.mutex);
+	struct heartbeat_keepalive_entry *entry = heartbeat_keepalive_find(udid);
+	if (entry) {
+		if (entry->have_rtt) {
+			*rtt_ms = entry->rtt;
+			res = HEARTBEAT_E_SUCCESS;
+		} else {
+			res = HEARTBEAT_E_NOT_ENOUGH_DATA;
+		}
+	}
+	mutex_unlock(&heartbeat_keepalive.mutex);
+
+	return res;
+}
@@ -25,11 +25,13 @@
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <sys/time.h>
 #include <plist/plist.h>
 
 #include "house_arrest.h"
 #include "property_list_service.h"
 #include "afc.h"
+#include "idevice.h"
 #include "common/debug.h"
 
 /**
@@ -158,6 +160,229 @@ LIBIMOBILEDEVICE_API afc_error_t afc_client_new_from_house_arrest_client(house_a
 	afc_error_t err = afc_client_new_with_service_client(client->parent->parent, afc_client);
 	if (err == AFC_E_SUCCESS) {
 		client->mode = HOUSE_ARREST_CLIENT_MODE_AFC;
+		/* the connection now speaks AFC and can't serve house_arrest again */
+		service_client_disable_pooling(client->parent->parent);
 	}
 	return err;
 }
+
+static uint64_t house_arrest_time_ms(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static void house_arrest_pool_entry_free(struct house_arrest_pool_entry *entry)
+{
+	/* the AFC client uses the connection of the house_arrest client */
+	if (entry->afc)
+		afc_client_free(entry->afc);
+	if (entry->house_arrest)
+		house_arrest_client_free(entry->house_arrest);
+	free(entry->udid);
+	free(entry->bundle_id);
+	free(entry->command);
+	free(entry);
+}
+
+/**
+ * Unlinks idle entries that expired or belong to the given device and
+ * returns them as a list to be freed after unlocking. The pool has to be
+ * locked.
+ */
+static struct house_arrest_pool_entry *house_arrest_pool_collect(house_arrest_pool_t pool, uint64_t now, const char *udid, int all)
+{
+	struct house_arrest_pool_entry *collected = NULL;
+	struct house_arrest_pool_entry **link = &pool->entries;
+
+	while (*link) {
+		struct house_arrest_pool_entry *entry = *link;
+		int drop;
+		if (entry->in_use) {
+			drop = 0;
+		} else if (all) {
+			drop = (!udid || strcmp(entry->udid, udid) == 0);
+		} else {
+			drop = (now - entry->last_used >= pool->idle_timeout);
+		}
+		if (drop) {
+			*link = entry->next;
+			entry->next = collected;
+			collected = entry;
+		} else {
+			link = &entry->next;
+		}
+	}
+
+	return collected;
+}
+
+static void house_arrest_pool_entries_free(struct house_arrest_pool_entry *entries)
+{
+	while (entries) {
+		struct house_arrest_pool_entry *next = entries->next;
+		house_arrest_pool_entry_free(entries);
+		entries = next;
+	}
+}
+
+LIBIMOBILEDEVICE_API house_arrest_error_t house_arrest_pool_new(unsigned int idle_timeout_ms, house_arrest_pool_t *pool)
+{
+	if (!pool)
+		return HOUSE_ARREST_E_INVALID_ARG;
+
+	house_arrest_pool_t pool_loc = (house_arrest_pool_t)calloc(1, sizeof(struct house_arrest_pool_private));
+	if (!pool_loc)
+		return HOUSE_ARREST_E_UNKNOWN_ERROR;
+
+	pool_loc->idle_timeout = (idle_timeout_ms) ? idle_timeout_ms : HOUSE_ARREST_POOL_DEFAULT_IDLE_TIMEOUT;
+	mutex_init(&pool_loc->mutex);
+
+	*pool = pool_loc;
+
+	return HOUSE_ARREST_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API house_arrest_error_t house_arrest_pool_free(house_arrest_pool_t pool)
+{
+	if (!pool)
+		return HOUSE_ARREST_E_INVALID_ARG;
+
+	house_arrest_pool_entries_free(pool->entries);
+	mutex_destroy(&pool->mutex);
+	free(pool);
+
+	return HOUSE_ARREST_E_SUCCESS;
+}
+
+/**
+ * Starts a house_arrest connection and vends the container of an
+ * application over it.
+ */
+static afc_error_t house_arrest_pool_vend(struct house_arrest_pool_entry *entry, idevice_t device, const char *label)
+{
+	afc_error_t err = AFC_E_UNKNOWN_ERROR;
+	plist_t dict = NULL;
+
+	if (house_arrest_client_start_service(device, &entry->house_arrest, label) != HOUSE_ARREST_E_SUCCESS) {
+		debug_info("Could not start house_arrest service");
+		entry->house_arrest = NULL;
+	} else if (house_arrest_send_command(entry->house_arrest, entry->command, entry->bundle_id) != HOUSE_ARREST_E_SUCCESS || house_arrest_get_result(entry->house_arrest, &dict) != HOUSE_ARREST_E_SUCCESS) {
+		debug_info("Could not send %s command for %s", entry->command, entry->bundle_id);
+	} else if (plist_dict_get_item(dict, "Error")) {
+		debug_info("Device refused %s for %s", entry->command, entry->bundle_id);
+		err = AFC_E_PERM_DENIED;
+	} else {
+		err = afc_client_new_from_house_arrest_client(entry->house_arrest, &entry->afc);
+	}
+	plist_free(dict);
+
+	return err;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t house_arrest_pool_acquire(house_arrest_pool_t pool, idevice_t device, const char *bundle_id, const char *command, const char *label, afc_client_t *afc_client)
+{
+	struct house_arrest_pool_entry *entry;
+
+	if (!pool || !device || !device->udid || !bundle_id || !afc_client)
+		return AFC_E_INVALID_ARG;
+
+	if (!command)
+		command = "VendContainer";
+
+	uint64_t now = house_arrest_time_ms();
+
+	mutex_lock(&pool->mutex);
+	struct house_arrest_pool_entry *expired = house_arrest_pool_collect(pool, now, NULL, 0);
+	for (entry = pool->entries; entry; entry = entry->next) {
+		if (!entry->in_use && strcmp(entry->udid, device->udid) == 0 && strcmp(entry->bundle_id, bundle_id) == 0 && strcmp(entry->command, command) == 0) {
+			entry->in_use = 1;
+			break;
+		}
+	}
+	mutex_unlock(&pool->mutex);
+
+	house_arrest_pool_entries_free(expired);
+
+	if (entry) {
+		debug_info("reusing %s session for %s", command, bundle_id);
+		*afc_client = entry->afc;
+		return AFC_E_SUCCESS;
+	}
+
+	entry = (struct house_arrest_pool_entry*)calloc(1, sizeof(struct house_arrest_pool_entry));
+	if (!entry)
+		return AFC_E_NO_MEM;
+	entry->udid = strdup(device->udid);
+	entry->bundle_id = strdup(bundle_id);
+	entry->command = strdup(command);
+	entry->in_use = 1;
+
+	afc_error_t err = house_arrest_pool_vend(entry, device, label);
+	if (err != AFC_E_SUCCESS) {
+		house_arrest_pool_entry_free(entry);
+		return err;
+	}
+
+	mutex_lock(&pool->mutex);
+	entry->next = pool->entries;
+	pool->entries = entry;
+	mutex_unlock(&pool->mutex);
+
+	*afc_client = entry->afc;
+
+	return AFC_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API house_arrest_error_t house_arrest_pool_release(house_arrest_pool_t pool, afc_client_t afc_client, int reusable)
+{
+	struct house_arrest_pool_entry *entry;
+	struct house_arrest_pool_entry **link;
+
+	if (!pool || !afc_client)
+		return HOUSE_ARREST_E_INVALID_ARG;
+
+	uint64_t now = house_arrest_time_ms();
+
+	mutex_lock(&pool->mutex);
+	for (link = &pool->entries; *link; link = &(*link)->next) {
+		if ((*link)->afc == afc_client && (*link)->in_use)
+			break;
+	}
+	entry = *link;
+	if (entry) {
+		if (reusable) {
+			entry->in_use = 0;
+			entry->last_used = now;
+			entry = NULL;
+		} else {
+			*link = entry->next;
+		}
+	} else {
+		mutex_unlock(&pool->mutex);
+		return HOUSE_ARREST_E_INVALID_ARG;
+	}
+	struct house_arrest_pool_entry *expired = house_arrest_pool_collect(pool, now, NULL, 0);
+	mutex_unlock(&pool->mutex);
+
+	if (entry)
+		house_arrest_pool_entry_free(entry);
+	house_arrest_pool_entries_free(expired);
+
+	return HOUSE_ARREST_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API house_arrest_error_t house_arrest_pool_flush(house_arrest_pool_t pool, const char *udid)
+{
+	if (!pool)
+		return HOUSE_ARREST_E_INVALID_ARG;
+
+	mutex_lock(&pool->mutex);
+	struct house_arrest_pool_entry *flushed = house_arrest_pool_collect(pool, 0, udid, 1);
+	mutex_unlock(&pool->mutex);
+
+	house_arrest_pool_entries_free(flushed);
+
+	return HOUSE_ARREST_E_SUCCESS;
+}
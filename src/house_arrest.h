@@ -24,6 +24,7 @@
 
 #include "libimobiledevice/house_arrest.h"
 #include "property_list_service.h"
+#include "common/thread.h"
 
 enum house_arrest_client_mode {
 	HOUSE_ARREST_CLIENT_MODE_NORMAL = 0,
@@ -35,4 +36,23 @@ struct house_arrest_client_private {
 	enum house_arrest_client_mode mode;
 };
 
+#define HOUSE_ARREST_POOL_DEFAULT_IDLE_TIMEOUT 30000
+
+struct house_arrest_pool_entry {
+	char *udid;
+	char *bundle_id;
+	char *command;
+	house_arrest_client_t house_arrest;
+	afc_client_t afc;
+	uint64_t last_used;
+	int in_use;
+	struct house_arrest_pool_entry *next;
+};
+
+struct house_arrest_pool_private {
+	struct house_arrest_pool_entry *entries;
+	unsigned int idle_timeout;
+	mutex_t mutex;
+};
+
 #endif
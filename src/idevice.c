@@ -29,6 +29,7 @@
 #include <string.h>
 #include <errno.h>
 #include <time.h>
+#include <sys/time.h>
 
 #include <usbmuxd.h>
 #ifdef HAVE_OPENSSL
@@ -44,6 +45,8 @@
 #include "common/socket.h"
 #include "common/thread.h"
 #include "common/debug.h"
+#include "common/trace.h"
+#include "common/probes.h"
 
 #ifdef WIN32
 #include <windows.h>
@@ -53,6 +56,12 @@
 #define ETIMEDOUT 138
 #endif
 
+#ifndef HAVE_OPENSSL
+/* size of the buffer GnuTLS reads encrypted data ahead into, large enough
+ * for a full TLS record */
+#define SSL_READ_AHEAD_SIZE 0x4400
+#endif
+
 #ifdef HAVE_OPENSSL
 
 #if OPENSSL_VERSION_NUMBER < 0x10100000L || \
@@ -104,7 +113,221 @@ static void id_function(CRYPTO_THREADID *thread)
 #endif
 #endif /* HAVE_OPENSSL */
 
-static void internal_idevice_init(void)
+#if defined(HAVE_OPENSSL) && (OPENSSL_VERSION_NUMBER < 0x10100000L || \
+	(defined(LIBRESSL_VERSION_NUMBER) && (LIBRESSL_VERSION_NUMBER < 0x20700000L)))
+#define X509_up_ref(x) CRYPTO_add(&(x)->references, 1, CRYPTO_LOCK_X509)
+#define SSL_CTX_up_ref(x) CRYPTO_add(&(x)->references, 1, CRYPTO_LOCK_SSL_CTX)
+#endif
+
+/* TLS state kept per pair record, so later connections to the same device
+ * reuse the SSL context and can resume the previous session */
+struct ssl_cache_entry {
+	char *udid;
+#ifdef HAVE_OPENSSL
+	X509 *root_cert;
+	int version;
+	SSL_CTX *ctx;
+	SSL_SESSION *session;
+	idevice_cipher_policy_t cipher_policy;
+#else
+	gnutls_datum_t session_data;
+#endif
+	struct ssl_cache_entry *next;
+};
+
+static mutex_t ssl_cache_mutex;
+static struct ssl_cache_entry *ssl_cache = NULL;
+
+/* policy of devices created from now on, see idevice_set_cipher_policy() */
+static idevice_cipher_policy_t default_cipher_policy = IDEVICE_CIPHER_POLICY_DEFAULT;
+
+#ifdef HAVE_OPENSSL
+/* TLS 1.2 and below; DEFAULT keeps everything else available afterwards */
+static const char *ssl_cipher_lists[] = {
+	NULL,
+	"ECDHE-RSA-AES128-GCM-SHA256:ECDHE-RSA-AES256-GCM-SHA384:AES128-GCM-SHA256:AES256-GCM-SHA384:DEFAULT",
+	"ECDHE-RSA-CHACHA20-POLY1305:ECDHE-RSA-AES128-GCM-SHA256:AES128-GCM-SHA256:DEFAULT",
+	"AES128-SHA:AES256-SHA:DEFAULT"
+};
+/* TLS 1.3 */
+static const char *ssl_cipher_suites[] = {
+	NULL,
+	"TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384:TLS_CHACHA20_POLY1305_SHA256",
+	"TLS_CHACHA20_POLY1305_SHA256:TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384",
+	NULL
+};
+#else
+#define SSL_PRIORITY_TLS10 "NONE:+VERS-TLS1.0:+ANON-DH:+RSA:+AES-128-CBC:+AES-256-CBC:+SHA1:+MD5:+COMP-NULL"
+#define SSL_PRIORITY_TLS12 "NONE:+VERS-TLS1.2:+VERS-TLS1.0:+ECDHE-RSA:+RSA:+AEAD:+SHA1:+MD5:+SIGN-ALL:+CURVE-ALL:+COMP-NULL"
+static const char *ssl_priorities[] = {
+	SSL_PRIORITY_TLS10,
+	SSL_PRIORITY_TLS12 ":+AES-128-GCM:+AES-256-GCM:+AES-128-CBC:+AES-256-CBC",
+	SSL_PRIORITY_TLS12 ":+CHACHA20-POLY1305:+AES-128-GCM:+AES-256-GCM:+AES-128-CBC:+AES-256-CBC",
+	SSL_PRIORITY_TLS10
+};
+#endif
+
+/* the ssl cache mutex must be held by the caller */
+static struct ssl_cache_entry *internal_ssl_cache_find(const char *udid, int create)
+{
+	struct ssl_cache_entry *entry;
+
+	for (entry = ssl_cache; entry; entry = entry->next) {
+		if (!strcmp(entry->udid, udid)) {
+			return entry;
+		}
+	}
+	if (!create) {
+		return NULL;
+	}
+
+	entry = (struct ssl_cache_entry*)malloc(sizeof(struct ssl_cache_entry));
+	if (!entry) {
+		return NULL;
+	}
+	entry->udid = strdup(udid);
+#ifdef HAVE_OPENSSL
+	entry->root_cert = NULL;
+	entry->version = 0;
+	entry->ctx = NULL;
+	entry->session = NULL;
+	entry->cipher_policy = IDEVICE_CIPHER_POLICY_DEFAULT;
+#else
+	entry->session_data.data = NULL;
+	entry->session_data.size = 0;
+#endif
+	entry->next = ssl_cache;
+	ssl_cache = entry;
+
+	return entry;
+}
+
+/* the ssl cache mutex must be held by the caller */
+static void internal_ssl_cache_entry_clear(struct ssl_cache_entry *entry)
+{
+#ifdef HAVE_OPENSSL
+	if (entry->session) {
+		SSL_SESSION_free(entry->session);
+		entry->session = NULL;
+	}
+	if (entry->ctx) {
+		/* connections still using the context must not find the entry */
+		SSL_CTX_set_app_data(entry->ctx, NULL);
+		SSL_CTX_free(entry->ctx);
+		entry->ctx = NULL;
+	}
+	if (entry->root_cert) {
+		X509_free(entry->root_cert);
+		entry->root_cert = NULL;
+	}
+#else
+	if (entry->session_data.data) {
+		gnutls_free(entry->session_data.data);
+		entry->session_data.data = NULL;
+		entry->session_data.size = 0;
+	}
+#endif
+}
+
+static void internal_ssl_cache_free(void)
+{
+	mutex_lock(&ssl_cache_mutex);
+	while (ssl_cache) {
+		struct ssl_cache_entry *entry = ssl_cache;
+		ssl_cache = entry->next;
+		internal_ssl_cache_entry_clear(entry);
+		free(entry->udid);
+		free(entry);
+	}
+	mutex_unlock(&ssl_cache_mutex);
+}
+
+/**
+ * Forgets the TLS session of a device, e.g. after resuming it failed.
+ */
+static void internal_ssl_cache_drop_session(const char *udid)
+{
+	mutex_lock(&ssl_cache_mutex);
+	struct ssl_cache_entry *entry = internal_ssl_cache_find(udid, 0);
+	if (entry) {
+#ifdef HAVE_OPENSSL
+		if (entry->session) {
+			SSL_SESSION_free(entry->session);
+			entry->session = NULL;
+		}
+#else
+		if (entry->session_data.data) {
+			gnutls_free(entry->session_data.data);
+			entry->session_data.data = NULL;
+			entry->session_data.size = 0;
+		}
+#endif
+	}
+	mutex_unlock(&ssl_cache_mutex);
+}
+
+#define IDEVICE_REGISTRY_HASH_SIZE 256
+
+struct idevice_registry_entry {
+	usbmuxd_device_info_t info;
+	struct idevice_registry_entry *hash_next;
+	struct idevice_registry_entry *prev;
+	struct idevice_registry_entry *next;
+};
+
+struct idevice_event_entry {
+	idevice_event_t event;
+	char udid[sizeof(((usbmuxd_device_info_t*)NULL)->udid)];
+	struct idevice_event_entry *next;
+};
+
+struct idevice_subscription_private {
+	char *udid;
+	int conn_types;
+	idevice_event_cb_t callback;
+	void *user_data;
+	/* events not yet passed to the callback */
+	mutex_t mutex;
+	cond_t cond;
+	struct idevice_event_entry *first;
+	struct idevice_event_entry *last;
+	int quit;
+	THREAD_T thread;
+	struct idevice_subscription_private *next;
+};
+
+/* devices known to usbmuxd, kept up to date by device events.
+ * Entries are hashed by UDID; a device can have one entry per
+ * connection type. The list keeps the order in which devices appeared. */
+static struct {
+	mutex_t setup_mutex;
+	mutex_t mutex;
+	int enabled;
+	usbmuxd_subscription_context_t context;
+	struct idevice_registry_entry *hash[IDEVICE_REGISTRY_HASH_SIZE];
+	struct idevice_registry_entry *first;
+	struct idevice_registry_entry *last;
+	unsigned int count;
+	/* registry wanted by idevice_set_device_registry() */
+	int requested;
+	/* subscribers for a specific device, hashed like the entries */
+	struct idevice_subscription_private *subscribers[IDEVICE_REGISTRY_HASH_SIZE];
+	/* subscribers for all devices */
+	struct idevice_subscription_private *subscribers_any;
+	unsigned int num_subscribers;
+} registry;
+
+/* open connections, so they can be aborted when their device is removed */
+static struct {
+	mutex_t mutex;
+	struct idevice_connection_private *first;
+} live_connections;
+
+/* the SSL library is only set up once the first connection enables SSL */
+static thread_once_t ssl_init_once = THREAD_ONCE_INIT;
+static int ssl_initialized = 0;
+
+static void internal_ssl_init(void)
 {
 #ifdef HAVE_OPENSSL
 #if OPENSSL_VERSION_NUMBER < 0x10100000L || defined(LIBRESSL_VERSION_NUMBER)
@@ -127,10 +350,34 @@ static void internal_idevice_init(void)
 #else
 	gnutls_global_init();
 #endif
+	ssl_initialized = 1;
+}
+
+void idevice_ssl_init(void)
+{
+	thread_once(&ssl_init_once, internal_ssl_init);
+}
+
+static void internal_idevice_init(void)
+{
+	mutex_init(&registry.setup_mutex);
+	mutex_init(&registry.mutex);
+	mutex_init(&ssl_cache_mutex);
+	mutex_init(&live_connections.mutex);
 }
 
 static void internal_idevice_deinit(void)
 {
+	/* the event thread of an active registry might still use the mutex */
+	if (!registry.enabled) {
+		mutex_destroy(&registry.mutex);
+		mutex_destroy(&registry.setup_mutex);
+	}
+	internal_ssl_cache_free();
+	mutex_destroy(&ssl_cache_mutex);
+	mutex_destroy(&live_connections.mutex);
+	if (!ssl_initialized)
+		return;
 #ifdef HAVE_OPENSSL
 #if OPENSSL_VERSION_NUMBER < 0x10100000L || defined(LIBRESSL_VERSION_NUMBER)
 	int i;
@@ -187,23 +434,90 @@ static void __attribute__((destructor)) libimobiledevice_deinitialize(void)
 }
 #endif
 
+/**
+ * Makes all pending and future I/O of a connection fail with the given
+ * error. Shutting the socket down wakes up threads blocked on it right away
+ * while the descriptor stays valid until the connection is closed.
+ */
+static void internal_connection_abort(idevice_connection_t connection, idevice_error_t reason)
+{
+	if (connection->cancelled)
+		return;
+	connection->cancelled = reason;
+	if (connection->type == CONNECTION_USBMUXD || connection->type == CONNECTION_NETWORK) {
+		socket_shutdown((int)(long)connection->data, SHUT_RDWR);
+	}
+}
+
+static void internal_connection_track(idevice_connection_t connection)
+{
+	mutex_lock(&live_connections.mutex);
+	connection->live_prev = NULL;
+	connection->live_next = live_connections.first;
+	if (live_connections.first)
+		live_connections.first->live_prev = connection;
+	live_connections.first = connection;
+	mutex_unlock(&live_connections.mutex);
+}
+
+static void internal_connection_untrack(idevice_connection_t connection)
+{
+	mutex_lock(&live_connections.mutex);
+	if (connection->live_prev)
+		connection->live_prev->live_next = connection->live_next;
+	else
+		live_connections.first = connection->live_next;
+	if (connection->live_next)
+		connection->live_next->live_prev = connection->live_prev;
+	mutex_unlock(&live_connections.mutex);
+}
+
+/**
+ * Aborts all connections to a device that was removed, so calls blocked on
+ * them don't have to wait for their timeout.
+ */
+static void idevice_connections_detach(uint32_t handle)
+{
+	idevice_connection_t connection;
+
+	mutex_lock(&live_connections.mutex);
+	for (connection = live_connections.first; connection; connection = connection->live_next) {
+		if (connection->mux_id == handle) {
+			debug_info("Aborting connection to removed device %d", handle);
+			internal_connection_abort(connection, IDEVICE_E_DEVICE_DETACHED);
+		}
+	}
+	mutex_unlock(&live_connections.mutex);
+}
+
 static idevice_event_cb_t event_cb = NULL;
 
+static int idevice_event_from_usbmuxd(int event_type, const usbmuxd_device_info_t *device, idevice_event_t *ev)
+{
+	ev->event = event_type;
+	ev->udid = device->udid;
+	ev->conn_type = 0;
+	if (device->conn_type == CONNECTION_TYPE_USB) {
+		ev->conn_type = CONNECTION_USBMUXD;
+	} else if (device->conn_type == CONNECTION_TYPE_NETWORK) {
+		ev->conn_type = CONNECTION_NETWORK;
+	} else {
+		debug_info("Unknown connection type %d", device->conn_type);
+		return -1;
+	}
+	return 0;
+}
+
 static void usbmux_event_cb(const usbmuxd_event_t *event, void *user_data)
 {
 	idevice_event_t ev;
 
-	ev.event = event->event;
-	ev.udid = event->device.udid;
-	ev.conn_type = 0;
-	if (event->device.conn_type == CONNECTION_TYPE_USB) {
-		ev.conn_type = CONNECTION_USBMUXD;
-	} else if (event->device.conn_type == CONNECTION_TYPE_NETWORK) {
-		ev.conn_type = CONNECTION_NETWORK;
-	} else {
-		debug_info("Unknown connection type %d", event->device.conn_type);
+	if (event->event == UE_DEVICE_REMOVE) {
+		idevice_connections_detach(event->device.handle);
 	}
 
+	idevice_event_from_usbmuxd(event->event, &event->device, &ev);
+
 	if (event_cb) {
 		event_cb(&ev, user_data);
 	}
@@ -232,564 +546,2566 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_event_unsubscribe(void)
 	return IDEVICE_E_SUCCESS;
 }
 
-LIBIMOBILEDEVICE_API idevice_error_t idevice_get_device_list_extended(idevice_info_t **devices, int *count)
+static unsigned int idevice_registry_hash(const char *udid)
 {
-	usbmuxd_device_info_t *dev_list;
-
-	*devices = NULL;
-	*count = 0;
-
-	if (usbmuxd_get_device_list(&dev_list) < 0) {
-		debug_info("ERROR: usbmuxd is not running!", __func__);
-		return IDEVICE_E_NO_DEVICE;
+	unsigned int hash = 2166136261u;
+	while (*udid) {
+		hash ^= (unsigned char)*udid++;
+		hash *= 16777619u;
 	}
+	return hash % IDEVICE_REGISTRY_HASH_SIZE;
+}
 
-	idevice_info_t *newlist = NULL;
-	int i, newcount = 0;
+static struct idevice_registry_entry *idevice_registry_find_handle(uint32_t handle, const char *udid)
+{
+	struct idevice_registry_entry *entry;
 
-	for (i = 0; dev_list[i].handle > 0; i++) {
-		newlist = realloc(*devices, sizeof(idevice_info_t) * (newcount+1));
-		newlist[newcount] = malloc(sizeof(struct idevice_info));
-		newlist[newcount]->udid = strdup(dev_list[i].udid);
-		if (dev_list[i].conn_type == CONNECTION_TYPE_USB) {
-			newlist[newcount]->conn_type = CONNECTION_USBMUXD;
-			newlist[newcount]->conn_data = NULL;
-		} else if (dev_list[i].conn_type == CONNECTION_TYPE_NETWORK) {
-			newlist[newcount]->conn_type = CONNECTION_NETWORK;
-			size_t addrlen = dev_list[i].conn_data[0];
-			newlist[newcount]->conn_data = malloc(addrlen);
-			memcpy(newlist[newcount]->conn_data, dev_list[i].conn_data, addrlen);
+	if (udid && *udid) {
+		for (entry = registry.hash[idevice_registry_hash(udid)]; entry; entry = entry->hash_next) {
+			if (entry->info.handle == handle) {
+				return entry;
+			}
 		}
-		newcount++;
-		*devices = newlist;
+		return NULL;
 	}
-	usbmuxd_device_list_free(&dev_list);
-
-	*count = newcount;
-	newlist = realloc(*devices, sizeof(idevice_info_t) * (newcount+1));
-	newlist[newcount] = NULL;
-	*devices = newlist;
-
-	return IDEVICE_E_SUCCESS;
-}
-
-LIBIMOBILEDEVICE_API idevice_error_t idevice_device_list_extended_free(idevice_info_t *devices)
-{
-	if (devices) {
-		int i = 0;
-		while (devices[i]) {
-			free(devices[i]->udid);
-			free(devices[i]->conn_data);
-			free(devices[i]);
-			i++;
+	for (entry = registry.first; entry; entry = entry->next) {
+		if (entry->info.handle == handle) {
+			return entry;
 		}
-		free(devices);
 	}
-	return IDEVICE_E_SUCCESS;
+	return NULL;
 }
 
-LIBIMOBILEDEVICE_API idevice_error_t idevice_get_device_list(char ***devices, int *count)
+/* the registry mutex must be held by the caller */
+static void idevice_registry_add(const usbmuxd_device_info_t *info)
 {
-	usbmuxd_device_info_t *dev_list;
-
-	*devices = NULL;
-	*count = 0;
-
-	if (usbmuxd_get_device_list(&dev_list) < 0) {
-		debug_info("ERROR: usbmuxd is not running!", __func__);
-		return IDEVICE_E_NO_DEVICE;
+	struct idevice_registry_entry *entry = idevice_registry_find_handle(info->handle, info->udid);
+	if (entry) {
+		memcpy(&entry->info, info, sizeof(usbmuxd_device_info_t));
+		return;
 	}
 
-	char **newlist = NULL;
-	int i, newcount = 0;
+	entry = (struct idevice_registry_entry*)malloc(sizeof(struct idevice_registry_entry));
+	if (!entry)
+		return;
+	memcpy(&entry->info, info, sizeof(usbmuxd_device_info_t));
 
-	for (i = 0; dev_list[i].handle > 0; i++) {
-		if (dev_list[i].conn_type == CONNECTION_TYPE_USB) {
-			newlist = realloc(*devices, sizeof(char*) * (newcount+1));
-			newlist[newcount++] = strdup(dev_list[i].udid);
-			*devices = newlist;
-		}
+	unsigned int idx = idevice_registry_hash(info->udid);
+	entry->hash_next = registry.hash[idx];
+	registry.hash[idx] = entry;
+
+	entry->next = NULL;
+	entry->prev = registry.last;
+	if (registry.last) {
+		registry.last->next = entry;
+	} else {
+		registry.first = entry;
 	}
-	usbmuxd_device_list_free(&dev_list);
+	registry.last = entry;
+	registry.count++;
+}
 
-	*count = newcount;
-	newlist = realloc(*devices, sizeof(char*) * (newcount+1));
-	newlist[newcount] = NULL;
-	*devices = newlist;
+/* the registry mutex must be held by the caller */
+static void idevice_registry_remove(struct idevice_registry_entry *entry)
+{
+	struct idevice_registry_entry **pp = &registry.hash[idevice_registry_hash(entry->info.udid)];
+	while (*pp && *pp != entry) {
+		pp = &(*pp)->hash_next;
+	}
+	if (*pp) {
+		*pp = entry->hash_next;
+	}
 
-	return IDEVICE_E_SUCCESS;
+	if (entry->prev) {
+		entry->prev->next = entry->next;
+	} else {
+		registry.first = entry->next;
+	}
+	if (entry->next) {
+		entry->next->prev = entry->prev;
+	} else {
+		registry.last = entry->prev;
+	}
+	registry.count--;
+	free(entry);
 }
 
-LIBIMOBILEDEVICE_API idevice_error_t idevice_device_list_free(char **devices)
+/* the registry mutex must be held by the caller */
+static void idevice_registry_clear(void)
 {
-	if (devices) {
-		int i = 0;
-		while (devices[i]) {
-			free(devices[i]);
-			i++;
-		}
-		free(devices);
+	while (registry.first) {
+		idevice_registry_remove(registry.first);
 	}
-	return IDEVICE_E_SUCCESS;
 }
 
-LIBIMOBILEDEVICE_API void idevice_set_debug_level(int level)
+/* the registry mutex must be held by the caller */
+static void idevice_subscription_queue(struct idevice_subscription_private *sub, int event_type, const usbmuxd_device_info_t *device)
 {
-	internal_set_debug_level(level);
+	struct idevice_event_entry *entry;
+	idevice_event_t ev;
+
+	if (idevice_event_from_usbmuxd(event_type, device, &ev) < 0)
+		return;
+	if (ev.conn_type == CONNECTION_USBMUXD && !(sub->conn_types & IDEVICE_LOOKUP_USBMUX))
+		return;
+	if (ev.conn_type == CONNECTION_NETWORK && !(sub->conn_types & IDEVICE_LOOKUP_NETWORK))
+		return;
+
+	entry = (struct idevice_event_entry*)malloc(sizeof(struct idevice_event_entry));
+	if (!entry)
+		return;
+	entry->event = ev;
+	strncpy(entry->udid, device->udid, sizeof(entry->udid) - 1);
+	entry->udid[sizeof(entry->udid) - 1] = '\0';
+	entry->event.udid = entry->udid;
+	entry->next = NULL;
+
+	mutex_lock(&sub->mutex);
+	if (sub->last) {
+		sub->last->next = entry;
+	} else {
+		sub->first = entry;
+		cond_signal(&sub->cond);
+	}
+	sub->last = entry;
+	mutex_unlock(&sub->mutex);
 }
 
-static idevice_t idevice_from_mux_device(usbmuxd_device_info_t *muxdev)
+/* the registry mutex must be held by the caller */
+static void idevice_subscription_dispatch(int event_type, const usbmuxd_device_info_t *device)
 {
-	if (!muxdev)
-		return NULL;
+	struct idevice_subscription_private *sub;
 
-	idevice_t device = (idevice_t)malloc(sizeof(struct idevice_private));
-	if (!device)
-		return NULL;
+	for (sub = registry.subscribers_any; sub; sub = sub->next) {
+		idevice_subscription_queue(sub, event_type, device);
+	}
+	for (sub = registry.subscribers[idevice_registry_hash(device->udid)]; sub; sub = sub->next) {
+		if (strcmp(sub->udid, device->udid) == 0) {
+			idevice_subscription_queue(sub, event_type, device);
+		}
+	}
+}
 
-	device->udid = strdup(muxdev->udid);
-	device->mux_id = muxdev->handle;
-	device->version = 0;
-	switch (muxdev->conn_type) {
-	case CONNECTION_TYPE_USB:
-		device->conn_type = CONNECTION_USBMUXD;
-		device->conn_data = NULL;
+static void idevice_registry_event_cb(const usbmuxd_event_t *event, void *user_data)
+{
+	struct idevice_registry_entry *entry;
+
+	mutex_lock(&registry.mutex);
+	switch (event->event) {
+	case UE_DEVICE_ADD:
+	case UE_DEVICE_PAIRED:
+		idevice_registry_add(&event->device);
 		break;
-	case CONNECTION_TYPE_NETWORK:
-		device->conn_type = CONNECTION_NETWORK;
-		size_t len = ((uint8_t*)muxdev->conn_data)[0];
-		device->conn_data = malloc(len);
-		memcpy(device->conn_data, muxdev->conn_data, len);
+	case UE_DEVICE_REMOVE:
+		entry = idevice_registry_find_handle(event->device.handle, event->device.udid);
+		if (entry) {
+			idevice_registry_remove(entry);
+		}
+		idevice_connections_detach(event->device.handle);
 		break;
 	default:
-		device->conn_type = 0;
-		device->conn_data = NULL;
 		break;
 	}
-	return device;
+	idevice_subscription_dispatch(event->event, &event->device);
+	mutex_unlock(&registry.mutex);
 }
 
-LIBIMOBILEDEVICE_API idevice_error_t idevice_new_with_options(idevice_t * device, const char *udid, enum idevice_options options)
+/**
+ * Looks up a device in the registry like usbmuxd_get_device() does.
+ *
+ * @return 1 if the device was found, 0 if it was not found, or -1 if the
+ *    registry is not enabled.
+ */
+static int idevice_registry_get_device(const char *udid, usbmuxd_device_info_t *device, int options)
 {
-	usbmuxd_device_info_t muxdev;
-	int usbmux_options = 0;
-	if (options & IDEVICE_LOOKUP_USBMUX) {
-		usbmux_options |= DEVICE_LOOKUP_USBMUX;
-	}
-	if (options & IDEVICE_LOOKUP_NETWORK) {
-		usbmux_options |= DEVICE_LOOKUP_NETWORK;
+	struct idevice_registry_entry *entry;
+	struct idevice_registry_entry *dev_usbmuxd = NULL;
+	struct idevice_registry_entry *dev_network = NULL;
+	int res = 0;
+
+	if (!(options & (DEVICE_LOOKUP_USBMUX | DEVICE_LOOKUP_NETWORK))) {
+		options |= DEVICE_LOOKUP_USBMUX;
 	}
-	if (options & IDEVICE_LOOKUP_PREFER_NETWORK) {
-		usbmux_options |= DEVICE_LOOKUP_PREFER_NETWORK;
+
+	mutex_lock(&registry.mutex);
+	if (!registry.enabled) {
+		mutex_unlock(&registry.mutex);
+		return -1;
 	}
-	int res = usbmuxd_get_device(udid, &muxdev, usbmux_options);
-	if (res > 0) {
-		*device = idevice_from_mux_device(&muxdev);
-		if (!*device) {
-			return IDEVICE_E_UNKNOWN_ERROR;
+
+	entry = (udid) ? registry.hash[idevice_registry_hash(udid)] : registry.first;
+	for (; entry; entry = (udid) ? entry->hash_next : entry->next) {
+		if (udid && strcmp(entry->info.udid, udid) != 0) {
+			continue;
+		}
+		if (entry->info.conn_type == CONNECTION_TYPE_USB && (options & DEVICE_LOOKUP_USBMUX)) {
+			if (!dev_usbmuxd)
+				dev_usbmuxd = entry;
+		} else if (entry->info.conn_type == CONNECTION_TYPE_NETWORK && (options & DEVICE_LOOKUP_NETWORK)) {
+			if (!dev_network)
+				dev_network = entry;
+		}
+		if (dev_usbmuxd && dev_network) {
+			break;
 		}
-		return IDEVICE_E_SUCCESS;
 	}
-	return IDEVICE_E_NO_DEVICE;
-}
+
+	if (dev_network && ((options & DEVICE_LOOKUP_PREFER_NETWORK) || !dev_usbmuxd)) {
+		memcpy(device, &dev_network->info, sizeof(usbmuxd_device_info_t));
+		res = 1;
+	} else if (dev_usbmuxd) {
+		memcpy(device, &dev_usbmuxd->info, sizeof(usbmuxd_device_info_t));
+		res = 1;
+	}
+	mutex_unlock(&registry.mutex);
+
+	return res;
+}
+
+/**
+ * Gets the list of devices from the registry if it is enabled, or from
+ * usbmuxd otherwise. The list must be freed with
+ * idevice_mux_device_list_free().
+ */
+static int idevice_get_mux_device_list(usbmuxd_device_info_t **dev_list)
+{
+	mutex_lock(&registry.mutex);
+	if (registry.enabled) {
+		struct idevice_registry_entry *entry;
+		unsigned int i = 0;
+		*dev_list = (usbmuxd_device_info_t*)malloc(sizeof(usbmuxd_device_info_t) * (registry.count + 1));
+		if (!*dev_list) {
+			mutex_unlock(&registry.mutex);
+			return -1;
+		}
+		for (entry = registry.first; entry; entry = entry->next) {
+			memcpy(&(*dev_list)[i++], &entry->info, sizeof(usbmuxd_device_info_t));
+		}
+		memset(&(*dev_list)[i], '\0', sizeof(usbmuxd_device_info_t));
+		mutex_unlock(&registry.mutex);
+		return i;
+	}
+	mutex_unlock(&registry.mutex);
+
+	return usbmuxd_get_device_list(dev_list);
+}
+
+static void idevice_mux_device_list_free(usbmuxd_device_info_t **dev_list)
+{
+	/* usbmuxd_device_list_free() only releases the array itself */
+	free(*dev_list);
+	*dev_list = NULL;
+}
+
+/**
+ * Populates the registry and subscribes to device events of usbmuxd.
+ * Both registry mutexes must be held by the caller.
+ */
+static idevice_error_t idevice_registry_start(void)
+{
+	usbmuxd_device_info_t *dev_list = NULL;
+	int i;
+
+	/* populate the registry before subscribing, events for devices
+	 * that are already known just update their entries */
+	if (usbmuxd_get_device_list(&dev_list) < 0) {
+		debug_info("ERROR: usbmuxd is not running!");
+		return IDEVICE_E_NO_DEVICE;
+	}
+	for (i = 0; dev_list[i].handle > 0; i++) {
+		idevice_registry_add(&dev_list[i]);
+	}
+	usbmuxd_device_list_free(&dev_list);
+
+	/* the event callback takes the registry mutex */
+	mutex_unlock(&registry.mutex);
+	int res = usbmuxd_events_subscribe(&registry.context, idevice_registry_event_cb, NULL);
+	mutex_lock(&registry.mutex);
+	if (res != 0) {
+		debug_info("ERROR: usbmuxd_events_subscribe() returned %d!", res);
+		idevice_registry_clear();
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+	registry.enabled = 1;
+
+	return IDEVICE_E_SUCCESS;
+}
+
+/**
+ * Unsubscribes from usbmuxd and empties the registry.
+ * Both registry mutexes must be held by the caller.
+ */
+static void idevice_registry_stop(void)
+{
+	registry.enabled = 0;
+	mutex_unlock(&registry.mutex);
+	usbmuxd_events_unsubscribe(registry.context);
+	mutex_lock(&registry.mutex);
+	registry.context = NULL;
+	idevice_registry_clear();
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_set_device_registry(int enable)
+{
+	idevice_error_t ret = IDEVICE_E_SUCCESS;
+
+	mutex_lock(&registry.setup_mutex);
+	mutex_lock(&registry.mutex);
+	if (enable && !registry.enabled) {
+		ret = idevice_registry_start();
+	} else if (!enable && registry.enabled && registry.num_subscribers == 0) {
+		/* event subscribers keep the registry running */
+		idevice_registry_stop();
+	}
+	if (ret == IDEVICE_E_SUCCESS) {
+		registry.requested = (enable) ? 1 : 0;
+	}
+	mutex_unlock(&registry.mutex);
+	mutex_unlock(&registry.setup_mutex);
+
+	return ret;
+}
+
+static void* idevice_subscription_thread(void *arg)
+{
+	struct idevice_subscription_private *sub = (struct idevice_subscription_private*)arg;
+
+	mutex_lock(&sub->mutex);
+	while (1) {
+		while (!sub->first && !sub->quit) {
+			cond_wait(&sub->cond, &sub->mutex);
+		}
+		if (sub->quit)
+			break;
+
+		/* take all queued events at once and deliver them unlocked */
+		struct idevice_event_entry *entry = sub->first;
+		sub->first = sub->last = NULL;
+		mutex_unlock(&sub->mutex);
+		while (entry) {
+			struct idevice_event_entry *next = entry->next;
+			sub->callback(&entry->event, sub->user_data);
+			free(entry);
+			entry = next;
+		}
+		mutex_lock(&sub->mutex);
+	}
+	mutex_unlock(&sub->mutex);
+
+	return NULL;
+}
+
+static void idevice_subscription_free(struct idevice_subscription_private *sub)
+{
+	while (sub->first) {
+		struct idevice_event_entry *next = sub->first->next;
+		free(sub->first);
+		sub->first = next;
+	}
+	cond_destroy(&sub->cond);
+	mutex_destroy(&sub->mutex);
+	free(sub->udid);
+	free(sub);
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_events_subscribe(idevice_subscription_t *subscription, idevice_event_cb_t callback, void *user_data, const char *udid, int options)
+{
+	idevice_error_t ret = IDEVICE_E_SUCCESS;
+
+	if (!subscription || !callback)
+		return IDEVICE_E_INVALID_ARG;
+
+	struct idevice_subscription_private *sub = (struct idevice_subscription_private*)calloc(1, sizeof(struct idevice_subscription_private));
+	if (!sub)
+		return IDEVICE_E_UNKNOWN_ERROR;
+	sub->udid = (udid && *udid) ? strdup(udid) : NULL;
+	sub->conn_types = options & (IDEVICE_LOOKUP_USBMUX | IDEVICE_LOOKUP_NETWORK);
+	if (!sub->conn_types) {
+		sub->conn_types = IDEVICE_LOOKUP_USBMUX | IDEVICE_LOOKUP_NETWORK;
+	}
+	sub->callback = callback;
+	sub->user_data = user_data;
+	mutex_init(&sub->mutex);
+	cond_init(&sub->cond);
+
+	if (thread_new(&sub->thread, idevice_subscription_thread, sub) != 0) {
+		idevice_subscription_free(sub);
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+
+	mutex_lock(&registry.setup_mutex);
+	mutex_lock(&registry.mutex);
+	if (!registry.enabled) {
+		ret = idevice_registry_start();
+	}
+	if (ret == IDEVICE_E_SUCCESS) {
+		struct idevice_registry_entry *entry;
+
+		/* report the devices that are already known, queued under the same
+		 * lock as the events so none get lost or reported twice */
+		if (options & IDEVICE_EVENTS_REPORT_EXISTING) {
+			for (entry = (sub->udid) ? registry.hash[idevice_registry_hash(sub->udid)] : registry.first; entry; entry = (sub->udid) ? entry->hash_next : entry->next) {
+				if (sub->udid && strcmp(entry->info.udid, sub->udid) != 0)
+					continue;
+				idevice_subscription_queue(sub, IDEVICE_DEVICE_ADD, &entry->info);
+			}
+		}
+
+		struct idevice_subscription_private **list = (sub->udid) ? &registry.subscribers[idevice_registry_hash(sub->udid)] : &registry.subscribers_any;
+		sub->next = *list;
+		*list = sub;
+		registry.num_subscribers++;
+	}
+	mutex_unlock(&registry.mutex);
+	mutex_unlock(&registry.setup_mutex);
+
+	if (ret != IDEVICE_E_SUCCESS) {
+		mutex_lock(&sub->mutex);
+		sub->quit = 1;
+		cond_signal(&sub->cond);
+		mutex_unlock(&sub->mutex);
+		thread_join(sub->thread);
+		thread_free(sub->thread);
+		idevice_subscription_free(sub);
+		return ret;
+	}
+
+	*subscription = sub;
+
+	return IDEVICE_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_events_unsubscribe(idevice_subscription_t subscription)
+{
+	struct idevice_subscription_private **pp;
+
+	if (!subscription)
+		return IDEVICE_E_INVALID_ARG;
+
+	mutex_lock(&registry.setup_mutex);
+	mutex_lock(&registry.mutex);
+	pp = (subscription->udid) ? &registry.subscribers[idevice_registry_hash(subscription->udid)] : &registry.subscribers_any;
+	while (*pp && *pp != subscription) {
+		pp = &(*pp)->next;
+	}
+	if (!*pp) {
+		mutex_unlock(&registry.mutex);
+		mutex_unlock(&registry.setup_mutex);
+		return IDEVICE_E_INVALID_ARG;
+	}
+	*pp = subscription->next;
+	registry.num_subscribers--;
+	if (registry.num_subscribers == 0 && !registry.requested && registry.enabled) {
+		idevice_registry_stop();
+	}
+	mutex_unlock(&registry.mutex);
+	mutex_unlock(&registry.setup_mutex);
+
+	/* no new events can be queued anymore, let the thread finish */
+	mutex_lock(&subscription->mutex);
+	subscription->quit = 1;
+	cond_signal(&subscription->cond);
+	mutex_unlock(&subscription->mutex);
+	thread_join(subscription->thread);
+	thread_free(subscription->thread);
+	idevice_subscription_free(subscription);
+
+	return IDEVICE_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_get_device_list_extended(idevice_info_t **devices, int *count)
+{
+	usbmuxd_device_info_t *dev_list;
+
+	*devices = NULL;
+	*count = 0;
+
+	if (idevice_get_mux_device_list(&dev_list) < 0) {
+		debug_info("ERROR: usbmuxd is not running!", __func__);
+		return IDEVICE_E_NO_DEVICE;
+	}
+
+	idevice_info_t *newlist = NULL;
+	int i, newcount = 0;
+
+	for (i = 0; dev_list[i].handle > 0; i++) {
+		newlist = realloc(*devices, sizeof(idevice_info_t) * (newcount+1));
+		newlist[newcount] = malloc(sizeof(struct idevice_info));
+		newlist[newcount]->udid = strdup(dev_list[i].udid);
+		if (dev_list[i].conn_type == CONNECTION_TYPE_USB) {
+			newlist[newcount]->conn_type = CONNECTION_USBMUXD;
+			newlist[newcount]->conn_data = NULL;
+		} else if (dev_list[i].conn_type == CONNECTION_TYPE_NETWORK) {
+			newlist[newcount]->conn_type = CONNECTION_NETWORK;
+			size_t addrlen = dev_list[i].conn_data[0];
+			newlist[newcount]->conn_data = malloc(addrlen);
+			memcpy(newlist[newcount]->conn_data, dev_list[i].conn_data, addrlen);
+		}
+		newcount++;
+		*devices = newlist;
+	}
+	idevice_mux_device_list_free(&dev_list);
+
+	*count = newcount;
+	newlist = realloc(*devices, sizeof(idevice_info_t) * (newcount+1));
+	newlist[newcount] = NULL;
+	*devices = newlist;
+
+	return IDEVICE_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_device_list_extended_free(idevice_info_t *devices)
+{
+	if (devices) {
+		int i = 0;
+		while (devices[i]) {
+			free(devices[i]->udid);
+			free(devices[i]->conn_data);
+			free(devices[i]);
+			i++;
+		}
+		free(devices);
+	}
+	return IDEVICE_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_get_device_list(char ***devices, int *count)
+{
+	usbmuxd_device_info_t *dev_list;
+
+	*devices = NULL;
+	*count = 0;
+
+	if (idevice_get_mux_device_list(&dev_list) < 0) {
+		debug_info("ERROR: usbmuxd is not running!", __func__);
+		return IDEVICE_E_NO_DEVICE;
+	}
+
+	char **newlist = NULL;
+	int i, newcount = 0;
+
+	for (i = 0; dev_list[i].handle > 0; i++) {
+		if (dev_list[i].conn_type == CONNECTION_TYPE_USB) {
+			newlist = realloc(*devices, sizeof(char*) * (newcount+1));
+			newlist[newcount++] = strdup(dev_list[i].udid);
+			*devices = newlist;
+		}
+	}
+	idevice_mux_device_list_free(&dev_list);
+
+	*count = newcount;
+	newlist = realloc(*devices, sizeof(char*) * (newcount+1));
+	newlist[newcount] = NULL;
+	*devices = newlist;
+
+	return IDEVICE_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_device_list_free(char **devices)
+{
+	if (devices) {
+		int i = 0;
+		while (devices[i]) {
+			free(devices[i]);
+			i++;
+		}
+		free(devices);
+	}
+	return IDEVICE_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API void idevice_set_debug_level(int level)
+{
+	internal_set_debug_level(level);
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_trace_start(unsigned int events_per_thread, idevice_trace_cb_t callback, unsigned int interval, void *user_data)
+{
+	int res = trace_start(events_per_thread, callback, interval, user_data);
+	if (res == -1)
+		return IDEVICE_E_INVALID_ARG;
+	return (res == 0) ? IDEVICE_E_SUCCESS : IDEVICE_E_UNKNOWN_ERROR;
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_trace_stop(void)
+{
+	return (trace_stop() == 0) ? IDEVICE_E_SUCCESS : IDEVICE_E_INVALID_ARG;
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_trace_dump(idevice_trace_cb_t callback, void *user_data)
+{
+	if (!callback)
+		return IDEVICE_E_INVALID_ARG;
+	trace_dump(callback, user_data);
+	return IDEVICE_E_SUCCESS;
+}
+
+/* lockdown values of the global domain that are cached per device, with
+ * the number of seconds they stay valid or 0 if they never change */
+static const struct {
+	const char *key;
+	unsigned int ttl;
+} idevice_cacheable_values[] = {
+	{ "UniqueDeviceID", 0 },
+	{ "UniqueChipID", 0 },
+	{ "ChipID", 0 },
+	{ "BoardId", 0 },
+	{ "DieID", 0 },
+	{ "SerialNumber", 0 },
+	{ "ProductType", 0 },
+	{ "HardwareModel", 0 },
+	{ "HardwarePlatform", 0 },
+	{ "ModelNumber", 0 },
+	{ "DeviceClass", 0 },
+	{ "CPUArchitecture", 0 },
+	{ "WiFiAddress", 0 },
+	{ "BluetoothAddress", 0 },
+	{ "EthernetAddress", 0 },
+	{ "ProductName", 3600 },
+	{ "ProductVersion", 3600 },
+	{ "BuildVersion", 3600 },
+	{ "DeviceName", 30 },
+	{ NULL, 0 }
+};
+
+static int idevice_value_cache_lookup_ttl(const char *domain, const char *key, unsigned int *ttl)
+{
+	int i;
+
+	if (domain || !key)
+		return 0;
+
+	for (i = 0; idevice_cacheable_values[i].key; i++) {
+		if (!strcmp(idevice_cacheable_values[i].key, key)) {
+			*ttl = idevice_cacheable_values[i].ttl;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void idevice_value_cache_entry_free(struct idevice_value_cache_entry *entry)
+{
+	free(entry->key);
+	plist_free(entry->value);
+	free(entry);
+}
+
+void idevice_value_cache_enable(idevice_t device, int enable)
+{
+	mutex_lock(&device->value_cache_mutex);
+	device->value_cache_enabled = enable;
+	mutex_unlock(&device->value_cache_mutex);
+	if (!enable) {
+		idevice_value_cache_invalidate(device, NULL);
+	}
+}
+
+/**
+ * Returns a copy of a cached lockdown value, or NULL if the value is not
+ * cached or has expired.
+ */
+plist_t idevice_value_cache_get(idevice_t device, const char *domain, const char *key)
+{
+	plist_t value = NULL;
+	struct idevice_value_cache_entry *entry;
+
+	if (!device || domain || !key)
+		return NULL;
+
+	mutex_lock(&device->value_cache_mutex);
+	if (device->value_cache_enabled) {
+		time_t now = time(NULL);
+		for (entry = device->value_cache; entry; entry = entry->next) {
+			if (!strcmp(entry->key, key)) {
+				if (entry->expires == 0 || now < entry->expires) {
+					value = plist_copy(entry->value);
+				}
+				break;
+			}
+		}
+	}
+	mutex_unlock(&device->value_cache_mutex);
+
+	return value;
+}
+
+/**
+ * Stores a copy of a lockdown value in the cache if caching is enabled for
+ * the device and the value is known to be immutable or slow-changing.
+ */
+void idevice_value_cache_set(idevice_t device, const char *domain, const char *key, plist_t value)
+{
+	unsigned int ttl = 0;
+	struct idevice_value_cache_entry *entry;
+
+	if (!device || !value || !idevice_value_cache_lookup_ttl(domain, key, &ttl))
+		return;
+
+	mutex_lock(&device->value_cache_mutex);
+	if (device->value_cache_enabled) {
+		for (entry = device->value_cache; entry; entry = entry->next) {
+			if (!strcmp(entry->key, key)) {
+				break;
+			}
+		}
+		if (!entry) {
+			entry = (struct idevice_value_cache_entry*)malloc(sizeof(struct idevice_value_cache_entry));
+			entry->key = strdup(key);
+			entry->value = NULL;
+			entry->next = device->value_cache;
+			device->value_cache = entry;
+		}
+		plist_free(entry->value);
+		entry->value = plist_copy(value);
+		entry->expires = (ttl > 0) ? time(NULL) + ttl : 0;
+	}
+	mutex_unlock(&device->value_cache_mutex);
+}
+
+/**
+ * Removes a value from the cache, or all cached values if key is NULL.
+ */
+void idevice_value_cache_invalidate(idevice_t device, const char *key)
+{
+	struct idevice_value_cache_entry **prev;
+
+	if (!device)
+		return;
+
+	mutex_lock(&device->value_cache_mutex);
+	prev = &device->value_cache;
+	while (*prev) {
+		struct idevice_value_cache_entry *entry = *prev;
+		if (!key || !strcmp(entry->key, key)) {
+			*prev = entry->next;
+			idevice_value_cache_entry_free(entry);
+		} else {
+			prev = &entry->next;
+		}
+	}
+	mutex_unlock(&device->value_cache_mutex);
+}
+
+static void idevice_connection_pool_entry_free(struct idevice_connection_pool_entry *entry)
+{
+	idevice_disconnect(entry->connection);
+	free(entry->name);
+	free(entry);
+}
+
+/**
+ * Removes entries that have been idle for too long, and the oldest entries
+ * beyond the given limit, from the pool and returns them as a list.
+ * The pool mutex must be held by the caller.
+ */
+static struct idevice_connection_pool_entry *idevice_connection_pool_prune(idevice_t device, unsigned int limit)
+{
+	struct idevice_connection_pool_entry *expired = NULL;
+	struct idevice_connection_pool_entry **prev = &device->pool;
+	time_t now = time(NULL);
+	unsigned int count = 0;
+
+	while (*prev) {
+		struct idevice_connection_pool_entry *entry = *prev;
+		if (count >= limit || (device->pool_idle_timeout > 0 && now - entry->idle_since >= (time_t)device->pool_idle_timeout)) {
+			*prev = entry->next;
+			entry->next = expired;
+			expired = entry;
+		} else {
+			count++;
+			prev = &entry->next;
+		}
+	}
+
+	return expired;
+}
+
+static void idevice_connection_pool_free_list(struct idevice_connection_pool_entry *list)
+{
+	while (list) {
+		struct idevice_connection_pool_entry *next = list->next;
+		idevice_connection_pool_entry_free(list);
+		list = next;
+	}
+}
+
+/**
+ * Checks if data can be read from an SSL session without waiting for the
+ * socket, either already decrypted or read ahead but not yet decrypted.
+ */
+static int internal_ssl_pending(ssl_data_t ssl_data)
+{
+#ifdef HAVE_OPENSSL
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L && !defined(LIBRESSL_VERSION_NUMBER)
+	/* also covers data read ahead but not yet processed */
+	return SSL_has_pending(ssl_data->session);
+#else
+	return (SSL_pending(ssl_data->session) > 0);
+#endif
+#else
+	return (gnutls_record_check_pending(ssl_data->session) > 0 || ssl_data->read_ahead_len > ssl_data->read_ahead_pos);
+#endif
+}
+
+/**
+ * Checks if data can be received from a connection without waiting for its
+ * file descriptor, because it is buffered or already decrypted.
+ */
+int idevice_connection_has_pending_data(idevice_connection_t connection)
+{
+	if (connection->recv_buffer_len > connection->recv_buffer_pos) {
+		return 1;
+	}
+	if (connection->ssl_data && connection->ssl_data->session) {
+		return internal_ssl_pending(connection->ssl_data);
+	}
+	return 0;
+}
+
+/**
+ * Checks if an idle connection is still usable. An idle connection must not
+ * have any pending data; if it is readable the device either closed it or
+ * sent something nobody asked for.
+ */
+static int idevice_connection_is_idle(idevice_connection_t connection)
+{
+	if (connection->recv_buffer_len > connection->recv_buffer_pos) {
+		return 0;
+	}
+	if (connection->ssl_data) {
+		if (!connection->ssl_data->session) {
+			return 0;
+		}
+		if (internal_ssl_pending(connection->ssl_data)) {
+			return 0;
+		}
+	}
+	int fd = (int)(long)connection->data;
+	return (socket_check_fd(fd, FDM_READ, 1) == -ETIMEDOUT);
+}
+
+int idevice_connection_pool_enabled(idevice_t device)
+{
+	int enabled;
+
+	mutex_lock(&device->pool_mutex);
+	enabled = (device->pool_max_idle > 0);
+	mutex_unlock(&device->pool_mutex);
+
+	return enabled;
+}
+
+/**
+ * Puts an idle service connection into the pool of the device.
+ *
+ * @return 1 if the pool took ownership of the connection, 0 if pooling is
+ *    disabled and the caller has to close the connection.
+ */
+int idevice_connection_pool_put(idevice_t device, const char *name, uint16_t port, idevice_connection_t connection)
+{
+	struct idevice_connection_pool_entry *expired = NULL;
+	int res = 0;
+
+	if (!device || !name || !connection)
+		return 0;
+
+	struct idevice_connection_pool_entry *entry = (struct idevice_connection_pool_entry*)malloc(sizeof(struct idevice_connection_pool_entry));
+	if (!entry)
+		return 0;
+	entry->name = strdup(name);
+	entry->port = port;
+	entry->connection = connection;
+	entry->idle_since = time(NULL);
+
+	mutex_lock(&device->pool_mutex);
+	if (device->pool_max_idle > 0) {
+		/* most recently used connections go first */
+		entry->next = device->pool;
+		device->pool = entry;
+		expired = idevice_connection_pool_prune(device, device->pool_max_idle);
+		res = 1;
+	}
+	mutex_unlock(&device->pool_mutex);
+
+	if (!res) {
+		free(entry->name);
+		free(entry);
+	}
+	idevice_connection_pool_free_list(expired);
+
+	return res;
+}
+
+/**
+ * Takes a healthy idle connection for the given service from the pool of
+ * the device, along with the port it was connected to.
+ *
+ * @return The connection or NULL if there is none.
+ */
+idevice_connection_t idevice_connection_pool_take(idevice_t device, const char *name, uint16_t *port)
+{
+	idevice_connection_t connection = NULL;
+
+	if (!device || !name)
+		return NULL;
+
+	while (!connection) {
+		struct idevice_connection_pool_entry *entry = NULL;
+		struct idevice_connection_pool_entry *expired = NULL;
+		struct idevice_connection_pool_entry **prev;
+
+		mutex_lock(&device->pool_mutex);
+		expired = idevice_connection_pool_prune(device, device->pool_max_idle);
+		for (prev = &device->pool; *prev; prev = &(*prev)->next) {
+			if (!strcmp((*prev)->name, name)) {
+				entry = *prev;
+				*prev = entry->next;
+				break;
+			}
+		}
+		mutex_unlock(&device->pool_mutex);
+
+		idevice_connection_pool_free_list(expired);
+		if (!entry) {
+			break;
+		}
+
+		if (idevice_connection_is_idle(entry->connection)) {
+			connection = entry->connection;
+			*port = entry->port;
+			free(entry->name);
+			free(entry);
+		} else {
+			debug_info("Dropping stale pooled connection for %s", name);
+			idevice_connection_pool_entry_free(entry);
+		}
+	}
+
+	return connection;
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_set_connection_pool(idevice_t device, unsigned int max_idle, unsigned int idle_timeout)
+{
+	struct idevice_connection_pool_entry *expired = NULL;
+
+	if (!device)
+		return IDEVICE_E_INVALID_ARG;
+
+	mutex_lock(&device->pool_mutex);
+	device->pool_max_idle = max_idle;
+	device->pool_idle_timeout = idle_timeout;
+	expired = idevice_connection_pool_prune(device, max_idle);
+	mutex_unlock(&device->pool_mutex);
+
+	idevice_connection_pool_free_list(expired);
+
+	return IDEVICE_E_SUCCESS;
+}
+
+/**
+ * Feeds a measured round trip time in microseconds into the estimator of
+ * the given operation class, using the smoothing of RFC 6298 (gain 1/8
+ * for the mean, 1/4 for the variation).
+ */
+void idevice_rtt_sample(idevice_t device, const char *op_class, uint64_t rtt)
+{
+	struct idevice_rtt_estimate *entry;
+
+	if (!device || !op_class)
+		return;
+
+	mutex_lock(&device->rtt_mutex);
+	for (entry = device->rtt_estimates; entry; entry = entry->next) {
+		if (!strcmp(entry->op_class, op_class))
+			break;
+	}
+	if (!entry) {
+		entry = (struct idevice_rtt_estimate*)calloc(1, sizeof(struct idevice_rtt_estimate));
+		if (entry)
+			entry->op_class = strdup(op_class);
+		if (!entry || !entry->op_class) {
+			free(entry);
+			mutex_unlock(&device->rtt_mutex);
+			return;
+		}
+		entry->next = device->rtt_estimates;
+		device->rtt_estimates = entry;
+	}
+	if (entry->samples == 0) {
+		entry->srtt = rtt;
+		entry->rttvar = rtt / 2;
+	} else {
+		uint64_t delta = (rtt > entry->srtt) ? rtt - entry->srtt : entry->srtt - rtt;
+		entry->rttvar = (3 * entry->rttvar + delta) / 4;
+		entry->srtt = (7 * entry->srtt + rtt) / 8;
+	}
+	entry->samples++;
+	mutex_unlock(&device->rtt_mutex);
+}
+
+/**
+ * Gets the current estimate of an operation class.
+ *
+ * @return 1 if at least one sample has been taken, 0 otherwise.
+ */
+int idevice_rtt_get(idevice_t device, const char *op_class, uint64_t *srtt, uint64_t *rttvar)
+{
+	struct idevice_rtt_estimate *entry;
+	int res = 0;
+
+	if (!device || !op_class)
+		return 0;
+
+	mutex_lock(&device->rtt_mutex);
+	for (entry = device->rtt_estimates; entry; entry = entry->next) {
+		if (!strcmp(entry->op_class, op_class)) {
+			*srtt = entry->srtt;
+			*rttvar = entry->rttvar;
+			res = 1;
+			break;
+		}
+	}
+	mutex_unlock(&device->rtt_mutex);
+
+	return res;
+}
+
+static idevice_t idevice_from_mux_device(usbmuxd_device_info_t *muxdev)
+{
+	if (!muxdev)
+		return NULL;
+
+	idevice_t device = (idevice_t)malloc(sizeof(struct idevice_private));
+	if (!device)
+		return NULL;
+
+	device->udid = strdup(muxdev->udid);
+	device->mux_id = muxdev->handle;
+	device->version = 0;
+	device->handshake_validated = 0;
+	mutex_init(&device->lockdown_mutex);
+	device->lockdown_reuse = 0;
+	device->lockdown_session = NULL;
+	mutex_init(&device->value_cache_mutex);
+	device->value_cache_enabled = 0;
+	device->value_cache = NULL;
+	mutex_init(&device->pool_mutex);
+	device->pool_max_idle = 0;
+	device->pool_idle_timeout = 0;
+	device->pool = NULL;
+	device->network_profile = NULL;
+	mutex_init(&device->rtt_mutex);
+	device->rtt_estimates = NULL;
+	mutex_init(&device->arena_mutex);
+	device->arena = idevice_memory_arena_new(NULL);
+	mutex_lock(&ssl_cache_mutex);
+	device->cipher_policy = default_cipher_policy;
+	mutex_unlock(&ssl_cache_mutex);
+	device->cipher = NULL;
+	device->loopback = NULL;
+	switch (muxdev->conn_type) {
+	case CONNECTION_TYPE_USB:
+		device->conn_type = CONNECTION_USBMUXD;
+		device->conn_data = NULL;
+		break;
+	case CONNECTION_TYPE_NETWORK:
+		device->conn_type = CONNECTION_NETWORK;
+		size_t len = ((uint8_t*)muxdev->conn_data)[0];
+		device->conn_data = malloc(len);
+		memcpy(device->conn_data, muxdev->conn_data, len);
+		break;
+	default:
+		device->conn_type = 0;
+		device->conn_data = NULL;
+		break;
+	}
+	return device;
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_new_with_options(idevice_t * device, const char *udid, enum idevice_options options)
+{
+	usbmuxd_device_info_t muxdev;
+	int usbmux_options = 0;
+	if (options & IDEVICE_LOOKUP_USBMUX) {
+		usbmux_options |= DEVICE_LOOKUP_USBMUX;
+	}
+	if (options & IDEVICE_LOOKUP_NETWORK) {
+		usbmux_options |= DEVICE_LOOKUP_NETWORK;
+	}
+	if (options & IDEVICE_LOOKUP_PREFER_NETWORK) {
+		usbmux_options |= DEVICE_LOOKUP_PREFER_NETWORK;
+	}
+	/* devices that are not in the registry (yet) are looked up with usbmuxd */
+	int res = idevice_registry_get_device(udid, &muxdev, usbmux_options);
+	if (res <= 0) {
+		res = usbmuxd_get_device(udid, &muxdev, usbmux_options);
+	}
+	if (res > 0) {
+		*device = idevice_from_mux_device(&muxdev);
+		if (!*device) {
+			return IDEVICE_E_UNKNOWN_ERROR;
+		}
+		return IDEVICE_E_SUCCESS;
+	}
+	return IDEVICE_E_NO_DEVICE;
+}
 
 LIBIMOBILEDEVICE_API idevice_error_t idevice_new(idevice_t * device, const char *udid)
 {
-	return idevice_new_with_options(device, udid, 0);
+	return idevice_new_with_options(device, udid, 0);
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_free(idevice_t device)
+{
+	if (!device)
+		return IDEVICE_E_INVALID_ARG;
+	idevice_error_t ret = IDEVICE_E_UNKNOWN_ERROR;
+
+	ret = IDEVICE_E_SUCCESS;
+
+	idevice_set_connection_pool(device, 0, 0);
+	mutex_destroy(&device->pool_mutex);
+
+	if (device->lockdown_session) {
+		lockdownd_client_free(device->lockdown_session);
+		device->lockdown_session = NULL;
+	}
+	mutex_destroy(&device->lockdown_mutex);
+
+	idevice_value_cache_invalidate(device, NULL);
+	mutex_destroy(&device->value_cache_mutex);
+
+	while (device->rtt_estimates) {
+		struct idevice_rtt_estimate *entry = device->rtt_estimates;
+		device->rtt_estimates = entry->next;
+		free(entry->op_class);
+		free(entry);
+	}
+	mutex_destroy(&device->rtt_mutex);
+
+	/* buffers still allocated for the device keep the arena around */
+	idevice_memory_arena_unref(device->arena);
+	mutex_destroy(&device->arena_mutex);
+
+	free(device->network_profile);
+	free(device->udid);
+
+	if (device->conn_data) {
+		free(device->conn_data);
+	}
+	free(device);
+	return ret;
+}
+
+static uint64_t internal_time_ms(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+/**
+ * Applies a network profile to the socket of a network connection.
+ *
+ * @return 0 on success, -1 if a setting could not be applied.
+ */
+static int internal_apply_network_profile(int sfd, const idevice_network_profile_t *profile)
+{
+	int res = 0;
+
+	if (socket_set_nodelay(sfd, profile->nodelay) < 0)
+		res = -1;
+
+	if (profile->bandwidth > 0 && profile->rtt > 0) {
+		/* keep a full bandwidth-delay product in flight */
+		uint64_t bdp = (uint64_t)profile->bandwidth * profile->rtt / 1000;
+		if (bdp < IDEVICE_NETWORK_MIN_BUFFER_SIZE)
+			bdp = IDEVICE_NETWORK_MIN_BUFFER_SIZE;
+		if (bdp > IDEVICE_NETWORK_MAX_BUFFER_SIZE)
+			bdp = IDEVICE_NETWORK_MAX_BUFFER_SIZE;
+		if (socket_set_buffer_sizes(sfd, (int)bdp, (int)bdp) < 0)
+			res = -1;
+	}
+
+	if (socket_set_keepalive(sfd, profile->keepalive_idle, profile->keepalive_interval, profile->keepalive_count) < 0)
+		res = -1;
+
+	return res;
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_set_network_profile(idevice_t device, const idevice_network_profile_t *profile)
+{
+	if (!device)
+		return IDEVICE_E_INVALID_ARG;
+
+	idevice_network_profile_t *copy = NULL;
+	if (profile) {
+		copy = (idevice_network_profile_t*)malloc(sizeof(idevice_network_profile_t));
+		if (!copy)
+			return IDEVICE_E_UNKNOWN_ERROR;
+		memcpy(copy, profile, sizeof(idevice_network_profile_t));
+	}
+	free(device->network_profile);
+	device->network_profile = copy;
+
+	return IDEVICE_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_set_cipher_policy(idevice_t device, idevice_cipher_policy_t policy)
+{
+	if ((int)policy < IDEVICE_CIPHER_POLICY_DEFAULT || policy > IDEVICE_CIPHER_POLICY_AES_CBC)
+		return IDEVICE_E_INVALID_ARG;
+
+	if (!device) {
+		mutex_lock(&ssl_cache_mutex);
+		default_cipher_policy = policy;
+		mutex_unlock(&ssl_cache_mutex);
+		return IDEVICE_E_SUCCESS;
+	}
+
+	mutex_lock(&ssl_cache_mutex);
+	int changed = (device->cipher_policy != policy);
+	device->cipher_policy = policy;
+	mutex_unlock(&ssl_cache_mutex);
+
+	/* a resumed session would keep the cipher negotiated before */
+	if (changed) {
+		internal_ssl_cache_drop_session(device->udid);
+	}
+
+	return IDEVICE_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_get_cipher(idevice_t device, char **name)
+{
+	if (!device || !name)
+		return IDEVICE_E_INVALID_ARG;
+
+	mutex_lock(&ssl_cache_mutex);
+	*name = (device->cipher) ? strdup(device->cipher) : NULL;
+	mutex_unlock(&ssl_cache_mutex);
+
+	return (*name) ? IDEVICE_E_SUCCESS : IDEVICE_E_NOT_ENOUGH_DATA;
+}
+
+/**
+ * Creates the connection object for a connected socket of a device.
+ */
+static idevice_connection_t internal_connection_new(idevice_t device, enum idevice_connection_type type, int sfd)
+{
+	idevice_connection_t new_connection = (idevice_connection_t)malloc(sizeof(struct idevice_connection_private));
+	if (!new_connection) {
+		return NULL;
+	}
+	new_connection->type = type;
+	new_connection->data = (void*)(long)sfd;
+	new_connection->ssl_data = NULL;
+	new_connection->device = device;
+	new_connection->arena = idevice_get_memory_arena(device);
+	new_connection->recv_buffer = NULL;
+	new_connection->recv_buffer_size = 0;
+	new_connection->recv_buffer_pos = 0;
+	new_connection->recv_buffer_len = 0;
+	new_connection->connected_at = internal_time_ms();
+	new_connection->bytes_sent = 0;
+	new_connection->bytes_received = 0;
+	new_connection->mux_id = device->mux_id;
+	new_connection->cancelled = 0;
+	internal_connection_track(new_connection);
+
+	return new_connection;
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_connect(idevice_t device, uint16_t port, idevice_connection_t *connection)
+{
+	if (!device) {
+		return IDEVICE_E_INVALID_ARG;
+	}
+
+	if (device->loopback) {
+		/* the emulator only accepts the pair record it was created with */
+		userpref_pin_pair_record(device->udid, device->loopback->pair_record);
+		int sfd = device->loopback->connect(port, device->loopback->user_data);
+		if (sfd < 0) {
+			debug_info("ERROR: Connecting to port %d of the emulated device failed", port);
+			return IDEVICE_E_NO_DEVICE;
+		}
+		/* plain socket I/O, like a network connection */
+		*connection = internal_connection_new(device, CONNECTION_NETWORK, sfd);
+		if (!*connection) {
+			socket_close(sfd);
+			return IDEVICE_E_UNKNOWN_ERROR;
+		}
+		return IDEVICE_E_SUCCESS;
+	} else if (device->conn_type == CONNECTION_USBMUXD) {
+		int sfd = usbmuxd_connect(device->mux_id, port);
+		if (sfd < 0) {
+			debug_info("ERROR: Connecting to usbmuxd failed: %d (%s)", sfd, strerror(-sfd));
+			return IDEVICE_E_UNKNOWN_ERROR;
+		}
+		*connection = internal_connection_new(device, CONNECTION_USBMUXD, sfd);
+		if (!*connection) {
+			usbmuxd_disconnect(sfd);
+			return IDEVICE_E_UNKNOWN_ERROR;
+		}
+		return IDEVICE_E_SUCCESS;
+	} else if (device->conn_type == CONNECTION_NETWORK) {
+		struct sockaddr_storage saddr_storage;
+		struct sockaddr* saddr = (struct sockaddr*)&saddr_storage;
+
+		/* FIXME: Improve handling of this platform/host dependent connection data */
+		if (((char*)device->conn_data)[1] == 0x02) { // AF_INET
+			saddr->sa_family = AF_INET;
+			memcpy(&saddr->sa_data[0], (char*)device->conn_data + 2, 14);
+		}
+		else if (((char*)device->conn_data)[1] == 0x1E) { // AF_INET6 (bsd)
+#ifdef AF_INET6
+			saddr->sa_family = AF_INET6;
+			/* copy the address and the host dependent scope id */
+			memcpy(&saddr->sa_data[0], (char*)device->conn_data + 2, 26);
+#else
+			debug_info("ERROR: Got an IPv6 address but this system doesn't support IPv6");
+			return IDEVICE_E_UNKNOWN_ERROR;
+#endif
+		}
+		else {
+			debug_info("Unsupported address family 0x%02x", ((char*)device->conn_data)[1]);
+			return IDEVICE_E_UNKNOWN_ERROR;
+		}
+
+		char addrtxt[48];
+		addrtxt[0] = '\0';
+
+		if (!socket_addr_to_string(saddr, addrtxt, sizeof(addrtxt))) {
+			debug_info("Failed to convert network address: %d (%s)", errno, strerror(errno));
+		}
+
+		debug_info("Connecting to %s port %d...", addrtxt, port);
+
+		int sfd = socket_connect_addr(saddr, port);
+		if (sfd < 0) {
+			debug_info("ERROR: Connecting to network device failed: %d (%s)", errno, strerror(errno));
+			return IDEVICE_E_NO_DEVICE;
+		}
+		if (device->network_profile) {
+			internal_apply_network_profile(sfd, device->network_profile);
+		}
+
+		*connection = internal_connection_new(device, CONNECTION_NETWORK, sfd);
+		if (!*connection) {
+			socket_close(sfd);
+			return IDEVICE_E_UNKNOWN_ERROR;
+		}
+
+		return IDEVICE_E_SUCCESS;
+	} else {
+		debug_info("Unknown connection type %d", device->conn_type);
+	}
+
+	return IDEVICE_E_UNKNOWN_ERROR;
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_disconnect(idevice_connection_t connection)
+{
+	if (!connection) {
+		return IDEVICE_E_INVALID_ARG;
+	}
+	internal_connection_untrack(connection);
+
+	/* shut down ssl if enabled, an aborted connection can't send the alert anymore */
+	if (connection->ssl_data) {
+		idevice_connection_disable_bypass_ssl(connection, connection->cancelled ? 1 : 0);
+	}
+	idevice_error_t result = IDEVICE_E_UNKNOWN_ERROR;
+	if (connection->type == CONNECTION_USBMUXD) {
+		usbmuxd_disconnect((int)(long)connection->data);
+		connection->data = NULL;
+		result = IDEVICE_E_SUCCESS;
+	} else if (connection->type == CONNECTION_NETWORK) {
+		socket_close((int)(long)connection->data);
+		connection->data = NULL;
+		result = IDEVICE_E_SUCCESS;
+	} else {
+		debug_info("Unknown connection type %d", connection->type);
+	}
+
+	idevice_memory_free(connection->recv_buffer);
+	idevice_memory_arena_unref(connection->arena);
+	free(connection);
+	connection = NULL;
+
+	return result;
+}
+
+/**
+ * Reports the error a connection was aborted with, if it was, so no I/O is
+ * attempted on its shut down socket.
+ */
+static idevice_error_t internal_connection_cancelled(idevice_connection_t connection)
+{
+	if (connection && connection->cancelled)
+		return (idevice_error_t)connection->cancelled;
+	return IDEVICE_E_SUCCESS;
+}
+
+/**
+ * Replaces the error of an operation that failed because the connection got
+ * aborted meanwhile with the reason it was aborted for.
+ */
+static idevice_error_t internal_cancel_status(idevice_connection_t connection, idevice_error_t res)
+{
+	if (res != IDEVICE_E_SUCCESS && connection && connection->cancelled)
+		return (idevice_error_t)connection->cancelled;
+	return res;
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_cancel(idevice_connection_t connection)
+{
+	if (!connection)
+		return IDEVICE_E_INVALID_ARG;
+
+	internal_connection_abort(connection, IDEVICE_E_CANCELLED);
+
+	return IDEVICE_E_SUCCESS;
+}
+
+/**
+ * Internally used function to send raw data over the given connection.
+ */
+static idevice_error_t internal_connection_send(idevice_connection_t connection, const char *data, uint32_t len, uint32_t *sent_bytes)
+{
+	if (!connection || !data) {
+		return IDEVICE_E_INVALID_ARG;
+	}
+
+	if (connection->type == CONNECTION_USBMUXD) {
+		int res = usbmuxd_send((int)(long)connection->data, data, len, sent_bytes);
+		if (res < 0) {
+			debug_info("ERROR: usbmuxd_send returned %d (%s)", res, strerror(-res));
+			return IDEVICE_E_UNKNOWN_ERROR;
+		}
+		return IDEVICE_E_SUCCESS;
+	} else if (connection->type == CONNECTION_NETWORK) {
+		int s = socket_send((int)(long)connection->data, (void*)data, len);
+		if (s < 0) {
+			*sent_bytes = 0;
+			return IDEVICE_E_UNKNOWN_ERROR;
+		}
+		*sent_bytes = s;
+		return IDEVICE_E_SUCCESS;
+	} else {
+		debug_info("Unknown connection type %d", connection->type);
+	}
+	return IDEVICE_E_UNKNOWN_ERROR;
+
+}
+
+static idevice_error_t socket_recv_to_idevice_error(int conn_error, uint32_t len, uint32_t received)
+{
+	if (conn_error < 0) {
+		switch (conn_error) {
+			case -EAGAIN:
+				debug_info("ERROR: received partial data %d/%d (%s)", received, len, strerror(-conn_error));
+				return IDEVICE_E_NOT_ENOUGH_DATA;
+			case -ETIMEDOUT:
+				return IDEVICE_E_TIMEOUT;
+			default:
+				return IDEVICE_E_UNKNOWN_ERROR;
+		}
+	}
+
+	return IDEVICE_E_SUCCESS;
+}
+
+#ifdef HAVE_OPENSSL
+/**
+ * Internally used function to wait until the socket of an SSL connection is
+ * ready for the operation OpenSSL asked for.
+ */
+static idevice_error_t internal_ssl_wait(idevice_connection_t connection, int sslerr, unsigned int timeout, uint32_t received)
+{
+	fd_mode fdm;
+
+	switch (sslerr) {
+		case SSL_ERROR_WANT_READ:
+			fdm = FDM_READ;
+			break;
+		case SSL_ERROR_WANT_WRITE:
+			fdm = FDM_WRITE;
+			break;
+		default:
+			debug_info("ERROR: SSL error %d", sslerr);
+			return IDEVICE_E_SSL_ERROR;
+	}
+
+	int conn_error = socket_check_fd((int)(long)connection->data, fdm, timeout);
+	if (conn_error > 0) {
+		return IDEVICE_E_SUCCESS;
+	}
+	return socket_recv_to_idevice_error(conn_error, 0, received);
+}
+#endif
+
+/**
+ * Internally used function to send data over an SSL enabled connection.
+ */
+static idevice_error_t internal_ssl_send(idevice_connection_t connection, const char *data, uint32_t len, uint32_t *sent_bytes)
+{
+	uint32_t sent = 0;
+	while (sent < len) {
+#ifdef HAVE_OPENSSL
+		/* the socket is non-blocking, so only wait when OpenSSL asks for it */
+		int s = SSL_write(connection->ssl_data->session, (const void*)(data+sent), (int)(len-sent));
+		if (s <= 0) {
+			idevice_error_t error = internal_ssl_wait(connection, SSL_get_error(connection->ssl_data->session, s), 100, 0);
+			if (error == IDEVICE_E_SUCCESS || error == IDEVICE_E_TIMEOUT) {
+				continue;
+			}
+			break;
+		}
+#else
+		ssize_t s = gnutls_record_send(connection->ssl_data->session, (void*)(data+sent), (size_t)(len-sent));
+#endif
+		if (s < 0) {
+			break;
+		}
+		sent += s;
+	}
+	debug_info("SSL_write %d, sent %d", len, sent);
+	connection->bytes_sent += sent;
+	if (sent < len) {
+		*sent_bytes = 0;
+		return IDEVICE_E_SSL_ERROR;
+	}
+	*sent_bytes = sent;
+	return IDEVICE_E_SUCCESS;
+}
+
+/**
+ * Internally used function to send all of the given data over a connection.
+ */
+static idevice_error_t internal_send(idevice_connection_t connection, const char *data, uint32_t len, uint32_t *sent_bytes)
+{
+	if (!connection || !data || (connection->ssl_data && !connection->ssl_data->session)) {
+		return IDEVICE_E_INVALID_ARG;
+	}
+
+	if (connection->ssl_data) {
+		return internal_ssl_send(connection, data, len, sent_bytes);
+	} else {
+		uint32_t sent = 0;
+		while (sent < len) {
+			uint32_t bytes = 0;
+			int s = internal_connection_send(connection, data+sent, len-sent, &bytes);
+			if (s < 0) {
+				break;
+			}
+			sent += bytes;
+		}
+		debug_info("internal_connection_send %d, sent %d", len, sent);
+		connection->bytes_sent += sent;
+		if (sent < len) {
+			*sent_bytes = 0;
+			return IDEVICE_E_NOT_ENOUGH_DATA;
+		}
+		*sent_bytes = sent;
+		return IDEVICE_E_SUCCESS;
+	}
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_send(idevice_connection_t connection, const char *data, uint32_t len, uint32_t *sent_bytes)
+{
+	PROBE2(connection__send__start, IDEVICE_CONNECTION_UDID(connection), len);
+	idevice_error_t res = internal_connection_cancelled(connection);
+	if (res == IDEVICE_E_SUCCESS)
+		res = internal_cancel_status(connection, internal_send(connection, data, len, sent_bytes));
+	PROBE4(connection__send__done, IDEVICE_CONNECTION_UDID(connection), len, (res == IDEVICE_E_SUCCESS) ? *sent_bytes : 0, res);
+	return res;
+}
+
+#ifndef WIN32
+/**
+ * Internally used function to send data from multiple buffers over a plain
+ * connection with as few writes as possible.
+ */
+static idevice_error_t internal_connection_sendv(idevice_connection_t connection, const idevice_iovec_t *iov, int iovcnt, uint32_t *sent_bytes)
+{
+	struct iovec vec[IDEVICE_IOV_MAX];
+	uint32_t total = 0;
+	uint32_t sent = 0;
+	int i = 0;
+
+	*sent_bytes = 0;
+
+	while (i < iovcnt) {
+		/* map the next batch of buffers */
+		int cnt = 0;
+		uint32_t batch_len = 0;
+		while (i + cnt < iovcnt && cnt < IDEVICE_IOV_MAX) {
+			vec[cnt].iov_base = iov[i+cnt].data;
+			vec[cnt].iov_len = iov[i+cnt].len;
+			batch_len += iov[i+cnt].len;
+			cnt++;
+		}
+		total += batch_len;
+
+		/* send the batch, advancing over partial writes */
+		int first = 0;
+		while (first < cnt) {
+			int s = socket_sendv((int)(long)connection->data, vec + first, cnt - first);
+			if (s < 0) {
+				debug_info("ERROR: socket_sendv returned %d (%s)", s, strerror(errno));
+				*sent_bytes = sent;
+				return IDEVICE_E_UNKNOWN_ERROR;
+			}
+			sent += s;
+			while (first < cnt && (size_t)s >= vec[first].iov_len) {
+				s -= vec[first].iov_len;
+				first++;
+			}
+			if (first < cnt) {
+				vec[first].iov_base = (char*)vec[first].iov_base + s;
+				vec[first].iov_len -= s;
+			}
+		}
+		i += cnt;
+	}
+	debug_info("socket_sendv %d, sent %d", total, sent);
+
+	*sent_bytes = sent;
+	return IDEVICE_E_SUCCESS;
+}
+#endif
+
+static idevice_error_t internal_sendv(idevice_connection_t connection, const idevice_iovec_t *iov, int iovcnt, uint32_t *sent_bytes)
+{
+	int i;
+
+	if (!connection || !iov || iovcnt <= 0 || !sent_bytes || (connection->ssl_data && !connection->ssl_data->session)) {
+		return IDEVICE_E_INVALID_ARG;
+	}
+
+	*sent_bytes = 0;
+
+	if (connection->ssl_data) {
+		uint32_t total = 0;
+		for (i = 0; i < iovcnt; i++) {
+			total += iov[i].len;
+		}
+		if (total == 0) {
+			return IDEVICE_E_SUCCESS;
+		}
+		if (iovcnt == 1) {
+			return internal_ssl_send(connection, iov[0].data, iov[0].len, sent_bytes);
+		}
+
+		/* coalesce buffers into full sized records, a small message like a
+		 * length prefixed plist ends up in a single record */
+		uint32_t record_size = (total < IDEVICE_SSL_RECORD_SIZE) ? total : IDEVICE_SSL_RECORD_SIZE;
+		char *record = (char*)idevice_memory_alloc(connection->arena, record_size);
+		uint32_t fill = 0;
+		uint32_t sent = 0;
+		idevice_error_t res = IDEVICE_E_SUCCESS;
+		if (!record) {
+			return IDEVICE_E_UNKNOWN_ERROR;
+		}
+		for (i = 0; i < iovcnt && res == IDEVICE_E_SUCCESS; i++) {
+			uint32_t done = 0;
+			while (done < iov[i].len) {
+				uint32_t n = iov[i].len - done;
+				if (n > record_size - fill) {
+					n = record_size - fill;
+				}
+				memcpy(record + fill, iov[i].data + done, n);
+				fill += n;
+				done += n;
+				if (fill == record_size) {
+					uint32_t bytes = 0;
+					res = internal_ssl_send(connection, record, fill, &bytes);
+					if (res != IDEVICE_E_SUCCESS) {
+						break;
+					}
+					sent += bytes;
+					fill = 0;
+				}
+			}
+		}
+		if (res == IDEVICE_E_SUCCESS && fill > 0) {
+			uint32_t bytes = 0;
+			res = internal_ssl_send(connection, record, fill, &bytes);
+			sent += bytes;
+		}
+		idevice_memory_free(record);
+		if (res != IDEVICE_E_SUCCESS) {
+			return res;
+		}
+		*sent_bytes = sent;
+		return IDEVICE_E_SUCCESS;
+	}
+
+	if (connection->type != CONNECTION_USBMUXD && connection->type != CONNECTION_NETWORK) {
+		debug_info("Unknown connection type %d", connection->type);
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+
+#ifdef WIN32
+	/* no vectored socket I/O here, send the buffers one after another */
+	for (i = 0; i < iovcnt; i++) {
+		uint32_t bytes = 0;
+		if (iov[i].len == 0) {
+			continue;
+		}
+		idevice_error_t res = idevice_connection_send(connection, iov[i].data, iov[i].len, &bytes);
+		*sent_bytes += bytes;
+		if (res != IDEVICE_E_SUCCESS) {
+			return res;
+		}
+	}
+	return IDEVICE_E_SUCCESS;
+#else
+	uint32_t total = 0;
+	for (i = 0; i < iovcnt; i++) {
+		total += iov[i].len;
+	}
+	idevice_error_t res = internal_connection_sendv(connection, iov, iovcnt, sent_bytes);
+	connection->bytes_sent += *sent_bytes;
+	if (res == IDEVICE_E_SUCCESS && *sent_bytes < total) {
+		*sent_bytes = 0;
+		return IDEVICE_E_NOT_ENOUGH_DATA;
+	}
+	return res;
+#endif
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_sendv(idevice_connection_t connection, const idevice_iovec_t *iov, int iovcnt, uint32_t *sent_bytes)
+{
+	idevice_error_t res = internal_connection_cancelled(connection);
+	if (res != IDEVICE_E_SUCCESS)
+		return res;
+	return internal_cancel_status(connection, internal_sendv(connection, iov, iovcnt, sent_bytes));
 }
 
-LIBIMOBILEDEVICE_API idevice_error_t idevice_free(idevice_t device)
+/**
+ * Internally used function for receiving raw data over the given connection
+ * using a timeout.
+ */
+static idevice_error_t internal_connection_receive_timeout(idevice_connection_t connection, char *data, uint32_t len, uint32_t *recv_bytes, unsigned int timeout)
 {
-	if (!device)
+	if (!connection) {
 		return IDEVICE_E_INVALID_ARG;
-	idevice_error_t ret = IDEVICE_E_UNKNOWN_ERROR;
+	}
 
-	ret = IDEVICE_E_SUCCESS;
+	if (connection->type == CONNECTION_USBMUXD) {
+		int conn_error = usbmuxd_recv_timeout((int)(long)connection->data, data, len, recv_bytes, timeout);
+		idevice_error_t error = socket_recv_to_idevice_error(conn_error, len, *recv_bytes);
+		if (conn_error >= 0)
+			connection->bytes_received += *recv_bytes;
 
-	free(device->udid);
+		if (error == IDEVICE_E_UNKNOWN_ERROR) {
+			debug_info("ERROR: usbmuxd_recv_timeout returned %d (%s)", conn_error, strerror(-conn_error));
+		}
 
-	if (device->conn_data) {
-		free(device->conn_data);
+		return error;
+	} else if (connection->type == CONNECTION_NETWORK) {
+		int res = socket_receive_timeout((int)(long)connection->data, data, len, 0, timeout);
+		if (res < 0) {
+			debug_info("ERROR: socket_receive_timeout failed: %d (%s)", res, strerror(-res));
+			return (res == -EAGAIN ? IDEVICE_E_NOT_ENOUGH_DATA : IDEVICE_E_UNKNOWN_ERROR);
+		}
+		*recv_bytes = (uint32_t)res;
+		connection->bytes_received += *recv_bytes;
+		return IDEVICE_E_SUCCESS;
+	} else {
+		debug_info("Unknown connection type %d", connection->type);
 	}
-	free(device);
-	return ret;
+	return IDEVICE_E_UNKNOWN_ERROR;
 }
 
-LIBIMOBILEDEVICE_API idevice_error_t idevice_connect(idevice_t device, uint16_t port, idevice_connection_t *connection)
+/**
+ * Internally used function for receiving whatever data is available on the
+ * given connection (plain or SSL) with a single read, waiting at most
+ * timeout milliseconds for the first byte.
+ */
+static idevice_error_t internal_connection_receive_some(idevice_connection_t connection, char *data, uint32_t len, uint32_t *recv_bytes, unsigned int timeout)
 {
-	if (!device) {
-		return IDEVICE_E_INVALID_ARG;
+	*recv_bytes = 0;
+
+	if (!connection->ssl_data) {
+		return internal_connection_receive_timeout(connection, data, len, recv_bytes, timeout);
 	}
 
-	if (device->conn_type == CONNECTION_USBMUXD) {
-		int sfd = usbmuxd_connect(device->mux_id, port);
-		if (sfd < 0) {
-			debug_info("ERROR: Connecting to usbmuxd failed: %d (%s)", sfd, strerror(-sfd));
-			return IDEVICE_E_UNKNOWN_ERROR;
+	while (1) {
+#ifdef HAVE_OPENSSL
+		/* the socket is non-blocking, so only wait when OpenSSL asks for it */
+		int r = SSL_read(connection->ssl_data->session, (void*)data, (int)len);
+		if (r <= 0) {
+			idevice_error_t error = internal_ssl_wait(connection, SSL_get_error(connection->ssl_data->session, r), timeout, 0);
+			if (error != IDEVICE_E_SUCCESS) {
+				return error;
+			}
+			continue;
+		}
+#else
+		if (!internal_ssl_pending(connection->ssl_data)) {
+			int conn_error = socket_check_fd((int)(long)connection->data, FDM_READ, timeout);
+			idevice_error_t error = socket_recv_to_idevice_error(conn_error, len, 0);
+			if (error != IDEVICE_E_SUCCESS) {
+				return error;
+			}
+		}
+		ssize_t r = gnutls_record_recv(connection->ssl_data->session, (void*)data, (size_t)len);
+		if (r == GNUTLS_E_AGAIN || r == GNUTLS_E_INTERRUPTED) {
+			continue;
+		}
+		if (r <= 0) {
+			return IDEVICE_E_SSL_ERROR;
 		}
-		idevice_connection_t new_connection = (idevice_connection_t)malloc(sizeof(struct idevice_connection_private));
-		new_connection->type = CONNECTION_USBMUXD;
-		new_connection->data = (void*)(long)sfd;
-		new_connection->ssl_data = NULL;
-		new_connection->device = device;
-		*connection = new_connection;
+#endif
+		*recv_bytes = (uint32_t)r;
+		connection->bytes_received += *recv_bytes;
 		return IDEVICE_E_SUCCESS;
-	} else if (device->conn_type == CONNECTION_NETWORK) {
-		struct sockaddr_storage saddr_storage;
-		struct sockaddr* saddr = (struct sockaddr*)&saddr_storage;
+	}
+}
 
-		/* FIXME: Improve handling of this platform/host dependent connection data */
-		if (((char*)device->conn_data)[1] == 0x02) { // AF_INET
-			saddr->sa_family = AF_INET;
-			memcpy(&saddr->sa_data[0], (char*)device->conn_data + 2, 14);
+/**
+ * Internally used function to fill the receive buffer of a connection with
+ * a single read.
+ */
+static idevice_error_t internal_connection_fill_buffer(idevice_connection_t connection, unsigned int timeout)
+{
+	uint32_t bytes = 0;
+
+	/* move remaining data to the front */
+	if (connection->recv_buffer_pos > 0) {
+		memmove(connection->recv_buffer, connection->recv_buffer + connection->recv_buffer_pos, connection->recv_buffer_len - connection->recv_buffer_pos);
+		connection->recv_buffer_len -= connection->recv_buffer_pos;
+		connection->recv_buffer_pos = 0;
+	}
+	if (connection->recv_buffer_len >= connection->recv_buffer_size) {
+		return IDEVICE_E_SUCCESS;
+	}
+
+	idevice_error_t res = internal_connection_receive_some(connection, connection->recv_buffer + connection->recv_buffer_len, connection->recv_buffer_size - connection->recv_buffer_len, &bytes, timeout);
+	if (res != IDEVICE_E_SUCCESS) {
+		return res;
+	}
+	if (bytes == 0) {
+		return IDEVICE_E_TIMEOUT;
+	}
+	connection->recv_buffer_len += bytes;
+	return IDEVICE_E_SUCCESS;
+}
+
+/**
+ * Internally used function for receiving data through the receive buffer of
+ * a connection. Small reads are served from the buffer which is refilled with
+ * as much data as is available, large reads go directly to the caller's
+ * buffer once the buffered data has been consumed.
+ */
+static idevice_error_t internal_connection_receive_buffered(idevice_connection_t connection, char *data, uint32_t len, uint32_t *recv_bytes, unsigned int timeout)
+{
+	idevice_error_t res = IDEVICE_E_SUCCESS;
+	uint32_t received = 0;
+
+	while (received < len) {
+		uint32_t avail = connection->recv_buffer_len - connection->recv_buffer_pos;
+		if (avail > 0) {
+			uint32_t n = (avail > len - received) ? len - received : avail;
+			memcpy(data + received, connection->recv_buffer + connection->recv_buffer_pos, n);
+			connection->recv_buffer_pos += n;
+			received += n;
+			continue;
 		}
-		else if (((char*)device->conn_data)[1] == 0x1E) { // AF_INET6 (bsd)
-#ifdef AF_INET6
-			saddr->sa_family = AF_INET6;
-			/* copy the address and the host dependent scope id */
-			memcpy(&saddr->sa_data[0], (char*)device->conn_data + 2, 26);
+		connection->recv_buffer_pos = 0;
+		connection->recv_buffer_len = 0;
+		if (len - received >= connection->recv_buffer_size) {
+			uint32_t bytes = 0;
+			res = internal_connection_receive_some(connection, data + received, len - received, &bytes, timeout);
+			if (res == IDEVICE_E_SUCCESS && bytes == 0) {
+				res = IDEVICE_E_TIMEOUT;
+			}
+			received += bytes;
+		} else {
+			res = internal_connection_fill_buffer(connection, timeout);
+		}
+		if (res != IDEVICE_E_SUCCESS) {
+			break;
+		}
+	}
+
+	*recv_bytes = received;
+	if (received > 0) {
+		/* the data has been consumed, so report what we got */
+		return IDEVICE_E_SUCCESS;
+	}
+	return res;
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_set_receive_buffer_size(idevice_connection_t connection, uint32_t size)
+{
+	if (!connection) {
+		return IDEVICE_E_INVALID_ARG;
+	}
+
+	uint32_t avail = connection->recv_buffer_len - connection->recv_buffer_pos;
+	if (size < avail) {
+		debug_info("ERROR: Can't shrink receive buffer below %u buffered bytes", avail);
+		return IDEVICE_E_INVALID_ARG;
+	}
+
+	if (size == 0) {
+		idevice_memory_free(connection->recv_buffer);
+		connection->recv_buffer = NULL;
+		connection->recv_buffer_size = 0;
+		connection->recv_buffer_pos = 0;
+		connection->recv_buffer_len = 0;
+		return IDEVICE_E_SUCCESS;
+	}
+
+	if (avail > 0 && connection->recv_buffer_pos > 0) {
+		memmove(connection->recv_buffer, connection->recv_buffer + connection->recv_buffer_pos, avail);
+	}
+	char *newbuf = (char*)idevice_memory_realloc(connection->arena, connection->recv_buffer, size);
+	if (!newbuf) {
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+	connection->recv_buffer = newbuf;
+	connection->recv_buffer_size = size;
+	connection->recv_buffer_pos = 0;
+	connection->recv_buffer_len = avail;
+
+	return IDEVICE_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_get_available(idevice_connection_t connection, uint32_t *available)
+{
+	if (!connection || !available) {
+		return IDEVICE_E_INVALID_ARG;
+	}
+
+	*available = connection->recv_buffer_len - connection->recv_buffer_pos;
+
+	return IDEVICE_E_SUCCESS;
+}
+
+static idevice_error_t internal_peek(idevice_connection_t connection, char *data, uint32_t len, uint32_t *peeked_bytes, unsigned int timeout)
+{
+	if (!connection || !data || !peeked_bytes || len == 0 || !connection->recv_buffer || len > connection->recv_buffer_size || (connection->ssl_data && !connection->ssl_data->session)) {
+		return IDEVICE_E_INVALID_ARG;
+	}
+
+	idevice_error_t res = IDEVICE_E_SUCCESS;
+	while (connection->recv_buffer_len - connection->recv_buffer_pos < len) {
+		res = internal_connection_fill_buffer(connection, timeout);
+		if (res != IDEVICE_E_SUCCESS) {
+			break;
+		}
+	}
+
+	uint32_t avail = connection->recv_buffer_len - connection->recv_buffer_pos;
+	*peeked_bytes = (avail > len) ? len : avail;
+	memcpy(data, connection->recv_buffer + connection->recv_buffer_pos, *peeked_bytes);
+
+	return (*peeked_bytes > 0) ? IDEVICE_E_SUCCESS : res;
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_peek(idevice_connection_t connection, char *data, uint32_t len, uint32_t *peeked_bytes, unsigned int timeout)
+{
+	idevice_error_t res = internal_connection_cancelled(connection);
+	if (res != IDEVICE_E_SUCCESS)
+		return res;
+	return internal_cancel_status(connection, internal_peek(connection, data, len, peeked_bytes, timeout));
+}
+
+/**
+ * Internally used function to receive exactly len bytes with a timeout.
+ */
+static idevice_error_t internal_receive_timeout(idevice_connection_t connection, char *data, uint32_t len, uint32_t *recv_bytes, unsigned int timeout)
+{
+	if (!connection || (connection->ssl_data && !connection->ssl_data->session) || len == 0) {
+		return IDEVICE_E_INVALID_ARG;
+	}
+
+	if (connection->recv_buffer) {
+		return internal_connection_receive_buffered(connection, data, len, recv_bytes, timeout);
+	}
+
+	if (connection->ssl_data) {
+		uint32_t received = 0;
+
+		while (received < len) {
+#ifdef HAVE_OPENSSL
+			/* the socket is non-blocking, so only wait when OpenSSL asks for it */
+			int r = SSL_read(connection->ssl_data->session, (void*)((char*)(data+received)), (int)len-received);
+			if (r > 0) {
+				received += r;
+			} else {
+				idevice_error_t error = internal_ssl_wait(connection, SSL_get_error(connection->ssl_data->session, r), timeout, received);
+				if (error == IDEVICE_E_SSL_ERROR) {
+					break;
+				} else if (error != IDEVICE_E_SUCCESS) {
+					return error;
+				}
+			}
 #else
-			debug_info("ERROR: Got an IPv6 address but this system doesn't support IPv6");
-			return IDEVICE_E_UNKNOWN_ERROR;
+			if (!internal_ssl_pending(connection->ssl_data)) {
+				int conn_error = socket_check_fd((int)(long)connection->data, FDM_READ, timeout);
+				idevice_error_t error = socket_recv_to_idevice_error(conn_error, len, received);
+
+				switch (error) {
+					case IDEVICE_E_SUCCESS:
+						break;
+					case IDEVICE_E_UNKNOWN_ERROR:
+					default:
+						debug_info("ERROR: socket_check_fd returned %d (%s)", conn_error, strerror(-conn_error));
+						return error;
+				}
+			}
+
+			ssize_t r = gnutls_record_recv(connection->ssl_data->session, (void*)(data+received), (size_t)len-received);
+			if (r > 0) {
+				received += r;
+			} else {
+				break;
+			}
 #endif
 		}
-		else {
-			debug_info("Unsupported address family 0x%02x", ((char*)device->conn_data)[1]);
-			return IDEVICE_E_UNKNOWN_ERROR;
+
+		debug_info("SSL_read %d, received %d", len, received);
+		connection->bytes_received += received;
+		if (received < len) {
+			*recv_bytes = 0;
+			return IDEVICE_E_SSL_ERROR;
 		}
 
-		char addrtxt[48];
-		addrtxt[0] = '\0';
+		*recv_bytes = received;
+		return IDEVICE_E_SUCCESS;
+	}
+	return internal_connection_receive_timeout(connection, data, len, recv_bytes, timeout);
+}
 
-		if (!socket_addr_to_string(saddr, addrtxt, sizeof(addrtxt))) {
-			debug_info("Failed to convert network address: %d (%s)", errno, strerror(errno));
-		}
+LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_receive_timeout(idevice_connection_t connection, char *data, uint32_t len, uint32_t *recv_bytes, unsigned int timeout)
+{
+	PROBE3(connection__receive__start, IDEVICE_CONNECTION_UDID(connection), len, timeout);
+	idevice_error_t res = internal_connection_cancelled(connection);
+	if (res == IDEVICE_E_SUCCESS)
+		res = internal_cancel_status(connection, internal_receive_timeout(connection, data, len, recv_bytes, timeout));
+	PROBE4(connection__receive__done, IDEVICE_CONNECTION_UDID(connection), len, (res == IDEVICE_E_SUCCESS) ? *recv_bytes : 0, res);
+	return res;
+}
 
-		debug_info("Connecting to %s port %d...", addrtxt, port);
+static idevice_error_t internal_receivev(idevice_connection_t connection, idevice_iovec_t *iov, int iovcnt, uint32_t *recv_bytes, unsigned int timeout)
+{
+	uint32_t received = 0;
+	int i;
 
-		int sfd = socket_connect_addr(saddr, port);
-		if (sfd < 0) {
-			debug_info("ERROR: Connecting to network device failed: %d (%s)", errno, strerror(errno));
-			return IDEVICE_E_NO_DEVICE;
+	if (!connection || !iov || iovcnt <= 0 || !recv_bytes || (connection->ssl_data && !connection->ssl_data->session)) {
+		return IDEVICE_E_INVALID_ARG;
+	}
+
+	*recv_bytes = 0;
+
+#ifndef WIN32
+	if (!connection->ssl_data && !connection->recv_buffer) {
+		struct iovec vec[IDEVICE_IOV_MAX];
+		i = 0;
+		while (i < iovcnt) {
+			/* map the next batch of buffers */
+			int cnt = 0;
+			while (i + cnt < iovcnt && cnt < IDEVICE_IOV_MAX) {
+				vec[cnt].iov_base = iov[i+cnt].data;
+				vec[cnt].iov_len = iov[i+cnt].len;
+				cnt++;
+			}
+			/* fill the batch, advancing over partial reads */
+			int first = 0;
+			while (first < cnt) {
+				if (vec[first].iov_len == 0) {
+					first++;
+					continue;
+				}
+				int r = socket_receivev_timeout((int)(long)connection->data, vec + first, cnt - first, timeout);
+				if (r < 0) {
+					idevice_error_t error = socket_recv_to_idevice_error(r, 0, received);
+					debug_info("ERROR: socket_receivev_timeout returned %d (%s)", r, strerror(-r));
+					*recv_bytes = received;
+					return (error == IDEVICE_E_SUCCESS) ? IDEVICE_E_UNKNOWN_ERROR : error;
+				}
+				received += r;
+				connection->bytes_received += r;
+				while (first < cnt && (size_t)r >= vec[first].iov_len) {
+					r -= vec[first].iov_len;
+					first++;
+				}
+				if (first < cnt) {
+					vec[first].iov_base = (char*)vec[first].iov_base + r;
+					vec[first].iov_len -= r;
+				}
+			}
+			i += cnt;
+		}
+		*recv_bytes = received;
+		return IDEVICE_E_SUCCESS;
+	}
+#endif
+
+	for (i = 0; i < iovcnt; i++) {
+		uint32_t done = 0;
+		while (done < iov[i].len) {
+			uint32_t bytes = 0;
+			idevice_error_t res = idevice_connection_receive_timeout(connection, iov[i].data + done, iov[i].len - done, &bytes, timeout);
+			if (res != IDEVICE_E_SUCCESS) {
+				*recv_bytes = received + done;
+				return res;
+			}
+			if (bytes == 0) {
+				*recv_bytes = received + done;
+				return IDEVICE_E_TIMEOUT;
+			}
+			done += bytes;
 		}
+		received += done;
+	}
+	*recv_bytes = received;
+	return IDEVICE_E_SUCCESS;
+}
 
-		idevice_connection_t new_connection = (idevice_connection_t)malloc(sizeof(struct idevice_connection_private));
-		new_connection->type = CONNECTION_NETWORK;
-		new_connection->data = (void*)(long)sfd;
-		new_connection->ssl_data = NULL;
-		new_connection->device = device;
+LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_receivev(idevice_connection_t connection, idevice_iovec_t *iov, int iovcnt, uint32_t *recv_bytes, unsigned int timeout)
+{
+	idevice_error_t res = internal_connection_cancelled(connection);
+	if (res != IDEVICE_E_SUCCESS)
+		return res;
+	return internal_cancel_status(connection, internal_receivev(connection, iov, iovcnt, recv_bytes, timeout));
+}
 
-		*connection = new_connection;
+/**
+ * Internally used function for receiving raw data over the given connection.
+ */
+static idevice_error_t internal_connection_receive(idevice_connection_t connection, char *data, uint32_t len, uint32_t *recv_bytes)
+{
+	if (!connection) {
+		return IDEVICE_E_INVALID_ARG;
+	}
 
+	if (connection->type == CONNECTION_USBMUXD) {
+		int res = usbmuxd_recv((int)(long)connection->data, data, len, recv_bytes);
+		if (res < 0) {
+			debug_info("ERROR: usbmuxd_recv returned %d (%s)", res, strerror(-res));
+			return IDEVICE_E_UNKNOWN_ERROR;
+		}
+		connection->bytes_received += *recv_bytes;
+		return IDEVICE_E_SUCCESS;
+	} else if (connection->type == CONNECTION_NETWORK) {
+		int res = socket_receive((int)(long)connection->data, data, len);
+		if (res < 0) {
+			debug_info("ERROR: socket_receive returned %d (%s)", res, strerror(-res));
+			return IDEVICE_E_UNKNOWN_ERROR;
+		}
+		*recv_bytes = (uint32_t)res;
+		connection->bytes_received += *recv_bytes;
 		return IDEVICE_E_SUCCESS;
 	} else {
-		debug_info("Unknown connection type %d", device->conn_type);
+		debug_info("Unknown connection type %d", connection->type);
 	}
-
 	return IDEVICE_E_UNKNOWN_ERROR;
 }
 
-LIBIMOBILEDEVICE_API idevice_error_t idevice_disconnect(idevice_connection_t connection)
+/**
+ * Internally used function to receive whatever data is available.
+ */
+static idevice_error_t internal_receive(idevice_connection_t connection, char *data, uint32_t len, uint32_t *recv_bytes)
 {
-	if (!connection) {
+	if (!connection || (connection->ssl_data && !connection->ssl_data->session)) {
 		return IDEVICE_E_INVALID_ARG;
 	}
-	/* shut down ssl if enabled */
+
+	if (connection->recv_buffer) {
+		return internal_connection_receive_buffered(connection, data, len, recv_bytes, IDEVICE_BUFFERED_RECEIVE_TIMEOUT);
+	}
+
 	if (connection->ssl_data) {
-		idevice_connection_disable_ssl(connection);
+#ifdef HAVE_OPENSSL
+		int received = SSL_read(connection->ssl_data->session, (void*)data, (int)len);
+		debug_info("SSL_read %d, received %d", len, received);
+#else
+		ssize_t received = gnutls_record_recv(connection->ssl_data->session, (void*)data, (size_t)len);
+#endif
+		if (received > 0) {
+			*recv_bytes = received;
+			connection->bytes_received += received;
+			return IDEVICE_E_SUCCESS;
+		}
+		*recv_bytes = 0;
+		return IDEVICE_E_SSL_ERROR;
+	}
+	return internal_connection_receive(connection, data, len, recv_bytes);
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_receive(idevice_connection_t connection, char *data, uint32_t len, uint32_t *recv_bytes)
+{
+	PROBE3(connection__receive__start, IDEVICE_CONNECTION_UDID(connection), len, 0);
+	idevice_error_t res = internal_connection_cancelled(connection);
+	if (res == IDEVICE_E_SUCCESS)
+		res = internal_cancel_status(connection, internal_receive(connection, data, len, recv_bytes));
+	PROBE4(connection__receive__done, IDEVICE_CONNECTION_UDID(connection), len, (res == IDEVICE_E_SUCCESS) ? *recv_bytes : 0, res);
+	return res;
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_get_fd(idevice_connection_t connection, int *fd)
+{
+	if (!connection || !fd) {
+		return IDEVICE_E_INVALID_ARG;
 	}
+
 	idevice_error_t result = IDEVICE_E_UNKNOWN_ERROR;
 	if (connection->type == CONNECTION_USBMUXD) {
-		usbmuxd_disconnect((int)(long)connection->data);
-		connection->data = NULL;
+		*fd = (int)(long)connection->data;
 		result = IDEVICE_E_SUCCESS;
 	} else if (connection->type == CONNECTION_NETWORK) {
-		socket_close((int)(long)connection->data);
-		connection->data = NULL;
+		*fd = (int)(long)connection->data;
 		result = IDEVICE_E_SUCCESS;
 	} else {
 		debug_info("Unknown connection type %d", connection->type);
 	}
+	return result;
+}
 
-	free(connection);
-	connection = NULL;
+LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_set_network_profile(idevice_connection_t connection, const idevice_network_profile_t *profile)
+{
+	if (!connection || !profile || connection->type != CONNECTION_NETWORK) {
+		return IDEVICE_E_INVALID_ARG;
+	}
 
-	return result;
+	if (internal_apply_network_profile((int)(long)connection->data, profile) < 0) {
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+
+	return IDEVICE_E_SUCCESS;
 }
 
-/**
- * Internally used function to send raw data over the given connection.
- */
-static idevice_error_t internal_connection_send(idevice_connection_t connection, const char *data, uint32_t len, uint32_t *sent_bytes)
+LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_get_stats(idevice_connection_t connection, idevice_connection_stats_t *stats)
 {
-	if (!connection || !data) {
+	if (!connection || !stats) {
 		return IDEVICE_E_INVALID_ARG;
 	}
 
-	if (connection->type == CONNECTION_USBMUXD) {
-		int res = usbmuxd_send((int)(long)connection->data, data, len, sent_bytes);
-		if (res < 0) {
-			debug_info("ERROR: usbmuxd_send returned %d (%s)", res, strerror(-res));
-			return IDEVICE_E_UNKNOWN_ERROR;
-		}
-		return IDEVICE_E_SUCCESS;
-	} else if (connection->type == CONNECTION_NETWORK) {
-		int s = socket_send((int)(long)connection->data, (void*)data, len);
-		if (s < 0) {
-			*sent_bytes = 0;
-			return IDEVICE_E_UNKNOWN_ERROR;
+	memset(stats, '\0', sizeof(idevice_connection_stats_t));
+	stats->bytes_sent = connection->bytes_sent;
+	stats->bytes_received = connection->bytes_received;
+	stats->duration = internal_time_ms() - connection->connected_at;
+	if (stats->duration > 0) {
+		stats->send_rate = stats->bytes_sent * 1000 / stats->duration;
+		stats->receive_rate = stats->bytes_received * 1000 / stats->duration;
+	}
+
+	if (connection->type == CONNECTION_NETWORK) {
+		unsigned int rtt = 0;
+		unsigned int rtt_var = 0;
+		if (socket_get_rtt((int)(long)connection->data, &rtt, &rtt_var) == 0) {
+			stats->rtt = rtt;
+			stats->rtt_var = rtt_var;
 		}
-		*sent_bytes = s;
-		return IDEVICE_E_SUCCESS;
-	} else {
-		debug_info("Unknown connection type %d", connection->type);
 	}
-	return IDEVICE_E_UNKNOWN_ERROR;
 
+	return IDEVICE_E_SUCCESS;
 }
 
-LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_send(idevice_connection_t connection, const char *data, uint32_t len, uint32_t *sent_bytes)
+#ifndef WIN32
+LIBIMOBILEDEVICE_API idevice_error_t idevice_io_ring_new(unsigned int depth, idevice_io_ring_t *ring)
 {
-	if (!connection || !data || (connection->ssl_data && !connection->ssl_data->session)) {
+	if (depth == 0 || !ring) {
 		return IDEVICE_E_INVALID_ARG;
 	}
 
-	if (connection->ssl_data) {
-		uint32_t sent = 0;
-		while (sent < len) {
-#ifdef HAVE_OPENSSL
-			int c = socket_check_fd((int)(long)connection->data, FDM_WRITE, 100);
-			if (c == 0 || c == -ETIMEDOUT || c == -EAGAIN) {
-				continue;
-			} else if (c < 0) {
-				break;
-			}
-			int s = SSL_write(connection->ssl_data->session, (const void*)(data+sent), (int)(len-sent));
-			if (s <= 0) {
-				int sslerr = SSL_get_error(connection->ssl_data->session, s);
-				if (sslerr == SSL_ERROR_WANT_WRITE) {
-					continue;
-				}
-				break;
-			}
-#else
-			ssize_t s = gnutls_record_send(connection->ssl_data->session, (void*)(data+sent), (size_t)(len-sent));
-#endif
-			if (s < 0) {
-				break;
-			}
-			sent += s;
-		}
-		debug_info("SSL_write %d, sent %d", len, sent);
-		if (sent < len) {
-			*sent_bytes = 0;
-			return IDEVICE_E_SSL_ERROR;
-		}
-		*sent_bytes = sent;
-		return IDEVICE_E_SUCCESS;
-	} else {
-		uint32_t sent = 0;
-		while (sent < len) {
-			uint32_t bytes = 0;
-			int s = internal_connection_send(connection, data+sent, len-sent, &bytes);
-			if (s < 0) {
-				break;
-			}
-			sent += bytes;
-		}
-		debug_info("internal_connection_send %d, sent %d", len, sent);
-		if (sent < len) {
-			*sent_bytes = 0;
-			return IDEVICE_E_NOT_ENOUGH_DATA;
-		}
-		*sent_bytes = sent;
-		return IDEVICE_E_SUCCESS;
+	idevice_io_ring_t ring_loc = (idevice_io_ring_t)calloc(1, sizeof(struct idevice_io_ring_private));
+	if (!ring_loc) {
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+	ring_loc->ring = socket_ring_new(depth);
+	if (!ring_loc->ring) {
+		debug_info("Could not set up I/O ring with depth %u", depth);
+		free(ring_loc);
+		return IDEVICE_E_UNKNOWN_ERROR;
 	}
+	ring_loc->depth = depth;
+
+	*ring = ring_loc;
+
+	return IDEVICE_E_SUCCESS;
 }
 
-static idevice_error_t socket_recv_to_idevice_error(int conn_error, uint32_t len, uint32_t received)
+LIBIMOBILEDEVICE_API idevice_error_t idevice_io_ring_free(idevice_io_ring_t ring)
 {
-	if (conn_error < 0) {
-		switch (conn_error) {
-			case -EAGAIN:
-				debug_info("ERROR: received partial data %d/%d (%s)", received, len, strerror(-conn_error));
-				return IDEVICE_E_NOT_ENOUGH_DATA;
-			case -ETIMEDOUT:
-				return IDEVICE_E_TIMEOUT;
-			default:
-				return IDEVICE_E_UNKNOWN_ERROR;
-		}
+	if (!ring) {
+		return IDEVICE_E_INVALID_ARG;
+	}
+
+	while (ring->ops) {
+		struct idevice_io_op *op = ring->ops;
+		ring->ops = op->next;
+		free(op);
 	}
+	socket_ring_free(ring->ring);
+	free(ring);
 
 	return IDEVICE_E_SUCCESS;
 }
 
-/**
- * Internally used function for receiving raw data over the given connection
- * using a timeout.
- */
-static idevice_error_t internal_connection_receive_timeout(idevice_connection_t connection, char *data, uint32_t len, uint32_t *recv_bytes, unsigned int timeout)
+LIBIMOBILEDEVICE_API idevice_error_t idevice_io_ring_register_buffers(idevice_io_ring_t ring, const idevice_iovec_t *buffers, int count)
 {
-	if (!connection) {
+	struct iovec vec[IDEVICE_IOV_MAX];
+	int i;
+
+	if (!ring || count < 0 || count > IDEVICE_IOV_MAX || (count > 0 && !buffers)) {
 		return IDEVICE_E_INVALID_ARG;
 	}
 
-	if (connection->type == CONNECTION_USBMUXD) {
-		int conn_error = usbmuxd_recv_timeout((int)(long)connection->data, data, len, recv_bytes, timeout);
-		idevice_error_t error = socket_recv_to_idevice_error(conn_error, len, *recv_bytes);
+	for (i = 0; i < count; i++) {
+		vec[i].iov_base = buffers[i].data;
+		vec[i].iov_len = buffers[i].len;
+	}
+	int r = socket_ring_register_buffers(ring->ring, (count > 0) ? vec : NULL, (unsigned int)count);
+	if (r < 0) {
+		debug_info("Could not register buffers: %s", strerror(-r));
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
 
-		if (error == IDEVICE_E_UNKNOWN_ERROR) {
-			debug_info("ERROR: usbmuxd_recv_timeout returned %d (%s)", conn_error, strerror(-conn_error));
-		}
+	return IDEVICE_E_SUCCESS;
+}
 
-		return error;
-	} else if (connection->type == CONNECTION_NETWORK) {
-		int res = socket_receive_timeout((int)(long)connection->data, data, len, 0, timeout);
-		if (res < 0) {
-			debug_info("ERROR: socket_receive_timeout failed: %d (%s)", res, strerror(-res));
-			return (res == -EAGAIN ? IDEVICE_E_NOT_ENOUGH_DATA : IDEVICE_E_UNKNOWN_ERROR);
-		}
-		*recv_bytes = (uint32_t)res;
-		return IDEVICE_E_SUCCESS;
+/**
+ * Hands an operation to the socket ring.
+ */
+static int internal_io_ring_start(idevice_io_ring_t ring, struct idevice_io_op *op)
+{
+	int fd = (int)(long)op->connection->data;
+	int r;
+
+	if (op->is_send) {
+		r = socket_ring_queue_send(ring->ring, fd, op->data + op->done, op->len - op->done, op->buffer_index, op);
 	} else {
-		debug_info("Unknown connection type %d", connection->type);
+		r = socket_ring_queue_recv(ring->ring, fd, op->data, op->len, op->buffer_index, op);
 	}
-	return IDEVICE_E_UNKNOWN_ERROR;
+	return r;
 }
 
-LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_receive_timeout(idevice_connection_t connection, char *data, uint32_t len, uint32_t *recv_bytes, unsigned int timeout)
+static idevice_error_t internal_io_ring_queue(idevice_io_ring_t ring, idevice_connection_t connection, int is_send, char *data, uint32_t len, int buffer_index, idevice_io_cb_t callback, void *user_data)
 {
-	if (!connection || (connection->ssl_data && !connection->ssl_data->session) || len == 0) {
+	struct idevice_io_op *other;
+
+	if (!ring || !connection || !data || len == 0 || !callback) {
 		return IDEVICE_E_INVALID_ARG;
 	}
+	/* the data has to go through the SSL layer or the receive buffer */
+	if (connection->ssl_data || connection->recv_buffer) {
+		return IDEVICE_E_INVALID_ARG;
+	}
+	if (connection->type != CONNECTION_USBMUXD && connection->type != CONNECTION_NETWORK) {
+		return IDEVICE_E_INVALID_ARG;
+	}
+	if (ring->count >= ring->depth) {
+		debug_info("I/O ring is full");
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
 
-	if (connection->ssl_data) {
-		uint32_t received = 0;
-		int do_select = 1;
-
-		while (received < len) {
-#ifdef HAVE_OPENSSL
-			do_select = (SSL_pending(connection->ssl_data->session) == 0);
-#endif
-			if (do_select) {
-				int conn_error = socket_check_fd((int)(long)connection->data, FDM_READ, timeout);
-				idevice_error_t error = socket_recv_to_idevice_error(conn_error, len, received);
+	struct idevice_io_op *op = (struct idevice_io_op*)calloc(1, sizeof(struct idevice_io_op));
+	if (!op) {
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+	op->connection = connection;
+	op->is_send = is_send;
+	op->data = data;
+	op->len = len;
+	op->buffer_index = buffer_index;
+	op->callback = callback;
+	op->user_data = user_data;
+
+	/* only one operation per connection and direction is in flight, so a
+	 * stream is never read or written out of order */
+	for (other = ring->ops; other; other = other->next) {
+		if (other->connection == connection && other->is_send == is_send)
+			break;
+	}
+	if (!other && internal_io_ring_start(ring, op) < 0) {
+		free(op);
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
 
-				switch (error) {
-					case IDEVICE_E_SUCCESS:
-						break;
-					case IDEVICE_E_UNKNOWN_ERROR:
-					default:
-						debug_info("ERROR: socket_check_fd returned %d (%s)", conn_error, strerror(-conn_error));
-						return error;
-				}
-			}
+	if (ring->ops_last) {
+		ring->ops_last->next = op;
+	} else {
+		ring->ops = op;
+	}
+	ring->ops_last = op;
+	ring->count++;
 
-#ifdef HAVE_OPENSSL
-			int r = SSL_read(connection->ssl_data->session, (void*)((char*)(data+received)), (int)len-received);
-			if (r > 0) {
-				received += r;
-			} else {
-				int sslerr = SSL_get_error(connection->ssl_data->session, r);
-				if (sslerr == SSL_ERROR_WANT_READ) {
-					continue;
-				}
-				break;
-			}
-#else
-			ssize_t r = gnutls_record_recv(connection->ssl_data->session, (void*)(data+received), (size_t)len-received);
-			if (r > 0) {
-				received += r;
-			} else {
-				break;
-			}
-#endif
-		}
+	return IDEVICE_E_SUCCESS;
+}
 
-		debug_info("SSL_read %d, received %d", len, received);
-		if (received < len) {
-			*recv_bytes = 0;
-			return IDEVICE_E_SSL_ERROR;
-		}
+LIBIMOBILEDEVICE_API idevice_error_t idevice_io_ring_queue_send(idevice_io_ring_t ring, idevice_connection_t connection, const char *data, uint32_t len, int buffer_index, idevice_io_cb_t callback, void *user_data)
+{
+	return internal_io_ring_queue(ring, connection, 1, (char*)data, len, buffer_index, callback, user_data);
+}
 
-		*recv_bytes = received;
-		return IDEVICE_E_SUCCESS;
+LIBIMOBILEDEVICE_API idevice_error_t idevice_io_ring_queue_receive(idevice_io_ring_t ring, idevice_connection_t connection, char *data, uint32_t len, int buffer_index, idevice_io_cb_t callback, void *user_data)
+{
+	return internal_io_ring_queue(ring, connection, 0, data, len, buffer_index, callback, user_data);
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_io_ring_submit(idevice_io_ring_t ring)
+{
+	if (!ring) {
+		return IDEVICE_E_INVALID_ARG;
 	}
-	return internal_connection_receive_timeout(connection, data, len, recv_bytes, timeout);
+
+	int r = socket_ring_submit(ring->ring);
+	if (r < 0) {
+		debug_info("Could not submit operations: %s", strerror(-r));
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+
+	return IDEVICE_E_SUCCESS;
 }
 
 /**
- * Internally used function for receiving raw data over the given connection.
+ * Removes a finished operation and starts the next one queued for the same
+ * connection and direction.
  */
-static idevice_error_t internal_connection_receive(idevice_connection_t connection, char *data, uint32_t len, uint32_t *recv_bytes)
+static void internal_io_ring_finish(idevice_io_ring_t ring, struct idevice_io_op *op)
 {
-	if (!connection) {
-		return IDEVICE_E_INVALID_ARG;
+	struct idevice_io_op *prev = NULL;
+	struct idevice_io_op *cur;
+
+	for (cur = ring->ops; cur && cur != op; cur = cur->next) {
+		prev = cur;
+	}
+	if (!cur) {
+		return;
 	}
+	if (prev) {
+		prev->next = op->next;
+	} else {
+		ring->ops = op->next;
+	}
+	if (ring->ops_last == op) {
+		ring->ops_last = prev;
+	}
+	ring->count--;
 
-	if (connection->type == CONNECTION_USBMUXD) {
-		int res = usbmuxd_recv((int)(long)connection->data, data, len, recv_bytes);
-		if (res < 0) {
-			debug_info("ERROR: usbmuxd_recv returned %d (%s)", res, strerror(-res));
-			return IDEVICE_E_UNKNOWN_ERROR;
-		}
-		return IDEVICE_E_SUCCESS;
-	} else if (connection->type == CONNECTION_NETWORK) {
-		int res = socket_receive((int)(long)connection->data, data, len);
-		if (res < 0) {
-			debug_info("ERROR: socket_receive returned %d (%s)", res, strerror(-res));
-			return IDEVICE_E_UNKNOWN_ERROR;
+	for (cur = op->next; cur; cur = cur->next) {
+		if (cur->connection == op->connection && cur->is_send == op->is_send) {
+			if (internal_io_ring_start(ring, cur) < 0) {
+				debug_info("Could not start queued operation");
+			}
+			break;
 		}
-		*recv_bytes = (uint32_t)res;
-		return IDEVICE_E_SUCCESS;
-	} else {
-		debug_info("Unknown connection type %d", connection->type);
 	}
-	return IDEVICE_E_UNKNOWN_ERROR;
 }
 
-LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_receive(idevice_connection_t connection, char *data, uint32_t len, uint32_t *recv_bytes)
+LIBIMOBILEDEVICE_API idevice_error_t idevice_io_ring_dispatch(idevice_io_ring_t ring, unsigned int timeout, int *completed)
 {
-	if (!connection || (connection->ssl_data && !connection->ssl_data->session)) {
+	struct socket_ring_completion completions[IDEVICE_IO_RING_BATCH];
+	int i;
+
+	if (!ring) {
 		return IDEVICE_E_INVALID_ARG;
 	}
+	if (completed) {
+		*completed = 0;
+	}
 
-	if (connection->ssl_data) {
-#ifdef HAVE_OPENSSL
-		int received = SSL_read(connection->ssl_data->session, (void*)data, (int)len);
-		debug_info("SSL_read %d, received %d", len, received);
-#else
-		ssize_t received = gnutls_record_recv(connection->ssl_data->session, (void*)data, (size_t)len);
-#endif
-		if (received > 0) {
-			*recv_bytes = received;
-			return IDEVICE_E_SUCCESS;
+	int n = socket_ring_wait(ring->ring, completions, IDEVICE_IO_RING_BATCH, (timeout > 0) ? (int)timeout : -1);
+	if (n < 0) {
+		debug_info("Waiting for completions failed: %s", strerror(-n));
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+	if (n == 0) {
+		return IDEVICE_E_TIMEOUT;
+	}
+
+	int finished = 0;
+	for (i = 0; i < n; i++) {
+		struct idevice_io_op *op = (struct idevice_io_op*)completions[i].user_data;
+		int result = completions[i].result;
+		idevice_error_t error = IDEVICE_E_SUCCESS;
+
+		if (result < 0) {
+			debug_info("I/O operation failed: %s", strerror(-result));
+			error = IDEVICE_E_UNKNOWN_ERROR;
+		} else if (op->is_send) {
+			op->done += result;
+			op->connection->bytes_sent += result;
+			if (op->done < op->len && result > 0) {
+				/* short write, send the rest before anything else */
+				if (internal_io_ring_start(ring, op) == 0) {
+					continue;
+				}
+				error = IDEVICE_E_UNKNOWN_ERROR;
+			} else if (op->done < op->len) {
+				error = IDEVICE_E_NOT_ENOUGH_DATA;
+			}
+		} else {
+			op->done = result;
+			op->connection->bytes_received += result;
+			if (result == 0) {
+				/* closed by the other side */
+				error = IDEVICE_E_UNKNOWN_ERROR;
+			}
 		}
-		*recv_bytes = 0;
-		return IDEVICE_E_SSL_ERROR;
+
+		internal_io_ring_finish(ring, op);
+		op->callback(op->connection, error, op->done, op->user_data);
+		free(op);
+		finished++;
 	}
-	return internal_connection_receive(connection, data, len, recv_bytes);
+
+	/* hand over operations started from completions and callbacks */
+	socket_ring_submit(ring->ring);
+
+	if (completed) {
+		*completed = finished;
+	}
+
+	return IDEVICE_E_SUCCESS;
+}
+#else
+LIBIMOBILEDEVICE_API idevice_error_t idevice_io_ring_new(unsigned int depth, idevice_io_ring_t *ring)
+{
+	return IDEVICE_E_UNKNOWN_ERROR;
 }
 
-LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_get_fd(idevice_connection_t connection, int *fd)
+LIBIMOBILEDEVICE_API idevice_error_t idevice_io_ring_free(idevice_io_ring_t ring)
 {
-	if (!connection || !fd) {
-		return IDEVICE_E_INVALID_ARG;
-	}
+	return IDEVICE_E_INVALID_ARG;
+}
 
-	idevice_error_t result = IDEVICE_E_UNKNOWN_ERROR;
-	if (connection->type == CONNECTION_USBMUXD) {
-		*fd = (int)(long)connection->data;
-		result = IDEVICE_E_SUCCESS;
-	} else if (connection->type == CONNECTION_NETWORK) {
-		*fd = (int)(long)connection->data;
-		result = IDEVICE_E_SUCCESS;
-	} else {
-		debug_info("Unknown connection type %d", connection->type);
-	}
-	return result;
+LIBIMOBILEDEVICE_API idevice_error_t idevice_io_ring_register_buffers(idevice_io_ring_t ring, const idevice_iovec_t *buffers, int count)
+{
+	return IDEVICE_E_INVALID_ARG;
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_io_ring_queue_send(idevice_io_ring_t ring, idevice_connection_t connection, const char *data, uint32_t len, int buffer_index, idevice_io_cb_t callback, void *user_data)
+{
+	return IDEVICE_E_INVALID_ARG;
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_io_ring_queue_receive(idevice_io_ring_t ring, idevice_connection_t connection, char *data, uint32_t len, int buffer_index, idevice_io_cb_t callback, void *user_data)
+{
+	return IDEVICE_E_INVALID_ARG;
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_io_ring_submit(idevice_io_ring_t ring)
+{
+	return IDEVICE_E_INVALID_ARG;
 }
 
+LIBIMOBILEDEVICE_API idevice_error_t idevice_io_ring_dispatch(idevice_io_ring_t ring, unsigned int timeout, int *completed)
+{
+	return IDEVICE_E_INVALID_ARG;
+}
+#endif
+
 LIBIMOBILEDEVICE_API idevice_error_t idevice_get_handle(idevice_t device, uint32_t *handle)
 {
 	if (!device || !handle)
@@ -814,43 +3130,50 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_get_udid(idevice_t device, char **u
  */
 static ssize_t internal_ssl_read(gnutls_transport_ptr_t transport, char *buffer, size_t length)
 {
-	int bytes = 0, pos_start_fill = 0;
 	size_t tbytes = 0;
-	int this_len = length;
+	uint32_t bytes = 0;
 	idevice_error_t res;
-	idevice_connection_t connection = (idevice_connection_t)transport;
-	char *recv_buffer;
+	ssl_data_t ssl_data = (ssl_data_t)transport;
+	idevice_connection_t connection = ssl_data->connection;
 
 	debug_info("pre-read client wants %zi bytes", length);
 
-	recv_buffer = (char *)malloc(sizeof(char) * this_len);
-
 	/* repeat until we have the full data or an error occurs */
-	do {
-		if ((res = internal_connection_receive(connection, recv_buffer, this_len, (uint32_t*)&bytes)) != IDEVICE_E_SUCCESS) {
+	while (tbytes < length) {
+		uint32_t avail = ssl_data->read_ahead_len - ssl_data->read_ahead_pos;
+		if (avail > 0) {
+			uint32_t n = (avail > length - tbytes) ? (uint32_t)(length - tbytes) : avail;
+			memcpy(buffer + tbytes, ssl_data->read_ahead + ssl_data->read_ahead_pos, n);
+			ssl_data->read_ahead_pos += n;
+			tbytes += n;
+			continue;
+		}
+		ssl_data->read_ahead_pos = 0;
+		ssl_data->read_ahead_len = 0;
+
+		if (length - tbytes >= ssl_data->read_ahead_size) {
+			/* large reads go directly into the buffer of GnuTLS */
+			res = internal_connection_receive(connection, buffer + tbytes, length - tbytes, &bytes);
+			if (res == IDEVICE_E_SUCCESS) {
+				tbytes += bytes;
+			}
+		} else {
+			/* read whatever is available so the next records don't need a read */
+			res = internal_connection_receive(connection, ssl_data->read_ahead, ssl_data->read_ahead_size, &bytes);
+			if (res == IDEVICE_E_SUCCESS) {
+				ssl_data->read_ahead_len = bytes;
+			}
+		}
+		if (res != IDEVICE_E_SUCCESS) {
 			debug_info("ERROR: idevice_connection_receive returned %d", res);
-			return res;
+			return -1;
 		}
-		debug_info("post-read we got %i bytes", bytes);
-
-		/* increase read count */
-		tbytes += bytes;
-
-		/* fill the buffer with what we got right now */
-		memcpy(buffer + pos_start_fill, recv_buffer, bytes);
-		pos_start_fill += bytes;
-
-		if (tbytes >= length) {
+		if (bytes == 0) {
 			break;
 		}
-
-		this_len = length - tbytes;
-		debug_info("re-read trying to read missing %i bytes", this_len);
-	} while (tbytes < length);
-
-	if (recv_buffer) {
-		free(recv_buffer);
+		debug_info("post-read we got %i bytes", bytes);
 	}
+
 	return tbytes;
 }
 
@@ -861,7 +3184,7 @@ static ssize_t internal_ssl_write(gnutls_transport_ptr_t transport, char *buffer
 {
 	uint32_t bytes = 0;
 	idevice_error_t res;
-	idevice_connection_t connection = (idevice_connection_t)transport;
+	idevice_connection_t connection = ((ssl_data_t)transport)->connection;
 	debug_info("pre-send length = %zi", length);
 	if ((res = internal_connection_send(connection, buffer, length, &bytes)) != IDEVICE_E_SUCCESS) {
 		debug_info("ERROR: internal_connection_send returned %d", res);
@@ -906,6 +3229,7 @@ static void internal_ssl_cleanup(ssl_data_t ssl_data)
 	if (ssl_data->host_privkey) {
 		gnutls_x509_privkey_deinit(ssl_data->host_privkey);
 	}
+	free(ssl_data->read_ahead);
 #endif
 }
 
@@ -977,42 +3301,39 @@ static int internal_cert_callback(gnutls_session_t session, const gnutls_datum_t
 }
 #endif
 
-LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_enable_ssl(idevice_connection_t connection)
+#ifdef HAVE_OPENSSL
+/**
+ * Called by OpenSSL when a new session has been established, to remember
+ * it for resumption by the next connection to the device.
+ */
+static int internal_ssl_new_session_cb(SSL *ssl, SSL_SESSION *session)
 {
-	if (!connection || connection->ssl_data)
-		return IDEVICE_E_INVALID_ARG;
-
-	idevice_error_t ret = IDEVICE_E_SSL_ERROR;
-	plist_t pair_record = NULL;
+	int res = 0;
 
-	userpref_read_pair_record(connection->device->udid, &pair_record);
-	if (!pair_record) {
-		debug_info("ERROR: Failed enabling SSL. Unable to read pair record for udid %s.", connection->device->udid);
-		return ret;
+	mutex_lock(&ssl_cache_mutex);
+	struct ssl_cache_entry *entry = (struct ssl_cache_entry*)SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+	if (entry) {
+		if (entry->session) {
+			SSL_SESSION_free(entry->session);
+		}
+		/* keep the reference passed to us */
+		entry->session = session;
+		res = 1;
 	}
+	mutex_unlock(&ssl_cache_mutex);
 
-#ifdef HAVE_OPENSSL
-	key_data_t root_cert = { NULL, 0 };
-	key_data_t root_privkey = { NULL, 0 };
-
-	pair_record_import_crt_with_name(pair_record, USERPREF_ROOT_CERTIFICATE_KEY, &root_cert);
-	pair_record_import_key_with_name(pair_record, USERPREF_ROOT_PRIVATE_KEY_KEY, &root_privkey);
-
-	if (pair_record)
-		plist_free(pair_record);
-
-	BIO *ssl_bio = BIO_new(BIO_s_socket());
-	if (!ssl_bio) {
-		debug_info("ERROR: Could not create SSL bio.");
-		return ret;
-	}
-	BIO_set_fd(ssl_bio, (int)(long)connection->data, BIO_NOCLOSE);
+	return res;
+}
 
+/**
+ * Creates an SSL context with the root credentials of a pair record.
+ */
+static SSL_CTX *internal_ssl_ctx_new(int version, idevice_cipher_policy_t policy, X509 *rootCert, RSA *rootPrivKey)
+{
 	SSL_CTX *ssl_ctx = SSL_CTX_new(TLS_method());
 	if (ssl_ctx == NULL) {
 		debug_info("ERROR: Could not create SSL context.");
-		BIO_free(ssl_bio);
-		return ret;
+		return NULL;
 	}
 
 #if OPENSSL_VERSION_NUMBER >= 0x10100000L
@@ -1022,7 +3343,7 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_enable_ssl(idevice_conne
 #if OPENSSL_VERSION_NUMBER < 0x10100002L || \
 	(defined(LIBRESSL_VERSION_NUMBER) && (LIBRESSL_VERSION_NUMBER < 0x2060000fL))
 	/* force use of TLSv1 for older devices */
-	if (connection->device->version < DEVICE_VERSION(10,0,0)) {
+	if (version < DEVICE_VERSION(10,0,0)) {
 #ifdef SSL_OP_NO_TLSv1_1
 		long opts = SSL_CTX_get_options(ssl_ctx);
 		opts |= SSL_OP_NO_TLSv1_1;
@@ -1037,39 +3358,141 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_enable_ssl(idevice_conne
 	}
 #else
 	SSL_CTX_set_min_proto_version(ssl_ctx, TLS1_VERSION);
-	if (connection->device->version < DEVICE_VERSION(10,0,0)) {
+	if (version < DEVICE_VERSION(10,0,0)) {
 		SSL_CTX_set_max_proto_version(ssl_ctx, TLS1_VERSION);
+	} else if (policy == IDEVICE_CIPHER_POLICY_AES_CBC) {
+		SSL_CTX_set_max_proto_version(ssl_ctx, TLS1_2_VERSION);
 	}
 #endif
 
-	BIO* membp;
-	X509* rootCert = NULL;
-	membp = BIO_new_mem_buf(root_cert.data, root_cert.size);
-	PEM_read_bio_X509(membp, &rootCert, NULL, NULL);
-	BIO_free(membp);
-	if (SSL_CTX_use_certificate(ssl_ctx, rootCert) != 1) {
+	if (ssl_cipher_lists[policy] && SSL_CTX_set_cipher_list(ssl_ctx, ssl_cipher_lists[policy]) != 1) {
+		debug_info("WARNING: Could not set cipher list for policy %d", policy);
+	}
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L && !defined(LIBRESSL_VERSION_NUMBER)
+	if (ssl_cipher_suites[policy] && SSL_CTX_set_ciphersuites(ssl_ctx, ssl_cipher_suites[policy]) != 1) {
+		debug_info("WARNING: Could not set TLS 1.3 cipher suites for policy %d", policy);
+	}
+#endif
+
+	if (!rootCert || SSL_CTX_use_certificate(ssl_ctx, rootCert) != 1) {
 		debug_info("WARNING: Could not load RootCertificate");
 	}
-	X509_free(rootCert);
-	free(root_cert.data);
+	if (!rootPrivKey || SSL_CTX_use_RSAPrivateKey(ssl_ctx, rootPrivKey) != 1) {
+		debug_info("WARNING: Could not load RootPrivateKey");
+	}
 
+	/* sessions are stored per device by the new session callback */
+	SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(ssl_ctx, internal_ssl_new_session_cb);
+
+	return ssl_ctx;
+}
+
+/**
+ * Creates a new SSL object for a connection using the cached SSL context of
+ * the device, which is (re)created if the pair record or the device version
+ * changed. If a previous session is known it is set up for resumption.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int internal_ssl_new(idevice_connection_t connection, SSL_CTX **ctx, SSL **ssl, int *resuming)
+{
+	X509* rootCert = NULL;
 	RSA* rootPrivKey = NULL;
-	membp = BIO_new_mem_buf(root_privkey.data, root_privkey.size);
-	PEM_read_bio_RSAPrivateKey(membp, &rootPrivKey, NULL, NULL);
-	BIO_free(membp);
-	if (SSL_CTX_use_RSAPrivateKey(ssl_ctx, rootPrivKey) != 1) {
-		debug_info("WARNING: Could not load RootPrivateKey");
+	int res = -1;
+
+	/* the decoded credentials are cached along with the pair record */
+	if (userpref_get_root_credentials(connection->device->udid, &rootCert, &rootPrivKey) != USERPREF_E_SUCCESS) {
+		debug_info("ERROR: Failed enabling SSL. Unable to read pair record for udid %s.", connection->device->udid);
+		return -1;
+	}
+
+	mutex_lock(&ssl_cache_mutex);
+	idevice_cipher_policy_t policy = connection->device->cipher_policy;
+	struct ssl_cache_entry *entry = internal_ssl_cache_find(connection->device->udid, 1);
+	if (entry && (!entry->ctx || entry->root_cert != rootCert || entry->version != connection->device->version || entry->cipher_policy != policy)) {
+		internal_ssl_cache_entry_clear(entry);
+		entry->ctx = internal_ssl_ctx_new(connection->device->version, policy, rootCert, rootPrivKey);
+		if (entry->ctx) {
+			SSL_CTX_set_app_data(entry->ctx, entry);
+			entry->version = connection->device->version;
+			entry->cipher_policy = policy;
+			if (rootCert) {
+				X509_up_ref(rootCert);
+			}
+			entry->root_cert = rootCert;
+		}
+	}
+
+	SSL_CTX *ssl_ctx = NULL;
+	if (entry && entry->ctx) {
+		ssl_ctx = entry->ctx;
+		SSL_CTX_up_ref(ssl_ctx);
+	} else if (!entry) {
+		/* not cached, but still usable */
+		ssl_ctx = internal_ssl_ctx_new(connection->device->version, policy, rootCert, rootPrivKey);
+	}
+
+	if (ssl_ctx) {
+		*ssl = SSL_new(ssl_ctx);
+		if (!*ssl) {
+			debug_info("ERROR: Could not create SSL object");
+			SSL_CTX_free(ssl_ctx);
+		} else {
+			*resuming = 0;
+			if (entry && entry->session && SSL_set_session(*ssl, entry->session) == 1) {
+				debug_info("Trying to resume previous SSL session");
+				*resuming = 1;
+			}
+			*ctx = ssl_ctx;
+			res = 0;
+		}
+	}
+	mutex_unlock(&ssl_cache_mutex);
+
+	if (rootCert)
+		X509_free(rootCert);
+	if (rootPrivKey)
+		RSA_free(rootPrivKey);
+
+	return res;
+}
+#endif
+
+/**
+ * Internally used function to perform the SSL handshake on a connection.
+ */
+static idevice_error_t internal_enable_ssl(idevice_connection_t connection)
+{
+	if (!connection || connection->ssl_data)
+		return IDEVICE_E_INVALID_ARG;
+
+	idevice_ssl_init();
+
+	if (connection->recv_buffer_len > connection->recv_buffer_pos) {
+		debug_info("WARNING: %u bytes of buffered plain data pending while enabling SSL", connection->recv_buffer_len - connection->recv_buffer_pos);
+	}
+
+	idevice_error_t ret = IDEVICE_E_SSL_ERROR;
+
+#ifdef HAVE_OPENSSL
+	SSL *ssl = NULL;
+	SSL_CTX *ssl_ctx = NULL;
+	int resuming = 0;
+
+	if (internal_ssl_new(connection, &ssl_ctx, &ssl, &resuming) != 0) {
+		return ret;
 	}
-	RSA_free(rootPrivKey);
-	free(root_privkey.data);
 
-	SSL *ssl = SSL_new(ssl_ctx);
-	if (!ssl) {
-		debug_info("ERROR: Could not create SSL object");
-		BIO_free(ssl_bio);
+	BIO *ssl_bio = BIO_new(BIO_s_socket());
+	if (!ssl_bio) {
+		debug_info("ERROR: Could not create SSL bio.");
+		SSL_free(ssl);
 		SSL_CTX_free(ssl_ctx);
 		return ret;
 	}
+	BIO_set_fd(ssl_bio, (int)(long)connection->data, BIO_NOCLOSE);
+
 	SSL_set_connect_state(ssl);
 	SSL_set_verify(ssl, 0, ssl_verify_callback);
 	SSL_set_bio(ssl, ssl_bio, ssl_bio);
@@ -1081,15 +3504,18 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_enable_ssl(idevice_conne
 		if (ssl_error == 0 || ssl_error != SSL_ERROR_WANT_READ) {
 			break;
 		}
-#ifdef WIN32
-		Sleep(100);
-#else
-		struct timespec ts = { 0, 100000000 };
-		nanosleep(&ts, NULL);
-#endif
+		/* wait for the reply of the device instead of sleeping */
+		idevice_error_t wait_res = internal_ssl_wait(connection, ssl_error, 100, 0);
+		if (wait_res != IDEVICE_E_SUCCESS && wait_res != IDEVICE_E_TIMEOUT) {
+			break;
+		}
 	} while (1);
 	if (ssl_error != 0) {
 		debug_info("ERROR during SSL handshake: %s", ssl_error_to_string(ssl_error));
+		if (resuming) {
+			/* don't offer the session again, the device might not accept it */
+			internal_ssl_cache_drop_session(connection->device->udid);
+		}
 		SSL_free(ssl);
 		SSL_CTX_free(ssl_ctx);
 	} else {
@@ -1097,13 +3523,34 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_enable_ssl(idevice_conne
 		ssl_data_loc->session = ssl;
 		ssl_data_loc->ctx = ssl_ctx;
 		connection->ssl_data = ssl_data_loc;
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L && !defined(LIBRESSL_VERSION_NUMBER)
+		/* read as much as is available with each read from now on; not during
+		 * the handshake, as some services continue in plain text after it */
+		SSL_set_read_ahead(ssl, 1);
+#endif
+		mutex_lock(&ssl_cache_mutex);
+		connection->device->cipher = SSL_get_cipher(ssl);
+		mutex_unlock(&ssl_cache_mutex);
 		ret = IDEVICE_E_SUCCESS;
-		debug_info("SSL mode enabled, %s, cipher: %s", SSL_get_version(ssl), SSL_get_cipher(ssl));
+		debug_info("SSL mode enabled, %s, cipher: %s%s", SSL_get_version(ssl), SSL_get_cipher(ssl), SSL_session_reused(ssl) ? ", resumed session" : "");
 	}
 	/* required for proper multi-thread clean up to prevent leaks */
 	openssl_remove_thread_state();
 #else
+	plist_t pair_record = NULL;
+
+	userpref_read_pair_record(connection->device->udid, &pair_record);
+	if (!pair_record) {
+		debug_info("ERROR: Failed enabling SSL. Unable to read pair record for udid %s.", connection->device->udid);
+		return ret;
+	}
+
 	ssl_data_t ssl_data_loc = (ssl_data_t)malloc(sizeof(struct ssl_data_private));
+	ssl_data_loc->connection = connection;
+	ssl_data_loc->read_ahead = (char*)malloc(SSL_READ_AHEAD_SIZE);
+	ssl_data_loc->read_ahead_size = (ssl_data_loc->read_ahead) ? SSL_READ_AHEAD_SIZE : 0;
+	ssl_data_loc->read_ahead_pos = 0;
+	ssl_data_loc->read_ahead_len = 0;
 
 	/* Set up GnuTLS... */
 	debug_info("enabling SSL mode");
@@ -1115,10 +3562,27 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_enable_ssl(idevice_conne
 	gnutls_certificate_client_set_retrieve_function(ssl_data_loc->certificate, internal_cert_callback);
 #endif
 	gnutls_init(&ssl_data_loc->session, GNUTLS_CLIENT);
-	gnutls_priority_set_direct(ssl_data_loc->session, "NONE:+VERS-TLS1.0:+ANON-DH:+RSA:+AES-128-CBC:+AES-256-CBC:+SHA1:+MD5:+COMP-NULL", NULL);
+	mutex_lock(&ssl_cache_mutex);
+	idevice_cipher_policy_t policy = connection->device->cipher_policy;
+	mutex_unlock(&ssl_cache_mutex);
+	if (gnutls_priority_set_direct(ssl_data_loc->session, ssl_priorities[policy], NULL) != GNUTLS_E_SUCCESS) {
+		/* e.g. ChaCha20 is not supported by this GnuTLS version */
+		debug_info("WARNING: Could not set priorities for cipher policy %d", policy);
+		gnutls_priority_set_direct(ssl_data_loc->session, SSL_PRIORITY_TLS10, NULL);
+	}
 	gnutls_credentials_set(ssl_data_loc->session, GNUTLS_CRD_CERTIFICATE, ssl_data_loc->certificate);
 	gnutls_session_set_ptr(ssl_data_loc->session, ssl_data_loc);
 
+	/* offer the previous session of the device for resumption */
+	int resuming = 0;
+	mutex_lock(&ssl_cache_mutex);
+	struct ssl_cache_entry *entry = internal_ssl_cache_find(connection->device->udid, 0);
+	if (entry && entry->session_data.data && gnutls_session_set_data(ssl_data_loc->session, entry->session_data.data, entry->session_data.size) == GNUTLS_E_SUCCESS) {
+		debug_info("Trying to resume previous SSL session");
+		resuming = 1;
+	}
+	mutex_unlock(&ssl_cache_mutex);
+
 	gnutls_x509_crt_init(&ssl_data_loc->root_cert);
 	gnutls_x509_crt_init(&ssl_data_loc->host_cert);
 	gnutls_x509_privkey_init(&ssl_data_loc->root_privkey);
@@ -1133,7 +3597,7 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_enable_ssl(idevice_conne
 		plist_free(pair_record);
 
 	debug_info("GnuTLS step 1...");
-	gnutls_transport_set_ptr(ssl_data_loc->session, (gnutls_transport_ptr_t)connection);
+	gnutls_transport_set_ptr(ssl_data_loc->session, (gnutls_transport_ptr_t)ssl_data_loc);
 	debug_info("GnuTLS step 2...");
 	gnutls_transport_set_push_function(ssl_data_loc->session, (gnutls_push_func) & internal_ssl_write);
 	debug_info("GnuTLS step 3...");
@@ -1151,19 +3615,48 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_enable_ssl(idevice_conne
 	debug_info("GnuTLS handshake done...");
 
 	if (return_me != GNUTLS_E_SUCCESS) {
+		if (resuming) {
+			/* don't offer the session again, the device might not accept it */
+			internal_ssl_cache_drop_session(connection->device->udid);
+		}
 		internal_ssl_cleanup(ssl_data_loc);
 		free(ssl_data_loc);
 		debug_info("GnuTLS reported something wrong: %s", gnutls_strerror(return_me));
 		debug_info("oh.. errno says %s", strerror(errno));
 	} else {
+		gnutls_datum_t session_data = { NULL, 0 };
+		if (gnutls_session_get_data2(ssl_data_loc->session, &session_data) == GNUTLS_E_SUCCESS) {
+			mutex_lock(&ssl_cache_mutex);
+			entry = internal_ssl_cache_find(connection->device->udid, 1);
+			if (entry) {
+				if (entry->session_data.data) {
+					gnutls_free(entry->session_data.data);
+				}
+				entry->session_data = session_data;
+			} else {
+				gnutls_free(session_data.data);
+			}
+			mutex_unlock(&ssl_cache_mutex);
+		}
+		mutex_lock(&ssl_cache_mutex);
+		connection->device->cipher = gnutls_cipher_get_name(gnutls_cipher_get(ssl_data_loc->session));
+		mutex_unlock(&ssl_cache_mutex);
 		connection->ssl_data = ssl_data_loc;
 		ret = IDEVICE_E_SUCCESS;
-		debug_info("SSL mode enabled");
+		debug_info("SSL mode enabled%s", gnutls_session_is_resumed(ssl_data_loc->session) ? ", resumed session" : "");
 	}
 #endif
 	return ret;
 }
 
+LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_enable_ssl(idevice_connection_t connection)
+{
+	PROBE1(ssl__enable__start, IDEVICE_CONNECTION_UDID(connection));
+	idevice_error_t res = internal_enable_ssl(connection);
+	PROBE2(ssl__enable__done, IDEVICE_CONNECTION_UDID(connection), res);
+	return res;
+}
+
 LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_disable_ssl(idevice_connection_t connection)
 {
 	return idevice_connection_disable_bypass_ssl(connection, 0);
@@ -1201,6 +3694,22 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_disable_bypass_ssl(idevi
 #endif
 	}
 
+#ifndef HAVE_OPENSSL
+	/* data read ahead of the SSL session belongs to the plain stream now */
+	ssl_data_t ssl_data = connection->ssl_data;
+	uint32_t read_ahead = ssl_data->read_ahead_len - ssl_data->read_ahead_pos;
+	if (read_ahead > 0) {
+		uint32_t avail = connection->recv_buffer_len - connection->recv_buffer_pos;
+		uint32_t size = (connection->recv_buffer_size > avail + read_ahead) ? connection->recv_buffer_size : avail + read_ahead;
+		if (idevice_connection_set_receive_buffer_size(connection, size) == IDEVICE_E_SUCCESS) {
+			memcpy(connection->recv_buffer + connection->recv_buffer_len, ssl_data->read_ahead + ssl_data->read_ahead_pos, read_ahead);
+			connection->recv_buffer_len += read_ahead;
+		} else {
+			debug_info("ERROR: Dropping %u bytes of plain data read ahead", read_ahead);
+		}
+	}
+#endif
+
 	internal_ssl_cleanup(connection->ssl_data);
 	free(connection->ssl_data);
 	connection->ssl_data = NULL;
@@ -44,7 +44,26 @@
 #endif
 
 #include "common/userpref.h"
+#include "common/thread.h"
+#include "common/socket.h"
 #include "libimobiledevice/libimobiledevice.h"
+#include "libimobiledevice/lockdown.h"
+
+/* maximum number of buffers passed to a single vectored socket write */
+#define IDEVICE_IOV_MAX 16
+
+/* size of the staging buffer used to coalesce vectored sends over SSL */
+#define IDEVICE_SSL_RECORD_SIZE 16384
+
+/* socket buffer sizes of network connections, the minimum is the default */
+#define IDEVICE_NETWORK_MIN_BUFFER_SIZE 0x20000
+#define IDEVICE_NETWORK_MAX_BUFFER_SIZE 0x400000
+
+/* timeout used for buffered receives without an explicit timeout */
+#define IDEVICE_BUFFERED_RECEIVE_TIMEOUT 5000
+
+/* UDID of the device a connection belongs to, for tracepoints */
+#define IDEVICE_CONNECTION_UDID(c) (((c) && (c)->device) ? (c)->device->udid : NULL)
 
 #define DEVICE_VERSION(maj, min, patch) (((maj & 0xFF) << 16) | ((min & 0xFF) << 8) | (patch & 0xFF))
 
@@ -59,15 +78,85 @@ struct ssl_data_private {
 	gnutls_x509_crt_t root_cert;
 	gnutls_x509_privkey_t host_privkey;
 	gnutls_x509_crt_t host_cert;
+	struct idevice_connection_private *connection;
+	char *read_ahead;
+	uint32_t read_ahead_size;
+	uint32_t read_ahead_pos;
+	uint32_t read_ahead_len;
 #endif
 };
 typedef struct ssl_data_private *ssl_data_t;
 
+/*
+ * The allocator and counters for the message buffers of a device. Every
+ * buffer holds a reference, so an arena stays around until the last of its
+ * buffers has been freed, even if the device is gone or uses another
+ * allocator by then.
+ */
+struct idevice_memory_arena {
+	idevice_allocator_t allocator;
+	volatile uint64_t refcount;
+	volatile uint64_t bytes;
+	volatile uint64_t peak_bytes;
+	volatile uint64_t blocks;
+	volatile uint64_t allocations;
+};
+
 struct idevice_connection_private {
 	idevice_t device;
 	enum idevice_connection_type type;
 	void *data;
 	ssl_data_t ssl_data;
+	/* arena of the device at the time of connecting, referenced */
+	struct idevice_memory_arena *arena;
+	char *recv_buffer;
+	uint32_t recv_buffer_size;
+	uint32_t recv_buffer_pos;
+	uint32_t recv_buffer_len;
+	uint64_t connected_at;
+	uint64_t bytes_sent;
+	uint64_t bytes_received;
+	/* usbmuxd handle of the device, to find the connection when it is removed */
+	uint32_t mux_id;
+	/* error I/O fails with after the connection got aborted, 0 otherwise */
+	volatile int cancelled;
+	struct idevice_connection_private *live_prev;
+	struct idevice_connection_private *live_next;
+};
+
+struct idevice_value_cache_entry {
+	char *key;
+	plist_t value;
+	time_t expires;
+	struct idevice_value_cache_entry *next;
+};
+
+struct idevice_connection_pool_entry {
+	char *name;
+	uint16_t port;
+	idevice_connection_t connection;
+	time_t idle_since;
+	struct idevice_connection_pool_entry *next;
+};
+
+/*
+ * Hooks of a device emulated in the same process instead of being reached
+ * through usbmuxd, used by the tests and benchmarks in tests/.
+ */
+struct idevice_loopback {
+	/* returns a connected socket to the given port of the device, or -1 */
+	int (*connect)(uint16_t port, void *user_data);
+	/* pair record the emulator accepts, used instead of asking usbmuxd */
+	plist_t pair_record;
+	void *user_data;
+};
+
+struct idevice_rtt_estimate {
+	char *op_class;
+	uint64_t srtt;    /* smoothed round trip time in microseconds */
+	uint64_t rttvar;  /* round trip time variation in microseconds */
+	uint64_t samples;
+	struct idevice_rtt_estimate *next;
 };
 
 struct idevice_private {
@@ -76,6 +165,138 @@ struct idevice_private {
 	enum idevice_connection_type conn_type;
 	void *conn_data;
 	int version;
+	int handshake_validated;
+	mutex_t lockdown_mutex;
+	int lockdown_reuse;
+	lockdownd_client_t lockdown_session;
+	mutex_t value_cache_mutex;
+	int value_cache_enabled;
+	struct idevice_value_cache_entry *value_cache;
+	mutex_t pool_mutex;
+	unsigned int pool_max_idle;
+	unsigned int pool_idle_timeout;
+	struct idevice_connection_pool_entry *pool;
+	idevice_network_profile_t *network_profile;
+	mutex_t rtt_mutex;
+	struct idevice_rtt_estimate *rtt_estimates;
+	mutex_t arena_mutex;
+	struct idevice_memory_arena *arena;
+	/* both protected by the ssl cache mutex */
+	idevice_cipher_policy_t cipher_policy;
+	const char *cipher;
+	/* set if the device is emulated in-process, NULL otherwise */
+	const struct idevice_loopback *loopback;
+};
+
+#ifndef WIN32
+/* number of completions reaped per wait of an I/O ring */
+#define IDEVICE_IO_RING_BATCH 64
+
+struct idevice_io_op {
+	idevice_connection_t connection;
+	int is_send;
+	char *data;
+	uint32_t len;
+	uint32_t done;
+	int buffer_index;
+	idevice_io_cb_t callback;
+	void *user_data;
+	struct idevice_io_op *next;
+};
+
+struct idevice_io_ring_private {
+	socket_ring_t ring;
+	unsigned int depth;
+	unsigned int count;
+	struct idevice_io_op *ops;
+	struct idevice_io_op *ops_last;
+};
+#endif
+
+/* bytes relayed per read of a forwarded connection, and its pipe size */
+#define IDEVICE_FORWARD_CHUNK_SIZE 65536
+
+/* reads per direction and wakeup, so busy connections don't starve others */
+#define IDEVICE_FORWARD_BUDGET 16
+
+/* pending connections of a forwarded port */
+#define IDEVICE_FORWARD_BACKLOG 16
+
+enum idevice_forward_kind {
+	IDEVICE_FORWARD_LISTENER,
+	IDEVICE_FORWARD_CONNECTION
+};
+
+struct idevice_forward_listener {
+	enum idevice_forward_kind kind;
+	int fd;
+	uint16_t port;
+	uint16_t device_port;
+	idevice_t device;
+	int registered;
+	struct idevice_forward_listener *next;
+};
+
+/* one direction of a forwarded connection */
+struct idevice_forward_direction {
+	int from;
+	int to;
+#ifdef HAVE_SPLICE
+	int pipe[2];
+#endif
+	char *buffer;
+	uint32_t pos;
+	uint32_t pending;
+	int eof;
+	int done;
+};
+
+struct idevice_forward_connection {
+	enum idevice_forward_kind kind;
+	idevice_connection_t connection;
+	int client_fd;
+	int device_fd;
+	unsigned int client_events;
+	unsigned int device_events;
+	struct idevice_forward_direction up;   /* client to device */
+	struct idevice_forward_direction down; /* device to client */
+	int closed;
+	struct idevice_forward_connection *next;
+};
+
+struct idevice_forward_private {
+	mutex_t mutex;
+	THREAD_T thread;
+	int stop;
+	struct idevice_forward_listener *listeners;
+	struct idevice_forward_connection *connections;
+#ifndef WIN32
+	int wakeup[2];
+#endif
 };
 
+void idevice_ssl_init(void);
+
+void idevice_value_cache_enable(idevice_t device, int enable);
+plist_t idevice_value_cache_get(idevice_t device, const char *domain, const char *key);
+void idevice_value_cache_set(idevice_t device, const char *domain, const char *key, plist_t value);
+void idevice_value_cache_invalidate(idevice_t device, const char *key);
+
+int idevice_connection_has_pending_data(idevice_connection_t connection);
+
+int idevice_connection_pool_enabled(idevice_t device);
+int idevice_connection_pool_put(idevice_t device, const char *name, uint16_t port, idevice_connection_t connection);
+idevice_connection_t idevice_connection_pool_take(idevice_t device, const char *name, uint16_t *port);
+
+void idevice_rtt_sample(idevice_t device, const char *op_class, uint64_t rtt);
+int idevice_rtt_get(idevice_t device, const char *op_class, uint64_t *srtt, uint64_t *rttvar);
+
+struct idevice_memory_arena *idevice_memory_arena_new(const idevice_allocator_t *allocator);
+struct idevice_memory_arena *idevice_memory_arena_ref(struct idevice_memory_arena *arena);
+void idevice_memory_arena_unref(struct idevice_memory_arena *arena);
+struct idevice_memory_arena *idevice_get_memory_arena(idevice_t device);
+void *idevice_memory_alloc(struct idevice_memory_arena *arena, size_t size);
+void *idevice_memory_realloc(struct idevice_memory_arena *arena, void *ptr, size_t size);
+void idevice_memory_free(void *ptr);
+
 #endif
@@ -0,0 +1,529 @@
+/*
+ * idevice_forward.c
+ * Forwards local ports to device ports from a single event loop.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#define _GNU_SOURCE 1
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#ifdef WIN32
+#include <winsock2.h>
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#endif
+
+#include "idevice.h"
+#include "common/socket.h"
+#include "common/debug.h"
+
+#ifdef WIN32
+/* there is no pollable wakeup pipe, check for new ports periodically instead */
+#define IDEVICE_FORWARD_MAX_WAIT 1000
+#else
+#define IDEVICE_FORWARD_MAX_WAIT -1
+#endif
+
+/* events handled per wait of the event loop */
+#define IDEVICE_FORWARD_BATCH 64
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+static void forward_set_nonblocking(int fd)
+{
+#ifdef WIN32
+	u_long l_yes = 1;
+	ioctlsocket(fd, FIONBIO, &l_yes);
+#else
+	int flags = fcntl(fd, F_GETFL, 0);
+	fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+#endif
+}
+
+static int forward_would_block(void)
+{
+#ifdef WIN32
+	int err = WSAGetLastError();
+	return (err == WSAEWOULDBLOCK || err == WSAEINTR);
+#else
+	return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+#endif
+}
+
+/* makes the forwarding thread pick up added ports or the stop request */
+static void forward_wakeup(idevice_forward_t forward)
+{
+#ifndef WIN32
+	if (forward->wakeup[1] >= 0) {
+		char c = 0;
+		if (write(forward->wakeup[1], &c, 1) < 0) {
+			/* the pipe is full, so the thread wakes up anyway */
+		}
+	}
+#endif
+}
+
+static int forward_direction_use_buffer(struct idevice_forward_direction *dir)
+{
+#ifdef HAVE_SPLICE
+	if (dir->pipe[0] >= 0) {
+		close(dir->pipe[0]);
+		close(dir->pipe[1]);
+		dir->pipe[0] = dir->pipe[1] = -1;
+	}
+#endif
+	if (!dir->buffer) {
+		dir->buffer = (char*)malloc(IDEVICE_FORWARD_CHUNK_SIZE);
+		if (!dir->buffer)
+			return -1;
+	}
+	return 0;
+}
+
+static int forward_direction_init(struct idevice_forward_direction *dir, int from, int to)
+{
+	memset(dir, '\0', sizeof(struct idevice_forward_direction));
+	dir->from = from;
+	dir->to = to;
+#ifdef HAVE_SPLICE
+	/* data is spliced from one socket into the pipe and from there into the other */
+	if (pipe(dir->pipe) == 0) {
+		fcntl(dir->pipe[0], F_SETFD, FD_CLOEXEC);
+		fcntl(dir->pipe[1], F_SETFD, FD_CLOEXEC);
+		return 0;
+	}
+	dir->pipe[0] = dir->pipe[1] = -1;
+#endif
+	return forward_direction_use_buffer(dir);
+}
+
+static void forward_direction_free(struct idevice_forward_direction *dir)
+{
+#ifdef HAVE_SPLICE
+	if (dir->pipe[0] >= 0) {
+		close(dir->pipe[0]);
+		close(dir->pipe[1]);
+	}
+#endif
+	free(dir->buffer);
+}
+
+/**
+ * Moves the data available on one side of a connection to the other side
+ * until either would block.
+ *
+ * @return 0 if ok, -1 if the connection has to be closed.
+ */
+static int forward_direction_pump(struct idevice_forward_direction *dir)
+{
+	int budget = IDEVICE_FORWARD_BUDGET;
+
+	while (!dir->done) {
+		if (dir->pending == 0 && !dir->eof) {
+			if (budget-- == 0)
+				break;
+			long r;
+#ifdef HAVE_SPLICE
+			if (dir->pipe[0] >= 0) {
+				r = (long)splice(dir->from, NULL, dir->pipe[1], NULL, IDEVICE_FORWARD_CHUNK_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+				if (r < 0 && (errno == EINVAL || errno == ENOSYS)) {
+					debug_info("splice not supported, relaying through a buffer");
+					if (forward_direction_use_buffer(dir) < 0)
+						return -1;
+					continue;
+				}
+			} else
+#endif
+			{
+				r = (long)recv(dir->from, dir->buffer, IDEVICE_FORWARD_CHUNK_SIZE, 0);
+			}
+			if (r < 0) {
+				if (forward_would_block())
+					break;
+				return -1;
+			}
+			if (r == 0) {
+				dir->eof = 1;
+			} else {
+				dir->pos = 0;
+				dir->pending = (uint32_t)r;
+			}
+		}
+
+		if (dir->pending > 0) {
+			long w;
+#ifdef HAVE_SPLICE
+			if (dir->pipe[0] >= 0) {
+				w = (long)splice(dir->pipe[0], NULL, dir->to, NULL, dir->pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			} else
+#endif
+			{
+				w = (long)send(dir->to, dir->buffer + dir->pos, dir->pending, MSG_NOSIGNAL);
+			}
+			if (w < 0) {
+				if (forward_would_block())
+					break;
+				return -1;
+			}
+			dir->pos += (uint32_t)w;
+			dir->pending -= (uint32_t)w;
+			if (dir->pending > 0) {
+				/* wait until the other side is writable again */
+				break;
+			}
+			continue;
+		}
+
+		if (dir->eof) {
+			/* pass the half close on, the other direction may still be busy */
+			socket_shutdown(dir->to, SHUT_WR);
+			dir->done = 1;
+		}
+	}
+
+	return 0;
+}
+
+static unsigned int forward_direction_read_events(struct idevice_forward_direction *dir)
+{
+	return (!dir->done && !dir->eof && dir->pending == 0) ? SOCKET_WAIT_READ : 0;
+}
+
+static unsigned int forward_direction_write_events(struct idevice_forward_direction *dir)
+{
+	return (dir->pending > 0) ? SOCKET_WAIT_WRITE : 0;
+}
+
+/**
+ * Registers the sockets of a connection for the events its directions wait
+ * for. Sockets that wait for nothing are removed from the waiter, so a hang
+ * up can't wake up the loop over and over.
+ */
+static int forward_connection_update(socket_waiter_t waiter, struct idevice_forward_connection *fc)
+{
+	unsigned int client_events = forward_direction_read_events(&fc->up) | forward_direction_write_events(&fc->down);
+	unsigned int device_events = forward_direction_read_events(&fc->down) | forward_direction_write_events(&fc->up);
+
+	if (client_events != fc->client_events) {
+		if (client_events == 0) {
+			socket_waiter_remove(waiter, fc->client_fd);
+		} else if (socket_waiter_add(waiter, fc->client_fd, client_events, fc) < 0) {
+			return -1;
+		}
+		fc->client_events = client_events;
+	}
+	if (device_events != fc->device_events) {
+		if (device_events == 0) {
+			socket_waiter_remove(waiter, fc->device_fd);
+		} else if (socket_waiter_add(waiter, fc->device_fd, device_events, fc) < 0) {
+			return -1;
+		}
+		fc->device_events = device_events;
+	}
+
+	return 0;
+}
+
+static void forward_connection_close(socket_waiter_t waiter, struct idevice_forward_connection *fc)
+{
+	if (fc->client_events)
+		socket_waiter_remove(waiter, fc->client_fd);
+	if (fc->device_events)
+		socket_waiter_remove(waiter, fc->device_fd);
+	fc->client_events = fc->device_events = 0;
+	fc->closed = 1;
+}
+
+static void forward_connection_free(struct idevice_forward_connection *fc)
+{
+	forward_direction_free(&fc->up);
+	forward_direction_free(&fc->down);
+	if (fc->client_fd >= 0)
+		socket_close(fc->client_fd);
+	if (fc->connection)
+		idevice_disconnect(fc->connection);
+	free(fc);
+}
+
+/**
+ * Accepts the pending connections of a listener and connects each of them
+ * to the device.
+ */
+static void forward_accept(idevice_forward_t forward, socket_waiter_t waiter, struct idevice_forward_listener *listener)
+{
+	while (1) {
+		int cfd = socket_accept(listener->fd, listener->port);
+		if (cfd < 0)
+			break;
+
+		struct idevice_forward_connection *fc = (struct idevice_forward_connection*)calloc(1, sizeof(struct idevice_forward_connection));
+		if (!fc) {
+			socket_close(cfd);
+			break;
+		}
+		fc->kind = IDEVICE_FORWARD_CONNECTION;
+		fc->client_fd = cfd;
+		fc->device_fd = -1;
+
+		if (idevice_connect(listener->device, listener->device_port, &fc->connection) != IDEVICE_E_SUCCESS) {
+			debug_info("Could not connect to port %d of device %s", listener->device_port, listener->device->udid);
+			fc->connection = NULL;
+			forward_connection_free(fc);
+			continue;
+		}
+		if (idevice_connection_get_fd(fc->connection, &fc->device_fd) != IDEVICE_E_SUCCESS
+		    || forward_direction_init(&fc->up, fc->client_fd, fc->device_fd) < 0
+		    || forward_direction_init(&fc->down, fc->device_fd, fc->client_fd) < 0) {
+			forward_connection_free(fc);
+			continue;
+		}
+		/* the connection is only ever used by the forwarder from here on */
+		forward_set_nonblocking(fc->client_fd);
+		forward_set_nonblocking(fc->device_fd);
+		socket_set_nodelay(fc->client_fd, 1);
+
+		if (forward_connection_update(waiter, fc) < 0) {
+			forward_connection_close(waiter, fc);
+			forward_connection_free(fc);
+			continue;
+		}
+		fc->next = forward->connections;
+		forward->connections = fc;
+
+		debug_info("Forwarding local port %d to port %d of device %s", listener->port, listener->device_port, listener->device->udid);
+	}
+}
+
+static void forward_handle_connection(socket_waiter_t waiter, struct idevice_forward_connection *fc)
+{
+	if (fc->closed)
+		return;
+
+	if (forward_direction_pump(&fc->up) < 0
+	    || forward_direction_pump(&fc->down) < 0
+	    || (fc->up.done && fc->down.done)
+	    || forward_connection_update(waiter, fc) < 0) {
+		forward_connection_close(waiter, fc);
+	}
+}
+
+static void *forward_thread(void *arg)
+{
+	idevice_forward_t forward = (idevice_forward_t)arg;
+	struct socket_wait_event events[IDEVICE_FORWARD_BATCH];
+
+	socket_waiter_t waiter = socket_waiter_new();
+	if (!waiter) {
+		debug_info("ERROR: Could not create socket waiter");
+		return NULL;
+	}
+
+#ifndef WIN32
+	/* splice() has no MSG_NOSIGNAL, so writes to closed sockets would raise it */
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	if (forward->wakeup[0] >= 0)
+		socket_waiter_add(waiter, forward->wakeup[0], SOCKET_WAIT_READ, NULL);
+#endif
+
+	debug_info("Running");
+
+	while (1) {
+		struct idevice_forward_listener *listener;
+		int i;
+
+		mutex_lock(&forward->mutex);
+		if (forward->stop) {
+			mutex_unlock(&forward->mutex);
+			break;
+		}
+		for (listener = forward->listeners; listener; listener = listener->next) {
+			if (!listener->registered && socket_waiter_add(waiter, listener->fd, SOCKET_WAIT_READ, listener) == 0)
+				listener->registered = 1;
+		}
+		mutex_unlock(&forward->mutex);
+
+		int n = socket_waiter_wait(waiter, events, IDEVICE_FORWARD_BATCH, IDEVICE_FORWARD_MAX_WAIT);
+		if (n < 0) {
+			debug_info("ERROR: wait failed: %s", strerror(-n));
+			break;
+		}
+
+		for (i = 0; i < n; i++) {
+			if (!events[i].user_data) {
+#ifndef WIN32
+				char buf[64];
+				while (read(forward->wakeup[0], buf, sizeof(buf)) > 0);
+#endif
+				continue;
+			}
+			if (*(enum idevice_forward_kind*)events[i].user_data == IDEVICE_FORWARD_LISTENER) {
+				forward_accept(forward, waiter, (struct idevice_forward_listener*)events[i].user_data);
+			} else {
+				forward_handle_connection(waiter, (struct idevice_forward_connection*)events[i].user_data);
+			}
+		}
+
+		/* free closed connections only after the batch, it might refer to them again */
+		struct idevice_forward_connection **prev = &forward->connections;
+		while (*prev) {
+			struct idevice_forward_connection *fc = *prev;
+			if (fc->closed) {
+				*prev = fc->next;
+				forward_connection_free(fc);
+				continue;
+			}
+			prev = &fc->next;
+		}
+	}
+
+	while (forward->connections) {
+		struct idevice_forward_connection *fc = forward->connections;
+		forward->connections = fc->next;
+		forward_connection_free(fc);
+	}
+	socket_waiter_free(waiter);
+
+	debug_info("Exiting");
+
+	return NULL;
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_forward_new(idevice_forward_t *forward)
+{
+	if (!forward)
+		return IDEVICE_E_INVALID_ARG;
+
+	idevice_forward_t forward_loc = (idevice_forward_t)calloc(1, sizeof(struct idevice_forward_private));
+	if (!forward_loc)
+		return IDEVICE_E_UNKNOWN_ERROR;
+
+	mutex_init(&forward_loc->mutex);
+#ifndef WIN32
+	if (pipe(forward_loc->wakeup) == 0) {
+		fcntl(forward_loc->wakeup[0], F_SETFL, O_NONBLOCK);
+		fcntl(forward_loc->wakeup[1], F_SETFL, O_NONBLOCK);
+	} else {
+		forward_loc->wakeup[0] = forward_loc->wakeup[1] = -1;
+	}
+#endif
+
+	if (thread_new(&forward_loc->thread, forward_thread, forward_loc) != 0) {
+#ifndef WIN32
+		if (forward_loc->wakeup[0] >= 0) {
+			close(forward_loc->wakeup[0]);
+			close(forward_loc->wakeup[1]);
+		}
+#endif
+		mutex_destroy(&forward_loc->mutex);
+		free(forward_loc);
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+
+	*forward = forward_loc;
+
+	return IDEVICE_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_forward_add(idevice_forward_t forward, idevice_t device, uint16_t local_port, uint16_t device_port, uint16_t *bound_port)
+{
+	if (!forward || !device || device_port == 0)
+		return IDEVICE_E_INVALID_ARG;
+
+	struct idevice_forward_listener *listener = (struct idevice_forward_listener*)calloc(1, sizeof(struct idevice_forward_listener));
+	if (!listener)
+		return IDEVICE_E_UNKNOWN_ERROR;
+	listener->kind = IDEVICE_FORWARD_LISTENER;
+	listener->device = device;
+	listener->device_port = device_port;
+
+	listener->fd = socket_create(local_port);
+	if (listener->fd < 0) {
+		debug_info("Could not listen on port %d", local_port);
+		free(listener);
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+
+	struct sockaddr_in addr;
+#ifdef WIN32
+	int addr_len = sizeof(addr);
+#else
+	socklen_t addr_len = sizeof(addr);
+#endif
+	if (getsockname(listener->fd, (struct sockaddr*)&addr, &addr_len) == 0) {
+		listener->port = ntohs(addr.sin_port);
+	} else {
+		listener->port = local_port;
+	}
+	listen(listener->fd, IDEVICE_FORWARD_BACKLOG);
+	forward_set_nonblocking(listener->fd);
+
+	mutex_lock(&forward->mutex);
+	listener->next = forward->listeners;
+	forward->listeners = listener;
+	forward_wakeup(forward);
+	mutex_unlock(&forward->mutex);
+
+	if (bound_port)
+		*bound_port = listener->port;
+
+	return IDEVICE_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_forward_free(idevice_forward_t forward)
+{
+	if (!forward)
+		return IDEVICE_E_INVALID_ARG;
+
+	mutex_lock(&forward->mutex);
+	forward->stop = 1;
+	forward_wakeup(forward);
+	mutex_unlock(&forward->mutex);
+
+	thread_join(forward->thread);
+	thread_free(forward->thread);
+
+	while (forward->listeners) {
+		struct idevice_forward_listener *listener = forward->listeners;
+		forward->listeners = listener->next;
+		socket_close(listener->fd);
+		free(listener);
+	}
+#ifndef WIN32
+	if (forward->wakeup[0] >= 0) {
+		close(forward->wakeup[0]);
+		close(forward->wakeup[1]);
+	}
+#endif
+	mutex_destroy(&forward->mutex);
+	free(forward);
+
+	return IDEVICE_E_SUCCESS;
+}
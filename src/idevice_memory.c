@@ -0,0 +1,351 @@
+/*
+ * idevice_memory.c
+ * Pluggable allocator and memory accounting for message buffers.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <string.h>
+#include <stdlib.h>
+#ifdef WIN32
+#include <windows.h>
+#endif
+
+#include "idevice.h"
+#include "common/debug.h"
+
+/*
+ * Every buffer is preceded by a header naming its arena and size, so it can
+ * be accounted for and released without knowing where it came from. The
+ * header is padded to 16 bytes to keep the alignment malloc() provides.
+ */
+struct idevice_memory_header {
+	struct idevice_memory_arena *arena;
+	size_t size;
+};
+#define IDEVICE_MEMORY_HEADER_SIZE 16
+
+/* arena for buffers without a device, replaced by idevice_set_allocator() */
+static struct idevice_memory_arena *default_arena = NULL;
+static mutex_t default_arena_mutex;
+static thread_once_t default_arena_once = THREAD_ONCE_INIT;
+
+/* counters of all arenas; only the counter fields are used */
+static struct idevice_memory_arena memory_totals;
+
+static void default_arena_init(void)
+{
+	mutex_init(&default_arena_mutex);
+}
+
+static uint64_t idevice_memory_load(volatile uint64_t *value)
+{
+#ifdef WIN32
+	return (uint64_t)InterlockedCompareExchange64((volatile LONGLONG*)value, 0, 0);
+#else
+	return __atomic_load_n(value, __ATOMIC_ACQUIRE);
+#endif
+}
+
+/* returns the new value; subtracting is adding the two's complement */
+static uint64_t idevice_memory_add(volatile uint64_t *value, uint64_t amount)
+{
+#ifdef WIN32
+	return (uint64_t)InterlockedExchangeAdd64((volatile LONGLONG*)value, (LONGLONG)amount) + amount;
+#else
+	return __atomic_add_fetch(value, amount, __ATOMIC_ACQ_REL);
+#endif
+}
+
+static void idevice_memory_update_peak(volatile uint64_t *peak, uint64_t bytes)
+{
+	uint64_t cur = idevice_memory_load(peak);
+	while (bytes > cur) {
+#ifdef WIN32
+		uint64_t prev = (uint64_t)InterlockedCompareExchange64((volatile LONGLONG*)peak, (LONGLONG)bytes, (LONGLONG)cur);
+		if (prev == cur)
+			break;
+		cur = prev;
+#else
+		if (__atomic_compare_exchange_n(peak, &cur, bytes, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			break;
+#endif
+	}
+}
+
+static void idevice_memory_account(struct idevice_memory_arena *counters, uint64_t bytes, uint64_t blocks, int allocation)
+{
+	uint64_t now = idevice_memory_add(&counters->bytes, bytes);
+	if (blocks != 0) {
+		idevice_memory_add(&counters->blocks, blocks);
+	}
+	if (allocation) {
+		idevice_memory_add(&counters->allocations, 1);
+		idevice_memory_update_peak(&counters->peak_bytes, now);
+	}
+}
+
+static void *default_malloc(size_t size, void *user_data)
+{
+	return malloc(size);
+}
+
+static void *default_realloc(void *ptr, size_t size, void *user_data)
+{
+	return realloc(ptr, size);
+}
+
+static void default_free(void *ptr, void *user_data)
+{
+	free(ptr);
+}
+
+static int idevice_allocator_valid(const idevice_allocator_t *allocator)
+{
+	return !allocator || (allocator->malloc && allocator->realloc && allocator->free);
+}
+
+/* creates an arena using the given allocator, or malloc() if it is NULL */
+static struct idevice_memory_arena *idevice_memory_arena_create(const idevice_allocator_t *allocator)
+{
+	struct idevice_memory_arena *arena = (struct idevice_memory_arena*)calloc(1, sizeof(struct idevice_memory_arena));
+	if (!arena) {
+		return NULL;
+	}
+	if (allocator) {
+		arena->allocator = *allocator;
+	} else {
+		arena->allocator.malloc = default_malloc;
+		arena->allocator.realloc = default_realloc;
+		arena->allocator.free = default_free;
+		arena->allocator.user_data = NULL;
+	}
+	arena->refcount = 1;
+
+	return arena;
+}
+
+/**
+ * Creates an arena with the given allocator, or with the one set with
+ * idevice_set_allocator() if allocator is NULL. The caller owns the only
+ * reference.
+ */
+struct idevice_memory_arena *idevice_memory_arena_new(const idevice_allocator_t *allocator)
+{
+	idevice_allocator_t current;
+
+	if (!allocator) {
+		thread_once(&default_arena_once, default_arena_init);
+		mutex_lock(&default_arena_mutex);
+		if (default_arena) {
+			current = default_arena->allocator;
+			allocator = &current;
+		}
+		mutex_unlock(&default_arena_mutex);
+	}
+
+	return idevice_memory_arena_create(allocator);
+}
+
+struct idevice_memory_arena *idevice_memory_arena_ref(struct idevice_memory_arena *arena)
+{
+	if (arena) {
+		idevice_memory_add(&arena->refcount, 1);
+	}
+	return arena;
+}
+
+void idevice_memory_arena_unref(struct idevice_memory_arena *arena)
+{
+	if (arena && idevice_memory_add(&arena->refcount, (uint64_t)-1) == 0) {
+		free(arena);
+	}
+}
+
+/**
+ * Gets a reference to the arena for the buffers of a device, or to the
+ * default arena if device is NULL. Release it with idevice_memory_arena_unref().
+ */
+struct idevice_memory_arena *idevice_get_memory_arena(idevice_t device)
+{
+	struct idevice_memory_arena *arena = NULL;
+
+	if (device) {
+		mutex_lock(&device->arena_mutex);
+		arena = idevice_memory_arena_ref(device->arena);
+		mutex_unlock(&device->arena_mutex);
+		return arena;
+	}
+
+	thread_once(&default_arena_once, default_arena_init);
+	mutex_lock(&default_arena_mutex);
+	if (!default_arena) {
+		default_arena = idevice_memory_arena_create(NULL);
+	}
+	arena = idevice_memory_arena_ref(default_arena);
+	mutex_unlock(&default_arena_mutex);
+
+	return arena;
+}
+
+/**
+ * Allocates a buffer from an arena, or from the default arena if arena is
+ * NULL. The buffer must be released with idevice_memory_free().
+ */
+void *idevice_memory_alloc(struct idevice_memory_arena *arena, size_t size)
+{
+	struct idevice_memory_arena *temp = NULL;
+
+	if (size > SIZE_MAX - IDEVICE_MEMORY_HEADER_SIZE) {
+		return NULL;
+	}
+	if (!arena) {
+		arena = temp = idevice_get_memory_arena(NULL);
+		if (!arena) {
+			return NULL;
+		}
+	}
+
+	struct idevice_memory_header *header = (struct idevice_memory_header*)arena->allocator.malloc(IDEVICE_MEMORY_HEADER_SIZE + size, arena->allocator.user_data);
+	if (!header) {
+		idevice_memory_arena_unref(temp);
+		return NULL;
+	}
+	/* the buffer holds a reference of its own */
+	header->arena = idevice_memory_arena_ref(arena);
+	header->size = size;
+	idevice_memory_account(arena, size, 1, 1);
+	idevice_memory_account(&memory_totals, size, 1, 1);
+	idevice_memory_arena_unref(temp);
+
+	return (char*)header + IDEVICE_MEMORY_HEADER_SIZE;
+}
+
+/**
+ * Resizes a buffer allocated with idevice_memory_alloc(), within the arena
+ * it was allocated from. A NULL ptr allocates a new buffer from arena.
+ */
+void *idevice_memory_realloc(struct idevice_memory_arena *arena, void *ptr, size_t size)
+{
+	if (!ptr) {
+		return idevice_memory_alloc(arena, size);
+	}
+	if (size == 0) {
+		idevice_memory_free(ptr);
+		return NULL;
+	}
+	if (size > SIZE_MAX - IDEVICE_MEMORY_HEADER_SIZE) {
+		return NULL;
+	}
+
+	struct idevice_memory_header *header = (struct idevice_memory_header*)((char*)ptr - IDEVICE_MEMORY_HEADER_SIZE);
+	struct idevice_memory_arena *owner = header->arena;
+	size_t oldsize = header->size;
+
+	header = (struct idevice_memory_header*)owner->allocator.realloc(header, IDEVICE_MEMORY_HEADER_SIZE + size, owner->allocator.user_data);
+	if (!header) {
+		return NULL;
+	}
+	header->size = size;
+	idevice_memory_account(owner, (uint64_t)size - (uint64_t)oldsize, 0, 1);
+	idevice_memory_account(&memory_totals, (uint64_t)size - (uint64_t)oldsize, 0, 1);
+
+	return (char*)header + IDEVICE_MEMORY_HEADER_SIZE;
+}
+
+void idevice_memory_free(void *ptr)
+{
+	if (!ptr) {
+		return;
+	}
+
+	struct idevice_memory_header *header = (struct idevice_memory_header*)((char*)ptr - IDEVICE_MEMORY_HEADER_SIZE);
+	struct idevice_memory_arena *owner = header->arena;
+	uint64_t size = header->size;
+
+	owner->allocator.free(header, owner->allocator.user_data);
+	idevice_memory_account(owner, (uint64_t)0 - size, (uint64_t)-1, 0);
+	idevice_memory_account(&memory_totals, (uint64_t)0 - size, (uint64_t)-1, 0);
+	idevice_memory_arena_unref(owner);
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_set_allocator(const idevice_allocator_t *allocator)
+{
+	if (!idevice_allocator_valid(allocator)) {
+		return IDEVICE_E_INVALID_ARG;
+	}
+
+	struct idevice_memory_arena *arena = idevice_memory_arena_create(allocator);
+	if (!arena) {
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+
+	thread_once(&default_arena_once, default_arena_init);
+	mutex_lock(&default_arena_mutex);
+	struct idevice_memory_arena *old = default_arena;
+	default_arena = arena;
+	mutex_unlock(&default_arena_mutex);
+
+	/* buffers still allocated from the old arena keep it around */
+	idevice_memory_arena_unref(old);
+
+	return IDEVICE_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_set_device_allocator(idevice_t device, const idevice_allocator_t *allocator)
+{
+	if (!device || !idevice_allocator_valid(allocator)) {
+		return IDEVICE_E_INVALID_ARG;
+	}
+
+	struct idevice_memory_arena *arena = idevice_memory_arena_new(allocator);
+	if (!arena) {
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+
+	mutex_lock(&device->arena_mutex);
+	struct idevice_memory_arena *old = device->arena;
+	device->arena = arena;
+	mutex_unlock(&device->arena_mutex);
+
+	idevice_memory_arena_unref(old);
+
+	return IDEVICE_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_get_memory_stats(idevice_t device, idevice_memory_stats_t *stats)
+{
+	if (!stats) {
+		return IDEVICE_E_INVALID_ARG;
+	}
+
+	struct idevice_memory_arena *arena = (device) ? idevice_get_memory_arena(device) : &memory_totals;
+	if (!arena) {
+		memset(stats, '\0', sizeof(idevice_memory_stats_t));
+		return IDEVICE_E_SUCCESS;
+	}
+	stats->bytes = idevice_memory_load(&arena->bytes);
+	stats->peak_bytes = idevice_memory_load(&arena->peak_bytes);
+	stats->blocks = idevice_memory_load(&arena->blocks);
+	stats->allocations = idevice_memory_load(&arena->allocations);
+	if (device) {
+		idevice_memory_arena_unref(arena);
+	}
+
+	return IDEVICE_E_SUCCESS;
+}
@@ -32,6 +32,7 @@
 #include "installation_proxy.h"
 #include "property_list_service.h"
 #include "common/debug.h"
+#include "common/strmap.h"
 
 typedef enum {
 	INSTPROXY_COMMAND_TYPE_ASYNC,
@@ -41,10 +42,82 @@ typedef enum {
 struct instproxy_status_data {
 	instproxy_client_t client;
 	plist_t command;
+	char *command_name;
 	instproxy_status_cb_t cbfunc;
 	void *user_data;
+	int cancelled;
+	unsigned int idle_time;
+	struct instproxy_status_data *next;
 };
 
+struct instproxy_error_name {
+	const char *name;
+	instproxy_error_t err;
+};
+
+static struct instproxy_error_name instproxy_error_names[] = {
+	{ "AlreadyArchived", INSTPROXY_E_ALREADY_ARCHIVED },
+	{ "APIInternalError", INSTPROXY_E_API_INTERNAL_ERROR },
+	{ "ApplicationAlreadyInstalled", INSTPROXY_E_APPLICATION_ALREADY_INSTALLED },
+	{ "ApplicationMoveFailed", INSTPROXY_E_APPLICATION_MOVE_FAILED },
+	{ "ApplicationSINFCaptureFailed", INSTPROXY_E_APPLICATION_SINF_CAPTURE_FAILED },
+	{ "ApplicationSandboxFailed", INSTPROXY_E_APPLICATION_SANDBOX_FAILED },
+	{ "ApplicationVerificationFailed", INSTPROXY_E_APPLICATION_VERIFICATION_FAILED },
+	{ "ArchiveDestructionFailed", INSTPROXY_E_ARCHIVE_DESTRUCTION_FAILED },
+	{ "BundleVerificationFailed", INSTPROXY_E_BUNDLE_VERIFICATION_FAILED },
+	{ "CarrierBundleCopyFailed", INSTPROXY_E_CARRIER_BUNDLE_COPY_FAILED },
+	{ "CarrierBundleDirectoryCreationFailed", INSTPROXY_E_CARRIER_BUNDLE_DIRECTORY_CREATION_FAILED },
+	{ "CarrierBundleMissingSupportedSIMs", INSTPROXY_E_CARRIER_BUNDLE_MISSING_SUPPORTED_SIMS },
+	{ "CommCenterNotificationFailed", INSTPROXY_E_COMM_CENTER_NOTIFICATION_FAILED },
+	{ "ContainerCreationFailed", INSTPROXY_E_CONTAINER_CREATION_FAILED },
+	{ "ContainerP0wnFailed", INSTPROXY_E_CONTAINER_P0WN_FAILED },
+	{ "ContainerRemovalFailed", INSTPROXY_E_CONTAINER_REMOVAL_FAILED },
+	{ "EmbeddedProfileInstallFailed", INSTPROXY_E_EMBEDDED_PROFILE_INSTALL_FAILED },
+	{ "ExecutableTwiddleFailed", INSTPROXY_E_EXECUTABLE_TWIDDLE_FAILED },
+	{ "ExistenceCheckFailed", INSTPROXY_E_EXISTENCE_CHECK_FAILED },
+	{ "InstallMapUpdateFailed", INSTPROXY_E_INSTALL_MAP_UPDATE_FAILED },
+	{ "ManifestCaptureFailed", INSTPROXY_E_MANIFEST_CAPTURE_FAILED },
+	{ "MapGenerationFailed", INSTPROXY_E_MAP_GENERATION_FAILED },
+	{ "MissingBundleExecutable", INSTPROXY_E_MISSING_BUNDLE_EXECUTABLE },
+	{ "MissingBundleIdentifier", INSTPROXY_E_MISSING_BUNDLE_IDENTIFIER },
+	{ "MissingBundlePath", INSTPROXY_E_MISSING_BUNDLE_PATH },
+	{ "MissingContainer", INSTPROXY_E_MISSING_CONTAINER },
+	{ "NotificationFailed", INSTPROXY_E_NOTIFICATION_FAILED },
+	{ "PackageExtractionFailed", INSTPROXY_E_PACKAGE_EXTRACTION_FAILED },
+	{ "PackageInspectionFailed", INSTPROXY_E_PACKAGE_INSPECTION_FAILED },
+	{ "PackageMoveFailed", INSTPROXY_E_PACKAGE_MOVE_FAILED },
+	{ "PathConversionFailed", INSTPROXY_E_PATH_CONVERSION_FAILED },
+	{ "RestoreContainerFailed", INSTPROXY_E_RESTORE_CONTAINER_FAILED },
+	{ "SeatbeltProfileRemovalFailed", INSTPROXY_E_SEATBELT_PROFILE_REMOVAL_FAILED },
+	{ "StageCreationFailed", INSTPROXY_E_STAGE_CREATION_FAILED },
+	{ "SymlinkFailed", INSTPROXY_E_SYMLINK_FAILED },
+	{ "UnknownCommand", INSTPROXY_E_UNKNOWN_COMMAND },
+	{ "iTunesArtworkCaptureFailed", INSTPROXY_E_ITUNES_ARTWORK_CAPTURE_FAILED },
+	{ "iTunesMetadataCaptureFailed", INSTPROXY_E_ITUNES_METADATA_CAPTURE_FAILED },
+	{ "DeviceOSVersionTooLow", INSTPROXY_E_DEVICE_OS_VERSION_TOO_LOW },
+	{ "DeviceFamilyNotSupported", INSTPROXY_E_DEVICE_FAMILY_NOT_SUPPORTED },
+	{ "PackagePatchFailed", INSTPROXY_E_PACKAGE_PATCH_FAILED },
+	{ "IncorrectArchitecture", INSTPROXY_E_INCORRECT_ARCHITECTURE },
+	{ "PluginCopyFailed", INSTPROXY_E_PLUGIN_COPY_FAILED },
+	{ "BreadcrumbFailed", INSTPROXY_E_BREADCRUMB_FAILED },
+	{ "BreadcrumbUnlockFailed", INSTPROXY_E_BREADCRUMB_UNLOCK_FAILED },
+	{ "GeoJSONCaptureFailed", INSTPROXY_E_GEOJSON_CAPTURE_FAILED },
+	{ "NewsstandArtworkCaptureFailed", INSTPROXY_E_NEWSSTAND_ARTWORK_CAPTURE_FAILED },
+	{ "MissingCommand", INSTPROXY_E_MISSING_COMMAND },
+	{ "NotEntitled", INSTPROXY_E_NOT_ENTITLED },
+	{ "MissingPackagePath", INSTPROXY_E_MISSING_PACKAGE_PATH },
+	{ "MissingContainerPath", INSTPROXY_E_MISSING_CONTAINER_PATH },
+	{ "MissingApplicationIdentifier", INSTPROXY_E_MISSING_APPLICATION_IDENTIFIER },
+	{ "MissingAttributeValue", INSTPROXY_E_MISSING_ATTRIBUTE_VALUE },
+	{ "LookupFailed", INSTPROXY_E_LOOKUP_FAILED },
+	{ "DictCreationFailed", INSTPROXY_E_DICT_CREATION_FAILED },
+	{ "InstallProhibited", INSTPROXY_E_INSTALL_PROHIBITED },
+	{ "UninstallProhibited", INSTPROXY_E_UNINSTALL_PROHIBITED },
+	{ "MissingBundleVersion", INSTPROXY_E_MISSING_BUNDLE_VERSION },
+	{ NULL, 0 }
+};
+static strmap_t instproxy_error_name_map = STRMAP_INIT(instproxy_error_names);
+
 /**
  * Converts an error string identifier to a instproxy_error_t value.
  * Used internally to get correct error codes from a response.
@@ -59,127 +132,8 @@ struct instproxy_status_data {
  */
 static instproxy_error_t instproxy_strtoerr(const char* name)
 {
-	instproxy_error_t err = INSTPROXY_E_UNKNOWN_ERROR;
-
-	if (strcmp(name, "AlreadyArchived") == 0) {
-		err = INSTPROXY_E_ALREADY_ARCHIVED;
-	} else if (strcmp(name, "APIInternalError") == 0) {
-		err = INSTPROXY_E_API_INTERNAL_ERROR;
-	} else if (strcmp(name, "ApplicationAlreadyInstalled") == 0) {
-		err = INSTPROXY_E_APPLICATION_ALREADY_INSTALLED;
-	} else if (strcmp(name, "ApplicationMoveFailed") == 0) {
-		err = INSTPROXY_E_APPLICATION_MOVE_FAILED;
-	} else if (strcmp(name, "ApplicationSINFCaptureFailed") == 0) {
-		err = INSTPROXY_E_APPLICATION_SINF_CAPTURE_FAILED;
-	} else if (strcmp(name, "ApplicationSandboxFailed") == 0) {
-		err = INSTPROXY_E_APPLICATION_SANDBOX_FAILED;
-	} else if (strcmp(name, "ApplicationVerificationFailed") == 0) {
-		err = INSTPROXY_E_APPLICATION_VERIFICATION_FAILED;
-	} else if (strcmp(name, "ArchiveDestructionFailed") == 0) {
-		err = INSTPROXY_E_ARCHIVE_DESTRUCTION_FAILED;
-	} else if (strcmp(name, "BundleVerificationFailed") == 0) {
-		err = INSTPROXY_E_BUNDLE_VERIFICATION_FAILED;
-	} else if (strcmp(name, "CarrierBundleCopyFailed") == 0) {
-		err = INSTPROXY_E_CARRIER_BUNDLE_COPY_FAILED;
-	} else if (strcmp(name, "CarrierBundleDirectoryCreationFailed") == 0) {
-		err = INSTPROXY_E_CARRIER_BUNDLE_DIRECTORY_CREATION_FAILED;
-	} else if (strcmp(name, "CarrierBundleMissingSupportedSIMs") == 0) {
-		err = INSTPROXY_E_CARRIER_BUNDLE_MISSING_SUPPORTED_SIMS;
-	} else if (strcmp(name, "CommCenterNotificationFailed") == 0) {
-		err = INSTPROXY_E_COMM_CENTER_NOTIFICATION_FAILED;
-	} else if (strcmp(name, "ContainerCreationFailed") == 0) {
-		err = INSTPROXY_E_CONTAINER_CREATION_FAILED;
-	} else if (strcmp(name, "ContainerP0wnFailed") == 0) {
-		err = INSTPROXY_E_CONTAINER_P0WN_FAILED;
-	} else if (strcmp(name, "ContainerRemovalFailed") == 0) {
-		err = INSTPROXY_E_CONTAINER_REMOVAL_FAILED;
-	} else if (strcmp(name, "EmbeddedProfileInstallFailed") == 0) {
-		err = INSTPROXY_E_EMBEDDED_PROFILE_INSTALL_FAILED;
-	} else if (strcmp(name, "ExecutableTwiddleFailed") == 0) {
-		err = INSTPROXY_E_EXECUTABLE_TWIDDLE_FAILED;
-	} else if (strcmp(name, "ExistenceCheckFailed") == 0) {
-		err = INSTPROXY_E_EXISTENCE_CHECK_FAILED;
-	} else if (strcmp(name, "InstallMapUpdateFailed") == 0) {
-		err = INSTPROXY_E_INSTALL_MAP_UPDATE_FAILED;
-	} else if (strcmp(name, "ManifestCaptureFailed") == 0) {
-		err = INSTPROXY_E_MANIFEST_CAPTURE_FAILED;
-	} else if (strcmp(name, "MapGenerationFailed") == 0) {
-		err = INSTPROXY_E_MAP_GENERATION_FAILED;
-	} else if (strcmp(name, "MissingBundleExecutable") == 0) {
-		err = INSTPROXY_E_MISSING_BUNDLE_EXECUTABLE;
-	} else if (strcmp(name, "MissingBundleIdentifier") == 0) {
-		err = INSTPROXY_E_MISSING_BUNDLE_IDENTIFIER;
-	} else if (strcmp(name, "MissingBundlePath") == 0) {
-		err = INSTPROXY_E_MISSING_BUNDLE_PATH;
-	} else if (strcmp(name, "MissingContainer") == 0) {
-		err = INSTPROXY_E_MISSING_CONTAINER;
-	} else if (strcmp(name, "NotificationFailed") == 0) {
-		err = INSTPROXY_E_NOTIFICATION_FAILED;
-	} else if (strcmp(name, "PackageExtractionFailed") == 0) {
-		err = INSTPROXY_E_PACKAGE_EXTRACTION_FAILED;
-	} else if (strcmp(name, "PackageInspectionFailed") == 0) {
-		err = INSTPROXY_E_PACKAGE_INSPECTION_FAILED;
-	} else if (strcmp(name, "PackageMoveFailed") == 0) {
-		err = INSTPROXY_E_PACKAGE_MOVE_FAILED;
-	} else if (strcmp(name, "PathConversionFailed") == 0) {
-		err = INSTPROXY_E_PATH_CONVERSION_FAILED;
-	} else if (strcmp(name, "RestoreContainerFailed") == 0) {
-		err = INSTPROXY_E_RESTORE_CONTAINER_FAILED;
-	} else if (strcmp(name, "SeatbeltProfileRemovalFailed") == 0) {
-		err = INSTPROXY_E_SEATBELT_PROFILE_REMOVAL_FAILED;
-	} else if (strcmp(name, "StageCreationFailed") == 0) {
-		err = INSTPROXY_E_STAGE_CREATION_FAILED;
-	} else if (strcmp(name, "SymlinkFailed") == 0) {
-		err = INSTPROXY_E_SYMLINK_FAILED;
-	} else if (strcmp(name, "UnknownCommand") == 0) {
-		err = INSTPROXY_E_UNKNOWN_COMMAND;
-	} else if (strcmp(name, "iTunesArtworkCaptureFailed") == 0) {
-		err = INSTPROXY_E_ITUNES_ARTWORK_CAPTURE_FAILED;
-	} else if (strcmp(name, "iTunesMetadataCaptureFailed") == 0) {
-		err = INSTPROXY_E_ITUNES_METADATA_CAPTURE_FAILED;
-	} else if (strcmp(name, "DeviceOSVersionTooLow") == 0) {
-		err = INSTPROXY_E_DEVICE_OS_VERSION_TOO_LOW;
-	} else if (strcmp(name, "DeviceFamilyNotSupported") == 0) {
-		err = INSTPROXY_E_DEVICE_FAMILY_NOT_SUPPORTED;
-	} else if (strcmp(name, "PackagePatchFailed") == 0) {
-		err = INSTPROXY_E_PACKAGE_PATCH_FAILED;
-	} else if (strcmp(name, "IncorrectArchitecture") == 0) {
-		err = INSTPROXY_E_INCORRECT_ARCHITECTURE;
-	} else if (strcmp(name, "PluginCopyFailed") == 0) {
-		err = INSTPROXY_E_PLUGIN_COPY_FAILED;
-	} else if (strcmp(name, "BreadcrumbFailed") == 0) {
-		err = INSTPROXY_E_BREADCRUMB_FAILED;
-	} else if (strcmp(name, "BreadcrumbUnlockFailed") == 0) {
-		err = INSTPROXY_E_BREADCRUMB_UNLOCK_FAILED;
-	} else if (strcmp(name, "GeoJSONCaptureFailed") == 0) {
-		err = INSTPROXY_E_GEOJSON_CAPTURE_FAILED;
-	} else if (strcmp(name, "NewsstandArtworkCaptureFailed") == 0) {
-		err = INSTPROXY_E_NEWSSTAND_ARTWORK_CAPTURE_FAILED;
-	} else if (strcmp(name, "MissingCommand") == 0) {
-		err = INSTPROXY_E_MISSING_COMMAND;
-	} else if (strcmp(name, "NotEntitled") == 0) {
-		err = INSTPROXY_E_NOT_ENTITLED;
-	} else if (strcmp(name, "MissingPackagePath") == 0) {
-		err = INSTPROXY_E_MISSING_PACKAGE_PATH;
-	} else if (strcmp(name, "MissingContainerPath") == 0) {
-		err = INSTPROXY_E_MISSING_CONTAINER_PATH;
-	} else if (strcmp(name, "MissingApplicationIdentifier") == 0) {
-		err = INSTPROXY_E_MISSING_APPLICATION_IDENTIFIER;
-	} else if (strcmp(name, "MissingAttributeValue") == 0) {
-		err = INSTPROXY_E_MISSING_ATTRIBUTE_VALUE;
-	} else if (strcmp(name, "LookupFailed") == 0) {
-		err = INSTPROXY_E_LOOKUP_FAILED;
-	} else if (strcmp(name, "DictCreationFailed") == 0) {
-		err = INSTPROXY_E_DICT_CREATION_FAILED;
-	} else if (strcmp(name, "InstallProhibited") == 0) {
-		err = INSTPROXY_E_INSTALL_PROHIBITED;
-	} else if (strcmp(name, "UninstallProhibited") == 0) {
-		err = INSTPROXY_E_UNINSTALL_PROHIBITED;
-	} else if (strcmp(name, "MissingBundleVersion") == 0) {
-		err = INSTPROXY_E_MISSING_BUNDLE_VERSION;
-	}
-
-	return err;
+	int i = strmap_find(&instproxy_error_name_map, name);
+	return (i < 0) ? INSTPROXY_E_UNKNOWN_ERROR : instproxy_error_names[i].err;
 }
 
 /**
@@ -243,7 +197,8 @@ LIBIMOBILEDEVICE_API instproxy_error_t instproxy_client_new(idevice_t device, lo
 	instproxy_client_t client_loc = (instproxy_client_t) malloc(sizeof(struct instproxy_client_private));
 	client_loc->parent = plistclient;
 	mutex_init(&client_loc->mutex);
-	client_loc->receive_status_thread = THREAD_T_NULL;
+	client_loc->status_job = NULL;
+	cond_init(&client_loc->status_job_cond);
 
 	*client = client_loc;
 	return INSTPROXY_E_SUCCESS;
@@ -261,15 +216,21 @@ LIBIMOBILEDEVICE_API instproxy_error_t instproxy_client_free(instproxy_client_t
 	if (!client)
 		return INSTPROXY_E_INVALID_ARG;
 
+	/* the executor only lets go of the command once it has seen the cancellation */
+	instproxy_lock(client);
+	if (client->status_job) {
+		debug_info("waiting for pending command to finish");
+		client->status_job->cancelled = 1;
+		while (client->status_job) {
+			cond_wait(&client->status_job_cond, &client->mutex);
+		}
+	}
+	instproxy_unlock(client);
+
 	property_list_service_client_t parent = client->parent;
 	client->parent = NULL;
-	if (client->receive_status_thread) {
-		debug_info("joining receive_status_thread");
-		thread_join(client->receive_status_thread);
-		thread_free(client->receive_status_thread);
-		client->receive_status_thread = THREAD_T_NULL;
-	}
 	property_list_service_client_free(parent);
+	cond_destroy(&client->status_job_cond);
 	mutex_destroy(&client->mutex);
 	free(client);
 
@@ -304,6 +265,90 @@ static instproxy_error_t instproxy_send_command(instproxy_client_t client, plist
 	return res;
 }
 
+/**
+ * Internally used function that processes a single status message received
+ * for a command and passes it to the status callback.
+ *
+ * @param command Operation specificiation in plist. Will be passed to the
+ *        status_cb callback.
+ * @param command_name Name of the command, used for debug messages.
+ * @param message The received status message. Its plist is only built
+ *        when there is a status callback to pass it to.
+ * @param status_cb Pointer to a callback function or NULL
+ * @param user_data Callback data passed to status_cb.
+ * @param complete Will be set to 1 if the command completed or failed.
+ *
+ * @return INSTPROXY_E_SUCCESS when the command completed,
+ *         INSTPROXY_E_OP_IN_PROGRESS when it is still running, or an
+ *         INSTPROXY_E_* error value reported by the device.
+ */
+static instproxy_error_t instproxy_handle_status(plist_t command, const char *command_name, struct property_list_message *message, instproxy_status_cb_t status_cb, void *user_data, int *complete)
+{
+	instproxy_error_t res = INSTPROXY_E_SUCCESS;
+	char* status_name = NULL;
+	char* error_name = NULL;
+	char* error_description = NULL;
+	uint64_t error_code = 0;
+#ifndef STRIP_DEBUG_CODE
+	uint64_t percent_complete = 0;
+#endif
+
+	/* check status for possible error to allow reporting it and aborting it gracefully */
+	if (property_list_message_get_string(message, "Error", &error_name)) {
+		res = instproxy_strtoerr(error_name);
+		property_list_message_get_uint(message, "ErrorDetail", &error_code);
+		error_code &= 0xffffffff;
+		property_list_message_get_string(message, "ErrorDescription", &error_description);
+		debug_info("command: %s, error %d, code 0x%08"PRIx64", name: %s, description: \"%s\"", command_name, res, error_code, error_name, error_description ? error_description: "N/A");
+		*complete = 1;
+	}
+
+	if (error_name) {
+		free(error_name);
+		error_name = NULL;
+	}
+
+	if (error_description) {
+		free(error_description);
+		error_description = NULL;
+	}
+
+	/* check status from response */
+	property_list_message_get_string(message, "Status", &status_name);
+	if (!status_name) {
+		debug_info("failed to retrieve name from status response with error %d.", res);
+		*complete = 1;
+	}
+
+	if (status_name) {
+		if (!strcmp(status_name, "Complete")) {
+			*complete = 1;
+		} else {
+			res = INSTPROXY_E_OP_IN_PROGRESS;
+		}
+
+#ifndef STRIP_DEBUG_CODE
+		if (property_list_message_get_uint(message, "PercentComplete", &percent_complete)) {
+			debug_info("command: %s, status: %s, percent (%d%%)", command_name, status_name, (int)percent_complete);
+		} else {
+			debug_info("command: %s, status: %s", command_name, status_name);
+		}
+#endif
+		free(status_name);
+		status_name = NULL;
+	}
+
+	/* invoke status callback function */
+	if (status_cb) {
+		plist_t node = property_list_message_get_plist(message);
+		if (node) {
+			status_cb(command, node, user_data);
+		}
+	}
+
+	return res;
+}
+
 /**
  * Internally used function that will synchronously receive messages from
  * the specified installation_proxy until it completes or an error occurs.
@@ -321,22 +366,15 @@ static instproxy_error_t instproxy_receive_status_loop(instproxy_client_t client
 {
 	instproxy_error_t res = INSTPROXY_E_UNKNOWN_ERROR;
 	int complete = 0;
-	plist_t node = NULL;
+	struct property_list_message message;
 	char* command_name = NULL;
-	char* status_name = NULL;
-	char* error_name = NULL;
-	char* error_description = NULL;
-	uint64_t error_code = 0;
-#ifndef STRIP_DEBUG_CODE
-	int percent_complete = 0;
-#endif
 
 	instproxy_command_get_name(command, &command_name);
 
 	do {
 		/* receive status response */
 		instproxy_lock(client);
-		res = instproxy_error(property_list_service_receive_plist_with_timeout(client->parent, &node, 1000));
+		res = instproxy_error(property_list_service_receive_message(client->parent, &message, 1000));
 		instproxy_unlock(client);
 
 		/* break out if we have a communication problem */
@@ -346,110 +384,249 @@ static instproxy_error_t instproxy_receive_status_loop(instproxy_client_t client
 		}
 
 		/* parse status response */
-		if (node) {
-			/* check status for possible error to allow reporting it and aborting it gracefully */
-			res = instproxy_status_get_error(node, &error_name, &error_description, &error_code);
-			if (res != INSTPROXY_E_SUCCESS) {
-				debug_info("command: %s, error %d, code 0x%08"PRIx64", name: %s, description: \"%s\"", command_name, res, error_code, error_name, error_description ? error_description: "N/A");
-				complete = 1;
-			}
+		if (res == INSTPROXY_E_SUCCESS) {
+			res = instproxy_handle_status(command, command_name, &message, status_cb, user_data, &complete);
+			property_list_message_free(&message);
+		}
+	} while (!complete && client->parent);
 
-			if (error_name) {
-				free(error_name);
-				error_name = NULL;
-			}
+	if (command_name)
+		free(command_name);
 
-			if (error_description) {
-				free(error_description);
-				error_description = NULL;
-			}
+	return res;
+}
 
-			/* check status from response */
-			instproxy_status_get_name(node, &status_name);
-			if (!status_name) {
-				debug_info("failed to retrieve name from status response with error %d.", res);
-				complete = 1;
-			}
+/*
+ * Status loops of asynchronous commands of all clients are run by a shared
+ * executor instead of a thread per command. Each worker takes the command
+ * at the head of the run queue, waits up to poll_timeout for one status
+ * message, and puts the command back at the tail unless it is done. Workers
+ * are started on demand up to max_workers and exit when the queue is empty.
+ */
+#define INSTPROXY_EXECUTOR_DEFAULT_WORKERS 4
+#define INSTPROXY_EXECUTOR_DEFAULT_POLL_TIMEOUT 100
+
+static struct {
+	mutex_t mutex;
+	struct instproxy_status_data *first;
+	struct instproxy_status_data *last;
+	unsigned int num_jobs;
+	unsigned int num_workers;
+	unsigned int max_workers;
+	unsigned int poll_timeout;
+	unsigned int command_timeout;
+} executor;
+
+static thread_once_t executor_init_once = THREAD_ONCE_INIT;
+
+static void instproxy_executor_init(void)
+{
+	mutex_init(&executor.mutex);
+	executor.first = NULL;
+	executor.last = NULL;
+	executor.num_jobs = 0;
+	executor.num_workers = 0;
+	executor.max_workers = INSTPROXY_EXECUTOR_DEFAULT_WORKERS;
+	executor.poll_timeout = INSTPROXY_EXECUTOR_DEFAULT_POLL_TIMEOUT;
+	executor.command_timeout = 0;
+}
 
-			if (status_name) {
-				if (!strcmp(status_name, "Complete")) {
-					complete = 1;
-				} else {
-					res = INSTPROXY_E_OP_IN_PROGRESS;
-				}
+/**
+ * Reports the end of a command that did not complete on its own to the
+ * status callback, so callers waiting for a final status don't hang.
+ */
+static void instproxy_status_job_abort(struct instproxy_status_data *job, const char *error_name, const char *description)
+{
+	if (!job->cbfunc)
+		return;
 
-#ifndef STRIP_DEBUG_CODE
-				percent_complete = -1;
-				instproxy_status_get_percent_complete(node, &percent_complete);
-				if (percent_complete >= 0) {
-					debug_info("command: %s, status: %s, percent (%d%%)", command_name, status_name, percent_complete);
-				} else {
-					debug_info("command: %s, status: %s", command_name, status_name);
-				}
-#endif
-				free(status_name);
-				status_name = NULL;
-			}
+	plist_t status = plist_new_dict();
+	plist_dict_set_item(status, "Error", plist_new_string(error_name));
+	plist_dict_set_item(status, "ErrorDescription", plist_new_string(description));
+	job->cbfunc(job->command, status, job->user_data);
+	plist_free(status);
+}
 
-			/* invoke status callback function */
-			if (status_cb) {
-				status_cb(command, node, user_data);
-			}
+/**
+ * Runs a single step of the status loop of a command.
+ *
+ * @return 1 if the command is done, 0 if it has to be run again.
+ */
+static int instproxy_status_job_step(struct instproxy_status_data *job, unsigned int poll_timeout, unsigned int command_timeout)
+{
+	instproxy_client_t client = job->client;
+	struct property_list_message message;
+	int complete = 0;
 
-			plist_free(node);
-			node = NULL;
+	if (job->cancelled) {
+		debug_info("command: %s, cancelled", job->command_name);
+		instproxy_status_job_abort(job, "Cancelled", "The command was cancelled");
+		return 1;
+	}
+
+	instproxy_lock(client);
+	instproxy_error_t res = instproxy_error(property_list_service_receive_message(client->parent, &message, poll_timeout));
+	instproxy_unlock(client);
+
+	if (res == INSTPROXY_E_RECEIVE_TIMEOUT) {
+		job->idle_time += poll_timeout;
+		if (command_timeout > 0 && job->idle_time >= command_timeout) {
+			debug_info("command: %s, no status received for %u ms, giving up", job->command_name, job->idle_time);
+			instproxy_status_job_abort(job, "TimedOut", "No status was received within the command timeout");
+			return 1;
 		}
-	} while (!complete && client->parent);
+		return 0;
+	}
 
-	if (command_name)
-		free(command_name);
+	if (res != INSTPROXY_E_SUCCESS) {
+		debug_info("could not receive plist, error %d", res);
+		instproxy_status_job_abort(job, "ConnectionLost", "The connection to the device was lost");
+		return 1;
+	}
 
-	return res;
+	job->idle_time = 0;
+	instproxy_handle_status(job->command, job->command_name, &message, job->cbfunc, job->user_data, &complete);
+	property_list_message_free(&message);
+
+	return complete;
 }
 
 /**
- * Internally used "receive status" thread function that will call the specified
- * callback function when status update messages (or error messages) are
- * received.
- *
- * @param arg Pointer to an allocated struct instproxy_status_data that holds
- *     the required data about the connected client and the callback function.
+ * Internally used executor thread function that runs status loop steps of
+ * queued commands until the run queue is empty.
  *
  * @return Always NULL.
  */
-static void* instproxy_receive_status_loop_thread(void* arg)
+static void* instproxy_executor_worker(void* arg)
 {
-	struct instproxy_status_data *data = (struct instproxy_status_data*)arg;
+	mutex_lock(&executor.mutex);
+	while (executor.first) {
+		struct instproxy_status_data *job = executor.first;
+		executor.first = job->next;
+		if (!executor.first) {
+			executor.last = NULL;
+		}
+		job->next = NULL;
+		unsigned int poll_timeout = executor.poll_timeout;
+		unsigned int command_timeout = executor.command_timeout;
+		mutex_unlock(&executor.mutex);
+
+		int done = instproxy_status_job_step(job, poll_timeout, command_timeout);
+
+		if (done) {
+			/* cleanup */
+			instproxy_client_t client = job->client;
+			debug_info("done, cleaning up.");
+
+			instproxy_lock(client);
+			client->status_job = NULL;
+			cond_signal(&client->status_job_cond);
+			instproxy_unlock(client);
+
+			plist_free(job->command);
+			free(job->command_name);
+			free(job);
+		}
 
-	/* run until the command is complete or an error occurs */
-	(void)instproxy_receive_status_loop(data->client, data->command, data->cbfunc, data->user_data);
+		mutex_lock(&executor.mutex);
+		if (done) {
+			executor.num_jobs--;
+		} else if (executor.last) {
+			executor.last->next = job;
+			executor.last = job;
+		} else {
+			executor.first = job;
+			executor.last = job;
+		}
+	}
+	executor.num_workers--;
+	mutex_unlock(&executor.mutex);
 
-	/* cleanup */
-	instproxy_lock(data->client);
+	return NULL;
+}
 
-	debug_info("done, cleaning up.");
+/**
+ * Queues a command for the executor and starts another worker if there
+ * are more commands than workers.
+ *
+ * @return 0 on success, or a negative value if no worker could be started.
+ */
+static int instproxy_executor_submit(struct instproxy_status_data *job)
+{
+	int res = 0;
 
-	if (data->command) {
-		plist_free(data->command);
-	}
+	thread_once(&executor_init_once, instproxy_executor_init);
 
-	if (data->client->receive_status_thread) {
-		thread_free(data->client->receive_status_thread);
-		data->client->receive_status_thread = THREAD_T_NULL;
+	mutex_lock(&executor.mutex);
+	job->next = NULL;
+	if (executor.last) {
+		executor.last->next = job;
+	} else {
+		executor.first = job;
 	}
+	executor.last = job;
+	executor.num_jobs++;
+
+	if (executor.num_workers < executor.max_workers && executor.num_workers < executor.num_jobs) {
+		THREAD_T worker = THREAD_T_NULL;
+		if (thread_new(&worker, instproxy_executor_worker, NULL) == 0) {
+			thread_detach(worker);
+			executor.num_workers++;
+		} else if (executor.num_workers == 0) {
+			/* nobody would ever run the command */
+			struct instproxy_status_data **p = &executor.first;
+			executor.last = NULL;
+			while (*p) {
+				if (*p == job) {
+					*p = job->next;
+				} else {
+					executor.last = *p;
+					p = &(*p)->next;
+				}
+			}
+			executor.num_jobs--;
+			res = -1;
+		}
+	}
+	mutex_unlock(&executor.mutex);
+
+	return res;
+}
 
-	instproxy_unlock(data->client);
-	free(data);
+LIBIMOBILEDEVICE_API instproxy_error_t instproxy_set_status_executor(unsigned int max_workers, unsigned int poll_timeout, unsigned int command_timeout)
+{
+	thread_once(&executor_init_once, instproxy_executor_init);
 
-	return NULL;
+	mutex_lock(&executor.mutex);
+	executor.max_workers = (max_workers > 0) ? max_workers : INSTPROXY_EXECUTOR_DEFAULT_WORKERS;
+	executor.poll_timeout = (poll_timeout > 0) ? poll_timeout : INSTPROXY_EXECUTOR_DEFAULT_POLL_TIMEOUT;
+	executor.command_timeout = command_timeout;
+	mutex_unlock(&executor.mutex);
+
+	return INSTPROXY_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API instproxy_error_t instproxy_cancel(instproxy_client_t client)
+{
+	if (!client)
+		return INSTPROXY_E_INVALID_ARG;
+
+	instproxy_lock(client);
+	if (client->status_job) {
+		client->status_job->cancelled = 1;
+	}
+	instproxy_unlock(client);
+
+	return INSTPROXY_E_SUCCESS;
 }
 
 /**
- * Internally used helper function that creates a "receive status" thread which
- * will call the passed callback function when a status is received.
+ * Internally used helper function that hands the status loop of a command
+ * to the shared executor, which will call the passed callback function
+ * when a status is received.
  *
- * If async is 0 no thread will be created and the command will run
- * synchronously until it completes or an error occurs.
+ * If async is 0 the command will run synchronously until it completes or
+ * an error occurs.
  *
  * @param client The connected installation proxy client
  * @param command Operation name. Will be passed to the callback function
@@ -459,7 +636,7 @@ static void* instproxy_receive_status_loop_thread(void* arg)
  * @param status_cb Pointer to a callback function or NULL.
  * @param user_data Callback data passed to status_cb.
  *
- * @return INSTPROXY_E_SUCCESS when the thread was created (async mode), or
+ * @return INSTPROXY_E_SUCCESS when the command was queued (async mode), or
  *         when the command completed successfully (sync).
  *         An INSTPROXY_E_* error value is returned if an error occurred.
  */
@@ -469,7 +646,7 @@ static instproxy_error_t instproxy_receive_status_loop_with_callback(instproxy_c
 		return INSTPROXY_E_INVALID_ARG;
 	}
 
-	if (client->receive_status_thread) {
+	if (client->status_job) {
 		return INSTPROXY_E_OP_IN_PROGRESS;
 	}
 
@@ -480,11 +657,27 @@ static instproxy_error_t instproxy_receive_status_loop_with_callback(instproxy_c
 		if (data) {
 			data->client = client;
 			data->command = plist_copy(command);
+			data->command_name = NULL;
+			instproxy_command_get_name(command, &data->command_name);
 			data->cbfunc = status_cb;
 			data->user_data = user_data;
+			data->cancelled = 0;
+			data->idle_time = 0;
+			data->next = NULL;
 
-			if (thread_new(&client->receive_status_thread, instproxy_receive_status_loop_thread, data) == 0) {
+			instproxy_lock(client);
+			client->status_job = data;
+			instproxy_unlock(client);
+
+			if (instproxy_executor_submit(data) == 0) {
 				res = INSTPROXY_E_SUCCESS;
+			} else {
+				instproxy_lock(client);
+				client->status_job = NULL;
+				instproxy_unlock(client);
+				plist_free(data->command);
+				free(data->command_name);
+				free(data);
 			}
 		}
 	} else {
@@ -514,7 +707,7 @@ static instproxy_error_t instproxy_perform_command(instproxy_client_t client, pl
 		return INSTPROXY_E_INVALID_ARG;
 	}
 
-	if (client->receive_status_thread) {
+	if (client->status_job) {
 		return INSTPROXY_E_OP_IN_PROGRESS;
 	}
 
@@ -550,43 +743,147 @@ LIBIMOBILEDEVICE_API instproxy_error_t instproxy_browse_with_callback(instproxy_
 	return res;
 }
 
-static void instproxy_append_current_list_to_result_cb(plist_t command, plist_t status, void *user_data)
+struct instproxy_browse_pages_data {
+	instproxy_browse_page_cb_t page_cb;
+	void *user_data;
+	plist_t return_attributes;
+};
+
+/**
+ * Removes all items from an application dictionary that are not listed in
+ * the given array of attribute names.
+ */
+static void instproxy_app_project_attributes(plist_t app, plist_t return_attributes)
 {
-	plist_t *result_array = (plist_t*)user_data;
-	uint64_t current_amount = 0;
-	plist_t current_list = NULL;
-	uint64_t i;
+	uint32_t size = plist_dict_get_size(app);
+	char **remove_keys;
+	uint32_t num_remove = 0;
+	uint32_t i;
 
-	instproxy_status_get_current_list(status, NULL, NULL, &current_amount, &current_list);
+	if (size == 0)
+		return;
 
-	debug_info("current_amount: %d", current_amount);
+	remove_keys = (char**)malloc(sizeof(char*) * size);
+	if (!remove_keys)
+		return;
+
+	plist_dict_iter iter = NULL;
+	plist_dict_new_iter(app, &iter);
+	if (iter) {
+		char *key = NULL;
+		plist_t node = NULL;
+		do {
+			key = NULL;
+			node = NULL;
+			plist_dict_next_item(app, iter, &key, &node);
+			if (!key)
+				break;
 
-	if (current_amount > 0) {
-		for (i = 0; current_list && (i < current_amount); i++) {
-			plist_t item = plist_array_get_item(current_list, i);
-			plist_array_append_item(*result_array, plist_copy(item));
+			uint32_t count = plist_array_get_size(return_attributes);
+			uint32_t j;
+			int wanted = 0;
+			for (j = 0; j < count; j++) {
+				plist_t attr = plist_array_get_item(return_attributes, j);
+				if (plist_get_node_type(attr) == PLIST_STRING && plist_string_val_compare(attr, key) == 0) {
+					wanted = 1;
+					break;
+				}
+			}
+			if (!wanted && num_remove < size) {
+				remove_keys[num_remove++] = key;
+			} else {
+				free(key);
+			}
+		} while (node);
+		free(iter);
+	}
+
+	for (i = 0; i < num_remove; i++) {
+		plist_dict_remove_item(app, remove_keys[i]);
+		free(remove_keys[i]);
+	}
+	free(remove_keys);
+}
+
+static void instproxy_browse_pages_cb(plist_t command, plist_t status, void *user_data)
+{
+	struct instproxy_browse_pages_data *data = (struct instproxy_browse_pages_data*)user_data;
+	uint64_t total = 0;
+	uint64_t current_index = 0;
+
+	/* the status is freed after the callback, so the page can be handed out without copying */
+	plist_t current_list = plist_dict_get_item(status, "CurrentList");
+	if (!current_list || plist_get_node_type(current_list) != PLIST_ARRAY)
+		return;
+
+	instproxy_status_get_current_list(status, &total, &current_index, NULL, NULL);
+
+	if (data->return_attributes) {
+		uint32_t count = plist_array_get_size(current_list);
+		uint32_t i;
+		for (i = 0; i < count; i++) {
+			plist_t app = plist_array_get_item(current_list, i);
+			if (plist_get_node_type(app) == PLIST_DICT) {
+				instproxy_app_project_attributes(app, data->return_attributes);
+			}
 		}
 	}
 
-	if (current_list)
-		plist_free(current_list);
+	data->page_cb(current_list, current_index, total, data->user_data);
 }
 
-LIBIMOBILEDEVICE_API instproxy_error_t instproxy_browse(instproxy_client_t client, plist_t client_options, plist_t *result)
+LIBIMOBILEDEVICE_API instproxy_error_t instproxy_browse_pages(instproxy_client_t client, plist_t client_options, instproxy_browse_page_cb_t page_cb, void *user_data)
 {
-	if (!client || !client->parent || !result)
+	if (!client || !client->parent || !page_cb)
 		return INSTPROXY_E_INVALID_ARG;
 
 	instproxy_error_t res = INSTPROXY_E_UNKNOWN_ERROR;
+	struct instproxy_browse_pages_data data;
 
-	plist_t result_array = plist_new_array();
+	data.page_cb = page_cb;
+	data.user_data = user_data;
+	data.return_attributes = NULL;
 
 	plist_t command = plist_new_dict();
 	plist_dict_set_item(command, "Command", plist_new_string("Browse"));
-	if (client_options)
+	if (client_options) {
 		plist_dict_set_item(command, "ClientOptions", plist_copy(client_options));
+		plist_t attributes = plist_dict_get_item(client_options, "ReturnAttributes");
+		if (attributes && plist_get_node_type(attributes) == PLIST_ARRAY && plist_array_get_size(attributes) > 0) {
+			data.return_attributes = attributes;
+		}
+	}
+
+	res = instproxy_perform_command(client, command, INSTPROXY_COMMAND_TYPE_SYNC, instproxy_browse_pages_cb, (void*)&data);
+
+	plist_free(command);
+
+	return res;
+}
 
-	res = instproxy_perform_command(client, command, INSTPROXY_COMMAND_TYPE_SYNC, instproxy_append_current_list_to_result_cb, (void*)&result_array);
+static void instproxy_append_page_to_result_cb(plist_t page, uint64_t current_index, uint64_t total, void *user_data)
+{
+	plist_t result_array = (plist_t)user_data;
+	uint32_t count = plist_array_get_size(page);
+	uint32_t i;
+
+	debug_info("current_amount: %d", count);
+
+	for (i = 0; i < count; i++) {
+		plist_array_append_item(result_array, plist_copy(plist_array_get_item(page, i)));
+	}
+}
+
+LIBIMOBILEDEVICE_API instproxy_error_t instproxy_browse(instproxy_client_t client, plist_t client_options, plist_t *result)
+{
+	if (!client || !client->parent || !result)
+		return INSTPROXY_E_INVALID_ARG;
+
+	instproxy_error_t res = INSTPROXY_E_UNKNOWN_ERROR;
+
+	plist_t result_array = plist_new_array();
+
+	res = instproxy_browse_pages(client, client_options, instproxy_append_page_to_result_cb, (void*)result_array);
 
 	if (res == INSTPROXY_E_SUCCESS) {
 		*result = result_array;
@@ -594,8 +891,6 @@ LIBIMOBILEDEVICE_API instproxy_error_t instproxy_browse(instproxy_client_t clien
 		plist_free(result_array);
 	}
 
-	plist_free(command);
-
 	return res;
 }
 
@@ -982,6 +1277,20 @@ LIBIMOBILEDEVICE_API void instproxy_client_options_set_return_attributes(plist_t
 	plist_dict_set_item(client_options, "ReturnAttributes", return_attributes);
 }
 
+LIBIMOBILEDEVICE_API void instproxy_client_options_set_return_attributes_list(plist_t client_options, const char **attributes)
+{
+	if (!client_options || !attributes)
+		return;
+
+	plist_t return_attributes = plist_new_array();
+	int i;
+	for (i = 0; attributes[i]; i++) {
+		plist_array_append_item(return_attributes, plist_new_string(attributes[i]));
+	}
+
+	plist_dict_set_item(client_options, "ReturnAttributes", return_attributes);
+}
+
 LIBIMOBILEDEVICE_API void instproxy_client_options_free(plist_t client_options)
 {
 	if (client_options) {
@@ -30,7 +30,13 @@
 struct instproxy_client_private {
 	property_list_service_client_t parent;
 	mutex_t mutex;
-	THREAD_T receive_status_thread;
+	struct instproxy_status_data *status_job;
+	cond_t status_job_cond;
+};
+
+struct instproxy_app_cache_private {
+	mutex_t mutex;
+	plist_t devices;
 };
 
 #endif
@@ -0,0 +1,319 @@
+/*
+ * installation_proxy_cache.c
+ * Application list cache on top of the installation_proxy service.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <string.h>
+#include <stdlib.h>
+#include <plist/plist.h>
+
+#include "installation_proxy.h"
+#include "property_list_service.h"
+#include "service.h"
+#include "idevice.h"
+#include "common/debug.h"
+#include "common/utils.h"
+
+/*
+ * The cache is a dictionary keyed by UDID. Each device entry holds the
+ * client options the applications were fetched with and a dictionary keyed
+ * by bundle identifier with the fingerprint and full information of every
+ * application:
+ *
+ * <UDID> = {
+ *   Options = <client options as XML>
+ *   Apps = {
+ *     <CFBundleIdentifier> = { Fingerprint = <versions>, App = {...} }
+ *   }
+ * }
+ */
+
+/* attributes used to find out which applications changed since the last run */
+static const char *instproxy_app_cache_revalidate_attributes[] = {
+	"CFBundleIdentifier",
+	"CFBundleVersion",
+	"CFBundleShortVersionString",
+	NULL
+};
+
+LIBIMOBILEDEVICE_API instproxy_error_t instproxy_app_cache_new(instproxy_app_cache_t *cache)
+{
+	if (!cache)
+		return INSTPROXY_E_INVALID_ARG;
+
+	instproxy_app_cache_t cache_loc = (instproxy_app_cache_t)malloc(sizeof(struct instproxy_app_cache_private));
+	if (!cache_loc)
+		return INSTPROXY_E_UNKNOWN_ERROR;
+
+	mutex_init(&cache_loc->mutex);
+	cache_loc->devices = plist_new_dict();
+
+	*cache = cache_loc;
+
+	return INSTPROXY_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API instproxy_error_t instproxy_app_cache_free(instproxy_app_cache_t cache)
+{
+	if (!cache)
+		return INSTPROXY_E_INVALID_ARG;
+
+	plist_free(cache->devices);
+	mutex_destroy(&cache->mutex);
+	free(cache);
+
+	return INSTPROXY_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API instproxy_error_t instproxy_app_cache_load(instproxy_app_cache_t cache, const char *path)
+{
+	if (!cache || !path)
+		return INSTPROXY_E_INVALID_ARG;
+
+	plist_t devices = NULL;
+	if (!plist_read_from_filename(&devices, path) || plist_get_node_type(devices) != PLIST_DICT) {
+		debug_info("could not read application cache from %s", path);
+		plist_free(devices);
+		return INSTPROXY_E_UNKNOWN_ERROR;
+	}
+
+	mutex_lock(&cache->mutex);
+	plist_free(cache->devices);
+	cache->devices = devices;
+	mutex_unlock(&cache->mutex);
+
+	return INSTPROXY_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API instproxy_error_t instproxy_app_cache_save(instproxy_app_cache_t cache, const char *path)
+{
+	if (!cache || !path)
+		return INSTPROXY_E_INVALID_ARG;
+
+	mutex_lock(&cache->mutex);
+	int written = plist_write_to_filename(cache->devices, path, PLIST_FORMAT_BINARY);
+	mutex_unlock(&cache->mutex);
+
+	if (!written) {
+		debug_info("could not write application cache to %s", path);
+		return INSTPROXY_E_UNKNOWN_ERROR;
+	}
+
+	return INSTPROXY_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API instproxy_error_t instproxy_app_cache_invalidate(instproxy_app_cache_t cache, const char *udid)
+{
+	if (!cache)
+		return INSTPROXY_E_INVALID_ARG;
+
+	mutex_lock(&cache->mutex);
+	if (udid) {
+		plist_dict_remove_item(cache->devices, udid);
+	} else {
+		plist_free(cache->devices);
+		cache->devices = plist_new_dict();
+	}
+	mutex_unlock(&cache->mutex);
+
+	return INSTPROXY_E_SUCCESS;
+}
+
+/**
+ * Serializes the client options so they can be compared with the options
+ * a cache entry was created with.
+ */
+static char *instproxy_app_cache_options_string(plist_t client_options)
+{
+	char *xml = NULL;
+	uint32_t length = 0;
+	char *result = NULL;
+
+	if (!client_options)
+		return strdup("");
+
+	plist_to_xml(client_options, &xml, &length);
+	if (xml) {
+		result = strdup(xml);
+		plist_to_xml_free(xml);
+	}
+
+	return result;
+}
+
+static char *instproxy_app_cache_fingerprint(plist_t app)
+{
+	char *fingerprint = strdup("");
+	int i;
+
+	/* the bundle identifier is the key, not part of the fingerprint */
+	for (i = 1; instproxy_app_cache_revalidate_attributes[i]; i++) {
+		plist_t node = plist_dict_get_item(app, instproxy_app_cache_revalidate_attributes[i]);
+		char *val = NULL;
+		if (node && plist_get_node_type(node) == PLIST_STRING) {
+			plist_get_string_val(node, &val);
+		}
+		fingerprint = string_append(fingerprint, (val) ? val : "", "\n", NULL);
+		free(val);
+	}
+
+	return fingerprint;
+}
+
+static void instproxy_app_cache_collect_cb(plist_t page, uint64_t current_index, uint64_t total, void *user_data)
+{
+	plist_t apps = (plist_t)user_data;
+	uint32_t count = plist_array_get_size(page);
+	uint32_t i;
+
+	for (i = 0; i < count; i++) {
+		plist_t app = plist_array_get_item(page, i);
+		char *bundle_id = NULL;
+		plist_t node = plist_dict_get_item(app, "CFBundleIdentifier");
+		if (node && plist_get_node_type(node) == PLIST_STRING) {
+			plist_get_string_val(node, &bundle_id);
+		}
+		if (!bundle_id)
+			continue;
+
+		char *fingerprint = instproxy_app_cache_fingerprint(app);
+		plist_array_append_item(apps, plist_new_string(bundle_id));
+		plist_array_append_item(apps, plist_new_string(fingerprint));
+		free(fingerprint);
+		free(bundle_id);
+	}
+}
+
+LIBIMOBILEDEVICE_API instproxy_error_t instproxy_app_cache_browse(instproxy_app_cache_t cache, instproxy_client_t client, plist_t client_options, plist_t *result)
+{
+	if (!cache || !client || !client->parent || !result)
+		return INSTPROXY_E_INVALID_ARG;
+
+	instproxy_error_t res = INSTPROXY_E_UNKNOWN_ERROR;
+	const char *udid = client->parent->parent->connection->device->udid;
+	char *options = instproxy_app_cache_options_string(client_options);
+	plist_t entry = NULL;
+	plist_t current = plist_new_array();
+	plist_t apps = plist_new_dict();
+	plist_t lookup_result = NULL;
+	const char **changed = NULL;
+	uint32_t num_apps;
+	uint32_t num_changed = 0;
+	uint32_t i;
+
+	/* fetch only the attributes needed to tell which applications changed */
+	plist_t revalidate_options = (client_options) ? plist_copy(client_options) : instproxy_client_options_new();
+	instproxy_client_options_set_return_attributes_list(revalidate_options, instproxy_app_cache_revalidate_attributes);
+	res = instproxy_browse_pages(client, revalidate_options, instproxy_app_cache_collect_cb, (void*)current);
+	instproxy_client_options_free(revalidate_options);
+	if (res != INSTPROXY_E_SUCCESS) {
+		debug_info("could not revalidate application list, error %d", res);
+		goto leave;
+	}
+
+	num_apps = plist_array_get_size(current) / 2;
+
+	mutex_lock(&cache->mutex);
+	entry = plist_dict_get_item(cache->devices, udid);
+	if (entry) {
+		char *entry_options = NULL;
+		plist_t node = plist_dict_get_item(entry, "Options");
+		if (node && plist_get_node_type(node) == PLIST_STRING) {
+			plist_get_string_val(node, &entry_options);
+		}
+		if (!options || !entry_options || strcmp(options, entry_options) != 0) {
+			/* fetched with different options, can't be reused */
+			entry = NULL;
+		}
+		free(entry_options);
+	}
+	plist_t cached_apps = (entry) ? plist_dict_get_item(entry, "Apps") : NULL;
+
+	/* take over unchanged applications, remember the others */
+	changed = (const char**)malloc(sizeof(char*) * (num_apps + 1));
+	for (i = 0; i < num_apps; i++) {
+		plist_t id_node = plist_array_get_item(current, i * 2);
+		plist_t fp_node = plist_array_get_item(current, i * 2 + 1);
+		const char *bundle_id = plist_get_string_ptr(id_node, NULL);
+		plist_t cached = (cached_apps) ? plist_dict_get_item(cached_apps, bundle_id) : NULL;
+		plist_t cached_fp = (cached) ? plist_dict_get_item(cached, "Fingerprint") : NULL;
+		if (cached_fp && plist_get_node_type(cached_fp) == PLIST_STRING && plist_string_val_compare(cached_fp, plist_get_string_ptr(fp_node, NULL)) == 0 && plist_dict_get_item(cached, "App")) {
+			plist_dict_set_item(apps, bundle_id, plist_copy(cached));
+		} else {
+			changed[num_changed++] = bundle_id;
+		}
+	}
+	changed[num_changed] = NULL;
+	mutex_unlock(&cache->mutex);
+
+	debug_info("%u of %u applications changed on device %s", num_changed, num_apps, udid);
+
+	/* fetch full information only for new or changed applications */
+	if (num_changed > 0) {
+		res = instproxy_lookup(client, changed, client_options, &lookup_result);
+		if (res != INSTPROXY_E_SUCCESS) {
+			debug_info("could not look up changed applications, error %d", res);
+			goto leave;
+		}
+		for (i = 0; i < num_apps; i++) {
+			const char *bundle_id = plist_get_string_ptr(plist_array_get_item(current, i * 2), NULL);
+			if (plist_dict_get_item(apps, bundle_id))
+				continue;
+			plist_t app = (lookup_result) ? plist_dict_get_item(lookup_result, bundle_id) : NULL;
+			if (!app)
+				continue;
+			plist_t item = plist_new_dict();
+			plist_dict_set_item(item, "Fingerprint", plist_copy(plist_array_get_item(current, i * 2 + 1)));
+			plist_dict_set_item(item, "App", plist_copy(app));
+			plist_dict_set_item(apps, bundle_id, item);
+		}
+	}
+
+	/* return the applications in the order the device listed them */
+	plist_t result_array = plist_new_array();
+	for (i = 0; i < num_apps; i++) {
+		const char *bundle_id = plist_get_string_ptr(plist_array_get_item(current, i * 2), NULL);
+		plist_t item = plist_dict_get_item(apps, bundle_id);
+		if (item) {
+			plist_array_append_item(result_array, plist_copy(plist_dict_get_item(item, "App")));
+		}
+	}
+	*result = result_array;
+
+	/* store the new state, applications that were removed are dropped */
+	entry = plist_new_dict();
+	plist_dict_set_item(entry, "Options", plist_new_string((options) ? options : ""));
+	plist_dict_set_item(entry, "Apps", apps);
+	apps = NULL;
+	mutex_lock(&cache->mutex);
+	plist_dict_set_item(cache->devices, udid, entry);
+	mutex_unlock(&cache->mutex);
+
+	res = INSTPROXY_E_SUCCESS;
+
+leave:
+	free(changed);
+	plist_free(lookup_result);
+	plist_free(apps);
+	plist_free(current);
+	free(options);
+
+	return res;
+}
@@ -41,6 +41,9 @@
 #include "common/debug.h"
 #include "common/userpref.h"
 #include "common/utils.h"
+#include "common/probes.h"
+#include "common/thread.h"
+#include "common/strmap.h"
 #include "asprintf.h"
 
 #ifdef WIN32
@@ -87,6 +90,7 @@ static struct st_lockdownd_error_str_map lockdownd_error_str_map[] = {
 	{ "MCChallengeRequired", "MC challenge required", LOCKDOWN_E_MC_CHALLENGE_REQUIRED },
 	{ NULL, NULL, 0 }
 };
+static strmap_t lockdownd_error_name_map = STRMAP_INIT(lockdownd_error_str_map);
 
 /**
  * Convert an error string identifier to a lockdownd_error_t value.
@@ -99,15 +103,8 @@ static struct st_lockdownd_error_str_map lockdownd_error_str_map[] = {
  */
 static lockdownd_error_t lockdownd_strtoerr(const char* name)
 {
-	lockdownd_error_t err = LOCKDOWN_E_UNKNOWN_ERROR;
-	int i = 0;
-	while (lockdownd_error_str_map[i].lockdown_errstr) {
-		if (strcmp(lockdownd_error_str_map[i].lockdown_errstr, name) == 0) {
-			return lockdownd_error_str_map[i].errcode;
-		}
-		i++;
-	}
-	return err;
+	int i = strmap_find(&lockdownd_error_name_map, name);
+	return (i < 0) ? LOCKDOWN_E_UNKNOWN_ERROR : lockdownd_error_str_map[i].errcode;
 }
 
 /**
@@ -411,16 +408,12 @@ LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_query_type(lockdownd_client_t c
 	return ret;
 }
 
-LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_get_value(lockdownd_client_t client, const char *domain, const char *key, plist_t *value)
+/**
+ * Creates a GetValue request for the given domain and key.
+ */
+static plist_t lockdownd_get_value_request_new(lockdownd_client_t client, const char *domain, const char *key)
 {
-	if (!client)
-		return LOCKDOWN_E_INVALID_ARG;
-
-	plist_t dict = NULL;
-	lockdownd_error_t ret = LOCKDOWN_E_UNKNOWN_ERROR;
-
-	/* setup request plist */
-	dict = plist_new_dict();
+	plist_t dict = plist_new_dict();
 	plist_dict_add_label(dict, client->label);
 	if (domain) {
 		plist_dict_set_item(dict,"Domain", plist_new_string(domain));
@@ -429,6 +422,26 @@ LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_get_value(lockdownd_client_t cl
 		plist_dict_set_item(dict,"Key", plist_new_string(key));
 	}
 	plist_dict_set_item(dict,"Request", plist_new_string("GetValue"));
+	return dict;
+}
+
+LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_get_value(lockdownd_client_t client, const char *domain, const char *key, plist_t *value)
+{
+	if (!client)
+		return LOCKDOWN_E_INVALID_ARG;
+
+	plist_t dict = NULL;
+	lockdownd_error_t ret = LOCKDOWN_E_UNKNOWN_ERROR;
+
+	dict = idevice_value_cache_get(client->device, domain, key);
+	if (dict) {
+		debug_info("using cached value for %s", key);
+		*value = dict;
+		return LOCKDOWN_E_SUCCESS;
+	}
+
+	/* setup request plist */
+	dict = lockdownd_get_value_request_new(client, domain, key);
 
 	/* send to device */
 	ret = lockdownd_send(client, dict);
@@ -459,12 +472,123 @@ LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_get_value(lockdownd_client_t cl
 	if (value_node) {
 		debug_info("has a value");
 		*value = plist_copy(value_node);
+		idevice_value_cache_set(client->device, domain, key, value_node);
 	}
 
 	plist_free(dict);
 	return ret;
 }
 
+/**
+ * Stores a value returned for a GetValue request in the result dictionary
+ * of lockdownd_get_values(). Values of the global domain go into the top
+ * level, values of other domains into a dictionary named after the domain.
+ * A value requested without a key is merged into the respective level.
+ */
+static void lockdownd_get_values_store(plist_t result, const char *domain, const char *key, plist_t value)
+{
+	plist_t target = result;
+
+	if (domain) {
+		target = plist_dict_get_item(result, domain);
+		if (!target || plist_get_node_type(target) != PLIST_DICT) {
+			target = plist_new_dict();
+			plist_dict_set_item(result, domain, target);
+		}
+	}
+
+	if (key) {
+		plist_dict_set_item(target, key, plist_copy(value));
+	} else if (plist_get_node_type(value) == PLIST_DICT) {
+		plist_dict_merge(&target, value);
+	}
+}
+
+struct lockdownd_get_values_request {
+	lockdownd_client_t client;
+	plist_t result;
+	const char *domain;
+	const char *key;
+};
+
+static void lockdownd_get_values_response_cb(plist_t response, void *user_data)
+{
+	struct lockdownd_get_values_request *req = (struct lockdownd_get_values_request*)user_data;
+
+	lockdownd_error_t res = lockdown_check_result(response, "GetValue");
+	if (res == LOCKDOWN_E_SUCCESS) {
+		plist_t value_node = plist_dict_get_item(response, "Value");
+		if (value_node) {
+			lockdownd_get_values_store(req->result, req->domain, req->key, value_node);
+			idevice_value_cache_set(req->client->device, req->domain, req->key, value_node);
+		}
+	} else {
+		debug_info("GetValue for domain %s key %s failed: %d", req->domain ? req->domain : "(global)", req->key ? req->key : "(all)", res);
+	}
+}
+
+LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_get_values(lockdownd_client_t client, const char **domains, const char **keys, unsigned int count, plist_t *values)
+{
+	if (!client || !values || (count > 0 && (!domains || !keys)))
+		return LOCKDOWN_E_INVALID_ARG;
+
+	lockdownd_error_t ret = LOCKDOWN_E_SUCCESS;
+	plist_t result = plist_new_dict();
+	property_list_service_request_t *requests = NULL;
+	struct lockdownd_get_values_request *contexts = NULL;
+	unsigned int num_pending = 0;
+	unsigned int i;
+
+	if (count > 0) {
+		requests = (property_list_service_request_t*)malloc(sizeof(property_list_service_request_t) * count);
+		contexts = (struct lockdownd_get_values_request*)malloc(sizeof(struct lockdownd_get_values_request) * count);
+		if (!requests || !contexts) {
+			free(requests);
+			free(contexts);
+			plist_free(result);
+			return LOCKDOWN_E_UNKNOWN_ERROR;
+		}
+	}
+
+	/* values from the cache of the device don't need a request */
+	for (i = 0; i < count; i++) {
+		plist_t cached = idevice_value_cache_get(client->device, domains[i], keys[i]);
+		if (cached) {
+			lockdownd_get_values_store(result, domains[i], keys[i], cached);
+			plist_free(cached);
+			continue;
+		}
+		contexts[num_pending].client = client;
+		contexts[num_pending].result = result;
+		contexts[num_pending].domain = domains[i];
+		contexts[num_pending].key = keys[i];
+		requests[num_pending].request = lockdownd_get_value_request_new(client, domains[i], keys[i]);
+		requests[num_pending].callback = lockdownd_get_values_response_cb;
+		requests[num_pending].user_data = &contexts[num_pending];
+		num_pending++;
+	}
+
+	if (num_pending > 0) {
+		ret = lockdownd_error(property_list_service_send_receive_pipelined(client->parent, requests, num_pending, 0, 0, 30000));
+	}
+
+	for (i = 0; i < num_pending; i++) {
+		plist_free(requests[i].request);
+	}
+	free(requests);
+	free(contexts);
+
+	if (ret != LOCKDOWN_E_SUCCESS) {
+		/* responses to requests still in flight can't be matched anymore */
+		plist_free(result);
+		return ret;
+	}
+
+	*values = result;
+
+	return LOCKDOWN_E_SUCCESS;
+}
+
 LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_set_value(lockdownd_client_t client, const char *domain, const char *key, plist_t value)
 {
 	if (!client || !value)
@@ -483,6 +607,11 @@ LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_set_value(lockdownd_client_t cl
 		plist_dict_set_item(dict,"Key", plist_new_string(key));
 	}
 	plist_dict_set_item(dict,"Request", plist_new_string("SetValue"));
+
+	/* the cached value is outdated regardless of the outcome */
+	if (!domain) {
+		idevice_value_cache_invalidate(client->device, key);
+	}
 	plist_dict_set_item(dict,"Value", value);
 
 	/* send to device */
@@ -532,6 +661,11 @@ LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_remove_value(lockdownd_client_t
 	}
 	plist_dict_set_item(dict,"Request", plist_new_string("RemoveValue"));
 
+	/* the cached value is outdated regardless of the outcome */
+	if (!domain) {
+		idevice_value_cache_invalidate(client->device, key);
+	}
+
 	/* send to device */
 	ret = lockdownd_send(client, dict);
 
@@ -644,6 +778,8 @@ LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_client_new(idevice_t device, lo
 	client_loc->ssl_enabled = 0;
 	client_loc->session_id = NULL;
 	client_loc->mux_id = device->mux_id;
+	client_loc->shared = 0;
+	client_loc->device = device;
 
 	if (idevice_get_udid(device, &client_loc->udid) != IDEVICE_E_SUCCESS) {
 		debug_info("failed to get device udid.");
@@ -674,14 +810,25 @@ LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_client_new_with_handshake(idevi
 		return ret;
 	}
 
+	/* QueryType and the version don't change while the device is connected,
+	 * so after a successful handshake we go straight to StartSession */
+	int fast_path = (device->handshake_validated && device->version != 0);
+	int validated = 0;
+
 	/* perform handshake */
-	ret = lockdownd_query_type(client_loc, &type);
-	if (LOCKDOWN_E_SUCCESS != ret) {
-		debug_info("QueryType failed in the lockdownd client.");
-	} else if (strcmp("com.apple.mobile.lockdown", type)) {
-		debug_info("Warning QueryType request returned \"%s\".", type);
+	if (fast_path) {
+		debug_info("Skipping QueryType, already validated for this device.");
+	} else {
+		ret = lockdownd_query_type(client_loc, &type);
+		if (LOCKDOWN_E_SUCCESS != ret) {
+			debug_info("QueryType failed in the lockdownd client.");
+		} else if (strcmp("com.apple.mobile.lockdown", type)) {
+			debug_info("Warning QueryType request returned \"%s\".", type);
+		} else {
+			validated = 1;
+		}
+		free(type);
 	}
-	free(type);
 
 	if (device->version == 0) {
 		plist_t p_version = NULL;
@@ -744,6 +891,14 @@ LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_client_new_with_handshake(idevi
 
 	}
 
+	if (LOCKDOWN_E_SUCCESS == ret) {
+		if (validated && device->version != 0)
+			device->handshake_validated = 1;
+	} else {
+		/* do the full handshake again next time */
+		device->handshake_validated = 0;
+	}
+
 	if (LOCKDOWN_E_SUCCESS == ret) {
 		*client = client_loc;
 	} else {
@@ -753,6 +908,242 @@ LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_client_new_with_handshake(idevi
 	return ret;
 }
 
+struct lockdownd_handshake_task {
+	lockdownd_handshake_entry_t *entry;
+	const char *label;
+};
+
+static void* lockdownd_handshake_task_func(void *data)
+{
+	struct lockdownd_handshake_task *task = (struct lockdownd_handshake_task*)data;
+	task->entry->error = lockdownd_client_new_with_handshake(task->entry->device, &task->entry->client, task->label);
+	return NULL;
+}
+
+LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_client_new_with_handshake_multi(lockdownd_handshake_entry_t *entries, unsigned int count, const char *label, unsigned int max_parallel)
+{
+	unsigned int i;
+
+	if (!entries || count == 0)
+		return LOCKDOWN_E_INVALID_ARG;
+
+	for (i = 0; i < count; i++) {
+		entries[i].client = NULL;
+		entries[i].error = (entries[i].device) ? LOCKDOWN_E_UNKNOWN_ERROR : LOCKDOWN_E_INVALID_ARG;
+	}
+
+	if (max_parallel == 0 || max_parallel > count)
+		max_parallel = count;
+
+	/* resolve the lazily initialized config dir before the threads use it */
+	userpref_get_config_dir();
+
+	struct lockdownd_handshake_task *tasks = (struct lockdownd_handshake_task*)calloc(count, sizeof(struct lockdownd_handshake_task));
+	thread_task_t *handles = (thread_task_t*)calloc(count, sizeof(thread_task_t));
+	/* the handshakes mostly wait for the devices, so the pool is sized by
+	 * the number of devices instead of the number of CPUs */
+	thread_pool_t pool = (tasks && handles && max_parallel > 1) ? thread_pool_new(max_parallel) : NULL;
+
+	for (i = 0; i < count; i++) {
+		if (!entries[i].device)
+			continue;
+		if (!tasks) {
+			entries[i].error = lockdownd_client_new_with_handshake(entries[i].device, &entries[i].client, label);
+			continue;
+		}
+		tasks[i].entry = &entries[i];
+		tasks[i].label = label;
+		if (pool)
+			handles[i] = thread_pool_submit(pool, lockdownd_handshake_task_func, &tasks[i]);
+		if (!handles || !handles[i])
+			lockdownd_handshake_task_func(&tasks[i]);
+	}
+
+	if (pool) {
+		for (i = 0; i < count; i++) {
+			if (handles[i])
+				thread_task_wait(pool, handles[i]);
+		}
+		thread_pool_free(pool);
+	}
+	free(handles);
+	free(tasks);
+
+	lockdownd_error_t ret = LOCKDOWN_E_SUCCESS;
+	unsigned int failed = 0;
+	for (i = 0; i < count; i++) {
+		if (entries[i].error != LOCKDOWN_E_SUCCESS) {
+			if (failed++ == 0)
+				ret = entries[i].error;
+		}
+	}
+	if (failed > 0) {
+		debug_info("handshake failed for %u of %u devices", failed, count);
+	}
+
+	return ret;
+}
+
+LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_set_session_reuse(idevice_t device, int enable)
+{
+	if (!device)
+		return LOCKDOWN_E_INVALID_ARG;
+
+	mutex_lock(&device->lockdown_mutex);
+	device->lockdown_reuse = enable;
+	if (!enable && device->lockdown_session) {
+		lockdownd_client_free(device->lockdown_session);
+		device->lockdown_session = NULL;
+	}
+	mutex_unlock(&device->lockdown_mutex);
+
+	return LOCKDOWN_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_set_value_cache(idevice_t device, int enable)
+{
+	if (!device)
+		return LOCKDOWN_E_INVALID_ARG;
+
+	idevice_value_cache_enable(device, enable);
+
+	return LOCKDOWN_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_invalidate_value_cache(idevice_t device, const char *key)
+{
+	if (!device)
+		return LOCKDOWN_E_INVALID_ARG;
+
+	idevice_value_cache_invalidate(device, key);
+
+	return LOCKDOWN_E_SUCCESS;
+}
+
+/**
+ * Gets a lockdown client with an established session for the given device.
+ * If session reuse is enabled for the device, the cached session is handed
+ * out and exclusively owned by the caller until it is passed back with
+ * lockdownd_client_release(). Otherwise a new client is created.
+ *
+ * @param device The device to get a lockdown client for
+ * @param client Pointer that will be set to the lockdown client
+ * @param label The label to use for a newly created client
+ *
+ * @return LOCKDOWN_E_SUCCESS on success or an error code from
+ *     lockdownd_client_new_with_handshake() otherwise.
+ */
+lockdownd_error_t lockdownd_client_borrow(idevice_t device, lockdownd_client_t *client, const char *label)
+{
+	lockdownd_error_t ret = LOCKDOWN_E_SUCCESS;
+
+	if (!device || !client)
+		return LOCKDOWN_E_INVALID_ARG;
+
+	mutex_lock(&device->lockdown_mutex);
+	if (!device->lockdown_reuse) {
+		mutex_unlock(&device->lockdown_mutex);
+		return lockdownd_client_new_with_handshake(device, client, label);
+	}
+
+	if (!device->lockdown_session) {
+		ret = lockdownd_client_new_with_handshake(device, &device->lockdown_session, label);
+		if (ret != LOCKDOWN_E_SUCCESS) {
+			device->lockdown_session = NULL;
+			mutex_unlock(&device->lockdown_mutex);
+			return ret;
+		}
+		device->lockdown_session->shared = 1;
+	} else {
+		debug_info("reusing lockdown session %s", device->lockdown_session->session_id);
+	}
+
+	/* the lock is held until the session is released */
+	*client = device->lockdown_session;
+
+	return ret;
+}
+
+/**
+ * Passes back a lockdown client obtained with lockdownd_client_borrow().
+ *
+ * @param device The device the client was obtained for
+ * @param client The lockdown client
+ * @param discard Non-zero if the session is not usable anymore, e.g. after
+ *     a communication error, so a cached session will not be reused.
+ */
+void lockdownd_client_release(idevice_t device, lockdownd_client_t client, int discard)
+{
+	if (!device || !client)
+		return;
+
+	if (!client->shared) {
+		lockdownd_client_free(client);
+		return;
+	}
+
+	if (discard) {
+		debug_info("discarding cached lockdown session");
+		lockdownd_client_free(client);
+		device->lockdown_session = NULL;
+	}
+	mutex_unlock(&device->lockdown_mutex);
+}
+
+/**
+ * Checks if an error indicates that the connection of a lockdown session is
+ * broken, as opposed to an error reported by lockdownd.
+ */
+static int lockdownd_is_connection_error(lockdownd_error_t err)
+{
+	switch (err) {
+		case LOCKDOWN_E_MUX_ERROR:
+		case LOCKDOWN_E_SSL_ERROR:
+		case LOCKDOWN_E_RECEIVE_TIMEOUT:
+		case LOCKDOWN_E_PLIST_ERROR:
+			return 1;
+		default:
+			break;
+	}
+	return 0;
+}
+
+/**
+ * Starts a service over a borrowed lockdown session. If a reused session
+ * turns out to be stale it is replaced and the request is tried once more.
+ *
+ * @param device The device to start the service on
+ * @param label The label to use for a newly created lockdown client
+ * @param identifier The identifier of the service to start
+ * @param service The service descriptor on success or NULL on failure
+ *
+ * @return LOCKDOWN_E_SUCCESS on success or an error code otherwise.
+ */
+lockdownd_error_t lockdownd_start_service_with_shared_session(idevice_t device, const char *label, const char *identifier, lockdownd_service_descriptor_t *service)
+{
+	lockdownd_client_t lckd = NULL;
+	int attempt;
+	lockdownd_error_t ret = LOCKDOWN_E_UNKNOWN_ERROR;
+
+	for (attempt = 0; attempt < 2; attempt++) {
+		ret = lockdownd_client_borrow(device, &lckd, label);
+		if (ret != LOCKDOWN_E_SUCCESS) {
+			debug_info("Could not create a lockdown client.");
+			return ret;
+		}
+		int shared = lckd->shared;
+		ret = lockdownd_start_service(lckd, identifier, service);
+		int broken = lockdownd_is_connection_error(ret);
+		lockdownd_client_release(device, lckd, broken);
+		if (!shared || !broken) {
+			break;
+		}
+		debug_info("Cached lockdown session is stale, retrying with a new one.");
+	}
+
+	return ret;
+}
+
 /**
  * Returns a new plist from the supplied lockdownd pair record. The caller is
  * responsible for freeing the plist.
@@ -805,6 +1196,7 @@ static lockdownd_error_t pair_record_generate(lockdownd_client_t client, plist_t
 	*pair_record = plist_new_dict();
 
 	/* generate keys and certificates into pair record */
+	idevice_ssl_init();
 	userpref_error_t uret = USERPREF_E_SUCCESS;
 	uret = pair_record_generate_keys_and_certs(*pair_record, public_key);
 	switch(uret) {
@@ -1047,6 +1439,16 @@ LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_unpair(lockdownd_client_t clien
 	return lockdownd_do_pair(client, pair_record, "Unpair", NULL, NULL);
 }
 
+LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_set_pairing_key_pool(unsigned int size, const char *filename)
+{
+	/* the pool generates keys in the background */
+	idevice_ssl_init();
+	if (userpref_set_key_pool(size, filename) != USERPREF_E_SUCCESS) {
+		return LOCKDOWN_E_UNKNOWN_ERROR;
+	}
+	return LOCKDOWN_E_SUCCESS;
+}
+
 LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_enter_recovery(lockdownd_client_t client)
 {
 	if (!client)
@@ -1280,10 +1682,12 @@ static lockdownd_error_t lockdownd_do_start_service(lockdownd_client_t client, c
 	uint16_t port_loc = 0;
 	lockdownd_error_t ret = LOCKDOWN_E_UNKNOWN_ERROR;
 
+	PROBE2(lockdown__start__service__start, client->udid, identifier);
+
 	/* create StartService request */
 	ret = lockdownd_build_start_service_request(client, identifier, send_escrow_bag, &dict);
 	if (LOCKDOWN_E_SUCCESS != ret)
-		return ret;
+		goto leave;
 
 	/* send to device */
 	ret = lockdownd_send(client, dict);
@@ -1291,15 +1695,17 @@ static lockdownd_error_t lockdownd_do_start_service(lockdownd_client_t client, c
 	dict = NULL;
 
 	if (LOCKDOWN_E_SUCCESS != ret)
-		return ret;
+		goto leave;
 
 	ret = lockdownd_receive(client, &dict);
 
 	if (LOCKDOWN_E_SUCCESS != ret)
-		return ret;
+		goto leave;
 
-	if (!dict)
-		return LOCKDOWN_E_PLIST_ERROR;
+	if (!dict) {
+		ret = LOCKDOWN_E_PLIST_ERROR;
+		goto leave;
+	}
 
 	ret = lockdown_check_result(dict, "StartService");
 	if (ret == LOCKDOWN_E_SUCCESS) {
@@ -1343,6 +1749,8 @@ static lockdownd_error_t lockdownd_do_start_service(lockdownd_client_t client, c
 	plist_free(dict);
 	dict = NULL;
 
+leave:
+	PROBE4(lockdown__start__service__done, client->udid, identifier, (*service) ? (*service)->port : 0, ret);
 	return ret;
 }
 
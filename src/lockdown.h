@@ -35,6 +35,12 @@ struct lockdownd_client_private {
 	char *udid;
 	char *label;
 	uint32_t mux_id;
+	int shared;
+	idevice_t device;
 };
 
+lockdownd_error_t lockdownd_client_borrow(idevice_t device, lockdownd_client_t *client, const char *label);
+void lockdownd_client_release(idevice_t device, lockdownd_client_t client, int discard);
+lockdownd_error_t lockdownd_start_service_with_shared_session(idevice_t device, const char *label, const char *identifier, lockdownd_service_descriptor_t *service);
+
 #endif
@@ -31,6 +31,7 @@
 #include "misagent.h"
 #include "property_list_service.h"
 #include "common/debug.h"
+#include "common/utils.h"
 
 /**
  * Convert a property_list_service_error_t value to a misagent_error_t
@@ -289,3 +290,232 @@ LIBIMOBILEDEVICE_API int misagent_get_status_code(misagent_client_t client)
 	}
 	return client->last_error;
 }
+
+/**
+ * Finds the value of a string key in the XML plist that is embedded
+ * unencrypted in the CMS envelope of a provisioning profile.
+ *
+ * @return A newly allocated string or NULL if the key was not found.
+ */
+static char *misagent_profile_get_string(const char *data, uint64_t length, const char *key)
+{
+	char pattern[64];
+	const char *end = data + length;
+
+	snprintf(pattern, sizeof(pattern), "<key>%s</key>", key);
+	size_t plen = strlen(pattern);
+	const char *p = data;
+	while (p + plen <= end) {
+		const char *found = (const char*)memchr(p, '<', end - p);
+		if (!found || found + plen > end)
+			return NULL;
+		if (memcmp(found, pattern, plen) != 0) {
+			p = found + 1;
+			continue;
+		}
+		p = found + plen;
+		while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+			p++;
+		if (p + 8 > end || memcmp(p, "<string>", 8) != 0)
+			return NULL;
+		p += 8;
+		const char *value_end = (const char*)memchr(p, '<', end - p);
+		if (!value_end)
+			return NULL;
+		char *value = (char*)malloc(value_end - p + 1);
+		if (!value)
+			return NULL;
+		memcpy(value, p, value_end - p);
+		value[value_end - p] = '\0';
+		return value;
+	}
+	return NULL;
+}
+
+struct misagent_sync_request {
+	misagent_client_t client;
+	unsigned int *done;
+	const char *uuid;
+	int is_install;
+	misagent_error_t result;
+};
+
+static void misagent_sync_response_cb(plist_t response, void *user_data)
+{
+	struct misagent_sync_request *req = (struct misagent_sync_request*)user_data;
+	int status = 0;
+
+	req->result = misagent_check_result(response, &status);
+	if (req->result == MISAGENT_E_SUCCESS) {
+		(*req->done)++;
+	} else {
+		debug_info("could not %s profile %s, status 0x%x", (req->is_install) ? "install" : "remove", req->uuid, status);
+		if (req->client->last_error == 0)
+			req->client->last_error = status;
+	}
+}
+
+LIBIMOBILEDEVICE_API misagent_error_t misagent_sync(misagent_client_t client, plist_t profiles, int remove_unlisted, unsigned int *installed, unsigned int *removed)
+{
+	if (!client || !client->parent || !profiles || plist_get_node_type(profiles) != PLIST_DICT)
+		return MISAGENT_E_INVALID_ARG;
+
+	unsigned int installed_loc = 0;
+	unsigned int removed_loc = 0;
+	if (installed)
+		*installed = 0;
+	if (removed)
+		*removed = 0;
+
+	/* one request for the UUIDs of everything that is installed */
+	plist_t current = NULL;
+	misagent_error_t res = misagent_copy_all(client, &current);
+	if (res == MISAGENT_E_REQUEST_FAILED) {
+		/* CopyAll is not supported before iOS 9.3 */
+		res = misagent_copy(client, &current);
+	}
+	if (res != MISAGENT_E_SUCCESS)
+		return res;
+
+	plist_t current_uuids = plist_new_dict();
+	uint32_t i;
+	uint32_t count = (plist_get_node_type(current) == PLIST_ARRAY) ? plist_array_get_size(current) : 0;
+	for (i = 0; i < count; i++) {
+		plist_t node = plist_array_get_item(current, i);
+		char *data = NULL;
+		uint64_t length = 0;
+		if (plist_get_node_type(node) != PLIST_DATA)
+			continue;
+		plist_get_data_val(node, &data, &length);
+		char *uuid = (data) ? misagent_profile_get_string(data, length, "UUID") : NULL;
+		if (uuid) {
+			plist_dict_set_item(current_uuids, uuid, plist_new_bool(1));
+		} else {
+			debug_info("could not find the UUID of installed profile %u", i);
+		}
+		free(uuid);
+		free(data);
+	}
+	plist_free(current);
+
+	/* work out the difference */
+	uint32_t max_requests = plist_dict_get_size(profiles) + plist_dict_get_size(current_uuids);
+	property_list_service_request_t *requests = (property_list_service_request_t*)calloc(max_requests ? max_requests : 1, sizeof(property_list_service_request_t));
+	struct misagent_sync_request *contexts = (struct misagent_sync_request*)calloc(max_requests ? max_requests : 1, sizeof(struct misagent_sync_request));
+	if (!requests || !contexts) {
+		free(requests);
+		free(contexts);
+		plist_free(current_uuids);
+		return MISAGENT_E_UNKNOWN_ERROR;
+	}
+	unsigned int nreq = 0;
+
+	plist_dict_iter iter = NULL;
+	plist_dict_new_iter(profiles, &iter);
+	char *key = NULL;
+	plist_t value = NULL;
+	do {
+		key = NULL;
+		value = NULL;
+		plist_dict_next_item(profiles, iter, &key, &value);
+		if (!key)
+			break;
+		if (plist_dict_get_item(current_uuids, key)) {
+			debug_info("profile %s is already installed", key);
+			free(key);
+			continue;
+		}
+
+		plist_t profile = NULL;
+		if (plist_get_node_type(value) == PLIST_DATA) {
+			profile = plist_copy(value);
+		} else if (plist_get_node_type(value) == PLIST_STRING) {
+			/* only read the files that actually have to be installed */
+			char *path = NULL;
+			char *data = NULL;
+			uint64_t length = 0;
+			plist_get_string_val(value, &path);
+			if (path)
+				buffer_read_from_filename(path, &data, &length);
+			if (data && length > 0)
+				profile = plist_new_data(data, length);
+			else
+				debug_info("could not read profile %s from %s", key, path);
+			free(data);
+			free(path);
+		}
+		if (!profile) {
+			free(key);
+			res = MISAGENT_E_INVALID_ARG;
+			break;
+		}
+
+		plist_t dict = plist_new_dict();
+		plist_dict_set_item(dict, "MessageType", plist_new_string("Install"));
+		plist_dict_set_item(dict, "Profile", profile);
+		plist_dict_set_item(dict, "ProfileType", plist_new_string("Provisioning"));
+		contexts[nreq].uuid = key;
+		contexts[nreq].is_install = 1;
+		contexts[nreq].done = &installed_loc;
+		requests[nreq].request = dict;
+		nreq++;
+	} while (1);
+	free(iter);
+
+	if (res == MISAGENT_E_SUCCESS && remove_unlisted) {
+		iter = NULL;
+		plist_dict_new_iter(current_uuids, &iter);
+		do {
+			key = NULL;
+			plist_dict_next_item(current_uuids, iter, &key, NULL);
+			if (!key)
+				break;
+			if (plist_dict_get_item(profiles, key)) {
+				free(key);
+				continue;
+			}
+			plist_t dict = plist_new_dict();
+			plist_dict_set_item(dict, "MessageType", plist_new_string("Remove"));
+			plist_dict_set_item(dict, "ProfileID", plist_new_string(key));
+			plist_dict_set_item(dict, "ProfileType", plist_new_string("Provisioning"));
+			contexts[nreq].uuid = key;
+			contexts[nreq].is_install = 0;
+			contexts[nreq].done = &removed_loc;
+			requests[nreq].request = dict;
+			nreq++;
+		} while (1);
+		free(iter);
+	}
+	plist_free(current_uuids);
+
+	/* only the needed requests, without waiting for each response */
+	client->last_error = 0;
+	for (i = 0; i < nreq; i++) {
+		contexts[i].client = client;
+		contexts[i].result = MISAGENT_E_UNKNOWN_ERROR;
+		requests[i].callback = misagent_sync_response_cb;
+		requests[i].user_data = &contexts[i];
+	}
+	if (res == MISAGENT_E_SUCCESS && nreq > 0) {
+		debug_info("sending %u install and remove requests", nreq);
+		res = misagent_error(property_list_service_send_receive_pipelined(client->parent, requests, nreq, 0, 0, 30000));
+		for (i = 0; i < nreq && res == MISAGENT_E_SUCCESS; i++) {
+			if (contexts[i].result != MISAGENT_E_SUCCESS)
+				res = contexts[i].result;
+		}
+	}
+
+	for (i = 0; i < nreq; i++) {
+		plist_free(requests[i].request);
+		free((char*)contexts[i].uuid);
+	}
+	free(requests);
+	free(contexts);
+
+	if (installed)
+		*installed = installed_loc;
+	if (removed)
+		*removed = removed_loc;
+
+	return res;
+}
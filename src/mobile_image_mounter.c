@@ -25,11 +25,29 @@
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#define HAVE_MMAP 1
+#endif
 #include <plist/plist.h>
 
 #include "mobile_image_mounter.h"
 #include "property_list_service.h"
 #include "common/debug.h"
+#include "common/utils.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+/* path of an image uploaded with ReceiveBytes, passed to MountImage */
+#define MOBILE_IMAGE_MOUNTER_STAGING_PATH "/private/var/mobile/Media/PublicStaging/staging.dimage"
+
+/* image data sent with a single write by the file based upload functions */
+#define MOBILE_IMAGE_MOUNTER_SEND_CHUNK_SIZE (8 * 1024 * 1024)
 
 /**
  * Locks a mobile_image_mounter client, used for thread safety.
@@ -144,16 +162,12 @@ leave_unlock:
 	return res;
 }
 
-static mobile_image_mounter_error_t process_result(plist_t result, const char *expected_status)
+static mobile_image_mounter_error_t process_result(struct property_list_message *result, const char *expected_status)
 {
 	mobile_image_mounter_error_t res = MOBILE_IMAGE_MOUNTER_E_COMMAND_FAILED;
 	char* strval = NULL;
-	plist_t node;
 
-	node = plist_dict_get_item(result, "Error");
-	if (node && plist_get_node_type(node) == PLIST_STRING) {
-		plist_get_string_val(node, &strval);
-	}
+	property_list_message_get_string(result, "Error", &strval);
 	if (strval) {
 		if (!strcmp(strval, "DeviceLocked")) {
 			debug_info("Device is locked, can't mount");
@@ -165,10 +179,7 @@ static mobile_image_mounter_error_t process_result(plist_t result, const char *e
 		return res;
 	}
 
-	node = plist_dict_get_item(result, "Status");
-	if (node && plist_get_node_type(node) == PLIST_STRING) {
-		plist_get_string_val(node, &strval);
-	}
+	property_list_message_get_string(result, "Status", &strval);
 	if (!strval) {
 		debug_info("Error: Unexpected response received!");
 	} else if (strcmp(strval, expected_status) == 0) {
@@ -181,13 +192,66 @@ static mobile_image_mounter_error_t process_result(plist_t result, const char *e
 	return res;
 }
 
-LIBIMOBILEDEVICE_API mobile_image_mounter_error_t mobile_image_mounter_upload_image(mobile_image_mounter_client_t client, const char *image_type, size_t image_size, const char *signature, uint16_t signature_size, mobile_image_mounter_upload_cb_t upload_cb, void* userdata)
+/**
+ * Makes the contents of an image file available in memory, by mapping it
+ * where supported or by reading it otherwise.
+ *
+ * @return 0 on success or -1 on error.
+ */
+static int mobile_image_mounter_map_fd(int fd, size_t size, char **data)
 {
-	if (!client || !image_type || (image_size == 0) || !upload_cb) {
-		return MOBILE_IMAGE_MOUNTER_E_INVALID_ARG;
+#ifdef HAVE_MMAP
+	char *map = (char*)mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		debug_info("Could not map image: %s", strerror(errno));
+		return -1;
 	}
-	mobile_image_mounter_lock(client);
-	plist_t result = NULL;
+#ifdef MADV_SEQUENTIAL
+	madvise(map, size, MADV_SEQUENTIAL);
+#endif
+	*data = map;
+#else
+	/* no mmap, read the image into memory in one go instead */
+	char *buf = (char*)malloc(size);
+	if (!buf) {
+		debug_info("Out of memory");
+		return -1;
+	}
+	size_t got = 0;
+	if (lseek(fd, 0, SEEK_SET) == 0) {
+		while (got < size) {
+			ssize_t r = read(fd, buf + got, size - got);
+			if (r <= 0)
+				break;
+			got += r;
+		}
+	}
+	if (got < size) {
+		debug_info("Could not read image");
+		free(buf);
+		return -1;
+	}
+	*data = buf;
+#endif
+	return 0;
+}
+
+static void mobile_image_mounter_unmap(char *data, size_t size)
+{
+#ifdef HAVE_MMAP
+	munmap(data, size);
+#else
+	free(data);
+#endif
+}
+
+/**
+ * Announces an image upload to the device and waits for it to acknowledge.
+ * The client has to be locked.
+ */
+static mobile_image_mounter_error_t mobile_image_mounter_begin_upload(mobile_image_mounter_client_t client, const char *image_type, size_t image_size, const char *signature, uint16_t signature_size)
+{
+	struct property_list_message result;
 
 	plist_t dict = plist_new_dict();
 	plist_dict_set_item(dict, "Command", plist_new_string("ReceiveBytes"));
@@ -201,15 +265,71 @@ LIBIMOBILEDEVICE_API mobile_image_mounter_error_t mobile_image_mounter_upload_im
 
 	if (res != MOBILE_IMAGE_MOUNTER_E_SUCCESS) {
 		debug_info("Error sending XML plist to device!");
-		goto leave_unlock;
+		return res;
 	}
 
-	res = mobile_image_mounter_error(property_list_service_receive_plist(client->parent, &result));
+	res = mobile_image_mounter_error(property_list_service_receive_message(client->parent, &result, 30000));
 	if (res != MOBILE_IMAGE_MOUNTER_E_SUCCESS) {
 		debug_info("Error receiving response from device!");
-		goto leave_unlock;
+		return res;
+	}
+	res = process_result(&result, "ReceiveBytesAck");
+	property_list_message_free(&result);
+
+	return res;
+}
+
+/**
+ * Waits for the device to confirm a completed image upload.
+ * The client has to be locked.
+ */
+static mobile_image_mounter_error_t mobile_image_mounter_finish_upload(mobile_image_mounter_client_t client)
+{
+	struct property_list_message result;
+
+	mobile_image_mounter_error_t res = mobile_image_mounter_error(property_list_service_receive_message(client->parent, &result, 30000));
+	if (res != MOBILE_IMAGE_MOUNTER_E_SUCCESS) {
+		debug_info("Error receiving response from device!");
+		return res;
+	}
+	res = process_result(&result, "Complete");
+	property_list_message_free(&result);
+
+	return res;
+}
+
+/**
+ * Sends image data straight from the given buffer, in large writes and
+ * without copying it. The client has to be locked.
+ *
+ * @return 0 on success or -1 if sending failed.
+ */
+static int mobile_image_mounter_send_image_data(mobile_image_mounter_client_t client, const char *data, size_t size)
+{
+	size_t tx = 0;
+
+	while (tx < size) {
+		size_t remaining = size - tx;
+		uint32_t amount = (remaining < MOBILE_IMAGE_MOUNTER_SEND_CHUNK_SIZE) ? (uint32_t)remaining : MOBILE_IMAGE_MOUNTER_SEND_CHUNK_SIZE;
+		uint32_t sent = 0;
+		if (service_send(client->parent->parent, data + tx, amount, &sent) != SERVICE_E_SUCCESS || sent == 0) {
+			debug_info("service_send failed");
+			return -1;
+		}
+		tx += sent;
 	}
-	res = process_result(result, "ReceiveBytesAck");
+
+	return 0;
+}
+
+LIBIMOBILEDEVICE_API mobile_image_mounter_error_t mobile_image_mounter_upload_image(mobile_image_mounter_client_t client, const char *image_type, size_t image_size, const char *signature, uint16_t signature_size, mobile_image_mounter_upload_cb_t upload_cb, void* userdata)
+{
+	if (!client || !image_type || (image_size == 0) || !upload_cb) {
+		return MOBILE_IMAGE_MOUNTER_E_INVALID_ARG;
+	}
+	mobile_image_mounter_lock(client);
+
+	mobile_image_mounter_error_t res = mobile_image_mounter_begin_upload(client, image_type, image_size, signature, signature_size);
 	if (res != MOBILE_IMAGE_MOUNTER_E_SUCCESS) {
 		goto leave_unlock;
 	}
@@ -241,23 +361,84 @@ LIBIMOBILEDEVICE_API mobile_image_mounter_error_t mobile_image_mounter_upload_im
 	free(buf);
 	if (tx < image_size) {
 		debug_info("Error: failed to upload image");
+		res = MOBILE_IMAGE_MOUNTER_E_UNKNOWN_ERROR;
 		goto leave_unlock;
 	}
 	debug_info("image uploaded");
 
-	res = mobile_image_mounter_error(property_list_service_receive_plist(client->parent, &result));
-	if (res != MOBILE_IMAGE_MOUNTER_E_SUCCESS) {
-		debug_info("Error receiving response from device!");
-		goto leave_unlock;
-	}
-	res = process_result(result, "Complete");
+	res = mobile_image_mounter_finish_upload(client);
 
 leave_unlock:
 	mobile_image_mounter_unlock(client);
-	if (result)
-		plist_free(result);
 	return res;
+}
+
+/**
+ * Uploads an image that is available in memory.
+ */
+static mobile_image_mounter_error_t mobile_image_mounter_upload_data(mobile_image_mounter_client_t client, const char *image_type, const char *data, size_t image_size, const char *signature, uint16_t signature_size)
+{
+	mobile_image_mounter_lock(client);
+
+	mobile_image_mounter_error_t res = mobile_image_mounter_begin_upload(client, image_type, image_size, signature, signature_size);
+	if (res == MOBILE_IMAGE_MOUNTER_E_SUCCESS) {
+		debug_info("uploading image (%d bytes)", (int)image_size);
+		if (mobile_image_mounter_send_image_data(client, data, image_size) < 0) {
+			debug_info("Error: failed to upload image");
+			res = MOBILE_IMAGE_MOUNTER_E_UNKNOWN_ERROR;
+		} else {
+			debug_info("image uploaded");
+			res = mobile_image_mounter_finish_upload(client);
+		}
+	}
+
+	mobile_image_mounter_unlock(client);
+
+	return res;
+}
+
+LIBIMOBILEDEVICE_API mobile_image_mounter_error_t mobile_image_mounter_upload_image_fd(mobile_image_mounter_client_t client, const char *image_type, int fd, const char *signature, uint16_t signature_size)
+{
+	struct stat st;
+
+	if (!client || !image_type || fd < 0) {
+		return MOBILE_IMAGE_MOUNTER_E_INVALID_ARG;
+	}
+
+	if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+		debug_info("Could not determine image size");
+		return MOBILE_IMAGE_MOUNTER_E_INVALID_ARG;
+	}
+	size_t image_size = (size_t)st.st_size;
+
+	char *data = NULL;
+	if (mobile_image_mounter_map_fd(fd, image_size, &data) < 0) {
+		return MOBILE_IMAGE_MOUNTER_E_UNKNOWN_ERROR;
+	}
+
+	mobile_image_mounter_error_t res = mobile_image_mounter_upload_data(client, image_type, data, image_size, signature, signature_size);
+
+	mobile_image_mounter_unmap(data, image_size);
+
+	return res;
+}
+
+LIBIMOBILEDEVICE_API mobile_image_mounter_error_t mobile_image_mounter_upload_image_file(mobile_image_mounter_client_t client, const char *image_type, const char *image_path, const char *signature, uint16_t signature_size)
+{
+	if (!client || !image_type || !image_path) {
+		return MOBILE_IMAGE_MOUNTER_E_INVALID_ARG;
+	}
+
+	int fd = open(image_path, O_RDONLY | O_BINARY);
+	if (fd < 0) {
+		debug_info("Could not open image %s: %s", image_path, strerror(errno));
+		return MOBILE_IMAGE_MOUNTER_E_INVALID_ARG;
+	}
+
+	mobile_image_mounter_error_t res = mobile_image_mounter_upload_image_fd(client, image_type, fd, signature, signature_size);
+	close(fd);
 
+	return res;
 }
 
 LIBIMOBILEDEVICE_API mobile_image_mounter_error_t mobile_image_mounter_mount_image(mobile_image_mounter_client_t client, const char *image_path, const char *signature, uint16_t signature_size, const char *image_type, plist_t *result)
@@ -324,3 +505,318 @@ leave_unlock:
 	mobile_image_mounter_unlock(client);
 	return res;
 }
+
+/* images loaded with mobile_image_mounter_image_load(), shared in the process */
+static mutex_t image_cache_mutex;
+static thread_once_t image_cache_once = THREAD_ONCE_INIT;
+static struct mobile_image_mounter_image_private *image_cache = NULL;
+
+static void image_cache_init(void)
+{
+	mutex_init(&image_cache_mutex);
+}
+
+LIBIMOBILEDEVICE_API mobile_image_mounter_error_t mobile_image_mounter_image_load(const char *image_path, const char *signature_path, mobile_image_mounter_image_t *image)
+{
+	struct mobile_image_mounter_image_private *entry;
+	struct stat st;
+	char *sig = NULL;
+	uint64_t sig_size = 0;
+
+	if (!image_path || !signature_path || !image) {
+		return MOBILE_IMAGE_MOUNTER_E_INVALID_ARG;
+	}
+
+	thread_once(&image_cache_once, image_cache_init);
+
+	mutex_lock(&image_cache_mutex);
+	for (entry = image_cache; entry; entry = entry->next) {
+		if (!strcmp(entry->image_path, image_path) && !strcmp(entry->signature_path, signature_path)) {
+			entry->refcount++;
+			mutex_unlock(&image_cache_mutex);
+			*image = entry;
+			return MOBILE_IMAGE_MOUNTER_E_SUCCESS;
+		}
+	}
+	mutex_unlock(&image_cache_mutex);
+
+	buffer_read_from_filename(signature_path, &sig, &sig_size);
+	if (!sig || sig_size == 0 || sig_size > 0xFFFF) {
+		debug_info("Could not read signature from %s", signature_path);
+		free(sig);
+		return MOBILE_IMAGE_MOUNTER_E_INVALID_ARG;
+	}
+
+	int fd = open(image_path, O_RDONLY | O_BINARY);
+	if (fd < 0) {
+		debug_info("Could not open image %s: %s", image_path, strerror(errno));
+		free(sig);
+		return MOBILE_IMAGE_MOUNTER_E_INVALID_ARG;
+	}
+	if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+		debug_info("Could not determine image size");
+		close(fd);
+		free(sig);
+		return MOBILE_IMAGE_MOUNTER_E_INVALID_ARG;
+	}
+
+	entry = (struct mobile_image_mounter_image_private*)malloc(sizeof(struct mobile_image_mounter_image_private));
+	if (!entry) {
+		close(fd);
+		free(sig);
+		return MOBILE_IMAGE_MOUNTER_E_UNKNOWN_ERROR;
+	}
+	entry->size = (size_t)st.st_size;
+	if (mobile_image_mounter_map_fd(fd, entry->size, &entry->data) < 0) {
+		close(fd);
+		free(sig);
+		free(entry);
+		return MOBILE_IMAGE_MOUNTER_E_UNKNOWN_ERROR;
+	}
+	close(fd);
+	entry->image_path = strdup(image_path);
+	entry->signature_path = strdup(signature_path);
+	entry->signature = sig;
+	entry->signature_size = (uint16_t)sig_size;
+	entry->refcount = 1;
+
+	mutex_lock(&image_cache_mutex);
+	entry->next = image_cache;
+	image_cache = entry;
+	mutex_unlock(&image_cache_mutex);
+
+	*image = entry;
+
+	return MOBILE_IMAGE_MOUNTER_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API mobile_image_mounter_error_t mobile_image_mounter_image_free(mobile_image_mounter_image_t image)
+{
+	struct mobile_image_mounter_image_private **p;
+
+	if (!image) {
+		return MOBILE_IMAGE_MOUNTER_E_INVALID_ARG;
+	}
+
+	mutex_lock(&image_cache_mutex);
+	if (--image->refcount > 0) {
+		mutex_unlock(&image_cache_mutex);
+		return MOBILE_IMAGE_MOUNTER_E_SUCCESS;
+	}
+	for (p = &image_cache; *p; p = &(*p)->next) {
+		if (*p == image) {
+			*p = image->next;
+			break;
+		}
+	}
+	mutex_unlock(&image_cache_mutex);
+
+	mobile_image_mounter_unmap(image->data, image->size);
+	free(image->signature);
+	free(image->image_path);
+	free(image->signature_path);
+	free(image);
+
+	return MOBILE_IMAGE_MOUNTER_E_SUCCESS;
+}
+
+/**
+ * Checks the result of a LookupImage command for an image with the given
+ * signature. Older firmware doesn't report signatures, only whether an
+ * image of the requested type is mounted, so that is taken as a match.
+ */
+static int mobile_image_mounter_lookup_matches(plist_t lookup, const char *signature, uint16_t signature_size)
+{
+	plist_t node = plist_dict_get_item(lookup, "ImageSignature");
+	if (node && plist_get_node_type(node) == PLIST_ARRAY) {
+		uint32_t count = plist_array_get_size(node);
+		uint32_t i;
+		for (i = 0; i < count; i++) {
+			plist_t item = plist_array_get_item(node, i);
+			uint64_t len = 0;
+			const char *data = (plist_get_node_type(item) == PLIST_DATA) ? plist_get_data_ptr(item, &len) : NULL;
+			if (data && len == signature_size && !memcmp(data, signature, len)) {
+				return 1;
+			}
+		}
+		return 0;
+	} else if (node && plist_get_node_type(node) == PLIST_DATA) {
+		uint64_t len = 0;
+		const char *data = plist_get_data_ptr(node, &len);
+		return (data && len == signature_size && !memcmp(data, signature, len));
+	}
+
+	node = plist_dict_get_item(lookup, "ImagePresent");
+	if (node && plist_get_node_type(node) == PLIST_BOOLEAN) {
+		uint8_t present = 0;
+		plist_get_bool_val(node, &present);
+		return present;
+	}
+
+	return 0;
+}
+
+LIBIMOBILEDEVICE_API mobile_image_mounter_error_t mobile_image_mounter_mount_loaded_image(mobile_image_mounter_client_t client, mobile_image_mounter_image_t image, const char *image_type, int *uploaded)
+{
+	plist_t result = NULL;
+
+	if (!client || !image || !image_type) {
+		return MOBILE_IMAGE_MOUNTER_E_INVALID_ARG;
+	}
+	if (uploaded) {
+		*uploaded = 0;
+	}
+
+	mobile_image_mounter_error_t res = mobile_image_mounter_lookup_image(client, image_type, &result);
+	if (res == MOBILE_IMAGE_MOUNTER_E_SUCCESS && mobile_image_mounter_lookup_matches(result, image->signature, image->signature_size)) {
+		debug_info("image is already mounted");
+		plist_free(result);
+		return MOBILE_IMAGE_MOUNTER_E_SUCCESS;
+	}
+	plist_free(result);
+	result = NULL;
+
+	res = mobile_image_mounter_upload_data(client, image_type, image->data, image->size, image->signature, image->signature_size);
+	if (res != MOBILE_IMAGE_MOUNTER_E_SUCCESS) {
+		return res;
+	}
+	if (uploaded) {
+		*uploaded = 1;
+	}
+
+	res = mobile_image_mounter_mount_image(client, MOBILE_IMAGE_MOUNTER_STAGING_PATH, image->signature, image->signature_size, image_type, &result);
+	if (res == MOBILE_IMAGE_MOUNTER_E_SUCCESS) {
+		struct property_list_message message = { result, NULL, 0 };
+		res = process_result(&message, "Complete");
+	}
+	plist_free(result);
+
+	return res;
+}
+
+struct mount_devices_data {
+	mutex_t mutex;
+	unsigned int next;
+	unsigned int count;
+	unsigned int failed;
+	const char **udids;
+	mobile_image_mounter_image_t image;
+	const char *image_type;
+	mobile_image_mounter_error_t *errors;
+	int *uploaded;
+};
+
+static void* mount_devices_worker(void* arg)
+{
+	struct mount_devices_data *data = (struct mount_devices_data*)arg;
+
+	while (1) {
+		mutex_lock(&data->mutex);
+		unsigned int i = data->next;
+		if (i < data->count) {
+			data->next++;
+		}
+		mutex_unlock(&data->mutex);
+		if (i >= data->count)
+			break;
+
+		idevice_t device = NULL;
+		mobile_image_mounter_client_t client = NULL;
+		mobile_image_mounter_error_t res = MOBILE_IMAGE_MOUNTER_E_CONN_FAILED;
+		int uploaded = 0;
+
+		if (idevice_new(&device, data->udids[i]) == IDEVICE_E_SUCCESS) {
+			res = mobile_image_mounter_start_service(device, &client, NULL);
+			if (res == MOBILE_IMAGE_MOUNTER_E_SUCCESS) {
+				res = mobile_image_mounter_mount_loaded_image(client, data->image, data->image_type, &uploaded);
+				mobile_image_mounter_hangup(client);
+				mobile_image_mounter_free(client);
+			}
+			idevice_free(device);
+		}
+		debug_info("device %s: result %d, %s", data->udids[i], res, (uploaded) ? "uploaded" : "not uploaded");
+
+		if (data->errors) {
+			data->errors[i] = res;
+		}
+		if (data->uploaded) {
+			data->uploaded[i] = uploaded;
+		}
+		if (res != MOBILE_IMAGE_MOUNTER_E_SUCCESS) {
+			mutex_lock(&data->mutex);
+			data->failed++;
+			mutex_unlock(&data->mutex);
+		}
+	}
+
+	return NULL;
+}
+
+LIBIMOBILEDEVICE_API mobile_image_mounter_error_t mobile_image_mounter_mount_image_on_devices(mobile_image_mounter_image_t image, const char *image_type, const char **udids, unsigned int count, unsigned int max_parallel, mobile_image_mounter_error_t *errors, int *uploaded)
+{
+	struct mount_devices_data data;
+	THREAD_T *threads;
+	unsigned int num_threads;
+	unsigned int i;
+
+	if (!image || !image_type || (count > 0 && !udids)) {
+		return MOBILE_IMAGE_MOUNTER_E_INVALID_ARG;
+	}
+	if (count == 0) {
+		return MOBILE_IMAGE_MOUNTER_E_SUCCESS;
+	}
+
+	mutex_init(&data.mutex);
+	data.next = 0;
+	data.count = count;
+	data.failed = 0;
+	data.udids = udids;
+	data.image = image;
+	data.image_type = image_type;
+	data.errors = errors;
+	data.uploaded = uploaded;
+	for (i = 0; i < count; i++) {
+		if (errors)
+			errors[i] = MOBILE_IMAGE_MOUNTER_E_UNKNOWN_ERROR;
+		if (uploaded)
+			uploaded[i] = 0;
+	}
+
+	num_threads = (max_parallel > 0 && max_parallel < count) ? max_parallel : count;
+	threads = (THREAD_T*)malloc(sizeof(THREAD_T) * num_threads);
+	if (!threads) {
+		mutex_destroy(&data.mutex);
+		return MOBILE_IMAGE_MOUNTER_E_UNKNOWN_ERROR;
+	}
+	for (i = 0; i < num_threads; i++) {
+		if (thread_new(&threads[i], mount_devices_worker, &data) != 0) {
+			threads[i] = THREAD_T_NULL;
+		}
+	}
+	/* if not a single thread could be started, do the work here */
+	int started = 0;
+	for (i = 0; i < num_threads; i++) {
+		if (threads[i]) {
+			started = 1;
+			break;
+		}
+	}
+	if (!started) {
+		mount_devices_worker(&data);
+	}
+	for (i = 0; i < num_threads; i++) {
+		if (threads[i]) {
+			thread_join(threads[i]);
+			thread_free(threads[i]);
+		}
+	}
+	free(threads);
+	mutex_destroy(&data.mutex);
+
+	if (data.failed > 0) {
+		debug_info("mounting failed on %u of %u devices", data.failed, count);
+		return MOBILE_IMAGE_MOUNTER_E_COMMAND_FAILED;
+	}
+
+	return MOBILE_IMAGE_MOUNTER_E_SUCCESS;
+}
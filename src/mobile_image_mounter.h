@@ -31,4 +31,15 @@ struct mobile_image_mounter_client_private {
 	mutex_t mutex;
 };
 
+struct mobile_image_mounter_image_private {
+	char *image_path;
+	char *signature_path;
+	char *data;
+	size_t size;
+	char *signature;
+	uint16_t signature_size;
+	unsigned int refcount;
+	struct mobile_image_mounter_image_private *next;
+};
+
 #endif
@@ -27,6 +27,7 @@
 #include "mobileactivation.h"
 #include "property_list_service.h"
 #include "common/debug.h"
+#include "common/thread.h"
 
 /**
  * Convert a property_list_service_error_t value to a mobileactivation_error_t value.
@@ -217,6 +218,8 @@ LIBIMOBILEDEVICE_API mobileactivation_error_t mobileactivation_create_activation
 			*blob = plist_copy(node);
 		}
 	}
+	plist_free(result);
+	result = NULL;
 
 	return ret;
 }
@@ -315,3 +318,128 @@ LIBIMOBILEDEVICE_API mobileactivation_error_t mobileactivation_deactivate(mobile
 
 	return ret;
 }
+
+struct mobileactivation_activation_task {
+	mobileactivation_activation_entry_t *entry;
+	const mobileactivation_server_t *server;
+	const char *label;
+};
+
+static void* mobileactivation_activation_task_func(void *data)
+{
+	struct mobileactivation_activation_task *task = (struct mobileactivation_activation_task*)data;
+	mobileactivation_activation_entry_t *entry = task->entry;
+	const mobileactivation_server_t *server = task->server;
+	mobileactivation_client_t client = NULL;
+	plist_t session_info = NULL;
+	plist_t handshake_response = NULL;
+	plist_t activation_info = NULL;
+	plist_t activation_record = NULL;
+	plist_t headers = NULL;
+
+	entry->step = MOBILEACTIVATION_STEP_CONNECT;
+	entry->error = mobileactivation_client_start_service(entry->device, &client, task->label);
+	if (entry->error != MOBILEACTIVATION_E_SUCCESS)
+		goto leave;
+
+	entry->step = MOBILEACTIVATION_STEP_SESSION_INFO;
+	entry->error = mobileactivation_create_activation_session_info(client, &session_info);
+	if (entry->error != MOBILEACTIVATION_E_SUCCESS)
+		goto leave;
+
+	entry->step = MOBILEACTIVATION_STEP_HANDSHAKE;
+	entry->error = server->handshake(entry->device, session_info, &handshake_response, server->user_data);
+	if (entry->error != MOBILEACTIVATION_E_SUCCESS)
+		goto leave;
+
+	entry->step = MOBILEACTIVATION_STEP_ACTIVATION_INFO;
+	entry->error = mobileactivation_create_activation_info_with_session(client, handshake_response, &activation_info);
+	if (entry->error != MOBILEACTIVATION_E_SUCCESS)
+		goto leave;
+
+	entry->step = MOBILEACTIVATION_STEP_ACTIVATION;
+	entry->error = server->activation(entry->device, activation_info, &activation_record, &headers, server->user_data);
+	if (entry->error == MOBILEACTIVATION_E_SUCCESS && !activation_record)
+		entry->error = MOBILEACTIVATION_E_PLIST_ERROR;
+	if (entry->error != MOBILEACTIVATION_E_SUCCESS)
+		goto leave;
+
+	entry->step = MOBILEACTIVATION_STEP_ACTIVATE;
+	entry->error = mobileactivation_activate_with_session(client, activation_record, headers);
+	if (entry->error != MOBILEACTIVATION_E_SUCCESS)
+		goto leave;
+
+	entry->step = MOBILEACTIVATION_STEP_DONE;
+
+leave:
+	if (entry->error != MOBILEACTIVATION_E_SUCCESS)
+		debug_info("activation failed in step %d with error %d", entry->step, entry->error);
+	plist_free(session_info);
+	plist_free(handshake_response);
+	plist_free(activation_info);
+	plist_free(activation_record);
+	plist_free(headers);
+	mobileactivation_client_free(client);
+
+	return NULL;
+}
+
+LIBIMOBILEDEVICE_API mobileactivation_error_t mobileactivation_activate_multi(mobileactivation_activation_entry_t *entries, unsigned int count, const mobileactivation_server_t *server, const char *label, unsigned int max_parallel)
+{
+	unsigned int i;
+
+	if (!entries || count == 0 || !server || !server->handshake || !server->activation)
+		return MOBILEACTIVATION_E_INVALID_ARG;
+
+	for (i = 0; i < count; i++) {
+		entries[i].step = MOBILEACTIVATION_STEP_CONNECT;
+		entries[i].error = (entries[i].device) ? MOBILEACTIVATION_E_UNKNOWN_ERROR : MOBILEACTIVATION_E_INVALID_ARG;
+	}
+
+	if (max_parallel == 0 || max_parallel > count)
+		max_parallel = count;
+
+	struct mobileactivation_activation_task *tasks = (struct mobileactivation_activation_task*)calloc(count, sizeof(struct mobileactivation_activation_task));
+	thread_task_t *handles = (thread_task_t*)calloc(count, sizeof(thread_task_t));
+	/* the activations mostly wait for the devices and the server, so the
+	 * pool is sized by the number of devices instead of the number of CPUs */
+	thread_pool_t pool = (tasks && handles && max_parallel > 1) ? thread_pool_new(max_parallel) : NULL;
+
+	for (i = 0; i < count; i++) {
+		struct mobileactivation_activation_task single;
+		struct mobileactivation_activation_task *task = (tasks) ? &tasks[i] : &single;
+		if (!entries[i].device)
+			continue;
+		task->entry = &entries[i];
+		task->server = server;
+		task->label = label;
+		if (pool)
+			handles[i] = thread_pool_submit(pool, mobileactivation_activation_task_func, task);
+		if (!handles || !handles[i])
+			mobileactivation_activation_task_func(task);
+	}
+
+	if (pool) {
+		for (i = 0; i < count; i++) {
+			if (handles[i])
+				thread_task_wait(pool, handles[i]);
+		}
+		thread_pool_free(pool);
+	}
+	free(handles);
+	free(tasks);
+
+	mobileactivation_error_t ret = MOBILEACTIVATION_E_SUCCESS;
+	unsigned int failed = 0;
+	for (i = 0; i < count; i++) {
+		if (entries[i].error != MOBILEACTIVATION_E_SUCCESS) {
+			if (failed++ == 0)
+				ret = entries[i].error;
+		}
+	}
+	if (failed > 0) {
+		debug_info("activation failed for %u of %u devices", failed, count);
+	}
+
+	return ret;
+}
@@ -123,6 +123,38 @@ LIBIMOBILEDEVICE_API mobilebackup_error_t mobilebackup_receive(mobilebackup_clie
 	return ret;
 }
 
+LIBIMOBILEDEVICE_API mobilebackup_error_t mobilebackup_receive_file_hunk(mobilebackup_client_t client, plist_t *message, const char **data, uint64_t *length)
+{
+	if (!client || !message || !data || !length)
+		return MOBILEBACKUP_E_INVALID_ARG;
+
+	*data = NULL;
+	*length = 0;
+
+	mobilebackup_error_t ret = mobilebackup_error(device_link_service_receive(client->parent, message));
+	if (ret != MOBILEBACKUP_E_SUCCESS || !*message)
+		return ret;
+
+	if (plist_get_node_type(*message) != PLIST_ARRAY || plist_array_get_size(*message) < 3)
+		return MOBILEBACKUP_E_SUCCESS;
+
+	plist_t node = plist_array_get_item(*message, 0);
+	if (plist_get_node_type(node) != PLIST_STRING || plist_string_val_compare(node, "DLSendFile") != 0)
+		return MOBILEBACKUP_E_SUCCESS;
+
+	node = plist_array_get_item(*message, 1);
+	if (plist_get_node_type(node) != PLIST_DATA) {
+		debug_info("ERROR: DLSendFile message without file data");
+		plist_free(*message);
+		*message = NULL;
+		return MOBILEBACKUP_E_PLIST_ERROR;
+	}
+
+	*data = plist_get_data_ptr(node, length);
+
+	return MOBILEBACKUP_E_SUCCESS;
+}
+
 LIBIMOBILEDEVICE_API mobilebackup_error_t mobilebackup_send(mobilebackup_client_t client, plist_t plist)
 {
 	if (!client || !plist)
@@ -245,6 +245,25 @@ LIBIMOBILEDEVICE_API mobilebackup2_error_t mobilebackup2_send_raw(mobilebackup2_
 	}
 }
 
+LIBIMOBILEDEVICE_API mobilebackup2_error_t mobilebackup2_send_rawv(mobilebackup2_client_t client, const idevice_iovec_t *iov, int iovcnt, uint32_t *bytes)
+{
+	if (!client || !client->parent || !iov || (iovcnt <= 0) || !bytes)
+		return MOBILEBACKUP2_E_INVALID_ARG;
+
+	*bytes = 0;
+
+	service_client_t raw = client->parent->parent->parent;
+
+	uint32_t sent = 0;
+	service_sendv(raw, iov, iovcnt, &sent);
+	if (sent > 0) {
+		*bytes = sent;
+		return MOBILEBACKUP2_E_SUCCESS;
+	} else {
+		return MOBILEBACKUP2_E_MUX_ERROR;
+	}
+}
+
 LIBIMOBILEDEVICE_API mobilebackup2_error_t mobilebackup2_receive_raw(mobilebackup2_client_t client, char *data, uint32_t length, uint32_t *bytes)
 {
 	if (!client || !client->parent || !data || (length == 0) || !bytes)
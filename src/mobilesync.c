@@ -39,6 +39,9 @@
 
 #define EMPTY_PARAMETER_STRING "___EmptyParameterString___"
 
+#define MSYNC_DEFAULT_BATCH_SIZE 1000
+#define MSYNC_DEFAULT_WINDOW 4
+
 /**
  * Convert an #device_link_service_error_t value to an #mobilesync_error_t value.
  * Used internally to get correct error codes when using device_link_service stuff.
@@ -421,6 +424,82 @@ LIBIMOBILEDEVICE_API mobilesync_error_t mobilesync_receive_changes(mobilesync_cl
 	return err;
 }
 
+/**
+ * Receives a message and checks that it is of the expected type.
+ *
+ * @return MOBILESYNC_E_SUCCESS if the expected message was received,
+ *     MOBILESYNC_E_CANCELLED if the device cancelled the session,
+ *     MOBILESYNC_E_PLIST_ERROR for any other message, or the error of the
+ *     receive operation.
+ */
+static mobilesync_error_t mobilesync_receive_expected(mobilesync_client_t client, const char *expected, plist_t *msg)
+{
+	*msg = NULL;
+	mobilesync_error_t err = mobilesync_receive(client, msg);
+	if (err != MOBILESYNC_E_SUCCESS) {
+		return err;
+	}
+
+	plist_t node = (plist_get_node_type(*msg) == PLIST_ARRAY) ? plist_array_get_item(*msg, 0) : NULL;
+	if (!node || plist_get_node_type(node) != PLIST_STRING) {
+		err = MOBILESYNC_E_PLIST_ERROR;
+	} else if (!plist_string_val_compare(node, "SDMessageCancelSession")) {
+		plist_t reason = plist_array_get_item(*msg, 2);
+		debug_info("Device cancelled: %s", (plist_get_node_type(reason) == PLIST_STRING) ? plist_get_string_ptr(reason, NULL) : "(null)");
+		err = MOBILESYNC_E_CANCELLED;
+	} else if (plist_string_val_compare(node, expected)) {
+		debug_info("Expected %s but received %s", expected, plist_get_string_ptr(node, NULL));
+		err = MOBILESYNC_E_PLIST_ERROR;
+	}
+
+	if (err != MOBILESYNC_E_SUCCESS) {
+		plist_free(*msg);
+		*msg = NULL;
+	}
+	return err;
+}
+
+LIBIMOBILEDEVICE_API mobilesync_error_t mobilesync_receive_changes_with_callback(mobilesync_client_t client, mobilesync_receive_changes_cb_t callback, void *user_data)
+{
+	if (!client || !client->data_class || !callback) {
+		return MOBILESYNC_E_INVALID_ARG;
+	}
+
+	mobilesync_error_t err = MOBILESYNC_E_SUCCESS;
+	uint8_t is_last_record = 0;
+
+	while (err == MOBILESYNC_E_SUCCESS && !is_last_record) {
+		plist_t msg = NULL;
+		err = mobilesync_receive_expected(client, "SDMessageProcessChanges", &msg);
+		if (err != MOBILESYNC_E_SUCCESS) {
+			break;
+		}
+
+		uint8_t has_more_changes = 0;
+		plist_t node = plist_array_get_item(msg, 3);
+		if (plist_get_node_type(node) == PLIST_BOOLEAN)
+			plist_get_bool_val(node, &has_more_changes);
+		is_last_record = (has_more_changes > 0 ? 0 : 1);
+
+		/* let the device prepare the next batch while this one is processed */
+		err = mobilesync_acknowledge_changes_from_device(client);
+		if (err == MOBILESYNC_E_SUCCESS) {
+			plist_t actions = plist_array_get_item(msg, 4);
+			if (plist_get_node_type(actions) != PLIST_DICT)
+				actions = NULL;
+			if (callback(plist_array_get_item(msg, 2), is_last_record, actions, user_data) != 0) {
+				debug_info("Receiving changes cancelled by callback");
+				mobilesync_cancel(client, "Cancelled by computer");
+				err = MOBILESYNC_E_CANCELLED;
+			}
+		}
+
+		plist_free(msg);
+	}
+
+	return err;
+}
+
 LIBIMOBILEDEVICE_API mobilesync_error_t mobilesync_clear_all_records_on_device(mobilesync_client_t client)
 {
 	if (!client || !client->data_class) {
@@ -688,6 +767,87 @@ LIBIMOBILEDEVICE_API mobilesync_error_t mobilesync_remap_identifiers(mobilesync_
 	return err;
 }
 
+LIBIMOBILEDEVICE_API mobilesync_error_t mobilesync_send_changes_with_callback(mobilesync_client_t client, uint32_t batch_size, uint32_t window, plist_t actions, mobilesync_send_changes_cb_t callback, void *user_data, plist_t *mapping)
+{
+	if (!client || !client->data_class || !callback) {
+		return MOBILESYNC_E_INVALID_ARG;
+	}
+
+	if (actions && plist_get_node_type(actions) != PLIST_DICT) {
+		return MOBILESYNC_E_INVALID_ARG;
+	}
+
+	if (client->direction != MOBILESYNC_SYNC_DIR_COMPUTER_TO_DEVICE) {
+		return MOBILESYNC_E_WRONG_DIRECTION;
+	}
+
+	if (batch_size == 0)
+		batch_size = MSYNC_DEFAULT_BATCH_SIZE;
+	if (window == 0)
+		window = MSYNC_DEFAULT_WINDOW;
+
+	mobilesync_error_t err = MOBILESYNC_E_SUCCESS;
+	plist_t result = (mapping) ? plist_new_dict() : NULL;
+	uint8_t is_last_record = 0;
+	uint32_t in_flight = 0;
+	int cancelled = 0;
+
+	while (err == MOBILESYNC_E_SUCCESS && (!is_last_record || in_flight > 0)) {
+		plist_t msg = NULL;
+
+		if (!is_last_record && in_flight < window) {
+			plist_t entities = plist_new_dict();
+			if (callback(entities, batch_size, &is_last_record, user_data) != 0) {
+				debug_info("Sending changes cancelled by callback");
+				plist_free(entities);
+				cancelled = 1;
+				err = MOBILESYNC_E_CANCELLED;
+				break;
+			}
+
+			/* the message takes over the batch, so it is freed right after sending */
+			msg = plist_new_array();
+			plist_array_append_item(msg, plist_new_string("SDMessageProcessChanges"));
+			plist_array_append_item(msg, plist_new_string(client->data_class));
+			plist_array_append_item(msg, entities);
+			plist_array_append_item(msg, plist_new_bool(is_last_record > 0 ? 0 : 1));
+			if (actions)
+				plist_array_append_item(msg, plist_copy(actions));
+			else
+				plist_array_append_item(msg, plist_new_string(EMPTY_PARAMETER_STRING));
+
+			err = mobilesync_send(client, msg);
+			plist_free(msg);
+			if (err == MOBILESYNC_E_SUCCESS)
+				in_flight++;
+			continue;
+		}
+
+		err = mobilesync_receive_expected(client, "SDMessageRemapRecordIdentifiers", &msg);
+		if (err != MOBILESYNC_E_SUCCESS) {
+			break;
+		}
+		in_flight--;
+
+		plist_t map = plist_array_get_item(msg, 2);
+		if (result && plist_get_node_type(map) == PLIST_DICT)
+			plist_dict_merge(&result, map);
+		plist_free(msg);
+	}
+
+	if (cancelled) {
+		mobilesync_cancel(client, "Cancelled by computer");
+	}
+
+	if (mapping && err == MOBILESYNC_E_SUCCESS) {
+		*mapping = result;
+	} else {
+		plist_free(result);
+	}
+
+	return err;
+}
+
 LIBIMOBILEDEVICE_API mobilesync_error_t mobilesync_cancel(mobilesync_client_t client, const char* reason)
 {
 	if (!client || !client->data_class || !reason) {
@@ -25,19 +25,18 @@
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <errno.h>
 #include <plist/plist.h>
 
 #include "notification_proxy.h"
 #include "property_list_service.h"
 #include "common/debug.h"
-
-#ifdef WIN32
-#define sleep(x) Sleep(x*1000)
-#endif
+#include "common/socket.h"
 
 struct np_thread {
 	np_client_t client;
 	np_notify_cb_t cbfunc;
+	np_notify_batch_cb_t batch_cbfunc;
 	void *user_data;
 };
 
@@ -103,6 +102,9 @@ LIBIMOBILEDEVICE_API np_error_t np_client_new(idevice_t device, lockdownd_servic
 	mutex_init(&client_loc->mutex);
 	client_loc->notifier = THREAD_T_NULL;
 
+	/* allows waiting for notifications without consuming them */
+	idevice_connection_set_receive_buffer_size(plistclient->parent->connection, NP_RECEIVE_BUFFER_SIZE);
+
 	*client = client_loc;
 	return NP_E_SUCCESS;
 }
@@ -242,8 +244,63 @@ LIBIMOBILEDEVICE_API np_error_t np_observe_notifications(np_client_t client, con
 	return res;
 }
 
+/**
+ * Waits until data from the device is available without consuming it.
+ * The connection is only touched with the client locked, since sending
+ * commands may use it at the same time (for SSL even for reading). While
+ * waiting, the client is not locked and just the socket is polled.
+ *
+ * @param client NP client to wait on
+ * @param timeout Maximum time in milliseconds to wait for data
+ *
+ * @return 1 if data is available, 0 if the timeout was reached,
+ *         or a negative value if an error occurred.
+ */
+static int np_wait_for_data(np_client_t client, unsigned int timeout)
+{
+	idevice_error_t err = IDEVICE_E_SUCCESS;
+	char c = 0;
+	uint32_t available = 0;
+	uint32_t peeked = 0;
+	int fd = -1;
+
+	np_lock(client);
+	if (!client->parent) {
+		np_unlock(client);
+		return -1;
+	}
+	idevice_connection_t connection = client->parent->parent->connection;
+	idevice_connection_get_available(connection, &available);
+	if (available == 0) {
+		/* pick up data the SSL layer already decrypted, the socket won't
+		 * signal it anymore */
+		err = idevice_connection_peek(connection, &c, 1, &peeked, 1);
+	}
+	idevice_connection_get_fd(connection, &fd);
+	np_unlock(client);
+
+	if (available > 0 || peeked > 0) {
+		return 1;
+	}
+	if (err != IDEVICE_E_SUCCESS && err != IDEVICE_E_TIMEOUT) {
+		debug_info("NotificationProxy: error %d occurred while waiting!", err);
+		return -1;
+	}
+
+	int res = socket_check_fd(fd, FDM_READ, timeout);
+	if (res == -ETIMEDOUT) {
+		return 0;
+	} else if (res < 0) {
+		debug_info("NotificationProxy: error %d occurred while waiting!", res);
+		return -1;
+	}
+
+	return 1;
+}
+
 /**
  * Checks if a notification has been sent by the device.
+ * The client needs to be locked by the caller.
  *
  * @param client NP to get a notification from
  * @param notification Pointer to a buffer that will be allocated and filled
@@ -263,9 +320,7 @@ static int np_get_notification(np_client_t client, char **notification)
 	if (!client || !client->parent || *notification)
 		return -1;
 
-	np_lock(client);
-
-	property_list_service_error_t perr = property_list_service_receive_plist_with_timeout(client->parent, &dict, 500);
+	property_list_service_error_t perr = property_list_service_receive_plist_with_timeout(client->parent, &dict, NP_RECEIVE_TIMEOUT);
 	if (perr == PROPERTY_LIST_SERVICE_E_RECEIVE_TIMEOUT) {
 		debug_info("NotificationProxy: no notification received!");
 		res = 0;
@@ -292,7 +347,7 @@ static int np_get_notification(np_client_t client, char **notification)
 			res = -2;
 			if (name_value_node && name_value) {
 				*notification = name_value;
-				debug_info("got notification %s", __func__, name_value);
+				debug_info("got notification %s", name_value);
 				res = 0;
 			}
 		} else if (cmd_value && !strcmp(cmd_value, "ProxyDeath")) {
@@ -311,33 +366,92 @@ static int np_get_notification(np_client_t client, char **notification)
 		dict = NULL;
 	}
 
-	np_unlock(client);
-
 	return res;
 }
 
+/**
+ * Passes a batch of received notifications to the registered callback.
+ */
+static void np_dispatch_notifications(struct np_thread *npt, char **notifications, int count)
+{
+	int i;
+
+	if (count == 0)
+		return;
+
+	if (npt->batch_cbfunc) {
+		npt->batch_cbfunc((const char**)notifications, count, npt->user_data);
+	} else {
+		for (i = 0; i < count; i++) {
+			npt->cbfunc(notifications[i], npt->user_data);
+		}
+	}
+}
+
+/**
+ * Signals the registered callback that the notifier is terminating.
+ */
+static void np_dispatch_termination(struct np_thread *npt)
+{
+	if (npt->batch_cbfunc) {
+		const char *empty = "";
+		npt->batch_cbfunc(&empty, 1, npt->user_data);
+	} else {
+		npt->cbfunc("", npt->user_data);
+	}
+}
+
 /**
  * Internally used thread function.
  */
 void* np_notifier( void* arg )
 {
-	char *notification = NULL;
+	char *notifications[NP_MAX_BATCH_SIZE];
 	struct np_thread *npt = (struct np_thread*)arg;
+	int count = 0;
+	int res = 0;
+	int i;
 
 	if (!npt) return NULL;
 
 	debug_info("starting callback.");
 	while (npt->client->parent) {
-		if (np_get_notification(npt->client, &notification) < 0) {
-			npt->cbfunc("", npt->user_data);
-			break;
+		res = np_wait_for_data(npt->client, NP_WAIT_TIMEOUT);
+		if (res == 0) {
+			continue;
 		}
-		if (notification) {
-			npt->cbfunc(notification, npt->user_data);
-			free(notification);
-			notification = NULL;
+
+		/* collect all notifications that are already available */
+		count = 0;
+		if (res > 0) {
+			np_lock(npt->client);
+			do {
+				char *notification = NULL;
+				uint32_t available = 0;
+				res = np_get_notification(npt->client, &notification);
+				if (notification) {
+					notifications[count++] = notification;
+				}
+				if (res < 0 || !npt->client->parent) {
+					break;
+				}
+				idevice_connection_get_available(npt->client->parent->parent->connection, &available);
+				if (available == 0) {
+					break;
+				}
+			} while (count < NP_MAX_BATCH_SIZE);
+			np_unlock(npt->client);
+		}
+
+		np_dispatch_notifications(npt, notifications, count);
+		for (i = 0; i < count; i++) {
+			free(notifications[i]);
+		}
+
+		if (res < 0) {
+			np_dispatch_termination(npt);
+			break;
 		}
-		sleep(1);
 	}
 	if (npt) {
 		free(npt);
@@ -346,33 +460,40 @@ void* np_notifier( void* arg )
 	return NULL;
 }
 
-LIBIMOBILEDEVICE_API np_error_t np_set_notify_callback( np_client_t client, np_notify_cb_t notify_cb, void *user_data )
+/**
+ * Replaces the notifier thread with one delivering to the given callbacks.
+ */
+static np_error_t np_set_notifier(np_client_t client, np_notify_cb_t notify_cb, np_notify_batch_cb_t batch_cb, void *user_data)
 {
-	if (!client)
-		return NP_E_INVALID_ARG;
-
 	np_error_t res = NP_E_UNKNOWN_ERROR;
 
 	np_lock(client);
 	if (client->notifier) {
 		debug_info("callback already set, removing");
 		property_list_service_client_t parent = client->parent;
+		THREAD_T notifier = client->notifier;
 		client->parent = NULL;
-		thread_join(client->notifier);
-		thread_free(client->notifier);
 		client->notifier = THREAD_T_NULL;
+		/* the notifier thread might need the lock to finish */
+		np_unlock(client);
+		thread_join(notifier);
+		thread_free(notifier);
+		np_lock(client);
 		client->parent = parent;
 	}
 
-	if (notify_cb) {
+	if (notify_cb || batch_cb) {
 		struct np_thread *npt = (struct np_thread*)malloc(sizeof(struct np_thread));
 		if (npt) {
 			npt->client = client;
 			npt->cbfunc = notify_cb;
+			npt->batch_cbfunc = batch_cb;
 			npt->user_data = user_data;
 
 			if (thread_new(&client->notifier, np_notifier, npt) == 0) {
 				res = NP_E_SUCCESS;
+			} else {
+				free(npt);
 			}
 		}
 	} else {
@@ -382,3 +503,19 @@ LIBIMOBILEDEVICE_API np_error_t np_set_notify_callback( np_client_t client, np_n
 
 	return res;
 }
+
+LIBIMOBILEDEVICE_API np_error_t np_set_notify_callback( np_client_t client, np_notify_cb_t notify_cb, void *user_data )
+{
+	if (!client)
+		return NP_E_INVALID_ARG;
+
+	return np_set_notifier(client, notify_cb, NULL, user_data);
+}
+
+LIBIMOBILEDEVICE_API np_error_t np_set_notify_batch_callback(np_client_t client, np_notify_batch_cb_t notify_cb, void *user_data)
+{
+	if (!client)
+		return NP_E_INVALID_ARG;
+
+	return np_set_notifier(client, NULL, notify_cb, user_data);
+}
@@ -26,12 +26,47 @@
 #include "property_list_service.h"
 #include "common/thread.h"
 
+/* buffered data allows waiting for notifications without consuming them */
+#define NP_RECEIVE_BUFFER_SIZE 4096
+
+/* time in milliseconds the notifier waits before checking for termination */
+#define NP_WAIT_TIMEOUT 1000
+
+/* time in milliseconds to wait for the rest of a partially received plist */
+#define NP_RECEIVE_TIMEOUT 5000
+
+/* maximum number of notifications passed to a batch callback at once */
+#define NP_MAX_BATCH_SIZE 32
+
 struct np_client_private {
 	property_list_service_client_t parent;
 	mutex_t mutex;
 	THREAD_T notifier;
 };
 
+/* one connection of the notification hub, shared by all its subscribers */
+struct np_hub_device {
+	mutex_t mutex;
+	char *udid;
+	idevice_t device;
+	np_client_t client;
+	plist_t observed;
+	int dead;
+	struct np_hub_subscription_private *subscriptions;
+	struct np_hub_device *next;
+};
+
+struct np_hub_subscription_private {
+	struct np_hub_device *hub_device;
+	plist_t notifications;
+	np_hub_cb_t callback;
+	void *user_data;
+	int refs;
+	volatile int removed;
+	cond_t released;
+	struct np_hub_subscription_private *next;
+};
+
 void* np_notifier(void* arg);
 
 #endif
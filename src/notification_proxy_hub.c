@@ -0,0 +1,344 @@
+/*
+ * notification_proxy_hub.c
+ * Shares one notification_proxy connection per device between subscribers.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <string.h>
+#include <stdlib.h>
+#include <plist/plist.h>
+
+#include "notification_proxy.h"
+#include "common/debug.h"
+
+static struct {
+	mutex_t mutex;
+	struct np_hub_device *devices;
+} np_hub;
+static thread_once_t np_hub_once = THREAD_ONCE_INIT;
+
+static void np_hub_init(void)
+{
+	mutex_init(&np_hub.mutex);
+	np_hub.devices = NULL;
+}
+
+/* must be called with the hub mutex held */
+static struct np_hub_device *np_hub_find(const char *udid)
+{
+	struct np_hub_device *hd;
+	for (hd = np_hub.devices; hd; hd = hd->next) {
+		mutex_lock(&hd->mutex);
+		int dead = hd->dead;
+		mutex_unlock(&hd->mutex);
+		if (!dead && !strcmp(hd->udid, udid)) {
+			return hd;
+		}
+	}
+	return NULL;
+}
+
+/* must be called with the hub mutex held */
+static void np_hub_unlink(struct np_hub_device *hd)
+{
+	struct np_hub_device **pp;
+	for (pp = &np_hub.devices; *pp; pp = &(*pp)->next) {
+		if (*pp == hd) {
+			*pp = hd->next;
+			break;
+		}
+	}
+	hd->next = NULL;
+}
+
+/**
+ * Passes the notifications received from a device to all subscriptions
+ * that want them. Runs on the notifier thread of the device connection.
+ *
+ * The subscriptions are referenced under the device mutex and the
+ * callbacks run without any lock held.
+ */
+static void np_hub_dispatch(const char **notifications, int count, void *user_data)
+{
+	struct np_hub_device *hd = (struct np_hub_device*)user_data;
+	struct np_hub_subscription_private **subs = NULL;
+	struct np_hub_subscription_private *sub;
+	int nsubs = 0;
+	int i, j;
+
+	mutex_lock(&hd->mutex);
+	for (sub = hd->subscriptions; sub; sub = sub->next) {
+		nsubs++;
+	}
+	if (nsubs > 0) {
+		subs = (struct np_hub_subscription_private**)malloc(nsubs * sizeof(struct np_hub_subscription_private*));
+	}
+	nsubs = 0;
+	if (subs) {
+		for (sub = hd->subscriptions; sub; sub = sub->next) {
+			if (sub->removed)
+				continue;
+			sub->refs++;
+			subs[nsubs++] = sub;
+		}
+	}
+	for (i = 0; i < count; i++) {
+		if (notifications[i][0] == '\0') {
+			debug_info("lost notification_proxy connection to %s", hd->udid);
+			hd->dead = 1;
+			break;
+		}
+	}
+	mutex_unlock(&hd->mutex);
+
+	for (i = 0; i < count; i++) {
+		if (notifications[i][0] == '\0') {
+			for (j = 0; j < nsubs; j++) {
+				sub = subs[j];
+				if (!sub->removed)
+					sub->callback(hd->udid, "", sub->user_data);
+			}
+			break;
+		}
+		for (j = 0; j < nsubs; j++) {
+			sub = subs[j];
+			if (sub->removed)
+				continue;
+			if (!sub->notifications || plist_dict_get_item(sub->notifications, notifications[i])) {
+				sub->callback(hd->udid, notifications[i], sub->user_data);
+			}
+		}
+	}
+
+	/* wakes up np_hub_unsubscribe() waiting for the callback to return */
+	mutex_lock(&hd->mutex);
+	for (j = 0; j < nsubs; j++) {
+		sub = subs[j];
+		if (--sub->refs == 0 && sub->removed)
+			cond_signal(&sub->released);
+	}
+	mutex_unlock(&hd->mutex);
+	free(subs);
+}
+
+static void np_hub_device_free(struct np_hub_device *hd)
+{
+	if (!hd)
+		return;
+
+	/* joins the notifier thread, which might wait for the device mutex */
+	if (hd->client) {
+		np_client_free(hd->client);
+	}
+	if (hd->device) {
+		idevice_free(hd->device);
+	}
+	plist_free(hd->observed);
+	mutex_destroy(&hd->mutex);
+	free(hd->udid);
+	free(hd);
+}
+
+static np_error_t np_hub_device_new(const char *udid, enum idevice_options options, struct np_hub_device **hub_device)
+{
+	np_error_t res = NP_E_UNKNOWN_ERROR;
+
+	struct np_hub_device *hd = (struct np_hub_device*)calloc(1, sizeof(struct np_hub_device));
+	if (!hd) {
+		return NP_E_UNKNOWN_ERROR;
+	}
+	mutex_init(&hd->mutex);
+	hd->udid = strdup(udid);
+	hd->observed = plist_new_dict();
+
+	if (idevice_new_with_options(&hd->device, udid, options) != IDEVICE_E_SUCCESS) {
+		debug_info("device %s not found", udid);
+		np_hub_device_free(hd);
+		return NP_E_CONN_FAILED;
+	}
+
+	res = np_client_start_service(hd->device, &hd->client, "np_hub");
+	if (res != NP_E_SUCCESS) {
+		debug_info("could not connect to notification_proxy of %s: %d", udid, res);
+		np_hub_device_free(hd);
+		return res;
+	}
+
+	res = np_set_notify_batch_callback(hd->client, np_hub_dispatch, hd);
+	if (res != NP_E_SUCCESS) {
+		np_hub_device_free(hd);
+		return res;
+	}
+
+	*hub_device = hd;
+
+	return NP_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API np_error_t np_hub_subscribe(const char *udid, enum idevice_options options, const char **notification_spec, np_hub_cb_t callback, void *user_data, np_hub_subscription_t *subscription)
+{
+	np_error_t res = NP_E_SUCCESS;
+	struct np_hub_device *hd = NULL;
+	struct np_hub_device *unused = NULL;
+	const char **pending = NULL;
+	int count = 0;
+	int npending = 0;
+	int i;
+
+	if (!udid || !callback || !subscription)
+		return NP_E_INVALID_ARG;
+
+	thread_once(&np_hub_once, np_hub_init);
+
+	struct np_hub_subscription_private *sub = (struct np_hub_subscription_private*)calloc(1, sizeof(struct np_hub_subscription_private));
+	if (!sub) {
+		return NP_E_UNKNOWN_ERROR;
+	}
+	sub->callback = callback;
+	sub->user_data = user_data;
+	cond_init(&sub->released);
+	if (notification_spec) {
+		sub->notifications = plist_new_dict();
+		while (notification_spec[count]) {
+			plist_dict_set_item(sub->notifications, notification_spec[count], plist_new_bool(1));
+			count++;
+		}
+		pending = (const char**)calloc(count + 1, sizeof(const char*));
+		if (!pending) {
+			cond_destroy(&sub->released);
+			plist_free(sub->notifications);
+			free(sub);
+			return NP_E_UNKNOWN_ERROR;
+		}
+	}
+
+	mutex_lock(&np_hub.mutex);
+	hd = np_hub_find(udid);
+	if (!hd) {
+		/* connecting takes a while, don't hold up the other devices */
+		mutex_unlock(&np_hub.mutex);
+		res = np_hub_device_new(udid, options, &unused);
+		if (res != NP_E_SUCCESS) {
+			free(pending);
+			cond_destroy(&sub->released);
+			plist_free(sub->notifications);
+			free(sub);
+			return res;
+		}
+		mutex_lock(&np_hub.mutex);
+		hd = np_hub_find(udid);
+		if (!hd) {
+			hd = unused;
+			unused = NULL;
+			hd->next = np_hub.devices;
+			np_hub.devices = hd;
+		}
+	}
+
+	/* only ask the device for what nobody observes yet */
+	mutex_lock(&hd->mutex);
+	for (i = 0; i < count; i++) {
+		if (!plist_dict_get_item(hd->observed, notification_spec[i])) {
+			plist_dict_set_item(hd->observed, notification_spec[i], plist_new_bool(1));
+			pending[npending++] = notification_spec[i];
+		}
+	}
+
+	/* keeps the device connection around while observing */
+	sub->hub_device = hd;
+	sub->next = hd->subscriptions;
+	hd->subscriptions = sub;
+	mutex_unlock(&hd->mutex);
+	mutex_unlock(&np_hub.mutex);
+
+	/* another subscriber connected to the same device in the meantime */
+	np_hub_device_free(unused);
+
+	if (npending > 0) {
+		debug_info("observing %d more notifications of %s", npending, udid);
+		res = np_observe_notifications(hd->client, pending);
+		if (res != NP_E_SUCCESS) {
+			/* keep what other subscriptions added and rely on meanwhile */
+			mutex_lock(&hd->mutex);
+			for (i = 0; i < npending; i++) {
+				struct np_hub_subscription_private *other;
+				for (other = hd->subscriptions; other; other = other->next) {
+					if (other != sub && other->notifications && plist_dict_get_item(other->notifications, pending[i]))
+						break;
+				}
+				if (!other)
+					plist_dict_remove_item(hd->observed, pending[i]);
+			}
+			mutex_unlock(&hd->mutex);
+			free(pending);
+			np_hub_unsubscribe(sub);
+			return res;
+		}
+	}
+	free(pending);
+
+	*subscription = sub;
+
+	return NP_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API np_error_t np_hub_unsubscribe(np_hub_subscription_t subscription)
+{
+	struct np_hub_subscription_private **pp;
+	struct np_hub_device *hd;
+
+	if (!subscription)
+		return NP_E_INVALID_ARG;
+
+	hd = subscription->hub_device;
+
+	/* still linked, so the device stays around while waiting */
+	mutex_lock(&hd->mutex);
+	subscription->removed = 1;
+	while (subscription->refs > 0) {
+		cond_wait(&subscription->released, &hd->mutex);
+	}
+	mutex_unlock(&hd->mutex);
+
+	mutex_lock(&np_hub.mutex);
+	mutex_lock(&hd->mutex);
+	for (pp = &hd->subscriptions; *pp; pp = &(*pp)->next) {
+		if (*pp == subscription) {
+			*pp = subscription->next;
+			break;
+		}
+	}
+	int last = (hd->subscriptions == NULL);
+	mutex_unlock(&hd->mutex);
+	if (last) {
+		np_hub_unlink(hd);
+	} else {
+		hd = NULL;
+	}
+	mutex_unlock(&np_hub.mutex);
+
+	/* the last subscription closes the connection to the device */
+	np_hub_device_free(hd);
+
+	cond_destroy(&subscription->released);
+	plist_free(subscription->notifications);
+	free(subscription);
+
+	return NP_E_SUCCESS;
+}
@@ -22,12 +22,31 @@
 #include <config.h>
 #endif
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 
 #include "property_list_service.h"
 #include "common/debug.h"
+#include "common/trace.h"
+#include "common/probes.h"
 #include "endianness.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+/* initial size of the receive buffer of a client */
+#define PROPERTY_LIST_SERVICE_RECV_BUFFER_INITIAL_SIZE 0x1000
+/* larger receive buffers are shrunk again for smaller messages */
+#define PROPERTY_LIST_SERVICE_RECV_BUFFER_KEEP_SIZE 0x100000
+/* messages larger than this are rejected unless configured otherwise */
+#define PROPERTY_LIST_SERVICE_DEFAULT_MAX_MESSAGE_SIZE 0x8000000
+
+/* default number of requests property_list_service_send_receive_pipelined() keeps in flight */
+#define PROPERTY_LIST_SERVICE_PIPELINE_WINDOW 16
+
 /**
  * Convert a service_error_t value to a property_list_service_error_t value.
  * Used internally to get correct error codes.
@@ -52,6 +71,10 @@ static property_list_service_error_t service_to_property_list_service_error(serv
 			return PROPERTY_LIST_SERVICE_E_NOT_ENOUGH_DATA;
 		case SERVICE_E_TIMEOUT:
 			return PROPERTY_LIST_SERVICE_E_RECEIVE_TIMEOUT;
+		case SERVICE_E_DEVICE_DETACHED:
+			return PROPERTY_LIST_SERVICE_E_DEVICE_DETACHED;
+		case SERVICE_E_CANCELLED:
+			return PROPERTY_LIST_SERVICE_E_CANCELLED;
 		default:
 			break;
 	}
@@ -72,6 +95,9 @@ LIBIMOBILEDEVICE_API property_list_service_error_t property_list_service_client_
 	/* create client object */
 	property_list_service_client_t client_loc = (property_list_service_client_t)malloc(sizeof(struct property_list_service_client_private));
 	client_loc->parent = parent;
+	client_loc->recv_buffer = NULL;
+	client_loc->recv_buffer_size = 0;
+	client_loc->max_message_size = PROPERTY_LIST_SERVICE_DEFAULT_MAX_MESSAGE_SIZE;
 
 	/* all done, return success */
 	*client = client_loc;
@@ -85,6 +111,7 @@ LIBIMOBILEDEVICE_API property_list_service_error_t property_list_service_client_
 
 	property_list_service_error_t err = service_to_property_list_service_error(service_client_free(client->parent));
 
+	idevice_memory_free(client->recv_buffer);
 	free(client);
 	client = NULL;
 
@@ -130,24 +157,31 @@ static property_list_service_error_t internal_plist_send(property_list_service_c
 
 	nlen = htobe32(length);
 	debug_info("sending %d bytes", length);
-	service_send(client->parent, (const char*)&nlen, sizeof(nlen), &bytes);
-	if (bytes == sizeof(nlen)) {
-		service_send(client->parent, content, length, &bytes);
-		if (bytes > 0) {
-			debug_info("sent %d bytes", bytes);
-			debug_plist(plist);
-			if (bytes == length) {
-				res = PROPERTY_LIST_SERVICE_E_SUCCESS;
-			} else {
-				debug_info("ERROR: Could not send all data (%d of %d)!", bytes, length);
-			}
+	trace_event(IDEVICE_TRACE_OP_START, binary, (uintptr_t)client->parent, length);
+	idevice_iovec_t iov[2];
+	iov[0].data = (char*)&nlen;
+	iov[0].len = sizeof(nlen);
+	iov[1].data = content;
+	iov[1].len = length;
+	service_sendv(client->parent, iov, 2, &bytes);
+	if (bytes > sizeof(nlen)) {
+		bytes -= sizeof(nlen);
+		debug_info("sent %d bytes", bytes);
+		debug_plist(plist);
+		if (bytes == length) {
+			res = PROPERTY_LIST_SERVICE_E_SUCCESS;
+		} else {
+			debug_info("ERROR: Could not send all data (%d of %d)!", bytes, length);
 		}
+	} else {
+		bytes = 0;
 	}
 	if (bytes <= 0) {
 		debug_info("ERROR: sending to device failed.");
 		res = PROPERTY_LIST_SERVICE_E_MUX_ERROR;
 	}
 
+	PROBE4(plist__send, IDEVICE_CONNECTION_UDID(client->parent->connection), length, binary, res);
 	free(content);
 	return res;
 }
@@ -163,34 +197,75 @@ LIBIMOBILEDEVICE_API property_list_service_error_t property_list_service_send_bi
 }
 
 /**
- * Receives a plist using the given property list service client.
- * Internally used generic plist receive function.
+ * Replaces control characters other than tab, line feed and carriage return
+ * with spaces. Chunks without such characters are only scanned, not written.
+ *
+ * @param data The XML data to sanitize
+ * @param len Number of bytes to process
+ */
+static void internal_plist_xml_sanitize(char *data, uint32_t len)
+{
+	uint32_t i = 0;
+
+#if defined(__SSE2__)
+	const __m128i space = _mm_set1_epi8(0x20);
+	const __m128i minus1 = _mm_set1_epi8(-1);
+	const __m128i tab = _mm_set1_epi8(0x09);
+	const __m128i lf = _mm_set1_epi8(0x0a);
+	const __m128i cr = _mm_set1_epi8(0x0d);
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(data + i));
+		/* signed compare, bytes >= 0x80 are not control characters */
+		__m128i ctrl = _mm_and_si128(_mm_cmplt_epi8(v, space), _mm_cmpgt_epi8(v, minus1));
+		__m128i keep = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, tab), _mm_cmpeq_epi8(v, lf)), _mm_cmpeq_epi8(v, cr));
+		__m128i bad = _mm_andnot_si128(keep, ctrl);
+		if (_mm_movemask_epi8(bad)) {
+			v = _mm_or_si128(_mm_andnot_si128(bad, v), _mm_and_si128(bad, space));
+			_mm_storeu_si128((__m128i*)(data + i), v);
+		}
+	}
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+	const uint8x16_t space = vdupq_n_u8(0x20);
+	const uint8x16_t tab = vdupq_n_u8(0x09);
+	const uint8x16_t lf = vdupq_n_u8(0x0a);
+	const uint8x16_t cr = vdupq_n_u8(0x0d);
+	for (; i + 16 <= len; i += 16) {
+		uint8x16_t v = vld1q_u8((const uint8_t*)(data + i));
+		uint8x16_t ctrl = vcltq_u8(v, space);
+		uint8x16_t keep = vorrq_u8(vorrq_u8(vceqq_u8(v, tab), vceqq_u8(v, lf)), vceqq_u8(v, cr));
+		uint8x16_t bad = vbicq_u8(ctrl, keep);
+		uint64x2_t bad64 = vreinterpretq_u64_u8(bad);
+		if (vgetq_lane_u64(bad64, 0) | vgetq_lane_u64(bad64, 1)) {
+			vst1q_u8((uint8_t*)(data + i), vbslq_u8(bad, space, v));
+		}
+	}
+#endif
+	for (; i < len; i++) {
+		if ((data[i] >= 0) && (data[i] < 0x20) && (data[i] != 0x09) && (data[i] != 0x0a) && (data[i] != 0x0d))
+			data[i] = 0x20;
+	}
+}
+
+/**
+ * Receives the data of a single message into the receive buffer of the
+ * client. The buffer grows as needed and is reused for the next message.
  *
  * @param client The property list service client to use for receiving
- * @param plist pointer to a plist_t that will point to the received plist
- *      upon successful return
+ * @param length Set to the length of the received message
  * @param timeout Maximum time in milliseconds to wait for data.
  *
  * @return PROPERTY_LIST_SERVICE_E_SUCCESS on success,
- *      PROPERTY_LIST_SERVICE_E_INVALID_ARG when client or *plist is NULL,
- *      PROPERTY_LIST_SERVICE_E_NOT_ENOUGH_DATA when not enough data
- *      received, PROPERTY_LIST_SERVICE_E_RECEIVE_TIMEOUT when the connection times out,
- *      PROPERTY_LIST_SERVICE_E_PLIST_ERROR when the received data cannot be
- *      converted to a plist, PROPERTY_LIST_SERVICE_E_MUX_ERROR when a
- *      communication error occurs, or PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR
- *      when an unspecified error occurs.
+ *      PROPERTY_LIST_SERVICE_E_RECEIVE_TIMEOUT when the connection times out,
+ *      PROPERTY_LIST_SERVICE_E_PLIST_ERROR when the announced message size
+ *      exceeds the maximum message size, or an error code from the
+ *      underlying service otherwise.
  */
-static property_list_service_error_t internal_plist_receive_timeout(property_list_service_client_t client, plist_t *plist, unsigned int timeout)
+static property_list_service_error_t internal_plist_receive_data(property_list_service_client_t client, uint32_t *length, unsigned int timeout)
 {
 	property_list_service_error_t res = PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR;
 	uint32_t pktlen = 0;
 	uint32_t bytes = 0;
 
-	if (!client || (client && !client->parent) || !plist) {
-		return PROPERTY_LIST_SERVICE_E_INVALID_ARG;
-	}
-
-	*plist = NULL;
 	service_error_t serr = service_receive_with_timeout(client->parent, (char*)&pktlen, sizeof(pktlen), &bytes, timeout);
 	if (serr != SERVICE_E_SUCCESS) {
 		debug_info("initial read failed!");
@@ -204,19 +279,43 @@ static property_list_service_error_t internal_plist_receive_timeout(property_lis
 
 	debug_info("initial read=%i", bytes);
 
-	uint32_t curlen = 0;
-	char *content = NULL;
-
 	pktlen = be32toh(pktlen);
 	debug_info("%d bytes following", pktlen);
-	content = (char*)malloc(pktlen);
-	if (!content) {
-		debug_info("out of memory when allocating %d bytes", pktlen);
-		return PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR;
+	trace_event(IDEVICE_TRACE_OP_END, 0, (uintptr_t)client->parent, pktlen);
+
+	if (client->max_message_size > 0 && pktlen > client->max_message_size) {
+		debug_info("ERROR: message size %u exceeds the maximum of %u bytes", pktlen, client->max_message_size);
+		return PROPERTY_LIST_SERVICE_E_PLIST_ERROR;
 	}
 
+	/* grow geometrically, but don't keep a huge buffer around for small messages */
+	uint32_t newsize = client->recv_buffer_size;
+	if (pktlen > newsize) {
+		if (newsize < PROPERTY_LIST_SERVICE_RECV_BUFFER_INITIAL_SIZE) {
+			newsize = PROPERTY_LIST_SERVICE_RECV_BUFFER_INITIAL_SIZE;
+		}
+		while (newsize < pktlen && newsize <= UINT32_MAX / 2) {
+			newsize *= 2;
+		}
+		if (newsize < pktlen) {
+			newsize = pktlen;
+		}
+	} else if (newsize > PROPERTY_LIST_SERVICE_RECV_BUFFER_KEEP_SIZE && pktlen <= PROPERTY_LIST_SERVICE_RECV_BUFFER_KEEP_SIZE) {
+		newsize = PROPERTY_LIST_SERVICE_RECV_BUFFER_KEEP_SIZE;
+	}
+	if (newsize != client->recv_buffer_size) {
+		char *newbuf = (char*)idevice_memory_realloc(client->parent->connection->arena, client->recv_buffer, newsize);
+		if (!newbuf) {
+			debug_info("out of memory when allocating %d bytes", newsize);
+			return PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR;
+		}
+		client->recv_buffer = newbuf;
+		client->recv_buffer_size = newsize;
+	}
+
+	uint32_t curlen = 0;
 	while (curlen < pktlen) {
-		serr = service_receive(client->parent, content+curlen, pktlen-curlen, &bytes);
+		serr = service_receive_with_timeout(client->parent, client->recv_buffer+curlen, pktlen-curlen, &bytes, SERVICE_DEFAULT_TIMEOUT);
 		if (serr != SERVICE_E_SUCCESS) {
 			res = service_to_property_list_service_error(serr);
 			break;
@@ -229,20 +328,30 @@ static property_list_service_error_t internal_plist_receive_timeout(property_lis
 		debug_info("received incomplete packet (%d of %d bytes)", curlen, pktlen);
 		if (curlen > 0) {
 			debug_info("incomplete packet following:");
-			debug_buffer(content, curlen);
+			debug_buffer(client->recv_buffer, curlen);
 		}
-		free(content);
 		return res;
 	}
 
+	*length = pktlen;
+
+	return PROPERTY_LIST_SERVICE_E_SUCCESS;
+}
+
+/**
+ * Parses a received binary or XML plist. XML data is sanitized in place.
+ *
+ * @return PROPERTY_LIST_SERVICE_E_SUCCESS on success or
+ *      PROPERTY_LIST_SERVICE_E_PLIST_ERROR if the data is not a valid plist.
+ */
+static property_list_service_error_t internal_plist_parse(char *content, uint32_t pktlen, plist_t *plist)
+{
+	*plist = NULL;
 	if ((pktlen > 8) && !memcmp(content, "bplist00", 8)) {
 		plist_from_bin(content, pktlen, plist);
 	} else if ((pktlen > 5) && !memcmp(content, "<?xml", 5)) {
 		/* iOS 4.3+ hack: plist data might contain invalid characters, thus we convert those to spaces */
-		for (bytes = 0; bytes < pktlen-1; bytes++) {
-			if ((content[bytes] >= 0) && (content[bytes] < 0x20) && (content[bytes] != 0x09) && (content[bytes] != 0x0a) && (content[bytes] != 0x0d))
-				content[bytes] = 0x20;
-		}
+		internal_plist_xml_sanitize(content, pktlen-1);
 		plist_from_xml(content, pktlen, plist);
 	} else {
 		debug_info("WARNING: received unexpected non-plist content");
@@ -251,13 +360,48 @@ static property_list_service_error_t internal_plist_receive_timeout(property_lis
 
 	if (*plist) {
 		debug_plist(*plist);
-		res = PROPERTY_LIST_SERVICE_E_SUCCESS;
-	} else {
-		res = PROPERTY_LIST_SERVICE_E_PLIST_ERROR;
+		return PROPERTY_LIST_SERVICE_E_SUCCESS;
 	}
+	return PROPERTY_LIST_SERVICE_E_PLIST_ERROR;
+}
 
-	free(content);
-	content = NULL;
+/**
+ * Receives a plist using the given property list service client.
+ * Internally used generic plist receive function.
+ *
+ * @param client The property list service client to use for receiving
+ * @param plist pointer to a plist_t that will point to the received plist
+ *      upon successful return
+ * @param timeout Maximum time in milliseconds to wait for data.
+ *
+ * @return PROPERTY_LIST_SERVICE_E_SUCCESS on success,
+ *      PROPERTY_LIST_SERVICE_E_INVALID_ARG when client or *plist is NULL,
+ *      PROPERTY_LIST_SERVICE_E_NOT_ENOUGH_DATA when not enough data
+ *      received, PROPERTY_LIST_SERVICE_E_RECEIVE_TIMEOUT when the connection times out,
+ *      PROPERTY_LIST_SERVICE_E_PLIST_ERROR when the received data cannot be
+ *      converted to a plist, PROPERTY_LIST_SERVICE_E_MUX_ERROR when a
+ *      communication error occurs, or PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR
+ *      when an unspecified error occurs.
+ */
+static property_list_service_error_t internal_plist_receive_timeout(property_list_service_client_t client, plist_t *plist, unsigned int timeout)
+{
+	property_list_service_error_t res = PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR;
+	uint32_t pktlen = 0;
+
+	if (!client || (client && !client->parent) || !plist) {
+		return PROPERTY_LIST_SERVICE_E_INVALID_ARG;
+	}
+
+	*plist = NULL;
+	PROBE2(plist__receive__start, IDEVICE_CONNECTION_UDID(client->parent->connection), timeout);
+	res = internal_plist_receive_data(client, &pktlen, timeout);
+	if (res != PROPERTY_LIST_SERVICE_E_SUCCESS) {
+		PROBE3(plist__receive__done, IDEVICE_CONNECTION_UDID(client->parent->connection), 0, res);
+		return res;
+	}
+
+	res = internal_plist_parse(client->recv_buffer, pktlen, plist);
+	PROBE3(plist__receive__done, IDEVICE_CONNECTION_UDID(client->parent->connection), pktlen, res);
 
 	return res;
 }
@@ -267,9 +411,436 @@ LIBIMOBILEDEVICE_API property_list_service_error_t property_list_service_receive
 	return internal_plist_receive_timeout(client, plist, timeout);
 }
 
+/*
+ * Minimal reader for binary plists that looks up top-level dictionary
+ * entries in place, see property_list_message_get_string().
+ */
+#define BPLIST_MAGIC "bplist00"
+#define BPLIST_MAGIC_LEN 8
+#define BPLIST_TRAILER_SIZE 32
+
+struct bplist_reader {
+	const uint8_t *data;
+	uint64_t objects_end;
+	uint8_t offset_size;
+	uint8_t ref_size;
+	uint64_t num_objects;
+	uint64_t top_object;
+	uint64_t offset_table;
+};
+
+static uint64_t bplist_read_be(const uint8_t *p, uint8_t size)
+{
+	uint64_t v = 0;
+	while (size--) {
+		v = (v << 8) | *p++;
+	}
+	return v;
+}
+
+/**
+ * @return 0 if the trailer and offset table are plausible, -1 otherwise.
+ */
+static int bplist_reader_init(struct bplist_reader *r, const char *data, uint32_t length)
+{
+	if (length < BPLIST_MAGIC_LEN + BPLIST_TRAILER_SIZE || memcmp(data, BPLIST_MAGIC, BPLIST_MAGIC_LEN) != 0)
+		return -1;
+
+	const uint8_t *trailer = (const uint8_t*)data + length - BPLIST_TRAILER_SIZE;
+	r->data = (const uint8_t*)data;
+	r->offset_size = trailer[6];
+	r->ref_size = trailer[7];
+	r->num_objects = bplist_read_be(trailer + 8, 8);
+	r->top_object = bplist_read_be(trailer + 16, 8);
+	r->offset_table = bplist_read_be(trailer + 24, 8);
+
+	if (r->offset_size < 1 || r->offset_size > 8 || r->ref_size < 1 || r->ref_size > 8)
+		return -1;
+	if (r->top_object >= r->num_objects || r->offset_table < BPLIST_MAGIC_LEN)
+		return -1;
+	uint64_t table_end = length - BPLIST_TRAILER_SIZE;
+	if (r->offset_table > table_end || r->num_objects > (table_end - r->offset_table) / r->offset_size)
+		return -1;
+	r->objects_end = r->offset_table;
+
+	return 0;
+}
+
+/**
+ * Gets the offset and marker of an object and the position after the
+ * marker.
+ */
+static int bplist_object(struct bplist_reader *r, uint64_t index, uint8_t *marker, uint64_t *pos)
+{
+	if (index >= r->num_objects)
+		return -1;
+	uint64_t offset = bplist_read_be(r->data + r->offset_table + index * r->offset_size, r->offset_size);
+	if (offset < BPLIST_MAGIC_LEN || offset >= r->objects_end)
+		return -1;
+	*marker = r->data[offset];
+	*pos = offset + 1;
+	return 0;
+}
+
+/**
+ * Reads the element count of an object, which follows the marker as an
+ * integer object when it doesn't fit into the marker itself.
+ */
+static int bplist_object_count(struct bplist_reader *r, uint8_t marker, uint64_t *pos, uint64_t *count)
+{
+	if ((marker & 0x0F) != 0x0F) {
+		*count = marker & 0x0F;
+		return 0;
+	}
+	if (*pos >= r->objects_end || (r->data[*pos] & 0xF0) != 0x10)
+		return -1;
+	uint8_t size = 1 << (r->data[*pos] & 0x0F);
+	if (size > 8 || r->objects_end - *pos - 1 < size)
+		return -1;
+	*count = bplist_read_be(r->data + *pos + 1, size);
+	*pos += 1 + size;
+	return 0;
+}
+
+static int bplist_string_equals(struct bplist_reader *r, uint64_t index, const char *key, size_t key_len)
+{
+	uint8_t marker = 0;
+	uint64_t pos = 0;
+	uint64_t count = 0;
+	uint64_t i;
+
+	if (bplist_object(r, index, &marker, &pos) < 0 || bplist_object_count(r, marker, &pos, &count) < 0)
+		return -1;
+	if (count != key_len)
+		return 0;
+	switch (marker & 0xF0) {
+	case 0x50:
+		if (r->objects_end - pos < count)
+			return -1;
+		return (memcmp(r->data + pos, key, key_len) == 0);
+	case 0x60:
+		if ((r->objects_end - pos) / 2 < count)
+			return -1;
+		for (i = 0; i < count; i++) {
+			if (bplist_read_be(r->data + pos + i * 2, 2) != (uint8_t)key[i])
+				return 0;
+		}
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/**
+ * Finds the value of a key in the top-level dictionary.
+ *
+ * @return 1 if found, 0 if the key doesn't exist, -1 if the data can't be
+ *     handled here.
+ */
+static int bplist_dict_lookup(struct bplist_reader *r, const char *key, uint8_t *marker, uint64_t *pos)
+{
+	uint8_t dict_marker = 0;
+	uint64_t refs = 0;
+	uint64_t count = 0;
+	uint64_t i;
+	size_t key_len = strlen(key);
+
+	if (bplist_object(r, r->top_object, &dict_marker, &refs) < 0 || (dict_marker & 0xF0) != 0xD0)
+		return -1;
+	if (bplist_object_count(r, dict_marker, &refs, &count) < 0)
+		return -1;
+	if ((r->objects_end - refs) / (2 * r->ref_size) < count)
+		return -1;
+
+	for (i = 0; i < count; i++) {
+		uint64_t key_index = bplist_read_be(r->data + refs + i * r->ref_size, r->ref_size);
+		int match = bplist_string_equals(r, key_index, key, key_len);
+		if (match < 0)
+			return -1;
+		if (match) {
+			uint64_t value_index = bplist_read_be(r->data + refs + (count + i) * r->ref_size, r->ref_size);
+			return (bplist_object(r, value_index, marker, pos) < 0) ? -1 : 1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Receives a message without building the node tree of binary plists.
+ * The message has to be freed with property_list_message_free().
+ *
+ * @return PROPERTY_LIST_SERVICE_E_SUCCESS on success or an error value
+ *      like property_list_service_receive_plist_with_timeout().
+ */
+property_list_service_error_t property_list_service_receive_message(property_list_service_client_t client, struct property_list_message *message, unsigned int timeout)
+{
+	struct bplist_reader reader;
+	uint32_t pktlen = 0;
+
+	if (!client || !client->parent || !message)
+		return PROPERTY_LIST_SERVICE_E_INVALID_ARG;
+
+	memset(message, '\0', sizeof(struct property_list_message));
+
+	PROBE2(plist__receive__start, IDEVICE_CONNECTION_UDID(client->parent->connection), timeout);
+	property_list_service_error_t res = internal_plist_receive_data(client, &pktlen, timeout);
+	if (res != PROPERTY_LIST_SERVICE_E_SUCCESS) {
+		PROBE3(plist__receive__done, IDEVICE_CONNECTION_UDID(client->parent->connection), 0, res);
+		return res;
+	}
+
+	if (bplist_reader_init(&reader, client->recv_buffer, pktlen) == 0) {
+		/* keep the binary data, most lookups can be answered from it */
+		message->data = (char*)idevice_memory_alloc(client->parent->connection->arena, pktlen);
+		if (message->data) {
+			memcpy(message->data, client->recv_buffer, pktlen);
+			message->length = pktlen;
+			PROBE3(plist__receive__done, IDEVICE_CONNECTION_UDID(client->parent->connection), pktlen, res);
+			return PROPERTY_LIST_SERVICE_E_SUCCESS;
+		}
+	}
+
+	res = internal_plist_parse(client->recv_buffer, pktlen, &message->plist);
+	PROBE3(plist__receive__done, IDEVICE_CONNECTION_UDID(client->parent->connection), pktlen, res);
+
+	return res;
+}
+
+/**
+ * Gets the plist of a message, parsing it if that didn't happen yet.
+ *
+ * @return The plist owned by the message, or NULL if it is invalid.
+ */
+plist_t property_list_message_get_plist(struct property_list_message *message)
+{
+	if (!message->plist && message->data) {
+		plist_from_bin(message->data, message->length, &message->plist);
+		if (message->plist) {
+			debug_plist(message->plist);
+		}
+		idevice_memory_free(message->data);
+		message->data = NULL;
+		message->length = 0;
+	}
+	return message->plist;
+}
+
+/**
+ * Finds a top-level key in the binary message data. Falls back to a full
+ * parse if the data can't be handled in place.
+ *
+ * @return 1 if found in the binary data, 0 if the key doesn't exist, -1 if
+ *     the key has to be looked up in the parsed plist.
+ */
+static int property_list_message_lookup(struct property_list_message *message, const char *key, struct bplist_reader *reader, uint8_t *marker, uint64_t *pos)
+{
+	if (message->data) {
+		int found = -1;
+		if (bplist_reader_init(reader, message->data, message->length) == 0) {
+			found = bplist_dict_lookup(reader, key, marker, pos);
+		}
+		if (found >= 0)
+			return found;
+		property_list_message_get_plist(message);
+	}
+	return -1;
+}
+
+/**
+ * Gets a copy of a top-level string value of a message.
+ *
+ * @return 1 if the key exists and is a string, 0 otherwise.
+ */
+int property_list_message_get_string(struct property_list_message *message, const char *key, char **value)
+{
+	struct bplist_reader reader;
+	uint8_t marker = 0;
+	uint64_t pos = 0;
+	uint64_t count = 0;
+
+	*value = NULL;
+	int found = property_list_message_lookup(message, key, &reader, &marker, &pos);
+	if (found == 0)
+		return 0;
+	if (found > 0 && (marker & 0xF0) == 0x50) {
+		if (bplist_object_count(&reader, marker, &pos, &count) == 0 && count <= reader.objects_end - pos) {
+			*value = (char*)malloc(count + 1);
+			if (*value) {
+				memcpy(*value, reader.data + pos, count);
+				(*value)[count] = '\0';
+				return 1;
+			}
+		}
+		return 0;
+	}
+	if (found > 0) {
+		/* not an ASCII string, let libplist convert it */
+		property_list_message_get_plist(message);
+	}
+
+	plist_t node = plist_dict_get_item(message->plist, key);
+	if (!node || plist_get_node_type(node) != PLIST_STRING)
+		return 0;
+	plist_get_string_val(node, value);
+	return (*value) ? 1 : 0;
+}
+
+/**
+ * Gets a top-level integer value of a message.
+ *
+ * @return 1 if the key exists and is an integer, 0 otherwise.
+ */
+int property_list_message_get_uint(struct property_list_message *message, const char *key, uint64_t *value)
+{
+	struct bplist_reader reader;
+	uint8_t marker = 0;
+	uint64_t pos = 0;
+
+	*value = 0;
+	int found = property_list_message_lookup(message, key, &reader, &marker, &pos);
+	if (found == 0)
+		return 0;
+	if (found > 0) {
+		uint8_t size = 1 << (marker & 0x0F);
+		if ((marker & 0xF0) != 0x10 || size > 8 || reader.objects_end - pos < size)
+			return 0;
+		*value = bplist_read_be(reader.data + pos, size);
+		return 1;
+	}
+
+	plist_t node = plist_dict_get_item(message->plist, key);
+	if (!node || plist_get_node_type(node) != PLIST_UINT)
+		return 0;
+	plist_get_uint_val(node, value);
+	return 1;
+}
+
+/**
+ * Frees the data and plist of a message.
+ */
+void property_list_message_free(struct property_list_message *message)
+{
+	if (!message)
+		return;
+	plist_free(message->plist);
+	message->plist = NULL;
+	idevice_memory_free(message->data);
+	message->data = NULL;
+	message->length = 0;
+}
+
+LIBIMOBILEDEVICE_API property_list_service_error_t property_list_service_receive_raw_with_timeout(property_list_service_client_t client, const char **data, uint32_t *length, unsigned int timeout)
+{
+	if (!client || !client->parent || !data || !length)
+		return PROPERTY_LIST_SERVICE_E_INVALID_ARG;
+
+	*data = NULL;
+	*length = 0;
+
+	property_list_service_error_t res = internal_plist_receive_data(client, length, timeout);
+	if (res == PROPERTY_LIST_SERVICE_E_SUCCESS) {
+		*data = client->recv_buffer;
+	}
+
+	return res;
+}
+
+LIBIMOBILEDEVICE_API property_list_service_error_t property_list_service_receive_plist_data(property_list_service_client_t client, plist_t *plist, const char *key, const char **data, uint64_t *length, unsigned int timeout)
+{
+	if (!client || !client->parent || !plist || !key || !data || !length)
+		return PROPERTY_LIST_SERVICE_E_INVALID_ARG;
+
+	*data = NULL;
+	*length = 0;
+
+	property_list_service_error_t res = internal_plist_receive_timeout(client, plist, timeout);
+	if (res != PROPERTY_LIST_SERVICE_E_SUCCESS) {
+		return res;
+	}
+
+	plist_t node = (plist_get_node_type(*plist) == PLIST_DICT) ? plist_dict_get_item(*plist, key) : NULL;
+	if (!node || plist_get_node_type(node) != PLIST_DATA) {
+		debug_info("no data node for key %s in received plist", key);
+		plist_free(*plist);
+		*plist = NULL;
+		return PROPERTY_LIST_SERVICE_E_PLIST_ERROR;
+	}
+
+	*data = plist_get_data_ptr(node, length);
+
+	return PROPERTY_LIST_SERVICE_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API property_list_service_error_t property_list_service_set_max_message_size(property_list_service_client_t client, uint32_t size)
+{
+	if (!client)
+		return PROPERTY_LIST_SERVICE_E_INVALID_ARG;
+
+	client->max_message_size = size;
+
+	return PROPERTY_LIST_SERVICE_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API property_list_service_error_t property_list_service_set_timeout_policy(property_list_service_client_t client, const char *op_class, const service_timeout_policy_t *policy)
+{
+	if (!client)
+		return PROPERTY_LIST_SERVICE_E_INVALID_ARG;
+
+	return service_to_property_list_service_error(service_client_set_timeout_policy(client->parent, op_class, policy));
+}
+
 LIBIMOBILEDEVICE_API property_list_service_error_t property_list_service_receive_plist(property_list_service_client_t client, plist_t *plist)
 {
-	return internal_plist_receive_timeout(client, plist, 30000);
+	if (!client || !client->parent)
+		return PROPERTY_LIST_SERVICE_E_INVALID_ARG;
+
+	property_list_service_error_t res = internal_plist_receive_timeout(client, plist, service_client_default_timeout(client->parent, SERVICE_DEFAULT_TIMEOUT));
+	if (res == PROPERTY_LIST_SERVICE_E_RECEIVE_TIMEOUT) {
+		service_client_timeout_expired(client->parent);
+	}
+	return res;
+}
+
+LIBIMOBILEDEVICE_API property_list_service_error_t property_list_service_send_receive_pipelined(property_list_service_client_t client, property_list_service_request_t *requests, unsigned int count, int binary, unsigned int window, unsigned int timeout)
+{
+	if (!client || !client->parent || (count > 0 && !requests))
+		return PROPERTY_LIST_SERVICE_E_INVALID_ARG;
+
+	property_list_service_error_t res = PROPERTY_LIST_SERVICE_E_SUCCESS;
+	unsigned int sent = 0;
+	unsigned int received = 0;
+
+	if (window == 0) {
+		window = PROPERTY_LIST_SERVICE_PIPELINE_WINDOW;
+	}
+
+	while (received < count) {
+		/* keep a limited number of requests in flight */
+		while (sent < count && sent - received < window) {
+			res = internal_plist_send(client, requests[sent].request, binary);
+			if (res != PROPERTY_LIST_SERVICE_E_SUCCESS) {
+				debug_info("sending request %u failed: %d", sent, res);
+				return res;
+			}
+			sent++;
+		}
+
+		plist_t response = NULL;
+		res = internal_plist_receive_timeout(client, &response, timeout);
+		if (res != PROPERTY_LIST_SERVICE_E_SUCCESS) {
+			debug_info("receiving response %u failed: %d", received, res);
+			return res;
+		}
+
+		if (requests[received].callback) {
+			requests[received].callback(response, requests[received].user_data);
+		}
+		plist_free(response);
+		received++;
+	}
+
+	return PROPERTY_LIST_SERVICE_E_SUCCESS;
 }
 
 LIBIMOBILEDEVICE_API property_list_service_error_t property_list_service_enable_ssl(property_list_service_client_t client)
@@ -286,3 +857,10 @@ LIBIMOBILEDEVICE_API property_list_service_error_t property_list_service_disable
 	return service_to_property_list_service_error(service_disable_ssl(client->parent));
 }
 
+LIBIMOBILEDEVICE_API property_list_service_error_t property_list_service_get_service_client(property_list_service_client_t client, service_client_t *service_client)
+{
+	if (!client || !client->parent || !service_client)
+		return PROPERTY_LIST_SERVICE_E_INVALID_ARG;
+	*service_client = client->parent;
+	return PROPERTY_LIST_SERVICE_E_SUCCESS;
+}
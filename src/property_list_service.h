@@ -27,6 +27,28 @@
 
 struct property_list_service_client_private {
 	service_client_t parent;
+	char *recv_buffer;
+	uint32_t recv_buffer_size;
+	uint32_t max_message_size;
 };
 
+/*
+ * A received message of which only the needed keys are extracted. Binary
+ * plists are kept as data and top-level keys are read from it directly;
+ * the node tree is only built when property_list_message_get_plist() is
+ * called or the data can't be handled in place. XML plists are parsed
+ * right away.
+ */
+struct property_list_message {
+	plist_t plist;
+	char *data;
+	uint32_t length;
+};
+
+property_list_service_error_t property_list_service_receive_message(property_list_service_client_t client, struct property_list_message *message, unsigned int timeout);
+plist_t property_list_message_get_plist(struct property_list_message *message);
+int property_list_message_get_string(struct property_list_message *message, const char *key, char **value);
+int property_list_message_get_uint(struct property_list_message *message, const char *key, uint64_t *value);
+void property_list_message_free(struct property_list_message *message);
+
 #endif
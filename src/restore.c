@@ -118,6 +118,8 @@ LIBIMOBILEDEVICE_API restored_error_t restored_client_free(restored_client_t cli
 
 	restored_error_t ret = RESTORE_E_UNKNOWN_ERROR;
 
+	restored_stop_monitoring(client);
+
 	if (client->parent) {
 		restored_goodbye(client);
 
@@ -318,6 +320,7 @@ LIBIMOBILEDEVICE_API restored_error_t restored_client_new(idevice_t device, rest
 	client_loc->udid = NULL;
 	client_loc->label = NULL;
 	client_loc->info = NULL;
+	client_loc->monitor = NULL;
 	if (label != NULL)
 		client_loc->label = strdup(label);
 
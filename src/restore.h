@@ -27,11 +27,22 @@
 #include "libimobiledevice/restore.h"
 #include "property_list_service.h"
 
+/* monitors the messages of a client on the shared monitor thread */
+struct restored_monitor {
+	restored_client_t client;
+	int fd;
+	int pfd_index;
+	restored_message_cb_t callback;
+	void *user_data;
+	struct restored_monitor *next;
+};
+
 struct restored_client_private {
 	property_list_service_client_t parent;
 	char *udid;
 	char *label;
 	plist_t info;
+	struct restored_monitor *monitor;
 };
 
 #endif
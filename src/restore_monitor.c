@@ -0,0 +1,342 @@
+/*
+ * restore_monitor.c
+ * Receives the messages of many restore mode devices from a single thread.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#ifdef WIN32
+#include <winsock2.h>
+#include <windows.h>
+#define poll WSAPoll
+#else
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#endif
+#include <plist/plist.h>
+
+#include "restore.h"
+#include "idevice.h"
+#include "common/debug.h"
+#include "common/thread.h"
+
+#ifdef WIN32
+/* there is no pollable wakeup pipe, pick up changes periodically instead */
+#define RESTORED_MONITOR_MAX_WAIT 1000
+#endif
+
+static struct {
+	mutex_t mutex;
+	THREAD_T thread;
+	int running;
+	struct restored_monitor *monitors;
+#ifndef WIN32
+	int wakeup[2];
+#endif
+} restored_monitoring;
+static thread_once_t restored_monitoring_once = THREAD_ONCE_INIT;
+
+static void restored_monitoring_init(void)
+{
+	mutex_init(&restored_monitoring.mutex);
+	restored_monitoring.thread = THREAD_T_NULL;
+#ifndef WIN32
+	if (pipe(restored_monitoring.wakeup) == 0) {
+		fcntl(restored_monitoring.wakeup[0], F_SETFL, O_NONBLOCK);
+		fcntl(restored_monitoring.wakeup[1], F_SETFL, O_NONBLOCK);
+	} else {
+		restored_monitoring.wakeup[0] = restored_monitoring.wakeup[1] = -1;
+	}
+#endif
+}
+
+/* makes the monitor thread pick up added or removed clients */
+static void restored_monitoring_wakeup(void)
+{
+#ifndef WIN32
+	if (restored_monitoring.wakeup[1] >= 0) {
+		char c = 0;
+		if (write(restored_monitoring.wakeup[1], &c, 1) < 0) {
+			/* the pipe is full, so the thread wakes up anyway */
+		}
+	}
+#endif
+}
+
+/**
+ * Fills in the fields of a message that depend on its MsgType.
+ */
+static void restored_message_decode(plist_t node, restored_message_t *message)
+{
+	plist_t item;
+
+	memset(message, '\0', sizeof(restored_message_t));
+	message->type = RESTORED_MESSAGE_OTHER;
+	message->progress = -1;
+	message->message = node;
+
+	item = plist_dict_get_item(node, "MsgType");
+	if (plist_get_node_type(item) != PLIST_STRING) {
+		return;
+	}
+	message->msg_type = plist_get_string_ptr(item, NULL);
+
+	if (!strcmp(message->msg_type, "ProgressMsg")) {
+		uint64_t value = 0;
+		message->type = RESTORED_MESSAGE_PROGRESS;
+		item = plist_dict_get_item(node, "Operation");
+		if (plist_get_node_type(item) == PLIST_UINT) {
+			plist_get_uint_val(item, &message->operation);
+		}
+		item = plist_dict_get_item(node, "Progress");
+		if (plist_get_node_type(item) == PLIST_UINT) {
+			plist_get_uint_val(item, &value);
+			if (value <= 100) {
+				message->progress = (int)value;
+			}
+		}
+	} else if (!strcmp(message->msg_type, "StatusMsg")) {
+		message->type = RESTORED_MESSAGE_STATUS;
+		item = plist_dict_get_item(node, "Status");
+		if (plist_get_node_type(item) == PLIST_UINT) {
+			plist_get_uint_val(item, &message->status);
+		}
+	} else if (!strcmp(message->msg_type, "DataRequestMsg")) {
+		message->type = RESTORED_MESSAGE_DATA_REQUEST;
+		item = plist_dict_get_item(node, "DataType");
+		if (plist_get_node_type(item) == PLIST_STRING) {
+			message->data_type = plist_get_string_ptr(item, NULL);
+		}
+	}
+}
+
+/**
+ * Delivers all messages that arrived on the connection of a client.
+ *
+ * @return 0 on success or -1 if the connection failed.
+ */
+static int restored_monitor_read(struct restored_monitor *monitor)
+{
+	property_list_service_client_t parent = monitor->client->parent;
+	restored_message_t message;
+
+	do {
+		plist_t node = NULL;
+		/* the connection is readable, so the timeout doesn't matter here */
+		property_list_service_error_t perr = property_list_service_receive_plist_with_timeout(parent, &node, 1);
+		if (perr == PROPERTY_LIST_SERVICE_E_RECEIVE_TIMEOUT) {
+			break;
+		} else if (perr != PROPERTY_LIST_SERVICE_E_SUCCESS || !node) {
+			debug_info("could not receive plist from %s, error %d", monitor->client->udid, perr);
+			plist_free(node);
+			memset(&message, '\0', sizeof(restored_message_t));
+			message.type = RESTORED_MESSAGE_DISCONNECTED;
+			message.progress = -1;
+			monitor->callback(monitor->client, &message, monitor->user_data);
+			return -1;
+		}
+		restored_message_decode(node, &message);
+		monitor->callback(monitor->client, &message, monitor->user_data);
+		plist_free(node);
+		/* decrypted data can be pending that the fd doesn't report */
+	} while (parent->parent->connection->ssl_data);
+
+	return 0;
+}
+
+static void* restored_monitoring_thread(void* arg)
+{
+	struct pollfd *pfds = NULL;
+	unsigned int pfds_size = 0;
+
+	debug_info("Running");
+
+	while (1) {
+		struct restored_monitor *monitor;
+		unsigned int n = 0;
+		unsigned int first = 0;
+
+		mutex_lock(&restored_monitoring.mutex);
+		if (!restored_monitoring.monitors) {
+			/* started again by the next restored_start_monitoring() */
+			restored_monitoring.running = 0;
+			mutex_unlock(&restored_monitoring.mutex);
+			break;
+		}
+		for (monitor = restored_monitoring.monitors; monitor; monitor = monitor->next) {
+			n++;
+		}
+		n++;
+		if (n > pfds_size) {
+			struct pollfd *newpfds = (struct pollfd*)realloc(pfds, sizeof(struct pollfd) * n);
+			if (!newpfds) {
+				mutex_unlock(&restored_monitoring.mutex);
+				debug_info("ERROR: out of memory");
+				poll(NULL, 0, 1000);
+				continue;
+			}
+			pfds = newpfds;
+			pfds_size = n;
+		}
+		n = 0;
+#ifndef WIN32
+		if (restored_monitoring.wakeup[0] >= 0) {
+			pfds[n].fd = restored_monitoring.wakeup[0];
+			pfds[n].events = POLLIN;
+			pfds[n].revents = 0;
+			n++;
+			first = n;
+		}
+#endif
+		for (monitor = restored_monitoring.monitors; monitor; monitor = monitor->next) {
+			pfds[n].fd = monitor->fd;
+			pfds[n].events = POLLIN;
+			pfds[n].revents = 0;
+			monitor->pfd_index = n++;
+		}
+		mutex_unlock(&restored_monitoring.mutex);
+
+#ifdef WIN32
+		int timeout = RESTORED_MONITOR_MAX_WAIT;
+#else
+		int timeout = (restored_monitoring.wakeup[0] >= 0) ? -1 : 1000;
+#endif
+		int ready = poll(pfds, n, timeout);
+		if (ready < 0) {
+			if (errno != EINTR)
+				debug_info("poll failed: %s", strerror(errno));
+			continue;
+		}
+#ifndef WIN32
+		if (first > 0 && ready > 0 && (pfds[0].revents & POLLIN)) {
+			char buf[64];
+			while (read(restored_monitoring.wakeup[0], buf, sizeof(buf)) > 0);
+		}
+#endif
+		if (ready == 0)
+			continue;
+
+		mutex_lock(&restored_monitoring.mutex);
+		struct restored_monitor **prev = &restored_monitoring.monitors;
+		while ((monitor = *prev) != NULL) {
+			/* clients added while waiting have no poll entry yet */
+			if (monitor->pfd_index >= (int)first && (pfds[monitor->pfd_index].revents & (POLLIN | POLLHUP | POLLERR))) {
+				if (restored_monitor_read(monitor) < 0) {
+					*prev = monitor->next;
+					monitor->client->monitor = NULL;
+					free(monitor);
+					continue;
+				}
+			}
+			prev = &monitor->next;
+		}
+		mutex_unlock(&restored_monitoring.mutex);
+	}
+
+	free(pfds);
+
+	debug_info("Exiting");
+
+	return NULL;
+}
+
+LIBIMOBILEDEVICE_API restored_error_t restored_start_monitoring(restored_client_t client, restored_message_cb_t callback, void *user_data)
+{
+	if (!client || !client->parent || !callback) {
+		return RESTORE_E_INVALID_ARG;
+	}
+
+	thread_once(&restored_monitoring_once, restored_monitoring_init);
+
+	struct restored_monitor *monitor = (struct restored_monitor*)calloc(1, sizeof(struct restored_monitor));
+	if (!monitor) {
+		return RESTORE_E_UNKNOWN_ERROR;
+	}
+	monitor->client = client;
+	monitor->pfd_index = -1;
+	monitor->callback = callback;
+	monitor->user_data = user_data;
+	if (idevice_connection_get_fd(client->parent->parent->connection, &monitor->fd) != IDEVICE_E_SUCCESS) {
+		free(monitor);
+		return RESTORE_E_UNKNOWN_ERROR;
+	}
+
+	mutex_lock(&restored_monitoring.mutex);
+	if (client->monitor) {
+		mutex_unlock(&restored_monitoring.mutex);
+		free(monitor);
+		return RESTORE_E_OP_IN_PROGRESS;
+	}
+	monitor->next = restored_monitoring.monitors;
+	restored_monitoring.monitors = monitor;
+	client->monitor = monitor;
+	if (!restored_monitoring.running) {
+		/* a previous thread is done with the lock already and just exits */
+		if (restored_monitoring.thread != THREAD_T_NULL) {
+			thread_join(restored_monitoring.thread);
+			thread_free(restored_monitoring.thread);
+			restored_monitoring.thread = THREAD_T_NULL;
+		}
+		if (thread_new(&restored_monitoring.thread, restored_monitoring_thread, NULL) != 0) {
+			restored_monitoring.thread = THREAD_T_NULL;
+			restored_monitoring.monitors = monitor->next;
+			client->monitor = NULL;
+			mutex_unlock(&restored_monitoring.mutex);
+			free(monitor);
+			return RESTORE_E_UNKNOWN_ERROR;
+		}
+		restored_monitoring.running = 1;
+	} else {
+		restored_monitoring_wakeup();
+	}
+	mutex_unlock(&restored_monitoring.mutex);
+
+	return RESTORE_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API restored_error_t restored_stop_monitoring(restored_client_t client)
+{
+	if (!client) {
+		return RESTORE_E_INVALID_ARG;
+	}
+
+	thread_once(&restored_monitoring_once, restored_monitoring_init);
+
+	/* callbacks run with the lock held, so none is running after this */
+	mutex_lock(&restored_monitoring.mutex);
+	struct restored_monitor *monitor = client->monitor;
+	if (monitor) {
+		struct restored_monitor **prev;
+		for (prev = &restored_monitoring.monitors; *prev; prev = &(*prev)->next) {
+			if (*prev == monitor) {
+				*prev = monitor->next;
+				break;
+			}
+		}
+		client->monitor = NULL;
+		restored_monitoring_wakeup();
+	}
+	mutex_unlock(&restored_monitoring.mutex);
+	free(monitor);
+
+	return RESTORE_E_SUCCESS;
+}
@@ -24,12 +24,15 @@
 #endif
 #include <string.h>
 #include <stdlib.h>
+#include <stdio.h>
 #include <unistd.h>
+#include <inttypes.h>
 #include <plist/plist.h>
 
 #include "sbservices.h"
 #include "property_list_service.h"
 #include "common/debug.h"
+#include "common/utils.h"
 
 /**
  * Locks an sbservices client, used for thread safety.
@@ -90,6 +93,11 @@ LIBIMOBILEDEVICE_API sbservices_error_t sbservices_client_new(idevice_t device,
 	sbservices_client_t client_loc = (sbservices_client_t) malloc(sizeof(struct sbservices_client_private));
 	client_loc->parent = plistclient;
 	mutex_init(&client_loc->mutex);
+	client_loc->icon_cache_dir = NULL;
+	client_loc->icon_state_max_age = 0;
+	client_loc->icon_state = NULL;
+	client_loc->icon_state_format = NULL;
+	client_loc->icon_state_has_fingerprint = 0;
 
 	*client = client_loc;
 	return SBSERVICES_E_SUCCESS;
@@ -110,11 +118,80 @@ LIBIMOBILEDEVICE_API sbservices_error_t sbservices_client_free(sbservices_client
 	sbservices_error_t err = sbservices_error(property_list_service_client_free(client->parent));
 	client->parent = NULL;
 	mutex_destroy(&client->mutex);
+	free(client->icon_cache_dir);
+	plist_free(client->icon_state);
+	free(client->icon_state_format);
 	free(client);
 
 	return err;
 }
 
+/* FNV-1a over the binary plist, only used to tell whether two states differ */
+static int sbservices_icon_state_fingerprint(plist_t state, uint64_t *fingerprint)
+{
+	char *bin = NULL;
+	uint32_t length = 0;
+	uint32_t i;
+
+	plist_to_bin(state, &bin, &length);
+	if (!bin) {
+		return -1;
+	}
+	uint64_t hash = 14695981039346656037ULL;
+	for (i = 0; i < length; i++) {
+		hash ^= (unsigned char)bin[i];
+		hash *= 1099511628211ULL;
+	}
+	free(bin);
+	*fingerprint = hash;
+
+	return 0;
+}
+
+static void sbservices_icon_state_cache_clear(sbservices_client_t client)
+{
+	plist_free(client->icon_state);
+	client->icon_state = NULL;
+	free(client->icon_state_format);
+	client->icon_state_format = NULL;
+	client->icon_state_has_fingerprint = 0;
+}
+
+/* must be called with the client locked */
+static void sbservices_icon_state_cache_store(sbservices_client_t client, plist_t state, const char *format_version, const uint64_t *fingerprint)
+{
+	if (client->icon_state_max_age == 0) {
+		return;
+	}
+	sbservices_icon_state_cache_clear(client);
+	client->icon_state = plist_copy(state);
+	client->icon_state_format = (format_version) ? strdup(format_version) : NULL;
+	client->icon_state_time = time(NULL);
+	if (fingerprint) {
+		client->icon_state_fingerprint = *fingerprint;
+		client->icon_state_has_fingerprint = 1;
+	}
+}
+
+/* must be called with the client locked */
+static int sbservices_icon_state_cache_valid(sbservices_client_t client, const char *format_version)
+{
+	if (!client->icon_state || client->icon_state_max_age == 0) {
+		return 0;
+	}
+	if ((format_version == NULL) != (client->icon_state_format == NULL)) {
+		return 0;
+	}
+	if (format_version && strcmp(format_version, client->icon_state_format) != 0) {
+		return 0;
+	}
+	time_t now = time(NULL);
+	if (now < client->icon_state_time || (unsigned int)(now - client->icon_state_time) > client->icon_state_max_age) {
+		return 0;
+	}
+	return 1;
+}
+
 LIBIMOBILEDEVICE_API sbservices_error_t sbservices_get_icon_state(sbservices_client_t client, plist_t *state, const char *format_version)
 {
 	if (!client || !client->parent || !state)
@@ -122,6 +199,14 @@ LIBIMOBILEDEVICE_API sbservices_error_t sbservices_get_icon_state(sbservices_cli
 
 	sbservices_error_t res = SBSERVICES_E_UNKNOWN_ERROR;
 
+	sbservices_lock(client);
+	if (sbservices_icon_state_cache_valid(client, format_version)) {
+		*state = plist_copy(client->icon_state);
+		sbservices_unlock(client);
+		return SBSERVICES_E_SUCCESS;
+	}
+	sbservices_unlock(client);
+
 	plist_t dict = plist_new_dict();
 	plist_dict_set_item(dict, "command", plist_new_string("getIconState"));
 	if (format_version) {
@@ -145,6 +230,8 @@ LIBIMOBILEDEVICE_API sbservices_error_t sbservices_get_icon_state(sbservices_cli
 			plist_free(*state);
 			*state = NULL;
 		}
+	} else {
+		sbservices_icon_state_cache_store(client, *state, format_version, NULL);
 	}
 
 leave_unlock:
@@ -161,16 +248,36 @@ LIBIMOBILEDEVICE_API sbservices_error_t sbservices_set_icon_state(sbservices_cli
 		return SBSERVICES_E_INVALID_ARG;
 
 	sbservices_error_t res = SBSERVICES_E_UNKNOWN_ERROR;
+	uint64_t fingerprint = 0;
+	int has_fingerprint = 0;
+
+	sbservices_lock(client);
+
+	if (client->icon_state_max_age > 0) {
+		has_fingerprint = (sbservices_icon_state_fingerprint(newstate, &fingerprint) == 0);
+		if (has_fingerprint && client->icon_state && !client->icon_state_has_fingerprint) {
+			client->icon_state_has_fingerprint = (sbservices_icon_state_fingerprint(client->icon_state, &client->icon_state_fingerprint) == 0);
+		}
+		if (has_fingerprint && client->icon_state_has_fingerprint && sbservices_icon_state_cache_valid(client, client->icon_state_format) && fingerprint == client->icon_state_fingerprint) {
+			debug_info("icon state is unchanged, not sending it");
+			sbservices_unlock(client);
+			return SBSERVICES_E_SUCCESS;
+		}
+	}
 
 	plist_t dict = plist_new_dict();
 	plist_dict_set_item(dict, "command", plist_new_string("setIconState"));
 	plist_dict_set_item(dict, "iconState", plist_copy(newstate));
 
-	sbservices_lock(client);
-
 	res = sbservices_error(property_list_service_send_binary_plist(client->parent, dict));
 	if (res != SBSERVICES_E_SUCCESS) {
 		debug_info("could not send plist, error %d", res);
+		sbservices_icon_state_cache_clear(client);
+	} else {
+		/* the layout is in the format it was retrieved in */
+		char *format_version = (client->icon_state_format) ? strdup(client->icon_state_format) : NULL;
+		sbservices_icon_state_cache_store(client, newstate, format_version, (has_fingerprint) ? &fingerprint : NULL);
+		free(format_version);
 	}
 	/* NO RESPONSE */
 
@@ -181,6 +288,63 @@ LIBIMOBILEDEVICE_API sbservices_error_t sbservices_set_icon_state(sbservices_cli
 	return res;
 }
 
+LIBIMOBILEDEVICE_API sbservices_error_t sbservices_set_icon_state_cache(sbservices_client_t client, unsigned int max_age)
+{
+	if (!client)
+		return SBSERVICES_E_INVALID_ARG;
+
+	sbservices_lock(client);
+	client->icon_state_max_age = max_age;
+	if (max_age == 0) {
+		sbservices_icon_state_cache_clear(client);
+	}
+	sbservices_unlock(client);
+
+	return SBSERVICES_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API sbservices_error_t sbservices_update_icon_state(sbservices_client_t client, const char *format_version, sbservices_icon_state_cb_t callback, void *user_data, int *changed)
+{
+	if (!client || !client->parent || !callback)
+		return SBSERVICES_E_INVALID_ARG;
+
+	if (changed)
+		*changed = 0;
+
+	plist_t state = NULL;
+	sbservices_error_t res = sbservices_get_icon_state(client, &state, format_version);
+	if (res != SBSERVICES_E_SUCCESS) {
+		return res;
+	}
+
+	uint64_t before = 0;
+	if (sbservices_icon_state_fingerprint(state, &before) < 0) {
+		plist_free(state);
+		return SBSERVICES_E_PLIST_ERROR;
+	}
+
+	if (callback(state, user_data) != 0) {
+		plist_free(state);
+		return SBSERVICES_E_SUCCESS;
+	}
+
+	uint64_t after = 0;
+	if (sbservices_icon_state_fingerprint(state, &after) < 0) {
+		plist_free(state);
+		return SBSERVICES_E_PLIST_ERROR;
+	}
+	if (after != before) {
+		res = sbservices_set_icon_state(client, state);
+		if (res == SBSERVICES_E_SUCCESS && changed)
+			*changed = 1;
+	} else {
+		debug_info("icon state is unchanged, not sending it");
+	}
+	plist_free(state);
+
+	return res;
+}
+
 LIBIMOBILEDEVICE_API sbservices_error_t sbservices_get_icon_pngdata(sbservices_client_t client, const char *bundleId, char **pngdata, uint64_t *pngsize)
 {
 	if (!client || !client->parent || !bundleId || !pngdata)
@@ -218,6 +382,195 @@ leave_unlock:
 	return res;
 }
 
+/**
+ * Builds the path of the icon cache file for the given bundle identifier and
+ * version. The file name is a hash of both; since different keys could map
+ * to the same name, the file starts with the key it was written for.
+ *
+ * @param client The sbservices client with the icon cache directory
+ * @param key The cache key
+ *
+ * @return The path of the cache file, to be freed by the caller.
+ */
+static char *sbservices_icon_cache_path(sbservices_client_t client, const char *key)
+{
+	/* FNV-1a */
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	const unsigned char *p;
+	for (p = (const unsigned char*)key; *p; p++) {
+		hash ^= *p;
+		hash *= 0x100000001b3ULL;
+	}
+
+	char filename[32];
+	snprintf(filename, sizeof(filename), "%016" PRIx64 ".png", hash);
+
+	return string_build_path(client->icon_cache_dir, filename, NULL);
+}
+
+static char *sbservices_icon_cache_key(const char *bundle_id, const char *version)
+{
+	return string_concat(bundle_id, "\n", version, NULL);
+}
+
+static int sbservices_icon_cache_load(sbservices_client_t client, const char *bundle_id, const char *version, sbservices_icon_cb_t callback, void *user_data)
+{
+	char *key = sbservices_icon_cache_key(bundle_id, version);
+	char *path = sbservices_icon_cache_path(client, key);
+	char *buffer = NULL;
+	uint64_t length = 0;
+	size_t keylen = strlen(key) + 1;
+	int found = 0;
+
+	if (buffer_map_from_filename(path, &buffer, &length) == 0) {
+		if (length > keylen && !memcmp(buffer, key, keylen)) {
+			callback(bundle_id, buffer + keylen, length - keylen, user_data);
+			found = 1;
+		}
+		buffer_unmap(buffer, length);
+	}
+
+	free(path);
+	free(key);
+
+	return found;
+}
+
+static void sbservices_icon_cache_store(sbservices_client_t client, const char *bundle_id, const char *version, const char *pngdata, uint64_t pngsize)
+{
+	char *key = sbservices_icon_cache_key(bundle_id, version);
+	char *path = sbservices_icon_cache_path(client, key);
+	char *tmppath = string_concat(path, ".tmp", NULL);
+
+	/* write to a temporary file first so readers never see a partial icon */
+	FILE *f = fopen(tmppath, "wb");
+	if (f) {
+		int ok = (fwrite(key, 1, strlen(key) + 1, f) == strlen(key) + 1) && (fwrite(pngdata, 1, pngsize, f) == pngsize);
+		if (fclose(f) != 0) {
+			ok = 0;
+		}
+#ifdef WIN32
+		if (ok) {
+			remove(path);
+		}
+#endif
+		if (!ok || rename(tmppath, path) != 0) {
+			debug_info("could not write icon cache file %s", path);
+			remove(tmppath);
+		}
+	} else {
+		debug_info("could not create icon cache file %s", tmppath);
+	}
+
+	free(tmppath);
+	free(path);
+	free(key);
+}
+
+struct sbservices_icon_request {
+	sbservices_client_t client;
+	const char *bundle_id;
+	const char *version;
+	sbservices_icon_cb_t callback;
+	void *user_data;
+};
+
+static void sbservices_icon_response_cb(plist_t response, void *user_data)
+{
+	struct sbservices_icon_request *req = (struct sbservices_icon_request*)user_data;
+	const char *pngdata = NULL;
+	uint64_t pngsize = 0;
+
+	plist_t node = plist_dict_get_item(response, "pngData");
+	if (node && plist_get_node_type(node) == PLIST_DATA) {
+		/* no need to copy, the response outlives the callback */
+		pngdata = plist_get_data_ptr(node, &pngsize);
+	}
+
+	if (pngdata && pngsize > 0 && req->version && req->client->icon_cache_dir) {
+		sbservices_icon_cache_store(req->client, req->bundle_id, req->version, pngdata, pngsize);
+	}
+
+	req->callback(req->bundle_id, (pngsize > 0) ? pngdata : NULL, pngsize, req->user_data);
+}
+
+LIBIMOBILEDEVICE_API sbservices_error_t sbservices_get_icons_pngdata(sbservices_client_t client, const char **bundle_ids, const char **versions, unsigned int count, sbservices_icon_cb_t callback, void *user_data)
+{
+	if (!client || !client->parent || (count > 0 && !bundle_ids) || !callback)
+		return SBSERVICES_E_INVALID_ARG;
+
+	sbservices_error_t res = SBSERVICES_E_SUCCESS;
+	property_list_service_request_t *requests = NULL;
+	struct sbservices_icon_request *contexts = NULL;
+	unsigned int num_pending = 0;
+	unsigned int i;
+
+	if (count == 0)
+		return SBSERVICES_E_SUCCESS;
+
+	requests = (property_list_service_request_t*)malloc(sizeof(property_list_service_request_t) * count);
+	contexts = (struct sbservices_icon_request*)malloc(sizeof(struct sbservices_icon_request) * count);
+	if (!requests || !contexts) {
+		free(requests);
+		free(contexts);
+		return SBSERVICES_E_UNKNOWN_ERROR;
+	}
+
+	sbservices_lock(client);
+
+	for (i = 0; i < count; i++) {
+		const char *version = (versions) ? versions[i] : NULL;
+		if (!bundle_ids[i])
+			continue;
+		if (version && client->icon_cache_dir && sbservices_icon_cache_load(client, bundle_ids[i], version, callback, user_data))
+			continue;
+
+		plist_t dict = plist_new_dict();
+		plist_dict_set_item(dict, "command", plist_new_string("getIconPNGData"));
+		plist_dict_set_item(dict, "bundleId", plist_new_string(bundle_ids[i]));
+
+		contexts[num_pending].client = client;
+		contexts[num_pending].bundle_id = bundle_ids[i];
+		contexts[num_pending].version = version;
+		contexts[num_pending].callback = callback;
+		contexts[num_pending].user_data = user_data;
+		requests[num_pending].request = dict;
+		requests[num_pending].callback = sbservices_icon_response_cb;
+		requests[num_pending].user_data = &contexts[num_pending];
+		num_pending++;
+	}
+
+	if (num_pending > 0) {
+		res = sbservices_error(property_list_service_send_receive_pipelined(client->parent, requests, num_pending, 1, 0, 30000));
+		if (res != SBSERVICES_E_SUCCESS) {
+			debug_info("could not retrieve icons, error %d", res);
+		}
+	}
+
+	sbservices_unlock(client);
+
+	for (i = 0; i < num_pending; i++) {
+		plist_free(requests[i].request);
+	}
+	free(requests);
+	free(contexts);
+
+	return res;
+}
+
+LIBIMOBILEDEVICE_API sbservices_error_t sbservices_set_icon_cache_dir(sbservices_client_t client, const char *path)
+{
+	if (!client)
+		return SBSERVICES_E_INVALID_ARG;
+
+	sbservices_lock(client);
+	free(client->icon_cache_dir);
+	client->icon_cache_dir = (path) ? strdup(path) : NULL;
+	sbservices_unlock(client);
+
+	return SBSERVICES_E_SUCCESS;
+}
+
 LIBIMOBILEDEVICE_API sbservices_error_t sbservices_get_interface_orientation(sbservices_client_t client, sbservices_interface_orientation_t* interface_orientation)
 {
 	if (!client || !client->parent || !interface_orientation)
@@ -24,11 +24,20 @@
 
 #include "libimobiledevice/sbservices.h"
 #include "property_list_service.h"
+#include <time.h>
 #include "common/thread.h"
 
 struct sbservices_client_private {
 	property_list_service_client_t parent;
 	mutex_t mutex;
+	char *icon_cache_dir;
+	/* last icon state known to be on the device, see sbservices_set_icon_state_cache() */
+	unsigned int icon_state_max_age;
+	plist_t icon_state;
+	char *icon_state_format;
+	time_t icon_state_time;
+	int icon_state_has_fingerprint;
+	uint64_t icon_state_fingerprint;
 };
 
 #endif
@@ -25,6 +25,11 @@
 #include <plist/plist.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <sys/time.h>
+#ifdef WIN32
+#include <windows.h>
+#endif
 
 #include "screenshotr.h"
 #include "device_link_service.h"
@@ -79,6 +84,12 @@ LIBIMOBILEDEVICE_API screenshotr_error_t screenshotr_client_new(idevice_t device
 
 	screenshotr_client_t client_loc = (screenshotr_client_t) malloc(sizeof(struct screenshotr_client_private));
 	client_loc->parent = dlclient;
+	client_loc->stream_thread = THREAD_T_NULL;
+	client_loc->stream_stop = 0;
+	client_loc->stream_error = SCREENSHOTR_E_SUCCESS;
+	client_loc->stream_fps = 0;
+	client_loc->stream_cb = NULL;
+	client_loc->stream_user_data = NULL;
 
 	/* perform handshake */
 	ret = screenshotr_error(device_link_service_version_exchange(dlclient, SCREENSHOTR_VERSION_INT1, SCREENSHOTR_VERSION_INT2));
@@ -104,62 +115,239 @@ LIBIMOBILEDEVICE_API screenshotr_error_t screenshotr_client_free(screenshotr_cli
 {
 	if (!client)
 		return SCREENSHOTR_E_INVALID_ARG;
+	screenshotr_stop_stream(client);
 	device_link_service_disconnect(client->parent, NULL);
 	screenshotr_error_t err = screenshotr_error(device_link_service_client_free(client->parent));
 	free(client);
 	return err;
 }
 
-LIBIMOBILEDEVICE_API screenshotr_error_t screenshotr_take_screenshot(screenshotr_client_t client, char **imgdata, uint64_t *imgsize)
+static screenshotr_error_t screenshotr_send_request(screenshotr_client_t client)
 {
-	if (!client || !client->parent || !imgdata)
-		return SCREENSHOTR_E_INVALID_ARG;
-
-	screenshotr_error_t res = SCREENSHOTR_E_UNKNOWN_ERROR;
-
 	plist_t dict = plist_new_dict();
 	plist_dict_set_item(dict, "MessageType", plist_new_string("ScreenShotRequest"));
 
-	res = screenshotr_error(device_link_service_send_process_message(client->parent, dict));
+	screenshotr_error_t res = screenshotr_error(device_link_service_send_process_message(client->parent, dict));
 	plist_free(dict);
 	if (res != SCREENSHOTR_E_SUCCESS) {
 		debug_info("could not send plist, error %d", res);
-		return res;
 	}
 
-	dict = NULL;
-	res = screenshotr_error(device_link_service_receive_process_message(client->parent, &dict));
+	return res;
+}
+
+/**
+ * Receives a screenshot reply. The image data is not copied, it stays in
+ * the received envelope which has to be freed by the caller once the data
+ * is not needed anymore.
+ */
+static screenshotr_error_t screenshotr_receive_reply(screenshotr_client_t client, plist_t *envelope, const char **imgdata, uint64_t *imgsize)
+{
+	*envelope = NULL;
+	screenshotr_error_t res = screenshotr_error(device_link_service_receive_process_message_data(client->parent, "ScreenShotData", envelope, imgdata, imgsize));
 	if (res != SCREENSHOTR_E_SUCCESS) {
 		debug_info("could not get screenshot data, error %d", res);
-		goto leave;
-	}
-	if (!dict) {
-		debug_info("did not receive screenshot data!");
-		res = SCREENSHOTR_E_PLIST_ERROR;
-		goto leave;
+		return res;
 	}
 
-	plist_t node = plist_dict_get_item(dict, "MessageType");
-	char *strval = NULL;
-	plist_get_string_val(node, &strval);
-	if (!strval || strcmp(strval, "ScreenShotReply")) {
+	plist_t node = plist_dict_get_item(plist_array_get_item(*envelope, 1), "MessageType");
+	if (!node || plist_get_node_type(node) != PLIST_STRING || plist_string_val_compare(node, "ScreenShotReply") != 0) {
 		debug_info("invalid screenshot data received!");
-		res = SCREENSHOTR_E_PLIST_ERROR;
-		goto leave;
+		plist_free(*envelope);
+		*envelope = NULL;
+		return SCREENSHOTR_E_PLIST_ERROR;
 	}
-	node = plist_dict_get_item(dict, "ScreenShotData");
-	if (!node || plist_get_node_type(node) != PLIST_DATA) {
-		debug_info("no PNG data received!");
-		res = SCREENSHOTR_E_PLIST_ERROR;
-		goto leave;
+
+	return SCREENSHOTR_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API screenshotr_error_t screenshotr_take_screenshot(screenshotr_client_t client, char **imgdata, uint64_t *imgsize)
+{
+	if (!client || !client->parent || !imgdata)
+		return SCREENSHOTR_E_INVALID_ARG;
+
+	/* the connection is in use by the stream */
+	if (client->stream_thread)
+		return SCREENSHOTR_E_INVALID_ARG;
+
+	screenshotr_error_t res = screenshotr_send_request(client);
+	if (res != SCREENSHOTR_E_SUCCESS) {
+		return res;
 	}
 
-	plist_get_data_val(node, imgdata, imgsize);
-	res = SCREENSHOTR_E_SUCCESS;
+	plist_t envelope = NULL;
+	const char *data = NULL;
+	uint64_t size = 0;
+	res = screenshotr_receive_reply(client, &envelope, &data, &size);
+	if (res != SCREENSHOTR_E_SUCCESS) {
+		return res;
+	}
 
-leave:
-	if (dict)
-		plist_free(dict);
+	*imgdata = (char*)malloc(size);
+	if (*imgdata) {
+		memcpy(*imgdata, data, size);
+		if (imgsize)
+			*imgsize = size;
+	} else {
+		res = SCREENSHOTR_E_UNKNOWN_ERROR;
+	}
+	plist_free(envelope);
 
 	return res;
 }
+
+static uint64_t screenshotr_time_ms(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+/**
+ * Waits until the given time has been reached or the stream got stopped.
+ */
+static void screenshotr_stream_wait_until(screenshotr_client_t client, uint64_t until)
+{
+	uint64_t now = screenshotr_time_ms();
+	while (!client->stream_stop && now < until) {
+		uint64_t ms = until - now;
+		if (ms > 50)
+			ms = 50;
+#ifdef WIN32
+		Sleep((DWORD)ms);
+#else
+		usleep((useconds_t)(ms * 1000));
+#endif
+		now = screenshotr_time_ms();
+	}
+}
+
+static void* screenshotr_stream_thread(void *arg)
+{
+	screenshotr_client_t client = (screenshotr_client_t)arg;
+	uint64_t interval;
+	uint64_t next_due;
+	uint64_t request_time;
+	uint64_t last_frame_time = 0;
+	uint64_t index = 0;
+	int pending;
+
+	screenshotr_error_t res = screenshotr_send_request(client);
+	request_time = next_due = screenshotr_time_ms();
+	pending = (res == SCREENSHOTR_E_SUCCESS);
+
+	while (pending) {
+		plist_t envelope = NULL;
+		const char *data = NULL;
+		uint64_t size = 0;
+
+		res = screenshotr_receive_reply(client, &envelope, &data, &size);
+		pending = 0;
+		if (res != SCREENSHOTR_E_SUCCESS) {
+			break;
+		}
+
+		screenshotr_frame_info_t info;
+		info.index = index++;
+		info.timestamp = screenshotr_time_ms();
+		info.latency = (uint32_t)(info.timestamp - request_time);
+		info.interval = (last_frame_time) ? (uint32_t)(info.timestamp - last_frame_time) : 0;
+		last_frame_time = info.timestamp;
+
+		/* the rate might have been changed by screenshotr_stream_set_fps() */
+		interval = 1000 / client->stream_fps;
+		next_due += interval;
+		if (next_due + interval < info.timestamp) {
+			/* fell behind, don't try to catch up with a burst of requests */
+			next_due = info.timestamp;
+		}
+
+		/* let the device capture the next frame while this one is handed out */
+		if (!client->stream_stop && info.timestamp >= next_due) {
+			res = screenshotr_send_request(client);
+			request_time = screenshotr_time_ms();
+			pending = (res == SCREENSHOTR_E_SUCCESS);
+		}
+
+		if (client->stream_cb(data, size, &info, client->stream_user_data) != 0) {
+			client->stream_stop = 1;
+		}
+		plist_free(envelope);
+
+		if (res != SCREENSHOTR_E_SUCCESS) {
+			break;
+		}
+
+		if (client->stream_stop) {
+			if (pending) {
+				/* drain the reply to the request still in flight */
+				if (screenshotr_receive_reply(client, &envelope, &data, &size) == SCREENSHOTR_E_SUCCESS) {
+					plist_free(envelope);
+				}
+			}
+			break;
+		}
+
+		if (!pending) {
+			screenshotr_stream_wait_until(client, next_due);
+			if (client->stream_stop)
+				break;
+			res = screenshotr_send_request(client);
+			request_time = screenshotr_time_ms();
+			pending = (res == SCREENSHOTR_E_SUCCESS);
+		}
+	}
+
+	client->stream_error = res;
+	debug_info("stream ended after %llu frames, error %d", (unsigned long long)index, res);
+
+	return NULL;
+}
+
+LIBIMOBILEDEVICE_API screenshotr_error_t screenshotr_start_stream(screenshotr_client_t client, unsigned int fps, screenshotr_frame_cb_t callback, void *user_data)
+{
+	if (!client || !client->parent || fps == 0 || fps > 1000 || !callback)
+		return SCREENSHOTR_E_INVALID_ARG;
+
+	if (client->stream_thread)
+		return SCREENSHOTR_E_INVALID_ARG;
+
+	client->stream_stop = 0;
+	client->stream_error = SCREENSHOTR_E_SUCCESS;
+	client->stream_fps = fps;
+	client->stream_cb = callback;
+	client->stream_user_data = user_data;
+
+	if (thread_new(&client->stream_thread, screenshotr_stream_thread, client) != 0) {
+		client->stream_thread = THREAD_T_NULL;
+		return SCREENSHOTR_E_UNKNOWN_ERROR;
+	}
+
+	return SCREENSHOTR_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API screenshotr_error_t screenshotr_stream_set_fps(screenshotr_client_t client, unsigned int fps)
+{
+	if (!client || fps == 0 || fps > 1000)
+		return SCREENSHOTR_E_INVALID_ARG;
+
+	client->stream_fps = fps;
+
+	return SCREENSHOTR_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API screenshotr_error_t screenshotr_stop_stream(screenshotr_client_t client)
+{
+	if (!client)
+		return SCREENSHOTR_E_INVALID_ARG;
+
+	if (!client->stream_thread)
+		return SCREENSHOTR_E_SUCCESS;
+
+	client->stream_stop = 1;
+	thread_join(client->stream_thread);
+	thread_free(client->stream_thread);
+	client->stream_thread = THREAD_T_NULL;
+
+	return client->stream_error;
+}
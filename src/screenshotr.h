@@ -24,9 +24,16 @@
 
 #include "libimobiledevice/screenshotr.h"
 #include "device_link_service.h"
+#include "common/thread.h"
 
 struct screenshotr_client_private {
 	device_link_service_client_t parent;
+	THREAD_T stream_thread;
+	volatile int stream_stop;
+	screenshotr_error_t stream_error;
+	volatile unsigned int stream_fps;
+	screenshotr_frame_cb_t stream_cb;
+	void *stream_user_data;
 };
 
 #endif
@@ -23,10 +23,103 @@
 #endif
 #include <stdlib.h>
 #include <string.h>
+#include <sys/time.h>
 
 #include "service.h"
 #include "idevice.h"
+#include "lockdown.h"
 #include "common/debug.h"
+#include "common/thread.h"
+#include "common/trace.h"
+
+/* Service descriptors passed by service_client_factory_start_service() to
+ * the client constructors, so service_client_new() can attach the
+ * connection to the pool of the device or use a pooled connection. */
+struct service_handoff {
+	lockdownd_service_descriptor_t service;
+	const char *name;
+	idevice_connection_t connection;
+	struct service_handoff *next;
+};
+
+static mutex_t handoff_mutex;
+static struct service_handoff *handoffs = NULL;
+static thread_once_t handoff_once = THREAD_ONCE_INIT;
+
+static void service_handoff_init(void)
+{
+	mutex_init(&handoff_mutex);
+}
+
+static void service_handoff_register(struct service_handoff *handoff)
+{
+	thread_once(&handoff_once, service_handoff_init);
+	mutex_lock(&handoff_mutex);
+	handoff->next = handoffs;
+	handoffs = handoff;
+	mutex_unlock(&handoff_mutex);
+}
+
+static void service_handoff_unregister(struct service_handoff *handoff)
+{
+	struct service_handoff **prev;
+
+	mutex_lock(&handoff_mutex);
+	for (prev = &handoffs; *prev; prev = &(*prev)->next) {
+		if (*prev == handoff) {
+			*prev = handoff->next;
+			break;
+		}
+	}
+	mutex_unlock(&handoff_mutex);
+}
+
+/* Services whose connections can be reused by another client once the
+ * previous one is done. Their protocol has no session state beyond a single
+ * request and its replies, so a connection without pending data is in the
+ * same state as a new one. */
+static const char *service_pool_allowed[] = {
+	"com.apple.mobile.diagnostics_relay",
+	"com.apple.springboardservices",
+	"com.apple.mobile.installation_proxy",
+	NULL
+};
+
+static int service_pool_is_allowed(const char *service_name)
+{
+	int i;
+
+	for (i = 0; service_pool_allowed[i]; i++) {
+		if (!strcmp(service_pool_allowed[i], service_name))
+			return 1;
+	}
+	return 0;
+}
+
+/**
+ * Looks up the handoff for a service descriptor and takes its pooled
+ * connection, if any.
+ */
+static const char *service_handoff_claim(lockdownd_service_descriptor_t service, idevice_connection_t *connection)
+{
+	struct service_handoff *handoff;
+	const char *name = NULL;
+
+	*connection = NULL;
+	thread_once(&handoff_once, service_handoff_init);
+	mutex_lock(&handoff_mutex);
+	for (handoff = handoffs; handoff; handoff = handoff->next) {
+		if (handoff->service == service) {
+			name = handoff->name;
+			*connection = handoff->connection;
+			handoff->connection = NULL;
+			break;
+		}
+	}
+	mutex_unlock(&handoff_mutex);
+
+	return name;
+}
 
 /**
  * Convert an idevice_error_t value to an service_error_t value.
@@ -50,29 +143,221 @@ static service_error_t idevice_to_service_error(idevice_error_t err)
 			return SERVICE_E_NOT_ENOUGH_DATA;
 		case IDEVICE_E_TIMEOUT:
 			return SERVICE_E_TIMEOUT;
+		case IDEVICE_E_DEVICE_DETACHED:
+			return SERVICE_E_DEVICE_DETACHED;
+		case IDEVICE_E_CANCELLED:
+			return SERVICE_E_CANCELLED;
 		default:
 			break;
 	}
 	return SERVICE_E_UNKNOWN_ERROR;
 }
 
+static uint64_t service_time_us(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void service_histogram_add(service_latency_histogram_t *histogram, uint64_t us)
+{
+	unsigned int i = 0;
+	while (i < SERVICE_STATS_HISTOGRAM_BUCKETS - 1 && us > ((uint64_t)SERVICE_STATS_HISTOGRAM_BASE << i))
+		i++;
+	histogram->buckets[i]++;
+	histogram->count++;
+	histogram->sum += us;
+}
+
+/**
+ * Accounts a finished send operation that started at the given time.
+ */
+static void service_stats_sent(service_client_t client, service_error_t res, uint32_t bytes, uint64_t start)
+{
+	struct service_stats_private *stats = client->stats;
+	uint64_t now = service_time_us();
+
+	mutex_lock(&stats->mutex);
+	stats->stats.bytes_sent += bytes;
+	if (res == SERVICE_E_SUCCESS) {
+		stats->stats.sends++;
+		service_histogram_add(&stats->stats.send_latency, now - start);
+		if (!stats->request_pending) {
+			stats->request_pending = 1;
+			stats->request_start = start;
+		}
+	} else {
+		stats->stats.errors++;
+	}
+	mutex_unlock(&stats->mutex);
+}
+
+/**
+ * Accounts a finished receive operation that started at the given time.
+ */
+static void service_stats_received(service_client_t client, service_error_t res, uint32_t bytes, uint64_t start)
+{
+	struct service_stats_private *stats = client->stats;
+	uint64_t now = service_time_us();
+
+	mutex_lock(&stats->mutex);
+	stats->stats.bytes_received += bytes;
+	if (res == SERVICE_E_TIMEOUT && bytes == 0) {
+		stats->stats.timeouts++;
+		stats->stats.timeout_time += now - start;
+	} else if (res != SERVICE_E_SUCCESS && bytes == 0) {
+		stats->stats.errors++;
+	} else {
+		stats->stats.receives++;
+		service_histogram_add(&stats->stats.receive_latency, now - start);
+		if (stats->request_pending) {
+			stats->request_pending = 0;
+			service_histogram_add(&stats->stats.request_latency, now - stats->request_start);
+		}
+	}
+	mutex_unlock(&stats->mutex);
+}
+
+/**
+ * Remembers when the first request after a reply was sent, for the round
+ * trip time estimate of the timeout policy.
+ */
+static void service_timeout_sent(service_client_t client, service_error_t res, uint64_t start)
+{
+	struct service_timeout_private *timeout = client->timeout;
+
+	if (res != SERVICE_E_SUCCESS)
+		return;
+	mutex_lock(&timeout->mutex);
+	if (!timeout->request_pending) {
+		timeout->request_pending = 1;
+		timeout->request_start = start;
+	}
+	mutex_unlock(&timeout->mutex);
+}
+
+/**
+ * Takes a round trip time sample when data arrives for a pending request.
+ */
+static void service_timeout_received(service_client_t client, uint32_t bytes)
+{
+	struct service_timeout_private *timeout = client->timeout;
+	uint64_t rtt = 0;
+	int sampled = 0;
+
+	if (bytes == 0)
+		return;
+	mutex_lock(&timeout->mutex);
+	if (timeout->request_pending) {
+		timeout->request_pending = 0;
+		timeout->backoff = 1;
+		rtt = service_time_us() - timeout->request_start;
+		sampled = 1;
+	}
+	mutex_unlock(&timeout->mutex);
+	if (sampled) {
+		idevice_rtt_sample(client->connection->device, timeout->op_class, rtt);
+	}
+}
+
+static void service_timeout_free(struct service_timeout_private *timeout)
+{
+	if (!timeout)
+		return;
+	mutex_destroy(&timeout->mutex);
+	free(timeout->op_class);
+	free(timeout);
+}
+
+/**
+ * Returns the timeout in milliseconds for a receive operation without an
+ * explicit timeout, which is the given fixed one unless the client has a
+ * timeout policy.
+ */
+unsigned int service_client_default_timeout(service_client_t client, unsigned int fixed)
+{
+	struct service_timeout_private *timeout = client->timeout;
+	uint64_t srtt = 0;
+	uint64_t rttvar = 0;
+	uint64_t result;
+	unsigned int backoff;
+
+	if (!timeout)
+		return fixed;
+
+	if (!idevice_rtt_get(client->connection->device, timeout->op_class, &srtt, &rttvar))
+		return timeout->policy.ceiling;
+
+	mutex_lock(&timeout->mutex);
+	backoff = timeout->backoff;
+	mutex_unlock(&timeout->mutex);
+
+	/* microseconds to milliseconds, rounded up */
+	result = (srtt + (uint64_t)timeout->policy.variance_factor * rttvar + 999) / 1000;
+	result *= backoff;
+	if (result < timeout->policy.floor)
+		result = timeout->policy.floor;
+	if (result > timeout->policy.ceiling)
+		result = timeout->policy.ceiling;
+
+	return (unsigned int)result;
+}
+
+/**
+ * Keeps the connection of the client out of the connection pool, since it
+ * is now used for another protocol than the service it was started for.
+ */
+void service_client_disable_pooling(service_client_t client)
+{
+	if (client)
+		client->pool_broken = 1;
+}
+
+/**
+ * Called when a receive operation with a timeout from
+ * service_client_default_timeout() expired. The next timeout is doubled and
+ * the reply that may still arrive is not used as a sample, since it can't
+ * be told apart from the reply of a retried request.
+ */
+void service_client_timeout_expired(service_client_t client)
+{
+	struct service_timeout_private *timeout = client->timeout;
+
+	if (!timeout)
+		return;
+	mutex_lock(&timeout->mutex);
+	timeout->request_pending = 0;
+	if (timeout->backoff < SERVICE_TIMEOUT_MAX_BACKOFF)
+		timeout->backoff *= 2;
+	mutex_unlock(&timeout->mutex);
+}
+
 LIBIMOBILEDEVICE_API service_error_t service_client_new(idevice_t device, lockdownd_service_descriptor_t service, service_client_t *client)
 {
 	if (!device || !service || service->port == 0 || !client || *client)
 		return SERVICE_E_INVALID_ARG;
 
-	/* Attempt connection */
 	idevice_connection_t connection = NULL;
-	if (idevice_connect(device, service->port, &connection) != IDEVICE_E_SUCCESS) {
+	const char *pool_name = service_handoff_claim(service, &connection);
+
+	/* Attempt connection unless a pooled one is used */
+	int pooled = (connection != NULL);
+	if (!pooled && idevice_connect(device, service->port, &connection) != IDEVICE_E_SUCCESS) {
 		return SERVICE_E_MUX_ERROR;
 	}
 
 	/* create client object */
 	service_client_t client_loc = (service_client_t)malloc(sizeof(struct service_client_private));
 	client_loc->connection = connection;
-
-	/* enable SSL if requested */
-	if (service->ssl_enabled == 1)
+	client_loc->pool_name = (pool_name) ? strdup(pool_name) : NULL;
+	client_loc->pool_port = service->port;
+	client_loc->pool_broken = 0;
+	client_loc->stats = NULL;
+	client_loc->timeout = NULL;
+
+	/* enable SSL if requested, a pooled connection already has it */
+	if (!pooled && service->ssl_enabled == 1)
 		service_enable_ssl(client_loc);
 
 	/* all done, return success */
@@ -84,19 +369,36 @@ LIBIMOBILEDEVICE_API service_error_t service_client_factory_start_service(idevic
 {
 	*client = NULL;
 
-	lockdownd_client_t lckd = NULL;
-	if (LOCKDOWN_E_SUCCESS != lockdownd_client_new_with_handshake(device, &lckd, label)) {
-		debug_info("Could not create a lockdown client.");
-		return SERVICE_E_START_SERVICE_ERROR;
-	}
-
 	lockdownd_service_descriptor_t service = NULL;
-	lockdownd_start_service(lckd, service_name, &service);
-	lockdownd_client_free(lckd);
+	struct service_handoff handoff;
+	int pooling = idevice_connection_pool_enabled(device) && service_pool_is_allowed(service_name);
+
+	uint16_t port = 0;
+	handoff.connection = (pooling) ? idevice_connection_pool_take(device, service_name, &port) : NULL;
+	if (handoff.connection) {
+		debug_info("Using pooled connection for service %s", service_name);
+		service = (lockdownd_service_descriptor_t)malloc(sizeof(struct lockdownd_service_descriptor));
+		if (!service) {
+			if (!idevice_connection_pool_put(device, service_name, port, handoff.connection)) {
+				idevice_disconnect(handoff.connection);
+			}
+			return SERVICE_E_UNKNOWN_ERROR;
+		}
+		service->port = port;
+		service->ssl_enabled = 1;
+	} else {
+		lockdownd_start_service_with_shared_session(device, label, service_name, &service);
+
+		if (!service || service->port == 0) {
+			debug_info("Could not start service %s!", service_name);
+			return SERVICE_E_START_SERVICE_ERROR;
+		}
+	}
 
-	if (!service || service->port == 0) {
-		debug_info("Could not start service %s!", service_name);
-		return SERVICE_E_START_SERVICE_ERROR;
+	if (pooling) {
+		handoff.service = service;
+		handoff.name = service_name;
+		service_handoff_register(&handoff);
 	}
 
 	int32_t ec;
@@ -109,6 +411,14 @@ LIBIMOBILEDEVICE_API service_error_t service_client_factory_start_service(idevic
 		*error_code = ec;
 	}
 
+	if (pooling) {
+		service_handoff_unregister(&handoff);
+		/* not claimed by the constructor */
+		if (handoff.connection) {
+			idevice_disconnect(handoff.connection);
+		}
+	}
+
 	if (ec != SERVICE_E_SUCCESS) {
 		debug_info("Could not connect to service %s! Port: %i, error: %i", service_name, service->port, ec);
 	}
@@ -124,8 +434,21 @@ LIBIMOBILEDEVICE_API service_error_t service_client_free(service_client_t client
 	if (!client)
 		return SERVICE_E_INVALID_ARG;
 
-	service_error_t err = idevice_to_service_error(idevice_disconnect(client->connection));
+	service_error_t err = SERVICE_E_SUCCESS;
 
+	if (client->pool_name && !client->pool_broken && client->connection->ssl_data
+	    && idevice_connection_pool_put(client->connection->device, client->pool_name, client->pool_port, client->connection)) {
+		debug_info("Keeping connection for service %s in the pool", client->pool_name);
+	} else {
+		err = idevice_to_service_error(idevice_disconnect(client->connection));
+	}
+
+	if (client->stats) {
+		mutex_destroy(&client->stats->mutex);
+		free(client->stats);
+	}
+	service_timeout_free(client->timeout);
+	free(client->pool_name);
 	free(client);
 	client = NULL;
 
@@ -142,9 +465,48 @@ LIBIMOBILEDEVICE_API service_error_t service_send(service_client_t client, const
 	}
 
 	debug_info("sending %d bytes", size);
+	uint64_t start = (client->stats || client->timeout) ? service_time_us() : 0;
 	res = idevice_to_service_error(idevice_connection_send(client->connection, data, size, &bytes));
+	trace_event(IDEVICE_TRACE_SEND, res, (uintptr_t)client->connection, bytes);
+	if (client->stats) {
+		service_stats_sent(client, res, bytes, start);
+	}
+	if (client->timeout) {
+		service_timeout_sent(client, res, start);
+	}
 	if (res != SERVICE_E_SUCCESS) {
 		debug_info("ERROR: sending to device failed.");
+		client->pool_broken = 1;
+	}
+	if (sent) {
+		*sent = bytes;
+	}
+
+	return res;
+}
+
+LIBIMOBILEDEVICE_API service_error_t service_sendv(service_client_t client, const idevice_iovec_t *iov, int iovcnt, uint32_t *sent)
+{
+	service_error_t res = SERVICE_E_UNKNOWN_ERROR;
+	uint32_t bytes = 0;
+
+	if (!client || (client && !client->connection) || !iov || (iovcnt <= 0)) {
+		return SERVICE_E_INVALID_ARG;
+	}
+
+	debug_info("sending %d buffers", iovcnt);
+	uint64_t start = (client->stats || client->timeout) ? service_time_us() : 0;
+	res = idevice_to_service_error(idevice_connection_sendv(client->connection, iov, iovcnt, &bytes));
+	trace_event(IDEVICE_TRACE_SEND, res, (uintptr_t)client->connection, bytes);
+	if (client->stats) {
+		service_stats_sent(client, res, bytes, start);
+	}
+	if (client->timeout) {
+		service_timeout_sent(client, res, start);
+	}
+	if (res != SERVICE_E_SUCCESS) {
+		debug_info("ERROR: sending to device failed.");
+		client->pool_broken = 1;
 	}
 	if (sent) {
 		*sent = bytes;
@@ -162,7 +524,19 @@ LIBIMOBILEDEVICE_API service_error_t service_receive_with_timeout(service_client
 		return SERVICE_E_INVALID_ARG;
 	}
 
+	uint64_t start = (client->stats) ? service_time_us() : 0;
 	res = idevice_to_service_error(idevice_connection_receive_timeout(client->connection, data, size, &bytes, timeout));
+	trace_event(IDEVICE_TRACE_RECEIVE, res, (uintptr_t)client->connection, bytes);
+	if (client->stats) {
+		service_stats_received(client, res, bytes, start);
+	}
+	if (client->timeout) {
+		service_timeout_received(client, bytes);
+	}
+	if (res != SERVICE_E_SUCCESS) {
+		/* a late reply would confuse the next user of a pooled connection */
+		client->pool_broken = 1;
+	}
 	if (res != SERVICE_E_SUCCESS && res != SERVICE_E_TIMEOUT) {
 		debug_info("could not read data");
 		return res;
@@ -176,7 +550,19 @@ LIBIMOBILEDEVICE_API service_error_t service_receive_with_timeout(service_client
 
 LIBIMOBILEDEVICE_API service_error_t service_receive(service_client_t client, char* data, uint32_t size, uint32_t *received)
 {
-	return service_receive_with_timeout(client, data, size, received, 30000);
+	if (!client || !client->connection) {
+		return SERVICE_E_INVALID_ARG;
+	}
+
+	uint32_t bytes = 0;
+	service_error_t res = service_receive_with_timeout(client, data, size, &bytes, service_client_default_timeout(client, SERVICE_DEFAULT_TIMEOUT));
+	if (res == SERVICE_E_TIMEOUT && bytes == 0) {
+		service_client_timeout_expired(client);
+	}
+	if (received && (res == SERVICE_E_SUCCESS || res == SERVICE_E_TIMEOUT)) {
+		*received = bytes;
+	}
+	return res;
 }
 
 LIBIMOBILEDEVICE_API service_error_t service_enable_ssl(service_client_t client)
@@ -195,6 +581,90 @@ LIBIMOBILEDEVICE_API service_error_t service_disable_bypass_ssl(service_client_t
 {
 	if (!client || !client->connection)
 		return SERVICE_E_INVALID_ARG;
+	client->pool_broken = 1;
 	return idevice_to_service_error(idevice_connection_disable_bypass_ssl(client->connection, sslBypass));
 }
 
+LIBIMOBILEDEVICE_API service_error_t service_client_enable_stats(service_client_t client, int enable)
+{
+	if (!client)
+		return SERVICE_E_INVALID_ARG;
+
+	if (!enable) {
+		if (client->stats) {
+			mutex_destroy(&client->stats->mutex);
+			free(client->stats);
+			client->stats = NULL;
+		}
+		return SERVICE_E_SUCCESS;
+	}
+
+	if (client->stats) {
+		mutex_lock(&client->stats->mutex);
+		memset(&client->stats->stats, '\0', sizeof(service_stats_t));
+		client->stats->request_pending = 0;
+		mutex_unlock(&client->stats->mutex);
+		return SERVICE_E_SUCCESS;
+	}
+
+	struct service_stats_private *stats = (struct service_stats_private*)calloc(1, sizeof(struct service_stats_private));
+	if (!stats)
+		return SERVICE_E_UNKNOWN_ERROR;
+	mutex_init(&stats->mutex);
+	client->stats = stats;
+
+	return SERVICE_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API service_error_t service_client_get_stats(service_client_t client, service_stats_t *stats)
+{
+	if (!client || !stats || !client->stats)
+		return SERVICE_E_INVALID_ARG;
+
+	mutex_lock(&client->stats->mutex);
+	memcpy(stats, &client->stats->stats, sizeof(service_stats_t));
+	mutex_unlock(&client->stats->mutex);
+
+	return SERVICE_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API service_error_t service_client_set_timeout_policy(service_client_t client, const char *op_class, const service_timeout_policy_t *policy)
+{
+	if (!client || (policy && policy->floor > policy->ceiling))
+		return SERVICE_E_INVALID_ARG;
+
+	if (!policy) {
+		service_timeout_free(client->timeout);
+		client->timeout = NULL;
+		return SERVICE_E_SUCCESS;
+	}
+
+	struct service_timeout_private *timeout = (struct service_timeout_private*)calloc(1, sizeof(struct service_timeout_private));
+	if (!timeout)
+		return SERVICE_E_UNKNOWN_ERROR;
+	timeout->op_class = strdup((op_class) ? op_class : "default");
+	if (!timeout->op_class) {
+		free(timeout);
+		return SERVICE_E_UNKNOWN_ERROR;
+	}
+	mutex_init(&timeout->mutex);
+	timeout->policy = *policy;
+	if (timeout->policy.variance_factor == 0)
+		timeout->policy.variance_factor = 4;
+	timeout->backoff = 1;
+
+	service_timeout_free(client->timeout);
+	client->timeout = timeout;
+
+	return SERVICE_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API service_error_t service_client_get_timeout(service_client_t client, unsigned int *timeout)
+{
+	if (!client || !timeout)
+		return SERVICE_E_INVALID_ARG;
+
+	*timeout = service_client_default_timeout(client, SERVICE_DEFAULT_TIMEOUT);
+
+	return SERVICE_E_SUCCESS;
+}
@@ -24,9 +24,40 @@
 #include "libimobiledevice/service.h"
 #include "libimobiledevice/lockdown.h"
 #include "idevice.h"
+#include "common/thread.h"
+
+struct service_stats_private {
+	mutex_t mutex;
+	service_stats_t stats;
+	int request_pending;
+	uint64_t request_start;
+};
+
+/* fixed timeout of receive operations without an explicit one */
+#define SERVICE_DEFAULT_TIMEOUT 30000
+/* upper bound of the timeout multiplier after consecutive timeouts */
+#define SERVICE_TIMEOUT_MAX_BACKOFF 64
+
+struct service_timeout_private {
+	mutex_t mutex;
+	service_timeout_policy_t policy;
+	char *op_class;
+	int request_pending;
+	uint64_t request_start;
+	unsigned int backoff;
+};
 
 struct service_client_private {
 	idevice_connection_t connection;
+	char *pool_name;
+	uint16_t pool_port;
+	int pool_broken;
+	struct service_stats_private *stats;
+	struct service_timeout_private *timeout;
 };
 
+unsigned int service_client_default_timeout(service_client_t client, unsigned int fixed);
+void service_client_timeout_expired(service_client_t client);
+void service_client_disable_pooling(service_client_t client);
+
 #endif
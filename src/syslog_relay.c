@@ -30,13 +30,6 @@
 #include "lockdown.h"
 #include "common/debug.h"
 
-struct syslog_relay_worker_thread {
-	syslog_relay_client_t client;
-	syslog_relay_receive_cb_t cbfunc;
-	void *user_data;
-	int is_raw;
-};
-
 /**
  * Convert a service_error_t value to a syslog_relay_error_t value.
  * Used internally to get correct error codes.
@@ -88,6 +81,14 @@ LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_client_new(idevice_t devi
 	syslog_relay_client_t client_loc = (syslog_relay_client_t) malloc(sizeof(struct syslog_relay_client_private));
 	client_loc->parent = parent;
 	client_loc->worker = THREAD_T_NULL;
+	client_loc->delivery = THREAD_T_NULL;
+	client_loc->srwt = NULL;
+	client_loc->ring = NULL;
+	client_loc->ring_size = SYSLOG_RELAY_RING_DEFAULT_SIZE;
+	client_loc->bytes_received = 0;
+	client_loc->bytes_dropped = 0;
+	mutex_init(&client_loc->ring_mutex);
+	cond_init(&client_loc->ring_cond);
 
 	*client = client_loc;
 
@@ -108,6 +109,8 @@ LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_client_free(syslog_relay_
 		return SYSLOG_RELAY_E_INVALID_ARG;
 	syslog_relay_stop_capture(client);
 	syslog_relay_error_t err = syslog_relay_error(service_client_free(client->parent));
+	cond_destroy(&client->ring_cond);
+	mutex_destroy(&client->ring_mutex);
 	free(client);
 
 	return err;
@@ -138,49 +141,329 @@ LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_receive_with_timeout(sysl
 	return res;
 }
 
+/**
+ * Passes complete NUL terminated log lines found in the given buffer to the
+ * line callback and returns the number of bytes consumed.
+ */
+uint32_t syslog_relay_deliver_lines(syslog_relay_receive_data_cb_t callback, void *user_data, char *buf, uint32_t length)
+{
+	char *start = buf;
+	char *end = buf + length;
+	char *nul;
+
+	while (start < end && (nul = (char*)memchr(start, '\0', end - start)) != NULL) {
+		if (nul > start) {
+			callback(start, (uint32_t)(nul - start), user_data);
+		}
+		start = nul + 1;
+	}
+
+	return (uint32_t)(start - buf);
+}
+
+/*
+ * The ring buffer indices and counters are shared between the receiving
+ * worker and the delivery thread without a lock. Each index is only ever
+ * written by one side, so an acquire load and a release store are enough.
+ */
+static uint32_t syslog_relay_load(volatile uint32_t *value)
+{
+#ifdef WIN32
+	return (uint32_t)InterlockedExchangeAdd((volatile LONG*)value, 0);
+#else
+	return __atomic_load_n(value, __ATOMIC_ACQUIRE);
+#endif
+}
+
+static void syslog_relay_store(volatile uint32_t *value, uint32_t newval)
+{
+#ifdef WIN32
+	InterlockedExchange((volatile LONG*)value, (LONG)newval);
+#else
+	__atomic_store_n(value, newval, __ATOMIC_RELEASE);
+#endif
+}
+
+static uint64_t syslog_relay_load64(volatile uint64_t *value)
+{
+#ifdef WIN32
+	return (uint64_t)InterlockedCompareExchange64((volatile LONGLONG*)value, 0, 0);
+#else
+	return __atomic_load_n(value, __ATOMIC_ACQUIRE);
+#endif
+}
+
+static void syslog_relay_add64(volatile uint64_t *value, uint64_t amount)
+{
+#ifdef WIN32
+	InterlockedExchangeAdd64((volatile LONGLONG*)value, (LONGLONG)amount);
+#else
+	__atomic_fetch_add(value, amount, __ATOMIC_RELEASE);
+#endif
+}
+
+/* full barriers, used for the handshake that puts the delivery thread to sleep */
+static uint32_t syslog_relay_load_full(volatile uint32_t *value)
+{
+#ifdef WIN32
+	return (uint32_t)InterlockedCompareExchange((volatile LONG*)value, 0, 0);
+#else
+	return __atomic_load_n(value, __ATOMIC_SEQ_CST);
+#endif
+}
+
+static void syslog_relay_store_full(volatile uint32_t *value, uint32_t newval)
+{
+#ifdef WIN32
+	InterlockedExchange((volatile LONG*)value, (LONG)newval);
+#else
+	__atomic_store_n(value, newval, __ATOMIC_SEQ_CST);
+#endif
+}
+
+/**
+ * Makes sure the line buffer of the worker has room for more data. A line
+ * filling the whole buffer grows it up to SYSLOG_RELAY_MAX_LINE_SIZE, and
+ * is passed on unterminated beyond that.
+ */
+static void syslog_relay_buffer_reserve(struct syslog_relay_worker_thread *srwt)
+{
+	if (srwt->fill < srwt->bufsize - 1)
+		return;
+
+	if (srwt->bufsize < SYSLOG_RELAY_MAX_LINE_SIZE) {
+		char *newbuf = (char*)realloc(srwt->buf, srwt->bufsize * 2);
+		if (newbuf) {
+			srwt->buf = newbuf;
+			srwt->bufsize *= 2;
+		}
+	}
+	if (srwt->fill >= srwt->bufsize - 1) {
+		debug_info("Line exceeds %u bytes, passing it on unterminated", srwt->fill);
+		srwt->buf[srwt->fill] = '\0';
+		srwt->data_cbfunc(srwt->buf, srwt->fill, srwt->user_data);
+		srwt->fill = 0;
+	}
+}
+
+/**
+ * Passes the given number of bytes, just appended to the line buffer, to
+ * the callback according to the capture mode.
+ */
+static void syslog_relay_buffer_consume(struct syslog_relay_worker_thread *srwt, uint32_t bytes)
+{
+	char *buf = srwt->buf + srwt->fill;
+	uint32_t i;
+
+	switch (srwt->mode) {
+	case CAPTURE_MODE_RAW_DATA:
+		srwt->data_cbfunc(buf, bytes, srwt->user_data);
+		break;
+	case CAPTURE_MODE_LINES:
+		srwt->fill += bytes;
+		i = syslog_relay_deliver_lines(srwt->data_cbfunc, srwt->user_data, srwt->buf, srwt->fill);
+		if (i > 0) {
+			srwt->fill -= i;
+			memmove(srwt->buf, srwt->buf + i, srwt->fill);
+		}
+		break;
+	case CAPTURE_MODE_RAW_CHARS:
+		for (i = 0; i < bytes; i++) {
+			srwt->cbfunc(buf[i], srwt->user_data);
+		}
+		break;
+	case CAPTURE_MODE_CHARS:
+	default:
+		for (i = 0; i < bytes; i++) {
+			if (buf[i] != 0) {
+				srwt->cbfunc(buf[i], srwt->user_data);
+			}
+		}
+		break;
+	}
+}
+
+/**
+ * Accounts for data that could not be stored in the ring buffer. For
+ * line based capture modes the line cut off at the end of the buffer gets
+ * terminated, and data is skipped up to the next line boundary once there
+ * is room again, so no two partial lines are glued together.
+ */
+static void syslog_relay_ring_drop(syslog_relay_client_t client, uint32_t bytes)
+{
+	syslog_relay_add64(&client->bytes_dropped, bytes);
+
+	if (!client->ring_resync && client->srwt->mode != CAPTURE_MODE_RAW_DATA && client->srwt->mode != CAPTURE_MODE_RAW_CHARS) {
+		uint32_t head = client->ring_head;
+		if (head - syslog_relay_load(&client->ring_tail) < client->ring_size) {
+			/* the spare byte is reserved for this */
+			client->ring[head & (client->ring_size - 1)] = '\0';
+			syslog_relay_store(&client->ring_head, head + 1);
+		}
+		client->ring_resync = 1;
+	}
+}
+
+/**
+ * Receives data from the device straight into the free space of the ring
+ * buffer and publishes it to the delivery thread.
+ */
+static syslog_relay_error_t syslog_relay_ring_receive(syslog_relay_client_t client, char *scratch)
+{
+	syslog_relay_error_t ret;
+	uint32_t head = client->ring_head;
+	uint32_t used = head - syslog_relay_load(&client->ring_tail);
+	uint32_t offset = head & (client->ring_size - 1);
+	/* always keep one byte spare to be able to terminate a cut off line */
+	uint32_t space = (used < client->ring_size) ? client->ring_size - used - 1 : 0;
+	uint32_t bytes = 0;
+	char *dst;
+
+	if (space > client->ring_size - offset)
+		space = client->ring_size - offset;
+	if (space > SYSLOG_RELAY_READ_SIZE)
+		space = SYSLOG_RELAY_READ_SIZE;
+
+	/* the ring buffer is full, read anyway so the device does not stall */
+	dst = (space > 0) ? client->ring + offset : scratch;
+
+	ret = syslog_relay_receive_with_timeout(client, dst, (space > 0) ? space : SYSLOG_RELAY_READ_SIZE, &bytes, 100);
+	if (ret != SYSLOG_RELAY_E_SUCCESS || bytes == 0)
+		return ret;
+
+	syslog_relay_add64(&client->bytes_received, bytes);
+
+	if (space == 0) {
+		syslog_relay_ring_drop(client, bytes);
+		return ret;
+	}
+
+	if (client->ring_resync) {
+		char *nul = (char*)memchr(dst, '\0', bytes);
+		uint32_t skip = (nul) ? (uint32_t)(nul - dst) + 1 : bytes;
+		syslog_relay_add64(&client->bytes_dropped, skip);
+		if (!nul)
+			return ret;
+		client->ring_resync = 0;
+		bytes -= skip;
+		memmove(dst, dst + skip, bytes);
+		if (bytes == 0)
+			return ret;
+	}
+
+	syslog_relay_store_full(&client->ring_head, head + bytes);
+
+	/* only take the lock if the delivery thread went to sleep */
+	if (syslog_relay_load_full(&client->ring_waiting)) {
+		mutex_lock(&client->ring_mutex);
+		cond_signal(&client->ring_cond);
+		mutex_unlock(&client->ring_mutex);
+	}
+
+	return ret;
+}
+
+void *syslog_relay_delivery(void *arg)
+{
+	syslog_relay_client_t client = (syslog_relay_client_t)arg;
+	struct syslog_relay_worker_thread *srwt = client->srwt;
+	uint32_t tail = client->ring_tail;
+
+	while (1) {
+		uint32_t used = syslog_relay_load(&client->ring_head) - tail;
+		if (used == 0) {
+			if (syslog_relay_load_full(&client->ring_quit))
+				break;
+			mutex_lock(&client->ring_mutex);
+			syslog_relay_store_full(&client->ring_waiting, 1);
+			if (syslog_relay_load_full(&client->ring_head) == tail && !syslog_relay_load_full(&client->ring_quit)) {
+				cond_wait(&client->ring_cond, &client->ring_mutex);
+			}
+			syslog_relay_store_full(&client->ring_waiting, 0);
+			mutex_unlock(&client->ring_mutex);
+			continue;
+		}
+
+		syslog_relay_buffer_reserve(srwt);
+
+		uint32_t offset = tail & (client->ring_size - 1);
+		uint32_t amount = used;
+		if (amount > client->ring_size - offset)
+			amount = client->ring_size - offset;
+		if (amount > srwt->bufsize - srwt->fill - 1)
+			amount = srwt->bufsize - srwt->fill - 1;
+
+		memcpy(srwt->buf + srwt->fill, client->ring + offset, amount);
+		tail += amount;
+		syslog_relay_store(&client->ring_tail, tail);
+
+		syslog_relay_buffer_consume(srwt, amount);
+	}
+
+	return NULL;
+}
+
 void *syslog_relay_worker(void *arg)
 {
 	syslog_relay_error_t ret = SYSLOG_RELAY_E_UNKNOWN_ERROR;
 	struct syslog_relay_worker_thread *srwt = (struct syslog_relay_worker_thread*)arg;
+	syslog_relay_client_t client;
+	char *scratch = NULL;
 
 	if (!srwt)
 		return NULL;
 
+	client = srwt->client;
+
+	if (client->ring) {
+		/* data that does not fit into the ring buffer is read into this */
+		scratch = (char*)malloc(SYSLOG_RELAY_READ_SIZE);
+		if (!scratch)
+			return NULL;
+	}
+
 	debug_info("Running");
 
-	while (srwt->client->parent) {
-		char c;
+	while (client->parent) {
 		uint32_t bytes = 0;
-		ret = syslog_relay_receive_with_timeout(srwt->client, &c, 1, &bytes, 100);
+
+		if (scratch) {
+			/* the ring buffer stores the received data in place */
+			ret = syslog_relay_ring_receive(client, scratch);
+			if (ret < 0 && ret != SYSLOG_RELAY_E_TIMEOUT && ret != SYSLOG_RELAY_E_NOT_ENOUGH_DATA) {
+				debug_info("Connection to syslog relay interrupted");
+				break;
+			}
+			continue;
+		}
+
+		syslog_relay_buffer_reserve(srwt);
+
+		/* keep one byte spare to be able to terminate oversized lines */
+		ret = syslog_relay_receive_with_timeout(client, srwt->buf + srwt->fill, srwt->bufsize - srwt->fill - 1, &bytes, 100);
 		if (ret == SYSLOG_RELAY_E_TIMEOUT || ret == SYSLOG_RELAY_E_NOT_ENOUGH_DATA || ((bytes == 0) && (ret == SYSLOG_RELAY_E_SUCCESS))) {
 			continue;
 		} else if (ret < 0) {
 			debug_info("Connection to syslog relay interrupted");
 			break;
 		}
-		if (srwt->is_raw) {
-			srwt->cbfunc(c, srwt->user_data);
-		} else {
-			if (c != 0) {
-				srwt->cbfunc(c, srwt->user_data);
-			}
-		}
-	}
 
-	if (srwt) {
-		free(srwt);
+		syslog_relay_buffer_consume(srwt, bytes);
 	}
 
+	free(scratch);
+
 	debug_info("Exiting");
 
 	return NULL;
 }
 
-LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_start_capture(syslog_relay_client_t client, syslog_relay_receive_cb_t callback, void* user_data)
+/**
+ * Starts the capture worker thread in the given mode, and the delivery
+ * thread if a ring buffer is used.
+ */
+static syslog_relay_error_t syslog_relay_start_worker(syslog_relay_client_t client, enum syslog_relay_capture_mode mode, syslog_relay_receive_cb_t callback, syslog_relay_receive_data_cb_t data_callback, void* user_data)
 {
-	if (!client || !callback)
-		return SYSLOG_RELAY_E_INVALID_ARG;
-
 	syslog_relay_error_t res = SYSLOG_RELAY_E_UNKNOWN_ERROR;
 
 	if (client->worker) {
@@ -188,52 +471,90 @@ LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_start_capture(syslog_rela
 		return res;
 	}
 
-	/* start worker thread */
 	struct syslog_relay_worker_thread *srwt = (struct syslog_relay_worker_thread*)malloc(sizeof(struct syslog_relay_worker_thread));
-	if (srwt) {
-		srwt->client = client;
-		srwt->cbfunc = callback;
-		srwt->user_data = user_data;
-		srwt->is_raw = 0;
-
-		if (thread_new(&client->worker, syslog_relay_worker, srwt) == 0) {
-			res = SYSLOG_RELAY_E_SUCCESS;
+	if (!srwt) {
+		return res;
+	}
+	srwt->client = client;
+	srwt->cbfunc = callback;
+	srwt->data_cbfunc = data_callback;
+	srwt->user_data = user_data;
+	srwt->mode = mode;
+	srwt->bufsize = SYSLOG_RELAY_READ_SIZE;
+	srwt->fill = 0;
+	srwt->buf = (char*)malloc(srwt->bufsize);
+	if (!srwt->buf) {
+		free(srwt);
+		return res;
+	}
+	client->srwt = srwt;
+
+	client->ring_head = 0;
+	client->ring_tail = 0;
+	client->ring_waiting = 0;
+	client->ring_quit = 0;
+	client->ring_resync = 0;
+	client->bytes_received = 0;
+	client->bytes_dropped = 0;
+	if (client->ring_size > 0) {
+		client->ring = (char*)malloc(client->ring_size);
+		if (!client->ring) {
+			debug_info("Could not allocate a ring buffer of %u bytes, capturing without it", client->ring_size);
+		} else if (thread_new(&client->delivery, syslog_relay_delivery, client) != 0) {
+			free(client->ring);
+			client->ring = NULL;
+			client->delivery = THREAD_T_NULL;
 		}
 	}
 
+	/* start worker thread */
+	if (thread_new(&client->worker, syslog_relay_worker, srwt) == 0) {
+		res = SYSLOG_RELAY_E_SUCCESS;
+	} else {
+		client->worker = THREAD_T_NULL;
+		syslog_relay_stop_capture(client);
+	}
+
 	return res;
 }
 
+LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_start_capture(syslog_relay_client_t client, syslog_relay_receive_cb_t callback, void* user_data)
+{
+	if (!client || !callback)
+		return SYSLOG_RELAY_E_INVALID_ARG;
+
+	return syslog_relay_start_worker(client, CAPTURE_MODE_CHARS, callback, NULL, user_data);
+}
+
 LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_start_capture_raw(syslog_relay_client_t client, syslog_relay_receive_cb_t callback, void* user_data)
 {
 	if (!client || !callback)
 		return SYSLOG_RELAY_E_INVALID_ARG;
 
-	syslog_relay_error_t res = SYSLOG_RELAY_E_UNKNOWN_ERROR;
+	return syslog_relay_start_worker(client, CAPTURE_MODE_RAW_CHARS, callback, NULL, user_data);
+}
 
-	if (client->worker) {
-		debug_info("Another syslog capture thread appears to be running already.");
-		return res;
-	}
+LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_start_capture_lines(syslog_relay_client_t client, syslog_relay_receive_data_cb_t callback, void* user_data)
+{
+	if (!client || !callback)
+		return SYSLOG_RELAY_E_INVALID_ARG;
 
-	/* start worker thread */
-	struct syslog_relay_worker_thread *srwt = (struct syslog_relay_worker_thread*)malloc(sizeof(struct syslog_relay_worker_thread));
-	if (srwt) {
-		srwt->client = client;
-		srwt->cbfunc = callback;
-		srwt->user_data = user_data;
-		srwt->is_raw = 1;
-
-		if (thread_new(&client->worker, syslog_relay_worker, srwt) == 0) {
-			res = SYSLOG_RELAY_E_SUCCESS;
-		}
-	}
+	return syslog_relay_start_worker(client, CAPTURE_MODE_LINES, NULL, callback, user_data);
+}
 
-	return res;
+LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_start_capture_raw_data(syslog_relay_client_t client, syslog_relay_receive_data_cb_t callback, void* user_data)
+{
+	if (!client || !callback)
+		return SYSLOG_RELAY_E_INVALID_ARG;
+
+	return syslog_relay_start_worker(client, CAPTURE_MODE_RAW_DATA, NULL, callback, user_data);
 }
 
 LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_stop_capture(syslog_relay_client_t client)
 {
+	if (!client)
+		return SYSLOG_RELAY_E_INVALID_ARG;
+
 	if (client->worker) {
 		/* notify thread to finish */
 		service_client_t parent = client->parent;
@@ -245,5 +566,65 @@ LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_stop_capture(syslog_relay
 		client->parent = parent;
 	}
 
+	if (client->delivery) {
+		/* let the delivery thread pass on what is left in the ring buffer */
+		mutex_lock(&client->ring_mutex);
+		syslog_relay_store_full(&client->ring_quit, 1);
+		cond_signal(&client->ring_cond);
+		mutex_unlock(&client->ring_mutex);
+		thread_join(client->delivery);
+		thread_free(client->delivery);
+		client->delivery = THREAD_T_NULL;
+	}
+
+	if (client->srwt) {
+		if (client->bytes_dropped > 0) {
+			debug_info("Dropped %llu of %llu received bytes", (unsigned long long)client->bytes_dropped, (unsigned long long)client->bytes_received);
+		}
+		free(client->srwt->buf);
+		free(client->srwt);
+		client->srwt = NULL;
+	}
+	free(client->ring);
+	client->ring = NULL;
+
+	return SYSLOG_RELAY_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_set_buffer_size(syslog_relay_client_t client, uint32_t size)
+{
+	if (!client)
+		return SYSLOG_RELAY_E_INVALID_ARG;
+
+	if (client->worker) {
+		debug_info("Cannot change the buffer size while capturing.");
+		return SYSLOG_RELAY_E_UNKNOWN_ERROR;
+	}
+
+	if (size > SYSLOG_RELAY_RING_MAX_SIZE)
+		size = SYSLOG_RELAY_RING_MAX_SIZE;
+
+	/* the ring buffer indices wrap around, so use a power of two */
+	uint32_t ring_size = 0;
+	if (size > 0) {
+		ring_size = SYSLOG_RELAY_READ_SIZE;
+		while (ring_size < size)
+			ring_size <<= 1;
+	}
+	client->ring_size = ring_size;
+
+	return SYSLOG_RELAY_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_get_stats(syslog_relay_client_t client, syslog_relay_stats_t *stats)
+{
+	if (!client || !stats)
+		return SYSLOG_RELAY_E_INVALID_ARG;
+
+	stats->bytes_received = syslog_relay_load64(&client->bytes_received);
+	stats->bytes_dropped = syslog_relay_load64(&client->bytes_dropped);
+	stats->buffer_size = (client->ring) ? client->ring_size : 0;
+	stats->buffer_used = (client->ring) ? syslog_relay_load(&client->ring_head) - syslog_relay_load(&client->ring_tail) : 0;
+
 	return SYSLOG_RELAY_E_SUCCESS;
 }
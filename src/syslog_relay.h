@@ -26,11 +26,81 @@
 #include "service.h"
 #include "common/thread.h"
 
+/* size of the block read from the device at once */
+#define SYSLOG_RELAY_READ_SIZE 16384
+
+/* lines longer than this are passed on in pieces */
+#define SYSLOG_RELAY_MAX_LINE_SIZE 0x100000
+
+/* default size of the ring buffer between receiving and delivering data */
+#define SYSLOG_RELAY_RING_DEFAULT_SIZE 0x100000
+
+#define SYSLOG_RELAY_RING_MAX_SIZE 0x40000000
+
+enum syslog_relay_capture_mode {
+	CAPTURE_MODE_CHARS,
+	CAPTURE_MODE_RAW_CHARS,
+	CAPTURE_MODE_LINES,
+	CAPTURE_MODE_RAW_DATA
+};
+
+struct syslog_relay_worker_thread {
+	syslog_relay_client_t client;
+	syslog_relay_receive_cb_t cbfunc;
+	syslog_relay_receive_data_cb_t data_cbfunc;
+	void *user_data;
+	enum syslog_relay_capture_mode mode;
+	char *buf;
+	uint32_t bufsize;
+	uint32_t fill;
+};
+
 struct syslog_relay_client_private {
 	service_client_t parent;
 	THREAD_T worker;
+	THREAD_T delivery;
+	struct syslog_relay_worker_thread *srwt;
+	/* single producer, single consumer ring buffer, head and tail are
+	 * free running and only written by the worker and the delivery thread
+	 * respectively */
+	char *ring;
+	uint32_t ring_size;
+	volatile uint32_t ring_head;
+	volatile uint32_t ring_tail;
+	volatile uint32_t ring_waiting;
+	volatile uint32_t ring_quit;
+	int ring_resync;
+	mutex_t ring_mutex;
+	cond_t ring_cond;
+	volatile uint64_t bytes_received;
+	volatile uint64_t bytes_dropped;
+};
+
+struct syslog_relay_aggregator_device {
+	char *udid;
+	idevice_t device;
+	syslog_relay_client_t client;
+	int fd;
+	char *buf;
+	uint32_t bufsize;
+	uint32_t fill;
+	int pfd_index;
+	int busy;
+	volatile int removed;
+	struct syslog_relay_aggregator_device *next;
+};
+
+struct syslog_relay_aggregator_private {
+	mutex_t mutex;
+	THREAD_T thread;
+	volatile int quit;
+	struct syslog_relay_aggregator_device *devices;
+	syslog_relay_aggregator_cb_t callback;
+	void *user_data;
 };
 
 void *syslog_relay_worker(void *arg);
+void *syslog_relay_delivery(void *arg);
+uint32_t syslog_relay_deliver_lines(syslog_relay_receive_data_cb_t callback, void *user_data, char *buf, uint32_t length);
 
 #endif
@@ -0,0 +1,360 @@
+/*
+ * syslog_relay_aggregator.c
+ * Captures the syslog of many devices from a single thread.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#ifdef WIN32
+#include <winsock2.h>
+#include <windows.h>
+#define poll WSAPoll
+#else
+#include <poll.h>
+#endif
+
+#include "syslog_relay.h"
+#include "idevice.h"
+#include "common/debug.h"
+
+/* how long the aggregator thread waits before looking for new devices */
+#define SYSLOG_RELAY_AGGREGATOR_POLL_TIMEOUT 500
+
+static void syslog_relay_aggregator_device_free(struct syslog_relay_aggregator_device *dev)
+{
+	if (dev->client)
+		syslog_relay_client_free(dev->client);
+	if (dev->device)
+		idevice_free(dev->device);
+	free(dev->buf);
+	free(dev->udid);
+	free(dev);
+}
+
+/* passes lines of a device on to the aggregator callback */
+struct syslog_relay_aggregator_line_context {
+	syslog_relay_aggregator_t aggregator;
+	struct syslog_relay_aggregator_device *dev;
+};
+
+static void syslog_relay_aggregator_line_cb(const char *data, uint32_t length, void *user_data)
+{
+	struct syslog_relay_aggregator_line_context *ctx = (struct syslog_relay_aggregator_line_context*)user_data;
+	/* the callback may have removed the device with an earlier line */
+	if (ctx->dev->removed)
+		return;
+	ctx->aggregator->callback(ctx->dev->udid, data, length, ctx->aggregator->user_data);
+}
+
+/**
+ * Reads the available data of a device and delivers all complete lines.
+ *
+ * @return 0 on success, -1 if the connection to the device ended.
+ */
+static int syslog_relay_aggregator_read(syslog_relay_aggregator_t aggregator, struct syslog_relay_aggregator_device *dev)
+{
+	struct syslog_relay_aggregator_line_context ctx = { aggregator, dev };
+	idevice_connection_t connection = dev->client->parent->connection;
+
+	do {
+		if (dev->fill >= dev->bufsize - 1) {
+			/* a single line fills the whole buffer */
+			if (dev->bufsize < SYSLOG_RELAY_MAX_LINE_SIZE) {
+				char *newbuf = (char*)realloc(dev->buf, dev->bufsize * 2);
+				if (newbuf) {
+					dev->buf = newbuf;
+					dev->bufsize *= 2;
+				}
+			}
+			if (dev->fill >= dev->bufsize - 1) {
+				debug_info("Line exceeds %u bytes, passing it on unterminated", dev->fill);
+				dev->buf[dev->fill] = '\0';
+				syslog_relay_aggregator_line_cb(dev->buf, dev->fill, &ctx);
+				dev->fill = 0;
+			}
+		}
+
+		uint32_t bytes = 0;
+		/* the connection is readable, so the timeout doesn't matter here */
+		syslog_relay_error_t ret = syslog_relay_receive_with_timeout(dev->client, dev->buf + dev->fill, dev->bufsize - dev->fill - 1, &bytes, 1);
+		if (ret == SYSLOG_RELAY_E_TIMEOUT || ret == SYSLOG_RELAY_E_NOT_ENOUGH_DATA || (bytes == 0 && ret == SYSLOG_RELAY_E_SUCCESS)) {
+			break;
+		} else if (ret < 0) {
+			debug_info("Connection to syslog relay of %s interrupted", dev->udid);
+			return -1;
+		}
+
+		dev->fill += bytes;
+		uint32_t used = syslog_relay_deliver_lines(syslog_relay_aggregator_line_cb, &ctx, dev->buf, dev->fill);
+		if (used > 0) {
+			dev->fill -= used;
+			memmove(dev->buf, dev->buf + used, dev->fill);
+		}
+		/* decrypted data can be pending that the fd doesn't report */
+	} while (connection->ssl_data && !dev->removed);
+
+	return 0;
+}
+
+static void *syslog_relay_aggregator_thread(void *arg)
+{
+	syslog_relay_aggregator_t aggregator = (syslog_relay_aggregator_t)arg;
+	struct pollfd *pfds = NULL;
+	struct syslog_relay_aggregator_device **ready_devs = NULL;
+	unsigned int pfds_size = 0;
+
+	debug_info("Running");
+
+	while (!aggregator->quit) {
+		struct syslog_relay_aggregator_device *dev;
+		unsigned int n = 0;
+
+		mutex_lock(&aggregator->mutex);
+		for (dev = aggregator->devices; dev; dev = dev->next) {
+			n++;
+		}
+		if (n > pfds_size) {
+			struct pollfd *newpfds = (struct pollfd*)realloc(pfds, sizeof(struct pollfd) * n);
+			if (newpfds)
+				pfds = newpfds;
+			struct syslog_relay_aggregator_device **newready = (struct syslog_relay_aggregator_device**)realloc(ready_devs, sizeof(struct syslog_relay_aggregator_device*) * n);
+			if (newready)
+				ready_devs = newready;
+			if (!newpfds || !newready) {
+				mutex_unlock(&aggregator->mutex);
+				debug_info("ERROR: out of memory");
+				break;
+			}
+			pfds_size = n;
+		}
+		n = 0;
+		for (dev = aggregator->devices; dev; dev = dev->next) {
+			pfds[n].fd = dev->fd;
+			pfds[n].events = POLLIN;
+			pfds[n].revents = 0;
+			dev->pfd_index = n++;
+		}
+		mutex_unlock(&aggregator->mutex);
+
+		if (n == 0) {
+			/* nothing to wait for yet */
+#ifdef WIN32
+			Sleep(SYSLOG_RELAY_AGGREGATOR_POLL_TIMEOUT);
+#else
+			poll(NULL, 0, SYSLOG_RELAY_AGGREGATOR_POLL_TIMEOUT);
+#endif
+			continue;
+		}
+
+		int ready = poll(pfds, n, SYSLOG_RELAY_AGGREGATOR_POLL_TIMEOUT);
+		if (ready <= 0) {
+			continue;
+		}
+
+		/* busy devices stay in the list until the thread is done with them */
+		unsigned int num_ready = 0;
+		mutex_lock(&aggregator->mutex);
+		for (dev = aggregator->devices; dev; dev = dev->next) {
+			/* devices added while waiting have no poll entry yet */
+			if (dev->pfd_index < 0 || !(pfds[dev->pfd_index].revents & (POLLIN | POLLHUP | POLLERR)))
+				continue;
+			dev->busy = 1;
+			ready_devs[num_ready++] = dev;
+		}
+		mutex_unlock(&aggregator->mutex);
+
+		/* the callback runs unlocked, so it may add or remove devices */
+		unsigned int i;
+		for (i = 0; i < num_ready; i++) {
+			dev = ready_devs[i];
+			int ended = (dev->removed) ? 0 : (syslog_relay_aggregator_read(aggregator, dev) < 0);
+			if (ended && !dev->removed)
+				aggregator->callback(dev->udid, NULL, 0, aggregator->user_data);
+
+			mutex_lock(&aggregator->mutex);
+			dev->busy = 0;
+			if (ended || dev->removed) {
+				struct syslog_relay_aggregator_device **prev;
+				for (prev = &aggregator->devices; *prev; prev = &(*prev)->next) {
+					if (*prev == dev) {
+						*prev = dev->next;
+						break;
+					}
+				}
+			} else {
+				dev = NULL;
+			}
+			mutex_unlock(&aggregator->mutex);
+
+			if (dev)
+				syslog_relay_aggregator_device_free(dev);
+		}
+	}
+
+	free(ready_devs);
+	free(pfds);
+
+	debug_info("Exiting");
+
+	return NULL;
+}
+
+LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_aggregator_new(syslog_relay_aggregator_cb_t callback, void *user_data, syslog_relay_aggregator_t *aggregator)
+{
+	if (!callback || !aggregator)
+		return SYSLOG_RELAY_E_INVALID_ARG;
+
+	syslog_relay_aggregator_t aggregator_loc = (syslog_relay_aggregator_t)calloc(1, sizeof(struct syslog_relay_aggregator_private));
+	if (!aggregator_loc)
+		return SYSLOG_RELAY_E_UNKNOWN_ERROR;
+
+	mutex_init(&aggregator_loc->mutex);
+	aggregator_loc->callback = callback;
+	aggregator_loc->user_data = user_data;
+
+	if (thread_new(&aggregator_loc->thread, syslog_relay_aggregator_thread, aggregator_loc) != 0) {
+		mutex_destroy(&aggregator_loc->mutex);
+		free(aggregator_loc);
+		return SYSLOG_RELAY_E_UNKNOWN_ERROR;
+	}
+
+	*aggregator = aggregator_loc;
+
+	return SYSLOG_RELAY_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_aggregator_free(syslog_relay_aggregator_t aggregator)
+{
+	if (!aggregator)
+		return SYSLOG_RELAY_E_INVALID_ARG;
+
+	aggregator->quit = 1;
+	thread_join(aggregator->thread);
+	thread_free(aggregator->thread);
+
+	while (aggregator->devices) {
+		struct syslog_relay_aggregator_device *dev = aggregator->devices;
+		aggregator->devices = dev->next;
+		syslog_relay_aggregator_device_free(dev);
+	}
+	mutex_destroy(&aggregator->mutex);
+	free(aggregator);
+
+	return SYSLOG_RELAY_E_SUCCESS;
+}
+
+static struct syslog_relay_aggregator_device *syslog_relay_aggregator_find(syslog_relay_aggregator_t aggregator, const char *udid)
+{
+	struct syslog_relay_aggregator_device *dev;
+	for (dev = aggregator->devices; dev; dev = dev->next) {
+		if (!dev->removed && strcmp(dev->udid, udid) == 0)
+			return dev;
+	}
+	return NULL;
+}
+
+LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_aggregator_add_device(syslog_relay_aggregator_t aggregator, const char *udid, enum idevice_options options)
+{
+	if (!aggregator || !udid)
+		return SYSLOG_RELAY_E_INVALID_ARG;
+
+	mutex_lock(&aggregator->mutex);
+	int known = (syslog_relay_aggregator_find(aggregator, udid) != NULL);
+	mutex_unlock(&aggregator->mutex);
+	if (known)
+		return SYSLOG_RELAY_E_SUCCESS;
+
+	struct syslog_relay_aggregator_device *dev = (struct syslog_relay_aggregator_device*)calloc(1, sizeof(struct syslog_relay_aggregator_device));
+	if (!dev)
+		return SYSLOG_RELAY_E_UNKNOWN_ERROR;
+	dev->udid = strdup(udid);
+	dev->bufsize = SYSLOG_RELAY_READ_SIZE;
+	dev->buf = (char*)malloc(dev->bufsize);
+	dev->pfd_index = -1;
+	if (!dev->udid || !dev->buf) {
+		syslog_relay_aggregator_device_free(dev);
+		return SYSLOG_RELAY_E_UNKNOWN_ERROR;
+	}
+
+	/* connect without holding the lock, this takes a while */
+	if (idevice_new_with_options(&dev->device, udid, options) != IDEVICE_E_SUCCESS) {
+		debug_info("Device %s not found", udid);
+		syslog_relay_aggregator_device_free(dev);
+		return SYSLOG_RELAY_E_MUX_ERROR;
+	}
+	syslog_relay_error_t res = syslog_relay_client_start_service(dev->device, &dev->client, "syslog_relay_aggregator");
+	if (res != SYSLOG_RELAY_E_SUCCESS) {
+		debug_info("Could not start syslog_relay on %s, error %d", udid, res);
+		syslog_relay_aggregator_device_free(dev);
+		return res;
+	}
+	if (idevice_connection_get_fd(dev->client->parent->connection, &dev->fd) != IDEVICE_E_SUCCESS) {
+		syslog_relay_aggregator_device_free(dev);
+		return SYSLOG_RELAY_E_UNKNOWN_ERROR;
+	}
+
+	mutex_lock(&aggregator->mutex);
+	if (syslog_relay_aggregator_find(aggregator, udid)) {
+		/* added concurrently */
+		mutex_unlock(&aggregator->mutex);
+		syslog_relay_aggregator_device_free(dev);
+		return SYSLOG_RELAY_E_SUCCESS;
+	}
+	dev->next = aggregator->devices;
+	aggregator->devices = dev;
+	mutex_unlock(&aggregator->mutex);
+
+	debug_info("Added device %s", udid);
+
+	return SYSLOG_RELAY_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_aggregator_remove_device(syslog_relay_aggregator_t aggregator, const char *udid)
+{
+	if (!aggregator || !udid)
+		return SYSLOG_RELAY_E_INVALID_ARG;
+
+	struct syslog_relay_aggregator_device *dev = NULL;
+	struct syslog_relay_aggregator_device **prev;
+
+	mutex_lock(&aggregator->mutex);
+	for (prev = &aggregator->devices; *prev; prev = &(*prev)->next) {
+		if (!(*prev)->removed && strcmp((*prev)->udid, udid) == 0) {
+			dev = *prev;
+			if (dev->busy) {
+				/* being read, possibly by this very callback, the thread frees it */
+				dev->removed = 1;
+				mutex_unlock(&aggregator->mutex);
+				return SYSLOG_RELAY_E_SUCCESS;
+			}
+			*prev = dev->next;
+			break;
+		}
+	}
+	mutex_unlock(&aggregator->mutex);
+
+	if (!dev)
+		return SYSLOG_RELAY_E_INVALID_ARG;
+
+	syslog_relay_aggregator_device_free(dev);
+
+	return SYSLOG_RELAY_E_SUCCESS;
+}
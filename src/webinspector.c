@@ -28,6 +28,7 @@
 
 #include "webinspector.h"
 #include "lockdown.h"
+#include "service.h"
 #include "common/debug.h"
 
 /**
@@ -82,6 +83,8 @@ LIBIMOBILEDEVICE_API webinspector_error_t webinspector_client_new(idevice_t devi
 
 	webinspector_client_t client_loc = (webinspector_client_t) malloc(sizeof(struct webinspector_client_private));
 	client_loc->parent = plclient;
+	client_loc->reassembly = NULL;
+	client_loc->reassembly_size = 0;
 
 	*client = client_loc;
 
@@ -102,21 +105,122 @@ LIBIMOBILEDEVICE_API webinspector_error_t webinspector_client_free(webinspector_
 		return WEBINSPECTOR_E_INVALID_ARG;
 
 	webinspector_error_t err = webinspector_error(property_list_service_client_free(client->parent));
+	free(client->reassembly);
 	free(client);
 
 	return err;
 }
 
+/**
+ * Sends a chunk of a serialized message wrapped in a dictionary with a single
+ * data item, like property_list_service_send_binary_plist() would. The
+ * binary plist framing is written by hand around the chunk, so the chunk is
+ * sent straight out of the serialized message without copying it again.
+ */
+static webinspector_error_t webinspector_send_chunk(webinspector_client_t client, const char *key, const char *data, uint32_t length)
+{
+	unsigned char head[4 + 8 + 3 + 3 + WEBINSPECTOR_MAX_KEY_LENGTH + 5];
+	unsigned char tail[3 + 32];
+	uint32_t key_len = (uint32_t)strlen(key);
+	uint32_t h = 4;
+	uint32_t i;
+
+	if (key_len > WEBINSPECTOR_MAX_KEY_LENGTH)
+		return WEBINSPECTOR_E_INVALID_ARG;
+
+	/* header and the dict object referencing key object 1 and value object 2 */
+	memcpy(head + h, "bplist00", 8);
+	h += 8;
+	uint32_t dict_offset = h - 4;
+	head[h++] = 0xD1;
+	head[h++] = 1;
+	head[h++] = 2;
+
+	/* ASCII string object with the key */
+	uint32_t key_offset = h - 4;
+	if (key_len < 15) {
+		head[h++] = 0x50 | key_len;
+	} else {
+		head[h++] = 0x5F;
+		head[h++] = 0x10;
+		head[h++] = (unsigned char)key_len;
+	}
+	memcpy(head + h, key, key_len);
+	h += key_len;
+
+	/* data object header, the data follows right after it */
+	uint32_t data_offset = h - 4;
+	if (length < 15) {
+		head[h++] = 0x40 | length;
+	} else if (length <= 0xFF) {
+		head[h++] = 0x4F;
+		head[h++] = 0x10;
+		head[h++] = (unsigned char)length;
+	} else if (length <= 0xFFFF) {
+		head[h++] = 0x4F;
+		head[h++] = 0x11;
+		head[h++] = (unsigned char)(length >> 8);
+		head[h++] = (unsigned char)length;
+	} else {
+		head[h++] = 0x4F;
+		head[h++] = 0x12;
+		head[h++] = (unsigned char)(length >> 24);
+		head[h++] = (unsigned char)(length >> 16);
+		head[h++] = (unsigned char)(length >> 8);
+		head[h++] = (unsigned char)length;
+	}
+
+	/* offset table with 1 byte offsets and the trailer */
+	uint64_t table_offset = (uint64_t)(h - 4) + length;
+	memset(tail, '\0', sizeof(tail));
+	tail[0] = (unsigned char)dict_offset;
+	tail[1] = (unsigned char)key_offset;
+	tail[2] = (unsigned char)data_offset;
+	tail[3 + 6] = 1; /* offset size */
+	tail[3 + 7] = 1; /* object reference size */
+	tail[3 + 15] = 3; /* number of objects */
+	/* top object is object 0 */
+	for (i = 0; i < 8; i++) {
+		tail[3 + 31 - i] = (unsigned char)(table_offset >> (i * 8));
+	}
+
+	/* big endian length prefix of the property list service */
+	uint32_t total = (uint32_t)(table_offset + sizeof(tail));
+	head[0] = (unsigned char)(total >> 24);
+	head[1] = (unsigned char)(total >> 16);
+	head[2] = (unsigned char)(total >> 8);
+	head[3] = (unsigned char)total;
+
+	idevice_iovec_t iov[3];
+	iov[0].data = (char*)head;
+	iov[0].len = h;
+	iov[1].data = (char*)data;
+	iov[1].len = length;
+	iov[2].data = (char*)tail;
+	iov[2].len = sizeof(tail);
+
+	uint32_t sent = 0;
+	service_error_t err = service_sendv(client->parent->parent, iov, 3, &sent);
+	if (err != SERVICE_E_SUCCESS || sent != h + length + sizeof(tail)) {
+		debug_info("Could not send chunk, error %d", err);
+		return WEBINSPECTOR_E_MUX_ERROR;
+	}
+
+	return WEBINSPECTOR_E_SUCCESS;
+}
+
 LIBIMOBILEDEVICE_API webinspector_error_t webinspector_send(webinspector_client_t client, plist_t plist)
 {
 	webinspector_error_t res = WEBINSPECTOR_E_UNKNOWN_ERROR;
 
 	uint32_t offset = 0;
-	int is_final_message = 0;
 
 	char *packet = NULL;
 	uint32_t packet_length = 0;
 
+	if (!client || !client->parent || !plist)
+		return WEBINSPECTOR_E_INVALID_ARG;
+
 	debug_info("Sending webinspector message...");
 	debug_plist(plist);
 
@@ -124,49 +228,67 @@ LIBIMOBILEDEVICE_API webinspector_error_t webinspector_send(webinspector_client_
 	plist_to_bin(plist, &packet, &packet_length);
 	if (!packet || packet_length == 0) {
 		debug_info("Error converting plist to binary.");
+		free(packet);
 		return res;
 	}
 
+	/* send partial chunks straight out of the packet, then the final one */
 	do {
-		/* determine if we need to send partial messages */
-		if (packet_length < WEBINSPECTOR_PARTIAL_PACKET_CHUNK_SIZE) {
-			is_final_message = 1;
+		uint32_t remaining = packet_length - offset;
+		if (remaining < WEBINSPECTOR_PARTIAL_PACKET_CHUNK_SIZE) {
+			res = webinspector_send_chunk(client, "WIRFinalMessageKey", packet + offset, remaining);
+			offset += remaining;
 		} else {
-			/* send partial packet */
-			is_final_message = 0;
-		}
-
-		plist_t outplist = plist_new_dict();
-		if (!is_final_message) {
-			/* split packet into partial chunks */
-			plist_dict_set_item(outplist, "WIRPartialMessageKey", plist_new_data(packet + offset, WEBINSPECTOR_PARTIAL_PACKET_CHUNK_SIZE));
+			res = webinspector_send_chunk(client, "WIRPartialMessageKey", packet + offset, WEBINSPECTOR_PARTIAL_PACKET_CHUNK_SIZE);
 			offset += WEBINSPECTOR_PARTIAL_PACKET_CHUNK_SIZE;
-			packet_length -= WEBINSPECTOR_PARTIAL_PACKET_CHUNK_SIZE;
-		} else {
-			/* send final chunk */
-			plist_dict_set_item(outplist, "WIRFinalMessageKey", plist_new_data(packet + offset, packet_length));
-			offset += packet_length;
-			packet_length -= packet_length;
 		}
-
-		res = webinspector_error(property_list_service_send_binary_plist(client->parent, outplist));
-		plist_free(outplist);
-		outplist = NULL;
 		if (res != WEBINSPECTOR_E_SUCCESS) {
 			debug_info("Sending plist failed with error %d", res);
-			return res;
+			break;
 		}
-	} while(packet_length > 0);
+	} while (offset < packet_length);
 
 	free(packet);
-	packet = NULL;
 
 	return res;
 }
 
 LIBIMOBILEDEVICE_API webinspector_error_t webinspector_receive(webinspector_client_t client, plist_t * plist)
 {
-	return webinspector_receive_with_timeout(client, plist, 5000);
+	if (!client || !client->parent)
+		return WEBINSPECTOR_E_INVALID_ARG;
+
+	webinspector_error_t res = webinspector_receive_with_timeout(client, plist, service_client_default_timeout(client->parent->parent, 5000));
+	if (res == WEBINSPECTOR_E_RECEIVE_TIMEOUT) {
+		service_client_timeout_expired(client->parent->parent);
+	}
+	return res;
+}
+
+/**
+ * Makes sure the reassembly buffer of a client can hold the given number of
+ * bytes, growing it geometrically so that appending chunks is amortized
+ * linear.
+ *
+ * @return 0 on success or -1 if out of memory.
+ */
+static int webinspector_reassembly_reserve(webinspector_client_t client, uint64_t needed)
+{
+	if (needed <= client->reassembly_size)
+		return 0;
+
+	uint64_t size = (client->reassembly_size) ? client->reassembly_size : WEBINSPECTOR_REASSEMBLY_MIN_SIZE;
+	while (size < needed) {
+		size *= 2;
+	}
+
+	char *buffer = (char*)realloc(client->reassembly, size);
+	if (!buffer)
+		return -1;
+	client->reassembly = buffer;
+	client->reassembly_size = size;
+
+	return 0;
 }
 
 LIBIMOBILEDEVICE_API webinspector_error_t webinspector_receive_with_timeout(webinspector_client_t client, plist_t * plist, uint32_t timeout_ms)
@@ -177,11 +299,8 @@ LIBIMOBILEDEVICE_API webinspector_error_t webinspector_receive_with_timeout(webi
 
 	int is_final_message = 1;
 
-	char* buffer = NULL;
+	const char* buffer = NULL;
 	uint64_t length = 0;
-
-	char* packet = NULL;
-	char* newpacket = NULL;
 	uint64_t packet_length = 0;
 
 	debug_info("Receiving webinspector message...");
@@ -192,7 +311,8 @@ LIBIMOBILEDEVICE_API webinspector_error_t webinspector_receive_with_timeout(webi
 		if (res != WEBINSPECTOR_E_SUCCESS || !message) {
 			debug_info("Could not receive message, error %d", res);
 			plist_free(message);
-			return WEBINSPECTOR_E_MUX_ERROR;
+			res = WEBINSPECTOR_E_MUX_ERROR;
+			goto leave;
 		}
 
 		/* get message key */
@@ -202,7 +322,8 @@ LIBIMOBILEDEVICE_API webinspector_error_t webinspector_receive_with_timeout(webi
 			if (!key) {
 				debug_info("ERROR: Unable to read message key.");
 				plist_free(message);
-				return WEBINSPECTOR_E_PLIST_ERROR;
+				res = WEBINSPECTOR_E_PLIST_ERROR;
+				goto leave;
 			}
 			is_final_message = 0;
 		} else {
@@ -210,53 +331,55 @@ LIBIMOBILEDEVICE_API webinspector_error_t webinspector_receive_with_timeout(webi
 		}
 
 		/* read partial data */
-		plist_get_data_val(key, &buffer, &length);
-		if (!buffer || length == 0 || length > 0xFFFFFFFF) {
+		buffer = plist_get_data_ptr(key, &length);
+		if (!buffer || length == 0 || packet_length + length > 0xFFFFFFFF) {
 			debug_info("ERROR: Unable to get the inner plist binary data.");
-			free(packet);
-			free(buffer);
-			return WEBINSPECTOR_E_PLIST_ERROR;
+			plist_free(message);
+			res = WEBINSPECTOR_E_PLIST_ERROR;
+			goto leave;
 		}
 
-		/* (re)allocate packet data */
-		if (!packet) {
-			packet = (char*)malloc(length * sizeof(char));
-		} else {
-			newpacket = (char*)realloc(packet, (packet_length + length) * sizeof(char));
-			packet = newpacket;
+		if (is_final_message && packet_length == 0) {
+			/* not split up, parse it directly out of the received message */
+			plist_from_bin(buffer, (uint32_t)length, plist);
+			plist_free(message);
+			if (!*plist) {
+				debug_info("Error restoring the final plist.");
+				return WEBINSPECTOR_E_PLIST_ERROR;
+			}
+			debug_plist(*plist);
+			return res;
 		}
 
-		/* copy partial data into final packet data */
-		memcpy(packet + packet_length, buffer, length);
-
-		/* cleanup buffer */
-		free(buffer);
-		buffer = NULL;
-
-		if (message) {
+		/* append the chunk, the complete message is only parsed once */
+		if (webinspector_reassembly_reserve(client, packet_length + length) < 0) {
+			debug_info("ERROR: Out of memory reassembling a message of %llu bytes", (unsigned long long)(packet_length + length));
 			plist_free(message);
-			message = NULL;
+			res = WEBINSPECTOR_E_UNKNOWN_ERROR;
+			goto leave;
 		}
-
-		/* adjust packet length */
+		memcpy(client->reassembly + packet_length, buffer, length);
 		packet_length += length;
-		length = 0;
+
+		plist_free(message);
+		message = NULL;
 	} while(!is_final_message);
 
 	/* read final message */
-	if (packet_length) {
-		plist_from_bin(packet, (uint32_t)packet_length, plist);
-		if (!*plist) {
-			debug_info("Error restoring the final plist.");
-			free(packet);
-			return WEBINSPECTOR_E_PLIST_ERROR;
-		}
-
-		debug_plist(*plist);
+	plist_from_bin(client->reassembly, (uint32_t)packet_length, plist);
+	if (!*plist) {
+		debug_info("Error restoring the final plist.");
+		res = WEBINSPECTOR_E_PLIST_ERROR;
+		goto leave;
 	}
-
-	if (packet) {
-		free(packet);
+	debug_plist(*plist);
+
+leave:
+	/* don't hold on to the memory of exceptionally large messages */
+	if (client->reassembly_size > WEBINSPECTOR_REASSEMBLY_KEEP_SIZE) {
+		free(client->reassembly);
+		client->reassembly = NULL;
+		client->reassembly_size = 0;
 	}
 
 	return res;
@@ -26,9 +26,18 @@
 #include "property_list_service.h"
 
 #define WEBINSPECTOR_PARTIAL_PACKET_CHUNK_SIZE 8096
+/* longest dictionary key the chunk framing is written for */
+#define WEBINSPECTOR_MAX_KEY_LENGTH 32
+
+/* initial size of the buffer partial messages are reassembled in */
+#define WEBINSPECTOR_REASSEMBLY_MIN_SIZE 0x10000
+/* larger buffers are released after a message instead of being kept */
+#define WEBINSPECTOR_REASSEMBLY_KEEP_SIZE 0x400000
 
 struct webinspector_client_private {
 	property_list_service_client_t parent;
+	char *reassembly;
+	uint64_t reassembly_size;
 };
 
 #endif
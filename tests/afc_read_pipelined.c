@@ -0,0 +1,174 @@
+/*
+ * afc_read_pipelined.c
+ * Checks that afc_file_read_pipelined() reports a chunk failing in the
+ * middle of the pipeline instead of returning a short successful read
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "afc.h"
+
+#define CHUNK_SIZE 1024
+#define NUM_CHUNKS 4
+#define FAILING_CHUNK 2
+
+struct readinfo {
+	uint64_t handle;
+	uint64_t size;
+};
+
+static int read_all(int fd, void *buf, size_t len)
+{
+	size_t got = 0;
+	while (got < len) {
+		ssize_t r = read(fd, (char*)buf + got, len - got);
+		if (r <= 0)
+			return -1;
+		got += r;
+	}
+	return 0;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	size_t done = 0;
+	while (done < len) {
+		ssize_t w = write(fd, (const char*)buf + done, len - done);
+		if (w <= 0)
+			return -1;
+		done += w;
+	}
+	return 0;
+}
+
+static char file_byte(uint64_t offset)
+{
+	return (char)(offset * 7 + 3);
+}
+
+/* answers the read requests in order, failing one of them */
+static void* fake_device(void *arg)
+{
+	int fd = (int)(long)arg;
+	uint64_t offset = 0;
+	int i;
+
+	for (i = 0; i < NUM_CHUNKS; i++) {
+		AFCPacket req;
+		struct readinfo info;
+		if (read_all(fd, &req, sizeof(req)) < 0 || read_all(fd, &info, sizeof(info)) < 0)
+			break;
+		AFCPacket_from_LE(&req);
+		uint64_t size = le64toh(info.size);
+		if (size > CHUNK_SIZE)
+			break;
+
+		AFCPacket resp;
+		memcpy(resp.magic, AFC_MAGIC, AFC_MAGIC_LEN);
+		resp.packet_num = req.packet_num;
+		if (i == FAILING_CHUNK) {
+			/* the device has still moved its file position */
+			uint64_t status = htole64(AFC_E_IO_ERROR);
+			resp.operation = AFC_OP_STATUS;
+			resp.entire_length = resp.this_length = sizeof(resp) + sizeof(status);
+			AFCPacket_to_LE(&resp);
+			write_all(fd, &resp, sizeof(resp));
+			write_all(fd, &status, sizeof(status));
+		} else {
+			char buf[CHUNK_SIZE];
+			uint64_t j;
+			for (j = 0; j < size; j++)
+				buf[j] = file_byte(offset + j);
+			resp.operation = AFC_OP_DATA;
+			resp.entire_length = resp.this_length = sizeof(resp) + size;
+			AFCPacket_to_LE(&resp);
+			write_all(fd, &resp, sizeof(resp));
+			write_all(fd, buf, size);
+		}
+		offset += size;
+	}
+	return NULL;
+}
+
+int main(void)
+{
+	int sv[2];
+	THREAD_T device;
+	int res = 1;
+	uint32_t i;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+		perror("socketpair");
+		return 1;
+	}
+
+	struct idevice_connection_private connection;
+	memset(&connection, 0, sizeof(connection));
+	connection.type = CONNECTION_NETWORK;
+	connection.data = (void*)(long)sv[0];
+
+	struct service_client_private service;
+	memset(&service, 0, sizeof(service));
+	service.connection = &connection;
+
+	afc_client_t afc = NULL;
+	if (afc_client_new_with_service_client(&service, &afc) != AFC_E_SUCCESS) {
+		fprintf(stderr, "Could not create AFC client\n");
+		return 1;
+	}
+
+	if (thread_new(&device, fake_device, (void*)(long)sv[1]) != 0) {
+		fprintf(stderr, "Could not start fake device\n");
+		return 1;
+	}
+
+	char data[CHUNK_SIZE * NUM_CHUNKS];
+	uint32_t bytes_read = 0;
+	afc_error_t err = afc_file_read_pipelined(afc, 1, data, sizeof(data), CHUNK_SIZE, NUM_CHUNKS, &bytes_read);
+	thread_join(device);
+	thread_free(device);
+
+	if (err != AFC_E_IO_ERROR) {
+		fprintf(stderr, "Expected AFC_E_IO_ERROR, got %d with %u bytes\n", err, bytes_read);
+	} else if (bytes_read != CHUNK_SIZE * FAILING_CHUNK) {
+		fprintf(stderr, "Expected %u bytes before the failed chunk, got %u\n", CHUNK_SIZE * FAILING_CHUNK, bytes_read);
+	} else {
+		res = 0;
+		for (i = 0; i < bytes_read; i++) {
+			if (data[i] != file_byte(i)) {
+				fprintf(stderr, "Data mismatch at offset %u\n", i);
+				res = 1;
+				break;
+			}
+		}
+	}
+
+	afc_client_free(afc);
+	idevice_connection_set_receive_buffer_size(&connection, 0);
+	close(sv[0]);
+	close(sv[1]);
+
+	return res;
+}
@@ -0,0 +1,958 @@
+/*
+ * fakedevice.c
+ * A device emulated in the same process over socketpairs, answering the
+ * lockdown handshake with an SSL session and serving AFC from memory
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#ifdef HAVE_OPENSSL
+#include <openssl/ssl.h>
+#include <openssl/pem.h>
+#else
+#include <gnutls/gnutls.h>
+#include <gnutls/x509.h>
+#endif
+
+#include "fakedevice.h"
+#include "idevice.h"
+#include "afc.h"
+#include "endianness.h"
+#include "common/userpref.h"
+#include "common/thread.h"
+
+#define LOCKDOWN_PORT 0xf27e
+#define AFC_PORT 0xbe7c
+
+#define FAKEDEVICE_HOST_ID "3EF0F1F2-0000-4000-8000-FAKEDEVICE00"
+#define FAKEDEVICE_SESSION_ID "FAKEDEVICE-SESSION"
+#define FAKEDEVICE_BLOCK_SIZE 4096
+
+/* largest lockdown message and AFC packet accepted from the client */
+#define FAKEDEVICE_MAX_PLIST_SIZE (1024 * 1024)
+#define FAKEDEVICE_MAX_PACKET_SIZE (64 * 1024 * 1024)
+
+#ifndef HAVE_OPENSSL
+/* the client offers TLS 1.0 with RSA key exchange for the default policy */
+#define FAKEDEVICE_SSL_PRIORITY "NORMAL:+VERS-TLS1.0:+VERS-TLS1.1:+RSA:+SHA1:+AES-128-CBC:+AES-256-CBC"
+#endif
+
+/* PKCS#1 public key of the device, the DeviceCertificate is issued for it */
+static const char device_public_key[] =
+	"-----BEGIN RSA PUBLIC KEY-----\n"
+	"MIIBCgKCAQEAmRgC+mqgJHwZirHnleAbp/xewwWqlbDYw22qhp5i+FSiiCEDsbx0\n"
+	"VbizQNM+zmdhKvEDf6ccMhdRifFfcC80SpvU6mwMlPODrPc7UzODuYBIIRFEc3cF\n"
+	"dhgBw/YYlt4zhwnHXUpSAMS4cR+jnQSwbHTaWKatkDuP1oK+fqx9fvlCan5oWI9e\n"
+	"ivz9Vkng0o/TYA1XSUwFxMd27Tn46CnC/J9dOhqt8sTUFhHiWTyLLM1mNpTVDG7Y\n"
+	"qKsKS7IyUPYU77tqx3KXeYq3c7g9P2ho5yiEAdR43ysNpdV+1IE9+lHAt0qvn0jk\n"
+	"qHPX0kKPbYLAAUeECUaVl+yWjuGHXIOMdwIDAQAB\n"
+	"-----END RSA PUBLIC KEY-----\n";
+
+struct fake_file {
+	char *path;
+	char *data;
+	uint64_t size;
+	uint64_t alloc;
+	struct fake_file *next;
+};
+
+struct fake_handle {
+	uint64_t id;
+	struct fake_file *file;
+	uint64_t pos;
+	struct fake_handle *next;
+};
+
+struct fakedevice {
+	struct idevice_loopback loopback;
+	int options;
+	char *host_id;
+	mutex_t mutex;
+	/* signalled when the last connection is closed */
+	cond_t idle;
+	unsigned int connections;
+	/* protected by mutex */
+	struct fake_file *files;
+	uint64_t next_handle;
+#ifdef HAVE_OPENSSL
+	SSL_CTX *ssl_ctx;
+#else
+	gnutls_certificate_credentials_t credentials;
+	gnutls_datum_t ticket_key;
+#endif
+};
+
+struct fake_connection {
+	struct fakedevice *fake;
+	int fd;
+#ifdef HAVE_OPENSSL
+	SSL *ssl;
+#else
+	gnutls_session_t ssl;
+#endif
+	/* AFC only */
+	struct fake_handle *handles;
+};
+
+static int conn_read(struct fake_connection *conn, void *buf, size_t len)
+{
+	size_t done = 0;
+
+	while (done < len) {
+		ssize_t r;
+		if (conn->ssl) {
+#ifdef HAVE_OPENSSL
+			r = SSL_read(conn->ssl, (char*)buf + done, (int)(len - done));
+#else
+			r = gnutls_record_recv(conn->ssl, (char*)buf + done, len - done);
+			if (r == GNUTLS_E_AGAIN || r == GNUTLS_E_INTERRUPTED)
+				continue;
+#endif
+		} else {
+			r = recv(conn->fd, (char*)buf + done, len - done, 0);
+		}
+		if (r <= 0)
+			return -1;
+		done += r;
+	}
+	return 0;
+}
+
+static int conn_write(struct fake_connection *conn, const void *buf, size_t len)
+{
+	size_t done = 0;
+
+	while (done < len) {
+		ssize_t w;
+		if (conn->ssl) {
+#ifdef HAVE_OPENSSL
+			w = SSL_write(conn->ssl, (const char*)buf + done, (int)(len - done));
+#else
+			w = gnutls_record_send(conn->ssl, (const char*)buf + done, len - done);
+			if (w == GNUTLS_E_AGAIN || w == GNUTLS_E_INTERRUPTED)
+				continue;
+#endif
+		} else {
+			w = send(conn->fd, (const char*)buf + done, len - done, 0);
+		}
+		if (w <= 0)
+			return -1;
+		done += w;
+	}
+	return 0;
+}
+
+/**
+ * Performs the server side of the SSL handshake with the root credentials
+ * of the pair record. The client doesn't verify the certificate.
+ */
+static int conn_start_ssl(struct fake_connection *conn)
+{
+#ifdef HAVE_OPENSSL
+	SSL *ssl = SSL_new(conn->fake->ssl_ctx);
+	if (!ssl)
+		return -1;
+	SSL_set_fd(ssl, conn->fd);
+	if (SSL_accept(ssl) != 1) {
+		fprintf(stderr, "fakedevice: SSL handshake failed\n");
+		SSL_free(ssl);
+		return -1;
+	}
+#else
+	gnutls_session_t ssl = NULL;
+	int res;
+
+	if (gnutls_init(&ssl, GNUTLS_SERVER) != GNUTLS_E_SUCCESS)
+		return -1;
+	gnutls_priority_set_direct(ssl, FAKEDEVICE_SSL_PRIORITY, NULL);
+	gnutls_credentials_set(ssl, GNUTLS_CRD_CERTIFICATE, conn->fake->credentials);
+	gnutls_session_ticket_enable_server(ssl, &conn->fake->ticket_key);
+	gnutls_transport_set_ptr(ssl, (gnutls_transport_ptr_t)(long)conn->fd);
+	do {
+		res = gnutls_handshake(ssl);
+	} while (res == GNUTLS_E_AGAIN || res == GNUTLS_E_INTERRUPTED);
+	if (res != GNUTLS_E_SUCCESS) {
+		fprintf(stderr, "fakedevice: SSL handshake failed: %s\n", gnutls_strerror(res));
+		gnutls_deinit(ssl);
+		return -1;
+	}
+#endif
+	conn->ssl = ssl;
+	return 0;
+}
+
+/**
+ * Waits for the close notify of the client and answers it, after which the
+ * connection continues in plain text.
+ */
+static int conn_stop_ssl(struct fake_connection *conn)
+{
+	char c;
+	int res = -1;
+
+#ifdef HAVE_OPENSSL
+	if (SSL_read(conn->ssl, &c, 1) == 0 && SSL_get_error(conn->ssl, 0) == SSL_ERROR_ZERO_RETURN) {
+		SSL_shutdown(conn->ssl);
+		res = 0;
+	}
+	SSL_free(conn->ssl);
+#else
+	ssize_t r;
+	do {
+		r = gnutls_record_recv(conn->ssl, &c, 1);
+	} while (r == GNUTLS_E_AGAIN || r == GNUTLS_E_INTERRUPTED);
+	if (r == 0) {
+		gnutls_bye(conn->ssl, GNUTLS_SHUT_WR);
+		res = 0;
+	}
+	gnutls_deinit(conn->ssl);
+#endif
+	conn->ssl = NULL;
+	return res;
+}
+
+static int lockdown_receive(struct fake_connection *conn, plist_t *plist)
+{
+	uint32_t len = 0;
+
+	*plist = NULL;
+	if (conn_read(conn, &len, sizeof(len)) < 0)
+		return -1;
+	len = be32toh(len);
+	if (len == 0 || len > FAKEDEVICE_MAX_PLIST_SIZE)
+		return -1;
+
+	char *buf = (char*)malloc(len);
+	if (!buf)
+		return -1;
+	if (conn_read(conn, buf, len) == 0) {
+		if (len >= 8 && memcmp(buf, "bplist00", 8) == 0) {
+			plist_from_bin(buf, len, plist);
+		} else {
+			plist_from_xml(buf, len, plist);
+		}
+	}
+	free(buf);
+
+	return (*plist) ? 0 : -1;
+}
+
+static int lockdown_send(struct fake_connection *conn, plist_t plist)
+{
+	char *xml = NULL;
+	uint32_t len = 0;
+	int res = -1;
+
+	plist_to_xml(plist, &xml, &len);
+	if (!xml)
+		return -1;
+	uint32_t nlen = htobe32(len);
+	if (conn_write(conn, &nlen, sizeof(nlen)) == 0 && conn_write(conn, xml, len) == 0)
+		res = 0;
+	free(xml);
+
+	return res;
+}
+
+static char *dict_get_string(plist_t dict, const char *key)
+{
+	char *value = NULL;
+	plist_t node = plist_dict_get_item(dict, key);
+	if (node && plist_get_node_type(node) == PLIST_STRING)
+		plist_get_string_val(node, &value);
+	return value;
+}
+
+static plist_t lockdown_get_value(const char *key)
+{
+	if (!strcmp(key, "ProductVersion"))
+		return plist_new_string(FAKEDEVICE_PRODUCT_VERSION);
+	if (!strcmp(key, "UniqueDeviceID"))
+		return plist_new_string(FAKEDEVICE_UDID);
+	if (!strcmp(key, "DeviceName"))
+		return plist_new_string("fakedevice");
+	if (!strcmp(key, "DevicePublicKey"))
+		return plist_new_data(device_public_key, sizeof(device_public_key) - 1);
+	return NULL;
+}
+
+/* serves lockdownd, one request and response at a time */
+static void lockdown_serve(struct fake_connection *conn)
+{
+	int done = 0;
+
+	while (!done) {
+		plist_t request = NULL;
+		int start_ssl = 0;
+		int stop_ssl = 0;
+
+		if (lockdown_receive(conn, &request) < 0)
+			break;
+		char *name = dict_get_string(request, "Request");
+		if (!name) {
+			plist_free(request);
+			break;
+		}
+
+		plist_t response = plist_new_dict();
+		plist_dict_set_item(response, "Request", plist_new_string(name));
+		if (!strcmp(name, "QueryType")) {
+			plist_dict_set_item(response, "Type", plist_new_string("com.apple.mobile.lockdown"));
+		} else if (!strcmp(name, "GetValue")) {
+			char *key = dict_get_string(request, "Key");
+			plist_t value = (key && !plist_dict_get_item(request, "Domain")) ? lockdown_get_value(key) : NULL;
+			if (value) {
+				plist_dict_set_item(response, "Key", plist_new_string(key));
+				plist_dict_set_item(response, "Value", value);
+			} else {
+				plist_dict_set_item(response, "Error", plist_new_string("MissingValue"));
+			}
+			free(key);
+		} else if (!strcmp(name, "StartSession")) {
+			char *host_id = dict_get_string(request, "HostID");
+			if (host_id && !strcmp(host_id, conn->fake->host_id)) {
+				plist_dict_set_item(response, "SessionID", plist_new_string(FAKEDEVICE_SESSION_ID));
+				plist_dict_set_item(response, "EnableSessionSSL", plist_new_bool(1));
+				start_ssl = 1;
+			} else {
+				plist_dict_set_item(response, "Error", plist_new_string("InvalidHostID"));
+			}
+			free(host_id);
+		} else if (!strcmp(name, "StopSession")) {
+			stop_ssl = (conn->ssl != NULL);
+		} else if (!strcmp(name, "StartService")) {
+			char *service = dict_get_string(request, "Service");
+			if (!conn->ssl) {
+				plist_dict_set_item(response, "Error", plist_new_string("NoRunningSession"));
+			} else if (service && !strcmp(service, AFC_SERVICE_NAME)) {
+				plist_dict_set_item(response, "Service", plist_new_string(service));
+				plist_dict_set_item(response, "Port", plist_new_uint(AFC_PORT));
+				plist_dict_set_item(response, "EnableServiceSSL", plist_new_bool(conn->fake->options & FAKEDEVICE_AFC_SSL));
+			} else {
+				plist_dict_set_item(response, "Error", plist_new_string("InvalidService"));
+			}
+			free(service);
+		} else if (!strcmp(name, "Goodbye")) {
+			done = 1;
+		} else {
+			plist_dict_set_item(response, "Error", plist_new_string("InvalidRequest"));
+		}
+		free(name);
+		plist_free(request);
+
+		if (lockdown_send(conn, response) < 0)
+			done = 1;
+		plist_free(response);
+
+		if (done)
+			break;
+		if (start_ssl && conn_start_ssl(conn) < 0)
+			break;
+		if (stop_ssl && conn_stop_ssl(conn) < 0)
+			break;
+	}
+}
+
+static int afc_send(struct fake_connection *conn, uint64_t packet_num, uint64_t operation, const char *data, uint32_t len)
+{
+	AFCPacket header;
+
+	memcpy(header.magic, AFC_MAGIC, AFC_MAGIC_LEN);
+	header.entire_length = sizeof(AFCPacket) + len;
+	header.this_length = sizeof(AFCPacket) + len;
+	header.packet_num = packet_num;
+	header.operation = operation;
+	AFCPacket_to_LE(&header);
+	if (conn_write(conn, &header, sizeof(header)) < 0)
+		return -1;
+	return (len > 0) ? conn_write(conn, data, len) : 0;
+}
+
+static int afc_send_status(struct fake_connection *conn, uint64_t packet_num, uint64_t status)
+{
+	uint64_t value = htole64(status);
+	return afc_send(conn, packet_num, AFC_OP_STATUS, (const char*)&value, sizeof(value));
+}
+
+static int afc_send_uint64(struct fake_connection *conn, uint64_t packet_num, uint64_t operation, uint64_t value)
+{
+	value = htole64(value);
+	return afc_send(conn, packet_num, operation, (const char*)&value, sizeof(value));
+}
+
+/* the device needs to be locked */
+static struct fake_file *afc_find_file(struct fakedevice *fake, const char *path, struct fake_file ***prev)
+{
+	struct fake_file **pp = &fake->files;
+	while (*pp && strcmp((*pp)->path, path) != 0) {
+		pp = &(*pp)->next;
+	}
+	if (prev)
+		*prev = pp;
+	return *pp;
+}
+
+static struct fake_handle *afc_find_handle(struct fake_connection *conn, uint64_t id)
+{
+	struct fake_handle *handle;
+	for (handle = conn->handles; handle; handle = handle->next) {
+		if (handle->id == id)
+			return handle;
+	}
+	return NULL;
+}
+
+static uint64_t afc_open(struct fake_connection *conn, uint64_t mode, const char *path, uint64_t *id)
+{
+	struct fakedevice *fake = conn->fake;
+	uint64_t status = AFC_E_SUCCESS;
+
+	if (mode < AFC_FOPEN_RDONLY || mode > AFC_FOPEN_RDAPPEND)
+		return AFC_E_INVALID_ARG;
+
+	struct fake_handle *handle = (struct fake_handle*)calloc(1, sizeof(struct fake_handle));
+	if (!handle)
+		return AFC_E_NO_RESOURCES;
+
+	mutex_lock(&fake->mutex);
+	struct fake_file *file = afc_find_file(fake, path, NULL);
+	if (!file && mode != AFC_FOPEN_RDONLY) {
+		file = (struct fake_file*)calloc(1, sizeof(struct fake_file));
+		if (file && !(file->path = strdup(path))) {
+			free(file);
+			file = NULL;
+		}
+		if (file) {
+			file->next = fake->files;
+			fake->files = file;
+		} else {
+			status = AFC_E_NO_RESOURCES;
+		}
+	} else if (!file) {
+		status = AFC_E_OBJECT_NOT_FOUND;
+	}
+	if (file) {
+		if (mode == AFC_FOPEN_WRONLY || mode == AFC_FOPEN_WR)
+			file->size = 0;
+		handle->id = ++fake->next_handle;
+		handle->file = file;
+		handle->pos = (mode == AFC_FOPEN_APPEND || mode == AFC_FOPEN_RDAPPEND) ? file->size : 0;
+	}
+	mutex_unlock(&fake->mutex);
+
+	if (status != AFC_E_SUCCESS) {
+		free(handle);
+		return status;
+	}
+	handle->next = conn->handles;
+	conn->handles = handle;
+	*id = handle->id;
+
+	return AFC_E_SUCCESS;
+}
+
+static uint64_t afc_write(struct fakedevice *fake, struct fake_handle *handle, const char *data, uint32_t len)
+{
+	uint64_t status = AFC_E_SUCCESS;
+
+	mutex_lock(&fake->mutex);
+	struct fake_file *file = handle->file;
+	if (handle->pos + len > file->alloc) {
+		uint64_t alloc = (file->alloc > 0) ? file->alloc : FAKEDEVICE_BLOCK_SIZE;
+		while (alloc < handle->pos + len)
+			alloc *= 2;
+		char *newdata = (char*)realloc(file->data, alloc);
+		if (newdata) {
+			file->data = newdata;
+			file->alloc = alloc;
+		} else {
+			status = AFC_E_NO_SPACE_LEFT;
+		}
+	}
+	if (status == AFC_E_SUCCESS) {
+		if (handle->pos > file->size)
+			memset(file->data + file->size, '\0', handle->pos - file->size);
+		memcpy(file->data + handle->pos, data, len);
+		handle->pos += len;
+		if (handle->pos > file->size)
+			file->size = handle->pos;
+	}
+	mutex_unlock(&fake->mutex);
+
+	return status;
+}
+
+static int afc_send_read(struct fake_connection *conn, uint64_t packet_num, struct fake_handle *handle, uint64_t size)
+{
+	struct fakedevice *fake = conn->fake;
+	char *data = NULL;
+	uint32_t len = 0;
+
+	if (size > FAKEDEVICE_MAX_PACKET_SIZE)
+		size = FAKEDEVICE_MAX_PACKET_SIZE;
+
+	mutex_lock(&fake->mutex);
+	if (handle->pos < handle->file->size) {
+		uint64_t avail = handle->file->size - handle->pos;
+		len = (uint32_t)((avail < size) ? avail : size);
+		data = (char*)malloc(len);
+		if (data) {
+			memcpy(data, handle->file->data + handle->pos, len);
+			handle->pos += len;
+		}
+	}
+	mutex_unlock(&fake->mutex);
+
+	if (len > 0 && !data)
+		return afc_send_status(conn, packet_num, AFC_E_NO_RESOURCES);
+	int res = afc_send(conn, packet_num, AFC_OP_DATA, data, len);
+	free(data);
+
+	return res;
+}
+
+static int afc_send_file_info(struct fake_connection *conn, uint64_t packet_num, const char *path)
+{
+	struct fakedevice *fake = conn->fake;
+	char info[256];
+	int len = -1;
+
+	mutex_lock(&fake->mutex);
+	struct fake_file *file = afc_find_file(fake, path, NULL);
+	if (file) {
+		len = snprintf(info, sizeof(info), "st_size%c%llu%cst_blocks%c%llu%cst_nlink%c1%cst_ifmt%cS_IFREG%c",
+			0, (unsigned long long)file->size, 0, 0, (unsigned long long)((file->size + 511) / 512), 0, 0, 0, 0, 0);
+	} else if (!strcmp(path, "/") || !strcmp(path, ".")) {
+		len = snprintf(info, sizeof(info), "st_size%c0%cst_blocks%c0%cst_nlink%c2%cst_ifmt%cS_IFDIR%c",
+			0, 0, 0, 0, 0, 0, 0, 0);
+	}
+	mutex_unlock(&fake->mutex);
+
+	if (len < 0)
+		return afc_send_status(conn, packet_num, AFC_E_OBJECT_NOT_FOUND);
+	return afc_send(conn, packet_num, AFC_OP_DATA, info, (uint32_t)len);
+}
+
+static uint64_t afc_remove(struct fake_connection *conn, const char *path)
+{
+	struct fakedevice *fake = conn->fake;
+	struct fake_file **prev = NULL;
+	struct fake_handle *handle;
+
+	mutex_lock(&fake->mutex);
+	struct fake_file *file = afc_find_file(fake, path, &prev);
+	if (!file) {
+		mutex_unlock(&fake->mutex);
+		return AFC_E_OBJECT_NOT_FOUND;
+	}
+	for (handle = conn->handles; handle; handle = handle->next) {
+		if (handle->file == file) {
+			mutex_unlock(&fake->mutex);
+			return AFC_E_OBJECT_BUSY;
+		}
+	}
+	*prev = file->next;
+	mutex_unlock(&fake->mutex);
+
+	free(file->path);
+	free(file->data);
+	free(file);
+
+	return AFC_E_SUCCESS;
+}
+
+/**
+ * Handles one AFC request. header_len bytes of data are the header data of
+ * the request, the remaining len - header_len bytes its payload.
+ */
+static int afc_handle(struct fake_connection *conn, const AFCPacket *request, char *data, uint32_t header_len, uint32_t len)
+{
+	uint64_t num = request->packet_num;
+	struct fake_handle *handle = NULL;
+	uint64_t status = AFC_E_SUCCESS;
+
+	/* paths are NUL terminated */
+	const char *path = (header_len > 0 && data[header_len - 1] == '\0') ? data : NULL;
+	uint64_t arg0 = (header_len >= 8) ? le64toh(*(uint64_t*)data) : 0;
+	uint64_t arg1 = (header_len >= 16) ? le64toh(*(uint64_t*)(data + 8)) : 0;
+
+	switch (request->operation) {
+	case AFC_OP_FILE_OPEN: {
+		uint64_t id = 0;
+		if (header_len < 9 || data[header_len - 1] != '\0')
+			return afc_send_status(conn, num, AFC_E_INVALID_ARG);
+		status = afc_open(conn, arg0, data + 8, &id);
+		if (status != AFC_E_SUCCESS)
+			return afc_send_status(conn, num, status);
+		return afc_send_uint64(conn, num, AFC_OP_FILE_OPEN_RES, id);
+	}
+	case AFC_OP_FILE_READ:
+		if (header_len < 16 || !(handle = afc_find_handle(conn, arg0)))
+			return afc_send_status(conn, num, AFC_E_INVALID_ARG);
+		return afc_send_read(conn, num, handle, arg1);
+	case AFC_OP_FILE_WRITE:
+		if (header_len < 8 || !(handle = afc_find_handle(conn, arg0)))
+			return afc_send_status(conn, num, AFC_E_INVALID_ARG);
+		return afc_send_status(conn, num, afc_write(conn->fake, handle, data + header_len, len - header_len));
+	case AFC_OP_FILE_SEEK: {
+		if (header_len < 24 || !(handle = afc_find_handle(conn, arg0)))
+			return afc_send_status(conn, num, AFC_E_INVALID_ARG);
+		int64_t offset = (int64_t)le64toh(*(uint64_t*)(data + 16));
+		mutex_lock(&conn->fake->mutex);
+		int64_t base = (arg1 == SEEK_CUR) ? (int64_t)handle->pos : (arg1 == SEEK_END) ? (int64_t)handle->file->size : 0;
+		if (arg1 > SEEK_END || base + offset < 0) {
+			status = AFC_E_INVALID_ARG;
+		} else {
+			handle->pos = (uint64_t)(base + offset);
+		}
+		mutex_unlock(&conn->fake->mutex);
+		return afc_send_status(conn, num, status);
+	}
+	case AFC_OP_FILE_TELL:
+		if (header_len < 8 || !(handle = afc_find_handle(conn, arg0)))
+			return afc_send_status(conn, num, AFC_E_INVALID_ARG);
+		return afc_send_uint64(conn, num, AFC_OP_FILE_TELL_RES, handle->pos);
+	case AFC_OP_FILE_SET_SIZE:
+		if (header_len < 16 || !(handle = afc_find_handle(conn, arg0)))
+			return afc_send_status(conn, num, AFC_E_INVALID_ARG);
+		mutex_lock(&conn->fake->mutex);
+		if (arg1 <= handle->file->size) {
+			handle->file->size = arg1;
+		} else {
+			status = AFC_E_OP_NOT_SUPPORTED;
+		}
+		mutex_unlock(&conn->fake->mutex);
+		return afc_send_status(conn, num, status);
+	case AFC_OP_FILE_CLOSE: {
+		struct fake_handle **pp = &conn->handles;
+		if (header_len < 8)
+			return afc_send_status(conn, num, AFC_E_INVALID_ARG);
+		while (*pp && (*pp)->id != arg0) {
+			pp = &(*pp)->next;
+		}
+		if (!*pp)
+			return afc_send_status(conn, num, AFC_E_INVALID_ARG);
+		handle = *pp;
+		*pp = handle->next;
+		free(handle);
+		return afc_send_status(conn, num, AFC_E_SUCCESS);
+	}
+	case AFC_OP_REMOVE_PATH:
+		if (!path)
+			return afc_send_status(conn, num, AFC_E_INVALID_ARG);
+		return afc_send_status(conn, num, afc_remove(conn, path));
+	case AFC_OP_GET_FILE_INFO:
+		if (!path)
+			return afc_send_status(conn, num, AFC_E_INVALID_ARG);
+		return afc_send_file_info(conn, num, path);
+	case AFC_OP_GET_DEVINFO: {
+		char info[256];
+		int info_len = snprintf(info, sizeof(info), "Model%cfakedevice%cFSTotalBytes%c%llu%cFSFreeBytes%c%llu%cFSBlockSize%c%d%c",
+			0, 0, 0, 1ULL << 36, 0, 0, 1ULL << 35, 0, 0, FAKEDEVICE_BLOCK_SIZE, 0);
+		return afc_send(conn, num, AFC_OP_DATA, info, (uint32_t)info_len);
+	}
+	default:
+		return afc_send_status(conn, num, AFC_E_OP_NOT_SUPPORTED);
+	}
+}
+
+/* serves AFC, requests are answered in order so pipelining works */
+static void afc_serve(struct fake_connection *conn)
+{
+	char *data = NULL;
+	uint32_t data_size = 0;
+
+	if ((conn->fake->options & FAKEDEVICE_AFC_SSL) && conn_start_ssl(conn) < 0)
+		return;
+
+	while (1) {
+		AFCPacket request;
+		if (conn_read(conn, &request, sizeof(request)) < 0)
+			break;
+		AFCPacket_from_LE(&request);
+		if (memcmp(request.magic, AFC_MAGIC, AFC_MAGIC_LEN) != 0
+		    || request.this_length < sizeof(AFCPacket)
+		    || request.entire_length < request.this_length
+		    || request.entire_length - sizeof(AFCPacket) > FAKEDEVICE_MAX_PACKET_SIZE) {
+			fprintf(stderr, "fakedevice: invalid AFC packet\n");
+			break;
+		}
+		uint32_t len = (uint32_t)(request.entire_length - sizeof(AFCPacket));
+		uint32_t header_len = (uint32_t)(request.this_length - sizeof(AFCPacket));
+
+		/* keep room for a terminating NUL */
+		if (len + 1 > data_size) {
+			char *newdata = (char*)realloc(data, len + 1);
+			if (!newdata)
+				break;
+			data = newdata;
+			data_size = len + 1;
+		}
+		if (len > 0 && conn_read(conn, data, len) < 0)
+			break;
+		data[len] = '\0';
+
+		if (afc_handle(conn, &request, data, header_len, len) < 0)
+			break;
+	}
+	free(data);
+
+	while (conn->handles) {
+		struct fake_handle *handle = conn->handles;
+		conn->handles = handle->next;
+		free(handle);
+	}
+}
+
+struct fake_server {
+	struct fake_connection conn;
+	void (*serve)(struct fake_connection *conn);
+};
+
+static void *fakedevice_serve(void *data)
+{
+	struct fake_server *server = (struct fake_server*)data;
+	struct fakedevice *fake = server->conn.fake;
+
+	server->serve(&server->conn);
+
+	if (server->conn.ssl) {
+#ifdef HAVE_OPENSSL
+		SSL_free(server->conn.ssl);
+#else
+		gnutls_deinit(server->conn.ssl);
+#endif
+	}
+	close(server->conn.fd);
+	free(server);
+#ifdef HAVE_OPENSSL
+	/* release the per-thread state before the device can be freed */
+	OPENSSL_thread_stop();
+#endif
+
+	mutex_lock(&fake->mutex);
+	if (--fake->connections == 0)
+		cond_signal(&fake->idle);
+	mutex_unlock(&fake->mutex);
+
+	return NULL;
+}
+
+/* loopback hook, called by idevice_connect() */
+static int fakedevice_connect(uint16_t port, void *user_data)
+{
+	struct fakedevice *fake = (struct fakedevice*)user_data;
+	struct fake_server *server = NULL;
+	THREAD_T thread;
+	int sv[2];
+
+	if (port != LOCKDOWN_PORT && port != AFC_PORT)
+		return -1;
+
+	server = (struct fake_server*)calloc(1, sizeof(struct fake_server));
+	if (!server)
+		return -1;
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+		free(server);
+		return -1;
+	}
+	server->conn.fake = fake;
+	server->conn.fd = sv[1];
+	server->serve = (port == LOCKDOWN_PORT) ? lockdown_serve : afc_serve;
+
+	mutex_lock(&fake->mutex);
+	fake->connections++;
+	mutex_unlock(&fake->mutex);
+
+	if (thread_new(&thread, fakedevice_serve, server) != 0) {
+		mutex_lock(&fake->mutex);
+		fake->connections--;
+		mutex_unlock(&fake->mutex);
+		close(sv[0]);
+		close(sv[1]);
+		free(server);
+		return -1;
+	}
+	thread_detach(thread);
+
+	return sv[0];
+}
+
+static int fakedevice_setup_ssl(struct fakedevice *fake)
+{
+#ifdef HAVE_OPENSSL
+	key_data_t cert_pem = { NULL, 0 };
+	key_data_t key_pem = { NULL, 0 };
+	X509 *cert = NULL;
+	EVP_PKEY *key = NULL;
+	BIO *membp;
+	int res = -1;
+
+	if (pair_record_import_crt_with_name(fake->loopback.pair_record, USERPREF_ROOT_CERTIFICATE_KEY, &cert_pem) == USERPREF_E_SUCCESS) {
+		membp = BIO_new_mem_buf(cert_pem.data, cert_pem.size);
+		PEM_read_bio_X509(membp, &cert, NULL, NULL);
+		BIO_free(membp);
+	}
+	free(cert_pem.data);
+	if (pair_record_import_key_with_name(fake->loopback.pair_record, USERPREF_ROOT_PRIVATE_KEY_KEY, &key_pem) == USERPREF_E_SUCCESS) {
+		membp = BIO_new_mem_buf(key_pem.data, key_pem.size);
+		PEM_read_bio_PrivateKey(membp, &key, NULL, NULL);
+		BIO_free(membp);
+	}
+	free(key_pem.data);
+
+	fake->ssl_ctx = SSL_CTX_new(TLS_method());
+	if (fake->ssl_ctx && cert && key) {
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+		/* the certificates of the pair record are signed with SHA-1 */
+		SSL_CTX_set_security_level(fake->ssl_ctx, 0);
+		SSL_CTX_set_min_proto_version(fake->ssl_ctx, TLS1_VERSION);
+#endif
+		SSL_CTX_set_cipher_list(fake->ssl_ctx, "ALL");
+		if (SSL_CTX_use_certificate(fake->ssl_ctx, cert) == 1 && SSL_CTX_use_PrivateKey(fake->ssl_ctx, key) == 1)
+			res = 0;
+	}
+	if (cert)
+		X509_free(cert);
+	if (key)
+		EVP_PKEY_free(key);
+
+	return res;
+#else
+	gnutls_x509_crt_t cert = NULL;
+	gnutls_x509_privkey_t key = NULL;
+	int res = -1;
+
+	gnutls_global_init();
+	gnutls_x509_crt_init(&cert);
+	gnutls_x509_privkey_init(&key);
+	if (pair_record_import_crt_with_name(fake->loopback.pair_record, USERPREF_ROOT_CERTIFICATE_KEY, cert) == USERPREF_E_SUCCESS
+	    && pair_record_import_key_with_name(fake->loopback.pair_record, USERPREF_ROOT_PRIVATE_KEY_KEY, key) == USERPREF_E_SUCCESS
+	    && gnutls_certificate_allocate_credentials(&fake->credentials) == GNUTLS_E_SUCCESS
+	    && gnutls_certificate_set_x509_key(fake->credentials, &cert, 1, key) == GNUTLS_E_SUCCESS
+	    && gnutls_session_ticket_key_generate(&fake->ticket_key) == GNUTLS_E_SUCCESS) {
+		res = 0;
+	}
+	gnutls_x509_crt_deinit(cert);
+	gnutls_x509_privkey_deinit(key);
+
+	return res;
+#endif
+}
+
+static void fakedevice_destroy(struct fakedevice *fake)
+{
+#ifdef HAVE_OPENSSL
+	if (fake->ssl_ctx)
+		SSL_CTX_free(fake->ssl_ctx);
+#else
+	if (fake->credentials)
+		gnutls_certificate_free_credentials(fake->credentials);
+	if (fake->ticket_key.data)
+		gnutls_free(fake->ticket_key.data);
+#endif
+	while (fake->files) {
+		struct fake_file *file = fake->files;
+		fake->files = file->next;
+		free(file->path);
+		free(file->data);
+		free(file);
+	}
+	plist_free(fake->loopback.pair_record);
+	free(fake->host_id);
+	cond_destroy(&fake->idle);
+	mutex_destroy(&fake->mutex);
+	free(fake);
+}
+
+int fakedevice_new_with_options(idevice_t *device, int options)
+{
+	key_data_t public_key = { (unsigned char*)device_public_key, sizeof(device_public_key) - 1 };
+
+	struct fakedevice *fake = (struct fakedevice*)calloc(1, sizeof(struct fakedevice));
+	if (!fake)
+		return -1;
+	fake->options = options;
+	mutex_init(&fake->mutex);
+	cond_init(&fake->idle);
+
+	fake->host_id = strdup(FAKEDEVICE_HOST_ID);
+	fake->loopback.connect = fakedevice_connect;
+	fake->loopback.user_data = fake;
+	fake->loopback.pair_record = plist_new_dict();
+	if (!fake->host_id
+	    || pair_record_generate_keys_and_certs(fake->loopback.pair_record, public_key) != USERPREF_E_SUCCESS
+	    || pair_record_set_host_id(fake->loopback.pair_record, fake->host_id) != USERPREF_E_SUCCESS
+	    || fakedevice_setup_ssl(fake) < 0) {
+		fprintf(stderr, "fakedevice: Could not set up the pair record\n");
+		fakedevice_destroy(fake);
+		return -1;
+	}
+
+	/* set up like idevice_from_mux_device() does for a network device */
+	idevice_t dev = (idevice_t)calloc(1, sizeof(struct idevice_private));
+	if (!dev || !(dev->udid = strdup(FAKEDEVICE_UDID))) {
+		free(dev);
+		fakedevice_destroy(fake);
+		return -1;
+	}
+	dev->conn_type = CONNECTION_NETWORK;
+	mutex_init(&dev->lockdown_mutex);
+	mutex_init(&dev->value_cache_mutex);
+	mutex_init(&dev->pool_mutex);
+	mutex_init(&dev->rtt_mutex);
+	mutex_init(&dev->arena_mutex);
+	/* buffers come from the default arena */
+	dev->arena = NULL;
+	dev->cipher_policy = IDEVICE_CIPHER_POLICY_DEFAULT;
+	dev->loopback = &fake->loopback;
+
+	*device = dev;
+	return 0;
+}
+
+int fakedevice_new(idevice_t *device)
+{
+	return fakedevice_new_with_options(device, 0);
+}
+
+void fakedevice_free(idevice_t device)
+{
+	if (!device || !device->loopback)
+		return;
+
+	struct fakedevice *fake = (struct fakedevice*)device->loopback->user_data;
+
+	/* closes pooled connections */
+	idevice_free(device);
+
+	mutex_lock(&fake->mutex);
+	while (fake->connections > 0) {
+		cond_wait(&fake->idle, &fake->mutex);
+	}
+	mutex_unlock(&fake->mutex);
+
+	fakedevice_destroy(fake);
+}
@@ -0,0 +1,64 @@
+/*
+ * fakedevice.h
+ * A device emulated in the same process over socketpairs -- header file.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __FAKEDEVICE_H
+#define __FAKEDEVICE_H
+
+#include <libimobiledevice/libimobiledevice.h>
+
+#define FAKEDEVICE_UDID "00000000-0000FAKEDEVICE00"
+#define FAKEDEVICE_PRODUCT_VERSION "15.0"
+
+/** Options for fakedevice_new_with_options() */
+enum fakedevice_options {
+	FAKEDEVICE_AFC_SSL = 1 << 0 /**< serve AFC over SSL like the SSL only services do */
+};
+
+/**
+ * Creates a device that is emulated by threads of the calling process.
+ * It answers the lockdown handshake including the SSL session and
+ * StartService, and serves AFC from memory, so the library can be used
+ * without a device or usbmuxd. Every connection is a socketpair.
+ *
+ * @param device Set to the new device, free it with fakedevice_free().
+ *
+ * @return 0 on success, -1 if the pair record could not be generated.
+ */
+int fakedevice_new(idevice_t *device);
+
+/**
+ * Creates an emulated device like fakedevice_new() with the given options.
+ *
+ * @param device Set to the new device, free it with fakedevice_free().
+ * @param options Bitmask of fakedevice_options, or 0
+ *
+ * @return 0 on success, -1 if the pair record could not be generated.
+ */
+int fakedevice_new_with_options(idevice_t *device, int options);
+
+/**
+ * Frees a device created with fakedevice_new(). All clients of the device
+ * have to be freed before; this waits until the emulator has seen all of
+ * its connections closed.
+ *
+ * @param device The device to free
+ */
+void fakedevice_free(idevice_t device);
+
+#endif
@@ -0,0 +1,143 @@
+/*
+ * plist_sanitize_bench.c
+ * Compares the control character replacement for received XML plists with
+ * the byte loop it replaced, for output and throughput
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/* internal_plist_xml_sanitize() is static */
+#include "src/property_list_service.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+/* bytes sanitized per measurement */
+#define BENCH_BYTES (256 * 1024 * 1024)
+
+static const uint32_t message_sizes[] = { 256, 4096, 65536, 1048576 };
+#define NUM_MESSAGE_SIZES (int)(sizeof(message_sizes) / sizeof(message_sizes[0]))
+
+static double time_now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (double)tv.tv_sec + (double)tv.tv_usec / 1000000.0;
+}
+
+/* the loop internal_plist_parse() used before */
+static void sanitize_bytewise(char *data, uint32_t len)
+{
+	uint32_t i;
+	for (i = 0; i < len; i++) {
+		if ((data[i] >= 0) && (data[i] < 0x20) && (data[i] != 0x09) && (data[i] != 0x0a) && (data[i] != 0x0d))
+			data[i] = 0x20;
+	}
+}
+
+/* XML like text with a line feed or tab now and then, control characters
+ * every 'dirty' bytes if not 0 */
+static void fill_message(char *data, uint32_t len, uint32_t dirty)
+{
+	static const char text[] = "<key>ProductVersion</key>\n\t<string>15.0</string>\n";
+	uint32_t i;
+	for (i = 0; i < len; i++) {
+		data[i] = text[i % (sizeof(text) - 1)];
+		if (dirty && (i % dirty) == dirty - 1)
+			data[i] = (char)(i % 0x20);
+	}
+}
+
+static int check_output(void)
+{
+	char a[1027];
+	char b[1027];
+	uint32_t i;
+	int round;
+
+	srand(1);
+	for (round = 0; round < 1000; round++) {
+		for (i = 0; i < sizeof(a); i++) {
+			a[i] = b[i] = (char)rand();
+		}
+		/* odd lengths and offsets exercise the scalar tail */
+		uint32_t offset = round % 16;
+		uint32_t len = sizeof(a) - offset - (round % 7);
+		internal_plist_xml_sanitize(a + offset, len);
+		sanitize_bytewise(b + offset, len);
+		if (memcmp(a, b, sizeof(a)) != 0) {
+			fprintf(stderr, "ERROR: output differs from the byte loop for length %u at offset %u\n", len, offset);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static double measure(void (*sanitize)(char*, uint32_t), char *data, const char *orig, uint32_t len)
+{
+	uint32_t rounds = BENCH_BYTES / len;
+	uint32_t i;
+
+	double start = time_now();
+	for (i = 0; i < rounds; i++) {
+		/* sanitizing is done in place, dirty messages need a fresh copy */
+		if (orig)
+			memcpy(data, orig, len);
+		sanitize(data, len);
+	}
+	double elapsed = time_now() - start;
+
+	return (double)rounds * len / (1024.0 * 1024.0) / elapsed;
+}
+
+int main(int argc, char **argv)
+{
+	char *data = (char*)malloc(message_sizes[NUM_MESSAGE_SIZES-1]);
+	char *orig = (char*)malloc(message_sizes[NUM_MESSAGE_SIZES-1]);
+	int i;
+
+	if (!data || !orig) {
+		free(data);
+		free(orig);
+		return 1;
+	}
+
+	if (check_output() < 0) {
+		free(data);
+		free(orig);
+		return 1;
+	}
+
+	for (i = 0; i < NUM_MESSAGE_SIZES; i++) {
+		uint32_t len = message_sizes[i];
+
+		fill_message(data, len, 0);
+		double bytewise = measure(sanitize_bytewise, data, NULL, len);
+		double simd = measure(internal_plist_xml_sanitize, data, NULL, len);
+		printf("plist sanitize clean: size=%u bytewise=%.2fMB/s sanitize=%.2fMB/s\n", len, bytewise, simd);
+
+		fill_message(orig, len, 1000);
+		bytewise = measure(sanitize_bytewise, data, orig, len);
+		simd = measure(internal_plist_xml_sanitize, data, orig, len);
+		printf("plist sanitize dirty: size=%u bytewise=%.2fMB/s sanitize=%.2fMB/s\n", len, bytewise, simd);
+	}
+
+	free(data);
+	free(orig);
+
+	return 0;
+}
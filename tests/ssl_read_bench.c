@@ -0,0 +1,174 @@
+/*
+ * ssl_read_bench.c
+ * Measures reads from an SSL connection, which go through the transport
+ * read callback of the SSL library, with AFC served over SSL by a device
+ * emulated in the same process
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#ifndef WIN32
+#include <signal.h>
+#endif
+
+#include <libimobiledevice/libimobiledevice.h>
+#include <libimobiledevice/lockdown.h>
+#include <libimobiledevice/afc.h>
+
+#include "fakedevice.h"
+
+#define FILE_NAME "ssl_read_bench.dat"
+#define FILE_SIZE (16 * 1024 * 1024)
+#define ITERATIONS 4
+
+static const uint32_t chunk_sizes[] = { 256, 4096, 65536, 1048576 };
+#define NUM_CHUNK_SIZES (int)(sizeof(chunk_sizes) / sizeof(chunk_sizes[0]))
+
+static double time_now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (double)tv.tv_sec + (double)tv.tv_usec / 1000000.0;
+}
+
+static int write_file(afc_client_t afc, char *buf, uint32_t size)
+{
+	uint64_t handle = 0;
+	uint32_t done = 0;
+
+	if (afc_file_open(afc, FILE_NAME, AFC_FOPEN_WRONLY, &handle) != AFC_E_SUCCESS)
+		return -1;
+	while (done < FILE_SIZE) {
+		uint32_t written = 0;
+		if (afc_file_write(afc, handle, buf, size, &written) != AFC_E_SUCCESS || written == 0)
+			break;
+		done += written;
+	}
+	afc_file_close(afc, handle);
+
+	return (done == FILE_SIZE) ? 0 : -1;
+}
+
+static int read_file(afc_client_t afc, char *buf, uint32_t chunk)
+{
+	uint64_t handle = 0;
+	uint64_t total = 0;
+	int ops = 0;
+	int i;
+
+	if (afc_file_open(afc, FILE_NAME, AFC_FOPEN_RDONLY, &handle) != AFC_E_SUCCESS)
+		return -1;
+
+	/* fewer passes for small chunks, they take a lot longer */
+	int iterations = (chunk < 4096) ? 1 : ITERATIONS;
+	uint64_t limit = (chunk < 4096) ? FILE_SIZE / 16 : FILE_SIZE;
+
+	double start = time_now();
+	for (i = 0; i < iterations; i++) {
+		uint64_t pos = 0;
+		afc_file_seek(afc, handle, 0, SEEK_SET);
+		while (pos < limit) {
+			uint32_t got = 0;
+			if (afc_file_read(afc, handle, buf, chunk, &got) != AFC_E_SUCCESS || got == 0) {
+				afc_file_close(afc, handle);
+				return -1;
+			}
+			pos += got;
+			ops++;
+		}
+		total += pos;
+	}
+	double elapsed = time_now() - start;
+	afc_file_close(afc, handle);
+
+	printf("ssl read: chunk=%u bytes=%llu time=%.3fs rate=%.2fMB/s ops=%d latency=%.3fms\n",
+		chunk, (unsigned long long)total, elapsed, (double)total / (1024.0 * 1024.0) / elapsed,
+		ops, elapsed * 1000.0 / ops);
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	idevice_t device = NULL;
+	lockdownd_client_t lockdown = NULL;
+	lockdownd_service_descriptor_t service = NULL;
+	afc_client_t afc = NULL;
+	char *buf = NULL;
+	int res = 1;
+	int i;
+
+#ifndef WIN32
+	/* the emulator writes to sockets the client may have closed */
+	signal(SIGPIPE, SIG_IGN);
+#endif
+
+	if (fakedevice_new_with_options(&device, FAKEDEVICE_AFC_SSL) < 0) {
+		fprintf(stderr, "ERROR: Could not set up the emulated device\n");
+		return 1;
+	}
+
+	if (lockdownd_client_new_with_handshake(device, &lockdown, "ssl_read_bench") != LOCKDOWN_E_SUCCESS) {
+		fprintf(stderr, "ERROR: Could not connect to lockdownd\n");
+		goto leave;
+	}
+	if (lockdownd_start_service(lockdown, AFC_SERVICE_NAME, &service) != LOCKDOWN_E_SUCCESS || !service->ssl_enabled) {
+		fprintf(stderr, "ERROR: Could not start AFC over SSL\n");
+		goto leave;
+	}
+	if (afc_client_new(device, service, &afc) != AFC_E_SUCCESS) {
+		fprintf(stderr, "ERROR: Could not connect to AFC\n");
+		goto leave;
+	}
+
+	buf = (char*)malloc(chunk_sizes[NUM_CHUNK_SIZES-1]);
+	if (!buf)
+		goto leave;
+	memset(buf, 'x', chunk_sizes[NUM_CHUNK_SIZES-1]);
+
+	if (write_file(afc, buf, chunk_sizes[NUM_CHUNK_SIZES-1]) < 0) {
+		fprintf(stderr, "ERROR: Could not write %s\n", FILE_NAME);
+		goto leave;
+	}
+	res = 0;
+	for (i = 0; i < NUM_CHUNK_SIZES; i++) {
+		if (read_file(afc, buf, chunk_sizes[i]) < 0) {
+			fprintf(stderr, "ERROR: Could not read %s\n", FILE_NAME);
+			res = 1;
+			break;
+		}
+	}
+	afc_remove_path(afc, FILE_NAME);
+
+leave:
+	free(buf);
+	if (afc)
+		afc_client_free(afc);
+	if (service)
+		lockdownd_service_descriptor_free(service);
+	if (lockdown)
+		lockdownd_client_free(lockdown);
+	fakedevice_free(device);
+
+	return res;
+}
@@ -96,116 +96,151 @@ static int compare_hash(const unsigned char *hash1, const unsigned char *hash2,
 	return 1;
 }
 
-static void compute_datahash(const char *path, const char *destpath, uint8_t greylist, const char *domain, const char *appid, const char *version, unsigned char *hash_out)
-{
+struct datahash_ctx {
 #ifdef HAVE_OPENSSL
 	SHA_CTX sha1;
-	SHA1_Init(&sha1);
 #else
-	gcry_md_hd_t hd = NULL;
-	gcry_md_open(&hd, GCRY_MD_SHA1, 0);
-	if (!hd) {
-		printf("ERROR: Could not initialize libgcrypt/SHA1\n");
-		return;
-	}
-	gcry_md_reset(hd);
+	gcry_md_hd_t hd;
 #endif
-	FILE *f = fopen(path, "rb");
-	if (f) {
-		unsigned char buf[16384];
-		size_t len;
-		while ((len = fread(buf, 1, 16384, f)) > 0) {
-#ifdef HAVE_OPENSSL
-			SHA1_Update(&sha1, buf, len);
-#else
-			gcry_md_write(hd, buf, len);
-#endif
-		}
-		fclose(f);
-#ifdef HAVE_OPENSSL
-		SHA1_Update(&sha1, destpath, strlen(destpath));
-		SHA1_Update(&sha1, ";", 1);
-#else
-		gcry_md_write(hd, destpath, strlen(destpath));
-		gcry_md_write(hd, ";", 1);
-#endif
-		if (greylist == 1) {
-#ifdef HAVE_OPENSSL
-			SHA1_Update(&sha1, "true", 4);
-#else
-			gcry_md_write(hd, "true", 4);
-#endif
-		} else {
-#ifdef HAVE_OPENSSL
-			SHA1_Update(&sha1, "false", 5);
-#else
-			gcry_md_write(hd, "false", 5);
-#endif
-		}
-#ifdef HAVE_OPENSSL
-		SHA1_Update(&sha1, ";", 1);
-#else
-		gcry_md_write(hd, ";", 1);
-#endif
-		if (domain) {
-#ifdef HAVE_OPENSSL
-			SHA1_Update(&sha1, domain, strlen(domain));
-#else
-			gcry_md_write(hd, domain, strlen(domain));
-#endif
-		} else {
-#ifdef HAVE_OPENSSL
-			SHA1_Update(&sha1, "(null)", 6);
-#else
-			gcry_md_write(hd, "(null)", 6);
-#endif
-		}
-#ifdef HAVE_OPENSSL
-		SHA1_Update(&sha1, ";", 1);
-#else
-		gcry_md_write(hd, ";", 1);
-#endif
-		if (appid) {
-#ifdef HAVE_OPENSSL
-			SHA1_Update(&sha1, appid, strlen(appid));
-#else
-			gcry_md_write(hd, appid, strlen(appid));
-#endif
-		} else {
+};
+
+static int datahash_init(struct datahash_ctx *ctx)
+{
 #ifdef HAVE_OPENSSL
-			SHA1_Update(&sha1, "(null)", 6);
+	SHA1_Init(&ctx->sha1);
 #else
-			gcry_md_write(hd, "(null)", 6);
+	ctx->hd = NULL;
+	gcry_md_open(&ctx->hd, GCRY_MD_SHA1, 0);
+	if (!ctx->hd) {
+		printf("ERROR: Could not initialize libgcrypt/SHA1\n");
+		return -1;
+	}
+	gcry_md_reset(ctx->hd);
 #endif
-		}
+	return 0;
+}
+
+static void datahash_update(struct datahash_ctx *ctx, const void *data, size_t len)
+{
 #ifdef HAVE_OPENSSL
-		SHA1_Update(&sha1, ";", 1);
+	SHA1_Update(&ctx->sha1, data, len);
 #else
-		gcry_md_write(hd, ";", 1);
+	gcry_md_write(ctx->hd, data, len);
 #endif
-		if (version) {
+}
+
+static void datahash_update_field(struct datahash_ctx *ctx, const char *value)
+{
+	if (value) {
+		datahash_update(ctx, value, strlen(value));
+	} else {
+		datahash_update(ctx, "(null)", 6);
+	}
+}
+
+/**
+ * Appends the file metadata to the hashed file contents and releases the
+ * context.
+ */
+static void datahash_final(struct datahash_ctx *ctx, const char *destpath, uint8_t greylist, const char *domain, const char *appid, const char *version, unsigned char *hash_out)
+{
+	datahash_update(ctx, destpath, strlen(destpath));
+	datahash_update(ctx, ";", 1);
+	if (greylist == 1) {
+		datahash_update(ctx, "true", 4);
+	} else {
+		datahash_update(ctx, "false", 5);
+	}
+	datahash_update(ctx, ";", 1);
+	datahash_update_field(ctx, domain);
+	datahash_update(ctx, ";", 1);
+	datahash_update_field(ctx, appid);
+	datahash_update(ctx, ";", 1);
+	datahash_update_field(ctx, version);
 #ifdef HAVE_OPENSSL
-			SHA1_Update(&sha1, version, strlen(version));
+	SHA1_Final(hash_out, &ctx->sha1);
 #else
-			gcry_md_write(hd, version, strlen(version));
+	unsigned char *newhash = gcry_md_read(ctx->hd, GCRY_MD_SHA1);
+	memcpy(hash_out, newhash, 20);
+	gcry_md_close(ctx->hd);
+	ctx->hd = NULL;
 #endif
-		} else {
-#ifdef HAVE_OPENSSL
-			SHA1_Update(&sha1, "(null)", 6);
-#else
-			gcry_md_write(hd, "(null)", 6);
+}
+
+static void datahash_free(struct datahash_ctx *ctx)
+{
+#ifndef HAVE_OPENSSL
+	if (ctx->hd) {
+		gcry_md_close(ctx->hd);
+		ctx->hd = NULL;
+	}
 #endif
+}
+
+static void compute_datahash(const char *path, const char *destpath, uint8_t greylist, const char *domain, const char *appid, const char *version, unsigned char *hash_out)
+{
+	struct datahash_ctx ctx;
+	if (datahash_init(&ctx) < 0)
+		return;
+	FILE *f = fopen(path, "rb");
+	if (f) {
+		unsigned char buf[16384];
+		size_t len;
+		while ((len = fread(buf, 1, 16384, f)) > 0) {
+			datahash_update(&ctx, buf, len);
 		}
-#ifdef HAVE_OPENSSL
-		SHA1_Final(hash_out, &sha1);
-#else
-		unsigned char *newhash = gcry_md_read(hd, GCRY_MD_SHA1);
-		memcpy(hash_out, newhash, 20);
-#endif
+		fclose(f);
+		datahash_final(&ctx, destpath, greylist, domain, appid, version, hash_out);
 	}
-#ifndef HAVE_OPENSSL
-	gcry_md_close(hd);
-#endif
+	datahash_free(&ctx);
+}
+
+/**
+ * Computes the DataHash of a received file from its incrementally hashed
+ * contents and the Metadata in its BackupFileInfo.
+ *
+ * @return 1 if the hash was computed, 0 if the metadata is missing.
+ */
+static int datahash_final_from_file_info(struct datahash_ctx *ctx, plist_t file_info, unsigned char *hash_out)
+{
+	plist_t node = plist_dict_get_item(file_info, "Metadata");
+	if (!node || (plist_get_node_type(node) != PLIST_DATA))
+		return 0;
+
+	uint64_t meta_bin_size = 0;
+	const char *meta_bin = plist_get_data_ptr(node, &meta_bin_size);
+	plist_t metadata = NULL;
+	if (meta_bin && meta_bin_size > 0)
+		plist_from_bin(meta_bin, (uint32_t)meta_bin_size, &metadata);
+	if (!metadata)
+		return 0;
+
+	const char *destpath = NULL;
+	const char *domain = NULL;
+	const char *version = NULL;
+	uint8_t greylist = 0;
+
+	node = plist_dict_get_item(metadata, "Path");
+	if (node && (plist_get_node_type(node) == PLIST_STRING))
+		destpath = plist_get_string_ptr(node, NULL);
+	node = plist_dict_get_item(metadata, "Domain");
+	if (node && (plist_get_node_type(node) == PLIST_STRING))
+		domain = plist_get_string_ptr(node, NULL);
+	node = plist_dict_get_item(metadata, "Version");
+	if (node && (plist_get_node_type(node) == PLIST_STRING))
+		version = plist_get_string_ptr(node, NULL);
+	node = plist_dict_get_item(metadata, "Greylist");
+	if (node && (plist_get_node_type(node) == PLIST_BOOLEAN))
+		plist_get_bool_val(node, &greylist);
+
+	int res = 0;
+	if (destpath) {
+		datahash_final(ctx, destpath, greylist, domain, NULL, version, hash_out);
+		res = 1;
+	}
+	plist_free(metadata);
+
+	return res;
 }
 
 static void print_hash(const unsigned char *hash, int len)
@@ -602,6 +637,62 @@ static int mobilebackup_check_file_integrity(const char *backup_directory, const
 	return res;
 }
 
+/**
+ * Compares the DataHash entries of a received Manifest.plist with the hashes
+ * that were computed while the files were received.
+ *
+ * @return The number of files whose hash does not match.
+ */
+static int mobilebackup_verify_received_files(plist_t manifest, plist_t received_hashes)
+{
+	if (plist_dict_get_size(received_hashes) == 0)
+		return 0;
+
+	plist_t node = plist_dict_get_item(manifest, "Data");
+	if (!node || (plist_get_node_type(node) != PLIST_DATA))
+		return 0;
+
+	uint64_t binsize = 0;
+	const char *bin = plist_get_data_ptr(node, &binsize);
+	plist_t backup_data = NULL;
+	if (bin && binsize > 0)
+		plist_from_bin(bin, (uint32_t)binsize, &backup_data);
+	plist_t files = plist_dict_get_item(backup_data, "Files");
+	if (!files || (plist_get_node_type(files) != PLIST_DICT)) {
+		plist_free(backup_data);
+		return 0;
+	}
+
+	int mismatches = 0;
+	plist_dict_iter iter = NULL;
+	plist_dict_new_iter(received_hashes, &iter);
+	if (iter) {
+		char *hash = NULL;
+		plist_t received = NULL;
+		do {
+			plist_dict_next_item(received_hashes, iter, &hash, &received);
+			if (!hash)
+				break;
+			node = plist_dict_get_item(plist_dict_get_item(files, hash), "DataHash");
+			if (node && (plist_get_node_type(node) == PLIST_DATA)) {
+				uint64_t data_hash_len = 0;
+				const unsigned char *data_hash = (const unsigned char*)plist_get_data_ptr(node, &data_hash_len);
+				const unsigned char *file_hash = (const unsigned char*)plist_get_data_ptr(received, NULL);
+				if ((data_hash_len == 20) && !compare_hash(data_hash, file_hash, 20)) {
+					printf("ERROR: The hash for received '%s.mddata' does not match DataHash entry in Manifest\n", hash);
+					mismatches++;
+				}
+			}
+			free(hash);
+			hash = NULL;
+		} while (1);
+		free(iter);
+	}
+	plist_free(backup_data);
+
+	return mismatches;
+}
+
 static void do_post_notification(const char *notification)
 {
 	lockdownd_service_descriptor_t service = NULL;
@@ -1028,10 +1119,16 @@ int main(int argc, char *argv[])
 			char *format_size = NULL;
 			int is_manifest = 0;
 			uint8_t b = 0;
+			FILE *hunk_file = NULL;
+			struct datahash_ctx hunk_hash;
+			int hunk_hashing = 0;
+			plist_t received_hashes = plist_new_dict();
 
 			/* process series of DLSendFile messages */
 			do {
-				mobilebackup_receive(mobilebackup, &message);
+				const char *hunk_data = NULL;
+				uint64_t hunk_length = 0;
+				mobilebackup_receive_file_hunk(mobilebackup, &message, &hunk_data, &hunk_length);
 				if (!message) {
 					printf("Device is not ready yet. Going to try again in 2 seconds...\n");
 					sleep(2);
@@ -1128,25 +1225,48 @@ int main(int argc, char *argv[])
 
 					filename_mddata = mobilebackup_build_path(backup_directory, file_path, is_manifest ? NULL: ".mddata");
 
-					/* if this is the first hunk, remove any existing file */
-					if ((hunk_index == 0) && (stat(filename_mddata, &st) == 0))
-						remove(filename_mddata);
-
-					/* get file data hunk */
-					node_tmp = plist_array_get_item(message, 1);
-					plist_get_data_val(node_tmp, &buffer, &length);
+					/* the first hunk replaces any existing file, the following hunks are appended as they arrive */
+					if (hunk_index == 0) {
+						if (hunk_file)
+							fclose(hunk_file);
+						hunk_file = fopen(filename_mddata, "wb");
+						if (!hunk_file)
+							printf("ERROR: Could not open '%s' for writing: %s\n", filename_mddata, strerror(errno));
+						if (hunk_hashing)
+							datahash_free(&hunk_hash);
+						hunk_hashing = (!is_manifest && (datahash_init(&hunk_hash) == 0));
+					}
 
-					buffer_write_to_filename(filename_mddata, buffer, length);
+					/* write the file data hunk straight from the received message */
+					if (hunk_file && (hunk_length > 0) && (fwrite(hunk_data, 1, hunk_length, hunk_file) != hunk_length)) {
+						printf("ERROR: Could not write to '%s': %s\n", filename_mddata, strerror(errno));
+						fclose(hunk_file);
+						hunk_file = NULL;
+					}
+					if (hunk_hashing)
+						datahash_update(&hunk_hash, hunk_data, hunk_length);
 					if (!is_manifest)
-						file_size_current += length;
+						file_size_current += hunk_length;
 
-					/* activate currently sent manifest */
-					if ((file_status == DEVICE_LINK_FILE_STATUS_LAST_HUNK) && (is_manifest)) {
-						rename(filename_mddata, manifest_path);
-					}
+					if (file_status == DEVICE_LINK_FILE_STATUS_LAST_HUNK) {
+						if (hunk_file) {
+							fclose(hunk_file);
+							hunk_file = NULL;
+						}
 
-					free(buffer);
-					buffer = NULL;
+						/* keep the DataHash to check it against the Manifest without reading the file again */
+						if (hunk_hashing) {
+							unsigned char data_hash[20];
+							if (datahash_final_from_file_info(&hunk_hash, plist_dict_get_item(node_tmp, "BackupFileInfo"), data_hash))
+								plist_dict_set_item(received_hashes, file_path, plist_new_data((const char*)data_hash, 20));
+							datahash_free(&hunk_hash);
+							hunk_hashing = 0;
+						}
+
+						/* activate currently sent manifest */
+						if (is_manifest)
+							rename(filename_mddata, manifest_path);
+					}
 
 					free(filename_mddata);
 				}
@@ -1195,6 +1315,11 @@ files_out:
 				}
 			} while (1);
 
+			if (hunk_file)
+				fclose(hunk_file);
+			if (hunk_hashing)
+				datahash_free(&hunk_hash);
+
 			printf("Received %d files from device.\n", file_index);
 
 			if (!quit_flag && !plist_strcmp(node, "DLMessageProcessMessage")) {
@@ -1226,12 +1351,17 @@ files_out:
 						remove(manifest_path);
 						printf("Storing Manifest.plist...\n");
 						plist_write_to_filename(manifest_plist, manifest_path, PLIST_FORMAT_XML);
+
+						if (mobilebackup_verify_received_files(manifest_plist, received_hashes) > 0)
+							printf("WARNING: Some received files do not match the Manifest.\n");
 					}
 
 					backup_ok = 1;
 				}
 			}
 
+			plist_free(received_hashes);
+
 			if (backup_ok) {
 				/* Status.plist (Info on how the backup process turned out) */
 				printf("Backup Successful.\n");
@@ -26,6 +26,7 @@
 
 #define TOOL_NAME "idevicebackup2"
 
+#define _GNU_SOURCE 1
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
@@ -35,7 +36,21 @@
 #include <dirent.h>
 #include <libgen.h>
 #include <ctype.h>
+#include <limits.h>
 #include <time.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_MALLINFO2
+#include <malloc.h>
+#endif
+#ifdef HAVE_OPENSSL
+#include <openssl/sha.h>
+#else
+#include <gcrypt.h>
+#endif
 
 #include <libimobiledevice/libimobiledevice.h>
 #include <libimobiledevice/lockdown.h>
@@ -46,6 +61,8 @@
 #include <libimobiledevice/sbservices.h>
 #include <libimobiledevice/diagnostics_relay.h>
 #include "common/utils.h"
+#include "common/thread.h"
+#include "common/strmap.h"
 
 #include <endianness.h>
 
@@ -55,10 +72,21 @@
 #ifdef WIN32
 #include <windows.h>
 #include <conio.h>
+#include <io.h>
 #define sleep(x) Sleep(x*1000)
 #else
 #include <termios.h>
 #include <sys/statvfs.h>
+#ifdef HAVE_GETRUSAGE
+#include <sys/resource.h>
+#endif
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+#ifdef HAVE_CLONEFILE
+#include <sys/clonefile.h>
+#endif
 #endif
 #include <sys/stat.h>
 
@@ -67,7 +95,46 @@
 #define CODE_ERROR_REMOTE 0x0b
 #define CODE_FILE_DATA 0x0c
 
+#define SEND_CHUNK_SIZE_DEFAULT (1024 * 1024)
+#define SEND_CHUNK_SIZE_MIN 4096
+#define SEND_CHUNK_SIZE_MAX (16 * 1024 * 1024)
+
+#define WRITE_QUEUE_SIZE_DEFAULT (64 * 1024 * 1024)
+#define WRITE_BLOCK_SIZE (256 * 1024)
+
+#define DEDUP_BUFFER_SIZE (1024 * 1024)
+
+#define COMPRESS_MAGIC "\x89MB2Z\r\n\x1a"
+#define COMPRESS_MAGIC_SIZE 8
+#define COMPRESS_HEADER_SIZE 16
+#define COMPRESS_FRAME_MAX (16 * 1024 * 1024)
+#define COMPRESS_THREADS 4
+
+#define COPY_BUFFER_SIZE (1024 * 1024)
+#define COPY_RANGE_SIZE (64 * 1024 * 1024)
+#define FS_THREADS 4
+#define READ_AHEAD_FILES 16
+#define READ_AHEAD_BYTES (64 * 1024 * 1024)
+#define METRICS_WINDOW 10
+#define METRICS_SIZE_BUCKETS 10
+#define METRICS_STALL_TIMEOUT 5
+#define MOVE_JOBS_PER_THREAD 64
+#define REMOVE_JOBS_PER_THREAD 64
+
 static int verbose = 1;
+static uint32_t send_chunk_size = SEND_CHUNK_SIZE_DEFAULT;
+static uint64_t write_queue_size = WRITE_QUEUE_SIZE_DEFAULT;
+static const char *dedup_dir = NULL;
+static int compress_files = 0;
+static FILE *metrics_file = NULL;
+static mutex_t metrics_mutex;
+
+enum mb2_durability {
+	DURABILITY_NONE,
+	DURABILITY_BATCH,
+	DURABILITY_FILE
+};
+static enum mb2_durability durability = DURABILITY_NONE;
 static int quit_flag = 0;
 
 #define PRINT_VERBOSE(min_level, ...) if (verbose >= min_level) { printf(__VA_ARGS__); };
@@ -80,7 +147,8 @@ enum cmd_mode {
 	CMD_UNBACK,
 	CMD_CHANGEPW,
 	CMD_LEAVE,
-	CMD_CLOUD
+	CMD_CLOUD,
+	CMD_REPLAY
 };
 
 enum cmd_flags {
@@ -98,72 +166,489 @@ enum cmd_flags {
 	CMD_FLAG_RESTORE_SKIP_APPS          = (1 << 12)
 };
 
-static int backup_domain_changed = 0;
+struct mb2_index;
+struct mb2_trace;
 
-static void notify_cb(const char *notification, void *userdata)
+/**
+ * Disk I/O budget shared by concurrently running backups. Each engine gets
+ * a share of rate proportional to its weight among the running engines.
+ */
+struct mb2_io_budget {
+	mutex_t mutex;
+	/* bytes per second, 0 means unlimited */
+	uint64_t rate;
+	unsigned int weight_sum;
+};
+
+enum mb2_phase {
+	PHASE_WAITING,
+	PHASE_RECEIVING,
+	PHASE_SENDING
+};
+
+/**
+ * Live transfer metrics, written as JSON lines to metrics_file once per
+ * second by a thread of their own.
+ */
+struct mb2_metrics {
+	mutex_t mutex;
+	THREAD_T thread;
+	volatile int stop;
+	enum mb2_phase phase;
+	uint64_t start_us;
+	uint64_t last_activity_us;
+	uint64_t bytes_received;
+	uint64_t bytes_sent;
+	/* bytes per second over the last METRICS_WINDOW seconds */
+	uint64_t window[METRICS_WINDOW];
+	uint64_t window_second;
+	/* time blocked on the device and on the disk */
+	uint64_t device_wait_us;
+	uint64_t disk_wait_us;
+	unsigned int files;
+	unsigned int sizes[METRICS_SIZE_BUCKETS];
+	int stalled;
+	uint64_t stall_us;
+};
+
+/**
+ * State of one backup or restore operation, so that the DLMessage handling
+ * can run for several devices in the same process.
+ */
+struct mb2_engine {
+	mobilebackup2_client_t mobilebackup2;
+	const char *backup_dir;
+	const char *udid;
+	const char *source_udid;
+	struct mb2_index *index;
+	double overall_progress;
+	int progress_finished;
+	/* draw progress bars, only makes sense with a single engine */
+	int show_progress;
+	/* set when the device cancelled or the connection failed */
+	volatile int cancelled;
+	volatile int backup_domain_changed;
+	unsigned int file_count;
+	/* files linked to the dedup store, and the bytes that were not written */
+	unsigned int dedup_files;
+	uint64_t dedup_bytes;
+	int operation_ok;
+	int result_code;
+	/* batch durability: written paths not synced yet */
+	int sync_pending;
+	char **sync_paths;
+	unsigned int num_sync_paths;
+	/* disk space kept free for other backups */
+	uint64_t reserve;
+	/* disk I/O budget, NULL if unlimited */
+	struct mb2_io_budget *budget;
+	unsigned int weight;
+	double io_credit;
+	uint64_t io_time;
+	struct mb2_metrics metrics;
+	/* trace being recorded or replayed, NULL if none */
+	struct mb2_trace *trace;
+};
+
+static void mb2_engine_init(struct mb2_engine *engine, const char *backup_dir, const char *udid, const char *source_udid)
 {
-	if (strlen(notification) == 0) {
+	memset(engine, '\0', sizeof(struct mb2_engine));
+	engine->backup_dir = backup_dir;
+	engine->udid = udid;
+	engine->source_udid = source_udid;
+	engine->show_progress = 1;
+	engine->result_code = -1;
+	engine->weight = 1;
+}
+
+static int mb2_engine_cancelled(struct mb2_engine *engine)
+{
+	return (quit_flag > 0) || engine->cancelled;
+}
+
+static uint64_t mb2_time_us(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void mb2_metrics_advance(struct mb2_metrics *metrics, uint64_t now)
+{
+	uint64_t second = (now - metrics->start_us) / 1000000;
+	uint64_t s;
+
+	for (s = metrics->window_second + 1; s <= second && s <= metrics->window_second + METRICS_WINDOW; s++) {
+		metrics->window[s % METRICS_WINDOW] = 0;
+	}
+	if (second > metrics->window_second) {
+		metrics->window_second = second;
+	}
+}
+
+/**
+ * Returns a timestamp to pass to mb2_metrics_wait(), or 0 if metrics are
+ * not collected.
+ */
+static uint64_t mb2_metrics_clock(void)
+{
+	return (metrics_file) ? mb2_time_us() : 0;
+}
+
+static void mb2_metrics_transfer(struct mb2_engine *engine, int sent, uint64_t bytes)
+{
+	struct mb2_metrics *metrics = &engine->metrics;
+
+	if (!metrics_file)
 		return;
+
+	uint64_t now = mb2_time_us();
+	mutex_lock(&metrics->mutex);
+	mb2_metrics_advance(metrics, now);
+	metrics->window[metrics->window_second % METRICS_WINDOW] += bytes;
+	if (sent) {
+		metrics->bytes_sent += bytes;
+	} else {
+		metrics->bytes_received += bytes;
 	}
-	if (!strcmp(notification, NP_SYNC_CANCEL_REQUEST)) {
-		PRINT_VERBOSE(1, "User has cancelled the backup process on the device.\n");
-		quit_flag++;
-	} else if (!strcmp(notification, NP_BACKUP_DOMAIN_CHANGED)) {
-		backup_domain_changed = 1;
+	if (metrics->stalled) {
+		metrics->stalled = 0;
+		metrics->stall_us = now - metrics->last_activity_us;
+	}
+	metrics->last_activity_us = now;
+	mutex_unlock(&metrics->mutex);
+}
+
+/**
+ * Accounts for the time since start, as returned by mb2_metrics_clock(),
+ * spent waiting for the device or for the disk.
+ */
+static void mb2_metrics_wait(struct mb2_engine *engine, int disk, uint64_t start)
+{
+	struct mb2_metrics *metrics = &engine->metrics;
+
+	if (!metrics_file)
+		return;
+
+	uint64_t us = mb2_time_us() - start;
+	mutex_lock(&metrics->mutex);
+	if (disk) {
+		metrics->disk_wait_us += us;
 	} else {
-		PRINT_VERBOSE(1, "Unhandled notification '%s' (TODO: implement)\n", notification);
+		metrics->device_wait_us += us;
 	}
+	mutex_unlock(&metrics->mutex);
 }
 
-static void mobilebackup_afc_get_file_contents(afc_client_t afc, const char *filename, char **data, uint64_t *size)
+static void mb2_metrics_file(struct mb2_engine *engine, uint64_t size)
 {
-	if (!afc || !data || !size) {
+	struct mb2_metrics *metrics = &engine->metrics;
+	unsigned int bucket = 0;
+
+	if (!metrics_file)
 		return;
+
+	/* buckets grow by a factor of 4, starting below 4 KiB */
+	size >>= 12;
+	while (size > 0 && bucket < METRICS_SIZE_BUCKETS-1) {
+		size >>= 2;
+		bucket++;
 	}
+	mutex_lock(&metrics->mutex);
+	metrics->files++;
+	metrics->sizes[bucket]++;
+	mutex_unlock(&metrics->mutex);
+}
 
-	char **fileinfo = NULL;
-	uint32_t fsize = 0;
+static void mb2_metrics_phase(struct mb2_engine *engine, enum mb2_phase phase)
+{
+	struct mb2_metrics *metrics = &engine->metrics;
 
-	afc_get_file_info(afc, filename, &fileinfo);
-	if (!fileinfo) {
+	if (!metrics_file)
 		return;
+
+	mutex_lock(&metrics->mutex);
+	metrics->phase = phase;
+	/* a new phase is activity too, waiting starts from here */
+	metrics->last_activity_us = mb2_time_us();
+	metrics->stalled = 0;
+	mutex_unlock(&metrics->mutex);
+}
+
+/**
+ * Writes one JSON line about the engine to the metrics file, and stall and
+ * resume events when they happened since the last one.
+ */
+static void mb2_metrics_report(struct mb2_engine *engine, const char *event)
+{
+	static const char *phases[] = { "waiting", "receiving", "sending" };
+	struct mb2_metrics *metrics = &engine->metrics;
+	char line[1024];
+	char stall[256];
+	int len;
+	unsigned int i;
+
+	stall[0] = '\0';
+	uint64_t now = mb2_time_us();
+	mutex_lock(&metrics->mutex);
+	mb2_metrics_advance(metrics, now);
+	double elapsed = (double)(now - metrics->start_us) / 1000000;
+	uint64_t window_bytes = 0;
+	for (i = 0; i < METRICS_WINDOW; i++) {
+		window_bytes += metrics->window[i];
+	}
+	double window = (elapsed < METRICS_WINDOW) ? elapsed : METRICS_WINDOW;
+	double rate = (window > 0) ? (double)window_bytes / window : 0;
+	double idle = (double)(now - metrics->last_activity_us) / 1000000;
+
+	if (metrics->stall_us) {
+		snprintf(stall, sizeof(stall), "{\"event\":\"resume\",\"udid\":\"%s\",\"time\":%.3f,\"phase\":\"%s\",\"stalled\":%.3f}\n", engine->udid ? engine->udid : "", elapsed, phases[metrics->phase], (double)metrics->stall_us / 1000000);
+		metrics->stall_us = 0;
+	} else if (!metrics->stalled && idle >= METRICS_STALL_TIMEOUT) {
+		metrics->stalled = 1;
+		snprintf(stall, sizeof(stall), "{\"event\":\"stall\",\"udid\":\"%s\",\"time\":%.3f,\"phase\":\"%s\",\"idle\":%.3f}\n", engine->udid ? engine->udid : "", elapsed, phases[metrics->phase], idle);
+	}
+
+	len = snprintf(line, sizeof(line), "{\"event\":\"%s\",\"udid\":\"%s\",\"time\":%.3f,\"phase\":\"%s\",\"bytes_received\":%llu,\"bytes_sent\":%llu,\"rate\":%.0f,\"device_wait\":%.3f,\"disk_wait\":%.3f,\"files\":%u,\"sizes\":[",
+		event, engine->udid ? engine->udid : "", elapsed, phases[metrics->phase],
+		(unsigned long long)metrics->bytes_received, (unsigned long long)metrics->bytes_sent, rate,
+		(double)metrics->device_wait_us / 1000000, (double)metrics->disk_wait_us / 1000000, metrics->files);
+	for (i = 0; i < METRICS_SIZE_BUCKETS; i++) {
+		len += snprintf(line + len, sizeof(line) - len, (i > 0) ? ",%u" : "%u", metrics->sizes[i]);
+	}
+	mutex_unlock(&metrics->mutex);
+
+	/* the device reports the overall progress, so estimate from that */
+	double progress = engine->overall_progress;
+	if (progress > 0 && progress < 100) {
+		snprintf(line + len, sizeof(line) - len, "],\"progress\":%.1f,\"eta\":%.0f}\n", progress, elapsed * (100 - progress) / progress);
+	} else {
+		snprintf(line + len, sizeof(line) - len, "],\"progress\":%.1f,\"eta\":null}\n", progress);
 	}
+
+	mutex_lock(&metrics_mutex);
+	fputs(stall, metrics_file);
+	fputs(line, metrics_file);
+	fflush(metrics_file);
+	mutex_unlock(&metrics_mutex);
+}
+
+static void* mb2_metrics_thread(void *arg)
+{
+	struct mb2_engine *engine = (struct mb2_engine*)arg;
 	int i;
-	for (i = 0; fileinfo[i]; i+=2) {
-		if (!strcmp(fileinfo[i], "st_size")) {
-			fsize = atol(fileinfo[i+1]);
-			break;
+
+	while (!engine->metrics.stop) {
+		for (i = 0; i < 20 && !engine->metrics.stop; i++) {
+#ifdef WIN32
+			Sleep(50);
+#else
+			usleep(50000);
+#endif
 		}
+		if (!engine->metrics.stop) {
+			mb2_metrics_report(engine, "progress");
+		}
+	}
+
+	return NULL;
+}
+
+static void mb2_metrics_start(struct mb2_engine *engine)
+{
+	struct mb2_metrics *metrics = &engine->metrics;
+
+	if (!metrics_file)
+		return;
+
+	mutex_init(&metrics->mutex);
+	metrics->start_us = metrics->last_activity_us = mb2_time_us();
+	metrics->thread = THREAD_T_NULL;
+	mb2_metrics_report(engine, "start");
+	if (thread_new(&metrics->thread, mb2_metrics_thread, engine) != 0) {
+		metrics->thread = THREAD_T_NULL;
 	}
-	afc_dictionary_free(fileinfo);
+}
 
-	if (fsize == 0) {
+static void mb2_metrics_stop(struct mb2_engine *engine)
+{
+	struct mb2_metrics *metrics = &engine->metrics;
+
+	if (!metrics_file)
 		return;
+
+	metrics->stop = 1;
+	if (metrics->thread) {
+		thread_join(metrics->thread);
+		thread_free(metrics->thread);
+		metrics->thread = THREAD_T_NULL;
 	}
+	mb2_metrics_report(engine, "done");
+	mutex_destroy(&metrics->mutex);
+}
 
-	uint64_t f = 0;
-	afc_file_open(afc, filename, AFC_FOPEN_RDONLY, &f);
-	if (!f) {
+static void mb2_io_budget_join(struct mb2_io_budget *budget, struct mb2_engine *engine)
+{
+	mutex_lock(&budget->mutex);
+	budget->weight_sum += engine->weight;
+	engine->budget = budget;
+	engine->io_credit = 0;
+	engine->io_time = mb2_time_us();
+	mutex_unlock(&budget->mutex);
+}
+
+static void mb2_io_budget_leave(struct mb2_io_budget *budget, struct mb2_engine *engine)
+{
+	mutex_lock(&budget->mutex);
+	budget->weight_sum -= engine->weight;
+	engine->budget = NULL;
+	mutex_unlock(&budget->mutex);
+}
+
+/**
+ * Accounts for length bytes of disk I/O and waits while the engine is
+ * ahead of its share of the I/O budget.
+ */
+static void mb2_engine_throttle(struct mb2_engine *engine, uint32_t length)
+{
+	struct mb2_io_budget *budget = engine->budget;
+	uint64_t wait = 0;
+
+	if (!budget || budget->rate == 0)
 		return;
+
+	mutex_lock(&budget->mutex);
+	uint64_t now = mb2_time_us();
+	double share = (double)budget->rate * engine->weight / budget->weight_sum;
+	engine->io_credit += (double)(now - engine->io_time) * share / 1000000;
+	if (engine->io_credit > share) {
+		/* allow bursts of up to one second */
+		engine->io_credit = share;
 	}
-	char *buf = (char*)malloc((uint32_t)fsize);
-	uint32_t done = 0;
-	while (done < fsize) {
-		uint32_t bread = 0;
-		afc_file_read(afc, f, buf+done, 65536, &bread);
-		if (bread > 0) {
-			done += bread;
-		} else {
+	engine->io_time = now;
+	engine->io_credit -= length;
+	if (engine->io_credit < 0) {
+		wait = (uint64_t)(-engine->io_credit * 1000000 / share);
+	}
+	mutex_unlock(&budget->mutex);
+
+	while (wait > 0 && !mb2_engine_cancelled(engine)) {
+		uint64_t us = (wait > 50000) ? 50000 : wait;
+		usleep((useconds_t)us);
+		wait -= us;
+	}
+}
+
+static void notify_cb(const char *notification, void *userdata)
+{
+	struct mb2_engine *engine = (struct mb2_engine*)userdata;
+
+	if (strlen(notification) == 0) {
+		return;
+	}
+	if (!strcmp(notification, NP_SYNC_CANCEL_REQUEST)) {
+		PRINT_VERBOSE(1, "User has cancelled the backup process on the device.\n");
+		engine->cancelled = 1;
+	} else if (!strcmp(notification, NP_BACKUP_DOMAIN_CHANGED)) {
+		engine->backup_domain_changed = 1;
+	} else {
+		PRINT_VERBOSE(1, "Unhandled notification '%s' (TODO: implement)\n", notification);
+	}
+}
+
+static const char *itunes_files[] = {
+	"ApertureAlbumPrefs",
+	"IC-Info.sidb",
+	"IC-Info.sidv",
+	"PhotosFolderAlbums",
+	"PhotosFolderName",
+	"PhotosFolderPrefs",
+	"VoiceMemos.plist",
+	"iPhotoAlbumPrefs",
+	"iTunesApplicationIDs",
+	"iTunesPrefs",
+	"iTunesPrefs.plist",
+	NULL
+};
+
+#define ITUNES_FILES_COUNT (sizeof(itunes_files) / sizeof(itunes_files[0]))
+#define ITUNES_FILES_DIR "/iTunes_Control/iTunes/"
+#define IBOOKS_DATA_PATH "/Books/iBooksData2.plist"
+
+/**
+ * Fetches the files that go into Info.plist from the device, with the
+ * requests of all of them in flight at once, on a thread of its own so it
+ * overlaps with the lockdown and installation proxy queries. The last
+ * slot holds the iBooks data.
+ */
+struct mb2_itunes_prefetch {
+	afc_client_t afc;
+	THREAD_T thread;
+	char *paths[ITUNES_FILES_COUNT];
+	plist_t data[ITUNES_FILES_COUNT];
+};
+
+static int mb2_itunes_prefetch_cb(const char *path, afc_error_t error, const char *data, uint32_t length, void *user_data)
+{
+	struct mb2_itunes_prefetch *prefetch = (struct mb2_itunes_prefetch*)user_data;
+	unsigned int i;
+
+	if (error != AFC_E_SUCCESS || length == 0) {
+		return 0;
+	}
+	for (i = 0; i < ITUNES_FILES_COUNT; i++) {
+		if (!strcmp(prefetch->paths[i], path)) {
+			prefetch->data[i] = plist_new_data(data, length);
 			break;
 		}
 	}
-	if (done == fsize) {
-		*size = fsize;
-		*data = buf;
-	} else {
-		free(buf);
+
+	return 0;
+}
+
+static void* mb2_itunes_prefetch_thread(void *arg)
+{
+	struct mb2_itunes_prefetch *prefetch = (struct mb2_itunes_prefetch*)arg;
+
+	afc_read_files(prefetch->afc, (const char**)prefetch->paths, ITUNES_FILES_COUNT, 0, mb2_itunes_prefetch_cb, prefetch);
+
+	return NULL;
+}
+
+static void mb2_itunes_prefetch_start(struct mb2_itunes_prefetch *prefetch, afc_client_t afc)
+{
+	unsigned int i;
+
+	memset(prefetch, '\0', sizeof(struct mb2_itunes_prefetch));
+	prefetch->afc = afc;
+	prefetch->thread = THREAD_T_NULL;
+	if (!afc) {
+		return;
+	}
+	for (i = 0; itunes_files[i]; i++) {
+		prefetch->paths[i] = string_concat(ITUNES_FILES_DIR, itunes_files[i], NULL);
+	}
+	prefetch->paths[i] = strdup(IBOOKS_DATA_PATH);
+
+	if (thread_new(&prefetch->thread, mb2_itunes_prefetch_thread, prefetch) != 0) {
+		prefetch->thread = THREAD_T_NULL;
+		mb2_itunes_prefetch_thread(prefetch);
+	}
+}
+
+static void mb2_itunes_prefetch_finish(struct mb2_itunes_prefetch *prefetch)
+{
+	unsigned int i;
+
+	if (prefetch->thread) {
+		thread_join(prefetch->thread);
+		thread_free(prefetch->thread);
+		prefetch->thread = THREAD_T_NULL;
+	}
+	for (i = 0; i < ITUNES_FILES_COUNT; i++) {
+		free(prefetch->paths[i]);
+		prefetch->paths[i] = NULL;
 	}
-	afc_file_close(afc, f);
 }
 
 static int __mkdir(const char* path, int mode)
@@ -242,103 +727,585 @@ static int remove_directory(const char* path)
 	return e;
 }
 
-struct entry {
-	char *name;
-	struct entry *next;
+/*
+ * A trace of the DLMessage stream of a backup or restore, to replay it
+ * against the handlers without a device. It starts with TRACE_MAGIC, a 32
+ * bit big endian version, and the length and bytes of the UDID, followed by
+ * records of a type byte and a 32 bit big endian length:
+ *   'M' a DLMessage as binary plist of length bytes
+ *   'R' length bytes received besides file contents, like names and codes
+ *   'D' length bytes of file contents, of which only the CRC-32 follows
+ *   'F' a file sent to the device: its 64 bit size and path of length bytes
+ * Replies to the device are not recorded.
+ */
+#define TRACE_MAGIC "MB2TRACE"
+#define TRACE_MAGIC_SIZE 8
+#define TRACE_VERSION 1
+#define TRACE_RECORD_HEADER_SIZE 5
+
+struct mb2_trace {
+	/* recording */
+	FILE *f;
+	/* replaying, the whole trace is read first so it costs no I/O */
+	unsigned char *data;
+	size_t size;
+	size_t pos;
+	char *udid;
+	/* the record being received, 0 if none */
+	char type;
+	uint32_t remaining;
+	/* synthetic file contents, the same for the same CRC-32 and length */
+	uint64_t state;
+	uint32_t offset;
+	unsigned int messages;
+	uint64_t bytes_received;
+	uint64_t bytes_sent;
+	uint64_t heap_peak;
 };
 
-static void scan_directory(const char *path, struct entry **files, struct entry **directories)
+static void mb2_trace_write_record(struct mb2_trace *trace, char type, uint32_t length, const void *data, size_t data_length)
 {
-	DIR* cur_dir = opendir(path);
-	if (cur_dir) {
-		struct dirent* ep;
-		while ((ep = readdir(cur_dir))) {
-			if ((strcmp(ep->d_name, ".") == 0) || (strcmp(ep->d_name, "..") == 0)) {
-				continue;
-			}
-			char *fpath = string_build_path(path, ep->d_name, NULL);
-			if (fpath) {
-#ifdef HAVE_DIRENT_D_TYPE
-				if (ep->d_type & DT_DIR) {
-#else
-				struct stat st;
-				if (stat(fpath, &st) != 0) return;
-				if (S_ISDIR(st.st_mode)) {
-#endif
-					struct entry *ent = malloc(sizeof(struct entry));
-					if (!ent) return;
-					ent->name = fpath;
-					ent->next = *directories;
-					*directories = ent;
-					scan_directory(fpath, files, directories);
-					fpath = NULL;
-				} else {
-					struct entry *ent = malloc(sizeof(struct entry));
-					if (!ent) return;
-					ent->name = fpath;
-					ent->next = *files;
-					*files = ent;
-					fpath = NULL;
-				}
-			}
-		}
-		closedir(cur_dir);
+	unsigned char hdr[TRACE_RECORD_HEADER_SIZE];
+	uint32_t nlen = htobe32(length);
+
+	hdr[0] = (unsigned char)type;
+	memcpy(hdr + 1, &nlen, sizeof(nlen));
+	if (fwrite(hdr, 1, sizeof(hdr), trace->f) != sizeof(hdr) || (data_length > 0 && fwrite(data, 1, data_length, trace->f) != data_length)) {
+		printf("WARNING: Could not write to trace, recording stopped: %s\n", strerror(errno));
+		fclose(trace->f);
+		trace->f = NULL;
 	}
 }
 
-static int rmdir_recursive(const char* path)
+static struct mb2_trace *mb2_trace_record(const char *path, const char *udid)
 {
-	int res = 0;
-	struct entry *files = NULL;
-	struct entry *directories = NULL;
-	struct entry *ent;
-
-	ent = malloc(sizeof(struct entry));
-	if (!ent) return ENOMEM;
-	ent->name = strdup(path);
-	ent->next = NULL;
-	directories = ent;
-
-	scan_directory(path, &files, &directories);
-
-	ent = files;
-	while (ent) {
-		struct entry *del = ent;
-		res = remove_file(ent->name);
-		free(ent->name);
-		ent = ent->next;
-		free(del);
+	struct mb2_trace *trace = (struct mb2_trace*)calloc(1, sizeof(struct mb2_trace));
+	uint32_t version = htobe32(TRACE_VERSION);
+	uint32_t udid_len = htobe32((uint32_t)strlen(udid));
+
+	trace->f = fopen(path, "wb");
+	if (!trace->f) {
+		printf("ERROR: Could not create trace file \"%s\": %s\n", path, strerror(errno));
+		free(trace);
+		return NULL;
 	}
-	ent = directories;
-	while (ent) {
-		struct entry *del = ent;
-		res = remove_directory(ent->name);
-		free(ent->name);
-		ent = ent->next;
-		free(del);
+	if (fwrite(TRACE_MAGIC, 1, TRACE_MAGIC_SIZE, trace->f) != TRACE_MAGIC_SIZE
+	 || fwrite(&version, 1, 4, trace->f) != 4
+	 || fwrite(&udid_len, 1, 4, trace->f) != 4
+	 || fwrite(udid, 1, strlen(udid), trace->f) != strlen(udid)) {
+		printf("ERROR: Could not write trace file \"%s\": %s\n", path, strerror(errno));
+		fclose(trace->f);
+		free(trace);
+		return NULL;
 	}
 
-	return res;
+	return trace;
 }
 
-static char* get_uuid()
+static uint32_t mb2_trace_get32(const unsigned char *p)
 {
-	const char *chars = "ABCDEF0123456789";
-	int i = 0;
-	char *uuid = (char*)malloc(sizeof(char) * 33);
-
-	srand(time(NULL));
-
-	for (i = 0; i < 32; i++) {
-		uuid[i] = chars[rand() % 16];
-	}
-
-	uuid[32] = '\0';
-
-	return uuid;
+	uint32_t value;
+	memcpy(&value, p, sizeof(value));
+	return be32toh(value);
 }
 
-static plist_t mobilebackup_factory_info_plist_new(const char* udid, idevice_t device, afc_client_t afc)
+/**
+ * Returns the length of the record at pos including its header, or 0 if it
+ * is truncated.
+ */
+static size_t mb2_trace_record_size(struct mb2_trace *trace, size_t pos)
+{
+	size_t size;
+
+	if (trace->size - pos < TRACE_RECORD_HEADER_SIZE)
+		return 0;
+	uint32_t length = mb2_trace_get32(trace->data + pos + 1);
+	switch (trace->data[pos]) {
+		case 'M':
+		case 'R':
+			size = TRACE_RECORD_HEADER_SIZE + (size_t)length;
+			break;
+		case 'D':
+			size = TRACE_RECORD_HEADER_SIZE + 4;
+			break;
+		case 'F':
+			size = TRACE_RECORD_HEADER_SIZE + 8 + (size_t)length;
+			break;
+		default:
+			return 0;
+	}
+
+	return (size <= trace->size - pos) ? size : 0;
+}
+
+static void mb2_trace_free(struct mb2_trace *trace)
+{
+	if (!trace)
+		return;
+
+	if (trace->f) {
+		fclose(trace->f);
+	}
+	free(trace->data);
+	free(trace->udid);
+	free(trace);
+}
+
+static struct mb2_trace *mb2_trace_load(const char *path)
+{
+	struct mb2_trace *trace = NULL;
+	size_t pos;
+
+	FILE *f = fopen(path, "rb");
+	if (!f) {
+		printf("ERROR: Could not open trace file \"%s\": %s\n", path, strerror(errno));
+		return NULL;
+	}
+	trace = (struct mb2_trace*)calloc(1, sizeof(struct mb2_trace));
+	size_t capacity = 0;
+	while (1) {
+		if (trace->size == capacity) {
+			capacity = (capacity) ? capacity * 2 : (1024 * 1024);
+			unsigned char *data = (unsigned char*)realloc(trace->data, capacity);
+			if (!data) {
+				printf("ERROR: Not enough memory for trace file \"%s\"\n", path);
+				fclose(f);
+				mb2_trace_free(trace);
+				return NULL;
+			}
+			trace->data = data;
+		}
+		size_t r = fread(trace->data + trace->size, 1, capacity - trace->size, f);
+		if (r == 0)
+			break;
+		trace->size += r;
+	}
+	fclose(f);
+
+	if (trace->size < TRACE_MAGIC_SIZE + 8 || memcmp(trace->data, TRACE_MAGIC, TRACE_MAGIC_SIZE) != 0
+	 || mb2_trace_get32(trace->data + TRACE_MAGIC_SIZE) != TRACE_VERSION) {
+		printf("ERROR: \"%s\" is not a trace of this version\n", path);
+		mb2_trace_free(trace);
+		return NULL;
+	}
+	uint32_t udid_len = mb2_trace_get32(trace->data + TRACE_MAGIC_SIZE + 4);
+	pos = TRACE_MAGIC_SIZE + 8;
+	if (udid_len == 0 || udid_len > trace->size - pos) {
+		printf("ERROR: Trace file \"%s\" is truncated\n", path);
+		mb2_trace_free(trace);
+		return NULL;
+	}
+	trace->udid = strndup((const char*)trace->data + pos, udid_len);
+	trace->pos = pos + udid_len;
+
+	/* so a damaged trace can't send the replay off into the weeds */
+	for (pos = trace->pos; pos < trace->size; ) {
+		size_t size = mb2_trace_record_size(trace, pos);
+		if (size == 0) {
+			printf("ERROR: Trace file \"%s\" is damaged at offset %llu\n", path, (unsigned long long)pos);
+			mb2_trace_free(trace);
+			return NULL;
+		}
+		pos += size;
+	}
+
+	return trace;
+}
+
+/**
+ * Creates the files the device downloads during the traced run with
+ * synthetic contents, unless they exist in backup_dir already.
+ */
+static void mb2_trace_create_files(struct mb2_trace *trace, const char *backup_dir)
+{
+	char buf[65536];
+	size_t pos;
+	struct stat st;
+
+	memset(buf, 'x', sizeof(buf));
+	for (pos = trace->pos; pos < trace->size; pos += mb2_trace_record_size(trace, pos)) {
+		if (trace->data[pos] != 'F')
+			continue;
+
+		uint32_t length = mb2_trace_get32(trace->data + pos + 1);
+		uint64_t size;
+		memcpy(&size, trace->data + pos + TRACE_RECORD_HEADER_SIZE, sizeof(size));
+		size = be64toh(size);
+		char *name = strndup((const char*)trace->data + pos + TRACE_RECORD_HEADER_SIZE + 8, length);
+		char *path = string_build_path(backup_dir, name, NULL);
+		free(name);
+		if (stat(path, &st) == 0) {
+			free(path);
+			continue;
+		}
+		char *dir = strdup(path);
+		char *p = strrchr(dir, '/');
+		if (p) {
+			*p = '\0';
+			mkdir_with_parents(dir, 0755);
+		}
+		free(dir);
+		FILE *f = fopen(path, "wb");
+		if (!f) {
+			printf("WARNING: Could not create \"%s\": %s\n", path, strerror(errno));
+			free(path);
+			continue;
+		}
+		while (size > 0) {
+			size_t n = (size < sizeof(buf)) ? (size_t)size : sizeof(buf);
+			if (fwrite(buf, 1, n, f) != n)
+				break;
+			size -= n;
+		}
+		fclose(f);
+		free(path);
+	}
+}
+
+static void mb2_trace_sample_heap(struct mb2_trace *trace)
+{
+#ifdef HAVE_MALLINFO2
+	struct mallinfo2 mi = mallinfo2();
+	uint64_t heap = (uint64_t)mi.uordblks + (uint64_t)mi.hblkhd;
+	if (heap > trace->heap_peak) {
+		trace->heap_peak = heap;
+	}
+#endif
+}
+
+/**
+ * Moves on to the next record that is received raw, skipping 'F' records.
+ * Returns 0 if the next record is a DLMessage or the trace ends.
+ */
+static int mb2_trace_next_raw(struct mb2_trace *trace)
+{
+	while (trace->pos < trace->size) {
+		char type = (char)trace->data[trace->pos];
+		if (type == 'M') {
+			return 0;
+		}
+		size_t size = mb2_trace_record_size(trace, trace->pos);
+		if (type == 'F') {
+			trace->pos += size;
+			continue;
+		}
+		trace->type = type;
+		trace->remaining = mb2_trace_get32(trace->data + trace->pos + 1);
+		trace->offset = 0;
+		if (type == 'D') {
+			uint32_t crc = mb2_trace_get32(trace->data + trace->pos + TRACE_RECORD_HEADER_SIZE);
+			trace->state = ((uint64_t)crc << 32 | trace->remaining) | 1;
+			trace->pos += size;
+		} else {
+			trace->pos += TRACE_RECORD_HEADER_SIZE;
+		}
+		if (trace->remaining > 0) {
+			return 1;
+		}
+		trace->type = 0;
+	}
+
+	return 0;
+}
+
+static void mb2_trace_fill(struct mb2_trace *trace, char *data, uint32_t length)
+{
+	uint32_t i;
+
+	for (i = 0; i < length; i++, trace->offset++) {
+		if ((trace->offset & 7) == 0) {
+			/* xorshift64 */
+			trace->state ^= trace->state << 13;
+			trace->state ^= trace->state >> 7;
+			trace->state ^= trace->state << 17;
+		}
+		data[i] = (char)(trace->state >> ((trace->offset & 7) * 8));
+	}
+}
+
+static mobilebackup2_error_t mb2_trace_receive_raw(struct mb2_trace *trace, char *data, uint32_t length, uint32_t *bytes)
+{
+	uint32_t done = 0;
+
+	while (done < length) {
+		if (trace->type == 0 && !mb2_trace_next_raw(trace)) {
+			break;
+		}
+		uint32_t n = (length - done < trace->remaining) ? length - done : trace->remaining;
+		if (trace->type == 'R') {
+			memcpy(data + done, trace->data + trace->pos, n);
+			trace->pos += n;
+		} else {
+			mb2_trace_fill(trace, data + done, n);
+			trace->bytes_received += n;
+		}
+		done += n;
+		trace->remaining -= n;
+		if (trace->remaining == 0) {
+			trace->type = 0;
+		}
+	}
+	*bytes = done;
+
+	return (done > 0 || length == 0) ? MOBILEBACKUP2_E_SUCCESS : MOBILEBACKUP2_E_MUX_ERROR;
+}
+
+static mobilebackup2_error_t mb2_trace_receive_message(struct mb2_trace *trace, plist_t *message, char **dlmessage)
+{
+	/* whatever the handlers left unread */
+	if (trace->type == 'R') {
+		trace->pos += trace->remaining;
+	}
+	trace->type = 0;
+	while (mb2_trace_next_raw(trace)) {
+		if (trace->type == 'R') {
+			trace->pos += trace->remaining;
+		}
+		trace->type = 0;
+	}
+	if (trace->pos >= trace->size) {
+		return MOBILEBACKUP2_E_MUX_ERROR;
+	}
+
+	uint32_t length = mb2_trace_get32(trace->data + trace->pos + 1);
+	*message = NULL;
+	plist_from_bin((const char*)trace->data + trace->pos + TRACE_RECORD_HEADER_SIZE, length, message);
+	trace->pos += TRACE_RECORD_HEADER_SIZE + length;
+	plist_t node = plist_array_get_item(*message, 0);
+	if (plist_get_node_type(node) != PLIST_STRING) {
+		plist_free(*message);
+		*message = NULL;
+		return MOBILEBACKUP2_E_PLIST_ERROR;
+	}
+	if (dlmessage) {
+		plist_get_string_val(node, dlmessage);
+	}
+	trace->messages++;
+	mb2_trace_sample_heap(trace);
+
+	return MOBILEBACKUP2_E_SUCCESS;
+}
+
+/*
+ * Device I/O of the handlers. While replaying a trace these read from the
+ * trace and only count what is sent, while recording they also write the
+ * trace.
+ */
+
+static mobilebackup2_error_t mb2_receive_message(struct mb2_engine *engine, plist_t *message, char **dlmessage)
+{
+	struct mb2_trace *trace = engine->trace;
+
+	if (trace && trace->data) {
+		return mb2_trace_receive_message(trace, message, dlmessage);
+	}
+	mobilebackup2_error_t err = mobilebackup2_receive_message(engine->mobilebackup2, message, dlmessage);
+	if (err == MOBILEBACKUP2_E_SUCCESS && trace && trace->f) {
+		char *bin = NULL;
+		uint32_t length = 0;
+		plist_to_bin(*message, &bin, &length);
+		mb2_trace_write_record(trace, 'M', length, bin, length);
+		free(bin);
+	}
+
+	return err;
+}
+
+static uint32_t mb2_crc32(const char *data, uint32_t length)
+{
+#ifdef HAVE_ZLIB
+	return (uint32_t)crc32(0, (const Bytef*)data, length);
+#else
+	/* the CRC-32 of zlib, so traces don't depend on how the tool was built */
+	uint32_t crc = 0xffffffff;
+	uint32_t i;
+	int k;
+	for (i = 0; i < length; i++) {
+		crc ^= (unsigned char)data[i];
+		for (k = 0; k < 8; k++) {
+			crc = (crc >> 1) ^ (0xedb88320 & (0 - (crc & 1)));
+		}
+	}
+	return ~crc;
+#endif
+}
+
+/* contents is nonzero if the data received are file contents */
+static mobilebackup2_error_t mb2_receive_raw(struct mb2_engine *engine, char *data, uint32_t length, uint32_t *bytes, int contents)
+{
+	struct mb2_trace *trace = engine->trace;
+
+	if (trace && trace->data) {
+		mobilebackup2_error_t err = mb2_trace_receive_raw(trace, data, length, bytes);
+		if (err != MOBILEBACKUP2_E_SUCCESS) {
+			/* the device would have sent more, so the trace is incomplete */
+			printf("ERROR: Trace ended unexpectedly\n");
+			engine->cancelled = 1;
+		}
+		return err;
+	}
+	mobilebackup2_error_t err = mobilebackup2_receive_raw(engine->mobilebackup2, data, length, bytes);
+	if (err == MOBILEBACKUP2_E_SUCCESS && trace && trace->f && *bytes > 0) {
+		if (contents) {
+			uint32_t crc = htobe32(mb2_crc32(data, *bytes));
+			mb2_trace_write_record(trace, 'D', *bytes, &crc, sizeof(crc));
+		} else {
+			mb2_trace_write_record(trace, 'R', *bytes, data, *bytes);
+		}
+	}
+
+	return err;
+}
+
+static mobilebackup2_error_t mb2_send_raw(struct mb2_engine *engine, const char *data, uint32_t length, uint32_t *bytes)
+{
+	if (engine->trace && engine->trace->data) {
+		engine->trace->bytes_sent += length;
+		*bytes = length;
+		return MOBILEBACKUP2_E_SUCCESS;
+	}
+
+	return mobilebackup2_send_raw(engine->mobilebackup2, data, length, bytes);
+}
+
+static mobilebackup2_error_t mb2_send_rawv(struct mb2_engine *engine, const idevice_iovec_t *iov, int iovcnt, uint32_t *bytes)
+{
+	if (engine->trace && engine->trace->data) {
+		int i;
+		*bytes = 0;
+		for (i = 0; i < iovcnt; i++) {
+			*bytes += iov[i].len;
+		}
+		engine->trace->bytes_sent += *bytes;
+		return MOBILEBACKUP2_E_SUCCESS;
+	}
+
+	return mobilebackup2_send_rawv(engine->mobilebackup2, iov, iovcnt, bytes);
+}
+
+static mobilebackup2_error_t mb2_send_status_response(struct mb2_engine *engine, int status_code, const char *status1, plist_t status2)
+{
+	if (engine->trace && engine->trace->data) {
+		return MOBILEBACKUP2_E_SUCCESS;
+	}
+
+	return mobilebackup2_send_status_response(engine->mobilebackup2, status_code, status1, status2);
+}
+
+/* records the size of a file the device downloads, to recreate it for replay */
+static void mb2_trace_file(struct mb2_engine *engine, const char *path, uint64_t size)
+{
+	struct mb2_trace *trace = engine->trace;
+
+	if (!trace || !trace->f)
+		return;
+
+	uint32_t length = (uint32_t)strlen(path);
+	char *buf = (char*)malloc(8 + length);
+	uint64_t nsize = htobe64(size);
+	memcpy(buf, &nsize, 8);
+	memcpy(buf + 8, path, length);
+	mb2_trace_write_record(trace, 'F', length, buf, 8 + length);
+	free(buf);
+}
+
+struct entry {
+	char *name;
+	struct entry *next;
+};
+
+static void scan_directory(const char *path, struct entry **files, struct entry **directories)
+{
+	DIR* cur_dir = opendir(path);
+	if (cur_dir) {
+		struct dirent* ep;
+		while ((ep = readdir(cur_dir))) {
+			if ((strcmp(ep->d_name, ".") == 0) || (strcmp(ep->d_name, "..") == 0)) {
+				continue;
+			}
+			char *fpath = string_build_path(path, ep->d_name, NULL);
+			if (fpath) {
+#ifdef HAVE_DIRENT_D_TYPE
+				if (ep->d_type & DT_DIR) {
+#else
+				struct stat st;
+				if (stat(fpath, &st) != 0) return;
+				if (S_ISDIR(st.st_mode)) {
+#endif
+					struct entry *ent = malloc(sizeof(struct entry));
+					if (!ent) return;
+					ent->name = fpath;
+					ent->next = *directories;
+					*directories = ent;
+					scan_directory(fpath, files, directories);
+					fpath = NULL;
+				} else {
+					struct entry *ent = malloc(sizeof(struct entry));
+					if (!ent) return;
+					ent->name = fpath;
+					ent->next = *files;
+					*files = ent;
+					fpath = NULL;
+				}
+			}
+		}
+		closedir(cur_dir);
+	}
+}
+
+static int rmdir_recursive(const char* path)
+{
+	int res = 0;
+	struct entry *files = NULL;
+	struct entry *directories = NULL;
+	struct entry *ent;
+
+	ent = malloc(sizeof(struct entry));
+	if (!ent) return ENOMEM;
+	ent->name = strdup(path);
+	ent->next = NULL;
+	directories = ent;
+
+	scan_directory(path, &files, &directories);
+
+	ent = files;
+	while (ent) {
+		struct entry *del = ent;
+		res = remove_file(ent->name);
+		free(ent->name);
+		ent = ent->next;
+		free(del);
+	}
+	ent = directories;
+	while (ent) {
+		struct entry *del = ent;
+		res = remove_directory(ent->name);
+		free(ent->name);
+		ent = ent->next;
+		free(del);
+	}
+
+	return res;
+}
+
+static char* get_uuid()
+{
+	const char *chars = "ABCDEF0123456789";
+	int i = 0;
+	char *uuid = (char*)malloc(sizeof(char) * 33);
+
+	srand(time(NULL));
+
+	for (i = 0; i < 32; i++) {
+		uuid[i] = chars[rand() % 16];
+	}
+
+	uuid[32] = '\0';
+
+	return uuid;
+}
+
+static plist_t mobilebackup_factory_info_plist_new(const char* udid, idevice_t device, afc_client_t afc)
 {
 	/* gather data from lockdown */
 	plist_t value_node = NULL;
@@ -346,12 +1313,15 @@ static plist_t mobilebackup_factory_info_plist_new(const char* udid, idevice_t d
 	plist_t itunes_settings = NULL;
 	plist_t min_itunes_version = NULL;
 	char *udid_uppercase = NULL;
+	struct mb2_itunes_prefetch prefetch;
 
 	lockdownd_client_t lockdown = NULL;
 	if (lockdownd_client_new_with_handshake(device, &lockdown, TOOL_NAME) != LOCKDOWN_E_SUCCESS) {
 		return NULL;
 	}
 
+	mb2_itunes_prefetch_start(&prefetch, afc);
+
 	plist_t ret = plist_new_dict();
 
 	/* get basic device information in one go */
@@ -485,41 +1455,17 @@ static plist_t mobilebackup_factory_info_plist_new(const char* udid, idevice_t d
 	plist_dict_set_item(ret, "Unique Identifier", plist_new_string(udid_uppercase));
 	free(udid_uppercase);
 
-	char *data_buf = NULL;
-	uint64_t data_size = 0;
-	mobilebackup_afc_get_file_contents(afc, "/Books/iBooksData2.plist", &data_buf, &data_size);
-	if (data_buf) {
-		plist_dict_set_item(ret, "iBooks Data 2", plist_new_data(data_buf, data_size));
-		free(data_buf);
+	mb2_itunes_prefetch_finish(&prefetch);
+
+	if (prefetch.data[ITUNES_FILES_COUNT-1]) {
+		plist_dict_set_item(ret, "iBooks Data 2", prefetch.data[ITUNES_FILES_COUNT-1]);
 	}
 
 	plist_t files = plist_new_dict();
-	const char *itunesfiles[] = {
-		"ApertureAlbumPrefs",
-		"IC-Info.sidb",
-		"IC-Info.sidv",
-		"PhotosFolderAlbums",
-		"PhotosFolderName",
-		"PhotosFolderPrefs",
-		"VoiceMemos.plist",
-		"iPhotoAlbumPrefs",
-		"iTunesApplicationIDs",
-		"iTunesPrefs",
-		"iTunesPrefs.plist",
-		NULL
-	};
 	int i = 0;
-	for (i = 0; itunesfiles[i]; i++) {
-		data_buf = NULL;
-		data_size = 0;
-		char *fname = (char*)malloc(strlen("/iTunes_Control/iTunes/") + strlen(itunesfiles[i]) + 1);
-		strcpy(fname, "/iTunes_Control/iTunes/");
-		strcat(fname, itunesfiles[i]);
-		mobilebackup_afc_get_file_contents(afc, fname, &data_buf, &data_size);
-		free(fname);
-		if (data_buf) {
-			plist_dict_set_item(files, itunesfiles[i], plist_new_data(data_buf, data_size));
-			free(data_buf);
+	for (i = 0; itunes_files[i]; i++) {
+		if (prefetch.data[i]) {
+			plist_dict_set_item(files, itunes_files[i], prefetch.data[i]);
 		}
 	}
 	plist_dict_set_item(ret, "iTunes Files", files);
@@ -695,32 +1641,73 @@ static void print_progress(uint64_t current, uint64_t total)
 		PRINT_VERBOSE(1, "\n");
 }
 
-static double overall_progress = 0;
-
-static void mb2_set_overall_progress(double progress)
+static void mb2_set_overall_progress(struct mb2_engine *engine, double progress)
 {
 	if (progress > 0.0)
-		overall_progress = progress;
+		engine->overall_progress = progress;
+}
+
+enum mb2_dl_message {
+	MB2_DL_UNKNOWN = -1,
+	MB2_DL_DOWNLOAD_FILES,
+	MB2_DL_UPLOAD_FILES,
+	MB2_DL_GET_FREE_DISK_SPACE,
+	MB2_DL_CONTENTS_OF_DIRECTORY,
+	MB2_DL_CREATE_DIRECTORY,
+	MB2_DL_MOVE_ITEMS,
+	MB2_DL_REMOVE_ITEMS,
+	MB2_DL_COPY_ITEM,
+	MB2_DL_DISCONNECT,
+	MB2_DL_PROCESS_MESSAGE
+};
+
+static struct {
+	const char *name;
+	enum mb2_dl_message message;
+} mb2_dl_messages[] = {
+	{ "DLMessageDownloadFiles", MB2_DL_DOWNLOAD_FILES },
+	{ "DLMessageUploadFiles", MB2_DL_UPLOAD_FILES },
+	{ "DLMessageGetFreeDiskSpace", MB2_DL_GET_FREE_DISK_SPACE },
+	{ "DLContentsOfDirectory", MB2_DL_CONTENTS_OF_DIRECTORY },
+	{ "DLMessageCreateDirectory", MB2_DL_CREATE_DIRECTORY },
+	{ "DLMessageMoveFiles", MB2_DL_MOVE_ITEMS },
+	{ "DLMessageMoveItems", MB2_DL_MOVE_ITEMS },
+	{ "DLMessageRemoveFiles", MB2_DL_REMOVE_ITEMS },
+	{ "DLMessageRemoveItems", MB2_DL_REMOVE_ITEMS },
+	{ "DLMessageCopyItem", MB2_DL_COPY_ITEM },
+	{ "DLMessageDisconnect", MB2_DL_DISCONNECT },
+	{ "DLMessageProcessMessage", MB2_DL_PROCESS_MESSAGE },
+	{ NULL, MB2_DL_UNKNOWN }
+};
+static strmap_t mb2_dl_message_map = STRMAP_INIT(mb2_dl_messages);
+
+static enum mb2_dl_message mb2_dl_message_from_name(const char *name)
+{
+	int i = strmap_find(&mb2_dl_message_map, name);
+	return (i < 0) ? MB2_DL_UNKNOWN : mb2_dl_messages[i].message;
 }
 
-static void mb2_set_overall_progress_from_message(plist_t message, char* identifier)
+static void mb2_set_overall_progress_from_message(struct mb2_engine *engine, plist_t message, enum mb2_dl_message dlmsg)
 {
 	plist_t node = NULL;
 	double progress = 0.0;
 
-	if (!strcmp(identifier, "DLMessageDownloadFiles")) {
-		node = plist_array_get_item(message, 3);
-	} else if (!strcmp(identifier, "DLMessageUploadFiles")) {
-		node = plist_array_get_item(message, 2);
-	} else if (!strcmp(identifier, "DLMessageMoveFiles") || !strcmp(identifier, "DLMessageMoveItems")) {
-		node = plist_array_get_item(message, 3);
-	} else if (!strcmp(identifier, "DLMessageRemoveFiles") || !strcmp(identifier, "DLMessageRemoveItems")) {
-		node = plist_array_get_item(message, 3);
+	switch (dlmsg) {
+		case MB2_DL_UPLOAD_FILES:
+			node = plist_array_get_item(message, 2);
+			break;
+		case MB2_DL_DOWNLOAD_FILES:
+		case MB2_DL_MOVE_ITEMS:
+		case MB2_DL_REMOVE_ITEMS:
+			node = plist_array_get_item(message, 3);
+			break;
+		default:
+			break;
 	}
 
 	if (node != NULL) {
 		plist_get_real_val(node, &progress);
-		mb2_set_overall_progress(progress);
+		mb2_set_overall_progress(engine, progress);
 	}
 }
 
@@ -745,659 +1732,3610 @@ static int errno_to_device_error(int errno_value)
 	}
 }
 
-static int mb2_handle_send_file(mobilebackup2_client_t mobilebackup2, const char *backup_dir, const char *path, plist_t *errplist)
-{
-	uint32_t nlen = 0;
-	uint32_t pathlen = strlen(path);
-	uint32_t bytes = 0;
-	char *localfile = string_build_path(backup_dir, path, NULL);
-	char buf[32768];
-#ifdef WIN32
-	struct _stati64 fst;
-#else
-	struct stat fst;
-#endif
+enum mb2_file_type {
+	MB2_FILE_TYPE_UNKNOWN = 0,
+	MB2_FILE_TYPE_REGULAR,
+	MB2_FILE_TYPE_DIRECTORY
+};
 
-	FILE *f = NULL;
-	uint32_t slen = 0;
-	int errcode = -1;
-	int result = -1;
-	uint32_t length;
-#ifdef WIN32
-	uint64_t total;
-	uint64_t sent;
-#else
-	off_t total;
-	off_t sent;
-#endif
+#define INDEX_VERSION 1
+#define INDEX_DIR_HASH_SIZE 4096
+#define INDEX_ENTRY_HASH_SIZE 262144
+
+struct mb2_index_dir;
+
+struct mb2_index_entry {
+	char *path;
+	const char *name;
+	enum mb2_file_type type;
+	uint64_t size;
+	time_t mtime;
+	struct mb2_index_dir *dir;
+	struct mb2_index_entry *hash_next;
+	struct mb2_index_entry *prev;
+	struct mb2_index_entry *next;
+};
 
-	mobilebackup2_error_t err;
+struct mb2_index_dir {
+	char *path;
+	/* modification time of the directory when it was read, 0 after we changed it */
+	time_t mtime;
+	struct mb2_index_entry *entries;
+	struct mb2_index_dir *hash_next;
+};
 
-	/* send path length */
-	nlen = htobe32(pathlen);
-	err = mobilebackup2_send_raw(mobilebackup2, (const char*)&nlen, sizeof(nlen), &bytes);
-	if (err != MOBILEBACKUP2_E_SUCCESS) {
-		goto leave_proto_err;
-	}
-	if (bytes != (uint32_t)sizeof(nlen)) {
-		err = MOBILEBACKUP2_E_MUX_ERROR;
-		goto leave_proto_err;
-	}
+/**
+ * Keeps the contents of the directories of a backup in memory, so listing
+ * directories and checking for files doesn't need to hit the filesystem.
+ * Paths are relative to the backup directory, as used by the device.
+ * The index is persisted; a directory is only trusted after loading if its
+ * modification time didn't change.
+ * Besides the hash table, directories are kept in an array sorted by path
+ * with '/' ordered first, so all directories below a path follow it
+ * directly and a subtree can be dropped without scanning the whole index.
+ */
+struct mb2_index {
+	char *backup_dir;
+	char *filename;
+	struct mb2_index_dir **dirs;
+	struct mb2_index_entry **entries;
+	struct mb2_index_dir **sorted;
+	uint32_t num_sorted;
+	uint32_t sorted_size;
+	int dirty;
+};
 
-	/* send path */
-	err = mobilebackup2_send_raw(mobilebackup2, path, pathlen, &bytes);
-	if (err != MOBILEBACKUP2_E_SUCCESS) {
-		goto leave_proto_err;
+static uint32_t mb2_index_hash(const char *str)
+{
+	uint32_t hash = 2166136261U;
+	while (*str) {
+		hash ^= (unsigned char)*str++;
+		hash *= 16777619U;
 	}
-	if (bytes != pathlen) {
-		err = MOBILEBACKUP2_E_MUX_ERROR;
-		goto leave_proto_err;
+	return hash;
+}
+
+static char *mb2_index_normalize_path(const char *path)
+{
+	char *result = strdup(path);
+	size_t len = strlen(result);
+	while (len > 0 && result[len-1] == '/') {
+		result[--len] = '\0';
 	}
+	return result;
+}
 
-#ifdef WIN32
-	if (_stati64(localfile, &fst) < 0)
-#else
-	if (stat(localfile, &fst) < 0)
-#endif
-	{
-		if (errno != ENOENT)
-			printf("%s: stat failed on '%s': %d\n", __func__, localfile, errno);
-		errcode = errno;
-		goto leave;
+static char *mb2_index_parent_path(const char *path)
+{
+	const char *slash = strrchr(path, '/');
+	if (!slash) {
+		return strdup("");
 	}
+	char *result = (char*)malloc(slash - path + 1);
+	memcpy(result, path, slash - path);
+	result[slash - path] = '\0';
+	return result;
+}
 
-	total = fst.st_size;
+/**
+ * Orders paths so that everything below a directory directly follows it.
+ */
+static int mb2_path_compare(const char *a, const char *b)
+{
+	while (*a && *a == *b) {
+		a++;
+		b++;
+	}
+	int ca = (*a == '/') ? 1 : (unsigned char)*a;
+	int cb = (*b == '/') ? 1 : (unsigned char)*b;
+	return ca - cb;
+}
 
-	char *format_size = string_format_size(total);
-	PRINT_VERBOSE(1, "Sending '%s' (%s)\n", path, format_size);
-	free(format_size);
+/**
+ * Returns the position of the first directory in the sorted array that
+ * does not sort before path.
+ */
+static uint32_t mb2_index_sorted_pos(struct mb2_index *index, const char *path)
+{
+	uint32_t lo = 0;
+	uint32_t hi = index->num_sorted;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (mb2_path_compare(index->sorted[mid]->path, path) < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
 
-	if (total == 0) {
-		errcode = 0;
-		goto leave;
+static struct mb2_index_dir *mb2_index_find_dir(struct mb2_index *index, const char *path)
+{
+	struct mb2_index_dir *dir = index->dirs[mb2_index_hash(path) % INDEX_DIR_HASH_SIZE];
+	while (dir && strcmp(dir->path, path) != 0) {
+		dir = dir->hash_next;
 	}
+	return dir;
+}
 
-	f = fopen(localfile, "rb");
-	if (!f) {
-		printf("%s: Error opening local file '%s': %d\n", __func__, localfile, errno);
-		errcode = errno;
-		goto leave;
+static struct mb2_index_entry *mb2_index_find_entry(struct mb2_index *index, const char *path)
+{
+	struct mb2_index_entry *entry = index->entries[mb2_index_hash(path) % INDEX_ENTRY_HASH_SIZE];
+	while (entry && strcmp(entry->path, path) != 0) {
+		entry = entry->hash_next;
 	}
+	return entry;
+}
 
-	sent = 0;
-	do {
-		length = ((total-sent) < (long long)sizeof(buf)) ? (uint32_t)total-sent : (uint32_t)sizeof(buf);
-		/* send data size (file size + 1) */
-		nlen = htobe32(length+1);
-		memcpy(buf, &nlen, sizeof(nlen));
-		buf[4] = CODE_FILE_DATA;
-		err = mobilebackup2_send_raw(mobilebackup2, (const char*)buf, 5, &bytes);
-		if (err != MOBILEBACKUP2_E_SUCCESS) {
-			goto leave_proto_err;
-		}
-		if (bytes != 5) {
-			goto leave_proto_err;
-		}
+static struct mb2_index_dir *mb2_index_add_dir(struct mb2_index *index, const char *path, time_t mtime)
+{
+	uint32_t bucket = mb2_index_hash(path) % INDEX_DIR_HASH_SIZE;
+	struct mb2_index_dir *dir = (struct mb2_index_dir*)malloc(sizeof(struct mb2_index_dir));
+	dir->path = strdup(path);
+	dir->mtime = mtime;
+	dir->entries = NULL;
+	dir->hash_next = index->dirs[bucket];
+	index->dirs[bucket] = dir;
+
+	if (index->num_sorted == index->sorted_size) {
+		index->sorted_size = (index->sorted_size) ? index->sorted_size * 2 : 256;
+		index->sorted = (struct mb2_index_dir**)realloc(index->sorted, sizeof(struct mb2_index_dir*) * index->sorted_size);
+	}
+	uint32_t pos = mb2_index_sorted_pos(index, path);
+	memmove(&index->sorted[pos+1], &index->sorted[pos], sizeof(struct mb2_index_dir*) * (index->num_sorted - pos));
+	index->sorted[pos] = dir;
+	index->num_sorted++;
 
-		/* send file contents */
-		size_t r = fread(buf, 1, sizeof(buf), f);
-		if (r <= 0) {
-			printf("%s: read error\n", __func__);
-			errcode = errno;
-			goto leave;
-		}
-		err = mobilebackup2_send_raw(mobilebackup2, buf, r, &bytes);
-		if (err != MOBILEBACKUP2_E_SUCCESS) {
-			goto leave_proto_err;
-		}
-		if (bytes != (uint32_t)r) {
-			printf("Error: sent only %d of %d bytes\n", bytes, (int)r);
-			goto leave_proto_err;
-		}
-		sent += r;
-	} while (sent < total);
-	fclose(f);
-	f = NULL;
-	errcode = 0;
+	return dir;
+}
 
-leave:
-	if (errcode == 0) {
-		result = 0;
-		nlen = 1;
-		nlen = htobe32(nlen);
-		memcpy(buf, &nlen, 4);
-		buf[4] = CODE_SUCCESS;
-		mobilebackup2_send_raw(mobilebackup2, buf, 5, &bytes);
+static void mb2_index_set_entry(struct mb2_index *index, struct mb2_index_dir *dir, const char *name, enum mb2_file_type type, uint64_t size, time_t mtime)
+{
+	char *path = (*dir->path) ? string_build_path(dir->path, name, NULL) : strdup(name);
+	struct mb2_index_entry *entry = mb2_index_find_entry(index, path);
+	if (entry) {
+		free(path);
 	} else {
-		if (!*errplist) {
-			*errplist = plist_new_dict();
-		}
-		char *errdesc = strerror(errcode);
-		mb2_multi_status_add_file_error(*errplist, path, errno_to_device_error(errcode), errdesc);
-
-		length = strlen(errdesc);
-		nlen = htobe32(length+1);
-		memcpy(buf, &nlen, 4);
-		buf[4] = CODE_ERROR_LOCAL;
-		slen = 5;
-		memcpy(buf+slen, errdesc, length);
-		slen += length;
-		err = mobilebackup2_send_raw(mobilebackup2, (const char*)buf, slen, &bytes);
-		if (err != MOBILEBACKUP2_E_SUCCESS) {
-			printf("could not send message\n");
-		}
-		if (bytes != slen) {
-			printf("could only send %d from %d\n", bytes, slen);
+		uint32_t bucket = mb2_index_hash(path) % INDEX_ENTRY_HASH_SIZE;
+		entry = (struct mb2_index_entry*)malloc(sizeof(struct mb2_index_entry));
+		entry->path = path;
+		entry->name = path + strlen(path) - strlen(name);
+		entry->dir = dir;
+		entry->hash_next = index->entries[bucket];
+		index->entries[bucket] = entry;
+		entry->prev = NULL;
+		entry->next = dir->entries;
+		if (dir->entries) {
+			dir->entries->prev = entry;
 		}
+		dir->entries = entry;
 	}
-
-leave_proto_err:
-	if (f)
-		fclose(f);
-	free(localfile);
-	return result;
+	entry->type = type;
+	entry->size = size;
+	entry->mtime = mtime;
 }
 
-static void mb2_handle_send_files(mobilebackup2_client_t mobilebackup2, plist_t message, const char *backup_dir)
+static void mb2_index_free_entry(struct mb2_index *index, struct mb2_index_entry *entry)
 {
-	uint32_t cnt;
-	uint32_t i = 0;
-	uint32_t sent;
-	plist_t errplist = NULL;
+	struct mb2_index_entry **pp = &index->entries[mb2_index_hash(entry->path) % INDEX_ENTRY_HASH_SIZE];
+	while (*pp && *pp != entry) {
+		pp = &(*pp)->hash_next;
+	}
+	if (*pp) {
+		*pp = entry->hash_next;
+	}
+	if (entry->prev) {
+		entry->prev->next = entry->next;
+	} else {
+		entry->dir->entries = entry->next;
+	}
+	if (entry->next) {
+		entry->next->prev = entry->prev;
+	}
+	free(entry->path);
+	free(entry);
+}
 
-	if (!message || (plist_get_node_type(message) != PLIST_ARRAY) || (plist_array_get_size(message) < 2) || !backup_dir) return;
+static void mb2_index_drop_dir(struct mb2_index *index, struct mb2_index_dir *dir)
+{
+	struct mb2_index_dir **pp = &index->dirs[mb2_index_hash(dir->path) % INDEX_DIR_HASH_SIZE];
+	while (*pp && *pp != dir) {
+		pp = &(*pp)->hash_next;
+	}
+	if (*pp) {
+		*pp = dir->hash_next;
+	}
+	uint32_t pos = mb2_index_sorted_pos(index, dir->path);
+	if (pos < index->num_sorted && index->sorted[pos] == dir) {
+		index->num_sorted--;
+		memmove(&index->sorted[pos], &index->sorted[pos+1], sizeof(struct mb2_index_dir*) * (index->num_sorted - pos));
+	}
+	while (dir->entries) {
+		mb2_index_free_entry(index, dir->entries);
+	}
+	free(dir->path);
+	free(dir);
+	index->dirty = 1;
+}
 
-	plist_t files = plist_array_get_item(message, 1);
-	cnt = plist_array_get_size(files);
+/**
+ * Drops the directory at path and all directories below it from the index.
+ */
+static void mb2_index_drop_tree(struct mb2_index *index, const char *path)
+{
+	size_t len = strlen(path);
 
-	for (i = 0; i < cnt; i++) {
-		plist_t val = plist_array_get_item(files, i);
-		if (plist_get_node_type(val) != PLIST_STRING) {
-			continue;
+	if (len == 0) {
+		while (index->num_sorted > 0) {
+			mb2_index_drop_dir(index, index->sorted[index->num_sorted-1]);
 		}
-		char *str = NULL;
-		plist_get_string_val(val, &str);
-		if (!str)
-			continue;
+		return;
+	}
 
-		if (mb2_handle_send_file(mobilebackup2, backup_dir, str, &errplist) < 0) {
-			free(str);
-			//printf("Error when sending file '%s' to device\n", str);
-			// TODO: perhaps we can continue, we've got a multi status response?!
+	/* the directory itself comes first, then everything below it */
+	uint32_t pos = mb2_index_sorted_pos(index, path);
+	while (pos < index->num_sorted) {
+		struct mb2_index_dir *dir = index->sorted[pos];
+		if (strncmp(dir->path, path, len) != 0 || (dir->path[len] != '\0' && dir->path[len] != '/')) {
 			break;
 		}
-		free(str);
+		mb2_index_drop_dir(index, dir);
 	}
+}
 
-	/* send terminating 0 dword */
-	uint32_t zero = 0;
-	mobilebackup2_send_raw(mobilebackup2, (char*)&zero, 4, &sent);
+static struct mb2_index *mb2_index_new(const char *backup_dir, const char *filename)
+{
+	struct mb2_index *index = (struct mb2_index*)malloc(sizeof(struct mb2_index));
+	index->backup_dir = strdup(backup_dir);
+	index->filename = strdup(filename);
+	index->dirs = (struct mb2_index_dir**)calloc(INDEX_DIR_HASH_SIZE, sizeof(struct mb2_index_dir*));
+	index->entries = (struct mb2_index_entry**)calloc(INDEX_ENTRY_HASH_SIZE, sizeof(struct mb2_index_entry*));
+	index->sorted = NULL;
+	index->num_sorted = 0;
+	index->sorted_size = 0;
+	index->dirty = 0;
+	return index;
+}
 
-	if (!errplist) {
-		plist_t emptydict = plist_new_dict();
-		mobilebackup2_send_status_response(mobilebackup2, 0, NULL, emptydict);
-		plist_free(emptydict);
-	} else {
-		mobilebackup2_send_status_response(mobilebackup2, -13, "Multi status", errplist);
-		plist_free(errplist);
-	}
+static void mb2_index_free(struct mb2_index *index)
+{
+	if (!index)
+		return;
+	mb2_index_drop_tree(index, "");
+	free(index->dirs);
+	free(index->entries);
+	free(index->sorted);
+	free(index->backup_dir);
+	free(index->filename);
+	free(index);
 }
 
-static int mb2_receive_filename(mobilebackup2_client_t mobilebackup2, char** filename)
+static void mb2_index_load(struct mb2_index *index)
 {
-	uint32_t nlen = 0;
-	uint32_t rlen = 0;
+	plist_t plist = NULL;
+	plist_t node;
+	uint64_t version = 0;
+	uint32_t num_dirs = 0;
+	uint32_t valid_dirs = 0;
+
+	if (!plist_read_from_filename(&plist, index->filename) || plist_get_node_type(plist) != PLIST_DICT) {
+		plist_free(plist);
+		return;
+	}
 
-	do {
-		nlen = 0;
-		rlen = 0;
-		mobilebackup2_receive_raw(mobilebackup2, (char*)&nlen, 4, &rlen);
-		nlen = be32toh(nlen);
+	node = plist_dict_get_item(plist, "Version");
+	if (plist_get_node_type(node) == PLIST_UINT) {
+		plist_get_uint_val(node, &version);
+	}
+	plist_t dirs = plist_dict_get_item(plist, "Directories");
+	if (version != INDEX_VERSION || plist_get_node_type(dirs) != PLIST_DICT) {
+		plist_free(plist);
+		return;
+	}
 
-		if ((nlen == 0) && (rlen == 4)) {
-			// a zero length means no more files to receive
-			return 0;
-		} else if(rlen == 0) {
-			// device needs more time, waiting...
-			continue;
-		} else if (nlen > 4096) {
-			// filename length is too large
-			printf("ERROR: %s: too large filename length (%d)!\n", __func__, nlen);
-			return 0;
-		}
+	struct path_builder fpath;
+	path_builder_init(&fpath, index->backup_dir);
+	size_t base_len = fpath.len;
+
+	plist_dict_iter iter = NULL;
+	plist_dict_new_iter(dirs, &iter);
+	if (iter) {
+		char *key = NULL;
+		plist_t val = NULL;
+		do {
+			key = NULL;
+			val = NULL;
+			plist_dict_next_item(dirs, iter, &key, &val);
+			if (!key) {
+				break;
+			}
+			num_dirs++;
+			uint64_t mtime = 0;
+			node = plist_dict_get_item(val, "ModificationTime");
+			if (plist_get_node_type(node) == PLIST_UINT) {
+				plist_get_uint_val(node, &mtime);
+			}
+			plist_t entries = plist_dict_get_item(val, "Entries");
+			path_builder_truncate(&fpath, base_len);
+			const char *dpath = path_builder_join(&fpath, key);
+			struct stat st;
+			if (mtime != 0 && plist_get_node_type(entries) == PLIST_DICT && dpath && stat(dpath, &st) == 0 && S_ISDIR(st.st_mode) && (uint64_t)st.st_mtime == mtime && !mb2_index_find_dir(index, key)) {
+				struct mb2_index_dir *dir = mb2_index_add_dir(index, key, st.st_mtime);
+				plist_dict_iter eiter = NULL;
+				plist_dict_new_iter(entries, &eiter);
+				if (eiter) {
+					char *name = NULL;
+					plist_t info = NULL;
+					do {
+						name = NULL;
+						info = NULL;
+						plist_dict_next_item(entries, eiter, &name, &info);
+						if (!name) {
+							break;
+						}
+						if (plist_get_node_type(info) == PLIST_ARRAY && plist_array_get_size(info) == 3) {
+							uint64_t type = 0, size = 0, emtime = 0;
+							plist_get_uint_val(plist_array_get_item(info, 0), &type);
+							plist_get_uint_val(plist_array_get_item(info, 1), &size);
+							plist_get_uint_val(plist_array_get_item(info, 2), &emtime);
+							mb2_index_set_entry(index, dir, name, (enum mb2_file_type)type, size, (time_t)emtime);
+						}
+						free(name);
+					} while (info);
+					free(eiter);
+				}
+				valid_dirs++;
+			}
+			free(key);
+		} while (val);
+		free(iter);
+	}
+	path_builder_free(&fpath);
+	plist_free(plist);
 
-		if (*filename != NULL) {
-			free(*filename);
-			*filename = NULL;
+	PRINT_VERBOSE(2, "Loaded index with %d of %d directories up to date\n", valid_dirs, num_dirs);
+}
+
+/**
+ * Returns the modification time of an entry. Files that were just received
+ * are recorded before the writer closed them, so their modification time is
+ * taken from disk when it is needed first.
+ */
+static time_t mb2_index_entry_mtime(struct mb2_index *index, struct mb2_index_entry *entry)
+{
+	if (entry->mtime == 0) {
+		struct path_builder fpath;
+		struct stat st;
+		path_builder_init(&fpath, index->backup_dir);
+		const char *path = path_builder_join(&fpath, entry->path);
+		if (path && stat(path, &st) == 0) {
+			entry->mtime = st.st_mtime;
 		}
+		path_builder_free(&fpath);
+	}
+	return entry->mtime;
+}
 
-		*filename = (char*)malloc(nlen+1);
+static void mb2_index_save(struct mb2_index *index)
+{
+	time_t now = time(NULL);
+	uint32_t i;
 
-		rlen = 0;
-		mobilebackup2_receive_raw(mobilebackup2, *filename, nlen, &rlen);
-		if (rlen != nlen) {
-			printf("ERROR: %s: could not read filename\n", __func__);
-			return 0;
-		}
+	if (!index || !index->dirty)
+		return;
 
-		char* p = *filename;
-		p[rlen] = 0;
+	struct path_builder fpath;
+	path_builder_init(&fpath, index->backup_dir);
+	size_t base_len = fpath.len;
 
-		break;
-	} while(1 && !quit_flag);
+	plist_t dirs = plist_new_dict();
+	for (i = 0; i < INDEX_DIR_HASH_SIZE; i++) {
+		struct mb2_index_dir *dir;
+		for (dir = index->dirs[i]; dir; dir = dir->hash_next) {
+			if (dir->mtime == 0) {
+				struct stat st;
+				path_builder_truncate(&fpath, base_len);
+				const char *dpath = path_builder_join(&fpath, dir->path);
+				if (dpath && stat(dpath, &st) == 0) {
+					dir->mtime = st.st_mtime;
+				}
+			}
+			/* changes within the same second would not be noticed, read it again next time */
+			if (dir->mtime == 0 || dir->mtime >= now - 1) {
+				continue;
+			}
+			plist_t entries = plist_new_dict();
+			struct mb2_index_entry *entry;
+			for (entry = dir->entries; entry; entry = entry->next) {
+				plist_t info = plist_new_array();
+				plist_array_append_item(info, plist_new_uint(entry->type));
+				plist_array_append_item(info, plist_new_uint(entry->size));
+				plist_array_append_item(info, plist_new_uint(mb2_index_entry_mtime(index, entry)));
+				plist_dict_set_item(entries, entry->name, info);
+			}
+			plist_t dict = plist_new_dict();
+			plist_dict_set_item(dict, "ModificationTime", plist_new_uint(dir->mtime));
+			plist_dict_set_item(dict, "Entries", entries);
+			plist_dict_set_item(dirs, dir->path, dict);
+		}
+	}
+	path_builder_free(&fpath);
 
-	return nlen;
+	plist_t plist = plist_new_dict();
+	plist_dict_set_item(plist, "Version", plist_new_uint(INDEX_VERSION));
+	plist_dict_set_item(plist, "Directories", dirs);
+	if (!plist_write_to_filename(plist, index->filename, PLIST_FORMAT_BINARY)) {
+		PRINT_VERBOSE(1, "WARNING: Could not write backup index to %s\n", index->filename);
+	}
+	plist_free(plist);
+	index->dirty = 0;
 }
 
-static int mb2_handle_receive_files(mobilebackup2_client_t mobilebackup2, plist_t message, const char *backup_dir)
+/**
+ * Returns the contents of the given directory, reading it from disk if it
+ * is not in the index yet, or NULL if it can't be read.
+ */
+static struct mb2_index_dir *mb2_index_get_dir(struct mb2_index *index, const char *relpath)
 {
-	uint64_t backup_real_size = 0;
-	uint64_t backup_total_size = 0;
-	uint32_t blocksize;
-	uint32_t bdone;
+	char *path = mb2_index_normalize_path(relpath);
+	struct mb2_index_dir *dir = mb2_index_find_dir(index, path);
+	if (dir) {
+		free(path);
+		return dir;
+	}
+
+	struct path_builder dpath;
+	path_builder_init(&dpath, index->backup_dir);
+	const char *dirpath = path_builder_join(&dpath, path);
+	size_t dir_len = dpath.len;
+	struct stat st;
+	DIR* cur_dir = NULL;
+	/* take the modification time before reading, so concurrent changes are noticed next time */
+	if (dirpath && stat(dirpath, &st) == 0 && S_ISDIR(st.st_mode)) {
+		cur_dir = opendir(dirpath);
+	}
+	if (cur_dir) {
+		struct dirent* ep;
+		dir = mb2_index_add_dir(index, path, st.st_mtime);
+		while ((ep = readdir(cur_dir))) {
+			if ((strcmp(ep->d_name, ".") == 0) || (strcmp(ep->d_name, "..") == 0)) {
+				continue;
+			}
+			path_builder_truncate(&dpath, dir_len);
+			const char *fpath = path_builder_join(&dpath, ep->d_name);
+			if (fpath) {
+				struct stat fst;
+				enum mb2_file_type ftype = MB2_FILE_TYPE_UNKNOWN;
+				memset(&fst, '\0', sizeof(fst));
+				stat(fpath, &fst);
+				if (S_ISDIR(fst.st_mode)) {
+					ftype = MB2_FILE_TYPE_DIRECTORY;
+				} else if (S_ISREG(fst.st_mode)) {
+					ftype = MB2_FILE_TYPE_REGULAR;
+				}
+				mb2_index_set_entry(index, dir, ep->d_name, ftype, fst.st_size, fst.st_mtime);
+			}
+		}
+		closedir(cur_dir);
+		index->dirty = 1;
+	}
+	path_builder_free(&dpath);
+	free(path);
+
+	return dir;
+}
+
+/**
+ * Looks up the given path, returns its type or MB2_FILE_TYPE_UNKNOWN if it
+ * does not exist.
+ */
+static enum mb2_file_type mb2_index_get_type(struct mb2_index *index, const char *relpath)
+{
+	enum mb2_file_type type = MB2_FILE_TYPE_UNKNOWN;
+	char *path = mb2_index_normalize_path(relpath);
+	char *parent = mb2_index_parent_path(path);
+
+	if (mb2_index_get_dir(index, parent)) {
+		struct mb2_index_entry *entry = mb2_index_find_entry(index, path);
+		if (entry) {
+			type = entry->type;
+		}
+	}
+	free(parent);
+	free(path);
+
+	return type;
+}
+
+/**
+ * Records that a file or directory has been created or updated.
+ */
+static void mb2_index_update(struct mb2_index *index, const char *relpath, enum mb2_file_type type, uint64_t size, time_t mtime)
+{
+	char *path = mb2_index_normalize_path(relpath);
+	char *parent = mb2_index_parent_path(path);
+	struct mb2_index_dir *dir = mb2_index_find_dir(index, parent);
+
+	/* directories that have not been read yet will be read when needed */
+	if (dir) {
+		const char *name = strrchr(path, '/');
+		mb2_index_set_entry(index, dir, (name) ? name+1 : path, type, size, mtime);
+		dir->mtime = 0;
+		index->dirty = 1;
+	}
+	free(parent);
+	free(path);
+}
+
+/**
+ * Records that a file or directory (including its contents) has been removed.
+ */
+static void mb2_index_remove(struct mb2_index *index, const char *relpath)
+{
+	char *path = mb2_index_normalize_path(relpath);
+	struct mb2_index_entry *entry = mb2_index_find_entry(index, path);
+
+	int is_file = (entry && entry->type == MB2_FILE_TYPE_REGULAR);
+
+	if (entry) {
+		entry->dir->mtime = 0;
+		mb2_index_free_entry(index, entry);
+		index->dirty = 1;
+	}
+	if (!is_file || mb2_index_find_dir(index, path)) {
+		/* nothing can be below a file, only scan the directories otherwise */
+		mb2_index_drop_tree(index, path);
+	}
+	free(path);
+}
+
+/**
+ * Drops everything at and below the given path as well as its parent
+ * directory, so they are read from disk again when needed.
+ */
+static void mb2_index_invalidate(struct mb2_index *index, const char *relpath)
+{
+	char *path = mb2_index_normalize_path(relpath);
+	char *parent = mb2_index_parent_path(path);
+	struct mb2_index_dir *dir = mb2_index_find_dir(index, parent);
+
+	if (dir) {
+		mb2_index_drop_dir(index, dir);
+	}
+	mb2_index_drop_tree(index, path);
+	free(parent);
+	free(path);
+}
+
+/**
+ * Records that a file or directory has been renamed.
+ */
+static void mb2_index_rename(struct mb2_index *index, const char *oldpath, const char *newpath)
+{
+	char *path = mb2_index_normalize_path(oldpath);
+	struct mb2_index_entry *entry = mb2_index_find_entry(index, path);
+
+	mb2_index_remove(index, newpath);
+	if (entry && entry->type == MB2_FILE_TYPE_REGULAR) {
+		uint64_t size = entry->size;
+		time_t mtime = entry->mtime;
+		mb2_index_remove(index, path);
+		mb2_index_update(index, newpath, MB2_FILE_TYPE_REGULAR, size, mtime);
+	} else {
+		mb2_index_remove(index, path);
+		mb2_index_invalidate(index, newpath);
+	}
+	free(path);
+}
+
+/**
+ * Reads the header of a file stored with --compress. Returns 1 and the
+ * original size if it is one, otherwise 0 with the file rewound.
+ */
+static int mb2_compressed_read_header(FILE *f, uint64_t *size)
+{
+	char header[COMPRESS_HEADER_SIZE];
+
+	if (fread(header, 1, sizeof(header), f) == sizeof(header) && memcmp(header, COMPRESS_MAGIC, COMPRESS_MAGIC_SIZE) == 0) {
+		uint64_t be_size;
+		memcpy(&be_size, header + COMPRESS_MAGIC_SIZE, sizeof(be_size));
+		*size = be64toh(be_size);
+		return 1;
+	}
+	fseek(f, 0, SEEK_SET);
+
+	return 0;
+}
+
+/**
+ * Gets the size of the contents of a file, which for compressed files is
+ * the original size.
+ */
+static int mb2_file_get_size(const char *path, uint64_t *size)
+{
+	struct stat st;
+
+	if (stat(path, &st) < 0) {
+		return -1;
+	}
+	*size = st.st_size;
+	if (st.st_size >= COMPRESS_HEADER_SIZE) {
+		FILE *f = fopen(path, "rb");
+		if (f) {
+			mb2_compressed_read_header(f, size);
+			fclose(f);
+		}
+	}
+
+	return 0;
+}
+
+struct mb2_zreader {
+	FILE *f;
+	char *raw;
+	uint32_t raw_size;
+	uint32_t raw_length;
+	uint32_t raw_pos;
+	char *zbuf;
+	uint32_t zbuf_size;
+};
+
+static int mb2_zreader_next_frame(struct mb2_zreader *zr)
+{
+	uint32_t hdr[2];
+
+	if (fread(hdr, 1, sizeof(hdr), zr->f) != sizeof(hdr)) {
+		return -1;
+	}
+	uint32_t length = be32toh(hdr[0]);
+	uint32_t stored = be32toh(hdr[1]);
+	if (length == 0 || length > COMPRESS_FRAME_MAX || stored > length) {
+		return -1;
+	}
+	if (length > zr->raw_size) {
+		free(zr->raw);
+		zr->raw = (char*)malloc(length);
+		zr->raw_size = (zr->raw) ? length : 0;
+		if (!zr->raw) {
+			return -1;
+		}
+	}
+	zr->raw_pos = 0;
+	zr->raw_length = 0;
+	if (stored == length) {
+		/* the frame did not compress and was stored as is */
+		if (fread(zr->raw, 1, length, zr->f) != length) {
+			return -1;
+		}
+	} else {
+#ifdef HAVE_ZLIB
+		if (stored > zr->zbuf_size) {
+			free(zr->zbuf);
+			zr->zbuf = (char*)malloc(stored);
+			zr->zbuf_size = (zr->zbuf) ? stored : 0;
+			if (!zr->zbuf) {
+				return -1;
+			}
+		}
+		uLongf dlen = length;
+		if (fread(zr->zbuf, 1, stored, zr->f) != stored
+		    || uncompress((Bytef*)zr->raw, &dlen, (const Bytef*)zr->zbuf, stored) != Z_OK
+		    || dlen != length) {
+			return -1;
+		}
+#else
+		/* built without zlib, compressed frames can't be decoded */
+		return -1;
+#endif
+	}
+	zr->raw_length = length;
+
+	return 0;
+}
+
+static size_t mb2_zreader_read(struct mb2_zreader *zr, char *buf, size_t length)
+{
+	size_t done = 0;
+
+	while (done < length) {
+		if (zr->raw_pos == zr->raw_length && mb2_zreader_next_frame(zr) < 0) {
+			errno = EIO;
+			break;
+		}
+		size_t n = zr->raw_length - zr->raw_pos;
+		if (n > length - done) {
+			n = length - done;
+		}
+		memcpy(buf + done, zr->raw + zr->raw_pos, n);
+		zr->raw_pos += n;
+		done += n;
+	}
+
+	return done;
+}
+
+enum mb2_send_state {
+	SEND_QUEUED,
+	SEND_READING,
+	SEND_READY
+};
+
+/**
+ * A file requested by the device, opened and with its first chunk read
+ * ahead of time.
+ */
+struct mb2_send_item {
+	char *path;
+	enum mb2_send_state state;
+	int error;
+	FILE *f;
+	struct mb2_zreader zr;
+	uint64_t total;
+	char *data;
+	uint32_t length;
+};
+
+/**
+ * Read-ahead for restores: a few threads open the next READ_AHEAD_FILES
+ * files of the list and read their first chunk, with up to
+ * READ_AHEAD_BYTES buffered, so the seeks of cold storage overlap with
+ * sending the current file instead of leaving the link idle. The rest of
+ * larger files is read sequentially while sending.
+ */
+struct mb2_readahead {
+	struct mb2_engine *engine;
+	mutex_t mutex;
+	cond_t ready;
+	cond_t wanted;
+	struct mb2_send_item *items;
+	uint32_t count;
+	/* next file to open, and the file being sent */
+	uint32_t next;
+	uint32_t current;
+	uint64_t buffered;
+	int stop;
+	THREAD_T threads[FS_THREADS];
+	int num_threads;
+};
+
+static void mb2_send_item_open(struct mb2_engine *engine, struct mb2_send_item *item)
+{
+	struct path_builder lpath;
+	path_builder_init(&lpath, engine->backup_dir);
+	const char *localfile = path_builder_join(&lpath, item->path);
+	if (!localfile) {
+		item->error = ENOMEM;
+		goto leave;
+	}
+#ifdef WIN32
+	struct _stati64 fst;
+	if (_stati64(localfile, &fst) < 0)
+#else
+	struct stat fst;
+	if (stat(localfile, &fst) < 0)
+#endif
+	{
+		if (errno != ENOENT)
+			printf("%s: stat failed on '%s': %d\n", __func__, localfile, errno);
+		item->error = errno;
+		goto leave;
+	}
+
+	item->total = fst.st_size;
+	if (item->total == 0) {
+		goto leave;
+	}
+
+	item->f = fopen(localfile, "rb");
+	if (!item->f) {
+		printf("%s: Error opening local file '%s': %d\n", __func__, localfile, errno);
+		item->error = errno;
+		goto leave;
+	}
+	if (item->total >= COMPRESS_HEADER_SIZE) {
+		uint64_t size = 0;
+		if (mb2_compressed_read_header(item->f, &size)) {
+			item->zr.f = item->f;
+			item->total = size;
+		}
+	}
+	/* we read in large chunks anyway, so skip stdio buffering */
+	if (!item->zr.f)
+		setvbuf(item->f, NULL, _IONBF, 0);
+
+	if (item->total == 0) {
+		goto leave;
+	}
+
+	uint32_t length = (item->total < send_chunk_size) ? (uint32_t)item->total : send_chunk_size;
+	item->data = (char*)malloc(length);
+	if (!item->data) {
+		item->error = ENOMEM;
+		goto leave;
+	}
+	size_t r = (item->zr.f) ? mb2_zreader_read(&item->zr, item->data, length) : fread(item->data, 1, length, item->f);
+	if (r < length) {
+		printf("%s: read error\n", __func__);
+		item->error = (errno) ? errno : EIO;
+		goto leave;
+	}
+	item->length = length;
+	mb2_engine_throttle(engine, length);
+
+leave:
+	path_builder_free(&lpath);
+}
+
+static void mb2_send_item_free(struct mb2_send_item *item)
+{
+	if (item->f) {
+		fclose(item->f);
+		item->f = NULL;
+	}
+	free(item->zr.raw);
+	free(item->zr.zbuf);
+	free(item->data);
+	free(item->path);
+	memset(item, '\0', sizeof(struct mb2_send_item));
+}
+
+static void* mb2_readahead_thread(void *arg)
+{
+	struct mb2_readahead *ra = (struct mb2_readahead*)arg;
+
+	mutex_lock(&ra->mutex);
+	while (!ra->stop && ra->next < ra->count) {
+		/* the file being sent is always read, so it can't get stuck here */
+		if (ra->next >= ra->current + READ_AHEAD_FILES || (ra->buffered >= READ_AHEAD_BYTES && ra->next > ra->current)) {
+			cond_wait(&ra->wanted, &ra->mutex);
+			continue;
+		}
+		struct mb2_send_item *item = &ra->items[ra->next++];
+		item->state = SEND_READING;
+		/* another thread may take the next one */
+		cond_signal(&ra->wanted);
+		mutex_unlock(&ra->mutex);
+
+		mb2_send_item_open(ra->engine, item);
+
+		mutex_lock(&ra->mutex);
+		item->state = SEND_READY;
+		ra->buffered += item->length;
+		cond_signal(&ra->ready);
+	}
+	/* pass the wakeup on to the next one */
+	cond_signal(&ra->wanted);
+	mutex_unlock(&ra->mutex);
+
+	return NULL;
+}
+
+static void mb2_readahead_start(struct mb2_readahead *ra, struct mb2_engine *engine, plist_t files)
+{
+	uint32_t cnt = plist_array_get_size(files);
+	uint32_t i;
+
+	memset(ra, '\0', sizeof(struct mb2_readahead));
+	ra->engine = engine;
+	ra->items = (struct mb2_send_item*)calloc((cnt > 0) ? cnt : 1, sizeof(struct mb2_send_item));
+	for (i = 0; i < cnt; i++) {
+		plist_t val = plist_array_get_item(files, i);
+		if (plist_get_node_type(val) != PLIST_STRING) {
+			continue;
+		}
+		char *str = NULL;
+		plist_get_string_val(val, &str);
+		if (!str)
+			continue;
+		ra->items[ra->count++].path = str;
+	}
+	mutex_init(&ra->mutex);
+	cond_init(&ra->ready);
+	cond_init(&ra->wanted);
+
+	/* without threads, files are opened on demand */
+	while (ra->num_threads < FS_THREADS && ra->num_threads < (int)ra->count) {
+		if (thread_new(&ra->threads[ra->num_threads], mb2_readahead_thread, ra) != 0) {
+			break;
+		}
+		ra->num_threads++;
+	}
+}
+
+/**
+ * Waits until the file at index is ready to be sent.
+ */
+static struct mb2_send_item *mb2_readahead_get(struct mb2_readahead *ra, uint32_t index)
+{
+	struct mb2_send_item *item = &ra->items[index];
+	int open = 0;
+
+	uint64_t t = mb2_metrics_clock();
+	mutex_lock(&ra->mutex);
+	ra->current = index;
+	cond_signal(&ra->wanted);
+	if (item->state == SEND_QUEUED) {
+		/* files are taken in order, so nobody got to this one yet */
+		item->state = SEND_READING;
+		ra->next = index + 1;
+		open = 1;
+	}
+	while (!open && item->state != SEND_READY) {
+		cond_wait(&ra->ready, &ra->mutex);
+	}
+	mutex_unlock(&ra->mutex);
+
+	if (open) {
+		mb2_send_item_open(ra->engine, item);
+		mutex_lock(&ra->mutex);
+		item->state = SEND_READY;
+		ra->buffered += item->length;
+		mutex_unlock(&ra->mutex);
+	}
+	mb2_metrics_wait(ra->engine, 1, t);
+
+	return item;
+}
+
+static void mb2_readahead_release(struct mb2_readahead *ra, struct mb2_send_item *item)
+{
+	mutex_lock(&ra->mutex);
+	ra->buffered -= item->length;
+	cond_signal(&ra->wanted);
+	mutex_unlock(&ra->mutex);
+	mb2_send_item_free(item);
+}
+
+static void mb2_readahead_free(struct mb2_readahead *ra)
+{
+	uint32_t i;
+
+	mutex_lock(&ra->mutex);
+	ra->stop = 1;
+	cond_signal(&ra->wanted);
+	mutex_unlock(&ra->mutex);
+	while (ra->num_threads > 0) {
+		ra->num_threads--;
+		thread_join(ra->threads[ra->num_threads]);
+		thread_free(ra->threads[ra->num_threads]);
+	}
+	for (i = 0; i < ra->count; i++) {
+		mb2_send_item_free(&ra->items[i]);
+	}
+	free(ra->items);
+	cond_destroy(&ra->ready);
+	cond_destroy(&ra->wanted);
+	mutex_destroy(&ra->mutex);
+}
+
+static int mb2_handle_send_file(struct mb2_engine *engine, struct mb2_send_item *item, plist_t *errplist)
+{
+	const char *path = item->path;
+	uint32_t nlen = 0;
+	uint32_t pathlen = strlen(path);
+	uint32_t bytes = 0;
+	char buf[32768];
+	char hdr[5];
+	char *data = NULL;
+	idevice_iovec_t iov[2];
+	uint32_t slen = 0;
+	int errcode = -1;
+	int result = -1;
+	uint32_t length;
+	uint64_t total;
+	uint64_t sent;
+
+	mobilebackup2_error_t err;
+
+	/* send path length and path */
+	nlen = htobe32(pathlen);
+	iov[0].data = (char*)&nlen;
+	iov[0].len = sizeof(nlen);
+	iov[1].data = (char*)path;
+	iov[1].len = pathlen;
+	err = mb2_send_rawv(engine, iov, 2, &bytes);
+	if (err != MOBILEBACKUP2_E_SUCCESS) {
+		goto leave_proto_err;
+	}
+	if (bytes != (uint32_t)sizeof(nlen) + pathlen) {
+		err = MOBILEBACKUP2_E_MUX_ERROR;
+		goto leave_proto_err;
+	}
+
+	if (item->error) {
+		errcode = item->error;
+		goto leave;
+	}
+
+	total = item->total;
+	mb2_trace_file(engine, path, total);
+
+	char *format_size = string_format_size(total);
+	PRINT_VERBOSE(1, "Sending '%s' (%s)\n", path, format_size);
+	free(format_size);
+
+	if (total == 0) {
+		errcode = 0;
+		goto leave;
+	}
+
+	sent = 0;
+	do {
+		const char *chunk;
+		size_t r;
+
+		if (sent == 0) {
+			/* read ahead already */
+			chunk = item->data;
+			r = item->length;
+		} else {
+			length = ((total-sent) < send_chunk_size) ? (uint32_t)(total-sent) : send_chunk_size;
+			if (!data) {
+				data = (char*)malloc(send_chunk_size);
+				if (!data) {
+					errcode = ENOMEM;
+					goto leave;
+				}
+			}
+
+			/* read file contents */
+			uint64_t t = mb2_metrics_clock();
+			r = (item->zr.f) ? mb2_zreader_read(&item->zr, data, length) : fread(data, 1, length, item->f);
+			mb2_metrics_wait(engine, 1, t);
+			if (r <= 0) {
+				printf("%s: read error\n", __func__);
+				errcode = errno;
+				goto leave;
+			}
+			mb2_engine_throttle(engine, (uint32_t)r);
+			chunk = data;
+		}
+
+		/* send data size (chunk size + 1) and code with the file contents */
+		nlen = htobe32((uint32_t)r+1);
+		memcpy(hdr, &nlen, sizeof(nlen));
+		hdr[4] = CODE_FILE_DATA;
+		iov[0].data = hdr;
+		iov[0].len = sizeof(hdr);
+		iov[1].data = (char*)chunk;
+		iov[1].len = (uint32_t)r;
+		uint64_t t = mb2_metrics_clock();
+		err = mb2_send_rawv(engine, iov, 2, &bytes);
+		mb2_metrics_wait(engine, 0, t);
+		if (err != MOBILEBACKUP2_E_SUCCESS) {
+			goto leave_proto_err;
+		}
+		mb2_metrics_transfer(engine, 1, r);
+		if (bytes != sizeof(hdr) + (uint32_t)r) {
+			printf("Error: sent only %d of %d bytes\n", bytes, (int)(sizeof(hdr) + r));
+			goto leave_proto_err;
+		}
+		sent += r;
+	} while (sent < total);
+	errcode = 0;
+	mb2_metrics_file(engine, total);
+
+leave:
+	if (errcode == 0) {
+		result = 0;
+		nlen = 1;
+		nlen = htobe32(nlen);
+		memcpy(buf, &nlen, 4);
+		buf[4] = CODE_SUCCESS;
+		mb2_send_raw(engine, buf, 5, &bytes);
+	} else {
+		if (!*errplist) {
+			*errplist = plist_new_dict();
+		}
+		char *errdesc = strerror(errcode);
+		mb2_multi_status_add_file_error(*errplist, path, errno_to_device_error(errcode), errdesc);
+
+		length = strlen(errdesc);
+		nlen = htobe32(length+1);
+		memcpy(buf, &nlen, 4);
+		buf[4] = CODE_ERROR_LOCAL;
+		slen = 5;
+		memcpy(buf+slen, errdesc, length);
+		slen += length;
+		err = mb2_send_raw(engine, (const char*)buf, slen, &bytes);
+		if (err != MOBILEBACKUP2_E_SUCCESS) {
+			printf("could not send message\n");
+		}
+		if (bytes != slen) {
+			printf("could only send %d from %d\n", bytes, slen);
+		}
+	}
+
+leave_proto_err:
+	free(data);
+	return result;
+}
+
+static void mb2_handle_send_files(struct mb2_engine *engine, plist_t message)
+{
+	uint32_t i = 0;
+	uint32_t sent;
+	plist_t errplist = NULL;
+	struct mb2_readahead ra;
+
+	if (!message || (plist_get_node_type(message) != PLIST_ARRAY) || (plist_array_get_size(message) < 2)) return;
+
+	mb2_metrics_phase(engine, PHASE_SENDING);
+
+	plist_t files = plist_array_get_item(message, 1);
+	mb2_readahead_start(&ra, engine, files);
+
+	for (i = 0; i < ra.count; i++) {
+		struct mb2_send_item *item = mb2_readahead_get(&ra, i);
+		int res = mb2_handle_send_file(engine, item, &errplist);
+		mb2_readahead_release(&ra, item);
+		if (res < 0) {
+			//printf("Error when sending file '%s' to device\n", str);
+			// TODO: perhaps we can continue, we've got a multi status response?!
+			break;
+		}
+	}
+	mb2_readahead_free(&ra);
+
+	/* send terminating 0 dword */
+	uint32_t zero = 0;
+	mb2_send_raw(engine, (char*)&zero, 4, &sent);
+
+	mb2_metrics_phase(engine, PHASE_WAITING);
+
+	if (!errplist) {
+		plist_t emptydict = plist_new_dict();
+		mb2_send_status_response(engine, 0, NULL, emptydict);
+		plist_free(emptydict);
+	} else {
+		mb2_send_status_response(engine, -13, "Multi status", errplist);
+		plist_free(errplist);
+	}
+}
+
+static int mb2_receive_filename(struct mb2_engine *engine, char** filename)
+{
+	uint32_t nlen = 0;
+	uint32_t rlen = 0;
+
+	do {
+		nlen = 0;
+		rlen = 0;
+		mb2_receive_raw(engine, (char*)&nlen, 4, &rlen, 0);
+		nlen = be32toh(nlen);
+
+		if ((nlen == 0) && (rlen == 4)) {
+			// a zero length means no more files to receive
+			return 0;
+		} else if(rlen == 0) {
+			// device needs more time, waiting...
+			continue;
+		} else if (nlen > 4096) {
+			// filename length is too large
+			printf("ERROR: %s: too large filename length (%d)!\n", __func__, nlen);
+			return 0;
+		}
+
+		if (*filename != NULL) {
+			free(*filename);
+			*filename = NULL;
+		}
+
+		*filename = (char*)malloc(nlen+1);
+
+		rlen = 0;
+		mb2_receive_raw(engine, *filename, nlen, &rlen, 0);
+		if (rlen != nlen) {
+			printf("ERROR: %s: could not read filename\n", __func__);
+			return 0;
+		}
+
+		char* p = *filename;
+		p[rlen] = 0;
+
+		break;
+	} while(!mb2_engine_cancelled(engine));
+
+	return nlen;
+}
+
+enum mb2_write_op {
+	WRITE_OP_OPEN,
+	WRITE_OP_DATA,
+	WRITE_OP_CLOSE
+};
+
+enum mb2_compress_state {
+	COMPRESS_NONE,
+	COMPRESS_PENDING,
+	COMPRESS_BUSY,
+	COMPRESS_DONE
+};
+
+struct mb2_write_item {
+	enum mb2_write_op op;
+	char *path;
+	char *data;
+	uint32_t length;
+	/* compressed frame, NULL if stored as is */
+	enum mb2_compress_state zstate;
+	char *zdata;
+	uint32_t zlength;
+	struct mb2_write_item *next;
+};
+
+/**
+ * Metadata files are read by this tool and others, so they are always
+ * stored as is.
+ */
+static int mb2_compress_path_allowed(const char *path)
+{
+	static const char *skip[] = { "Info.plist", "Manifest.plist", "Status.plist", "Manifest.db", "Manifest.mbdb", NULL };
+	const char *name = strrchr(path, '/');
+	int i;
+
+	name = (name) ? name + 1 : path;
+	for (i = 0; skip[i]; i++) {
+		if (!strcmp(name, skip[i])) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/**
+ * Checks the start of a file for formats that are compressed already,
+ * like photos, videos and archives. Backup files are named by hash, so
+ * there is no extension to go by.
+ */
+static int mb2_compress_data_allowed(const unsigned char *data, uint32_t length)
+{
+	if (length < 8) {
+		return 1;
+	}
+	if ((data[0] == 0xFF && data[1] == 0xD8 && data[2] == 0xFF) /* JPEG */
+	    || !memcmp(data, "\x89PNG", 4)
+	    || !memcmp(data, "GIF8", 4)
+	    || !memcmp(data + 4, "ftyp", 4) /* MOV, MP4, M4A, HEIC */
+	    || !memcmp(data, "ID3", 3)
+	    || !memcmp(data, "PK\x03\x04", 4)
+	    || (data[0] == 0x1F && data[1] == 0x8B) /* gzip */
+	    || !memcmp(data, "BZh", 3)
+	    || !memcmp(data, "\xFD" "7zXZ", 5)
+	    || !memcmp(data, "\x28\xB5\x2F\xFD", 4) /* zstd */) {
+		return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * Compresses a data block into its own zlib frame. Blocks that don't get
+ * smaller are stored as is.
+ */
+static void mb2_compress_item(struct mb2_write_item *item)
+{
+#ifdef HAVE_ZLIB
+	uLongf zlength = compressBound(item->length);
+
+	item->zdata = (char*)malloc(zlength);
+	if (item->zdata && compress2((Bytef*)item->zdata, &zlength, (const Bytef*)item->data, item->length, Z_DEFAULT_COMPRESSION) == Z_OK && zlength < item->length) {
+		item->zlength = (uint32_t)zlength;
+	} else {
+		free(item->zdata);
+		item->zdata = NULL;
+	}
+#else
+	/* --compress is not accepted without zlib */
+	item->zdata = NULL;
+#endif
+}
+
+static void mb2_write_item_free(struct mb2_write_item *item)
+{
+	free(item->path);
+	free(item->data);
+	free(item->zdata);
+	free(item);
+}
+
+static int mb2_fdatasync(int fd)
+{
+#if defined(WIN32)
+	return _commit(fd);
+#elif defined(HAVE_FDATASYNC)
+	return fdatasync(fd);
+#else
+	return fsync(fd);
+#endif
+}
+
+/**
+ * Remembers a file and its directory entry, to be made durable at the
+ * next checkpoint in batch durability mode.
+ */
+static void mb2_engine_sync_later(struct mb2_engine *engine, const char *path)
+{
+	if (durability != DURABILITY_BATCH)
+		return;
+
+	engine->sync_pending = 1;
+#ifndef HAVE_SYNCFS
+	engine->sync_paths = (char**)realloc(engine->sync_paths, sizeof(char*) * (engine->num_sync_paths + 2));
+	engine->sync_paths[engine->num_sync_paths++] = strdup(path);
+	engine->sync_paths[engine->num_sync_paths++] = mb2_index_parent_path(path);
+#endif
+}
+
+#ifndef HAVE_SYNCFS
+static int mb2_string_ptr_compare(const void *a, const void *b)
+{
+	return strcmp(*(const char**)a, *(const char**)b);
+}
+#endif
+
+/**
+ * Group commit: makes everything written since the last checkpoint durable
+ * in one pass, before the device is told that it has been stored. Uses a
+ * single syncfs() where available.
+ */
+static void mb2_engine_checkpoint(struct mb2_engine *engine)
+{
+	if (!engine->sync_pending)
+		return;
+	engine->sync_pending = 0;
+
+#ifdef HAVE_SYNCFS
+	int fd = open(engine->backup_dir, O_RDONLY);
+	if (fd >= 0) {
+		if (syncfs(fd) < 0) {
+			printf("WARNING: Could not sync backup directory: %s\n", strerror(errno));
+		}
+		close(fd);
+	}
+#else
+	unsigned int i;
+	qsort(engine->sync_paths, engine->num_sync_paths, sizeof(char*), mb2_string_ptr_compare);
+	for (i = 0; i < engine->num_sync_paths; i++) {
+		const char *path = engine->sync_paths[i];
+		if (*path && (i == 0 || strcmp(path, engine->sync_paths[i-1]) != 0)) {
+#ifdef WIN32
+			/* directories can't be opened for syncing here */
+			int fd = open(path, O_RDWR);
+#else
+			int fd = open(path, O_RDONLY);
+#endif
+			if (fd >= 0) {
+				mb2_fdatasync(fd);
+				close(fd);
+			}
+		}
+	}
+	for (i = 0; i < engine->num_sync_paths; i++) {
+		free(engine->sync_paths[i]);
+	}
+	free(engine->sync_paths);
+	engine->sync_paths = NULL;
+	engine->num_sync_paths = 0;
+#endif
+}
+
+/**
+ * Writes received files to disk, either on its own thread with a queue
+ * limited to write_queue_size bytes, or synchronously if that is 0.
+ * With a dedup store, file contents are hashed while they are written and
+ * files already in the store are linked to it instead. Files up to
+ * DEDUP_BUFFER_SIZE are held back until their hash is known, so known
+ * contents aren't written at all.
+ * With --compress, data blocks are compressed by a pool of threads while
+ * they wait in the queue, and written in order as independent frames.
+ */
+struct mb2_writer {
+	struct mb2_engine *engine;
+	THREAD_T thread;
+	mutex_t mutex;
+	cond_t not_empty;
+	cond_t not_full;
+	struct mb2_write_item *head;
+	struct mb2_write_item *tail;
+	uint64_t queued_bytes;
+	int finish;
+	FILE *f;
+	unsigned int file_count;
+	int error;
+	char *error_path;
+	/* file currently being written */
+	char *path;
+	uint64_t size;
+	int zfile;
+	int zheader;
+	/* compression */
+	THREAD_T compressors[COMPRESS_THREADS];
+	int num_compressors;
+	cond_t compress_wanted;
+	cond_t compressed;
+	struct mb2_write_item *zhead;
+	int push_compress;
+	int push_first;
+	/* deduplication */
+	int holding;
+	struct mb2_write_item *held_head;
+	struct mb2_write_item *held_tail;
+	uint32_t buffered;
+#ifdef HAVE_OPENSSL
+	SHA256_CTX sha256;
+#else
+	gcry_md_hd_t hd;
+#endif
+	unsigned int dedup_files;
+	uint64_t dedup_bytes;
+	int dedup_warned;
+};
+
+static void mb2_writer_set_error(struct mb2_writer *writer, int error, const char *path)
+{
+	mutex_lock(&writer->mutex);
+	if (!writer->error) {
+		writer->error = error;
+		writer->error_path = strdup(path);
+	}
+	mutex_unlock(&writer->mutex);
+}
+
+static void mb2_writer_open(struct mb2_writer *writer)
+{
+	writer->f = fopen(writer->path, "wb");
+	if (!writer->f) {
+		mb2_writer_set_error(writer, errno, writer->path);
+	}
+}
+
+static void mb2_writer_fclose(struct mb2_writer *writer)
+{
+	if (writer->zheader) {
+		uint64_t be_size = htobe64(writer->size);
+		fseek(writer->f, COMPRESS_MAGIC_SIZE, SEEK_SET);
+		fwrite(&be_size, 1, sizeof(be_size), writer->f);
+	}
+	if (durability == DURABILITY_FILE) {
+		fflush(writer->f);
+		mb2_fdatasync(fileno(writer->f));
+	}
+	fclose(writer->f);
+	writer->f = NULL;
+	writer->file_count++;
+	mb2_engine_sync_later(writer->engine, writer->path);
+}
+
+static void mb2_writer_write(struct mb2_writer *writer, struct mb2_write_item *item)
+{
+	if (!writer->f) {
+		return;
+	}
+	if (!writer->zfile) {
+		fwrite(item->data, 1, item->length, writer->f);
+		mb2_engine_throttle(writer->engine, item->length);
+		return;
+	}
+	if (!writer->zheader) {
+		/* the original size is filled in when the file is closed */
+		char header[COMPRESS_HEADER_SIZE];
+		memset(header, '\0', sizeof(header));
+		memcpy(header, COMPRESS_MAGIC, COMPRESS_MAGIC_SIZE);
+		fwrite(header, 1, sizeof(header), writer->f);
+		writer->zheader = 1;
+	}
+	uint32_t stored = (item->zdata) ? item->zlength : item->length;
+	uint32_t hdr[2];
+	hdr[0] = htobe32(item->length);
+	hdr[1] = htobe32(stored);
+	fwrite(hdr, 1, sizeof(hdr), writer->f);
+	fwrite((item->zdata) ? item->zdata : item->data, 1, stored, writer->f);
+	mb2_engine_throttle(writer->engine, sizeof(hdr) + stored);
+}
+
+static void mb2_writer_hold(struct mb2_writer *writer, struct mb2_write_item *item)
+{
+	item->next = NULL;
+	if (writer->held_tail) {
+		writer->held_tail->next = item;
+	} else {
+		writer->held_head = item;
+	}
+	writer->held_tail = item;
+	writer->buffered += item->length;
+}
+
+/**
+ * Writes the data held back for deduplication, or only drops it.
+ */
+static void mb2_writer_release(struct mb2_writer *writer, int write)
+{
+	while (writer->held_head) {
+		struct mb2_write_item *item = writer->held_head;
+		writer->held_head = item->next;
+		if (write) {
+			mb2_writer_write(writer, item);
+		}
+		mb2_write_item_free(item);
+	}
+	writer->held_tail = NULL;
+	writer->buffered = 0;
+}
+
+/**
+ * Creates dst as a clone of src that shares its data blocks, where the
+ * filesystem supports it. Returns 0 on success.
+ */
+static int mb2_clone_file(const char *src, const char *dst)
+{
+	int res = -1;
+
+#if defined(HAVE_CLONEFILE)
+	res = clonefile(src, dst, 0);
+#elif defined(__linux__) && defined(FICLONE)
+	int from = open(src, O_RDONLY);
+	if (from >= 0) {
+		int to = open(dst, O_WRONLY | O_CREAT | O_EXCL, 0644);
+		if (to >= 0) {
+			res = ioctl(to, FICLONE, from);
+			close(to);
+			if (res < 0) {
+				remove_file(dst);
+			}
+		}
+		close(from);
+	}
+#endif
+
+	return res;
+}
+
+/**
+ * Links target to the object in the dedup store, as a hardlink or, if
+ * that fails, as a reflink. An existing target is replaced atomically.
+ */
+static int mb2_dedup_link(const char *object, const char *target)
+{
+	char *tmp = string_concat(target, ".dedup", NULL);
+	int res = -1;
+
+	remove_file(tmp);
+#ifdef WIN32
+	if (CreateHardLinkA(tmp, object, NULL)) {
+		res = 0;
+	}
+#else
+	res = link(object, tmp);
+	if (res < 0) {
+		res = mb2_clone_file(object, tmp);
+	}
+#endif
+	if (res == 0) {
+		remove_file(target);
+		if (rename(tmp, target) < 0) {
+			remove_file(tmp);
+			res = -1;
+		}
+	}
+	free(tmp);
+
+	return res;
+}
+
+/**
+ * Adds a file to the dedup store. Another backup adding the same contents
+ * at the same time is fine, the first link wins.
+ */
+static void mb2_dedup_add(struct mb2_writer *writer, const char *object, const char *path)
+{
+	char *objdir = mb2_index_parent_path(object);
+	mkdir_with_parents(objdir, 0755);
+	free(objdir);
+#ifdef WIN32
+	if (CreateHardLinkA(object, path, NULL) || GetLastError() == ERROR_ALREADY_EXISTS) {
+		return;
+	}
+#else
+	if (link(path, object) == 0) {
+		mb2_engine_sync_later(writer->engine, object);
+		return;
+	}
+	if (errno == EEXIST) {
+		return;
+	}
+#endif
+	if (!writer->dedup_warned) {
+		printf("WARNING: Could not add '%s' to the dedup store: %s\n", path, strerror(errno));
+		writer->dedup_warned = 1;
+	}
+}
+
+static char *mb2_dedup_object_path(struct mb2_writer *writer)
+{
+	unsigned char hash[32];
+	char hex[65];
+	int i;
+
+#ifdef HAVE_OPENSSL
+	SHA256_Final(hash, &writer->sha256);
+#else
+	gcry_md_final(writer->hd);
+	memcpy(hash, gcry_md_read(writer->hd, GCRY_MD_SHA256), sizeof(hash));
+#endif
+	for (i = 0; i < 32; i++) {
+		sprintf(hex + i*2, "%02x", hash[i]);
+	}
+	char subdir[3] = { hex[0], hex[1], '\0' };
+
+	return string_build_path(dedup_dir, subdir, hex, NULL);
+}
+
+static void mb2_writer_close(struct mb2_writer *writer)
+{
+	uint64_t size = 0;
+
+	if (writer->holding && writer->size == 0) {
+		/* empty files are not worth a link */
+		writer->holding = 0;
+		mb2_writer_open(writer);
+	}
+	if (!writer->holding) {
+		if (writer->f) {
+			mb2_writer_fclose(writer);
+			if (dedup_dir && writer->size > 0) {
+				/* too large to hold back, it has been written anyway */
+				char *object = mb2_dedup_object_path(writer);
+				if (mb2_file_get_size(object, &size) == 0 && size == writer->size) {
+					if (mb2_dedup_link(object, writer->path) == 0) {
+						writer->dedup_files++;
+					}
+				} else {
+					mb2_dedup_add(writer, object, writer->path);
+				}
+				free(object);
+			}
+		}
+		return;
+	}
+
+	writer->holding = 0;
+	char *object = mb2_dedup_object_path(writer);
+	int known = (mb2_file_get_size(object, &size) == 0 && size == writer->size);
+	if (known && mb2_dedup_link(object, writer->path) == 0) {
+		writer->dedup_files++;
+		writer->dedup_bytes += writer->size;
+		writer->file_count++;
+		mb2_engine_sync_later(writer->engine, writer->path);
+		mb2_writer_release(writer, 0);
+	} else {
+		mb2_writer_open(writer);
+		mb2_writer_release(writer, 1);
+		if (writer->f) {
+			mb2_writer_fclose(writer);
+			if (!known) {
+				mb2_dedup_add(writer, object, writer->path);
+			}
+		}
+	}
+	free(object);
+}
+
+static void mb2_writer_process(struct mb2_writer *writer, struct mb2_write_item *item)
+{
+	switch (item->op) {
+	case WRITE_OP_OPEN:
+		if (writer->f) {
+			fclose(writer->f);
+			writer->f = NULL;
+		}
+		free(writer->path);
+		writer->path = item->path;
+		item->path = NULL;
+		writer->size = 0;
+		writer->zfile = 0;
+		writer->zheader = 0;
+		remove_file(writer->path);
+		if (dedup_dir) {
+#ifdef HAVE_OPENSSL
+			SHA256_Init(&writer->sha256);
+#else
+			gcry_md_reset(writer->hd);
+#endif
+			writer->holding = 1;
+		} else {
+			mb2_writer_open(writer);
+		}
+		break;
+	case WRITE_OP_DATA:
+		if (writer->size == 0) {
+			/* the first block decides how the whole file is stored */
+			writer->zfile = (item->zstate != COMPRESS_NONE);
+		}
+		if (dedup_dir) {
+#ifdef HAVE_OPENSSL
+			SHA256_Update(&writer->sha256, item->data, item->length);
+#else
+			gcry_md_write(writer->hd, item->data, item->length);
+#endif
+			if (writer->holding) {
+				if (writer->buffered + (uint64_t)item->length <= DEDUP_BUFFER_SIZE) {
+					mb2_writer_hold(writer, item);
+					writer->size += item->length;
+					return;
+				}
+				/* the file outgrew the buffer, write what was held back */
+				writer->holding = 0;
+				mb2_writer_open(writer);
+				mb2_writer_release(writer, 1);
+			}
+		}
+		mb2_writer_write(writer, item);
+		writer->size += item->length;
+		break;
+	case WRITE_OP_CLOSE:
+		mb2_writer_close(writer);
+		break;
+	default:
+		break;
+	}
+	mb2_write_item_free(item);
+}
+
+static void* mb2_writer_thread(void *arg)
+{
+	struct mb2_writer *writer = (struct mb2_writer*)arg;
+
+	mutex_lock(&writer->mutex);
+	while (1) {
+		while (!writer->head && !writer->finish) {
+			cond_wait(&writer->not_empty, &writer->mutex);
+		}
+		struct mb2_write_item *item = writer->head;
+		if (!item) {
+			break;
+		}
+		if (item->zstate == COMPRESS_BUSY) {
+			/* still being compressed by the pool */
+			cond_wait(&writer->compressed, &writer->mutex);
+			continue;
+		}
+		/* nobody got to this one yet, better do it right away */
+		int compress = (item->zstate == COMPRESS_PENDING);
+		if (compress) {
+			item->zstate = COMPRESS_BUSY;
+		}
+		writer->head = item->next;
+		if (!writer->head) {
+			writer->tail = NULL;
+		}
+		if (writer->zhead == item) {
+			writer->zhead = item->next;
+		}
+		mutex_unlock(&writer->mutex);
+
+		uint32_t length = item->length;
+		if (compress) {
+			mb2_compress_item(item);
+			item->zstate = COMPRESS_DONE;
+		}
+		mb2_writer_process(writer, item);
+
+		mutex_lock(&writer->mutex);
+		writer->queued_bytes -= length;
+		cond_signal(&writer->not_full);
+	}
+	mutex_unlock(&writer->mutex);
+
+	return NULL;
+}
+
+static void* mb2_compressor_thread(void *arg)
+{
+	struct mb2_writer *writer = (struct mb2_writer*)arg;
+
+	mutex_lock(&writer->mutex);
+	while (1) {
+		while (writer->zhead && writer->zhead->zstate != COMPRESS_PENDING) {
+			writer->zhead = writer->zhead->next;
+		}
+		struct mb2_write_item *item = writer->zhead;
+		if (!item) {
+			if (writer->finish) {
+				/* pass the wakeup on to the next one */
+				cond_signal(&writer->compress_wanted);
+				break;
+			}
+			cond_wait(&writer->compress_wanted, &writer->mutex);
+			continue;
+		}
+		item->zstate = COMPRESS_BUSY;
+		writer->zhead = item->next;
+		if (writer->zhead) {
+			cond_signal(&writer->compress_wanted);
+		}
+		mutex_unlock(&writer->mutex);
+
+		mb2_compress_item(item);
+
+		mutex_lock(&writer->mutex);
+		item->zstate = COMPRESS_DONE;
+		cond_signal(&writer->compressed);
+	}
+	mutex_unlock(&writer->mutex);
+
+	return NULL;
+}
+
+static void mb2_writer_start(struct mb2_writer *writer, struct mb2_engine *engine)
+{
+	memset(writer, '\0', sizeof(struct mb2_writer));
+	writer->engine = engine;
+	if (dedup_dir) {
+#ifndef HAVE_OPENSSL
+		gcry_md_open(&writer->hd, GCRY_MD_SHA256, 0);
+#endif
+	}
+	mutex_init(&writer->mutex);
+	cond_init(&writer->not_empty);
+	cond_init(&writer->not_full);
+	cond_init(&writer->compress_wanted);
+	cond_init(&writer->compressed);
+	writer->thread = THREAD_T_NULL;
+
+	if (write_queue_size > 0) {
+		if (thread_new(&writer->thread, mb2_writer_thread, writer) != 0) {
+			printf("WARNING: Could not start writer thread, writing synchronously\n");
+			writer->thread = THREAD_T_NULL;
+		}
+	}
+	if (writer->thread && compress_files) {
+		/* without these the writer thread compresses on its own */
+		while (writer->num_compressors < COMPRESS_THREADS) {
+			if (thread_new(&writer->compressors[writer->num_compressors], mb2_compressor_thread, writer) != 0) {
+				break;
+			}
+			writer->num_compressors++;
+		}
+	}
+}
+
+/**
+ * Queues an operation for the writer, which takes ownership of path and data.
+ *
+ * @return 0 on success or -1 if out of memory, path and data are freed then.
+ */
+static int mb2_writer_push(struct mb2_writer *writer, enum mb2_write_op op, char *path, char *data, uint32_t length)
+{
+	struct mb2_write_item *item = NULL;
+	if (op != WRITE_OP_OPEN || path) {
+		item = (struct mb2_write_item*)malloc(sizeof(struct mb2_write_item));
+	}
+	if (!item) {
+		free(path);
+		free(data);
+		return -1;
+	}
+	item->op = op;
+	item->path = path;
+	item->data = data;
+	item->length = length;
+	item->zstate = COMPRESS_NONE;
+	item->zdata = NULL;
+	item->zlength = 0;
+	item->next = NULL;
+
+	if (op == WRITE_OP_OPEN) {
+		writer->push_compress = compress_files && mb2_compress_path_allowed(path);
+		writer->push_first = 1;
+	} else if (op == WRITE_OP_DATA) {
+		if (writer->push_first) {
+			writer->push_first = 0;
+			if (writer->push_compress && !mb2_compress_data_allowed((const unsigned char*)data, length)) {
+				writer->push_compress = 0;
+			}
+		}
+		if (writer->push_compress) {
+			item->zstate = COMPRESS_PENDING;
+		}
+	}
+
+	if (!writer->thread) {
+		if (item->zstate == COMPRESS_PENDING) {
+			mb2_compress_item(item);
+			item->zstate = COMPRESS_DONE;
+		}
+		mb2_writer_process(writer, item);
+		return 0;
+	}
+
+	mutex_lock(&writer->mutex);
+	/* a single block larger than the queue still gets through an empty queue */
+	while (writer->queued_bytes > 0 && writer->queued_bytes + length > write_queue_size) {
+		cond_wait(&writer->not_full, &writer->mutex);
+	}
+	if (writer->tail) {
+		writer->tail->next = item;
+	} else {
+		writer->head = item;
+	}
+	writer->tail = item;
+	writer->queued_bytes += length;
+	if (item->zstate == COMPRESS_PENDING) {
+		if (!writer->zhead) {
+			writer->zhead = item;
+		}
+		cond_signal(&writer->compress_wanted);
+	}
+	cond_signal(&writer->not_empty);
+	mutex_unlock(&writer->mutex);
+
+	return 0;
+}
+
+/**
+ * Returns the errno of the first file that could not be opened, or 0.
+ */
+static int mb2_writer_get_error(struct mb2_writer *writer, char **path)
+{
+	int error;
+
+	mutex_lock(&writer->mutex);
+	error = writer->error;
+	if (path) {
+		*path = writer->error_path;
+	}
+	mutex_unlock(&writer->mutex);
+
+	return error;
+}
+
+/**
+ * Waits until all queued data has been written and returns the number of
+ * files written.
+ */
+static unsigned int mb2_writer_finish(struct mb2_writer *writer)
+{
+	if (writer->thread) {
+		mutex_lock(&writer->mutex);
+		writer->finish = 1;
+		cond_signal(&writer->not_empty);
+		cond_signal(&writer->compress_wanted);
+		mutex_unlock(&writer->mutex);
+		thread_join(writer->thread);
+		thread_free(writer->thread);
+		writer->thread = THREAD_T_NULL;
+	}
+	while (writer->num_compressors > 0) {
+		writer->num_compressors--;
+		thread_join(writer->compressors[writer->num_compressors]);
+		thread_free(writer->compressors[writer->num_compressors]);
+	}
+	if (writer->f) {
+		fclose(writer->f);
+		writer->f = NULL;
+	}
+
+	return writer->file_count;
+}
+
+static void mb2_writer_free(struct mb2_writer *writer)
+{
+	free(writer->error_path);
+	free(writer->path);
+	mb2_writer_release(writer, 0);
+#ifndef HAVE_OPENSSL
+	if (writer->hd) {
+		gcry_md_close(writer->hd);
+	}
+#endif
+	cond_destroy(&writer->not_empty);
+	cond_destroy(&writer->not_full);
+	cond_destroy(&writer->compress_wanted);
+	cond_destroy(&writer->compressed);
+	mutex_destroy(&writer->mutex);
+}
+
+static int mb2_handle_receive_files(struct mb2_engine *engine, plist_t message)
+{
+	uint64_t backup_real_size = 0;
+	uint64_t backup_total_size = 0;
+	uint32_t blocksize;
+	uint32_t bdone;
+	uint64_t fsize = 0;
 	uint32_t rlen;
 	uint32_t nlen = 0;
 	uint32_t r;
-	char buf[32768];
 	char *fname = NULL;
 	char *dname = NULL;
-	char *bname = NULL;
+	const char *bname = NULL;
+	struct path_builder bpath;
 	char code = 0;
 	char last_code = 0;
 	plist_t node = NULL;
-	FILE *f = NULL;
 	unsigned int file_count = 0;
 	int errcode = 0;
 	char *errdesc = NULL;
+	char *errpath = NULL;
+	int oom = 0;
+	struct mb2_writer writer;
+
+	if (!message || (plist_get_node_type(message) != PLIST_ARRAY) || plist_array_get_size(message) < 4) return 0;
+
+	path_builder_init(&bpath, engine->backup_dir);
+	size_t base_len = bpath.len;
+
+	mb2_writer_start(&writer, engine);
+	mb2_metrics_phase(engine, PHASE_RECEIVING);
+
+	node = plist_array_get_item(message, 3);
+	if (plist_get_node_type(node) == PLIST_UINT) {
+		plist_get_uint_val(node, &backup_total_size);
+	}
+	if (backup_total_size > 0) {
+		PRINT_VERBOSE(1, "Receiving files\n");
+	}
+
+	do {
+		if (mb2_engine_cancelled(engine))
+			break;
+
+		nlen = mb2_receive_filename(engine, &dname);
+		if (nlen == 0) {
+			break;
+		}
+
+		nlen = mb2_receive_filename(engine, &fname);
+		if (!nlen) {
+			break;
+		}
+
+		path_builder_truncate(&bpath, base_len);
+		bname = path_builder_join(&bpath, fname);
+		if (!bname) {
+			break;
+		}
+		fsize = 0;
+
+		r = 0;
+		nlen = 0;
+		mb2_receive_raw(engine, (char*)&nlen, 4, &r, 0);
+		if (r != 4) {
+			printf("ERROR: %s: could not receive code length!\n", __func__);
+			break;
+		}
+		nlen = be32toh(nlen);
+
+		last_code = code;
+		code = 0;
+
+		mb2_receive_raw(engine, &code, 1, &r, 0);
+		if (r != 1) {
+			printf("ERROR: %s: could not receive code!\n", __func__);
+			break;
+		}
+
+		/* TODO remove this */
+		if ((code != CODE_SUCCESS) && (code != CODE_FILE_DATA) && (code != CODE_ERROR_REMOTE)) {
+			PRINT_VERBOSE(1, "Found new flag %02x\n", code);
+		}
+
+		if (mb2_writer_push(&writer, WRITE_OP_OPEN, strdup(bname), NULL, 0) < 0) {
+			mb2_writer_set_error(&writer, ENOMEM, bname);
+		}
+		errcode = mb2_writer_get_error(&writer, &errpath);
+		if (errcode) {
+			/* this or a previous file could not be opened */
+			errdesc = strerror(errcode);
+			printf("Error opening '%s' for writing: %s\n", errpath, errdesc);
+			errcode = errno_to_device_error(errcode);
+			break;
+		}
+		while (code == CODE_FILE_DATA) {
+			blocksize = nlen-1;
+			bdone = 0;
+			rlen = 0;
+			while (bdone < blocksize) {
+				if ((blocksize - bdone) < WRITE_BLOCK_SIZE) {
+					rlen = blocksize - bdone;
+				} else {
+					rlen = WRITE_BLOCK_SIZE;
+				}
+				char *block = (char*)malloc(rlen);
+				if (!block) {
+					mb2_writer_set_error(&writer, ENOMEM, bname);
+					oom = 1;
+					break;
+				}
+				r = 0;
+				uint64_t t = mb2_metrics_clock();
+				mb2_receive_raw(engine, block, rlen, &r, 1);
+				mb2_metrics_wait(engine, 0, t);
+				if ((int)r <= 0) {
+					free(block);
+					break;
+				}
+				mb2_metrics_transfer(engine, 0, r);
+				t = mb2_metrics_clock();
+				if (mb2_writer_push(&writer, WRITE_OP_DATA, NULL, block, r) < 0) {
+					mb2_writer_set_error(&writer, ENOMEM, bname);
+					bdone += r;
+					oom = 1;
+					break;
+				}
+				mb2_metrics_wait(engine, 1, t);
+				bdone += r;
+				fsize += r;
+			}
+			if (oom) {
+				/* the rest of the block is discarded below */
+				nlen = blocksize - bdone + 1;
+				break;
+			}
+			if (bdone == blocksize) {
+				backup_real_size += blocksize;
+			}
+			if (engine->show_progress && backup_total_size > 0) {
+				print_progress(backup_real_size, backup_total_size);
+			}
+			if (mb2_engine_cancelled(engine))
+				break;
+			nlen = 0;
+			mb2_receive_raw(engine, (char*)&nlen, 4, &r, 0);
+			nlen = be32toh(nlen);
+			if (nlen > 0) {
+				last_code = code;
+				mb2_receive_raw(engine, &code, 1, &r, 0);
+			} else {
+				break;
+			}
+		}
+		if (mb2_writer_push(&writer, WRITE_OP_CLOSE, NULL, NULL, 0) < 0) {
+			mb2_writer_set_error(&writer, ENOMEM, bname);
+			oom = 1;
+		}
+		if (oom) {
+			break;
+		}
+		/* the modification time is only known once the writer closed the file */
+		mb2_index_update(engine->index, fname, MB2_FILE_TYPE_REGULAR, fsize, 0);
+		mb2_metrics_file(engine, fsize);
+		if (nlen == 0) {
+			break;
+		}
+
+		/* check if an error message was received */
+		if (code == CODE_ERROR_REMOTE) {
+			/* error message */
+			char *msg = (char*)malloc(nlen);
+			mb2_receive_raw(engine, msg, nlen-1, &r, 0);
+			msg[r] = 0;
+			/* If sent using CODE_FILE_DATA, end marker will be CODE_ERROR_REMOTE which is not an error! */
+			if (last_code != CODE_FILE_DATA) {
+				fprintf(stdout, "\nReceived an error message from device: %s\n", msg);
+			}
+			free(msg);
+		}
+	} while (1);
+
+	uint64_t t = mb2_metrics_clock();
+	file_count = mb2_writer_finish(&writer);
+	mb2_metrics_wait(engine, 1, t);
+	mb2_metrics_phase(engine, PHASE_WAITING);
+	engine->dedup_files += writer.dedup_files;
+	engine->dedup_bytes += writer.dedup_bytes;
+	if (!errcode) {
+		int err = mb2_writer_get_error(&writer, &errpath);
+		if (err) {
+			errdesc = strerror(err);
+			printf("Error opening '%s' for writing: %s\n", errpath, errdesc);
+			errcode = errno_to_device_error(err);
+		}
+	}
+
+	/* if there are leftovers to read, finish up cleanly */
+	if ((int)nlen-1 > 0) {
+		PRINT_VERBOSE(1, "\nDiscarding current data hunk.\n");
+		char *hunk = (char*)malloc(nlen-1);
+		mb2_receive_raw(engine, hunk, nlen-1, &r, 1);
+		free(hunk);
+		if (bname) {
+			remove_file(bname);
+		}
+		if (fname) {
+			mb2_index_remove(engine->index, fname);
+		}
+	}
+
+	if (fname != NULL)
+		free(fname);
+
+	mb2_writer_free(&writer);
+
+	/* clean up */
+	path_builder_free(&bpath);
+
+	if (dname != NULL)
+		free(dname);
+
+	plist_t empty_plist = plist_new_dict();
+	/* the device considers the files stored once it gets the reply */
+	mb2_engine_checkpoint(engine);
+
+	mb2_send_status_response(engine, errcode, errdesc, empty_plist);
+	plist_free(empty_plist);
+
+	return file_count;
+}
+
+static void mb2_handle_list_directory(struct mb2_engine *engine, plist_t message)
+{
+
+	if (!message || (plist_get_node_type(message) != PLIST_ARRAY) || plist_array_get_size(message) < 2) return;
+
+	plist_t node = plist_array_get_item(message, 1);
+	char *str = NULL;
+	if (plist_get_node_type(node) == PLIST_STRING) {
+		plist_get_string_val(node, &str);
+	}
+	if (!str) {
+		printf("ERROR: Malformed DLContentsOfDirectory message\n");
+		// TODO error handling
+		return;
+	}
+
+	plist_t dirlist = plist_new_dict();
+
+	struct mb2_index_dir *dir = mb2_index_get_dir(engine->index, str);
+	free(str);
+	if (dir) {
+		struct mb2_index_entry *entry;
+		for (entry = dir->entries; entry; entry = entry->next) {
+			plist_t fdict = plist_new_dict();
+			const char *ftype = "DLFileTypeUnknown";
+			if (entry->type == MB2_FILE_TYPE_DIRECTORY) {
+				ftype = "DLFileTypeDirectory";
+			} else if (entry->type == MB2_FILE_TYPE_REGULAR) {
+				ftype = "DLFileTypeRegular";
+			}
+			plist_dict_set_item(fdict, "DLFileType", plist_new_string(ftype));
+			plist_dict_set_item(fdict, "DLFileSize", plist_new_uint(entry->size));
+			plist_dict_set_item(fdict, "DLFileModificationDate",
+					    plist_new_date(mb2_index_entry_mtime(engine->index, entry) - MAC_EPOCH, 0));
+
+			plist_dict_set_item(dirlist, entry->name, fdict);
+		}
+	}
+
+	/* TODO error handling */
+	mobilebackup2_error_t err = mb2_send_status_response(engine, 0, NULL, dirlist);
+	plist_free(dirlist);
+	if (err != MOBILEBACKUP2_E_SUCCESS) {
+		printf("Could not send status response, error %d\n", err);
+	}
+}
+
+static void mb2_handle_make_directory(struct mb2_engine *engine, plist_t message)
+{
+
+	if (!message || (plist_get_node_type(message) != PLIST_ARRAY) || plist_array_get_size(message) < 2) return;
+
+	plist_t dir = plist_array_get_item(message, 1);
+	char *str = NULL;
+	int errcode = 0;
+	char *errdesc = NULL;
+	plist_get_string_val(dir, &str);
+
+	struct path_builder newpath;
+	path_builder_init(&newpath, engine->backup_dir);
+
+	if (!str || !path_builder_join(&newpath, str)) {
+		errdesc = strerror(EINVAL);
+		errcode = errno_to_device_error(EINVAL);
+	} else if (mkdir_with_parents(newpath.path, 0755) < 0) {
+		errdesc = strerror(errno);
+		if (errno != EEXIST) {
+			printf("mkdir: %s (%d)\n", errdesc, errno);
+		}
+		errcode = errno_to_device_error(errno);
+	} else {
+		/* parents that did not exist are read again when needed */
+		mb2_index_invalidate(engine->index, str);
+	}
+	path_builder_free(&newpath);
+	free(str);
+	mobilebackup2_error_t err = mb2_send_status_response(engine, errcode, errdesc, NULL);
+	if (err != MOBILEBACKUP2_E_SUCCESS) {
+		printf("Could not send status response, error %d\n", err);
+	}
+}
+
+/**
+ * Runs func on each of count jobs of the given size, on the calling thread
+ * and up to FS_THREADS - 1 more, one more thread per min_jobs jobs. Meant
+ * for filesystem operations which are mostly waiting for the disk.
+ */
+struct mb2_pool {
+	mutex_t mutex;
+	char *jobs;
+	size_t size;
+	int count;
+	int next;
+	void (*func)(void *job);
+};
+
+static void* mb2_pool_worker(void *arg)
+{
+	struct mb2_pool *pool = (struct mb2_pool*)arg;
+
+	while (1) {
+		mutex_lock(&pool->mutex);
+		if (pool->next >= pool->count) {
+			mutex_unlock(&pool->mutex);
+			break;
+		}
+		void *job = pool->jobs + pool->size * pool->next++;
+		mutex_unlock(&pool->mutex);
+
+		pool->func(job);
+	}
+
+	return NULL;
+}
+
+static void mb2_pool_run(void *jobs, size_t size, int count, int min_jobs, void (*func)(void *job))
+{
+	struct mb2_pool pool;
+	THREAD_T workers[FS_THREADS];
+	int num_workers = 0;
+
+	pool.jobs = (char*)jobs;
+	pool.size = size;
+	pool.count = count;
+	pool.next = 0;
+	pool.func = func;
+	mutex_init(&pool.mutex);
+
+	while (num_workers < FS_THREADS - 1 && num_workers < (count - 1) / min_jobs) {
+		if (thread_new(&workers[num_workers], mb2_pool_worker, &pool) != 0) {
+			break;
+		}
+		num_workers++;
+	}
+	mb2_pool_worker(&pool);
+	while (num_workers > 0) {
+		num_workers--;
+		thread_join(workers[num_workers]);
+		thread_free(workers[num_workers]);
+	}
+
+	mutex_destroy(&pool.mutex);
+}
+
+static int mb2_path_ptr_compare(const void *a, const void *b)
+{
+	return mb2_path_compare(*(const char**)a, *(const char**)b);
+}
+
+static void mb2_copy_file_by_path(const char *src, const char *dst)
+{
+	/* the destination might be linked to the dedup store */
+	remove_file(dst);
+
+	if (mb2_clone_file(src, dst) == 0) {
+		return;
+	}
+
+#ifdef WIN32
+	if (!CopyFileA(src, dst, FALSE)) {
+		printf("Cannot copy '%s' to '%s'.\n", src, dst);
+	}
+#else
+	int from, to;
+	ssize_t length = 0;
+
+	/* open source file */
+	if ((from = open(src, O_RDONLY)) < 0) {
+		printf("Cannot open source path '%s'.\n", src);
+		return;
+	}
+
+	/* open destination file */
+	if ((to = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+		printf("Cannot open destination file '%s'.\n", dst);
+		close(from);
+		return;
+	}
+
+#ifdef HAVE_COPY_FILE_RANGE
+	/* let the kernel copy the data, falls back below if it can't on these files */
+	while ((length = copy_file_range(from, NULL, to, NULL, COPY_RANGE_SIZE, 0)) > 0);
+	if (length < 0 && errno != EXDEV && errno != ENOSYS && errno != EINVAL && errno != EOPNOTSUPP) {
+		printf("Error copying '%s': %s\n", src, strerror(errno));
+	} else if (length < 0) {
+		length = 1;
+	}
+#else
+	length = 1;
+#endif
+	if (length > 0) {
+		/* copy the file, continuing where the kernel stopped */
+		char *buf = (char*)malloc(COPY_BUFFER_SIZE);
+		while (buf && (length = read(from, buf, COPY_BUFFER_SIZE)) > 0) {
+			ssize_t done = 0;
+			while (done < length) {
+				ssize_t w = write(to, buf + done, length - done);
+				if (w < 0) {
+					break;
+				}
+				done += w;
+			}
+			if (done < length) {
+				printf("Error writing '%s': %s\n", dst, strerror(errno));
+				break;
+			}
+		}
+		free(buf);
+	}
+
+	if (close(from) < 0) {
+		printf("Error closing source file.\n");
+	}
+
+	if (close(to) < 0) {
+		printf("Error closing destination file.\n");
+	}
+#endif
+}
+
+struct mb2_copy_job {
+	char *src;
+	char *dst;
+};
+
+/**
+ * Files of a directory tree to be copied by a pool of threads. The
+ * directories are created up front while the files are collected.
+ */
+struct mb2_copy_queue {
+	struct mb2_copy_job *jobs;
+	int count;
+};
+
+static void mb2_copy_queue_collect(struct mb2_copy_queue *queue, const char *src, const char *dst)
+{
+	struct stat st;
+
+	/* if dst directory does not exist */
+	if ((stat(dst, &st) < 0) || !S_ISDIR(st.st_mode)) {
+		/* create it */
+		if (mkdir_with_parents(dst, 0755) < 0) {
+			printf("ERROR: Unable to create destination directory '%s': %s (%d)\n", dst, strerror(errno), errno);
+			return;
+		}
+	}
+
+	/* loop over src directory contents */
+	DIR *cur_dir = opendir(src);
+	if (!cur_dir) {
+		return;
+	}
+	struct dirent* ep;
+	while ((ep = readdir(cur_dir))) {
+		if ((strcmp(ep->d_name, ".") == 0) || (strcmp(ep->d_name, "..") == 0)) {
+			continue;
+		}
+		char *srcpath = string_build_path(src, ep->d_name, NULL);
+		char *dstpath = string_build_path(dst, ep->d_name, NULL);
+		if (stat(srcpath, &st) == 0 && S_ISDIR(st.st_mode)) {
+			mb2_copy_queue_collect(queue, srcpath, dstpath);
+			free(srcpath);
+			free(dstpath);
+			continue;
+		}
+		queue->jobs = (struct mb2_copy_job*)realloc(queue->jobs, sizeof(struct mb2_copy_job) * (queue->count + 1));
+		queue->jobs[queue->count].src = srcpath;
+		queue->jobs[queue->count].dst = dstpath;
+		queue->count++;
+	}
+	closedir(cur_dir);
+}
+
+static void mb2_copy_job_run(void *arg)
+{
+	struct mb2_copy_job *job = (struct mb2_copy_job*)arg;
+
+	/* copy file */
+	mb2_copy_file_by_path(job->src, job->dst);
+}
+
+static void mb2_copy_directory_by_path(const char *src, const char *dst)
+{
+	if (!src || !dst) {
+		return;
+	}
 
-	if (!message || (plist_get_node_type(message) != PLIST_ARRAY) || plist_array_get_size(message) < 4 || !backup_dir) return 0;
+	struct stat st;
 
-	node = plist_array_get_item(message, 3);
-	if (plist_get_node_type(node) == PLIST_UINT) {
-		plist_get_uint_val(node, &backup_total_size);
+	/* if src does not exist */
+	if ((stat(src, &st) < 0) || !S_ISDIR(st.st_mode)) {
+		printf("ERROR: Source directory does not exist '%s': %s (%d)\n", src, strerror(errno), errno);
+		return;
 	}
-	if (backup_total_size > 0) {
-		PRINT_VERBOSE(1, "Receiving files\n");
+
+	struct mb2_copy_queue queue;
+	memset(&queue, '\0', sizeof(queue));
+	mb2_copy_queue_collect(&queue, src, dst);
+
+	mb2_pool_run(queue.jobs, sizeof(struct mb2_copy_job), queue.count, 1, mb2_copy_job_run);
+
+	int i;
+	for (i = 0; i < queue.count; i++) {
+		free(queue.jobs[i].src);
+		free(queue.jobs[i].dst);
 	}
+	free(queue.jobs);
+}
 
-	do {
-		if (quit_flag)
-			break;
+struct mb2_move_job {
+	char *oldrel;
+	char *newrel;
+	char *oldpath;
+	char *newpath;
+	int target_is_dir;
+	int result;
+};
 
-		nlen = mb2_receive_filename(mobilebackup2, &dname);
-		if (nlen == 0) {
-			break;
+static void mb2_move_job_run(void *arg)
+{
+	struct mb2_move_job *job = (struct mb2_move_job*)arg;
+
+	if (job->target_is_dir)
+		rmdir_recursive(job->newpath);
+	else
+		remove_file(job->newpath);
+	job->result = (rename(job->oldpath, job->newpath) < 0) ? errno : 0;
+}
+
+static void mb2_handle_move_items(struct mb2_engine *engine, plist_t message)
+{
+	mobilebackup2_error_t err;
+	int errcode = 0;
+	const char *errdesc = NULL;
+	uint32_t num_jobs = 0;
+	uint32_t i;
+
+	plist_t moves = plist_array_get_item(message, 1);
+	uint32_t cnt = plist_dict_get_size(moves);
+	PRINT_VERBOSE(1, "Moving %d file%s\n", cnt, (cnt == 1) ? "" : "s");
+	struct mb2_move_job *jobs = (struct mb2_move_job*)calloc(cnt + 1, sizeof(struct mb2_move_job));
+	plist_dict_iter iter = NULL;
+	plist_dict_new_iter(moves, &iter);
+	if (iter) {
+		char *key = NULL;
+		plist_t val = NULL;
+		do {
+			plist_dict_next_item(moves, iter, &key, &val);
+			if (key && (plist_get_node_type(val) == PLIST_STRING)) {
+				char *str = NULL;
+				plist_get_string_val(val, &str);
+				if (str && num_jobs < cnt) {
+					jobs[num_jobs].oldrel = key;
+					jobs[num_jobs].newrel = str;
+					num_jobs++;
+					key = NULL;
+				} else {
+					free(str);
+				}
+			}
+			free(key);
+			key = NULL;
+		} while (val);
+		free(iter);
+	} else {
+		errcode = -1;
+		errdesc = "Could not create dict iterator";
+		printf("Could not create dict iterator\n");
+	}
+
+	/* the index is not thread safe, look up everything needed up front */
+	char **parents = (char**)malloc(sizeof(char*) * (num_jobs + 1));
+	char **sources = (char**)malloc(sizeof(char*) * (num_jobs + 1));
+	for (i = 0; i < num_jobs; i++) {
+		struct mb2_move_job *job = &jobs[i];
+		job->oldpath = string_build_path(engine->backup_dir, job->oldrel, NULL);
+		job->newpath = string_build_path(engine->backup_dir, job->newrel, NULL);
+		job->target_is_dir = (mb2_index_get_type(engine->index, job->newrel) == MB2_FILE_TYPE_DIRECTORY);
+		/* make sure the source is indexed so its details can be moved along */
+		mb2_index_get_type(engine->index, job->oldrel);
+		parents[i] = mb2_index_parent_path(job->newrel);
+		sources[i] = job->oldrel;
+	}
+
+	/* create missing parent directories once for the whole batch */
+	qsort(parents, num_jobs, sizeof(char*), mb2_path_ptr_compare);
+	for (i = 0; i < num_jobs; i++) {
+		if (*parents[i] && (i == 0 || strcmp(parents[i], parents[i-1]) != 0)) {
+			if (mb2_index_get_type(engine->index, parents[i]) != MB2_FILE_TYPE_DIRECTORY) {
+				char *dir = string_build_path(engine->backup_dir, parents[i], NULL);
+				mkdir_with_parents(dir, 0755);
+				free(dir);
+				mb2_index_invalidate(engine->index, parents[i]);
+			}
 		}
+	}
 
-		nlen = mb2_receive_filename(mobilebackup2, &fname);
-		if (!nlen) {
+	/* renames can only run in any order if no target is also a source */
+	int min_jobs = MOVE_JOBS_PER_THREAD;
+	qsort(sources, num_jobs, sizeof(char*), mb2_path_ptr_compare);
+	for (i = 0; i < num_jobs; i++) {
+		if (bsearch(&jobs[i].newrel, sources, num_jobs, sizeof(char*), mb2_path_ptr_compare)) {
+			min_jobs = INT_MAX;
 			break;
 		}
+	}
+	mb2_pool_run(jobs, sizeof(struct mb2_move_job), num_jobs, min_jobs, mb2_move_job_run);
+
+	for (i = 0; i < num_jobs; i++) {
+		struct mb2_move_job *job = &jobs[i];
+		if (job->result != 0) {
+			printf("Renameing '%s' to '%s' failed: %s (%d)\n", job->oldpath, job->newpath, strerror(job->result), job->result);
+			if (!errcode) {
+				errcode = errno_to_device_error(job->result);
+				errdesc = strerror(job->result);
+			}
+			mb2_index_remove(engine->index, job->newrel);
+		} else {
+			mb2_index_rename(engine->index, job->oldrel, job->newrel);
+			mb2_engine_sync_later(engine, job->newpath);
+		}
+		free(parents[i]);
+		free(job->oldrel);
+		free(job->newrel);
+		free(job->oldpath);
+		free(job->newpath);
+	}
+	free(parents);
+	free(sources);
+	free(jobs);
+	mb2_engine_checkpoint(engine);
+
+	plist_t empty_dict = plist_new_dict();
+	err = mb2_send_status_response(engine, errcode, errdesc, empty_dict);
+	plist_free(empty_dict);
+	if (err != MOBILEBACKUP2_E_SUCCESS) {
+		printf("Could not send status response, error %d\n", err);
+	}
+}
+
+struct mb2_remove_job {
+	char *relpath;
+	char *path;
+	int is_dir;
+	int suppress_warning;
+	int result;
+};
+
+static void mb2_remove_job_run(void *arg)
+{
+	struct mb2_remove_job *job = (struct mb2_remove_job*)arg;
+
+	if (job->is_dir) {
+		job->result = rmdir_recursive(job->path);
+	} else {
+		job->result = remove_file(job->path);
+	}
+}
+
+static int mb2_remove_job_compare(const void *a, const void *b)
+{
+	return mb2_path_compare(((const struct mb2_remove_job*)a)->relpath, ((const struct mb2_remove_job*)b)->relpath);
+}
+
+static void mb2_handle_remove_items(struct mb2_engine *engine, plist_t message)
+{
+	mobilebackup2_error_t err;
+	int errcode = 0;
+	const char *errdesc = NULL;
+	uint32_t num_jobs = 0;
+	uint32_t n = 0;
+
+	plist_t removes = plist_array_get_item(message, 1);
+	uint32_t cnt = plist_array_get_size(removes);
+	PRINT_VERBOSE(1, "Removing %d file%s\n", cnt, (cnt == 1) ? "" : "s");
+	struct mb2_remove_job *jobs = (struct mb2_remove_job*)calloc(cnt + 1, sizeof(struct mb2_remove_job));
+	uint32_t ii = 0;
+	for (ii = 0; ii < cnt; ii++) {
+		plist_t val = plist_array_get_item(removes, ii);
+		if (plist_get_node_type(val) == PLIST_STRING) {
+			char *str = NULL;
+			plist_get_string_val(val, &str);
+			if (str) {
+				const char *checkfile = strchr(str, '/');
+				if (checkfile) {
+					if (strcmp(checkfile+1, "Manifest.mbdx") == 0) {
+						jobs[num_jobs].suppress_warning = 1;
+					}
+				}
+				jobs[num_jobs++].relpath = str;
+			}
+		}
+	}
 
-		if (bname != NULL) {
-			free(bname);
-			bname = NULL;
+	/* entries below a directory that is removed go along with it */
+	qsort(jobs, num_jobs, sizeof(struct mb2_remove_job), mb2_remove_job_compare);
+	const char *dir = NULL;
+	size_t dirlen = 0;
+	for (ii = 0; ii < num_jobs; ii++) {
+		struct mb2_remove_job job = jobs[ii];
+		if ((n > 0 && strcmp(job.relpath, jobs[n-1].relpath) == 0)
+		    || (dir && strncmp(job.relpath, dir, dirlen) == 0 && job.relpath[dirlen] == '/')) {
+			free(job.relpath);
+			continue;
+		}
+		job.path = string_build_path(engine->backup_dir, job.relpath, NULL);
+		job.is_dir = (mb2_index_get_type(engine->index, job.relpath) == MB2_FILE_TYPE_DIRECTORY);
+		if (job.is_dir) {
+			dir = job.relpath;
+			dirlen = strlen(dir);
 		}
+		jobs[n++] = job;
+	}
 
-		bname = string_build_path(backup_dir, fname, NULL);
+	mb2_pool_run(jobs, sizeof(struct mb2_remove_job), n, REMOVE_JOBS_PER_THREAD, mb2_remove_job_run);
 
-		if (fname != NULL) {
-			free(fname);
-			fname = NULL;
+	for (ii = 0; ii < n; ii++) {
+		struct mb2_remove_job *job = &jobs[ii];
+		mb2_index_remove(engine->index, job->relpath);
+		if (job->result != 0 && job->result != ENOENT) {
+			if (!job->suppress_warning)
+				printf("Could not remove '%s': %s (%d)\n", job->path, strerror(job->result), job->result);
+			errcode = errno_to_device_error(job->result);
+			errdesc = strerror(job->result);
 		}
+		free(job->relpath);
+		free(job->path);
+	}
+	free(jobs);
 
-		r = 0;
-		nlen = 0;
-		mobilebackup2_receive_raw(mobilebackup2, (char*)&nlen, 4, &r);
-		if (r != 4) {
-			printf("ERROR: %s: could not receive code length!\n", __func__);
-			break;
+	plist_t empty_dict = plist_new_dict();
+	err = mb2_send_status_response(engine, errcode, errdesc, empty_dict);
+	plist_free(empty_dict);
+	if (err != MOBILEBACKUP2_E_SUCCESS) {
+		printf("Could not send status response, error %d\n", err);
+	}
+}
+
+static void mb2_handle_copy_item(struct mb2_engine *engine, plist_t message)
+{
+	mobilebackup2_error_t err;
+	int errcode = 0;
+	const char *errdesc = NULL;
+
+	plist_t srcpath = plist_array_get_item(message, 1);
+	plist_t dstpath = plist_array_get_item(message, 2);
+	if ((plist_get_node_type(srcpath) == PLIST_STRING) && (plist_get_node_type(dstpath) == PLIST_STRING)) {
+		char *src = NULL;
+		char *dst = NULL;
+		plist_get_string_val(srcpath, &src);
+		plist_get_string_val(dstpath, &dst);
+		struct path_builder oldpath;
+		struct path_builder newpath;
+		path_builder_init(&oldpath, engine->backup_dir);
+		path_builder_init(&newpath, engine->backup_dir);
+		if (src && dst && path_builder_join(&oldpath, src) && path_builder_join(&newpath, dst)) {
+
+			PRINT_VERBOSE(1, "Copying '%s' to '%s'\n", src, dst);
+
+			/* check that src exists */
+			enum mb2_file_type src_type = mb2_index_get_type(engine->index, src);
+			if (src_type == MB2_FILE_TYPE_DIRECTORY) {
+				mb2_copy_directory_by_path(oldpath.path, newpath.path);
+			} else if (src_type == MB2_FILE_TYPE_REGULAR) {
+				mb2_copy_file_by_path(oldpath.path, newpath.path);
+			}
+			mb2_index_invalidate(engine->index, dst);
 		}
-		nlen = be32toh(nlen);
+		path_builder_free(&newpath);
+		path_builder_free(&oldpath);
+		free(src);
+		free(dst);
+	}
+	plist_t empty_dict = plist_new_dict();
+	err = mb2_send_status_response(engine, errcode, errdesc, empty_dict);
+	plist_free(empty_dict);
+	if (err != MOBILEBACKUP2_E_SUCCESS) {
+		printf("Could not send status response, error %d\n", err);
+	}
+}
 
-		last_code = code;
-		code = 0;
+static int mb2_get_free_disk_space(const char *path, uint64_t *freespace)
+{
+	int res = -1;
 
-		mobilebackup2_receive_raw(mobilebackup2, &code, 1, &r);
-		if (r != 1) {
-			printf("ERROR: %s: could not receive code!\n", __func__);
-			break;
+	*freespace = 0;
+#ifdef WIN32
+	if (GetDiskFreeSpaceEx(path, (PULARGE_INTEGER)freespace, NULL, NULL)) {
+		res = 0;
+	}
+#else
+	struct statvfs fs;
+	memset(&fs, '\0', sizeof(fs));
+	res = statvfs(path, &fs);
+	if (res == 0) {
+		*freespace = (uint64_t)fs.f_bavail * (uint64_t)fs.f_bsize;
+	}
+#endif
+	return res;
+}
+
+static void mb2_handle_free_disk_space(struct mb2_engine *engine)
+{
+	uint64_t freespace = 0;
+	int res = mb2_get_free_disk_space(engine->backup_dir, &freespace);
+
+	/* the reserved space is not available to this backup */
+	freespace = (freespace > engine->reserve) ? freespace - engine->reserve : 0;
+
+	plist_t freespace_item = plist_new_uint(freespace);
+	mb2_send_status_response(engine, res, NULL, freespace_item);
+	plist_free(freespace_item);
+}
+
+static void mb2_handle_process_message(struct mb2_engine *engine, plist_t message)
+{
+	plist_t node_tmp = plist_array_get_item(message, 1);
+	if (plist_get_node_type(node_tmp) != PLIST_DICT) {
+		printf("Unknown message received!\n");
+	}
+	plist_t nn;
+	int error_code = -1;
+	nn = plist_dict_get_item(node_tmp, "ErrorCode");
+	if (nn && (plist_get_node_type(nn) == PLIST_UINT)) {
+		uint64_t ec = 0;
+		plist_get_uint_val(nn, &ec);
+		error_code = (uint32_t)ec;
+		if (error_code == 0) {
+			engine->operation_ok = 1;
+			engine->result_code = 0;
+		} else {
+			engine->result_code = -error_code;
+		}
+	}
+	nn = plist_dict_get_item(node_tmp, "ErrorDescription");
+	char *str = NULL;
+	if (nn && (plist_get_node_type(nn) == PLIST_STRING)) {
+		plist_get_string_val(nn, &str);
+	}
+	if (error_code != 0) {
+		if (str) {
+			printf("ErrorCode %d: %s\n", error_code, str);
+		} else {
+			printf("ErrorCode %d: (Unknown)\n", error_code);
 		}
+	}
+	if (str) {
+		free(str);
+	}
+	nn = plist_dict_get_item(node_tmp, "Content");
+	if (nn && (plist_get_node_type(nn) == PLIST_STRING)) {
+		str = NULL;
+		plist_get_string_val(nn, &str);
+		PRINT_VERBOSE(1, "Content:\n");
+		printf("%s", str);
+		free(str);
+	}
+}
 
-		/* TODO remove this */
-		if ((code != CODE_SUCCESS) && (code != CODE_FILE_DATA) && (code != CODE_ERROR_REMOTE)) {
-			PRINT_VERBOSE(1, "Found new flag %02x\n", code);
+/**
+ * Processes the DLMessage* operations sent by the device until it is done,
+ * disconnects, or the operation got cancelled.
+ */
+static void mb2_engine_run(struct mb2_engine *engine)
+{
+	plist_t message = NULL;
+	mobilebackup2_error_t mberr;
+	char *dlmsg = NULL;
+
+	/* directory contents are served from the index while processing */
+	char *index_name = string_concat(".", engine->source_udid, ".mb2index", NULL);
+	char *index_path = string_build_path(engine->backup_dir, index_name, NULL);
+	engine->index = mb2_index_new(engine->backup_dir, index_path);
+	mb2_index_load(engine->index);
+	free(index_path);
+	free(index_name);
+
+	mb2_metrics_start(engine);
+
+	/* process series of DLMessage* operations */
+	do {
+		free(dlmsg);
+		dlmsg = NULL;
+		mberr = mb2_receive_message(engine, &message, &dlmsg);
+		if (mberr == MOBILEBACKUP2_E_RECEIVE_TIMEOUT) {
+			PRINT_VERBOSE(2, "Device is not ready yet, retrying...\n");
+			goto files_out;
+		} else if (mberr != MOBILEBACKUP2_E_SUCCESS) {
+			PRINT_VERBOSE(0, "ERROR: Could not receive from mobilebackup2 (%d)\n", mberr);
+			engine->cancelled = 1;
+			goto files_out;
 		}
 
-		remove_file(bname);
-		f = fopen(bname, "wb");
-		while (f && (code == CODE_FILE_DATA)) {
-			blocksize = nlen-1;
-			bdone = 0;
-			rlen = 0;
-			while (bdone < blocksize) {
-				if ((blocksize - bdone) < sizeof(buf)) {
-					rlen = blocksize - bdone;
-				} else {
-					rlen = sizeof(buf);
-				}
-				mobilebackup2_receive_raw(mobilebackup2, buf, rlen, &r);
-				if ((int)r <= 0) {
-					break;
-				}
-				fwrite(buf, 1, r, f);
-				bdone += r;
-			}
-			if (bdone == blocksize) {
-				backup_real_size += blocksize;
-			}
-			if (backup_total_size > 0) {
-				print_progress(backup_real_size, backup_total_size);
-			}
-			if (quit_flag)
+		enum mb2_dl_message op = mb2_dl_message_from_name(dlmsg);
+		mb2_set_overall_progress_from_message(engine, message, op);
+		if (op == MB2_DL_DISCONNECT) {
+			break;
+		} else if (op == MB2_DL_PROCESS_MESSAGE) {
+			mb2_handle_process_message(engine, message);
+			break;
+		}
+		switch (op) {
+			case MB2_DL_DOWNLOAD_FILES:
+				/* device wants to download files from the computer */
+				mb2_handle_send_files(engine, message);
 				break;
-			nlen = 0;
-			mobilebackup2_receive_raw(mobilebackup2, (char*)&nlen, 4, &r);
-			nlen = be32toh(nlen);
-			if (nlen > 0) {
-				last_code = code;
-				mobilebackup2_receive_raw(mobilebackup2, &code, 1, &r);
-			} else {
+			case MB2_DL_UPLOAD_FILES:
+				/* device wants to send files to the computer */
+				engine->file_count += mb2_handle_receive_files(engine, message);
+				break;
+			case MB2_DL_GET_FREE_DISK_SPACE:
+				/* device wants to know how much disk space is available on the computer */
+				mb2_handle_free_disk_space(engine);
+				break;
+			case MB2_DL_CONTENTS_OF_DIRECTORY:
+				/* list directory contents */
+				mb2_handle_list_directory(engine, message);
+				break;
+			case MB2_DL_CREATE_DIRECTORY:
+				/* make a directory */
+				mb2_handle_make_directory(engine, message);
+				break;
+			case MB2_DL_MOVE_ITEMS:
+				/* perform a series of rename operations */
+				mb2_handle_move_items(engine, message);
+				break;
+			case MB2_DL_REMOVE_ITEMS:
+				mb2_handle_remove_items(engine, message);
+				break;
+			case MB2_DL_COPY_ITEM:
+				mb2_handle_copy_item(engine, message);
 				break;
+			default:
+				break;
+		}
+
+		/* print status */
+		if (engine->show_progress && (engine->overall_progress > 0) && !engine->progress_finished) {
+			if (engine->overall_progress >= 100.0f) {
+				engine->progress_finished = 1;
 			}
+			print_progress_real(engine->overall_progress, 0);
+			PRINT_VERBOSE(1, " Finished\n");
 		}
-		if (f) {
-			fclose(f);
-			file_count++;
-		} else {
-			errcode = errno_to_device_error(errno);
-			errdesc = strerror(errno);
-			printf("Error opening '%s' for writing: %s\n", bname, errdesc);
+
+files_out:
+		plist_free(message);
+		message = NULL;
+		free(dlmsg);
+		dlmsg = NULL;
+
+		if (mb2_engine_cancelled(engine)) {
+			/* need to cancel the backup here */
+			//mobilebackup_send_error(mobilebackup, "Cancelling DLSendFile");
+
+			/* remove any atomic Manifest.plist.tmp */
+
+			/*manifest_path = mobilebackup_build_path(backup_directory, "Manifest", ".plist.tmp");
+			if (stat(manifest_path, &st) == 0)
+				remove(manifest_path);*/
 			break;
 		}
-		if (nlen == 0) {
+	} while (1);
+
+	plist_free(message);
+	free(dlmsg);
+
+	mb2_engine_checkpoint(engine);
+	mb2_index_save(engine->index);
+	mb2_index_free(engine->index);
+	engine->index = NULL;
+
+	mb2_metrics_stop(engine);
+}
+
+/**
+ * Takes the sync lock on the device so no other host syncs while the
+ * backup or restore is running. Succeeds without a lock if the lock file
+ * can't be opened; returns -1 if it could not be locked.
+ */
+static int mb2_sync_lock(idevice_t device, afc_client_t afc, uint64_t *lockfile)
+{
+	int i;
+
+	*lockfile = 0;
+	do_post_notification(device, NP_SYNC_WILL_START);
+	afc_file_open(afc, "/com.apple.itunes.lock_sync", AFC_FOPEN_RW, lockfile);
+	if (!*lockfile) {
+		return 0;
+	}
+
+	afc_error_t aerr;
+	do_post_notification(device, NP_SYNC_LOCK_REQUEST);
+	for (i = 0; i < LOCK_ATTEMPTS; i++) {
+		aerr = afc_file_lock(afc, *lockfile, AFC_LOCK_EX);
+		if (aerr == AFC_E_SUCCESS) {
+			do_post_notification(device, NP_SYNC_DID_START);
+			return 0;
+		} else if (aerr == AFC_E_OP_WOULD_BLOCK) {
+			usleep(LOCK_WAIT);
+			continue;
+		} else {
+			fprintf(stderr, "ERROR: could not lock file! error code: %d\n", aerr);
 			break;
 		}
+	}
+	if (i == LOCK_ATTEMPTS) {
+		fprintf(stderr, "ERROR: timeout while locking for sync\n");
+	}
+	afc_file_close(afc, *lockfile);
+	*lockfile = 0;
 
-		/* check if an error message was received */
-		if (code == CODE_ERROR_REMOTE) {
-			/* error message */
-			char *msg = (char*)malloc(nlen);
-			mobilebackup2_receive_raw(mobilebackup2, msg, nlen-1, &r);
-			msg[r] = 0;
-			/* If sent using CODE_FILE_DATA, end marker will be CODE_ERROR_REMOTE which is not an error! */
-			if (last_code != CODE_FILE_DATA) {
-				fprintf(stdout, "\nReceived an error message from device: %s\n", msg);
-			}
-			free(msg);
-		}
-	} while (1);
+	return -1;
+}
 
-	if (fname != NULL)
-		free(fname);
+static void mb2_sync_unlock(idevice_t device, afc_client_t afc, uint64_t lockfile)
+{
+	afc_file_lock(afc, lockfile, AFC_LOCK_UN);
+	afc_file_close(afc, lockfile);
+	do_post_notification(device, NP_SYNC_DID_FINISH);
+}
 
-	/* if there are leftovers to read, finish up cleanly */
-	if ((int)nlen-1 > 0) {
-		PRINT_VERBOSE(1, "\nDiscarding current data hunk.\n");
-		fname = (char*)malloc(nlen-1);
-		mobilebackup2_receive_raw(mobilebackup2, fname, nlen-1, &r);
-		free(fname);
-		remove_file(bname);
+#ifdef WIN32
+#define BS_CC '\b'
+#define my_getch getch
+#else
+#define BS_CC 0x7f
+static int my_getch(void)
+{
+	struct termios oldt, newt;
+	int ch;
+	tcgetattr(STDIN_FILENO, &oldt);
+	newt = oldt;
+	newt.c_lflag &= ~(ICANON | ECHO);
+	tcsetattr(STDIN_FILENO, TCSANOW, &newt);
+	ch = getchar();
+	tcsetattr(STDIN_FILENO, TCSANOW, &oldt);
+	return ch;
+}
+#endif
+
+static void get_hidden_input(char *buf, int maxlen)
+{
+	int pwlen = 0;
+	int c;
+
+	while ((c = my_getch())) {
+		if ((c == '\r') || (c == '\n')) {
+			break;
+		} else if (isprint(c)) {
+			if (pwlen < maxlen-1)
+				buf[pwlen++] = c;
+			fputc('*', stderr);
+		} else if (c == BS_CC) {
+			if (pwlen > 0) {
+				fputs("\b \b", stderr);
+				pwlen--;
+			}
+		}
 	}
+	buf[pwlen] = 0;
+}
 
-	/* clean up */
-	if (bname != NULL)
-		free(bname);
+static char* ask_for_password(const char* msg, int type_again)
+{
+	char pwbuf[256];
 
-	if (dname != NULL)
-		free(dname);
+	fprintf(stderr, "%s: ", msg);
+	fflush(stderr);
+	get_hidden_input(pwbuf, 256);
+	fputc('\n', stderr);
 
-	plist_t empty_plist = plist_new_dict();
-	mobilebackup2_send_status_response(mobilebackup2, errcode, errdesc, empty_plist);
-	plist_free(empty_plist);
+	if (type_again) {
+		char pwrep[256];
 
-	return file_count;
+		fprintf(stderr, "%s (repeat): ", msg);
+		fflush(stderr);
+		get_hidden_input(pwrep, 256);
+		fputc('\n', stderr);
+
+		if (strcmp(pwbuf, pwrep) != 0) {
+			printf("ERROR: passwords don't match\n");
+			return NULL;
+		}
+	}
+	return strdup(pwbuf);
 }
 
-static void mb2_handle_list_directory(mobilebackup2_client_t mobilebackup2, plist_t message, const char *backup_dir)
+/**
+ * signal handler function for cleaning up properly
+ */
+static void clean_exit(int sig)
 {
-	if (!message || (plist_get_node_type(message) != PLIST_ARRAY) || plist_array_get_size(message) < 2 || !backup_dir) return;
+	fprintf(stderr, "Exiting...\n");
+	quit_flag++;
+}
 
-	plist_t node = plist_array_get_item(message, 1);
-	char *str = NULL;
-	if (plist_get_node_type(node) == PLIST_STRING) {
-		plist_get_string_val(node, &str);
-	}
-	if (!str) {
-		printf("ERROR: Malformed DLContentsOfDirectory message\n");
-		// TODO error handling
-		return;
-	}
+#define PRIORITY_DEFAULT 5
+#define PRIORITY_MAX 10
 
-	char *path = string_build_path(backup_dir, str, NULL);
-	free(str);
+struct mb2_job {
+	char *udid;
+	unsigned int priority;
+	int order;
+	int result;
+};
 
-	plist_t dirlist = plist_new_dict();
+/**
+ * Runs the backups of several devices concurrently. Backups are started in
+ * order of priority with one worker thread per concurrent backup, and only
+ * while the backup directory has more than min_free bytes available. The
+ * disk I/O of all running backups shares one budget.
+ */
+struct mb2_scheduler {
+	mutex_t mutex;
+	struct mb2_job *jobs;
+	int num_jobs;
+	int next_job;
+	const char *backup_dir;
+	int use_network;
+	int cmd_flags;
+	uint64_t min_free;
+	struct mb2_io_budget budget;
+};
 
-	DIR* cur_dir = opendir(path);
-	if (cur_dir) {
-		struct dirent* ep;
-		while ((ep = readdir(cur_dir))) {
-			if ((strcmp(ep->d_name, ".") == 0) || (strcmp(ep->d_name, "..") == 0)) {
-				continue;
-			}
-			char *fpath = string_build_path(path, ep->d_name, NULL);
-			if (fpath) {
-				plist_t fdict = plist_new_dict();
-				struct stat st;
-				stat(fpath, &st);
-				const char *ftype = "DLFileTypeUnknown";
-				if (S_ISDIR(st.st_mode)) {
-					ftype = "DLFileTypeDirectory";
-				} else if (S_ISREG(st.st_mode)) {
-					ftype = "DLFileTypeRegular";
-				}
-				plist_dict_set_item(fdict, "DLFileType", plist_new_string(ftype));
-				plist_dict_set_item(fdict, "DLFileSize", plist_new_uint(st.st_size));
-				plist_dict_set_item(fdict, "DLFileModificationDate",
-						    plist_new_date(st.st_mtime - MAC_EPOCH, 0));
+static void mb2_scheduler_init(struct mb2_scheduler *sched, const char *backup_dir)
+{
+	memset(sched, '\0', sizeof(struct mb2_scheduler));
+	mutex_init(&sched->mutex);
+	mutex_init(&sched->budget.mutex);
+	sched->backup_dir = backup_dir;
+}
 
-				plist_dict_set_item(dirlist, ep->d_name, fdict);
-				free(fpath);
-			}
-		}
-		closedir(cur_dir);
+static void mb2_scheduler_free(struct mb2_scheduler *sched)
+{
+	int i;
+	for (i = 0; i < sched->num_jobs; i++) {
+		free(sched->jobs[i].udid);
 	}
-	free(path);
+	free(sched->jobs);
+	mutex_destroy(&sched->budget.mutex);
+	mutex_destroy(&sched->mutex);
+}
 
-	/* TODO error handling */
-	mobilebackup2_error_t err = mobilebackup2_send_status_response(mobilebackup2, 0, NULL, dirlist);
-	plist_free(dirlist);
-	if (err != MOBILEBACKUP2_E_SUCCESS) {
-		printf("Could not send status response, error %d\n", err);
+static void mb2_scheduler_add_job(struct mb2_scheduler *sched, const char *udid)
+{
+	int i;
+	for (i = 0; i < sched->num_jobs; i++) {
+		if (!strcmp(sched->jobs[i].udid, udid)) {
+			return;
+		}
 	}
+	sched->jobs = (struct mb2_job*)realloc(sched->jobs, sizeof(struct mb2_job) * (sched->num_jobs + 1));
+	struct mb2_job *job = &sched->jobs[sched->num_jobs];
+	job->udid = strdup(udid);
+	job->priority = PRIORITY_DEFAULT;
+	job->order = sched->num_jobs;
+	job->result = -1;
+	sched->num_jobs++;
 }
 
-static void mb2_handle_make_directory(mobilebackup2_client_t mobilebackup2, plist_t message, const char *backup_dir)
+/**
+ * Sets the priority of a job from a UDID=NUM specification.
+ */
+static int mb2_scheduler_set_priority(struct mb2_scheduler *sched, const char *spec)
 {
-	if (!message || (plist_get_node_type(message) != PLIST_ARRAY) || plist_array_get_size(message) < 2 || !backup_dir) return;
-
-	plist_t dir = plist_array_get_item(message, 1);
-	char *str = NULL;
-	int errcode = 0;
-	char *errdesc = NULL;
-	plist_get_string_val(dir, &str);
-
-	char *newpath = string_build_path(backup_dir, str, NULL);
-	free(str);
+	const char *sep = strrchr(spec, '=');
+	char *end = NULL;
+	int i;
 
-	if (mkdir_with_parents(newpath, 0755) < 0) {
-		errdesc = strerror(errno);
-		if (errno != EEXIST) {
-			printf("mkdir: %s (%d)\n", errdesc, errno);
+	if (!sep || sep == spec) {
+		return -1;
+	}
+	unsigned long priority = strtoul(sep + 1, &end, 10);
+	if (!*(sep + 1) || *end || priority < 1 || priority > PRIORITY_MAX) {
+		return -1;
+	}
+	for (i = 0; i < sched->num_jobs; i++) {
+		if (strlen(sched->jobs[i].udid) == (size_t)(sep - spec) && !strncmp(sched->jobs[i].udid, spec, sep - spec)) {
+			sched->jobs[i].priority = (unsigned int)priority;
+			return 0;
 		}
-		errcode = errno_to_device_error(errno);
 	}
-	free(newpath);
-	mobilebackup2_error_t err = mobilebackup2_send_status_response(mobilebackup2, errcode, errdesc, NULL);
-	if (err != MOBILEBACKUP2_E_SUCCESS) {
-		printf("Could not send status response, error %d\n", err);
+	printf("WARNING: Ignoring priority for device %.*s which is not being backed up\n", (int)(sep - spec), spec);
+
+	return 0;
+}
+
+static int mb2_job_compare(const void *a, const void *b)
+{
+	const struct mb2_job *ja = (const struct mb2_job*)a;
+	const struct mb2_job *jb = (const struct mb2_job*)b;
+	if (ja->priority != jb->priority) {
+		return (ja->priority > jb->priority) ? -1 : 1;
 	}
+	return ja->order - jb->order;
 }
 
-static void mb2_copy_file_by_path(const char *src, const char *dst)
+/**
+ * Performs the backup of a single device, from connecting to it until
+ * releasing the sync lock. Returns 0 if the backup finished successfully.
+ */
+static int mb2_backup_device(struct mb2_scheduler *sched, struct mb2_job *job)
 {
-	FILE *from, *to;
-	char buf[BUFSIZ];
-	size_t length;
+	const char *udid = job->udid;
+	idevice_t device = NULL;
+	lockdownd_client_t lockdown = NULL;
+	lockdownd_service_descriptor_t service = NULL;
+	lockdownd_error_t ldret;
+	np_client_t np = NULL;
+	afc_client_t afc = NULL;
+	mobilebackup2_client_t mobilebackup2 = NULL;
+	mobilebackup2_error_t err;
+	uint64_t lockfile = 0;
+	plist_t opts = NULL;
+	int result = -1;
+	struct mb2_engine engine;
 
-	/* open source file */
-	if ((from = fopen(src, "rb")) == NULL) {
-		printf("Cannot open source path '%s'.\n", src);
-		return;
+	mb2_engine_init(&engine, sched->backup_dir, udid, udid);
+	engine.show_progress = 0;
+	engine.weight = job->priority;
+	engine.reserve = sched->min_free;
+
+	if (idevice_new_with_options(&device, udid, (sched->use_network) ? IDEVICE_LOOKUP_NETWORK : IDEVICE_LOOKUP_USBMUX) != IDEVICE_E_SUCCESS) {
+		printf("[%s] No device found.\n", udid);
+		return -1;
 	}
 
-	/* open destination file */
-	if ((to = fopen(dst, "wb")) == NULL) {
-		printf("Cannot open destination file '%s'.\n", dst);
-		fclose(from);
-		return;
+	ldret = lockdownd_client_new_with_handshake(device, &lockdown, TOOL_NAME);
+	if (ldret != LOCKDOWN_E_SUCCESS) {
+		printf("[%s] ERROR: Could not connect to lockdownd, error code %d\n", udid, ldret);
+		goto leave;
 	}
 
-	/* copy the file */
-	while ((length = fread(buf, 1, BUFSIZ, from)) != 0) {
-		fwrite(buf, 1, length, to);
+	ldret = lockdownd_start_service(lockdown, NP_SERVICE_NAME, &service);
+	if ((ldret == LOCKDOWN_E_SUCCESS) && service && service->port) {
+		np_client_new(device, service, &np);
+		np_set_notify_callback(np, notify_cb, &engine);
+		const char *noties[5] = {
+			NP_SYNC_CANCEL_REQUEST,
+			NP_SYNC_SUSPEND_REQUEST,
+			NP_SYNC_RESUME_REQUEST,
+			NP_BACKUP_DOMAIN_CHANGED,
+			NULL
+		};
+		np_observe_notifications(np, noties);
+	} else {
+		printf("[%s] ERROR: Could not start service %s.\n", udid, NP_SERVICE_NAME);
+	}
+	if (service) {
+		lockdownd_service_descriptor_free(service);
+		service = NULL;
 	}
 
-	if(fclose(from) == EOF) {
-		printf("Error closing source file.\n");
+	/* start AFC, we need this for the lock file */
+	ldret = lockdownd_start_service(lockdown, AFC_SERVICE_NAME, &service);
+	if ((ldret == LOCKDOWN_E_SUCCESS) && service && service->port) {
+		afc_client_new(device, service, &afc);
+	}
+	if (service) {
+		lockdownd_service_descriptor_free(service);
+		service = NULL;
 	}
 
-	if(fclose(to) == EOF) {
-		printf("Error closing destination file.\n");
+	ldret = lockdownd_start_service_with_escrow_bag(lockdown, MOBILEBACKUP2_SERVICE_NAME, &service);
+	lockdownd_client_free(lockdown);
+	lockdown = NULL;
+	if ((ldret == LOCKDOWN_E_SUCCESS) && service && service->port) {
+		mobilebackup2_client_new(device, service, &mobilebackup2);
 	}
-}
+	if (service) {
+		lockdownd_service_descriptor_free(service);
+		service = NULL;
+	}
+	if (!mobilebackup2) {
+		printf("[%s] ERROR: Could not start service %s.\n", udid, MOBILEBACKUP2_SERVICE_NAME);
+		goto leave;
+	}
+	engine.mobilebackup2 = mobilebackup2;
 
-static void mb2_copy_directory_by_path(const char *src, const char *dst)
-{
-	if (!src || !dst) {
-		return;
+	double local_versions[2] = {2.0, 2.1};
+	double remote_version = 0.0;
+	err = mobilebackup2_version_exchange(mobilebackup2, local_versions, 2, &remote_version);
+	if (err != MOBILEBACKUP2_E_SUCCESS) {
+		printf("[%s] Could not perform backup protocol version exchange, error code %d\n", udid, err);
+		goto leave;
 	}
 
-	struct stat st;
+	if (mb2_sync_lock(device, afc, &lockfile) < 0 || mb2_engine_cancelled(&engine)) {
+		goto leave;
+	}
 
-	/* if src does not exist */
-	if ((stat(src, &st) < 0) || !S_ISDIR(st.st_mode)) {
-		printf("ERROR: Source directory does not exist '%s': %s (%d)\n", src, strerror(errno), errno);
-		return;
+	/* make sure backup device sub-directory exists */
+	char *devbackupdir = string_build_path(sched->backup_dir, udid, NULL);
+	__mkdir(devbackupdir, 0755);
+	free(devbackupdir);
+
+	/* re-create Info.plist */
+	plist_t info_plist = mobilebackup_factory_info_plist_new(udid, device, afc);
+	if (!info_plist) {
+		printf("[%s] Failed to generate Info.plist - aborting\n", udid);
+		goto leave;
+	}
+	char *info_path = string_build_path(sched->backup_dir, udid, "Info.plist", NULL);
+	remove_file(info_path);
+	plist_write_to_filename(info_plist, info_path, PLIST_FORMAT_XML);
+	free(info_path);
+	plist_free(info_plist);
+
+	if (sched->cmd_flags & CMD_FLAG_FORCE_FULL_BACKUP) {
+		opts = plist_new_dict();
+		plist_dict_set_item(opts, "ForceFullBackup", plist_new_bool(1));
+	}
+	PRINT_VERBOSE(1, "[%s] Requesting backup from device...\n", udid);
+	err = mobilebackup2_send_request(mobilebackup2, "Backup", udid, udid, opts);
+	if (opts)
+		plist_free(opts);
+	if (err != MOBILEBACKUP2_E_SUCCESS) {
+		printf("[%s] ERROR: Could not start backup process, error code %d\n", udid, err);
+		goto leave;
 	}
 
-	/* if dst directory does not exist */
-	if ((stat(dst, &st) < 0) || !S_ISDIR(st.st_mode)) {
-		/* create it */
-		if (mkdir_with_parents(dst, 0755) < 0) {
-			printf("ERROR: Unable to create destination directory '%s': %s (%d)\n", dst, strerror(errno), errno);
-			return;
-		}
+	mb2_io_budget_join(&sched->budget, &engine);
+	mb2_engine_run(&engine);
+	mb2_io_budget_leave(&sched->budget, &engine);
+
+	if (engine.operation_ok && mb2_status_check_snapshot_state(sched->backup_dir, udid, "finished")) {
+		PRINT_VERBOSE(1, "[%s] Backup Successful, received %d files, %d of them deduplicated.\n", udid, engine.file_count, engine.dedup_files);
+		result = 0;
+	} else if (mb2_engine_cancelled(&engine)) {
+		PRINT_VERBOSE(1, "[%s] Backup Aborted.\n", udid);
+	} else {
+		PRINT_VERBOSE(1, "[%s] Backup Failed (Error Code %d).\n", udid, -engine.result_code);
 	}
 
-	/* loop over src directory contents */
-	DIR *cur_dir = opendir(src);
-	if (cur_dir) {
-		struct dirent* ep;
-		while ((ep = readdir(cur_dir))) {
-			if ((strcmp(ep->d_name, ".") == 0) || (strcmp(ep->d_name, "..") == 0)) {
-				continue;
-			}
-			char *srcpath = string_build_path(src, ep->d_name, NULL);
-			char *dstpath = string_build_path(dst, ep->d_name, NULL);
-			if (srcpath && dstpath) {
-				/* copy file */
-				mb2_copy_file_by_path(srcpath, dstpath);
-			}
+leave:
+	if (lockfile) {
+		mb2_sync_unlock(device, afc, lockfile);
+	}
+	if (lockdown) {
+		lockdownd_client_free(lockdown);
+	}
+	if (mobilebackup2) {
+		mobilebackup2_client_free(mobilebackup2);
+	}
+	if (afc) {
+		afc_client_free(afc);
+	}
+	if (np) {
+		np_client_free(np);
+	}
+	idevice_free(device);
 
-			if (srcpath)
-				free(srcpath);
-			if (dstpath)
-				free(dstpath);
-		}
-		closedir(cur_dir);
+	return result;
+}
+
+/**
+ * Admission control: a backup is only started if the backup directory
+ * still has more than min_free bytes of disk space available. Messages
+ * are prefixed with prefix.
+ */
+static int mb2_check_min_free(const char *backup_dir, uint64_t min_free, const char *prefix)
+{
+	uint64_t freespace = 0;
+
+	if (min_free == 0) {
+		return 1;
+	}
+	if (mb2_get_free_disk_space(backup_dir, &freespace) < 0) {
+		printf("%sERROR: Could not determine free disk space, not starting backup.\n", prefix);
+		return 0;
 	}
+	if (freespace <= min_free) {
+		char *format_size = string_format_size(freespace);
+		printf("%sERROR: Only %s of disk space left, not starting backup.\n", prefix, format_size);
+		free(format_size);
+		return 0;
+	}
+
+	return 1;
 }
 
-#ifdef WIN32
-#define BS_CC '\b'
-#define my_getch getch
-#else
-#define BS_CC 0x7f
-static int my_getch(void)
+static int mb2_scheduler_admit(struct mb2_scheduler *sched, struct mb2_job *job)
 {
-	struct termios oldt, newt;
-	int ch;
-	tcgetattr(STDIN_FILENO, &oldt);
-	newt = oldt;
-	newt.c_lflag &= ~(ICANON | ECHO);
-	tcsetattr(STDIN_FILENO, TCSANOW, &newt);
-	ch = getchar();
-	tcsetattr(STDIN_FILENO, TCSANOW, &oldt);
-	return ch;
+	char prefix[128];
+	snprintf(prefix, sizeof(prefix), "[%s] ", job->udid);
+	return mb2_check_min_free(sched->backup_dir, sched->min_free, prefix);
+}
+
+static void* mb2_scheduler_worker(void *arg)
+{
+	struct mb2_scheduler *sched = (struct mb2_scheduler*)arg;
+
+	mutex_lock(&sched->mutex);
+	while (!quit_flag && sched->next_job < sched->num_jobs) {
+		struct mb2_job *job = &sched->jobs[sched->next_job++];
+		mutex_unlock(&sched->mutex);
+
+		if (mb2_scheduler_admit(sched, job)) {
+			PRINT_VERBOSE(1, "[%s] Starting backup with priority %d...\n", job->udid, job->priority);
+			job->result = mb2_backup_device(sched, job);
+		}
+
+		mutex_lock(&sched->mutex);
+	}
+	mutex_unlock(&sched->mutex);
+
+	return NULL;
 }
-#endif
 
-static void get_hidden_input(char *buf, int maxlen)
+/**
+ * Runs all jobs with at most max_jobs backups at a time. Returns 0 if all
+ * backups finished successfully.
+ */
+static int mb2_scheduler_run(struct mb2_scheduler *sched, int max_jobs)
 {
-	int pwlen = 0;
-	int c;
+	THREAD_T *workers;
+	int num_workers;
+	int failed = 0;
+	int i;
 
-	while ((c = my_getch())) {
-		if ((c == '\r') || (c == '\n')) {
+	qsort(sched->jobs, sched->num_jobs, sizeof(struct mb2_job), mb2_job_compare);
+
+	if (max_jobs <= 0 || max_jobs > sched->num_jobs) {
+		max_jobs = sched->num_jobs;
+	}
+	PRINT_VERBOSE(1, "Backing up %d device%s, %d at a time\n", sched->num_jobs, (sched->num_jobs == 1) ? "" : "s", max_jobs);
+
+	workers = (THREAD_T*)calloc(max_jobs, sizeof(THREAD_T));
+	for (num_workers = 0; num_workers < max_jobs; num_workers++) {
+		if (thread_new(&workers[num_workers], mb2_scheduler_worker, sched) != 0) {
 			break;
-		} else if (isprint(c)) {
-			if (pwlen < maxlen-1)
-				buf[pwlen++] = c;
-			fputc('*', stderr);
-		} else if (c == BS_CC) {
-			if (pwlen > 0) {
-				fputs("\b \b", stderr);
-				pwlen--;
-			}
 		}
 	}
-	buf[pwlen] = 0;
-}
-
-static char* ask_for_password(const char* msg, int type_again)
-{
-	char pwbuf[256];
+	if (num_workers == 0) {
+		printf("ERROR: Could not start worker threads\n");
+		free(workers);
+		return -1;
+	}
+	for (i = 0; i < num_workers; i++) {
+		thread_join(workers[i]);
+		thread_free(workers[i]);
+	}
+	free(workers);
 
-	fprintf(stderr, "%s: ", msg);
-	fflush(stderr);
-	get_hidden_input(pwbuf, 256);
-	fputc('\n', stderr);
+	for (i = 0; i < sched->num_jobs; i++) {
+		if (sched->jobs[i].result != 0) {
+			failed++;
+		}
+	}
+	PRINT_VERBOSE(1, "%d of %d backups successful.\n", sched->num_jobs - failed, sched->num_jobs);
 
-	if (type_again) {
-		char pwrep[256];
+	return (failed > 0) ? -1 : 0;
+}
 
-		fprintf(stderr, "%s (repeat): ", msg);
-		fflush(stderr);
-		get_hidden_input(pwrep, 256);
-		fputc('\n', stderr);
+/* process counters a replay reports the difference of */
+struct mb2_replay_counters {
+	uint64_t read_calls;
+	uint64_t write_calls;
+	uint64_t disk_read;
+	uint64_t disk_written;
+	long minflt;
+	long majflt;
+	long inblock;
+	long oublock;
+	long nvcsw;
+	long nivcsw;
+	long maxrss;
+};
 
-		if (strcmp(pwbuf, pwrep) != 0) {
-			printf("ERROR: passwords don't match\n");
-			return NULL;
+static void mb2_replay_counters_get(struct mb2_replay_counters *counters)
+{
+	memset(counters, '\0', sizeof(struct mb2_replay_counters));
+#ifdef __linux__
+	FILE *f = fopen("/proc/self/io", "r");
+	if (f) {
+		char line[128];
+		unsigned long long value;
+		while (fgets(line, sizeof(line), f)) {
+			if (sscanf(line, "syscr: %llu", &value) == 1) {
+				counters->read_calls = value;
+			} else if (sscanf(line, "syscw: %llu", &value) == 1) {
+				counters->write_calls = value;
+			} else if (sscanf(line, "read_bytes: %llu", &value) == 1) {
+				counters->disk_read = value;
+			} else if (sscanf(line, "write_bytes: %llu", &value) == 1) {
+				counters->disk_written = value;
+			}
 		}
+		fclose(f);
 	}
-	return strdup(pwbuf);
+#endif
+#ifdef HAVE_GETRUSAGE
+	struct rusage ru;
+	if (getrusage(RUSAGE_SELF, &ru) == 0) {
+		counters->minflt = ru.ru_minflt;
+		counters->majflt = ru.ru_majflt;
+		counters->inblock = ru.ru_inblock;
+		counters->oublock = ru.ru_oublock;
+		counters->nvcsw = ru.ru_nvcsw;
+		counters->nivcsw = ru.ru_nivcsw;
+		counters->maxrss = ru.ru_maxrss;
+	}
+#endif
 }
 
 /**
- * signal handler function for cleaning up properly
+ * Replays a trace recorded with --trace against the DLMessage handlers,
+ * with synthetic file contents and without a device, and prints how long
+ * the host side took and what it cost.
  */
-static void clean_exit(int sig)
+static int mb2_replay(const char *backup_dir, const char *trace_path)
 {
-	fprintf(stderr, "Exiting...\n");
-	quit_flag++;
+	struct mb2_engine engine;
+	struct mb2_replay_counters before;
+	struct mb2_replay_counters after;
+
+	struct mb2_trace *trace = mb2_trace_load(trace_path);
+	if (!trace) {
+		return -1;
+	}
+	mb2_trace_create_files(trace, backup_dir);
+	char *udid_dir = string_build_path(backup_dir, trace->udid, NULL);
+	mkdir_with_parents(udid_dir, 0755);
+	free(udid_dir);
+
+	mb2_engine_init(&engine, backup_dir, trace->udid, trace->udid);
+	engine.show_progress = 0;
+	engine.trace = trace;
+
+#ifdef HAVE_MALLINFO2
+	/* the trace itself is not part of the heap used by the handlers */
+	mb2_trace_sample_heap(trace);
+	uint64_t heap_base = trace->heap_peak;
+#endif
+	mb2_replay_counters_get(&before);
+	uint64_t start = mb2_time_us();
+	mb2_engine_run(&engine);
+	double elapsed = (double)(mb2_time_us() - start) / 1000000;
+	mb2_replay_counters_get(&after);
+
+	printf("replay: messages=%u files=%u dedup_files=%u received=%llu sent=%llu time=%.3fs rate=%.2fMB/s\n",
+		trace->messages, engine.file_count, engine.dedup_files,
+		(unsigned long long)trace->bytes_received, (unsigned long long)trace->bytes_sent, elapsed,
+		(elapsed > 0) ? (trace->bytes_received + trace->bytes_sent) / 1048576.0 / elapsed : 0.0);
+#ifdef __linux__
+	printf("replay io: read_calls=%llu write_calls=%llu disk_read=%llu disk_written=%llu\n",
+		(unsigned long long)(after.read_calls - before.read_calls),
+		(unsigned long long)(after.write_calls - before.write_calls),
+		(unsigned long long)(after.disk_read - before.disk_read),
+		(unsigned long long)(after.disk_written - before.disk_written));
+#endif
+#ifdef HAVE_GETRUSAGE
+	printf("replay rusage: minflt=%ld majflt=%ld inblock=%ld oublock=%ld vcsw=%ld ivcsw=%ld maxrss=%ld\n",
+		after.minflt - before.minflt, after.majflt - before.majflt,
+		after.inblock - before.inblock, after.oublock - before.oublock,
+		after.nvcsw - before.nvcsw, after.nivcsw - before.nivcsw, after.maxrss);
+#endif
+#ifdef HAVE_MALLINFO2
+	printf("replay heap: peak=%llu\n", (unsigned long long)((trace->heap_peak > heap_base) ? trace->heap_peak - heap_base : 0));
+#endif
+
+	int res = (mb2_engine_cancelled(&engine)) ? -1 : 0;
+	mb2_trace_free(trace);
+
+	return res;
 }
 
 static void print_usage(int argc, char **argv)
@@ -1427,12 +5365,40 @@ static void print_usage(int argc, char **argv)
 	printf("  changepw [OLD NEW]  change backup password on target device\n");
 	printf("    NOTE: passwords will be requested in interactive mode if omitted\n");
 	printf("  cloud on|off\tenable or disable cloud use (requires iCloud account)\n");
+	printf("  replay TRACE\treplay a trace recorded with --trace into DIRECTORY without\n");
+	printf("              \ta device, with synthetic file contents, and print the time\n");
+	printf("              \tand I/O it took\n");
 	printf("\n");
 	printf("OPTIONS:\n");
-	printf("  -u, --udid UDID\ttarget specific device by UDID\n");
+	printf("  -u, --udid UDID\ttarget specific device by UDID, can be given multiple\n");
+	printf("                 \ttimes to back up several devices at once\n");
 	printf("  -s, --source UDID\tuse backup data from device specified by UDID\n");
 	printf("  -n, --network\t\tconnect to network device\n");
 	printf("  -i, --interactive\trequest passwords interactively\n");
+	printf("  -c, --chunk-size SIZE\tsize in bytes of data chunks sent to the device\n");
+	printf("  -q, --queue-size SIZE\tmemory in bytes for data waiting to be written to disk,\n");
+	printf("                       \t0 writes synchronously\n");
+	printf("  --metrics FILE\t\tappend transfer metrics as JSON lines to FILE every\n");
+	printf("                \t\tsecond, or write them to stderr if FILE is '-'\n");
+#ifdef HAVE_ZLIB
+	printf("  --compress\t\tstore received files compressed, except for media and\n");
+	printf("            \t\tarchives; files are decompressed again for restore\n");
+#endif
+	printf("  --durability MODE\twhen received data is synced to disk: none (default),\n");
+	printf("                   \tbatch for one sync per batch of files before the device\n");
+	printf("                   \tis told they are stored, or file for each file\n");
+	printf("  --dedup DIR\t\tstore received files once by content in DIR and link\n");
+	printf("             \t\tthem into the backup, DIR must be on the same filesystem\n");
+	printf("  -j, --jobs NUM\t\tback up NUM devices concurrently, all connected devices\n");
+	printf("                \t\tunless devices are given with -u\n");
+	printf("  --priority UDID=NUM\tpriority from 1 to 10 (default 5) of a device when backing\n");
+	printf("                     \tup several devices, higher priorities start first and\n");
+	printf("                     \tget a larger share of the I/O limit\n");
+	printf("  --io-limit RATE\tlimit the disk I/O of all backups to RATE bytes per second\n");
+	printf("  --min-free SIZE\tdo not start backups with less than SIZE bytes of free disk\n");
+	printf("                 \tspace and keep that space free while backing up\n");
+	printf("  --trace FILE\t\trecord the messages and file sizes, but not the contents,\n");
+	printf("              \t\tthe device sends to FILE for the replay command\n");
 	printf("  -d, --debug\t\tenable communication debugging\n");
 	printf("  -h, --help\t\tprints usage information\n");
 	printf("  -v, --version\t\tprints version information\n");
@@ -1450,6 +5416,16 @@ int main(int argc, char *argv[])
 	int i;
 	char* udid = NULL;
 	char* source_udid = NULL;
+	const char **udids = NULL;
+	int num_udids = 0;
+	const char **priorities = NULL;
+	int num_priorities = 0;
+	int max_jobs = 0;
+	uint64_t io_limit = 0;
+	uint64_t min_free = 0;
+	const char *metrics_path = NULL;
+	const char *trace_path = NULL;
+	const char *replay_path = NULL;
 	int use_network = 0;
 	lockdownd_service_descriptor_t service = NULL;
 	int cmd = -1;
@@ -1486,7 +5462,11 @@ int main(int argc, char *argv[])
 				print_usage(argc, argv);
 				return -1;
 			}
-			udid = strdup(argv[i]);
+			if (!udid) {
+				udid = strdup(argv[i]);
+			}
+			udids = (const char**)realloc(udids, sizeof(char*) * (num_udids + 1));
+			udids[num_udids++] = argv[i];
 			continue;
 		}
 		else if (!strcmp(argv[i], "-s") || !strcmp(argv[i], "--source")) {
@@ -1506,6 +5486,124 @@ int main(int argc, char *argv[])
 			interactive_mode = 1;
 			continue;
 		}
+		else if (!strcmp(argv[i], "-c") || !strcmp(argv[i], "--chunk-size")) {
+			i++;
+			if (!argv[i] || !*argv[i]) {
+				print_usage(argc, argv);
+				return -1;
+			}
+			unsigned long size = strtoul(argv[i], NULL, 0);
+			if (size < SEND_CHUNK_SIZE_MIN || size > SEND_CHUNK_SIZE_MAX) {
+				printf("ERROR: chunk size must be between %d and %d bytes.\n", SEND_CHUNK_SIZE_MIN, SEND_CHUNK_SIZE_MAX);
+				return -1;
+			}
+			send_chunk_size = (uint32_t)size;
+			continue;
+		}
+		else if (!strcmp(argv[i], "-q") || !strcmp(argv[i], "--queue-size")) {
+			i++;
+			if (!argv[i] || !*argv[i]) {
+				print_usage(argc, argv);
+				return -1;
+			}
+			write_queue_size = strtoull(argv[i], NULL, 0);
+			continue;
+		}
+		else if (!strcmp(argv[i], "--dedup")) {
+			i++;
+			if (!argv[i] || !*argv[i]) {
+				print_usage(argc, argv);
+				return -1;
+			}
+			dedup_dir = argv[i];
+			continue;
+		}
+		else if (!strcmp(argv[i], "--metrics")) {
+			i++;
+			if (!argv[i] || !*argv[i]) {
+				print_usage(argc, argv);
+				return -1;
+			}
+			metrics_path = argv[i];
+			continue;
+		}
+		else if (!strcmp(argv[i], "--trace")) {
+			i++;
+			if (!argv[i] || !*argv[i]) {
+				print_usage(argc, argv);
+				return -1;
+			}
+			trace_path = argv[i];
+			continue;
+		}
+		else if (!strcmp(argv[i], "--compress")) {
+#ifdef HAVE_ZLIB
+			compress_files = 1;
+			continue;
+#else
+			printf("ERROR: --compress is not supported, %s was built without zlib\n", TOOL_NAME);
+			return -1;
+#endif
+		}
+		else if (!strcmp(argv[i], "--durability")) {
+			i++;
+			if (!argv[i] || !*argv[i]) {
+				print_usage(argc, argv);
+				return -1;
+			}
+			if (!strcmp(argv[i], "none")) {
+				durability = DURABILITY_NONE;
+			} else if (!strcmp(argv[i], "batch")) {
+				durability = DURABILITY_BATCH;
+			} else if (!strcmp(argv[i], "file")) {
+				durability = DURABILITY_FILE;
+			} else {
+				printf("Invalid durability mode '%s'; must be none, batch or file.\n", argv[i]);
+				return -1;
+			}
+			continue;
+		}
+		else if (!strcmp(argv[i], "-j") || !strcmp(argv[i], "--jobs")) {
+			i++;
+			if (!argv[i] || !*argv[i]) {
+				print_usage(argc, argv);
+				return -1;
+			}
+			max_jobs = atoi(argv[i]);
+			if (max_jobs <= 0) {
+				printf("ERROR: number of jobs must be at least 1.\n");
+				return -1;
+			}
+			continue;
+		}
+		else if (!strcmp(argv[i], "--priority")) {
+			i++;
+			if (!argv[i] || !*argv[i]) {
+				print_usage(argc, argv);
+				return -1;
+			}
+			priorities = (const char**)realloc(priorities, sizeof(char*) * (num_priorities + 1));
+			priorities[num_priorities++] = argv[i];
+			continue;
+		}
+		else if (!strcmp(argv[i], "--io-limit")) {
+			i++;
+			if (!argv[i] || !*argv[i]) {
+				print_usage(argc, argv);
+				return -1;
+			}
+			io_limit = strtoull(argv[i], NULL, 0);
+			continue;
+		}
+		else if (!strcmp(argv[i], "--min-free")) {
+			i++;
+			if (!argv[i] || !*argv[i]) {
+				print_usage(argc, argv);
+				return -1;
+			}
+			min_free = strtoull(argv[i], NULL, 0);
+			continue;
+		}
 		else if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
 			print_usage(argc, argv);
 			return 0;
@@ -1583,6 +5681,17 @@ int main(int argc, char *argv[])
 		else if (!strcmp(argv[i], "unback")) {
 			cmd = CMD_UNBACK;
 		}
+		else if (!strcmp(argv[i], "replay")) {
+			cmd = CMD_REPLAY;
+			i++;
+			if (!argv[i] || !*argv[i]) {
+				printf("No trace given for replay command.\n");
+				print_usage(argc, argv);
+				return -1;
+			}
+			replay_path = argv[i];
+			continue;
+		}
 		else if (!strcmp(argv[i], "encryption")) {
 			cmd = CMD_CHANGEPW;
 			i++;
@@ -1674,6 +5783,93 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if (dedup_dir && ((stat(dedup_dir, &st) != 0) || !S_ISDIR(st.st_mode))) {
+		printf("ERROR: Dedup directory \"%s\" does not exist!\n", dedup_dir);
+		return -1;
+	}
+
+	if (metrics_path) {
+		metrics_file = (!strcmp(metrics_path, "-")) ? stderr : fopen(metrics_path, "a");
+		if (!metrics_file) {
+			printf("ERROR: Could not open metrics file \"%s\": %s\n", metrics_path, strerror(errno));
+			return -1;
+		}
+		mutex_init(&metrics_mutex);
+	}
+
+	if (cmd == CMD_REPLAY) {
+		free(udids);
+		free(priorities);
+		free(udid);
+		free(source_udid);
+		return mb2_replay(backup_directory, replay_path);
+	}
+
+	if (trace_path && cmd != CMD_BACKUP && cmd != CMD_RESTORE) {
+		printf("ERROR: Only the backup and restore commands can be traced.\n");
+		return -1;
+	}
+
+	if (num_udids > 1 || max_jobs > 0) {
+		struct mb2_scheduler sched;
+
+		if (cmd != CMD_BACKUP || source_udid || trace_path) {
+			printf("ERROR: Only the backup command without --source or --trace can handle several devices at once.\n");
+			return -1;
+		}
+
+		mb2_scheduler_init(&sched, backup_directory);
+		sched.use_network = use_network;
+		sched.cmd_flags = cmd_flags;
+		sched.min_free = min_free;
+		sched.budget.rate = io_limit;
+
+		if (num_udids > 0) {
+			for (i = 0; i < num_udids; i++) {
+				mb2_scheduler_add_job(&sched, udids[i]);
+			}
+		} else {
+			idevice_info_t *devices = NULL;
+			int count = 0;
+			if (idevice_get_device_list_extended(&devices, &count) == IDEVICE_E_SUCCESS) {
+				for (i = 0; i < count; i++) {
+					if (devices[i]->conn_type == ((use_network) ? CONNECTION_NETWORK : CONNECTION_USBMUXD)) {
+						mb2_scheduler_add_job(&sched, devices[i]->udid);
+					}
+				}
+				idevice_device_list_extended_free(devices);
+			}
+		}
+		for (i = 0; i < num_priorities; i++) {
+			if (mb2_scheduler_set_priority(&sched, priorities[i]) < 0) {
+				printf("ERROR: Invalid priority '%s', must be UDID=NUM with NUM from 1 to %d.\n", priorities[i], PRIORITY_MAX);
+				mb2_scheduler_free(&sched);
+				return -1;
+			}
+		}
+
+		if (sched.num_jobs == 0) {
+			printf("No device found.\n");
+			result_code = -1;
+		} else {
+			result_code = mb2_scheduler_run(&sched, max_jobs);
+		}
+		mb2_scheduler_free(&sched);
+		free(udids);
+		free(priorities);
+		free(udid);
+
+		return result_code;
+	}
+	free(udids);
+	free(priorities);
+
+	if (cmd == CMD_BACKUP && !mb2_check_min_free(backup_directory, min_free, "")) {
+		free(udid);
+		free(source_udid);
+		return -1;
+	}
+
 	idevice_t device = NULL;
 	ret = idevice_new_with_options(&device, udid, (use_network) ? IDEVICE_LOOKUP_NETWORK : IDEVICE_LOOKUP_USBMUX);
 	if (ret != IDEVICE_E_SUCCESS) {
@@ -1693,6 +5889,10 @@ int main(int argc, char *argv[])
 		source_udid = strdup(udid);
 	}
 
+	struct mb2_engine engine;
+	mb2_engine_init(&engine, backup_directory, udid, source_udid);
+	engine.reserve = min_free;
+
 	uint8_t is_encrypted = 0;
 	char *info_path = NULL;
 	if (cmd == CMD_CHANGEPW) {
@@ -1797,7 +5997,7 @@ int main(int argc, char *argv[])
 	ldret = lockdownd_start_service(lockdown, NP_SERVICE_NAME, &service);
 	if ((ldret == LOCKDOWN_E_SUCCESS) && service && service->port) {
 		np_client_new(device, service, &np);
-		np_set_notify_callback(np, notify_cb, NULL);
+		np_set_notify_callback(np, notify_cb, &engine);
 		const char *noties[5] = {
 			NP_SYNC_CANCEL_REQUEST,
 			NP_SYNC_SUSPEND_REQUEST,
@@ -1834,6 +6034,7 @@ int main(int argc, char *argv[])
 	if ((ldret == LOCKDOWN_E_SUCCESS) && service && service->port) {
 		PRINT_VERBOSE(1, "Started \"%s\" service on port %d.\n", MOBILEBACKUP2_SERVICE_NAME, service->port);
 		mobilebackup2_client_new(device, service, &mobilebackup2);
+		engine.mobilebackup2 = mobilebackup2;
 
 		if (service) {
 			lockdownd_service_descriptor_free(service);
@@ -1853,7 +6054,7 @@ int main(int argc, char *argv[])
 		PRINT_VERBOSE(1, "Negotiated Protocol Version %.1f\n", remote_version);
 
 		/* check abort conditions */
-		if (quit_flag > 0) {
+		if (mb2_engine_cancelled(&engine)) {
 			PRINT_VERBOSE(1, "Aborting as requested by user...\n");
 			cmd = CMD_LEAVE;
 			goto checkpoint;
@@ -1879,31 +6080,7 @@ int main(int argc, char *argv[])
 
 		uint64_t lockfile = 0;
 		if (cmd == CMD_BACKUP || cmd == CMD_RESTORE) {
-			do_post_notification(device, NP_SYNC_WILL_START);
-			afc_file_open(afc, "/com.apple.itunes.lock_sync", AFC_FOPEN_RW, &lockfile);
-		}
-		if (lockfile) {
-			afc_error_t aerr;
-			do_post_notification(device, NP_SYNC_LOCK_REQUEST);
-			for (i = 0; i < LOCK_ATTEMPTS; i++) {
-				aerr = afc_file_lock(afc, lockfile, AFC_LOCK_EX);
-				if (aerr == AFC_E_SUCCESS) {
-					do_post_notification(device, NP_SYNC_DID_START);
-					break;
-				} else if (aerr == AFC_E_OP_WOULD_BLOCK) {
-					usleep(LOCK_WAIT);
-					continue;
-				} else {
-					fprintf(stderr, "ERROR: could not lock file! error code: %d\n", aerr);
-					afc_file_close(afc, lockfile);
-					lockfile = 0;
-					cmd = CMD_LEAVE;
-				}
-			}
-			if (i == LOCK_ATTEMPTS) {
-				fprintf(stderr, "ERROR: timeout while locking for sync\n");
-				afc_file_close(afc, lockfile);
-				lockfile = 0;
+			if (mb2_sync_lock(device, afc, &lockfile) < 0) {
 				cmd = CMD_LEAVE;
 			}
 		}
@@ -2171,7 +6348,7 @@ checkpoint:
 				}
 				/*if (cmd_flags & CMD_FLAG_ENCRYPTION_ENABLE) {
 					int retr = 10;
-					while ((retr-- >= 0) && !backup_domain_changed) {
+					while ((retr-- >= 0) && !engine.backup_domain_changed) {
 						sleep(1);
 					}
 				}*/
@@ -2184,274 +6361,29 @@ checkpoint:
 			break;
 		}
 
-		if (cmd != CMD_LEAVE) {
-			/* reset operation success status */
-			int operation_ok = 0;
-			plist_t message = NULL;
-
-			mobilebackup2_error_t mberr;
-			char *dlmsg = NULL;
-			int file_count = 0;
-			int errcode = 0;
-			const char *errdesc = NULL;
-			int progress_finished = 0;
-
-			/* process series of DLMessage* operations */
-			do {
-				free(dlmsg);
-				dlmsg = NULL;
-				mberr = mobilebackup2_receive_message(mobilebackup2, &message, &dlmsg);
-				if (mberr == MOBILEBACKUP2_E_RECEIVE_TIMEOUT) {
-					PRINT_VERBOSE(2, "Device is not ready yet, retrying...\n");
-					goto files_out;
-				} else if (mberr != MOBILEBACKUP2_E_SUCCESS) {
-					PRINT_VERBOSE(0, "ERROR: Could not receive from mobilebackup2 (%d)\n", mberr);
-					quit_flag++;
-					goto files_out;
-				}
-
-				if (!strcmp(dlmsg, "DLMessageDownloadFiles")) {
-					/* device wants to download files from the computer */
-					mb2_set_overall_progress_from_message(message, dlmsg);
-					mb2_handle_send_files(mobilebackup2, message, backup_directory);
-				} else if (!strcmp(dlmsg, "DLMessageUploadFiles")) {
-					/* device wants to send files to the computer */
-					mb2_set_overall_progress_from_message(message, dlmsg);
-					file_count += mb2_handle_receive_files(mobilebackup2, message, backup_directory);
-				} else if (!strcmp(dlmsg, "DLMessageGetFreeDiskSpace")) {
-					/* device wants to know how much disk space is available on the computer */
-					uint64_t freespace = 0;
-					int res = -1;
-#ifdef WIN32
-					if (GetDiskFreeSpaceEx(backup_directory, (PULARGE_INTEGER)&freespace, NULL, NULL)) {
-						res = 0;
-					}
-#else
-					struct statvfs fs;
-					memset(&fs, '\0', sizeof(fs));
-					res = statvfs(backup_directory, &fs);
-					if (res == 0) {
-						freespace = (uint64_t)fs.f_bavail * (uint64_t)fs.f_bsize;
-					}
-#endif
-					plist_t freespace_item = plist_new_uint(freespace);
-					mobilebackup2_send_status_response(mobilebackup2, res, NULL, freespace_item);
-					plist_free(freespace_item);
-				} else if (!strcmp(dlmsg, "DLContentsOfDirectory")) {
-					/* list directory contents */
-					mb2_handle_list_directory(mobilebackup2, message, backup_directory);
-				} else if (!strcmp(dlmsg, "DLMessageCreateDirectory")) {
-					/* make a directory */
-					mb2_handle_make_directory(mobilebackup2, message, backup_directory);
-				} else if (!strcmp(dlmsg, "DLMessageMoveFiles") || !strcmp(dlmsg, "DLMessageMoveItems")) {
-					/* perform a series of rename operations */
-					mb2_set_overall_progress_from_message(message, dlmsg);
-					plist_t moves = plist_array_get_item(message, 1);
-					uint32_t cnt = plist_dict_get_size(moves);
-					PRINT_VERBOSE(1, "Moving %d file%s\n", cnt, (cnt == 1) ? "" : "s");
-					plist_dict_iter iter = NULL;
-					plist_dict_new_iter(moves, &iter);
-					errcode = 0;
-					errdesc = NULL;
-					if (iter) {
-						char *key = NULL;
-						plist_t val = NULL;
-						do {
-							plist_dict_next_item(moves, iter, &key, &val);
-							if (key && (plist_get_node_type(val) == PLIST_STRING)) {
-								char *str = NULL;
-								plist_get_string_val(val, &str);
-								if (str) {
-									char *newpath = string_build_path(backup_directory, str, NULL);
-									free(str);
-									char *oldpath = string_build_path(backup_directory, key, NULL);
-
-									if ((stat(newpath, &st) == 0) && S_ISDIR(st.st_mode))
-										rmdir_recursive(newpath);
-									else
-										remove_file(newpath);
-									if (rename(oldpath, newpath) < 0) {
-										printf("Renameing '%s' to '%s' failed: %s (%d)\n", oldpath, newpath, strerror(errno), errno);
-										errcode = errno_to_device_error(errno);
-										errdesc = strerror(errno);
-										break;
-									}
-									free(oldpath);
-									free(newpath);
-								}
-								free(key);
-								key = NULL;
-							}
-						} while (val);
-						free(iter);
-					} else {
-						errcode = -1;
-						errdesc = "Could not create dict iterator";
-						printf("Could not create dict iterator\n");
-					}
-					plist_t empty_dict = plist_new_dict();
-					err = mobilebackup2_send_status_response(mobilebackup2, errcode, errdesc, empty_dict);
-					plist_free(empty_dict);
-					if (err != MOBILEBACKUP2_E_SUCCESS) {
-						printf("Could not send status response, error %d\n", err);
-					}
-				} else if (!strcmp(dlmsg, "DLMessageRemoveFiles") || !strcmp(dlmsg, "DLMessageRemoveItems")) {
-					mb2_set_overall_progress_from_message(message, dlmsg);
-					plist_t removes = plist_array_get_item(message, 1);
-					uint32_t cnt = plist_array_get_size(removes);
-					PRINT_VERBOSE(1, "Removing %d file%s\n", cnt, (cnt == 1) ? "" : "s");
-					uint32_t ii = 0;
-					errcode = 0;
-					errdesc = NULL;
-					for (ii = 0; ii < cnt; ii++) {
-						plist_t val = plist_array_get_item(removes, ii);
-						if (plist_get_node_type(val) == PLIST_STRING) {
-							char *str = NULL;
-							plist_get_string_val(val, &str);
-							if (str) {
-								const char *checkfile = strchr(str, '/');
-								int suppress_warning = 0;
-								if (checkfile) {
-									if (strcmp(checkfile+1, "Manifest.mbdx") == 0) {
-										suppress_warning = 1;
-									}
-								}
-								char *newpath = string_build_path(backup_directory, str, NULL);
-								free(str);
-								int res = 0;
-								if ((stat(newpath, &st) == 0) && S_ISDIR(st.st_mode)) {
-									res = rmdir_recursive(newpath);
-								} else {
-									res = remove_file(newpath);
-								}
-								if (res != 0 && res != ENOENT) {
-									if (!suppress_warning)
-										printf("Could not remove '%s': %s (%d)\n", newpath, strerror(res), res);
-									errcode = errno_to_device_error(res);
-									errdesc = strerror(res);
-								}
-								free(newpath);
-							}
-						}
-					}
-					plist_t empty_dict = plist_new_dict();
-					err = mobilebackup2_send_status_response(mobilebackup2, errcode, errdesc, empty_dict);
-					plist_free(empty_dict);
-					if (err != MOBILEBACKUP2_E_SUCCESS) {
-						printf("Could not send status response, error %d\n", err);
-					}
-				} else if (!strcmp(dlmsg, "DLMessageCopyItem")) {
-					plist_t srcpath = plist_array_get_item(message, 1);
-					plist_t dstpath = plist_array_get_item(message, 2);
-					errcode = 0;
-					errdesc = NULL;
-					if ((plist_get_node_type(srcpath) == PLIST_STRING) && (plist_get_node_type(dstpath) == PLIST_STRING)) {
-						char *src = NULL;
-						char *dst = NULL;
-						plist_get_string_val(srcpath, &src);
-						plist_get_string_val(dstpath, &dst);
-						if (src && dst) {
-							char *oldpath = string_build_path(backup_directory, src, NULL);
-							char *newpath = string_build_path(backup_directory, dst, NULL);
-
-							PRINT_VERBOSE(1, "Copying '%s' to '%s'\n", src, dst);
-
-							/* check that src exists */
-							if ((stat(oldpath, &st) == 0) && S_ISDIR(st.st_mode)) {
-								mb2_copy_directory_by_path(oldpath, newpath);
-							} else if ((stat(oldpath, &st) == 0) && S_ISREG(st.st_mode)) {
-								mb2_copy_file_by_path(oldpath, newpath);
-							}
-
-							free(newpath);
-							free(oldpath);
-						}
-						free(src);
-						free(dst);
-					}
-					plist_t empty_dict = plist_new_dict();
-					err = mobilebackup2_send_status_response(mobilebackup2, errcode, errdesc, empty_dict);
-					plist_free(empty_dict);
-					if (err != MOBILEBACKUP2_E_SUCCESS) {
-						printf("Could not send status response, error %d\n", err);
-					}
-				} else if (!strcmp(dlmsg, "DLMessageDisconnect")) {
-					break;
-				} else if (!strcmp(dlmsg, "DLMessageProcessMessage")) {
-					node_tmp = plist_array_get_item(message, 1);
-					if (plist_get_node_type(node_tmp) != PLIST_DICT) {
-						printf("Unknown message received!\n");
-					}
-					plist_t nn;
-					int error_code = -1;
-					nn = plist_dict_get_item(node_tmp, "ErrorCode");
-					if (nn && (plist_get_node_type(nn) == PLIST_UINT)) {
-						uint64_t ec = 0;
-						plist_get_uint_val(nn, &ec);
-						error_code = (uint32_t)ec;
-						if (error_code == 0) {
-							operation_ok = 1;
-							result_code = 0;
-						} else {
-							result_code = -error_code;
-						}
-					}
-					nn = plist_dict_get_item(node_tmp, "ErrorDescription");
-					char *str = NULL;
-					if (nn && (plist_get_node_type(nn) == PLIST_STRING)) {
-						plist_get_string_val(nn, &str);
-					}
-					if (error_code != 0) {
-						if (str) {
-							printf("ErrorCode %d: %s\n", error_code, str);
-						} else {
-							printf("ErrorCode %d: (Unknown)\n", error_code);
-						}
-					}
-					if (str) {
-						free(str);
-					}
-					nn = plist_dict_get_item(node_tmp, "Content");
-					if (nn && (plist_get_node_type(nn) == PLIST_STRING)) {
-						str = NULL;
-						plist_get_string_val(nn, &str);
-						PRINT_VERBOSE(1, "Content:\n");
-						printf("%s", str);
-						free(str);
-					}
-					break;
-				}
-
-				/* print status */
-				if ((overall_progress > 0) && !progress_finished) {
-					if (overall_progress >= 100.0f) {
-						progress_finished = 1;
-					}
-					print_progress_real(overall_progress, 0);
-					PRINT_VERBOSE(1, " Finished\n");
-				}
-
-files_out:
-				plist_free(message);
-				message = NULL;
-				free(dlmsg);
-				dlmsg = NULL;
-
-				if (quit_flag > 0) {
-					/* need to cancel the backup here */
-					//mobilebackup_send_error(mobilebackup, "Cancelling DLSendFile");
-
-					/* remove any atomic Manifest.plist.tmp */
-
-					/*manifest_path = mobilebackup_build_path(backup_directory, "Manifest", ".plist.tmp");
-					if (stat(manifest_path, &st) == 0)
-						remove(manifest_path);*/
-					break;
-				}
-			} while (1);
+		if (cmd != CMD_LEAVE && trace_path) {
+			engine.trace = mb2_trace_record(trace_path, source_udid);
+			if (!engine.trace) {
+				cmd = CMD_LEAVE;
+			}
+		}
 
-			plist_free(message);
-			free(dlmsg);
+		if (cmd != CMD_LEAVE) {
+			/* a single backup gets the whole budget */
+			struct mb2_io_budget budget;
+			memset(&budget, '\0', sizeof(budget));
+			mutex_init(&budget.mutex);
+			budget.rate = io_limit;
+			mb2_io_budget_join(&budget, &engine);
+			mb2_engine_run(&engine);
+			mb2_io_budget_leave(&budget, &engine);
+			mutex_destroy(&budget.mutex);
+			mb2_trace_free(engine.trace);
+			engine.trace = NULL;
+			result_code = engine.result_code;
+
+			int operation_ok = engine.operation_ok;
+			int aborted = mb2_engine_cancelled(&engine);
 
 			/* report operation status to user */
 			switch (cmd) {
@@ -2471,11 +6403,16 @@ files_out:
 				}
 				break;
 				case CMD_BACKUP:
-					PRINT_VERBOSE(1, "Received %d files from device.\n", file_count);
+					PRINT_VERBOSE(1, "Received %d files from device.\n", engine.file_count);
+					if (dedup_dir) {
+						char *format_size = string_format_size(engine.dedup_bytes);
+						PRINT_VERBOSE(1, "Linked %d files to the dedup store, %s not written.\n", engine.dedup_files, format_size);
+						free(format_size);
+					}
 					if (operation_ok && mb2_status_check_snapshot_state(backup_directory, udid, "finished")) {
 						PRINT_VERBOSE(1, "Backup Successful.\n");
 					} else {
-						if (quit_flag) {
+						if (aborted) {
 							PRINT_VERBOSE(1, "Backup Aborted.\n");
 						} else {
 							PRINT_VERBOSE(1, "Backup Failed (Error Code %d).\n", -result_code);
@@ -2483,7 +6420,7 @@ files_out:
 					}
 				break;
 				case CMD_UNBACK:
-				if (quit_flag) {
+				if (aborted) {
 					PRINT_VERBOSE(1, "Unback Aborted.\n");
 				} else {
 					PRINT_VERBOSE(1, "The files can now be found in the \"_unback_\" directory.\n");
@@ -2519,7 +6456,7 @@ files_out:
 				} else {
 					afc_remove_path(afc, "/iTunesRestore/RestoreApplications.plist");
 					afc_remove_path(afc, "/iTunesRestore");
-					if (quit_flag) {
+					if (aborted) {
 						PRINT_VERBOSE(1, "Restore Aborted.\n");
 					} else {
 						PRINT_VERBOSE(1, "Restore Failed (Error Code %d).\n", -result_code);
@@ -2530,7 +6467,7 @@ files_out:
 				case CMD_LIST:
 				case CMD_LEAVE:
 				default:
-				if (quit_flag) {
+				if (aborted) {
 					PRINT_VERBOSE(1, "Operation Aborted.\n");
 				} else if (cmd == CMD_LEAVE) {
 					PRINT_VERBOSE(1, "Operation Failed.\n");
@@ -2541,11 +6478,8 @@ files_out:
 			}
 		}
 		if (lockfile) {
-			afc_file_lock(afc, lockfile, AFC_LOCK_UN);
-			afc_file_close(afc, lockfile);
+			mb2_sync_unlock(device, afc, lockfile);
 			lockfile = 0;
-			if (cmd == CMD_BACKUP || cmd == CMD_RESTORE)
-				do_post_notification(device, NP_SYNC_DID_FINISH);
 		}
 	} else {
 		printf("ERROR: Could not start service %s.\n", MOBILEBACKUP2_SERVICE_NAME);
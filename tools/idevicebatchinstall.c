@@ -0,0 +1,461 @@
+/*
+ * idevicebatchinstall.c
+ * Installs an application package on many devices at once
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#define TOOL_NAME "idevicebatchinstall"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <inttypes.h>
+#include <sys/time.h>
+#ifndef WIN32
+#include <signal.h>
+#endif
+
+#include <libimobiledevice/libimobiledevice.h>
+#include <libimobiledevice/lockdown.h>
+#include <libimobiledevice/afc.h>
+#include <libimobiledevice/installation_proxy.h>
+
+#include "common/thread.h"
+#include "common/utils.h"
+
+#define PKG_STAGING_DIR "PublicStaging"
+#define UPLOAD_CHUNK_SIZE (4 * 1024 * 1024)
+/* give up on a device that sends no status for this long (ms) */
+#define INSTALL_STATUS_TIMEOUT (5 * 60 * 1000)
+
+struct install_job {
+	const char *udid;
+	int use_network;
+	int result;
+	uint64_t uploaded;
+	double upload_time;
+	double install_time;
+	char *error;
+	/* install status, protected by mutex */
+	mutex_t mutex;
+	cond_t cond;
+	int install_done;
+	int install_failed;
+	int percent;
+};
+
+static const char *pkg_data = NULL;
+static uint64_t pkg_size = 0;
+static const char *pkg_name = NULL;
+
+static struct install_job *jobs = NULL;
+static int num_jobs = 0;
+static int next_job = 0;
+static mutex_t jobs_mutex;
+static mutex_t print_mutex;
+
+static double time_diff(struct timeval *start, struct timeval *end)
+{
+	return (double)(end->tv_sec - start->tv_sec) + (double)(end->tv_usec - start->tv_usec) / 1000000.0;
+}
+
+static void job_print(struct install_job *job, const char *fmt, ...)
+{
+	va_list args;
+
+	mutex_lock(&print_mutex);
+	printf("[%s] ", job->udid);
+	va_start(args, fmt);
+	vprintf(fmt, args);
+	va_end(args);
+	printf("\n");
+	fflush(stdout);
+	mutex_unlock(&print_mutex);
+}
+
+static void job_fail(struct install_job *job, const char *fmt, ...)
+{
+	va_list args;
+	char buf[512];
+
+	va_start(args, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, args);
+	va_end(args);
+
+	job->error = strdup(buf);
+	job->result = -1;
+	job_print(job, "ERROR: %s", buf);
+}
+
+static void status_cb(plist_t command, plist_t status, void *user_data)
+{
+	struct install_job *job = (struct install_job*)user_data;
+	char *name = NULL;
+	char *error_name = NULL;
+	char *error_description = NULL;
+	uint64_t error_code = 0;
+	int percent = -1;
+
+	if (instproxy_status_get_error(status, &error_name, &error_description, &error_code) != INSTPROXY_E_SUCCESS) {
+		mutex_lock(&job->mutex);
+		if (!job->error) {
+			job->error = string_concat(error_name ? error_name : "Unknown error", (error_description) ? ": " : "", (error_description) ? error_description : "", NULL);
+		}
+		job->install_failed = 1;
+		job->install_done = 1;
+		cond_signal(&job->cond);
+		mutex_unlock(&job->mutex);
+		free(error_name);
+		free(error_description);
+		return;
+	}
+
+	instproxy_status_get_name(status, &name);
+	instproxy_status_get_percent_complete(status, &percent);
+
+	int report = 0;
+	mutex_lock(&job->mutex);
+	if (name && !strcmp(name, "Complete")) {
+		job->install_done = 1;
+		cond_signal(&job->cond);
+	} else if (percent >= 0 && percent / 10 != job->percent / 10) {
+		job->percent = percent;
+		report = 1;
+	}
+	mutex_unlock(&job->mutex);
+
+	if (report) {
+		job_print(job, "%s (%d%%)", name ? name : "Installing", percent);
+	}
+
+	free(name);
+}
+
+static int upload_package(struct install_job *job, idevice_t device, const char *pkg_path)
+{
+	afc_client_t afc = NULL;
+	uint64_t handle = 0;
+	struct timeval start, end;
+	int res = -1;
+
+	if (afc_client_start_service(device, &afc, TOOL_NAME) != AFC_E_SUCCESS) {
+		job_fail(job, "Could not start AFC service");
+		return -1;
+	}
+
+	afc_make_directory(afc, PKG_STAGING_DIR);
+
+	if (afc_file_open(afc, pkg_path, AFC_FOPEN_WRONLY, &handle) != AFC_E_SUCCESS) {
+		job_fail(job, "Could not open %s on the device", pkg_path);
+		afc_client_free(afc);
+		return -1;
+	}
+
+	gettimeofday(&start, NULL);
+	while (job->uploaded < pkg_size) {
+		uint32_t chunk = (pkg_size - job->uploaded > UPLOAD_CHUNK_SIZE) ? UPLOAD_CHUNK_SIZE : (uint32_t)(pkg_size - job->uploaded);
+		uint32_t written = 0;
+		if (afc_file_write(afc, handle, pkg_data + job->uploaded, chunk, &written) != AFC_E_SUCCESS || written == 0) {
+			break;
+		}
+		job->uploaded += written;
+	}
+	gettimeofday(&end, NULL);
+	afc_file_close(afc, handle);
+	afc_client_free(afc);
+
+	job->upload_time = time_diff(&start, &end);
+
+	if (job->uploaded < pkg_size) {
+		job_fail(job, "Upload failed after %" PRIu64 " of %" PRIu64 " bytes", job->uploaded, pkg_size);
+	} else {
+		job_print(job, "Uploaded %.1f MB in %.2f s (%.1f MB/s)", job->uploaded / 1048576.0, job->upload_time, (job->upload_time > 0) ? job->uploaded / 1048576.0 / job->upload_time : 0.0);
+		res = 0;
+	}
+
+	return res;
+}
+
+static void run_job(struct install_job *job)
+{
+	idevice_t device = NULL;
+	instproxy_client_t ipc = NULL;
+	struct timeval start, end;
+	char *pkg_path = NULL;
+
+	if (idevice_new_with_options(&device, job->udid, (job->use_network) ? IDEVICE_LOOKUP_NETWORK : IDEVICE_LOOKUP_USBMUX) != IDEVICE_E_SUCCESS) {
+		job_fail(job, "Device not found");
+		return;
+	}
+
+	/* the upload of this device runs while others are already installing */
+	pkg_path = string_build_path(PKG_STAGING_DIR, pkg_name, NULL);
+	if (upload_package(job, device, pkg_path) < 0) {
+		goto leave;
+	}
+
+	if (instproxy_client_start_service(device, &ipc, TOOL_NAME) != INSTPROXY_E_SUCCESS) {
+		job_fail(job, "Could not start installation_proxy service");
+		goto leave;
+	}
+
+	gettimeofday(&start, NULL);
+	if (instproxy_install(ipc, pkg_path, NULL, status_cb, job) != INSTPROXY_E_SUCCESS) {
+		job_fail(job, "Could not start installation");
+		goto leave;
+	}
+
+	mutex_lock(&job->mutex);
+	while (!job->install_done) {
+		cond_wait(&job->cond, &job->mutex);
+	}
+	mutex_unlock(&job->mutex);
+	gettimeofday(&end, NULL);
+	job->install_time = time_diff(&start, &end);
+
+	if (job->install_failed) {
+		job->result = -1;
+		job_print(job, "ERROR: Installation failed: %s", job->error ? job->error : "Unknown error");
+	} else {
+		job->result = 0;
+		job_print(job, "Installed in %.2f s", job->install_time);
+	}
+
+leave:
+	if (ipc) {
+		instproxy_client_free(ipc);
+	}
+	free(pkg_path);
+	idevice_free(device);
+}
+
+static void* worker_thread(void *arg)
+{
+	while (1) {
+		struct install_job *job = NULL;
+		mutex_lock(&jobs_mutex);
+		if (next_job < num_jobs) {
+			job = &jobs[next_job++];
+		}
+		mutex_unlock(&jobs_mutex);
+		if (!job)
+			break;
+		run_job(job);
+	}
+	return NULL;
+}
+
+static void print_usage(int argc, char **argv)
+{
+	char *name = NULL;
+
+	name = strrchr(argv[0], '/');
+	printf("Usage: %s [OPTIONS] PACKAGE\n", (name ? name + 1: argv[0]));
+	printf("\n");
+	printf("Installs an application package on many devices at once.\n");
+	printf("\n");
+	printf("The package is read once and uploaded to all devices in parallel, each\n");
+	printf("over its own AFC connection. Devices that finished uploading are\n");
+	printf("installing while the others are still uploading.\n");
+	printf("\n");
+	printf("  -u, --udid UDID\ttarget specific device by UDID, can be repeated;\n");
+	printf("  \t\t\tdefaults to all connected devices\n");
+	printf("  -n, --network\t\tconnect to network devices\n");
+	printf("  -j, --jobs NUM\tprocess at most NUM devices at the same time\n");
+	printf("  -d, --debug\t\tenable communication debugging\n");
+	printf("  -h, --help\t\tprints usage information\n");
+	printf("  -v, --version\t\tprints version information\n");
+	printf("\n");
+	printf("Homepage:    <" PACKAGE_URL ">\n");
+	printf("Bug Reports: <" PACKAGE_BUGREPORT ">\n");
+}
+
+int main(int argc, char **argv)
+{
+	const char **udids = NULL;
+	int num_udids = 0;
+	idevice_info_t *dev_list = NULL;
+	int use_network = 0;
+	int max_parallel = 0;
+	const char *pkg_file = NULL;
+	char *buffer = NULL;
+	THREAD_T *workers = NULL;
+	int num_workers;
+	int result = 0;
+	int i;
+
+#ifndef WIN32
+	signal(SIGPIPE, SIG_IGN);
+#endif
+	udids = (const char**)malloc(sizeof(char*) * argc);
+
+	/* parse cmdline args */
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-d") || !strcmp(argv[i], "--debug")) {
+			idevice_set_debug_level(1);
+			continue;
+		}
+		else if (!strcmp(argv[i], "-u") || !strcmp(argv[i], "--udid")) {
+			i++;
+			if (!argv[i] || !*argv[i]) {
+				print_usage(argc, argv);
+				return 0;
+			}
+			udids[num_udids++] = argv[i];
+			continue;
+		}
+		else if (!strcmp(argv[i], "-n") || !strcmp(argv[i], "--network")) {
+			use_network = 1;
+			continue;
+		}
+		else if (!strcmp(argv[i], "-j") || !strcmp(argv[i], "--jobs")) {
+			i++;
+			if (!argv[i] || (max_parallel = atoi(argv[i])) <= 0) {
+				print_usage(argc, argv);
+				return 0;
+			}
+			continue;
+		}
+		else if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
+			print_usage(argc, argv);
+			return 0;
+		}
+		else if (!strcmp(argv[i], "-v") || !strcmp(argv[i], "--version")) {
+			printf("%s %s\n", TOOL_NAME, PACKAGE_VERSION);
+			return 0;
+		}
+		else if (argv[i][0] != '-' && !pkg_file) {
+			pkg_file = argv[i];
+			continue;
+		}
+		else {
+			print_usage(argc, argv);
+			return 0;
+		}
+	}
+
+	if (!pkg_file) {
+		print_usage(argc, argv);
+		free(udids);
+		return 0;
+	}
+
+	/* map the package once, all uploads are served from the mapping */
+	if (buffer_map_from_filename(pkg_file, &buffer, &pkg_size) != 0) {
+		printf("ERROR: Could not read package %s\n", pkg_file);
+		free(udids);
+		return -1;
+	}
+	pkg_data = buffer;
+	pkg_name = strrchr(pkg_file, '/');
+	pkg_name = (pkg_name) ? pkg_name + 1 : pkg_file;
+
+	if (num_udids == 0) {
+		int count = 0;
+		if (idevice_get_device_list_extended(&dev_list, &count) < 0) {
+			printf("ERROR: Unable to retrieve device list!\n");
+			buffer_unmap(buffer, pkg_size);
+			free(udids);
+			return -1;
+		}
+		free(udids);
+		udids = (const char**)malloc(sizeof(char*) * (count + 1));
+		for (i = 0; i < count; i++) {
+			if ((dev_list[i]->conn_type == CONNECTION_NETWORK) == (use_network != 0)) {
+				udids[num_udids++] = dev_list[i]->udid;
+			}
+		}
+	}
+
+	if (num_udids == 0) {
+		printf("No device found.\n");
+		result = -1;
+		goto leave;
+	}
+
+	mutex_init(&jobs_mutex);
+	mutex_init(&print_mutex);
+
+	num_jobs = num_udids;
+	jobs = (struct install_job*)calloc(num_jobs, sizeof(struct install_job));
+	for (i = 0; i < num_jobs; i++) {
+		jobs[i].udid = udids[i];
+		jobs[i].use_network = use_network;
+		jobs[i].result = -1;
+		jobs[i].percent = -1;
+		mutex_init(&jobs[i].mutex);
+		cond_init(&jobs[i].cond);
+	}
+
+	/* let the status loops of all devices progress together; a lost or
+	 * silent device ends its job with an error status instead of hanging */
+	instproxy_set_status_executor(num_jobs, 0, INSTALL_STATUS_TIMEOUT);
+
+	num_workers = (max_parallel > 0 && max_parallel < num_jobs) ? max_parallel : num_jobs;
+	workers = (THREAD_T*)malloc(sizeof(THREAD_T) * num_workers);
+	for (i = 0; i < num_workers; i++) {
+		if (thread_new(&workers[i], worker_thread, NULL) != 0) {
+			workers[i] = THREAD_T_NULL;
+		}
+	}
+	for (i = 0; i < num_workers; i++) {
+		if (workers[i]) {
+			thread_join(workers[i]);
+			thread_free(workers[i]);
+		}
+	}
+	free(workers);
+
+	/* summary */
+	uint64_t total_uploaded = 0;
+	int num_failed = 0;
+	printf("\n");
+	for (i = 0; i < num_jobs; i++) {
+		struct install_job *job = &jobs[i];
+		total_uploaded += job->uploaded;
+		if (job->result == 0) {
+			printf("%s: OK, upload %.1f MB/s, install %.2f s\n", job->udid, (job->upload_time > 0) ? job->uploaded / 1048576.0 / job->upload_time : 0.0, job->install_time);
+		} else {
+			printf("%s: FAILED, %s\n", job->udid, job->error ? job->error : "Unknown error");
+			num_failed++;
+		}
+		free(job->error);
+		cond_destroy(&job->cond);
+		mutex_destroy(&job->mutex);
+	}
+	printf("%d of %d devices installed, %.1f MB uploaded in total\n", num_jobs - num_failed, num_jobs, total_uploaded / 1048576.0);
+	if (num_failed > 0) {
+		result = -1;
+	}
+
+	free(jobs);
+	mutex_destroy(&print_mutex);
+	mutex_destroy(&jobs_mutex);
+
+leave:
+	if (dev_list) {
+		idevice_device_list_extended_free(dev_list);
+	}
+	free(udids);
+	buffer_unmap(buffer, pkg_size);
+
+	return result;
+}
@@ -0,0 +1,567 @@
+/*
+ * idevicebench.c
+ * Measures throughput and latency of the protocol stack against a device
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#define TOOL_NAME "idevicebench"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/time.h>
+#ifndef WIN32
+#include <signal.h>
+#endif
+
+#include <libimobiledevice/libimobiledevice.h>
+#include <libimobiledevice/lockdown.h>
+#include <libimobiledevice/afc.h>
+#ifdef HAVE_FAKEDEVICE
+#include "fakedevice.h"
+#endif
+
+#define BENCH_FILE "idevicebench.tmp"
+#define BENCH_DEFAULT_SIZE (16 * 1024 * 1024)
+#define BENCH_DEFAULT_ITERATIONS 100
+#define BENCH_MAX_CHUNK_SIZES 16
+
+enum {
+	BENCH_AFC = 1 << 0,
+	BENCH_PLIST = 1 << 1,
+	BENCH_SERVICE = 1 << 2,
+	BENCH_SSL = 1 << 3,
+	BENCH_ALL = BENCH_AFC | BENCH_PLIST | BENCH_SERVICE
+};
+
+static const struct {
+	const char *name;
+	idevice_cipher_policy_t policy;
+} cipher_policies[] = {
+	{ "default", IDEVICE_CIPHER_POLICY_DEFAULT },
+	{ "aes-gcm", IDEVICE_CIPHER_POLICY_AES_GCM },
+	{ "chacha20", IDEVICE_CIPHER_POLICY_CHACHA20 },
+	{ "aes-cbc", IDEVICE_CIPHER_POLICY_AES_CBC }
+};
+#define NUM_CIPHER_POLICIES (int)(sizeof(cipher_policies) / sizeof(cipher_policies[0]))
+
+static const uint32_t default_chunk_sizes[] = { 4096, 16384, 65536, 262144, 1048576 };
+
+static double time_now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (double)tv.tv_sec + (double)tv.tv_usec / 1000000.0;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+	double x = *(const double*)a;
+	double y = *(const double*)b;
+	return (x < y) ? -1 : (x > y) ? 1 : 0;
+}
+
+/**
+ * Prints a result line for a series of measured operation latencies.
+ * The latencies are sorted in place.
+ */
+static void print_latencies(const char *name, double *samples, int count, double total)
+{
+	double sum = 0;
+	int i;
+
+	if (count == 0) {
+		printf("%s: no samples\n", name);
+		return;
+	}
+	for (i = 0; i < count; i++) {
+		sum += samples[i];
+	}
+	qsort(samples, count, sizeof(double), compare_double);
+	printf("%s: count=%d rate=%.1f/s min=%.3fms avg=%.3fms p50=%.3fms p95=%.3fms max=%.3fms\n",
+		name, count, (total > 0) ? count / total : 0.0,
+		samples[0] * 1000.0, sum / count * 1000.0, samples[count / 2] * 1000.0,
+		samples[(count * 95) / 100] * 1000.0, samples[count - 1] * 1000.0);
+}
+
+static void print_throughput(const char *name, uint32_t chunk_size, uint64_t bytes, double elapsed, uint32_t ops)
+{
+	printf("%s: chunk=%u bytes=%llu time=%.3fs rate=%.2fMB/s ops=%u latency=%.3fms\n",
+		name, chunk_size, (unsigned long long)bytes, elapsed,
+		(elapsed > 0) ? bytes / 1048576.0 / elapsed : 0.0, ops,
+		(ops > 0) ? elapsed / ops * 1000.0 : 0.0);
+}
+
+static int bench_service(idevice_t device, int iterations)
+{
+	double *samples = (double*)malloc(sizeof(double) * iterations);
+	int count = 0;
+	double start = time_now();
+	int i;
+
+	for (i = 0; i < iterations; i++) {
+		lockdownd_client_t lockdown = NULL;
+		lockdownd_service_descriptor_t service = NULL;
+		double t = time_now();
+
+		if (lockdownd_client_new_with_handshake(device, &lockdown, TOOL_NAME) != LOCKDOWN_E_SUCCESS) {
+			fprintf(stderr, "ERROR: Could not connect to lockdownd\n");
+			break;
+		}
+		lockdownd_error_t lerr = lockdownd_start_service(lockdown, AFC_SERVICE_NAME, &service);
+		lockdownd_client_free(lockdown);
+		if (lerr != LOCKDOWN_E_SUCCESS) {
+			fprintf(stderr, "ERROR: Could not start %s: %d\n", AFC_SERVICE_NAME, lerr);
+			break;
+		}
+		lockdownd_service_descriptor_free(service);
+		samples[count++] = time_now() - t;
+	}
+
+	print_latencies("service start", samples, count, time_now() - start);
+	free(samples);
+
+	return (count == iterations) ? 0 : -1;
+}
+
+static int bench_plist(idevice_t device, int iterations)
+{
+	lockdownd_client_t lockdown = NULL;
+	double *samples = NULL;
+	int count = 0;
+	int i;
+
+	if (lockdownd_client_new_with_handshake(device, &lockdown, TOOL_NAME) != LOCKDOWN_E_SUCCESS) {
+		fprintf(stderr, "ERROR: Could not connect to lockdownd\n");
+		return -1;
+	}
+
+	/* each GetValue is one plist message in each direction over SSL */
+	samples = (double*)malloc(sizeof(double) * iterations);
+	double start = time_now();
+	for (i = 0; i < iterations; i++) {
+		plist_t value = NULL;
+		double t = time_now();
+		if (lockdownd_get_value(lockdown, NULL, "ProductVersion", &value) != LOCKDOWN_E_SUCCESS) {
+			fprintf(stderr, "ERROR: GetValue failed\n");
+			break;
+		}
+		samples[count++] = time_now() - t;
+		plist_free(value);
+	}
+
+	print_latencies("plist roundtrip", samples, count, time_now() - start);
+	free(samples);
+	lockdownd_client_free(lockdown);
+
+	return (count == iterations) ? 0 : -1;
+}
+
+static int bench_afc_chunk(afc_client_t afc, const char *name, char *buffer, uint32_t chunk_size, uint64_t total)
+{
+	uint64_t handle = 0;
+	uint64_t done = 0;
+	uint32_t ops = 0;
+	double start;
+	char label[64];
+
+	if (afc_file_open(afc, BENCH_FILE, AFC_FOPEN_WR, &handle) != AFC_E_SUCCESS) {
+		fprintf(stderr, "ERROR: Could not create %s on the device\n", BENCH_FILE);
+		return -1;
+	}
+	start = time_now();
+	while (done < total) {
+		uint32_t amount = (total - done < chunk_size) ? (uint32_t)(total - done) : chunk_size;
+		uint32_t written = 0;
+		if (afc_file_write(afc, handle, buffer, amount, &written) != AFC_E_SUCCESS || written == 0) {
+			break;
+		}
+		done += written;
+		ops++;
+	}
+	afc_file_close(afc, handle);
+	snprintf(label, sizeof(label), "%s write", name);
+	print_throughput(label, chunk_size, done, time_now() - start, ops);
+	if (done < total) {
+		fprintf(stderr, "ERROR: Write failed after %llu bytes\n", (unsigned long long)done);
+		return -1;
+	}
+
+	if (afc_file_open(afc, BENCH_FILE, AFC_FOPEN_RDONLY, &handle) != AFC_E_SUCCESS) {
+		fprintf(stderr, "ERROR: Could not open %s on the device\n", BENCH_FILE);
+		return -1;
+	}
+	done = 0;
+	ops = 0;
+	start = time_now();
+	while (done < total) {
+		uint32_t bytes = 0;
+		if (afc_file_read(afc, handle, buffer, chunk_size, &bytes) != AFC_E_SUCCESS || bytes == 0) {
+			break;
+		}
+		done += bytes;
+		ops++;
+	}
+	afc_file_close(afc, handle);
+	snprintf(label, sizeof(label), "%s read", name);
+	print_throughput(label, chunk_size, done, time_now() - start, ops);
+	if (done < total) {
+		fprintf(stderr, "ERROR: Read failed after %llu bytes\n", (unsigned long long)done);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int bench_afc(idevice_t device, const uint32_t *chunk_sizes, int num_chunk_sizes, uint64_t total)
+{
+	afc_client_t afc = NULL;
+	uint32_t max_chunk = 0;
+	int res = 0;
+	int i;
+
+	if (afc_client_start_service(device, &afc, TOOL_NAME) != AFC_E_SUCCESS) {
+		fprintf(stderr, "ERROR: Could not start AFC service\n");
+		return -1;
+	}
+
+	for (i = 0; i < num_chunk_sizes; i++) {
+		if (chunk_sizes[i] > max_chunk)
+			max_chunk = chunk_sizes[i];
+	}
+	char *buffer = (char*)malloc(max_chunk);
+	if (!buffer) {
+		afc_client_free(afc);
+		return -1;
+	}
+	for (i = 0; i < (int)max_chunk; i++) {
+		buffer[i] = (char)(i * 31);
+	}
+
+	for (i = 0; i < num_chunk_sizes && res == 0; i++) {
+		res = bench_afc_chunk(afc, "afc", buffer, chunk_sizes[i], total);
+	}
+
+	afc_remove_path(afc, BENCH_FILE);
+	free(buffer);
+	afc_client_free(afc);
+
+	return res;
+}
+
+/**
+ * Measures the SSL handshake and, if the device runs AFC over SSL, the AFC
+ * throughput with the largest chunk size for one cipher policy.
+ */
+static int bench_ssl_policy(idevice_t device, int index, uint32_t chunk_size, uint64_t total, int iterations)
+{
+	lockdownd_client_t lockdown = NULL;
+	lockdownd_service_descriptor_t service = NULL;
+	afc_client_t afc = NULL;
+	char *cipher = NULL;
+	char label[64];
+	double *samples = NULL;
+	int count = 0;
+	int res = 0;
+	int i;
+
+	idevice_set_cipher_policy(device, cipher_policies[index].policy);
+
+	/* the first handshake is a full one, the others resume the session */
+	samples = (double*)malloc(sizeof(double) * iterations);
+	double start = time_now();
+	for (i = 0; i < iterations; i++) {
+		double t = time_now();
+		if (lockdownd_client_new_with_handshake(device, &lockdown, TOOL_NAME) != LOCKDOWN_E_SUCCESS) {
+			fprintf(stderr, "ERROR: Could not connect to lockdownd\n");
+			break;
+		}
+		samples[count++] = time_now() - t;
+		if (i < iterations - 1) {
+			lockdownd_client_free(lockdown);
+			lockdown = NULL;
+		}
+	}
+	idevice_get_cipher(device, &cipher);
+	printf("ssl: policy=%s cipher=%s\n", cipher_policies[index].name, (cipher) ? cipher : "none");
+	free(cipher);
+	snprintf(label, sizeof(label), "ssl %s handshake", cipher_policies[index].name);
+	print_latencies(label, samples, count, time_now() - start);
+	free(samples);
+	if (!lockdown) {
+		return -1;
+	}
+
+	lockdownd_error_t lerr = lockdownd_start_service(lockdown, AFC_SERVICE_NAME, &service);
+	lockdownd_client_free(lockdown);
+	if (lerr != LOCKDOWN_E_SUCCESS) {
+		fprintf(stderr, "ERROR: Could not start %s: %d\n", AFC_SERVICE_NAME, lerr);
+		return -1;
+	}
+	if (!service->ssl_enabled) {
+		/* only the lockdown session is encrypted then */
+		printf("ssl %s afc: plaintext\n", cipher_policies[index].name);
+		lockdownd_service_descriptor_free(service);
+		return 0;
+	}
+	afc_error_t aerr = afc_client_new(device, service, &afc);
+	lockdownd_service_descriptor_free(service);
+	if (aerr != AFC_E_SUCCESS) {
+		fprintf(stderr, "ERROR: Could not connect to AFC: %d\n", aerr);
+		return -1;
+	}
+
+	char *buffer = (char*)malloc(chunk_size);
+	if (!buffer) {
+		afc_client_free(afc);
+		return -1;
+	}
+	for (i = 0; i < (int)chunk_size; i++) {
+		buffer[i] = (char)(i * 31);
+	}
+	snprintf(label, sizeof(label), "ssl %s afc", cipher_policies[index].name);
+	res = bench_afc_chunk(afc, label, buffer, chunk_size, total);
+	afc_remove_path(afc, BENCH_FILE);
+	free(buffer);
+	afc_client_free(afc);
+
+	return res;
+}
+
+static int bench_ssl(idevice_t device, int policy, const uint32_t *chunk_sizes, int num_chunk_sizes, uint64_t total, int iterations)
+{
+	uint32_t max_chunk = 0;
+	int res = 0;
+	int i;
+
+	for (i = 0; i < num_chunk_sizes; i++) {
+		if (chunk_sizes[i] > max_chunk)
+			max_chunk = chunk_sizes[i];
+	}
+	for (i = 0; i < NUM_CIPHER_POLICIES; i++) {
+		if (policy >= 0 && i != policy)
+			continue;
+		if (bench_ssl_policy(device, i, max_chunk, total, iterations) < 0)
+			res = -1;
+	}
+	idevice_set_cipher_policy(device, IDEVICE_CIPHER_POLICY_DEFAULT);
+
+	return res;
+}
+
+static void print_usage(int argc, char **argv)
+{
+	char *name = NULL;
+
+	name = strrchr(argv[0], '/');
+	printf("Usage: %s [OPTIONS] [afc|plist|service|ssl ...]\n", (name ? name + 1: argv[0]));
+	printf("\n");
+	printf("Measures throughput and latency of the protocol stack on a device.\n");
+	printf("\n");
+	printf("Runs the given benchmarks, or all but ssl:\n");
+	printf("  afc\t\t\tafc_file_write/afc_file_read throughput per chunk size\n");
+	printf("  plist\t\t\tlockdown plist message round trips\n");
+	printf("  service\t\tlockdown connection and StartService latency\n");
+	printf("  ssl\t\t\tSSL handshake and AFC throughput per cipher policy\n");
+	printf("\n");
+	printf("Each result is printed as one line of key=value pairs.\n");
+	printf("\n");
+	printf("  -u, --udid UDID\ttarget specific device by UDID\n");
+	printf("  -n, --network\t\tconnect to network device\n");
+#ifdef HAVE_FAKEDEVICE
+	printf("  -l, --loopback\t\tuse a device emulated in this process instead\n");
+#endif
+	printf("  -c, --chunk SIZE\tAFC chunk size in bytes, can be repeated\n");
+	printf("  -s, --size SIZE\tbytes transferred per AFC chunk size (default 16 MiB)\n");
+	printf("  -i, --iterations NUM\tplist, service and handshake iterations (default %d)\n", BENCH_DEFAULT_ITERATIONS);
+	printf("  -C, --cipher POLICY\tonly benchmark the default, aes-gcm, chacha20 or aes-cbc\n");
+	printf("  \t\t\tcipher policy with ssl\n");
+	printf("  -d, --debug\t\tenable communication debugging\n");
+	printf("  -h, --help\t\tprints usage information\n");
+	printf("  -v, --version\t\tprints version information\n");
+	printf("\n");
+	printf("Homepage:    <" PACKAGE_URL ">\n");
+	printf("Bug Reports: <" PACKAGE_BUGREPORT ">\n");
+}
+
+int main(int argc, char **argv)
+{
+	idevice_t device = NULL;
+	const char *udid = NULL;
+	int use_network = 0;
+#ifdef HAVE_FAKEDEVICE
+	int use_loopback = 0;
+#endif
+	uint32_t chunk_sizes[BENCH_MAX_CHUNK_SIZES];
+	int num_chunk_sizes = 0;
+	uint64_t total = BENCH_DEFAULT_SIZE;
+	int iterations = BENCH_DEFAULT_ITERATIONS;
+	int benchmarks = 0;
+	int policy = -1;
+	int result = 0;
+	int i;
+
+#ifndef WIN32
+	signal(SIGPIPE, SIG_IGN);
+#endif
+
+	/* parse cmdline args */
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-d") || !strcmp(argv[i], "--debug")) {
+			idevice_set_debug_level(1);
+			continue;
+		}
+		else if (!strcmp(argv[i], "-u") || !strcmp(argv[i], "--udid")) {
+			i++;
+			if (!argv[i] || !*argv[i]) {
+				print_usage(argc, argv);
+				return 0;
+			}
+			udid = argv[i];
+			continue;
+		}
+		else if (!strcmp(argv[i], "-n") || !strcmp(argv[i], "--network")) {
+			use_network = 1;
+			continue;
+		}
+#ifdef HAVE_FAKEDEVICE
+		else if (!strcmp(argv[i], "-l") || !strcmp(argv[i], "--loopback")) {
+			use_loopback = 1;
+			continue;
+		}
+#endif
+		else if (!strcmp(argv[i], "-c") || !strcmp(argv[i], "--chunk")) {
+			i++;
+			long size = (argv[i]) ? strtol(argv[i], NULL, 0) : 0;
+			if (size <= 0 || size > 0x7FFFFFFF || num_chunk_sizes >= BENCH_MAX_CHUNK_SIZES) {
+				print_usage(argc, argv);
+				return 0;
+			}
+			chunk_sizes[num_chunk_sizes++] = (uint32_t)size;
+			continue;
+		}
+		else if (!strcmp(argv[i], "-s") || !strcmp(argv[i], "--size")) {
+			i++;
+			long long size = (argv[i]) ? strtoll(argv[i], NULL, 0) : 0;
+			if (size <= 0) {
+				print_usage(argc, argv);
+				return 0;
+			}
+			total = (uint64_t)size;
+			continue;
+		}
+		else if (!strcmp(argv[i], "-i") || !strcmp(argv[i], "--iterations")) {
+			i++;
+			if (!argv[i] || (iterations = atoi(argv[i])) <= 0) {
+				print_usage(argc, argv);
+				return 0;
+			}
+			continue;
+		}
+		else if (!strcmp(argv[i], "-C") || !strcmp(argv[i], "--cipher")) {
+			i++;
+			for (policy = 0; argv[i] && policy < NUM_CIPHER_POLICIES; policy++) {
+				if (!strcmp(argv[i], cipher_policies[policy].name))
+					break;
+			}
+			if (!argv[i] || policy == NUM_CIPHER_POLICIES) {
+				print_usage(argc, argv);
+				return 0;
+			}
+			continue;
+		}
+		else if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
+			print_usage(argc, argv);
+			return 0;
+		}
+		else if (!strcmp(argv[i], "-v") || !strcmp(argv[i], "--version")) {
+			printf("%s %s\n", TOOL_NAME, PACKAGE_VERSION);
+			return 0;
+		}
+		else if (!strcmp(argv[i], "afc")) {
+			benchmarks |= BENCH_AFC;
+			continue;
+		}
+		else if (!strcmp(argv[i], "plist")) {
+			benchmarks |= BENCH_PLIST;
+			continue;
+		}
+		else if (!strcmp(argv[i], "service")) {
+			benchmarks |= BENCH_SERVICE;
+			continue;
+		}
+		else if (!strcmp(argv[i], "ssl")) {
+			benchmarks |= BENCH_SSL;
+			continue;
+		}
+		else {
+			print_usage(argc, argv);
+			return 0;
+		}
+	}
+
+	if (benchmarks == 0) {
+		benchmarks = BENCH_ALL;
+	}
+	if (num_chunk_sizes == 0) {
+		num_chunk_sizes = sizeof(default_chunk_sizes) / sizeof(default_chunk_sizes[0]);
+		memcpy(chunk_sizes, default_chunk_sizes, sizeof(default_chunk_sizes));
+	}
+
+#ifdef HAVE_FAKEDEVICE
+	if (use_loopback) {
+		if (fakedevice_new(&device) < 0) {
+			printf("ERROR: Could not set up the emulated device!\n");
+			return -1;
+		}
+	} else
+#endif
+	if (idevice_new_with_options(&device, udid, (use_network) ? IDEVICE_LOOKUP_NETWORK : IDEVICE_LOOKUP_USBMUX) != IDEVICE_E_SUCCESS) {
+		if (udid) {
+			printf("ERROR: Device %s not found!\n", udid);
+		} else {
+			printf("ERROR: No device found!\n");
+		}
+		return -1;
+	}
+
+	if ((benchmarks & BENCH_SERVICE) && bench_service(device, iterations) < 0) {
+		result = -1;
+	}
+	if ((benchmarks & BENCH_PLIST) && bench_plist(device, iterations) < 0) {
+		result = -1;
+	}
+	if ((benchmarks & BENCH_AFC) && bench_afc(device, chunk_sizes, num_chunk_sizes, total) < 0) {
+		result = -1;
+	}
+	if ((benchmarks & BENCH_SSL) && bench_ssl(device, policy, chunk_sizes, num_chunk_sizes, total, iterations) < 0) {
+		result = -1;
+	}
+
+#ifdef HAVE_FAKEDEVICE
+	if (use_loopback) {
+		fakedevice_free(device);
+	} else
+#endif
+	idevice_free(device);
+
+	return result;
+}
@@ -30,10 +30,14 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #ifndef WIN32
 #include <signal.h>
 #endif
 #include "common/utils.h"
+#include "common/thread.h"
 
 #include <libimobiledevice/libimobiledevice.h>
 #include <libimobiledevice/lockdown.h>
@@ -47,6 +51,10 @@
 #define S_IFSOCK S_IFREG
 #endif
 
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
 const char* target_directory = NULL;
 static int extract_raw_crash_reports = 0;
 static int keep_crash_reports = 0;
@@ -100,200 +108,422 @@ static int extract_raw_crash_report(const char* filename)
 	return res;
 }
 
-static int afc_client_copy_and_remove_crash_reports(afc_client_t afc, const char* device_directory, const char* host_directory)
+#define CRASH_REPORT_DEFAULT_CONNECTIONS 4
+#define CRASH_REPORT_MAX_CONNECTIONS 16
+#define CRASH_REPORT_READ_CHUNK_SIZE 0x100000
+#define CRASH_REPORT_WRITE_QUEUE_LIMIT 0x2000000
+
+struct crash_report_entry {
+	char *device_path;
+	char *host_path;
+	afc_stat_t st;
+	char *data;
+	int remove;
+	struct crash_report_entry *next_write;
+};
+
+struct crash_report_pull {
+	struct crash_report_entry *entries;
+	unsigned int num_entries;
+	unsigned int capacity;
+	const char *host_directory;
+	uint64_t since;
+	/* files are handed out to the readers in walk order */
+	unsigned int next_file;
+	/* queue of files read completely, waiting to be written */
+	struct crash_report_entry *write_first;
+	struct crash_report_entry *write_last;
+	uint64_t write_queued;
+	unsigned int readers_active;
+	mutex_t mutex;
+	cond_t write_cond;
+	cond_t space_cond;
+};
+
+struct crash_report_reader {
+	struct crash_report_pull *pull;
+	afc_client_t afc;
+	THREAD_T thread;
+};
+
+/**
+ * Builds the host path for a device path relative to the walk root,
+ * stripping the ".synced" extension as seen on iOS 5.
+ */
+static char *crash_report_host_path(const char *host_directory, const char *relative)
 {
-	afc_error_t afc_error;
-	int k;
-	int res = -1;
-	int crash_report_count = 0;
-	uint64_t handle;
-	char source_filename[512];
-	char target_filename[512];
-
-	if (!afc)
-		return res;
-
-	char** list = NULL;
-	afc_error = afc_read_directory(afc, device_directory, &list);
-	if (afc_error != AFC_E_SUCCESS) {
-		fprintf(stderr, "ERROR: Could not read device directory '%s'\n", device_directory);
-		return res;
+	char *path = string_build_path(host_directory, relative, NULL);
+	if (!path)
+		return NULL;
+	char *p = strrchr(path, '.');
+	if (p != NULL && !strncmp(p, ".synced", 7) && !strchr(p, '/')) {
+		*p = '\0';
 	}
+	return path;
+}
 
-	/* ensure we have a trailing slash */
-	strcpy(source_filename, device_directory);
-	if (source_filename[strlen(source_filename)-1] != '/') {
-		strcat(source_filename, "/");
-	}
-	int device_directory_length = strlen(source_filename);
+static int crash_report_walk_cb(const char *path, const afc_stat_t *st, void *user_data)
+{
+	struct crash_report_pull *pull = (struct crash_report_pull*)user_data;
 
-	/* ensure we have a trailing slash */
-	strcpy(target_filename, host_directory);
-	if (target_filename[strlen(target_filename)-1] != '/') {
-		strcat(target_filename, "/");
+	/* make the path relative to the walk root "." */
+	if (!strcmp(path, "."))
+		return 0;
+	if (!strncmp(path, "./", 2))
+		path += 2;
+
+	if (st->type != AFC_FILE_TYPE_DIRECTORY) {
+		if (st->type != AFC_FILE_TYPE_REGULAR && st->type != AFC_FILE_TYPE_SYMLINK)
+			return 0;
+		if (pull->since && st->mtime < pull->since)
+			return 0;
 	}
-	int host_directory_length = strlen(target_filename);
 
-	/* loop over file entries */
-	for (k = 0; list[k]; k++) {
-		if (!strcmp(list[k], ".") || !strcmp(list[k], "..")) {
-			continue;
+	if (pull->num_entries == pull->capacity) {
+		unsigned int capacity = (pull->capacity) ? pull->capacity * 2 : 256;
+		struct crash_report_entry *entries = (struct crash_report_entry*)realloc(pull->entries, sizeof(struct crash_report_entry) * capacity);
+		if (!entries) {
+			fprintf(stderr, "ERROR: Out of memory\n");
+			return -1;
 		}
+		pull->entries = entries;
+		pull->capacity = capacity;
+	}
 
-		char **fileinfo = NULL;
-		struct stat stbuf;
-		memset(&stbuf, '\0', sizeof(struct stat));
+	struct crash_report_entry *entry = &pull->entries[pull->num_entries];
+	memset(entry, '\0', sizeof(struct crash_report_entry));
+	entry->device_path = string_build_path(".", path, NULL);
+	entry->host_path = crash_report_host_path(pull->host_directory, path);
+	entry->st = *st;
+	if (!entry->device_path || !entry->host_path) {
+		free(entry->device_path);
+		free(entry->host_path);
+		fprintf(stderr, "ERROR: Out of memory\n");
+		return -1;
+	}
+	pull->num_entries++;
 
-		/* assemble absolute source filename */
-		strcpy(((char*)source_filename) + device_directory_length, list[k]);
+	/* directories are reported before their contents */
+	if (st->type == AFC_FILE_TYPE_DIRECTORY) {
+#ifdef WIN32
+		mkdir(entry->host_path);
+#else
+		mkdir(entry->host_path, 0755);
+#endif
+	}
 
-		/* assemble absolute target filename */
-		char* p = strrchr(list[k], '.');
-		if (p != NULL && !strncmp(p, ".synced", 7)) {
-			/* make sure to strip ".synced" extension as seen on iOS 5 */
-			int newlen = strlen(list[k]) - 7;
-			strncpy(((char*)target_filename) + host_directory_length, list[k], newlen);
-			target_filename[host_directory_length + newlen] = '\0';
-		} else {
-			strcpy(((char*)target_filename) + host_directory_length, list[k]);
-		}
+	return 0;
+}
 
-		/* get file information */
-		afc_get_file_info(afc, source_filename, &fileinfo);
-		if (!fileinfo) {
-			printf("Failed to read information for '%s'. Skipping...\n", source_filename);
-			continue;
-		}
+static void crash_report_write_file(struct crash_report_pull *pull, struct crash_report_entry *entry)
+{
+	int output = open(entry->host_path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+	if (output < 0) {
+		fprintf(stderr, "Unable to open local file '%s'. Skipping...\n", entry->host_path);
+		return;
+	}
 
-		/* parse file information */
-		int i;
-		for (i = 0; fileinfo[i]; i+=2) {
-			if (!strcmp(fileinfo[i], "st_size")) {
-				stbuf.st_size = atoll(fileinfo[i+1]);
-			} else if (!strcmp(fileinfo[i], "st_ifmt")) {
-				if (!strcmp(fileinfo[i+1], "S_IFREG")) {
-					stbuf.st_mode = S_IFREG;
-				} else if (!strcmp(fileinfo[i+1], "S_IFDIR")) {
-					stbuf.st_mode = S_IFDIR;
-				} else if (!strcmp(fileinfo[i+1], "S_IFLNK")) {
-					stbuf.st_mode = S_IFLNK;
-				} else if (!strcmp(fileinfo[i+1], "S_IFBLK")) {
-					stbuf.st_mode = S_IFBLK;
-				} else if (!strcmp(fileinfo[i+1], "S_IFCHR")) {
-					stbuf.st_mode = S_IFCHR;
-				} else if (!strcmp(fileinfo[i+1], "S_IFIFO")) {
-					stbuf.st_mode = S_IFIFO;
-				} else if (!strcmp(fileinfo[i+1], "S_IFSOCK")) {
-					stbuf.st_mode = S_IFSOCK;
-				}
-			} else if (!strcmp(fileinfo[i], "st_nlink")) {
-				stbuf.st_nlink = atoi(fileinfo[i+1]);
-			} else if (!strcmp(fileinfo[i], "st_mtime")) {
-				stbuf.st_mtime = (time_t)(atoll(fileinfo[i+1]) / 1000000000);
-			} else if (!strcmp(fileinfo[i], "LinkTarget")) {
-				/* report latest crash report filename */
-				printf("Link: %s\n", (char*)target_filename + strlen(target_directory));
-
-				/* remove any previous symlink */
-				if (file_exists(target_filename)) {
-					remove(target_filename);
-				}
+	uint64_t written = 0;
+	while (written < entry->st.size) {
+		ssize_t w = write(output, entry->data + written, (size_t)(entry->st.size - written));
+		if (w <= 0)
+			break;
+		written += (uint64_t)w;
+	}
+	close(output);
+	if (written < entry->st.size) {
+		fprintf(stderr, "Unable to write local file '%s'. Skipping...\n", entry->host_path);
+		remove(entry->host_path);
+		return;
+	}
 
 #ifndef WIN32
-				/* use relative filename */
-				char* b = strrchr(fileinfo[i+1], '/');
-				if (b == NULL) {
-					b = fileinfo[i+1];
-				} else {
-					b++;
-				}
-
-				/* create a symlink pointing to latest log */
-				if (symlink(b, target_filename) < 0) {
-					fprintf(stderr, "Can't create symlink to %s\n", b);
-				}
+	struct timeval times[2];
+	times[0].tv_sec = times[1].tv_sec = (time_t)(entry->st.mtime / 1000000000);
+	times[0].tv_usec = times[1].tv_usec = (suseconds_t)((entry->st.mtime % 1000000000) / 1000);
+	utimes(entry->host_path, times);
 #endif
 
-				if (!keep_crash_reports)
-					afc_remove_path(afc, source_filename);
+	printf("%s: %s\n", (keep_crash_reports ? "Copy": "Move"), entry->host_path + strlen(pull->host_directory));
 
-				res = 0;
-			}
+	/* extract raw crash information into separate '.crash' file */
+	if (extract_raw_crash_reports) {
+		extract_raw_crash_report(entry->host_path);
+	}
+
+	entry->remove = 1;
+}
+
+/**
+ * Writes the files read by the reader threads to the host, so that the
+ * readers can go on with the next file right away.
+ */
+static void crash_report_writer(struct crash_report_pull *pull)
+{
+	mutex_lock(&pull->mutex);
+	while (1) {
+		while (!pull->write_first && pull->readers_active > 0) {
+			cond_wait(&pull->write_cond, &pull->mutex);
 		}
+		struct crash_report_entry *entry = pull->write_first;
+		if (!entry)
+			break;
+		pull->write_first = entry->next_write;
+		if (!pull->write_first)
+			pull->write_last = NULL;
+		mutex_unlock(&pull->mutex);
+
+		crash_report_write_file(pull, entry);
+		free(entry->data);
+		entry->data = NULL;
+
+		mutex_lock(&pull->mutex);
+		pull->write_queued -= entry->st.size;
+		cond_signal(&pull->space_cond);
+	}
+	mutex_unlock(&pull->mutex);
+}
 
-		/* free file information */
-		afc_dictionary_free(fileinfo);
+static afc_error_t crash_report_read_file(afc_client_t afc, struct crash_report_entry *entry)
+{
+	uint64_t handle = 0;
+	uint64_t got = 0;
 
-		/* recurse into child directories */
-		if (S_ISDIR(stbuf.st_mode)) {
-#ifdef WIN32
-			mkdir(target_filename);
-#else
-			mkdir(target_filename, 0755);
-#endif
-			res = afc_client_copy_and_remove_crash_reports(afc, source_filename, target_filename);
-
-			/* remove directory from device */
-			if (!keep_crash_reports)
-				afc_remove_path(afc, source_filename);
-		} else if (S_ISREG(stbuf.st_mode)) {
-			/* copy file to host */
-			afc_error = afc_file_open(afc, source_filename, AFC_FOPEN_RDONLY, &handle);
-			if(afc_error != AFC_E_SUCCESS) {
-				if (afc_error == AFC_E_OBJECT_NOT_FOUND) {
-					continue;
-				}
-				fprintf(stderr, "Unable to open device file '%s' (%d). Skipping...\n", source_filename, afc_error);
-				continue;
-			}
+	afc_error_t afc_error = afc_file_open(afc, entry->device_path, AFC_FOPEN_RDONLY, &handle);
+	if (afc_error != AFC_E_SUCCESS)
+		return afc_error;
 
-			FILE* output = fopen(target_filename, "wb");
-			if(output == NULL) {
-				fprintf(stderr, "Unable to open local file '%s'. Skipping...\n", target_filename);
-				afc_file_close(afc, handle);
-				continue;
-			}
+	entry->data = (char*)malloc((entry->st.size > 0) ? (size_t)entry->st.size : 1);
+	if (!entry->data) {
+		afc_file_close(afc, handle);
+		return AFC_E_NO_MEM;
+	}
+	while (got < entry->st.size) {
+		uint64_t remaining = entry->st.size - got;
+		uint32_t amount = (remaining > CRASH_REPORT_READ_CHUNK_SIZE) ? CRASH_REPORT_READ_CHUNK_SIZE : (uint32_t)remaining;
+		uint32_t bytes_read = 0;
+		afc_error = afc_file_read_pipelined(afc, handle, entry->data + got, amount, 0, 0, &bytes_read);
+		if (afc_error != AFC_E_SUCCESS || bytes_read == 0)
+			break;
+		got += bytes_read;
+	}
+	afc_file_close(afc, handle);
 
-			printf("%s: %s\n", (keep_crash_reports ? "Copy": "Move") , (char*)target_filename + strlen(target_directory));
+	if (afc_error == AFC_E_SUCCESS && got != entry->st.size) {
+		fprintf(stderr, "File size mismatch. Skipping...\n");
+		afc_error = AFC_E_IO_ERROR;
+	}
+	if (afc_error != AFC_E_SUCCESS) {
+		free(entry->data);
+		entry->data = NULL;
+	}
+
+	return afc_error;
+}
+
+static void* crash_report_reader_thread(void *arg)
+{
+	struct crash_report_reader *reader = (struct crash_report_reader*)arg;
+	struct crash_report_pull *pull = reader->pull;
+
+	mutex_lock(&pull->mutex);
+	while (1) {
+		while (pull->next_file < pull->num_entries && pull->entries[pull->next_file].st.type != AFC_FILE_TYPE_REGULAR) {
+			pull->next_file++;
+		}
+		if (pull->next_file >= pull->num_entries)
+			break;
+		struct crash_report_entry *entry = &pull->entries[pull->next_file++];
+
+		/* don't let reading get too far ahead of writing */
+		while (pull->write_queued > 0 && pull->write_queued + entry->st.size > CRASH_REPORT_WRITE_QUEUE_LIMIT) {
+			cond_wait(&pull->space_cond, &pull->mutex);
+		}
+		pull->write_queued += entry->st.size;
+		mutex_unlock(&pull->mutex);
 
-			uint32_t bytes_read = 0;
-			uint32_t bytes_total = 0;
-			unsigned char data[0x1000];
+		afc_error_t afc_error = crash_report_read_file(reader->afc, entry);
+		if (afc_error != AFC_E_SUCCESS && afc_error != AFC_E_OBJECT_NOT_FOUND) {
+			fprintf(stderr, "Unable to copy device file '%s' (%d). Skipping...\n", entry->device_path, afc_error);
+		}
 
-			afc_error = afc_file_read(afc, handle, (char*)data, 0x1000, &bytes_read);
-			while(afc_error == AFC_E_SUCCESS && bytes_read > 0) {
-				fwrite(data, 1, bytes_read, output);
-				bytes_total += bytes_read;
-				afc_error = afc_file_read(afc, handle, (char*)data, 0x1000, &bytes_read);
+		mutex_lock(&pull->mutex);
+		if (entry->data) {
+			entry->next_write = NULL;
+			if (pull->write_last) {
+				pull->write_last->next_write = entry;
+			} else {
+				pull->write_first = entry;
 			}
-			afc_file_close(afc, handle);
-			fclose(output);
+			pull->write_last = entry;
+			cond_signal(&pull->write_cond);
+		} else {
+			pull->write_queued -= entry->st.size;
+			cond_signal(&pull->space_cond);
+		}
+	}
+	pull->readers_active--;
+	cond_signal(&pull->write_cond);
+	/* pass the wakeup on to other readers waiting for space */
+	cond_signal(&pull->space_cond);
+	mutex_unlock(&pull->mutex);
+
+	return NULL;
+}
+
+static void crash_report_link(struct crash_report_pull *pull, afc_client_t afc, struct crash_report_entry *entry)
+{
+	afc_stat_t st;
+	char *link_target = NULL;
 
-			if ((uint32_t)stbuf.st_size != bytes_total) {
-				fprintf(stderr, "File size mismatch. Skipping...\n");
+	if (afc_get_file_info_struct(afc, entry->device_path, &st, &link_target) != AFC_E_SUCCESS || !link_target) {
+		printf("Failed to read information for '%s'. Skipping...\n", entry->device_path);
+		free(link_target);
+		return;
+	}
+
+	/* report latest crash report filename */
+	printf("Link: %s\n", entry->host_path + strlen(pull->host_directory));
+
+	/* remove any previous symlink */
+	if (file_exists(entry->host_path)) {
+		remove(entry->host_path);
+	}
+
+#ifndef WIN32
+	/* use relative filename */
+	char* b = strrchr(link_target, '/');
+	if (b == NULL) {
+		b = link_target;
+	} else {
+		b++;
+	}
+
+	/* create a symlink pointing to latest log */
+	if (symlink(b, entry->host_path) < 0) {
+		fprintf(stderr, "Can't create symlink to %s\n", b);
+	}
+#endif
+
+	entry->remove = 1;
+	free(link_target);
+}
+
+static void crash_report_remove_cb(afc_error_t error, const char *data, uint32_t length, void *user_data)
+{
+	struct crash_report_entry *entry = (struct crash_report_entry*)user_data;
+	if (error != AFC_E_SUCCESS && error != AFC_E_OBJECT_NOT_FOUND && entry->st.type != AFC_FILE_TYPE_DIRECTORY) {
+		fprintf(stderr, "Unable to remove device file '%s' (%d)\n", entry->device_path, error);
+	}
+}
+
+/**
+ * Removes the pulled files and then the directories from the device, all
+ * requests in flight at once.
+ */
+static void crash_report_remove_pulled(struct crash_report_pull *pull, afc_client_t afc)
+{
+	afc_async_t async = NULL;
+	unsigned int i;
+
+	afc_error_t afc_error = afc_async_new(afc, &async);
+	if (afc_error == AFC_E_OP_NOT_SUPPORTED) {
+		/* not over SSL, remove them one by one */
+		for (i = pull->num_entries; i > 0; i--) {
+			struct crash_report_entry *entry = &pull->entries[i-1];
+			if (!entry->remove && entry->st.type != AFC_FILE_TYPE_DIRECTORY)
 				continue;
-			}
+			crash_report_remove_cb(afc_remove_path(afc, entry->device_path), NULL, 0, entry);
+		}
+		return;
+	}
+	if (afc_error != AFC_E_SUCCESS) {
+		fprintf(stderr, "ERROR: Could not remove crash reports from device\n");
+		return;
+	}
 
-			/* remove file from device */
-			if (!keep_crash_reports) {
-				afc_remove_path(afc, source_filename);
-			}
+	/* the walk lists directories before their contents, so going backwards
+	 * removes directories after everything in them */
+	for (i = pull->num_entries; i > 0; i--) {
+		struct crash_report_entry *entry = &pull->entries[i-1];
+		if (!entry->remove && entry->st.type != AFC_FILE_TYPE_DIRECTORY)
+			continue;
+		if (afc_async_remove_path(async, entry->device_path, crash_report_remove_cb, entry) != AFC_E_SUCCESS) {
+			fprintf(stderr, "ERROR: Could not remove crash reports from device\n");
+			break;
+		}
+	}
 
-			/* extract raw crash information into separate '.crash' file */
-			if (extract_raw_crash_reports) {
-				extract_raw_crash_report(target_filename);
-			}
+	/* waits for all removals to complete */
+	afc_async_free(async);
+}
 
-			crash_report_count++;
+static int afc_client_copy_and_remove_crash_reports(afc_client_t *afc, unsigned int num_afc, const char* host_directory, uint64_t since)
+{
+	struct crash_report_pull pull;
+	struct crash_report_reader readers[CRASH_REPORT_MAX_CONNECTIONS];
+	unsigned int i;
+	int res = 0;
+
+	memset(&pull, '\0', sizeof(pull));
+	pull.host_directory = host_directory;
+	pull.since = since;
+	mutex_init(&pull.mutex);
+	cond_init(&pull.write_cond);
+	cond_init(&pull.space_cond);
+
+	afc_error_t afc_error = afc_walk(afc[0], ".", 0, crash_report_walk_cb, &pull);
+	if (afc_error != AFC_E_SUCCESS) {
+		fprintf(stderr, "ERROR: Could not read device directory '.' (%d)\n", afc_error);
+		res = -1;
+		goto leave;
+	}
 
-			res = 0;
+	for (i = 0; i < pull.num_entries; i++) {
+		if (pull.entries[i].st.type == AFC_FILE_TYPE_SYMLINK) {
+			crash_report_link(&pull, afc[0], &pull.entries[i]);
 		}
 	}
-	afc_dictionary_free(list);
 
-	/* no reports, no error */
-	if (crash_report_count == 0)
-		res = 0;
+	/* read files over all connections while this thread writes them */
+	pull.readers_active = num_afc;
+	for (i = 0; i < num_afc; i++) {
+		readers[i].pull = &pull;
+		readers[i].afc = afc[i];
+		if (thread_new(&readers[i].thread, crash_report_reader_thread, &readers[i]) != 0) {
+			readers[i].thread = THREAD_T_NULL;
+			mutex_lock(&pull.mutex);
+			pull.readers_active--;
+			mutex_unlock(&pull.mutex);
+		}
+	}
+	if (pull.readers_active == 0) {
+		fprintf(stderr, "ERROR: Could not start reading crash reports\n");
+		res = -1;
+		goto leave;
+	}
+	crash_report_writer(&pull);
+	for (i = 0; i < num_afc; i++) {
+		if (readers[i].thread) {
+			thread_join(readers[i].thread);
+			thread_free(readers[i].thread);
+		}
+	}
+
+	if (!keep_crash_reports) {
+		crash_report_remove_pulled(&pull, afc[0]);
+	}
+
+leave:
+	for (i = 0; i < pull.num_entries; i++) {
+		free(pull.entries[i].device_path);
+		free(pull.entries[i].host_path);
+		free(pull.entries[i].data);
+	}
+	free(pull.entries);
+	cond_destroy(&pull.space_cond);
+	cond_destroy(&pull.write_cond);
+	mutex_destroy(&pull.mutex);
 
 	return res;
 }
@@ -312,6 +542,8 @@ static void print_usage(int argc, char **argv)
 	printf("  -n, --network\t\tconnect to network device\n");
 	printf("  -e, --extract\t\textract raw crash report into separate '.crash' file\n");
 	printf("  -k, --keep\t\tcopy but do not remove crash reports from device\n");
+	printf("  -s, --since TIME\tonly pull reports modified at or after TIME (seconds since epoch)\n");
+	printf("  -j, --jobs NUM\t\tread over NUM parallel connections (default: %d)\n", CRASH_REPORT_DEFAULT_CONNECTIONS);
 	printf("  -d, --debug\t\tenable communication debugging\n");
 	printf("  -h, --help\t\tprints usage information\n");
 	printf("  -v, --version\t\tprints version information\n");
@@ -324,7 +556,10 @@ int main(int argc, char* argv[])
 {
 	idevice_t device = NULL;
 	lockdownd_client_t lockdownd = NULL;
-	afc_client_t afc = NULL;
+	afc_client_t afc[CRASH_REPORT_MAX_CONNECTIONS];
+	unsigned int num_afc = 0;
+	unsigned int num_connections = CRASH_REPORT_DEFAULT_CONNECTIONS;
+	uint64_t since = 0;
 
 	idevice_error_t device_error = IDEVICE_E_SUCCESS;
 	lockdownd_error_t lockdownd_error = LOCKDOWN_E_SUCCESS;
@@ -372,6 +607,26 @@ int main(int argc, char* argv[])
 			keep_crash_reports = 1;
 			continue;
 		}
+		else if (!strcmp(argv[i], "-s") || !strcmp(argv[i], "--since")) {
+			i++;
+			if (!argv[i] || !*argv[i]) {
+				print_usage(argc, argv);
+				return 0;
+			}
+			since = strtoull(argv[i], NULL, 10) * 1000000000;
+			continue;
+		}
+		else if (!strcmp(argv[i], "-j") || !strcmp(argv[i], "--jobs")) {
+			i++;
+			if (!argv[i] || atoi(argv[i]) <= 0) {
+				print_usage(argc, argv);
+				return 0;
+			}
+			num_connections = (unsigned int)atoi(argv[i]);
+			if (num_connections > CRASH_REPORT_MAX_CONNECTIONS)
+				num_connections = CRASH_REPORT_MAX_CONNECTIONS;
+			continue;
+		}
 		else if (target_directory == NULL) {
 			target_directory = argv[i];
 			continue;
@@ -457,38 +712,37 @@ int main(int argc, char* argv[])
 		return -1;
 	}
 
-	lockdownd_error = lockdownd_start_service(lockdownd, "com.apple.crashreportcopymobile", &service);
-	if (lockdownd_error != LOCKDOWN_E_SUCCESS) {
-		lockdownd_client_free(lockdownd);
-		idevice_free(device);
-		return -1;
+	/* open the connections to read the crash reports over */
+	for (num_afc = 0; num_afc < num_connections; num_afc++) {
+		lockdownd_error = lockdownd_start_service(lockdownd, "com.apple.crashreportcopymobile", &service);
+		if (lockdownd_error != LOCKDOWN_E_SUCCESS)
+			break;
+		afc_error = afc_client_new(device, service, &afc[num_afc]);
+		lockdownd_service_descriptor_free(service);
+		service = NULL;
+		if (afc_error != AFC_E_SUCCESS)
+			break;
 	}
 	lockdownd_client_free(lockdownd);
 
-	afc = NULL;
-	afc_error = afc_client_new(device, service, &afc);
-	if(afc_error != AFC_E_SUCCESS) {
-		lockdownd_client_free(lockdownd);
+	if (num_afc == 0) {
 		idevice_free(device);
 		return -1;
 	}
 
-	if (service) {
-		lockdownd_service_descriptor_free(service);
-		service = NULL;
-	}
-
 	/* recursively copy crash reports from the device to a local directory */
-	if (afc_client_copy_and_remove_crash_reports(afc, ".", target_directory) < 0) {
+	int res = afc_client_copy_and_remove_crash_reports(afc, num_afc, target_directory, since);
+	for (i = 0; i < (int)num_afc; i++) {
+		afc_client_free(afc[i]);
+	}
+	if (res < 0) {
 		fprintf(stderr, "ERROR: Failed to get crash reports from device.\n");
-		afc_client_free(afc);
 		idevice_free(device);
 		return -1;
 	}
 
 	printf("Done.\n");
 
-	afc_client_free(afc);
 	idevice_free(device);
 
 	return 0;
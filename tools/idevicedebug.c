@@ -406,16 +406,10 @@ int main(int argc, char *argv[])
 				response = NULL;
 			}
 
-			/* set environment */
-			if (environment) {
-				log_debug("Setting environment...");
-				for (environment_index = 0; environment_index < environment_count; environment_index++) {
-					log_debug("setting environment variable: %s", environment[environment_index]);
-					debugserver_client_set_environment_hex_encoded(debugserver_client, environment[environment_index], NULL);
-				}
+			/* set environment and arguments and run app */
+			for (environment_index = 0; environment_index < environment_count; environment_index++) {
+				log_debug("setting environment variable: %s", environment[environment_index]);
 			}
-
-			/* set arguments and run app */
 			log_debug("Setting argv...");
 			i++; /* i is the offset of the bundle identifier, thus skip it */
 			int app_argc = (argc - i + 2);
@@ -429,22 +423,16 @@ int main(int argc, char *argv[])
 				i++;
 			}
 			app_argv[app_argc] = NULL;
-			debugserver_client_set_argv(debugserver_client, app_argc, app_argv, NULL);
+			log_debug("Launching app...");
+			dres = debugserver_client_launch(debugserver_client, app_argc, app_argv, environment, &response);
 			free(app_argv);
-
-			/* check if launch succeeded */
-			log_debug("Checking if launch succeeded...");
-			debugserver_command_new("qLaunchSuccess", 0, NULL, &command);
-			dres = debugserver_client_send_command(debugserver_client, command, &response, NULL);
-			debugserver_command_free(command);
-			command = NULL;
 			if (response) {
-				if (strncmp(response, "OK", 2)) {
-					debugserver_client_handle_response(debugserver_client, &response, 0);
-					goto cleanup;
-				}
-				free(response);
-				response = NULL;
+				debugserver_client_handle_response(debugserver_client, &response, 0);
+				goto cleanup;
+			}
+			if (dres != DEBUGSERVER_E_SUCCESS) {
+				fprintf(stderr, "Launching the app failed with error %d\n", dres);
+				goto cleanup;
 			}
 
 			/* set thread */
@@ -30,34 +30,43 @@
 #include <string.h>
 #include <errno.h>
 #include <signal.h>
+#ifdef WIN32
+#include <winsock2.h>
+#include <windows.h>
+#define poll WSAPoll
+#else
+#include <poll.h>
+#include <fcntl.h>
+#endif
 
 #include <libimobiledevice/libimobiledevice.h>
 #include <libimobiledevice/debugserver.h>
 
 #include "common/socket.h"
-#include "common/thread.h"
 
 #define info(...) fprintf(stdout, __VA_ARGS__); fflush(stdout)
 #define debug(...) if(debug_mode) fprintf(stdout, __VA_ARGS__)
 
+/* used when the socket buffer size can't be determined */
+#define RELAY_BUFFER_SIZE_DEFAULT 131072
+
 static int debug_mode = 0;
 static int quit_flag = 0;
 
-typedef struct {
+struct relay_connection {
 	int client_fd;
-	idevice_t device;
+	int device_fd;
 	debugserver_client_t debugserver_client;
-	volatile int stop_ctod;
-	volatile int stop_dtoc;
-} socket_info_t;
-
-struct thread_info {
-	THREAD_T th;
-	struct thread_info *next;
+	/* data received from the device that the client didn't take yet */
+	char *pending;
+	uint32_t pending_size;
+	uint32_t pending_off;
+	uint32_t pending_len;
+	int closed;
+	struct relay_connection *next;
 };
 
-typedef struct thread_info thread_info_t;
-
+typedef struct relay_connection relay_connection_t;
 
 static void clean_exit(int sig)
 {
@@ -85,171 +94,308 @@ static void print_usage(int argc, char **argv)
 	printf("Bug Reports: <" PACKAGE_BUGREPORT ">\n");
 }
 
-static void *thread_device_to_client(void *data)
+static int socket_set_nonblocking(int fd)
 {
-	socket_info_t* socket_info = (socket_info_t*)data;
-	debugserver_error_t res = DEBUGSERVER_E_UNKNOWN_ERROR;
-
-	int recv_len;
-	int sent;
-	char buffer[131072];
+#ifdef WIN32
+	u_long nonblock = 1;
+	return (ioctlsocket(fd, FIONBIO, &nonblock) == 0) ? 0 : -1;
+#else
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags < 0)
+		return -1;
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+#endif
+}
 
-	debug("%s: started thread...\n", __func__);
+static int socket_would_block(void)
+{
+#ifdef WIN32
+	return (WSAGetLastError() == WSAEWOULDBLOCK);
+#else
+	return (errno == EAGAIN || errno == EWOULDBLOCK);
+#endif
+}
 
-	debug("%s: client_fd = %d\n", __func__, socket_info->client_fd);
+/**
+ * Determines a buffer size that matches what the socket can hold, so a
+ * single read or write moves everything that is available.
+ */
+static uint32_t socket_buffer_size(int fd)
+{
+	int size = 0;
+#ifdef WIN32
+	int len = sizeof(size);
+#else
+	socklen_t len = sizeof(size);
+#endif
+	if (getsockopt(fd, SOL_SOCKET, SO_RCVBUF, (char*)&size, &len) != 0 || size <= 0) {
+		return RELAY_BUFFER_SIZE_DEFAULT;
+	}
+	return ((uint32_t)size < RELAY_BUFFER_SIZE_DEFAULT) ? RELAY_BUFFER_SIZE_DEFAULT : (uint32_t)size;
+}
 
-	while (!quit_flag && !socket_info->stop_dtoc && socket_info->client_fd > 0) {
-		debug("%s: receiving data from device...\n", __func__);
+static relay_connection_t *relay_connection_new(idevice_t device, int client_fd)
+{
+	debugserver_client_t debugserver_client = NULL;
 
-		res = debugserver_client_receive_with_timeout(socket_info->debugserver_client, buffer, sizeof(buffer), (uint32_t*)&recv_len, 5000);
+	debug("%s: client_fd = %d\n", __func__, client_fd);
 
-		if (recv_len <= 0) {
-			if (recv_len == 0 && res == DEBUGSERVER_E_SUCCESS) {
-				// try again
-				continue;
-			} else {
-				fprintf(stderr, "recv failed: %s\n", strerror(errno));
-				break;
-			}
-		} else {
-			/* send to device */
-			debug("%s: sending data to client...\n", __func__);
-			sent = socket_send(socket_info->client_fd, buffer, recv_len);
-			if (sent < recv_len) {
-				if (sent <= 0) {
-					fprintf(stderr, "send failed: %s\n", strerror(errno));
-					break;
-				} else {
-					fprintf(stderr, "only sent %d from %d bytes\n", sent, recv_len);
-				}
-			} else {
-				// sending succeeded, receive from device
-				debug("%s: pushed %d bytes to client\n", __func__, sent);
-			}
-		}
+	if (debugserver_client_start_service(device, &debugserver_client, TOOL_NAME) != DEBUGSERVER_E_SUCCESS) {
+		fprintf(stderr, "Could not start debugserver on device!\nPlease make sure to mount a developer disk image first.\n");
+		return NULL;
 	}
 
-	debug("%s: shutting down...\n", __func__);
+	relay_connection_t *conn = (relay_connection_t*)calloc(1, sizeof(relay_connection_t));
+	if (!conn) {
+		fprintf(stderr, "Out of memory\n");
+		debugserver_client_free(debugserver_client);
+		return NULL;
+	}
+	conn->client_fd = client_fd;
+	conn->debugserver_client = debugserver_client;
+	if (debugserver_client_get_fd(debugserver_client, &conn->device_fd) != DEBUGSERVER_E_SUCCESS || socket_set_nonblocking(client_fd) < 0) {
+		fprintf(stderr, "Could not set up connection\n");
+		debugserver_client_free(debugserver_client);
+		free(conn);
+		return NULL;
+	}
+	conn->pending_size = socket_buffer_size(client_fd);
+	conn->pending = (char*)malloc(conn->pending_size);
+	if (!conn->pending) {
+		fprintf(stderr, "Out of memory\n");
+		debugserver_client_free(debugserver_client);
+		free(conn);
+		return NULL;
+	}
 
-	socket_shutdown(socket_info->client_fd, SHUT_RDWR);
-	socket_close(socket_info->client_fd);
+	return conn;
+}
 
-	socket_info->client_fd = -1;
-	socket_info->stop_ctod = 1;
+static void relay_connection_free(relay_connection_t *conn)
+{
+	debug("%s: shutting down connection on client_fd %d...\n", __func__, conn->client_fd);
 
-	return NULL;
+	debugserver_client_free(conn->debugserver_client);
+	socket_shutdown(conn->client_fd, SHUT_RDWR);
+	socket_close(conn->client_fd);
+	free(conn->pending);
+	free(conn);
 }
 
-static void *thread_client_to_device(void *data)
+/**
+ * Pushes data received from the device to the client, as far as the client
+ * socket takes it without blocking.
+ */
+static void relay_flush_to_client(relay_connection_t *conn)
 {
-	socket_info_t* socket_info = (socket_info_t*)data;
-	debugserver_error_t res = DEBUGSERVER_E_UNKNOWN_ERROR;
+	while (conn->pending_off < conn->pending_len) {
+		int sent = send(conn->client_fd, conn->pending + conn->pending_off, conn->pending_len - conn->pending_off, 0);
+		if (sent < 0) {
+			if (!socket_would_block()) {
+				fprintf(stderr, "send failed: %s\n", strerror(errno));
+				conn->closed = 1;
+			}
+			return;
+		}
+		debug("%s: pushed %d bytes to client\n", __func__, sent);
+		conn->pending_off += sent;
+	}
+	conn->pending_off = conn->pending_len = 0;
+}
 
-	int recv_len;
-	int sent;
-	char buffer[131072];
-	THREAD_T dtoc;
+/* data the device fd doesn't report, e.g. already decrypted by SSL */
+static int relay_device_has_pending(relay_connection_t *conn)
+{
+	int pending = 0;
+	if (debugserver_client_has_pending_data(conn->debugserver_client, &pending) != DEBUGSERVER_E_SUCCESS) {
+		return 0;
+	}
+	return pending;
+}
 
-	debug("%s: started thread...\n", __func__);
+static void relay_device_to_client(relay_connection_t *conn)
+{
+	do {
+		uint32_t recv_len = 0;
+
+		/* the device fd is readable or data is pending, so this doesn't wait */
+		debugserver_error_t res = debugserver_client_receive_with_timeout(conn->debugserver_client, conn->pending, conn->pending_size, &recv_len, 1);
+		if (recv_len == 0) {
+			if (res == DEBUGSERVER_E_SUCCESS || res == DEBUGSERVER_E_TIMEOUT) {
+				/* readable without data, e.g. an incomplete SSL record */
+				return;
+			}
+			fprintf(stderr, "recv failed: %d\n", res);
+			conn->closed = 1;
+			return;
+		}
+		conn->pending_off = 0;
+		conn->pending_len = recv_len;
+		relay_flush_to_client(conn);
+	} while (!conn->closed && conn->pending_len == 0 && relay_device_has_pending(conn));
+}
 
-	debug("%s: client_fd = %d\n", __func__, socket_info->client_fd);
+static void relay_client_to_device(relay_connection_t *conn, char *buffer, uint32_t size)
+{
+	int recv_len = recv(conn->client_fd, buffer, size, 0);
+	if (recv_len <= 0) {
+		if (recv_len < 0 && socket_would_block()) {
+			return;
+		}
+		if (recv_len < 0) {
+			fprintf(stderr, "Receive failed: %s\n", strerror(errno));
+		}
+		conn->closed = 1;
+		return;
+	}
 
-	/* spawn server to client thread */
-	socket_info->stop_dtoc = 0;
-	if (thread_new(&dtoc, thread_device_to_client, data) != 0) {
-		fprintf(stderr, "Failed to start device to client thread...\n");
+	uint32_t sent = 0;
+	debugserver_error_t res = debugserver_client_send(conn->debugserver_client, buffer, recv_len, &sent);
+	if (res != DEBUGSERVER_E_SUCCESS || sent < (uint32_t)recv_len) {
+		fprintf(stderr, "only sent %d from %d bytes\n", sent, recv_len);
+		conn->closed = 1;
+		return;
 	}
+	debug("%s: sent %d bytes to device\n", __func__, sent);
+}
+
+/**
+ * Serves all client connections from a single thread. Data is forwarded as
+ * soon as one side becomes readable; while the client doesn't take data
+ * from the device, reading from the device is paused.
+ */
+static int relay_run(idevice_t device, int server_fd, uint16_t local_port)
+{
+	relay_connection_t *connections = NULL;
+	relay_connection_t *conn;
+	struct pollfd *pfds = NULL;
+	unsigned int pfds_size = 0;
+	char *buffer = NULL;
+	uint32_t buffer_size = 0;
+	int result = 0;
 
-	while (!quit_flag && !socket_info->stop_ctod && socket_info->client_fd > 0) {
-		debug("%s: receiving data from client...\n", __func__);
+	debug("%s: Waiting for connections on local port %d\n", __func__, local_port);
 
-		/* attempt to read incoming data from client */
-		recv_len = socket_receive_timeout(socket_info->client_fd, buffer, sizeof(buffer), 0, 5000);
+	while (!quit_flag) {
+		unsigned int num_conns = 0;
+		unsigned int n = 0;
 
-		/* any data received? */
-		if (recv_len <= 0) {
-			if (recv_len == 0) {
-				/* try again */
-				continue;
-			} else {
-				fprintf(stderr, "Receive failed: %s\n", strerror(errno));
+		for (conn = connections; conn; conn = conn->next) {
+			num_conns++;
+		}
+		if (pfds_size < 1 + num_conns * 2) {
+			struct pollfd *newpfds = (struct pollfd*)realloc(pfds, sizeof(struct pollfd) * (1 + num_conns * 2));
+			if (!newpfds) {
+				fprintf(stderr, "Out of memory\n");
+				result = -1;
 				break;
 			}
-		} else {
-			/* forward data to device */
-			debug("%s: sending data to device...\n", __func__);
-			res = debugserver_client_send(socket_info->debugserver_client, buffer, recv_len, (uint32_t*)&sent);
-
-			if (sent < recv_len || res != DEBUGSERVER_E_SUCCESS) {
-				if (sent <= 0) {
-					fprintf(stderr, "send failed: %s\n", strerror(errno));
-					break;
-				} else {
-					fprintf(stderr, "only sent %d from %d bytes\n", sent, recv_len);
-				}
-			} else {
-				// sending succeeded, receive from device
-				debug("%s: sent %d bytes to device\n", __func__, sent);
-			}
+			pfds = newpfds;
+			pfds_size = 1 + num_conns * 2;
 		}
-	}
-
-	debug("%s: shutting down...\n", __func__);
 
-	socket_shutdown(socket_info->client_fd, SHUT_RDWR);
-	socket_close(socket_info->client_fd);
+		pfds[n].fd = server_fd;
+		pfds[n].events = POLLIN;
+		pfds[n].revents = 0;
+		n++;
+		for (conn = connections; conn; conn = conn->next) {
+			int pending = (conn->pending_len > conn->pending_off);
+			pfds[n].fd = conn->client_fd;
+			pfds[n].events = POLLIN | ((pending) ? POLLOUT : 0);
+			pfds[n].revents = 0;
+			n++;
+			pfds[n].fd = conn->device_fd;
+			pfds[n].events = (pending) ? 0 : POLLIN;
+			pfds[n].revents = 0;
+			n++;
+		}
 
-	socket_info->client_fd = -1;
-	socket_info->stop_dtoc = 1;
+		/* wake up regularly to notice quit_flag */
+		int ready = poll(pfds, n, 1000);
+		if (ready < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "poll failed: %s\n", strerror(errno));
+			result = -1;
+			break;
+		}
+		if (ready == 0)
+			continue;
 
-	/* join other thread to allow it to stop */
-	thread_join(dtoc);
-	thread_free(dtoc);
+		n = 1;
+		for (conn = connections; conn; conn = conn->next, n += 2) {
+			short crev = pfds[n].revents;
+			short drev = pfds[n+1].revents;
+			if ((crev & POLLOUT) && !conn->closed) {
+				relay_flush_to_client(conn);
+				/* reading paused while the client was busy, pending data doesn't wake up poll */
+				if (!conn->closed && conn->pending_len == 0 && !(drev & (POLLIN | POLLHUP | POLLERR)) && relay_device_has_pending(conn)) {
+					relay_device_to_client(conn);
+				}
+			}
+			if ((drev & (POLLIN | POLLHUP | POLLERR)) && !conn->closed) {
+				relay_device_to_client(conn);
+			}
+			if ((crev & (POLLIN | POLLHUP | POLLERR)) && !conn->closed) {
+				if (!buffer) {
+					buffer_size = socket_buffer_size(conn->client_fd);
+					buffer = (char*)malloc(buffer_size);
+					if (!buffer) {
+						fprintf(stderr, "Out of memory\n");
+						conn->closed = 1;
+						continue;
+					}
+				}
+				relay_client_to_device(conn, buffer, buffer_size);
+			}
+		}
 
-	return NULL;
-}
+		/* drop connections that were closed by either side */
+		relay_connection_t **prev = &connections;
+		while (*prev) {
+			conn = *prev;
+			if (conn->closed) {
+				*prev = conn->next;
+				relay_connection_free(conn);
+			} else {
+				prev = &conn->next;
+			}
+		}
 
-static void* connection_handler(void* data)
-{
-	debugserver_error_t derr = DEBUGSERVER_E_SUCCESS;
-	socket_info_t* socket_info = (socket_info_t*)data;
-	THREAD_T ctod;
+		if (pfds[0].revents & POLLIN) {
+			int client_fd = socket_accept(server_fd, local_port);
+			if (client_fd < 0) {
+				continue;
+			}
 
-	debug("%s: client_fd = %d\n", __func__, socket_info->client_fd);
+			debug("%s: Handling new client connection...\n", __func__);
 
-	derr = debugserver_client_start_service(socket_info->device, &socket_info->debugserver_client, TOOL_NAME);
-	if (derr != DEBUGSERVER_E_SUCCESS) {
-		fprintf(stderr, "Could not start debugserver on device!\nPlease make sure to mount a developer disk image first.\n");
-		return NULL;
+			conn = relay_connection_new(device, client_fd);
+			if (!conn) {
+				socket_shutdown(client_fd, SHUT_RDWR);
+				socket_close(client_fd);
+				continue;
+			}
+			conn->next = connections;
+			connections = conn;
+		}
 	}
 
-	/* spawn client to device thread */
-	socket_info->stop_ctod = 0;
-	if (thread_new(&ctod, thread_client_to_device, data) != 0) {
-		fprintf(stderr, "Failed to start client to device thread...\n");
+	while (connections) {
+		conn = connections;
+		connections = conn->next;
+		relay_connection_free(conn);
 	}
+	free(pfds);
+	free(buffer);
 
-	/* join the fun */
-	thread_join(ctod);
-	thread_free(ctod);
-
-	debug("%s: shutting down...\n", __func__);
-
-	debugserver_client_free(socket_info->debugserver_client);
-	socket_info->debugserver_client = NULL;
-
-	/* shutdown client socket */
-	socket_shutdown(socket_info->client_fd, SHUT_RDWR);
-	socket_close(socket_info->client_fd);
-
-	return NULL;
+	return result;
 }
 
 int main(int argc, char *argv[])
 {
 	idevice_error_t ret = IDEVICE_E_UNKNOWN_ERROR;
 	idevice_t device = NULL;
-	thread_info_t *thread_list = NULL;
 	const char* udid = NULL;
 	int use_network = 0;
 	uint16_t local_port = 0;
@@ -345,56 +491,14 @@ int main(int argc, char *argv[])
 		goto leave_cleanup;
 	}
 
-	while (!quit_flag) {
-		debug("%s: Waiting for connection on local port %d\n", __func__, local_port);
-
-		/* wait for client */
-		int client_fd = socket_accept(server_fd, local_port);
-		if (client_fd < 0) {
-			continue;
-		}
-
-		debug("%s: Handling new client connection...\n", __func__);
-
-		thread_info_t *el = (thread_info_t*)malloc(sizeof(thread_info_t));
-		if (!el) {
-			fprintf(stderr, "Out of memory\n");
-			exit(EXIT_FAILURE);
-		}
-		el->next = NULL;
-
-		if (thread_list) {
-			thread_list->next = el;
-		} else {
-			thread_list = el;
-		}
-
-		socket_info_t *sinfo = (socket_info_t*)malloc(sizeof(socket_info_t));
-		if (!sinfo) {
-			fprintf(stderr, "Out of memory\n");
-			exit(EXIT_FAILURE);
-		}
-		sinfo->client_fd = client_fd;
-		sinfo->device = device;
-
-		if (thread_new(&(el->th), connection_handler, (void*)sinfo) != 0) {
-			fprintf(stderr, "Could not start connection handler.\n");
-			socket_shutdown(server_fd, SHUT_RDWR);
-			socket_close(server_fd);
-			break;
-		}
+	if (relay_run(device, server_fd, local_port) < 0) {
+		result = EXIT_FAILURE;
 	}
 
 	debug("%s: Shutting down debugserver proxy...\n", __func__);
 
-	/* join and clean up threads */
-	while (thread_list) {
-		thread_info_t *el = thread_list;
-		thread_join(el->th);
-		thread_free(el->th);
-		thread_list = el->next;
-		free(el);
-	}
+	socket_shutdown(server_fd, SHUT_RDWR);
+	socket_close(server_fd);
 
 leave_cleanup:
 	if (device) {
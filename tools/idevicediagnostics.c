@@ -37,6 +37,7 @@
 #include <libimobiledevice/libimobiledevice.h>
 #include <libimobiledevice/lockdown.h>
 #include <libimobiledevice/diagnostics_relay.h>
+#include "common/utils.h"
 
 enum cmd_mode {
 	CMD_NONE = 0,
@@ -49,13 +50,34 @@ enum cmd_mode {
 	CMD_IOREGISTRY_ENTRY
 };
 
-static void print_xml(plist_t node)
+enum output_format {
+	FORMAT_XML = 0,
+	FORMAT_KEY_VALUE,
+	FORMAT_JSON
+};
+
+static enum output_format output_format = FORMAT_XML;
+
+static void print_node(plist_t node)
 {
 	char *xml = NULL;
 	uint32_t len = 0;
-	plist_to_xml(node, &xml, &len);
-	if (xml) {
-		puts(xml);
+
+	switch (output_format) {
+	case FORMAT_KEY_VALUE:
+		plist_print_to_stream(node, stdout);
+		break;
+	case FORMAT_JSON:
+		plist_print_json_to_stream(node, stdout);
+		printf("\n");
+		break;
+	default:
+		plist_to_xml(node, &xml, &len);
+		if (xml) {
+			puts(xml);
+			free(xml);
+		}
+		break;
 	}
 }
 
@@ -100,6 +122,14 @@ int main(int argc, char **argv)
 			use_network = 1;
 			continue;
 		}
+		else if (!strcmp(argv[i], "-k") || !strcmp(argv[i], "--keyvalue")) {
+			output_format = FORMAT_KEY_VALUE;
+			continue;
+		}
+		else if (!strcmp(argv[i], "-j") || !strcmp(argv[i], "--json")) {
+			output_format = FORMAT_JSON;
+			continue;
+		}
 		else if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
 			print_usage(argc, argv);
 			result = EXIT_SUCCESS;
@@ -254,7 +284,7 @@ int main(int argc, char **argv)
 				case CMD_MOBILEGESTALT:
 					if (diagnostics_relay_query_mobilegestalt(diagnostics_client, keys, &node) == DIAGNOSTICS_RELAY_E_SUCCESS) {
 						if (node) {
-							print_xml(node);
+							print_node(node);
 							result = EXIT_SUCCESS;
 						}
 					} else {
@@ -264,7 +294,7 @@ int main(int argc, char **argv)
 				case CMD_IOREGISTRY_ENTRY:
 					if (diagnostics_relay_query_ioregistry_entry(diagnostics_client, cmd_arg == NULL ? "": cmd_arg, "", &node) == DIAGNOSTICS_RELAY_E_SUCCESS) {
 						if (node) {
-							print_xml(node);
+							print_node(node);
 							result = EXIT_SUCCESS;
 						}
 					} else {
@@ -274,7 +304,7 @@ int main(int argc, char **argv)
 				case CMD_IOREGISTRY:
 					if (diagnostics_relay_query_ioregistry_plane(diagnostics_client, cmd_arg == NULL ? "": cmd_arg, &node) == DIAGNOSTICS_RELAY_E_SUCCESS) {
 						if (node) {
-							print_xml(node);
+							print_node(node);
 							result = EXIT_SUCCESS;
 						}
 					} else {
@@ -285,7 +315,7 @@ int main(int argc, char **argv)
 				default:
 					if (diagnostics_relay_request_diagnostics(diagnostics_client, cmd_arg, &node) == DIAGNOSTICS_RELAY_E_SUCCESS) {
 						if (node) {
-							print_xml(node);
+							print_node(node);
 							result = EXIT_SUCCESS;
 						}
 					} else {
@@ -341,6 +371,8 @@ void print_usage(int argc, char **argv)
 	printf("The following OPTIONS are accepted:\n");
 	printf("  -u, --udid UDID\ttarget specific device by UDID\n");
 	printf("  -n, --network\t\tconnect to network device\n");
+	printf("  -k, --keyvalue\toutput information as key/value pairs instead of xml plist\n");
+	printf("  -j, --json\t\toutput information as JSON instead of xml plist\n");
 	printf("  -d, --debug\t\tenable communication debugging\n");
 	printf("  -h, --help\t\tprints usage information\n");
 	printf("  -v, --version\t\tprints version information\n");
@@ -152,11 +152,6 @@ static void print_xml(plist_t node)
 		puts(xml);
 }
 
-static ssize_t mim_upload_cb(void* buf, size_t size, void* userdata)
-{
-	return fread(buf, 1, size, (FILE*)userdata);
-}
-
 int main(int argc, char **argv)
 {
 	idevice_t device = NULL;
@@ -167,7 +162,6 @@ int main(int argc, char **argv)
 	lockdownd_service_descriptor_t service = NULL;
 	int res = -1;
 	char *image_path = NULL;
-	size_t image_size = 0;
 	char *image_sig_path = NULL;
 
 #ifndef WIN32
@@ -262,7 +256,6 @@ int main(int argc, char **argv)
 			fprintf(stderr, "ERROR: stat: %s: %s\n", image_path, strerror(errno));
 			goto leave;
 		}
-		image_size = fst.st_size;
 		if (stat(image_sig_path, &fst) != 0) {
 			fprintf(stderr, "ERROR: stat: %s: %s\n", image_sig_path, strerror(errno));
 			goto leave;
@@ -331,7 +324,7 @@ int main(int argc, char **argv)
 		switch(disk_image_upload_type) {
 			case DISK_IMAGE_UPLOAD_TYPE_UPLOAD_IMAGE:
 				printf("Uploading %s\n", image_path);
-				err = mobile_image_mounter_upload_image(mim, imagetype, image_size, sig, sig_length, mim_upload_cb, f);
+				err = mobile_image_mounter_upload_image_fd(mim, imagetype, fileno(f), sig, sig_length);
 				break;
 			case DISK_IMAGE_UPLOAD_TYPE_AFC:
 			default:
@@ -38,9 +38,30 @@
 #include <libimobiledevice/libimobiledevice.h>
 #include <libimobiledevice/lockdown.h>
 #include "common/utils.h"
+#include "common/thread.h"
 
 #define FORMAT_KEY_VALUE 1
 #define FORMAT_XML 2
+#define FORMAT_JSON 3
+
+/* upper limit of devices queried at the same time with --all */
+#define MAX_PARALLEL_DEVICES 64
+
+struct info_query {
+	const char **domains;
+	const char **keys;
+	unsigned int count;
+	const char *key;
+	int simple;
+};
+
+struct device_task {
+	const char *udid;
+	enum idevice_connection_type conn_type;
+	const struct info_query *query;
+};
+
+static mutex_t output_mutex;
 
 static const char *domains[] = {
 	"com.apple.disk_usage",
@@ -88,6 +109,139 @@ static int is_domain_known(const char *domain)
 	return 0;
 }
 
+/**
+ * Queries the requested values. A single domain is queried with one GetValue
+ * request like before, several domains are queried with pipelined requests.
+ */
+static lockdownd_error_t query_values(lockdownd_client_t client, const struct info_query *query, plist_t *values)
+{
+	if (query->count <= 1) {
+		return lockdownd_get_value(client, (query->count) ? query->domains[0] : NULL, query->key, values);
+	}
+	return lockdownd_get_values(client, query->domains, query->keys, query->count, values);
+}
+
+static void print_json_line(plist_t dict)
+{
+	char *json = plist_to_json_string(dict);
+	if (!json)
+		return;
+	mutex_lock(&output_mutex);
+	printf("%s\n", json);
+	fflush(stdout);
+	mutex_unlock(&output_mutex);
+	free(json);
+}
+
+static void* device_task_func(void *data)
+{
+	struct device_task *task = (struct device_task*)data;
+	idevice_t device = NULL;
+	lockdownd_client_t client = NULL;
+	lockdownd_error_t ldret = LOCKDOWN_E_UNKNOWN_ERROR;
+	plist_t values = NULL;
+	const char *error = NULL;
+
+	plist_t result = plist_new_dict();
+	plist_dict_set_item(result, "udid", plist_new_string(task->udid));
+	plist_dict_set_item(result, "connection", plist_new_string((task->conn_type == CONNECTION_NETWORK) ? "network" : "usb"));
+
+	if (idevice_new_with_options(&device, task->udid, (task->conn_type == CONNECTION_NETWORK) ? IDEVICE_LOOKUP_NETWORK : IDEVICE_LOOKUP_USBMUX) != IDEVICE_E_SUCCESS) {
+		error = "Device not found";
+	} else if (LOCKDOWN_E_SUCCESS != (ldret = task->query->simple ?
+			lockdownd_client_new(device, &client, TOOL_NAME):
+			lockdownd_client_new_with_handshake(device, &client, TOOL_NAME))) {
+		error = lockdownd_strerror(ldret);
+	} else if ((ldret = query_values(client, task->query, &values)) != LOCKDOWN_E_SUCCESS) {
+		error = lockdownd_strerror(ldret);
+	}
+
+	if (error) {
+		plist_dict_set_item(result, "error", plist_new_string(error));
+	} else {
+		plist_dict_set_item(result, "values", (values) ? values : plist_new_dict());
+		values = NULL;
+	}
+	print_json_line(result);
+
+	plist_free(result);
+	plist_free(values);
+	lockdownd_client_free(client);
+	idevice_free(device);
+
+	return NULL;
+}
+
+/**
+ * Queries all attached devices of the given connection type concurrently
+ * and prints one JSON object per device as soon as its values arrived.
+ *
+ * @return 0 if all devices could be queried, 1 otherwise.
+ */
+static int query_all_devices(const struct info_query *query, int use_network)
+{
+	idevice_info_t *devices = NULL;
+	int count = 0;
+	int i;
+	int num_tasks = 0;
+
+	/* serves the device list and the lookups of the device handles without
+	 * a usbmuxd round trip for each device */
+	idevice_set_device_registry(1);
+
+	if (idevice_get_device_list_extended(&devices, &count) != IDEVICE_E_SUCCESS) {
+		fprintf(stderr, "ERROR: Unable to retrieve device list!\n");
+		return 1;
+	}
+
+	struct device_task *tasks = (struct device_task*)calloc(count + 1, sizeof(struct device_task));
+	thread_task_t *handles = (thread_task_t*)calloc(count + 1, sizeof(thread_task_t));
+	if (!tasks || !handles) {
+		fprintf(stderr, "ERROR: Out of memory\n");
+		free(tasks);
+		free(handles);
+		idevice_device_list_extended_free(devices);
+		return 1;
+	}
+
+	for (i = 0; i < count; i++) {
+		if ((devices[i]->conn_type == CONNECTION_NETWORK) != (use_network != 0))
+			continue;
+		tasks[num_tasks].udid = devices[i]->udid;
+		tasks[num_tasks].conn_type = devices[i]->conn_type;
+		tasks[num_tasks].query = query;
+		num_tasks++;
+	}
+
+	mutex_init(&output_mutex);
+
+	thread_pool_t pool = NULL;
+	if (num_tasks > 1) {
+		pool = thread_pool_new((num_tasks < MAX_PARALLEL_DEVICES) ? num_tasks : MAX_PARALLEL_DEVICES);
+	}
+	for (i = 0; i < num_tasks; i++) {
+		if (pool)
+			handles[i] = thread_pool_submit(pool, device_task_func, &tasks[i]);
+		if (!handles[i])
+			device_task_func(&tasks[i]);
+	}
+	if (pool) {
+		for (i = 0; i < num_tasks; i++) {
+			if (handles[i])
+				thread_task_wait(pool, handles[i]);
+		}
+		thread_pool_free(pool);
+	}
+
+	mutex_destroy(&output_mutex);
+	free(handles);
+	free(tasks);
+	idevice_device_list_extended_free(devices);
+	idevice_set_device_registry(0);
+
+	return 0;
+}
+
 static void print_usage(int argc, char **argv, int is_error)
 {
 	int i = 0;
@@ -103,8 +257,12 @@ static void print_usage(int argc, char **argv, int is_error)
 		"  -n, --network      connect to network device\n" \
 		"  -s, --simple       use a simple connection to avoid auto-pairing with the device\n" \
 		"  -q, --domain NAME  set domain of query to NAME. Default: None\n" \
+		"                     Can be given multiple times to query several domains.\n" \
 		"  -k, --key NAME     only query key specified by NAME. Default: All keys.\n" \
 		"  -x, --xml          output information as xml plist instead of key/value pairs\n" \
+		"  -j, --json         output information as JSON instead of key/value pairs\n" \
+		"  -a, --all          query all attached devices in parallel and print one\n" \
+		"                     line of JSON per device\n" \
 		"  -h, --help         prints usage information\n" \
 		"  -d, --debug        enable communication debugging\n" \
 		"  -v, --version      prints version information\n" \
@@ -131,11 +289,16 @@ int main(int argc, char *argv[])
 	int format = FORMAT_KEY_VALUE;
 	const char* udid = NULL;
 	int use_network = 0;
-	const char *domain = NULL;
+	int all_devices = 0;
 	const char *key = NULL;
 	char *xml_doc = NULL;
 	uint32_t xml_length;
 	plist_t node = NULL;
+	struct info_query query;
+	unsigned int i;
+	int res = 0;
+
+	memset(&query, '\0', sizeof(query));
 
 	int c = 0;
 	const struct option longopts[] = {
@@ -147,6 +310,8 @@ int main(int argc, char *argv[])
 		{ "key", required_argument, NULL, 'k' },
 		{ "simple", no_argument, NULL, 's' },
 		{ "xml", no_argument, NULL, 'x' },
+		{ "json", no_argument, NULL, 'j' },
+		{ "all", no_argument, NULL, 'a' },
 		{ "version", no_argument, NULL, 'v' },
 		{ NULL, 0, NULL, 0}
 	};
@@ -155,7 +320,14 @@ int main(int argc, char *argv[])
 	signal(SIGPIPE, SIG_IGN);
 #endif
 
-	while ((c = getopt_long(argc, argv, "dhu:nq:k:sxv", longopts, NULL)) != -1) {
+	query.domains = (const char**)calloc(argc, sizeof(char*));
+	query.keys = (const char**)calloc(argc, sizeof(char*));
+	if (!query.domains || !query.keys) {
+		fprintf(stderr, "ERROR: Out of memory\n");
+		return -1;
+	}
+
+	while ((c = getopt_long(argc, argv, "dhu:nq:k:sxjav", longopts, NULL)) != -1) {
 		switch (c) {
 		case 'd':
 			idevice_set_debug_level(1);
@@ -177,7 +349,7 @@ int main(int argc, char *argv[])
 				print_usage(argc, argv, 1);
 				return 2;
 			}
-			domain = optarg;
+			query.domains[query.count++] = optarg;
 			break;
 		case 'k':
 			if (!*optarg) {
@@ -190,6 +362,12 @@ int main(int argc, char *argv[])
 		case 'x':
 			format = FORMAT_XML;
 			break;
+		case 'j':
+			format = FORMAT_JSON;
+			break;
+		case 'a':
+			all_devices = 1;
+			break;
 		case 's':
 			simple = 1;
 			break;
@@ -208,6 +386,27 @@ int main(int argc, char *argv[])
 	argc -= optind;
 	argv += optind;
 
+	query.key = key;
+	query.simple = simple;
+	for (i = 0; i < query.count; i++) {
+		if (!is_domain_known(query.domains[i])) {
+			fprintf(stderr, "WARNING: Sending query with unknown domain \"%s\".\n", query.domains[i]);
+		}
+		query.keys[i] = key;
+	}
+
+	if (all_devices) {
+		if (udid) {
+			fprintf(stderr, "ERROR: --all can't be combined with --udid!\n");
+			res = 2;
+		} else {
+			res = query_all_devices(&query, use_network);
+		}
+		free(query.domains);
+		free(query.keys);
+		return res;
+	}
+
 	ret = idevice_new_with_options(&device, udid, (use_network) ? IDEVICE_LOOKUP_NETWORK : IDEVICE_LOOKUP_USBMUX);
 	if (ret != IDEVICE_E_SUCCESS) {
 		if (udid) {
@@ -215,6 +414,8 @@ int main(int argc, char *argv[])
 		} else {
 			printf("ERROR: No device found!\n");
 		}
+		free(query.domains);
+		free(query.keys);
 		return -1;
 	}
 
@@ -223,15 +424,13 @@ int main(int argc, char *argv[])
 			lockdownd_client_new_with_handshake(device, &client, TOOL_NAME))) {
 		fprintf(stderr, "ERROR: Could not connect to lockdownd: %s (%d)\n", lockdownd_strerror(ldret), ldret);
 		idevice_free(device);
+		free(query.domains);
+		free(query.keys);
 		return -1;
 	}
 
-	if (domain && !is_domain_known(domain)) {
-		fprintf(stderr, "WARNING: Sending query with unknown domain \"%s\".\n", domain);
-	}
-
 	/* run query and output information */
-	if(lockdownd_get_value(client, domain, key, &node) == LOCKDOWN_E_SUCCESS) {
+	if (query_values(client, &query, &node) == LOCKDOWN_E_SUCCESS) {
 		if (node) {
 			switch (format) {
 			case FORMAT_XML:
@@ -239,6 +438,10 @@ int main(int argc, char *argv[])
 				printf("%s", xml_doc);
 				free(xml_doc);
 				break;
+			case FORMAT_JSON:
+				plist_print_json_to_stream(node, stdout);
+				printf("\n");
+				break;
 			case FORMAT_KEY_VALUE:
 				plist_print_to_stream(node, stdout);
 				break;
@@ -254,6 +457,8 @@ int main(int argc, char *argv[])
 
 	lockdownd_client_free(client);
 	idevice_free(device);
+	free(query.domains);
+	free(query.keys);
 
 	return 0;
 }
@@ -31,6 +31,7 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <dirent.h>
 #ifndef WIN32
 #include <signal.h>
 #endif
@@ -45,6 +46,9 @@
 #include <libimobiledevice/lockdown.h>
 #include <libimobiledevice/misagent.h>
 #include "common/utils.h"
+#include "common/userpref.h"
+
+#define PROFILE_CACHE_FILE "ideviceprovision.plist"
 
 static void print_usage(int argc, char **argv)
 {
@@ -67,6 +71,9 @@ static void print_usage(int argc, char **argv)
 	printf("           \tspecified by PATH. The file will be stored as UUID.mobileprovision.\n");
 	printf("  remove UUID\tRemoves the provisioning profile identified by UUID.\n");
 	printf("  remove-all\tRemoves all installed provisioning profiles.\n");
+	printf("  sync PATH\tMakes the installed provisioning profiles match the\n");
+	printf("           \t.mobileprovision files in the directory PATH, only\n");
+	printf("           \tinstalling and removing what differs.\n");
 	printf("  dump FILE\tPrints detailed information about the provisioning profile\n");
 	printf("           \tspecified by FILE.\n");
 	printf("\n");
@@ -88,6 +95,7 @@ enum {
 	OP_COPY,
 	OP_REMOVE,
 	OP_DUMP,
+	OP_SYNC,
 	NUM_OPS
 };
 
@@ -287,6 +295,120 @@ static int profile_read_from_file(const char* path, unsigned char **profile_data
 	return 0;
 }
 
+static uint64_t plist_dict_get_uint(plist_t dict, const char *key)
+{
+	uint64_t val = 0;
+	plist_t node = plist_dict_get_item(dict, key);
+	if (node && plist_get_node_type(node) == PLIST_UINT) {
+		plist_get_uint_val(node, &val);
+	}
+	return val;
+}
+
+/**
+ * Gets the UUID of a profile file, from the cache if the file didn't change
+ * since it was last parsed.
+ */
+static char *profile_get_uuid(const char *path, const struct stat *st, plist_t cache, int *cache_changed)
+{
+	char *uuid = NULL;
+	plist_t entry = plist_dict_get_item(cache, path);
+	if (entry && plist_get_node_type(entry) == PLIST_DICT
+	    && plist_dict_get_uint(entry, "Size") == (uint64_t)st->st_size
+	    && plist_dict_get_uint(entry, "MTime") == (uint64_t)st->st_mtime) {
+		plist_t node = plist_dict_get_item(entry, "UUID");
+		if (node && plist_get_node_type(node) == PLIST_STRING) {
+			plist_get_string_val(node, &uuid);
+			return uuid;
+		}
+	}
+
+	unsigned char* profile_data = NULL;
+	unsigned int profile_size = 0;
+	if (profile_read_from_file(path, &profile_data, &profile_size) != 0) {
+		return NULL;
+	}
+	plist_t pdata = plist_new_data((char*)profile_data, profile_size);
+	free(profile_data);
+	plist_t pl = profile_get_embedded_plist(pdata);
+	plist_free(pdata);
+	if (pl && plist_get_node_type(pl) == PLIST_DICT) {
+		plist_t node = plist_dict_get_item(pl, "UUID");
+		if (node && plist_get_node_type(node) == PLIST_STRING) {
+			plist_get_string_val(node, &uuid);
+		}
+	}
+	plist_free(pl);
+
+	if (uuid) {
+		entry = plist_new_dict();
+		plist_dict_set_item(entry, "Size", plist_new_uint(st->st_size));
+		plist_dict_set_item(entry, "MTime", plist_new_uint(st->st_mtime));
+		plist_dict_set_item(entry, "UUID", plist_new_string(uuid));
+		plist_dict_set_item(cache, path, entry);
+		*cache_changed = 1;
+	}
+
+	return uuid;
+}
+
+/**
+ * Collects the profiles in a directory into a dictionary of UUID and file
+ * path, as expected by misagent_sync(). The UUIDs are kept in a cache in
+ * the configuration directory, so unchanged files are not read again.
+ */
+static int profiles_from_directory(const char *dirpath, plist_t *profiles)
+{
+	DIR *dir = opendir(dirpath);
+	if (!dir) {
+		fprintf(stderr, "ERROR: Could not open directory %s: %s\n", dirpath, strerror(errno));
+		return -1;
+	}
+
+	char *cache_path = string_build_path(userpref_get_config_dir(), PROFILE_CACHE_FILE, NULL);
+	plist_t cache = NULL;
+	if (cache_path) {
+		plist_read_from_filename(&cache, cache_path);
+	}
+	if (!cache || plist_get_node_type(cache) != PLIST_DICT) {
+		plist_free(cache);
+		cache = plist_new_dict();
+	}
+	int cache_changed = 0;
+
+	*profiles = plist_new_dict();
+	struct dirent *ep;
+	while ((ep = readdir(dir))) {
+		size_t len = strlen(ep->d_name);
+		if (len <= strlen(".mobileprovision") || strcmp(ep->d_name + len - strlen(".mobileprovision"), ".mobileprovision") != 0) {
+			continue;
+		}
+		char *path = string_build_path(dirpath, ep->d_name, NULL);
+		struct stat st;
+		if (!path || stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+			free(path);
+			continue;
+		}
+		char *uuid = profile_get_uuid(path, &st, cache, &cache_changed);
+		if (uuid) {
+			plist_dict_set_item(*profiles, uuid, plist_new_string(path));
+			free(uuid);
+		} else {
+			fprintf(stderr, "WARNING: Could not get the UUID of %s, skipping it.\n", path);
+		}
+		free(path);
+	}
+	closedir(dir);
+
+	if (cache_path && cache_changed) {
+		plist_write_to_filename(cache, cache_path, PLIST_FORMAT_BINARY);
+	}
+	free(cache_path);
+	plist_free(cache);
+
+	return 0;
+}
+
 int main(int argc, char *argv[])
 {
 	lockdownd_client_t client = NULL;
@@ -377,6 +499,16 @@ int main(int argc, char *argv[])
 			op = OP_DUMP;
 			continue;
 		}
+		else if (!strcmp(argv[i], "sync")) {
+			i++;
+			if (!argv[i] || (strlen(argv[i]) < 1)) {
+				print_usage(argc, argv);
+				return 0;
+			}
+			param = argv[i];
+			op = OP_SYNC;
+			continue;
+		}
 		else if (!strcmp(argv[i], "-x") || !strcmp(argv[i], "--xml")) {
 			output_xml = 1;
 			continue;
@@ -443,6 +575,11 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	plist_t sync_profiles = NULL;
+	if (op == OP_SYNC && profiles_from_directory(param, &sync_profiles) != 0) {
+		return -1;
+	}
+
 	ret = idevice_new_with_options(&device, udid, (use_network) ? IDEVICE_LOOKUP_NETWORK : IDEVICE_LOOKUP_USBMUX);
 	if (ret != IDEVICE_E_SUCCESS) {
 		if (udid) {
@@ -659,9 +796,23 @@ int main(int argc, char *argv[])
 				plist_free(profiles);
 			}
 			break;
+		case OP_SYNC:
+		{
+			unsigned int num_installed = 0;
+			unsigned int num_removed = 0;
+			misagent_error_t merr = misagent_sync(mis, sync_profiles, 1, &num_installed, &num_removed);
+			printf("%u of %u profiles installed, %u removed.\n", num_installed, plist_dict_get_size(sync_profiles), num_removed);
+			if (merr != MISAGENT_E_SUCCESS) {
+				int sc = misagent_get_status_code(mis);
+				fprintf(stderr, "ERROR: Could not sync profiles, error %d, status code 0x%x\n", merr, sc);
+				res = -1;
+			}
+		}
+			break;
 		default:
 			break;
 	}
+	plist_free(sync_profiles);
 
 	misagent_client_free(mis);
 
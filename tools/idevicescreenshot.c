@@ -30,16 +30,597 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <time.h>
-#ifndef WIN32
+#include <stdint.h>
 #include <signal.h>
+#include <sys/stat.h>
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
 #endif
 
 #include <libimobiledevice/libimobiledevice.h>
 #include <libimobiledevice/lockdown.h>
 #include <libimobiledevice/screenshotr.h>
 
+#include "common/socket.h"
+#include "common/thread.h"
+
+#define DEFAULT_FPS 10
+/* unchanged frames in a row after which a device is polled at half the rate */
+#define IDLE_FRAMES 8
+#define HTTP_BOUNDARY "idevicescreenshot-frame"
+
 void print_usage(int argc, char **argv);
 
+static const char *image_type(const char *data, uint64_t size, const char **mime)
+{
+	if (size >= 4 && memcmp(data, "\x89PNG", 4) == 0) {
+		*mime = "image/png";
+		return ".png";
+	} else if (size >= 4 && memcmp(data, "MM\x00*", 4) == 0) {
+		*mime = "image/tiff";
+		return ".tiff";
+	} else if (size >= 2 && memcmp(data, "\xff\xd8", 2) == 0) {
+		*mime = "image/jpeg";
+		return ".jpg";
+	}
+	*mime = "application/octet-stream";
+	return NULL;
+}
+
+/* a captured frame, shared by everyone sending it */
+struct frame {
+	unsigned int refcount;
+	uint64_t size;
+	const char *mime;
+	char *data;
+};
+
+/* an HTTP client waiting for the next frame of a device */
+struct viewer {
+	cond_t cond;
+	struct viewer *next;
+};
+
+struct capture {
+	char *udid;
+	idevice_t device;
+	screenshotr_client_t shotr;
+	int active;
+	/* protected by wall.mutex */
+	struct frame *frame;
+	uint64_t seq;
+	struct viewer *viewers;
+	/* only used by the stream thread of the device */
+	uint64_t last_hash;
+	uint64_t last_size;
+	unsigned int fps;
+	unsigned int unchanged;
+	uint64_t captured;
+	uint64_t written;
+	uint64_t latency_total;
+	struct capture *next;
+};
+
+static struct {
+	mutex_t mutex;
+	struct capture *captures;
+	enum idevice_options lookup;
+	unsigned int max_fps;
+	const char *output_dir;
+	int serve;
+} wall;
+
+static volatile int quit_flag = 0;
+
+static void clean_exit(int sig)
+{
+	quit_flag = 1;
+}
+
+static void sleep_ms(unsigned int ms)
+{
+#ifdef WIN32
+	Sleep(ms);
+#else
+	usleep(ms * 1000);
+#endif
+}
+
+/* FNV-1a, only used to tell whether the screen content changed */
+static uint64_t frame_hash(const char *data, uint64_t size)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	uint64_t i;
+	for (i = 0; i < size; i++) {
+		hash ^= (unsigned char)data[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+/* must be called with wall.mutex held */
+static void frame_release(struct frame *frame)
+{
+	if (frame && --frame->refcount == 0) {
+		free(frame);
+	}
+}
+
+/* must be called with wall.mutex held */
+static void capture_wake_viewers(struct capture *capture)
+{
+	struct viewer *viewer;
+	for (viewer = capture->viewers; viewer; viewer = viewer->next) {
+		cond_signal(&viewer->cond);
+	}
+}
+
+static void capture_write_frame(struct capture *capture, const char *data, uint64_t size)
+{
+	const char *mime = NULL;
+	const char *ext = image_type(data, size, &mime);
+	char *filename = NULL;
+	size_t len = strlen(wall.output_dir) + strlen(capture->udid) + 32;
+
+	filename = (char*)malloc(len);
+	if (!filename) {
+		return;
+	}
+	snprintf(filename, len, "%s/%s-%06llu%s", wall.output_dir, capture->udid, (unsigned long long)capture->written, (ext) ? ext : ".dat");
+	FILE *f = fopen(filename, "wb");
+	if (f) {
+		if (fwrite(data, 1, (size_t)size, f) == (size_t)size) {
+			capture->written++;
+		} else {
+			fprintf(stderr, "Could not write frame to %s\n", filename);
+		}
+		fclose(f);
+	} else {
+		fprintf(stderr, "Could not open %s for writing: %s\n", filename, strerror(errno));
+	}
+	free(filename);
+}
+
+static int capture_frame_cb(const char *imgdata, uint64_t imgsize, const screenshotr_frame_info_t *info, void *user_data)
+{
+	struct capture *capture = (struct capture*)user_data;
+
+	capture->captured++;
+	capture->latency_total += info->latency;
+
+	/* the stream requests the next frame only once this one arrived, so a
+	 * device that captures slowly is not asked for more than it delivers;
+	 * on top of that, a device showing the same content is polled less */
+	uint64_t hash = frame_hash(imgdata, imgsize);
+	if (capture->captured > 1 && imgsize == capture->last_size && hash == capture->last_hash) {
+		if (++capture->unchanged >= IDLE_FRAMES && capture->fps > 1) {
+			capture->fps /= 2;
+			capture->unchanged = 0;
+			screenshotr_stream_set_fps(capture->shotr, capture->fps);
+		}
+		return quit_flag;
+	}
+	capture->unchanged = 0;
+	capture->last_size = imgsize;
+	capture->last_hash = hash;
+	if (capture->fps != wall.max_fps) {
+		capture->fps = wall.max_fps;
+		screenshotr_stream_set_fps(capture->shotr, capture->fps);
+	}
+
+	if (wall.output_dir) {
+		capture_write_frame(capture, imgdata, imgsize);
+	}
+
+	if (wall.serve) {
+		struct frame *frame = (struct frame*)malloc(sizeof(struct frame) + (size_t)imgsize);
+		if (frame) {
+			frame->refcount = 1;
+			frame->size = imgsize;
+			frame->data = (char*)(frame + 1);
+			memcpy(frame->data, imgdata, (size_t)imgsize);
+			image_type(imgdata, imgsize, &frame->mime);
+			mutex_lock(&wall.mutex);
+			frame_release(capture->frame);
+			capture->frame = frame;
+			capture->seq++;
+			capture_wake_viewers(capture);
+			mutex_unlock(&wall.mutex);
+		}
+	}
+
+	return quit_flag;
+}
+
+static struct capture *capture_find(const char *udid)
+{
+	struct capture *capture;
+	for (capture = wall.captures; capture; capture = capture->next) {
+		if (!strcmp(capture->udid, udid))
+			return capture;
+	}
+	return NULL;
+}
+
+static void capture_start(const char *udid)
+{
+	idevice_t device = NULL;
+	lockdownd_client_t lckd = NULL;
+	screenshotr_client_t shotr = NULL;
+	lockdownd_error_t ldret;
+
+	mutex_lock(&wall.mutex);
+	struct capture *capture = capture_find(udid);
+	int active = (capture && capture->active);
+	mutex_unlock(&wall.mutex);
+	if (active) {
+		return;
+	}
+
+	if (idevice_new_with_options(&device, udid, wall.lookup) != IDEVICE_E_SUCCESS) {
+		fprintf(stderr, "%s: Could not connect to device\n", udid);
+		return;
+	}
+	if (LOCKDOWN_E_SUCCESS != (ldret = lockdownd_client_new_with_handshake(device, &lckd, TOOL_NAME))) {
+		fprintf(stderr, "%s: Could not connect to lockdownd, error code %d\n", udid, ldret);
+		idevice_free(device);
+		return;
+	}
+	lockdownd_client_free(lckd);
+	if (screenshotr_client_start_service(device, &shotr, TOOL_NAME) != SCREENSHOTR_E_SUCCESS) {
+		fprintf(stderr, "%s: Could not start screenshotr service! Make sure the Developer disk image is mounted.\n", udid);
+		idevice_free(device);
+		return;
+	}
+
+	mutex_lock(&wall.mutex);
+	if (!capture) {
+		capture = (struct capture*)calloc(1, sizeof(struct capture));
+		if (!capture) {
+			mutex_unlock(&wall.mutex);
+			screenshotr_client_free(shotr);
+			idevice_free(device);
+			return;
+		}
+		capture->udid = strdup(udid);
+		capture->next = wall.captures;
+		wall.captures = capture;
+	}
+	capture->device = device;
+	capture->shotr = shotr;
+	capture->fps = wall.max_fps;
+	capture->unchanged = 0;
+	capture->captured = 0;
+	capture->active = 1;
+	mutex_unlock(&wall.mutex);
+
+	if (screenshotr_start_stream(shotr, wall.max_fps, capture_frame_cb, capture) != SCREENSHOTR_E_SUCCESS) {
+		fprintf(stderr, "%s: Could not start screenshot stream\n", udid);
+		mutex_lock(&wall.mutex);
+		capture->active = 0;
+		capture->shotr = NULL;
+		capture->device = NULL;
+		mutex_unlock(&wall.mutex);
+		screenshotr_client_free(shotr);
+		idevice_free(device);
+		return;
+	}
+
+	printf("%s: Capturing\n", udid);
+}
+
+static void capture_stop(struct capture *capture)
+{
+	mutex_lock(&wall.mutex);
+	int active = capture->active;
+	capture->active = 0;
+	capture_wake_viewers(capture);
+	mutex_unlock(&wall.mutex);
+	if (!active) {
+		return;
+	}
+
+	screenshotr_stop_stream(capture->shotr);
+	screenshotr_client_free(capture->shotr);
+	capture->shotr = NULL;
+	idevice_free(capture->device);
+	capture->device = NULL;
+
+	printf("%s: Stopped after %llu frames", capture->udid, (unsigned long long)capture->captured);
+	if (capture->captured > 0) {
+		printf(", average latency %llu ms", (unsigned long long)(capture->latency_total / capture->captured));
+	}
+	if (wall.output_dir) {
+		printf(", %llu frames written", (unsigned long long)capture->written);
+	}
+	printf("\n");
+}
+
+static void device_event_cb(const idevice_event_t* event, void* user_data)
+{
+	if (event->event == IDEVICE_DEVICE_ADD) {
+		capture_start(event->udid);
+	} else if (event->event == IDEVICE_DEVICE_REMOVE) {
+		mutex_lock(&wall.mutex);
+		struct capture *capture = capture_find(event->udid);
+		mutex_unlock(&wall.mutex);
+		if (capture) {
+			capture_stop(capture);
+		}
+	}
+}
+
+static int http_send_all(int fd, const char *data, uint64_t size)
+{
+	while (size > 0) {
+		int sent = socket_send(fd, (void*)data, (size > 65536) ? 65536 : (size_t)size);
+		if (sent <= 0) {
+			return -1;
+		}
+		data += sent;
+		size -= sent;
+	}
+	return 0;
+}
+
+static int http_send_string(int fd, const char *str)
+{
+	return http_send_all(fd, str, strlen(str));
+}
+
+static void http_send_index(int fd)
+{
+	size_t size = 4096;
+	size_t len = 0;
+	char *page = (char*)malloc(size);
+	if (!page) {
+		return;
+	}
+
+	len += snprintf(page + len, size - len, "<!DOCTYPE html>\n<html><head><title>%s</title></head><body>\n", TOOL_NAME);
+	mutex_lock(&wall.mutex);
+	struct capture *capture;
+	for (capture = wall.captures; capture; capture = capture->next) {
+		if (!capture->active)
+			continue;
+		size_t need = 2 * strlen(capture->udid) + 128;
+		if (len + need + 32 > size) {
+			char *newpage = (char*)realloc(page, size * 2 + need);
+			if (!newpage)
+				break;
+			page = newpage;
+			size = size * 2 + need;
+		}
+		len += snprintf(page + len, size - len, "<figure style=\"display:inline-block\"><img src=\"/stream/%s\" height=\"480\"><figcaption>%s</figcaption></figure>\n", capture->udid, capture->udid);
+	}
+	mutex_unlock(&wall.mutex);
+	len += snprintf(page + len, size - len, "</body></html>\n");
+
+	char header[128];
+	snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/html\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n", len);
+	if (http_send_string(fd, header) == 0) {
+		http_send_all(fd, page, len);
+	}
+	free(page);
+}
+
+static void http_send_frames(int fd, struct capture *capture, int single)
+{
+	struct viewer viewer;
+	uint64_t seq = 0;
+	char header[192];
+
+	if (!single) {
+		if (http_send_string(fd, "HTTP/1.0 200 OK\r\nCache-Control: no-cache\r\nConnection: close\r\nContent-Type: multipart/x-mixed-replace; boundary=" HTTP_BOUNDARY "\r\n\r\n") < 0) {
+			return;
+		}
+	}
+
+	cond_init(&viewer.cond);
+	mutex_lock(&wall.mutex);
+	viewer.next = capture->viewers;
+	capture->viewers = &viewer;
+	while (!quit_flag) {
+		/* a single frame is sent right away if there is one */
+		while (!quit_flag && capture->active && (capture->seq == seq || !capture->frame)) {
+			cond_wait(&viewer.cond, &wall.mutex);
+		}
+		if (quit_flag || !capture->frame || capture->seq == seq) {
+			break;
+		}
+		struct frame *frame = capture->frame;
+		frame->refcount++;
+		seq = capture->seq;
+		mutex_unlock(&wall.mutex);
+
+		int res;
+		if (single) {
+			snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nCache-Control: no-cache\r\nConnection: close\r\nContent-Type: %s\r\nContent-Length: %llu\r\n\r\n", frame->mime, (unsigned long long)frame->size);
+		} else {
+			snprintf(header, sizeof(header), "--" HTTP_BOUNDARY "\r\nContent-Type: %s\r\nContent-Length: %llu\r\n\r\n", frame->mime, (unsigned long long)frame->size);
+		}
+		res = http_send_string(fd, header);
+		if (res == 0)
+			res = http_send_all(fd, frame->data, frame->size);
+		if (res == 0 && !single)
+			res = http_send_string(fd, "\r\n");
+
+		mutex_lock(&wall.mutex);
+		frame_release(frame);
+		if (res < 0 || single) {
+			break;
+		}
+	}
+	struct viewer **prev;
+	for (prev = &capture->viewers; *prev; prev = &(*prev)->next) {
+		if (*prev == &viewer) {
+			*prev = viewer.next;
+			break;
+		}
+	}
+	mutex_unlock(&wall.mutex);
+	cond_destroy(&viewer.cond);
+}
+
+static void* http_client_thread(void *arg)
+{
+	int fd = (int)(intptr_t)arg;
+	char request[4096];
+	int len = 0;
+
+	/* only the request line matters, headers are read and ignored */
+	while (len < (int)sizeof(request) - 1) {
+		int res = socket_receive_timeout(fd, request + len, sizeof(request) - 1 - len, 0, 5000);
+		if (res <= 0) {
+			break;
+		}
+		len += res;
+		request[len] = '\0';
+		if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n")) {
+			break;
+		}
+	}
+	request[len] = '\0';
+
+	char *path = NULL;
+	if (!strncmp(request, "GET ", 4)) {
+		path = request + 4;
+		char *end = strpbrk(path, " \r\n");
+		if (end)
+			*end = '\0';
+	}
+
+	struct capture *capture = NULL;
+	int single = 0;
+	if (path && (!strncmp(path, "/stream/", 8) || !strncmp(path, "/frame/", 7))) {
+		single = (path[1] == 'f');
+		mutex_lock(&wall.mutex);
+		capture = capture_find(path + ((single) ? 7 : 8));
+		mutex_unlock(&wall.mutex);
+	}
+
+	if (!path) {
+		http_send_string(fd, "HTTP/1.0 400 Bad Request\r\nConnection: close\r\n\r\n");
+	} else if (!strcmp(path, "/")) {
+		http_send_index(fd);
+	} else if (capture) {
+		http_send_frames(fd, capture, single);
+	} else {
+		http_send_string(fd, "HTTP/1.0 404 Not Found\r\nConnection: close\r\n\r\n");
+	}
+
+	socket_close(fd);
+
+	return NULL;
+}
+
+static void* http_server_thread(void *arg)
+{
+	int server_fd = (int)(intptr_t)arg;
+
+	while (!quit_flag) {
+		/* wake up regularly to notice quit_flag */
+		if (socket_check_fd(server_fd, FDM_READ, 500) <= 0) {
+			continue;
+		}
+		int fd = socket_accept(server_fd, 0);
+		if (fd < 0) {
+			continue;
+		}
+		THREAD_T thread = THREAD_T_NULL;
+		if (thread_new(&thread, http_client_thread, (void*)(intptr_t)fd) != 0) {
+			socket_close(fd);
+			continue;
+		}
+		thread_detach(thread);
+	}
+
+	return NULL;
+}
+
+static int run_wall(const char *udid, int all, uint16_t http_port)
+{
+	idevice_subscription_t subscription = NULL;
+	int server_fd = -1;
+	THREAD_T server_thread = THREAD_T_NULL;
+	char *first_udid = NULL;
+
+	mutex_init(&wall.mutex);
+
+	if (!all && !udid) {
+		/* follow the first device, also when it gets reconnected */
+		idevice_t device = NULL;
+		if (idevice_new_with_options(&device, NULL, wall.lookup) != IDEVICE_E_SUCCESS) {
+			printf("No device found.\n");
+			return -1;
+		}
+		idevice_get_udid(device, &first_udid);
+		idevice_free(device);
+		udid = first_udid;
+	}
+
+	if (wall.output_dir) {
+		struct stat st;
+		if (stat(wall.output_dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+			fprintf(stderr, "ERROR: %s is not a directory\n", wall.output_dir);
+			free(first_udid);
+			return -1;
+		}
+	}
+
+	if (wall.serve) {
+		server_fd = socket_create(http_port);
+		if (server_fd < 0) {
+			fprintf(stderr, "ERROR: Could not listen on port %u\n", http_port);
+			free(first_udid);
+			return -1;
+		}
+		if (thread_new(&server_thread, http_server_thread, (void*)(intptr_t)server_fd) != 0) {
+			fprintf(stderr, "ERROR: Could not start HTTP server\n");
+			socket_close(server_fd);
+			free(first_udid);
+			return -1;
+		}
+		printf("Serving frames at http://localhost:%u/\n", http_port);
+	}
+
+	signal(SIGINT, clean_exit);
+	signal(SIGTERM, clean_exit);
+
+	int options = wall.lookup | IDEVICE_EVENTS_REPORT_EXISTING;
+	if (idevice_events_subscribe(&subscription, device_event_cb, NULL, udid, options) != IDEVICE_E_SUCCESS) {
+		fprintf(stderr, "ERROR: Could not subscribe to device events\n");
+		quit_flag = 1;
+	}
+
+	while (!quit_flag) {
+		sleep_ms(200);
+	}
+
+	if (subscription) {
+		idevice_events_unsubscribe(subscription);
+	}
+
+	struct capture *capture;
+	for (capture = wall.captures; capture; capture = capture->next) {
+		capture_stop(capture);
+	}
+
+	if (server_thread) {
+		thread_join(server_thread);
+		thread_free(server_thread);
+		socket_close(server_fd);
+	}
+
+	/* HTTP clients still sending see quit_flag and exit with the process,
+	 * so the captures and the mutex are left alone */
+	free(first_udid);
+
+	return 0;
+}
+
 int main(int argc, char **argv)
 {
 	idevice_t device = NULL;
@@ -52,6 +633,10 @@ int main(int argc, char **argv)
 	const char *udid = NULL;
 	int use_network = 0;
 	char *filename = NULL;
+	int all = 0;
+	int http_port = 0;
+
+	wall.max_fps = DEFAULT_FPS;
 
 #ifndef WIN32
 	signal(SIGPIPE, SIG_IGN);
@@ -75,6 +660,37 @@ int main(int argc, char **argv)
 			use_network = 1;
 			continue;
 		}
+		else if (!strcmp(argv[i], "-a") || !strcmp(argv[i], "--all")) {
+			all = 1;
+			continue;
+		}
+		else if (!strcmp(argv[i], "-f") || !strcmp(argv[i], "--fps")) {
+			i++;
+			if (!argv[i] || atoi(argv[i]) <= 0 || atoi(argv[i]) > 1000) {
+				print_usage(argc, argv);
+				return 0;
+			}
+			wall.max_fps = (unsigned int)atoi(argv[i]);
+			continue;
+		}
+		else if (!strcmp(argv[i], "-H") || !strcmp(argv[i], "--http")) {
+			i++;
+			if (!argv[i] || atoi(argv[i]) <= 0 || atoi(argv[i]) > 65535) {
+				print_usage(argc, argv);
+				return 0;
+			}
+			http_port = atoi(argv[i]);
+			continue;
+		}
+		else if (!strcmp(argv[i], "-o") || !strcmp(argv[i], "--output")) {
+			i++;
+			if (!argv[i] || !*argv[i]) {
+				print_usage(argc, argv);
+				return 0;
+			}
+			wall.output_dir = argv[i];
+			continue;
+		}
 		else if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
 			print_usage(argc, argv);
 			return 0;
@@ -93,6 +709,21 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if (http_port > 0 || wall.output_dir) {
+		if (filename || (all && udid)) {
+			print_usage(argc, argv);
+			free(filename);
+			return 0;
+		}
+		wall.lookup = (use_network) ? IDEVICE_LOOKUP_NETWORK : IDEVICE_LOOKUP_USBMUX;
+		wall.serve = (http_port > 0);
+		return run_wall(udid, all, (uint16_t)http_port);
+	} else if (all) {
+		print_usage(argc, argv);
+		free(filename);
+		return 0;
+	}
+
 	if (IDEVICE_E_SUCCESS != idevice_new_with_options(&device, udid, (use_network) ? IDEVICE_LOOKUP_NETWORK : IDEVICE_LOOKUP_USBMUX)) {
 		if (udid) {
 			printf("No device found with udid %s.\n", udid);
@@ -168,6 +799,7 @@ void print_usage(int argc, char **argv)
 
 	name = strrchr(argv[0], '/');
 	printf("Usage: %s [OPTIONS] [FILE]\n", (name ? name + 1: argv[0]));
+	printf("       %s [OPTIONS] --http PORT|--output DIR\n", (name ? name + 1: argv[0]));
 	printf("\n");
 	printf("Gets a screenshot from a device.\n");
 	printf("\n");
@@ -175,11 +807,22 @@ void print_usage(int argc, char **argv)
 	printf("where the default name is \"screenshot-DATE.tiff\", e.g.:\n");
 	printf("   ./screenshot-2013-12-31-23-59-59.tiff\n");
 	printf("\n");
+	printf("With --http or --output, frames are captured continuously until the\n");
+	printf("program is interrupted. Frames that didn't change are skipped, and a\n");
+	printf("device is polled less often while its screen stays the same. --http\n");
+	printf("serves a page with all streams on localhost, the frames of a device as\n");
+	printf("a multipart (MJPEG-style) stream at /stream/UDID and the latest frame\n");
+	printf("at /frame/UDID. --output writes numbered frames to DIR/UDID-NUMBER.EXT.\n");
+	printf("\n");
 	printf("NOTE: A mounted developer disk image is required on the device, otherwise\n");
 	printf("the screenshotr service is not available.\n");
 	printf("\n");
 	printf("  -u, --udid UDID\ttarget specific device by UDID\n");
 	printf("  -n, --network\t\tconnect to network device\n");
+	printf("  -a, --all\t\tcapture from all attached devices (with --http/--output)\n");
+	printf("  -f, --fps N\t\tmaximum frames per second per device (default: %d)\n", DEFAULT_FPS);
+	printf("  -H, --http PORT\tserve frames over HTTP on PORT\n");
+	printf("  -o, --output DIR\twrite numbered frames to DIR\n");
 	printf("  -d, --debug\t\tenable communication debugging\n");
 	printf("  -h, --help\t\tprints usage information\n");
 	printf("  -v, --version\t\tprints version information\n");
@@ -30,6 +30,13 @@
 #include <string.h>
 #include <errno.h>
 #include <getopt.h>
+#include <signal.h>
+#include <ctype.h>
+#include <time.h>
+#include <sys/time.h>
+#ifdef WIN32
+#include <windows.h>
+#endif
 
 #include <libimobiledevice/libimobiledevice.h>
 #include <libimobiledevice/lockdown.h>
@@ -41,9 +48,403 @@
 
 enum {
 	SET_LOCATION = 0,
-	RESET_LOCATION = 1
+	RESET_LOCATION = 1,
+	REPLAY_LOCATION = 2
+};
+
+/* default interval between points without a timestamp, in milliseconds */
+#define DEFAULT_REPLAY_INTERVAL 100
+#define COORDINATE_MAX_LENGTH 32
+
+struct location_point {
+	double time;   /* seconds, only valid if has_time is set */
+	int has_time;
+	char lat[COORDINATE_MAX_LENGTH];
+	char lon[COORDINATE_MAX_LENGTH];
+};
+
+struct location_track {
+	struct location_point *points;
+	unsigned int count;
+	unsigned int capacity;
 };
 
+static volatile int quit_flag = 0;
+
+static void clean_exit(int sig)
+{
+	quit_flag++;
+}
+
+static uint64_t time_now_us(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/**
+ * Sleeps until the given absolute time, so that the schedule doesn't drift
+ * by the time spent sending. Returns early when interrupted.
+ */
+static void sleep_until_us(uint64_t deadline)
+{
+	uint64_t now = time_now_us();
+	while (now < deadline && !quit_flag) {
+		uint64_t left = deadline - now;
+#ifdef WIN32
+		Sleep((DWORD)((left + 999) / 1000));
+#else
+		struct timespec ts;
+		ts.tv_sec = left / 1000000;
+		ts.tv_nsec = (left % 1000000) * 1000;
+		nanosleep(&ts, NULL);
+#endif
+		now = time_now_us();
+	}
+}
+
+/**
+ * Copies a coordinate and checks that it is a number, without converting
+ * it so the device gets exactly the digits from the file.
+ */
+static int copy_coordinate(char *dst, const char *src, size_t len)
+{
+	while (len > 0 && isspace((unsigned char)*src)) {
+		src++;
+		len--;
+	}
+	while (len > 0 && isspace((unsigned char)src[len-1])) {
+		len--;
+	}
+	if (len == 0 || len >= COORDINATE_MAX_LENGTH) {
+		return -1;
+	}
+	memcpy(dst, src, len);
+	dst[len] = '\0';
+
+	char *end = NULL;
+	strtod(dst, &end);
+	return (end && *end == '\0') ? 0 : -1;
+}
+
+static int64_t days_from_civil(int64_t y, unsigned int m, unsigned int d)
+{
+	y -= (m <= 2);
+	int64_t era = (y >= 0 ? y : y - 399) / 400;
+	unsigned int yoe = (unsigned int)(y - era * 400);
+	unsigned int doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+	unsigned int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	return era * 146097 + (int64_t)doe - 719468;
+}
+
+/**
+ * Parses an ISO 8601 timestamp like 2020-05-01T12:34:56.5Z or with a
+ * +hh:mm offset into seconds since the epoch.
+ */
+static int parse_iso8601(const char *str, double *seconds)
+{
+	int year = 0, month = 0, day = 0, hour = 0, minute = 0;
+	double second = 0;
+	int consumed = 0;
+
+	if (sscanf(str, "%d-%d-%dT%d:%d:%lf%n", &year, &month, &day, &hour, &minute, &second, &consumed) < 6) {
+		return -1;
+	}
+	if (month < 1 || month > 12 || day < 1 || day > 31) {
+		return -1;
+	}
+	double result = (double)days_from_civil(year, month, day) * 86400 + hour * 3600 + minute * 60 + second;
+
+	const char *tz = str + consumed;
+	if (*tz == '+' || *tz == '-') {
+		int tzh = 0, tzm = 0;
+		if (sscanf(tz + 1, "%d:%d", &tzh, &tzm) < 1) {
+			return -1;
+		}
+		int offset = tzh * 3600 + tzm * 60;
+		result -= (*tz == '+') ? offset : -offset;
+	}
+	*seconds = result;
+
+	return 0;
+}
+
+static struct location_point *track_add(struct location_track *track)
+{
+	if (track->count == track->capacity) {
+		unsigned int capacity = (track->capacity) ? track->capacity * 2 : 256;
+		struct location_point *points = (struct location_point*)realloc(track->points, capacity * sizeof(struct location_point));
+		if (!points) {
+			return NULL;
+		}
+		track->points = points;
+		track->capacity = capacity;
+	}
+	struct location_point *point = &track->points[track->count];
+	memset(point, 0, sizeof(struct location_point));
+	return point;
+}
+
+/**
+ * Finds the value of an XML attribute inside the tag from start to end.
+ */
+static const char *find_attribute(const char *start, const char *end, const char *name, size_t *len)
+{
+	size_t namelen = strlen(name);
+	const char *p = start;
+	while (p + namelen + 2 < end) {
+		if ((p == start || isspace((unsigned char)p[-1])) && !strncmp(p, name, namelen) && p[namelen] == '=' && (p[namelen+1] == '"' || p[namelen+1] == '\'')) {
+			char quote = p[namelen+1];
+			const char *value = p + namelen + 2;
+			const char *value_end = memchr(value, quote, end - value);
+			if (!value_end) {
+				return NULL;
+			}
+			*len = value_end - value;
+			return value;
+		}
+		p++;
+	}
+	return NULL;
+}
+
+/**
+ * Reads the trkpt, rtept and wpt elements of a GPX file. This is not a full
+ * XML parser, but it handles what GPS tools and editors write.
+ */
+static int parse_gpx(const char *data, struct location_track *track)
+{
+	static const char *elements[] = { "<trkpt", "<rtept", "<wpt" };
+	const char *p = data;
+
+	while (p && *p) {
+		const char *next = NULL;
+		unsigned int i;
+		for (i = 0; i < sizeof(elements) / sizeof(elements[0]); i++) {
+			const char *found = strstr(p, elements[i]);
+			if (found && (!next || found < next)) {
+				next = found;
+			}
+		}
+		if (!next) {
+			break;
+		}
+		const char *tag_end = strchr(next, '>');
+		if (!tag_end) {
+			return -1;
+		}
+
+		struct location_point *point = track_add(track);
+		if (!point) {
+			return -1;
+		}
+		size_t len = 0;
+		const char *lat = find_attribute(next, tag_end, "lat", &len);
+		if (!lat || copy_coordinate(point->lat, lat, len) < 0) {
+			return -1;
+		}
+		const char *lon = find_attribute(next, tag_end, "lon", &len);
+		if (!lon || copy_coordinate(point->lon, lon, len) < 0) {
+			return -1;
+		}
+
+		p = tag_end + 1;
+		if (tag_end[-1] != '/') {
+			/* look for a timestamp before the element is closed */
+			const char *close = strstr(p, "</");
+			const char *time_tag = strstr(p, "<time>");
+			while (close && time_tag && close < time_tag && strncmp(close, "</trkpt", 7) && strncmp(close, "</rtept", 7) && strncmp(close, "</wpt", 5)) {
+				close = strstr(close + 2, "</");
+			}
+			if (time_tag && (!close || time_tag < close)) {
+				point->has_time = (parse_iso8601(time_tag + 6, &point->time) == 0);
+			}
+		}
+		track->count++;
+	}
+
+	return (track->count > 0) ? 0 : -1;
+}
+
+/**
+ * Reads lines of the form [TIME,]LAT,LON where TIME is in seconds or an
+ * ISO 8601 timestamp. Empty lines and lines starting with '#' are skipped.
+ */
+static int parse_csv(char *data, struct location_track *track)
+{
+	char *line = data;
+
+	while (line && *line) {
+		char *eol = strchr(line, '\n');
+		if (eol) {
+			*eol = '\0';
+		}
+		char *p = line;
+		while (isspace((unsigned char)*p)) {
+			p++;
+		}
+		if (*p != '\0' && *p != '#') {
+			char *fields[3] = { p, NULL, NULL };
+			int nfields = 1;
+			char *comma = p;
+			while (nfields < 3 && (comma = strchr(comma, ',')) != NULL) {
+				*comma++ = '\0';
+				fields[nfields++] = comma;
+			}
+			if (nfields < 2 || strchr(fields[nfields-1], ',')) {
+				return -1;
+			}
+			struct location_point *point = track_add(track);
+			if (!point) {
+				return -1;
+			}
+			char *latf = fields[nfields-2];
+			char *lonf = fields[nfields-1];
+			if (copy_coordinate(point->lat, latf, strlen(latf)) < 0 || copy_coordinate(point->lon, lonf, strlen(lonf)) < 0) {
+				/* a header line */
+				if (track->count == 0) {
+					line = (eol) ? eol + 1 : NULL;
+					continue;
+				}
+				return -1;
+			}
+			if (nfields == 3) {
+				char *end = NULL;
+				point->time = strtod(fields[0], &end);
+				point->has_time = (end != fields[0] && (*end == '\0' || isspace((unsigned char)*end)));
+				if (!point->has_time) {
+					point->has_time = (parse_iso8601(fields[0], &point->time) == 0);
+				}
+				if (!point->has_time) {
+					return -1;
+				}
+			}
+			track->count++;
+		}
+		line = (eol) ? eol + 1 : NULL;
+	}
+
+	return (track->count > 0) ? 0 : -1;
+}
+
+static int load_track(const char *filename, struct location_track *track)
+{
+	FILE *f = fopen(filename, "rb");
+	if (!f) {
+		fprintf(stderr, "ERROR: Could not open %s: %s\n", filename, strerror(errno));
+		return -1;
+	}
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	if (size <= 0) {
+		fclose(f);
+		fprintf(stderr, "ERROR: %s is empty\n", filename);
+		return -1;
+	}
+	char *data = (char*)malloc(size + 1);
+	if (!data || fread(data, 1, size, f) != (size_t)size) {
+		fclose(f);
+		free(data);
+		fprintf(stderr, "ERROR: Could not read %s\n", filename);
+		return -1;
+	}
+	fclose(f);
+	data[size] = '\0';
+
+	int res;
+	if (strstr(data, "<gpx")) {
+		res = parse_gpx(data, track);
+	} else {
+		res = parse_csv(data, track);
+	}
+	free(data);
+	if (res < 0) {
+		fprintf(stderr, "ERROR: Could not parse any locations from %s\n", filename);
+	}
+
+	return res;
+}
+
+/**
+ * Sends all points of a track over the open service connection, each one
+ * at its time relative to the first point divided by speed. Points without
+ * a timestamp follow the previous one after interval milliseconds.
+ */
+static int replay_track(service_client_t service, struct location_track *track, unsigned int interval, double speed)
+{
+	unsigned int i;
+	size_t maxlen = 0;
+
+	for (i = 0; i < track->count; i++) {
+		size_t len = strlen(track->points[i].lat) + strlen(track->points[i].lon);
+		if (len > maxlen) {
+			maxlen = len;
+		}
+	}
+
+	/* one buffer for all messages: mode, lat and lon with their lengths */
+	char *buf = (char*)malloc(12 + maxlen);
+	if (!buf) {
+		return -1;
+	}
+
+	double first_time = 0;
+	int have_first_time = 0;
+	uint64_t offset = 0;
+	uint64_t start = time_now_us();
+	unsigned int sent_points = 0;
+	int res = 0;
+
+	for (i = 0; i < track->count && !quit_flag; i++) {
+		struct location_point *point = &track->points[i];
+
+		if (i > 0) {
+			uint64_t next = offset + (uint64_t)interval * 1000;
+			if (point->has_time && have_first_time) {
+				double rel = (point->time - first_time) / speed;
+				next = (rel * 1000000 > (double)offset) ? (uint64_t)(rel * 1000000) : offset;
+			}
+			offset = next;
+		}
+		if (point->has_time && !have_first_time) {
+			/* timestamps count from the first timed point */
+			first_time = point->time - (double)offset * speed / 1000000;
+			have_first_time = 1;
+		}
+		sleep_until_us(start + offset);
+		if (quit_flag) {
+			break;
+		}
+
+		uint32_t latlen = strlen(point->lat);
+		uint32_t lonlen = strlen(point->lon);
+		uint32_t l = htobe32(SET_LOCATION);
+		memcpy(buf, &l, 4);
+		l = htobe32(latlen);
+		memcpy(buf+4, &l, 4);
+		memcpy(buf+8, point->lat, latlen);
+		l = htobe32(lonlen);
+		memcpy(buf+8+latlen, &l, 4);
+		memcpy(buf+12+latlen, point->lon, lonlen);
+
+		uint32_t s = 0;
+		uint32_t len = 12 + latlen + lonlen;
+		if (service_send(service, buf, len, &s) != SERVICE_E_SUCCESS || s != len) {
+			fprintf(stderr, "ERROR: Could not send location %u\n", i);
+			res = -1;
+			break;
+		}
+		sent_points++;
+	}
+	free(buf);
+
+	printf("Replayed %u of %u locations in %.1f seconds\n", sent_points, track->count, (double)(time_now_us() - start) / 1000000);
+
+	return res;
+}
+
 static void print_usage(int argc, char **argv, int is_error)
 {
 	char *bname = strrchr(argv[0], '/');
@@ -51,10 +452,18 @@ static void print_usage(int argc, char **argv, int is_error)
 
 	fprintf(is_error ? stderr : stdout, "Usage: %s [OPTIONS] -- <LAT> <LONG>\n", bname);
 	fprintf(is_error ? stderr : stdout, "       %s [OPTIONS] reset\n", bname);
+	fprintf(is_error ? stderr : stdout, "       %s [OPTIONS] replay FILE\n", bname);
 	fprintf(is_error ? stderr : stdout, "\n" \
+		"Replay sends the locations of a GPX file or CSV file with lines of\n" \
+		"the form [TIME,]LAT,LON over one connection, at the times given in\n" \
+		"the file.\n" \
+		"\n" \
 		"OPTIONS:\n" \
 		"  -u, --udid UDID    target specific device by UDID\n" \
 		"  -n, --network      connect to network device\n" \
+		"  -i, --interval MS  replay points without a time MS milliseconds apart\n" \
+		"                     (default: 100)\n" \
+		"  -s, --speed FACTOR replay faster or slower than the timestamps\n" \
 		"  -d, --debug        enable communication debugging\n" \
 		"  -h, --help         prints usage information\n" \
 		"  -v, --version      prints version information\n" \
@@ -73,14 +482,33 @@ int main(int argc, char **argv)
 		{ "debug",   no_argument,       NULL, 'd' },
 		{ "network", no_argument,       NULL, 'n' },
 		{ "version", no_argument,       NULL, 'v' },
+		{ "interval", required_argument, NULL, 'i' },
+		{ "speed",   required_argument, NULL, 's' },
 		{ NULL, 0, NULL, 0}
 	};
 	uint32_t mode = 0;
 	const char *udid = NULL;
 	int use_network = 0;
+	unsigned int interval = DEFAULT_REPLAY_INTERVAL;
+	double speed = 1.0;
+	struct location_track track = { NULL, 0, 0 };
 
-	while ((c = getopt_long(argc, argv, "dhu:nv", longopts, NULL)) != -1) {
+	while ((c = getopt_long(argc, argv, "dhu:nvi:s:", longopts, NULL)) != -1) {
 		switch (c) {
+		case 'i':
+			interval = (unsigned int)strtoul(optarg, NULL, 10);
+			if (interval == 0) {
+				fprintf(stderr, "ERROR: Interval must be a positive number of milliseconds!\n");
+				return 2;
+			}
+			break;
+		case 's':
+			speed = strtod(optarg, NULL);
+			if (speed <= 0) {
+				fprintf(stderr, "ERROR: Speed must be a positive factor!\n");
+				return 2;
+			}
+			break;
 		case 'd':
 			idevice_set_debug_level(1);
 			break;
@@ -115,7 +543,12 @@ int main(int argc, char **argv)
 		return -1;
 	}
 
-	if (argc == 2) {
+	if (argc == 2 && strcmp(argv[0], "replay") == 0) {
+		mode = REPLAY_LOCATION;
+		if (load_track(argv[1], &track) < 0) {
+			return -1;
+		}
+	} else if (argc == 2) {
 		mode = SET_LOCATION;
 	} else if (argc == 1) {
 		if (strcmp(argv[0], "reset") == 0) {
@@ -162,6 +595,16 @@ int main(int argc, char **argv)
 		return -1;
 	}
 
+	if (mode == REPLAY_LOCATION) {
+		signal(SIGINT, clean_exit);
+		signal(SIGTERM, clean_exit);
+		int res = replay_track(service, &track, interval, speed);
+		free(track.points);
+		service_client_free(service);
+		idevice_free(device);
+		return res;
+	}
+
 	uint32_t l;
 	uint32_t s = 0;
 
@@ -66,14 +66,12 @@ static int triggered = 0;
 
 static idevice_t device = NULL;
 static syslog_relay_client_t syslog = NULL;
+static syslog_relay_aggregator_t aggregator = NULL;
 
 static const char QUIET_FILTER[] = "CircleJoinRequested|CommCenter|HeuristicInterpreter|MobileMail|PowerUIAgent|ProtectedCloudKeySyncing|SpringBoard|UserEventAgent|WirelessRadioManagerd|accessoryd|accountsd|aggregated|analyticsd|appstored|apsd|assetsd|assistant_service|backboardd|biometrickitd|bluetoothd|calaccessd|callservicesd|cloudd|com.apple.Safari.SafeBrowsing.Service|contextstored|corecaptured|coreduetd|corespeechd|cdpd|dasd|dataaccessd|distnoted|dprivacyd|duetexpertd|findmydeviced|fmfd|fmflocatord|gpsd|healthd|homed|identityservicesd|imagent|itunescloudd|itunesstored|kernel|locationd|maild|mDNSResponder|mediaremoted|mediaserverd|mobileassetd|nanoregistryd|nanotimekitcompaniond|navd|nsurlsessiond|passd|pasted|photoanalysisd|powerd|powerlogHelperd|ptpd|rapportd|remindd|routined|runningboardd|searchd|sharingd|suggestd|symptomsd|timed|thermalmonitord|useractivityd|vmd|wifid|wirelessproxd";
 
 static int use_network = 0;
 
-static char *line = NULL;
-static int line_buffer_size = 0;
-static int lp = 0;
 
 #ifdef WIN32
 static WORD COLOR_RESET = 0;
@@ -171,6 +169,205 @@ static void add_filter(const char* filterstr)
 	}
 }
 
+/*
+ * Filters are compiled once after parsing the options: process names go
+ * into a hash table, pids into a sorted array and the message, trigger and
+ * untrigger strings into Aho-Corasick automatons, so matching a line costs
+ * the same no matter how many filters are given.
+ */
+
+struct string_matcher {
+	int num_states;
+	int *next; /* num_states * 256 transitions */
+	unsigned char *accept;
+};
+
+static struct string_matcher msg_matcher = { 0, NULL, NULL };
+static struct string_matcher trigger_matcher = { 0, NULL, NULL };
+static struct string_matcher untrigger_matcher = { 0, NULL, NULL };
+
+struct proc_filter_entry {
+	const char *name;
+	size_t len;
+};
+
+static struct proc_filter_entry *proc_filter_table = NULL;
+static unsigned int proc_filter_table_size = 0;
+
+static void *xcalloc(size_t nmemb, size_t size)
+{
+	void *p = calloc(nmemb, size);
+	if (!p) {
+		fprintf(stderr, "ERROR: calloc() failed\n");
+		exit(EXIT_FAILURE);
+	}
+	return p;
+}
+
+static void string_matcher_build(struct string_matcher *m, char **patterns, int num_patterns)
+{
+	int max_states = 1;
+	int i;
+
+	if (num_patterns == 0) {
+		return;
+	}
+	for (i = 0; i < num_patterns; i++) {
+		max_states += strlen(patterns[i]);
+	}
+
+	m->next = (int*)xcalloc((size_t)max_states * 256, sizeof(int));
+	m->accept = (unsigned char*)xcalloc(max_states, 1);
+	m->num_states = 1;
+
+	/* build the trie, 0 is the root and doubles as "no transition" */
+	for (i = 0; i < num_patterns; i++) {
+		const unsigned char *p = (const unsigned char*)patterns[i];
+		int state = 0;
+		for (; *p; p++) {
+			int *t = &m->next[state * 256 + *p];
+			if (*t == 0) {
+				*t = m->num_states++;
+			}
+			state = *t;
+		}
+		m->accept[state] = 1;
+	}
+
+	/* turn it into a DFA by resolving failure links breadth first */
+	int *fail = (int*)xcalloc(m->num_states, sizeof(int));
+	int *queue = (int*)xcalloc(m->num_states, sizeof(int));
+	int head = 0;
+	int tail = 0;
+	int c;
+	for (c = 0; c < 256; c++) {
+		int s = m->next[c];
+		if (s) {
+			fail[s] = 0;
+			queue[tail++] = s;
+		}
+	}
+	while (head < tail) {
+		int state = queue[head++];
+		m->accept[state] |= m->accept[fail[state]];
+		for (c = 0; c < 256; c++) {
+			int *t = &m->next[state * 256 + c];
+			if (*t) {
+				fail[*t] = m->next[fail[state] * 256 + c];
+				queue[tail++] = *t;
+			} else {
+				*t = m->next[fail[state] * 256 + c];
+			}
+		}
+	}
+	free(queue);
+	free(fail);
+}
+
+static void string_matcher_free(struct string_matcher *m)
+{
+	free(m->next);
+	free(m->accept);
+	m->next = NULL;
+	m->accept = NULL;
+	m->num_states = 0;
+}
+
+/* returns 1 if any of the patterns occurs in the given data */
+static int string_matcher_match(const struct string_matcher *m, const char *data, size_t length)
+{
+	const unsigned char *p = (const unsigned char*)data;
+	const unsigned char *end = p + length;
+	int state = 0;
+
+	while (p < end) {
+		state = m->next[state * 256 + *p++];
+		if (m->accept[state]) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static unsigned int proc_filter_hash(const char *name, size_t len)
+{
+	unsigned int hash = 2166136261u;
+	size_t i;
+	for (i = 0; i < len; i++) {
+		hash ^= (unsigned char)name[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static int proc_filter_lookup(const char *name, size_t len)
+{
+	if (!proc_filter_table) {
+		return 0;
+	}
+	unsigned int i = proc_filter_hash(name, len) & (proc_filter_table_size - 1);
+	while (proc_filter_table[i].name) {
+		if (proc_filter_table[i].len == len && memcmp(proc_filter_table[i].name, name, len) == 0) {
+			return 1;
+		}
+		i = (i + 1) & (proc_filter_table_size - 1);
+	}
+	return 0;
+}
+
+static int compare_pids(const void *a, const void *b)
+{
+	int pa = *(const int*)a;
+	int pb = *(const int*)b;
+	return (pa > pb) - (pa < pb);
+}
+
+static int pid_filter_lookup(int pid)
+{
+	return bsearch(&pid, pid_filters, num_pid_filters, sizeof(int), compare_pids) != NULL;
+}
+
+static void compile_filters(void)
+{
+	int i;
+
+	if (num_proc_filters > 0) {
+		proc_filter_table_size = 16;
+		while (proc_filter_table_size < (unsigned int)num_proc_filters * 2) {
+			proc_filter_table_size *= 2;
+		}
+		proc_filter_table = (struct proc_filter_entry*)xcalloc(proc_filter_table_size, sizeof(struct proc_filter_entry));
+		for (i = 0; i < num_proc_filters; i++) {
+			if (!proc_filters[i]) continue;
+			size_t len = strlen(proc_filters[i]);
+			if (proc_filter_lookup(proc_filters[i], len)) continue;
+			unsigned int j = proc_filter_hash(proc_filters[i], len) & (proc_filter_table_size - 1);
+			while (proc_filter_table[j].name) {
+				j = (j + 1) & (proc_filter_table_size - 1);
+			}
+			proc_filter_table[j].name = proc_filters[i];
+			proc_filter_table[j].len = len;
+		}
+	}
+
+	if (num_pid_filters > 0) {
+		qsort(pid_filters, num_pid_filters, sizeof(int), compare_pids);
+	}
+
+	string_matcher_build(&msg_matcher, msg_filters, num_msg_filters);
+	string_matcher_build(&trigger_matcher, trigger_filters, num_trigger_filters);
+	string_matcher_build(&untrigger_matcher, untrigger_filters, num_untrigger_filters);
+}
+
+static void free_compiled_filters(void)
+{
+	free(proc_filter_table);
+	proc_filter_table = NULL;
+	string_matcher_free(&msg_matcher);
+	string_matcher_free(&trigger_matcher);
+	string_matcher_free(&untrigger_matcher);
+}
+
 static int find_char(char c, char** p, char* end)
 {
 	while ((**p != c) && (*p < end)) {
@@ -181,223 +378,173 @@ static int find_char(char c, char** p, char* end)
 
 static void stop_logging(void);
 
-static void syslog_callback(char c, void *user_data)
+static void syslog_callback(const char *data, uint32_t length, void *user_data)
 {
-	if (lp >= line_buffer_size-1) {
-		line_buffer_size+=1024;
-		char* _line = realloc(line, line_buffer_size);
-		if (!_line) {
-			fprintf(stderr, "ERROR: realloc failed\n");
-			exit(EXIT_FAILURE);
-		}
-		line = _line;
-	}
-	line[lp++] = c;
-	if (c == '\0') {
-		int shall_print = 0;
-		int trigger_off = 0;
-		lp--;
-		char* linep = &line[0];
-		do {
-			if (lp < 16) {
-				shall_print = 1;
-				TEXT_COLOR(COLOR_WHITE);
-				break;
-			} else if (line[3] == ' ' && line[6] == ' ' && line[15] == ' ') {
-				char* end = &line[lp];
-				char* p = &line[16];
-
-				/* device name */
-				char* device_name_start = p;
-				char* device_name_end = p;
-				if (!find_char(' ', &p, end)) break;
-				device_name_end = p;
-				p++;
-
-				/* check if we have any triggers/untriggers */
-				if (num_untrigger_filters > 0 && triggered) {
-					int found = 0;
-					int i;
-					for (i = 0; i < num_untrigger_filters; i++) {
-						if (strstr(device_name_end+1, untrigger_filters[i])) {
-							found = 1;
-							break;
-						}
-					}
-					if (!found) {
-						shall_print = 1;
-					} else {
-						shall_print = 1;
-						trigger_off = 1;
-					}
-				} else if (num_trigger_filters > 0 && !triggered) {
-					int found = 0;
-					int i;
-					for (i = 0; i < num_trigger_filters; i++) {
-						if (strstr(device_name_end+1, trigger_filters[i])) {
-							found = 1;
-							break;
-						}
-					}
-					if (!found) {
-						shall_print = 0;
-						break;
-					} else {
-						triggered = 1;
-						shall_print = 1;
-					}
-				} else if (num_trigger_filters == 0 && num_untrigger_filters > 0 && !triggered) {
+	const char* line = data;
+	int lp = (int)length;
+	int shall_print = 0;
+	int trigger_off = 0;
+	char* linep = (char*)&line[0];
+	do {
+		if (lp < 16) {
+			shall_print = 1;
+			TEXT_COLOR(COLOR_WHITE);
+			break;
+		} else if (line[3] == ' ' && line[6] == ' ' && line[15] == ' ') {
+			char* end = (char*)&line[lp];
+			char* p = (char*)&line[16];
+
+			/* device name */
+			char* device_name_start = p;
+			char* device_name_end = p;
+			if (!find_char(' ', &p, end)) break;
+			device_name_end = p;
+			p++;
+
+			/* check if we have any triggers/untriggers */
+			if (num_untrigger_filters > 0 && triggered) {
+				int found = string_matcher_match(&untrigger_matcher, device_name_end+1, end - (device_name_end+1));
+				if (!found) {
+					shall_print = 1;
+				} else {
+					shall_print = 1;
+					trigger_off = 1;
+				}
+			} else if (num_trigger_filters > 0 && !triggered) {
+				int found = string_matcher_match(&trigger_matcher, device_name_end+1, end - (device_name_end+1));
+				if (!found) {
 					shall_print = 0;
-					quit_flag++;
 					break;
+				} else {
+					triggered = 1;
+					shall_print = 1;
 				}
+			} else if (num_trigger_filters == 0 && num_untrigger_filters > 0 && !triggered) {
+				shall_print = 0;
+				quit_flag++;
+				break;
+			}
 
-				/* check message filters */
-				if (num_msg_filters > 0) {
-					int found = 0;
-					int i;
-					for (i = 0; i < num_msg_filters; i++) {
-						if (strstr(device_name_end+1, msg_filters[i])) {
-							found = 1;
-							break;
-						}
-					}
-					if (!found) {
-						shall_print = 0;
-						break;
-					} else {
-						shall_print = 1;
-					}
+			/* check message filters */
+			if (num_msg_filters > 0) {
+				int found = string_matcher_match(&msg_matcher, device_name_end+1, end - (device_name_end+1));
+				if (!found) {
+					shall_print = 0;
+					break;
+				} else {
+					shall_print = 1;
 				}
+			}
 
-				/* process name */
-				char* proc_name_start = p;
-				char* proc_name_end = p;
-				if (!find_char('[', &p, end)) break;
-				char* process_name_start = proc_name_start;
-				char* process_name_end = p;
-				char* pid_start = p+1;
-				char* pp = process_name_start;
-				if (find_char('(', &pp, p)) {
-					process_name_end = pp;
-				}
-				if (!find_char(']', &p, end)) break;
-				p++;
-				if (*p != ' ') break;
-				proc_name_end = p;
-				p++;
-
-				int proc_matched = 0;
-				if (num_pid_filters > 0) {
-					char* endp = NULL;
-					int pid_value = (int)strtol(pid_start, &endp, 10);
-					if (endp && (*endp == ']')) {
-						int found = proc_filter_excluding;
-						int i = 0;
-						for (i = 0; i < num_pid_filters; i++) {
-							if (pid_value == pid_filters[i]) {
-								found = !proc_filter_excluding;
-								break;
-							}
-						}
-						if (found) {
-							proc_matched = 1;
-						}
-					}
-				}
-				if (num_proc_filters > 0 && !proc_matched) {
-					int found = proc_filter_excluding;
-					int i = 0;
-					for (i = 0; i < num_proc_filters; i++) {
-						if (!proc_filters[i]) continue;
-						if (strncmp(proc_filters[i], process_name_start, process_name_end-process_name_start) == 0) {
-							found = !proc_filter_excluding;
-							break;
-						}
-					}
+			/* process name */
+			char* proc_name_start = p;
+			char* proc_name_end = p;
+			if (!find_char('[', &p, end)) break;
+			char* process_name_start = proc_name_start;
+			char* process_name_end = p;
+			char* pid_start = p+1;
+			char* pp = process_name_start;
+			if (find_char('(', &pp, p)) {
+				process_name_end = pp;
+			}
+			if (!find_char(']', &p, end)) break;
+			p++;
+			if (*p != ' ') break;
+			proc_name_end = p;
+			p++;
+
+			int proc_matched = 0;
+			if (num_pid_filters > 0) {
+				char* endp = NULL;
+				int pid_value = (int)strtol(pid_start, &endp, 10);
+				if (endp && (*endp == ']')) {
+					int found = (pid_filter_lookup(pid_value)) ? !proc_filter_excluding : proc_filter_excluding;
 					if (found) {
 						proc_matched = 1;
 					}
 				}
-				if (proc_matched) {
-					shall_print = 1;
-				} else {
-					if (num_pid_filters > 0 || num_proc_filters > 0) {
-						shall_print = 0;
-						break;
-					}
+			}
+			if (num_proc_filters > 0 && !proc_matched) {
+				int found = (proc_filter_lookup(process_name_start, process_name_end-process_name_start)) ? !proc_filter_excluding : proc_filter_excluding;
+				if (found) {
+					proc_matched = 1;
+				}
+			}
+			if (proc_matched) {
+				shall_print = 1;
+			} else {
+				if (num_pid_filters > 0 || num_proc_filters > 0) {
+					shall_print = 0;
+					break;
 				}
+			}
 
-				/* log level */
-				char* level_start = p;
-				char* level_end = p;
+			/* log level */
+			char* level_start = p;
+			char* level_end = p;
 #ifdef WIN32
-				WORD level_color = COLOR_NORMAL;
+			WORD level_color = COLOR_NORMAL;
 #else
-				const char* level_color = NULL;
+			const char* level_color = NULL;
 #endif
-				if (!strncmp(p, "<Notice>:", 9)) {
-					level_end += 9;
-					level_color = COLOR_GREEN;
-				} else if (!strncmp(p, "<Error>:", 8)) {
-					level_end += 8;
-					level_color = COLOR_RED;
-				} else if (!strncmp(p, "<Warning>:", 10)) {
-					level_end += 10;
-					level_color = COLOR_YELLOW;
-				} else if (!strncmp(p, "<Debug>:", 8)) {
-					level_end += 8;
-					level_color = COLOR_MAGENTA;
-				} else {
-					level_color = COLOR_WHITE;
-				}
+			if (!strncmp(p, "<Notice>:", 9)) {
+				level_end += 9;
+				level_color = COLOR_GREEN;
+			} else if (!strncmp(p, "<Error>:", 8)) {
+				level_end += 8;
+				level_color = COLOR_RED;
+			} else if (!strncmp(p, "<Warning>:", 10)) {
+				level_end += 10;
+				level_color = COLOR_YELLOW;
+			} else if (!strncmp(p, "<Debug>:", 8)) {
+				level_end += 8;
+				level_color = COLOR_MAGENTA;
+			} else {
+				level_color = COLOR_WHITE;
+			}
 
-				/* write date and time */
-				TEXT_COLOR(COLOR_DARK_WHITE);
-				fwrite(line, 1, 16, stdout);
+			/* write date and time */
+			TEXT_COLOR(COLOR_DARK_WHITE);
+			fwrite(line, 1, 16, stdout);
 
-				if (show_device_name) {
-					/* write device name */
-					TEXT_COLOR(COLOR_DARK_YELLOW);
-					fwrite(device_name_start, 1, device_name_end-device_name_start+1, stdout);
-					TEXT_COLOR(COLOR_RESET);
-				}
+			if (show_device_name) {
+				/* write device name */
+				TEXT_COLOR(COLOR_DARK_YELLOW);
+				fwrite(device_name_start, 1, device_name_end-device_name_start+1, stdout);
+				TEXT_COLOR(COLOR_RESET);
+			}
 
-				/* write process name */
-				TEXT_COLOR(COLOR_BRIGHT_CYAN);
-				fwrite(process_name_start, 1, process_name_end-process_name_start, stdout);
-				TEXT_COLOR(COLOR_CYAN);
-				fwrite(process_name_end, 1, proc_name_end-process_name_end+1, stdout);
-
-				/* write log level */
-				TEXT_COLOR(level_color);
-				if (level_end > level_start) {
-					fwrite(level_start, 1, level_end-level_start, stdout);
-					p = level_end;
-				}
+			/* write process name */
+			TEXT_COLOR(COLOR_BRIGHT_CYAN);
+			fwrite(process_name_start, 1, process_name_end-process_name_start, stdout);
+			TEXT_COLOR(COLOR_CYAN);
+			fwrite(process_name_end, 1, proc_name_end-process_name_end+1, stdout);
+
+			/* write log level */
+			TEXT_COLOR(level_color);
+			if (level_end > level_start) {
+				fwrite(level_start, 1, level_end-level_start, stdout);
+				p = level_end;
+			}
 
-				lp -= p - linep;
-				linep = p;
+			lp -= p - linep;
+			linep = p;
 
-				TEXT_COLOR(COLOR_WHITE);
+			TEXT_COLOR(COLOR_WHITE);
 
-			} else {
-				shall_print = 1;
-				TEXT_COLOR(COLOR_WHITE);
-			}
-		} while (0);
-
-		if ((num_msg_filters == 0 && num_proc_filters == 0 && num_pid_filters == 0 && num_trigger_filters == 0 && num_untrigger_filters == 0) || shall_print) {
-			fwrite(linep, 1, lp, stdout);
-			TEXT_COLOR(COLOR_RESET);
-			fflush(stdout);
-			if (trigger_off) {
-				triggered = 0;
-			}
+		} else {
+			shall_print = 1;
+			TEXT_COLOR(COLOR_WHITE);
+		}
+	} while (0);
+
+	if ((num_msg_filters == 0 && num_proc_filters == 0 && num_pid_filters == 0 && num_trigger_filters == 0 && num_untrigger_filters == 0) || shall_print) {
+		fwrite(linep, 1, lp, stdout);
+		TEXT_COLOR(COLOR_RESET);
+		fflush(stdout);
+		if (trigger_off) {
+			triggered = 0;
 		}
-		line[0] = '\0';
-		lp = 0;
-		return;
 	}
 }
 
@@ -451,7 +598,7 @@ static int start_logging(void)
 	}
 
 	/* start capturing syslog */
-	serr = syslog_relay_start_capture_raw(syslog, syslog_callback, NULL);
+	serr = syslog_relay_start_capture_lines(syslog, syslog_callback, NULL);
 	if (serr != SYSLOG_RELAY_E_SUCCESS) {
 		fprintf(stderr, "ERROR: Unable tot start capturing syslog.\n");
 		syslog_relay_client_free(syslog);
@@ -482,6 +629,42 @@ static void stop_logging(void)
 	}
 }
 
+static void aggregator_callback(const char *dev_udid, const char *data, uint32_t length, void *user_data)
+{
+	if (!data) {
+		fprintf(stdout, "[disconnected:%s]\n", dev_udid);
+		fflush(stdout);
+		return;
+	}
+	TEXT_COLOR(COLOR_DARK_YELLOW);
+	fprintf(stdout, "%s ", dev_udid);
+	TEXT_COLOR(COLOR_RESET);
+	syslog_callback(data, length, user_data);
+}
+
+static void aggregator_event_cb(const idevice_event_t* event, void* userdata)
+{
+	if (use_network && event->conn_type != CONNECTION_NETWORK) {
+		return;
+	} else if (!use_network && event->conn_type != CONNECTION_USBMUXD) {
+		return;
+	}
+	if (event->event == IDEVICE_DEVICE_ADD) {
+		syslog_relay_error_t serr = syslog_relay_aggregator_add_device(aggregator, event->udid, (use_network) ? IDEVICE_LOOKUP_NETWORK : IDEVICE_LOOKUP_USBMUX);
+		if (serr != SYSLOG_RELAY_E_SUCCESS) {
+			fprintf(stderr, "Could not start logger for udid %s: %d\n", event->udid, serr);
+			return;
+		}
+		fprintf(stdout, "[connected:%s]\n", event->udid);
+		fflush(stdout);
+	} else if (event->event == IDEVICE_DEVICE_REMOVE) {
+		if (syslog_relay_aggregator_remove_device(aggregator, event->udid) == SYSLOG_RELAY_E_SUCCESS) {
+			fprintf(stdout, "[disconnected:%s]\n", event->udid);
+			fflush(stdout);
+		}
+	}
+}
+
 static void device_event_cb(const idevice_event_t* event, void* userdata)
 {
 	if (use_network && event->conn_type != CONNECTION_NETWORK) {
@@ -532,6 +715,7 @@ static void print_usage(int argc, char **argv, int is_error)
 		"OPTIONS:\n" \
 		"  -u, --udid UDID  target specific device by UDID\n" \
 		"  -n, --network    connect to network device\n" \
+		"  -a, --all        relay the syslog of all devices, prefixed with their UDID\n" \
 		"  -x, --exit       exit when device disconnects\n" \
 		"  -h, --help       prints usage information\n" \
 		"  -d, --debug      enable communication debugging\n" \
@@ -572,12 +756,14 @@ int main(int argc, char *argv[])
 	int exclude_filter = 0;
 	int include_kernel = 0;
 	int exclude_kernel = 0;
+	int all_devices = 0;
 	int c = 0;
 	const struct option longopts[] = {
 		{ "debug", no_argument, NULL, 'd' },
 		{ "help", no_argument, NULL, 'h' },
 		{ "udid", required_argument, NULL, 'u' },
 		{ "network", no_argument, NULL, 'n' },
+		{ "all", no_argument, NULL, 'a' },
 		{ "exit", no_argument, NULL, 'x' },
 		{ "trigger", required_argument, NULL, 't' },
 		{ "untrigger", required_argument, NULL, 'T' },
@@ -600,7 +786,7 @@ int main(int argc, char *argv[])
 	signal(SIGPIPE, SIG_IGN);
 #endif
 
-	while ((c = getopt_long(argc, argv, "dhu:nxt:T:m:e:p:qkKv", longopts, NULL)) != -1) {
+	while ((c = getopt_long(argc, argv, "dhu:naxt:T:m:e:p:qkKv", longopts, NULL)) != -1) {
 		switch (c) {
 		case 'd':
 			idevice_set_debug_level(1);
@@ -617,6 +803,9 @@ int main(int argc, char *argv[])
 		case 'n':
 			use_network = 1;
 			break;
+		case 'a':
+			all_devices = 1;
+			break;
 		case 'q':
 			exclude_filter++;
 			add_filter(QUIET_FILTER);
@@ -749,10 +938,18 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if (all_devices && (udid || exit_on_disconnect)) {
+		fprintf(stderr, "ERROR: -a cannot be used together with -u or -x.\n");
+		print_usage(argc, argv, 1);
+		return 2;
+	}
+
 	if (num_untrigger_filters > 0 && num_trigger_filters == 0) {
 		triggered = 1;
 	}
 
+	compile_filters();
+
 	argc -= optind;
 	argv += optind;
 
@@ -765,7 +962,9 @@ int main(int argc, char *argv[])
 	idevice_get_device_list_extended(&devices, &num);
 	idevice_device_list_extended_free(devices);
 	if (num == 0) {
-		if (!udid) {
+		if (all_devices) {
+			fprintf(stderr, "Waiting for devices to become available...\n");
+		} else if (!udid) {
 			fprintf(stderr, "No device found. Plug in a device or pass UDID with -u to wait for device to be available.\n");
 			return -1;
 		} else {
@@ -773,17 +972,28 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	line_buffer_size = 1024;
-	line = malloc(line_buffer_size);
-
-	idevice_event_subscribe(device_event_cb, NULL);
+	if (all_devices) {
+		if (syslog_relay_aggregator_new(aggregator_callback, NULL, &aggregator) != SYSLOG_RELAY_E_SUCCESS) {
+			fprintf(stderr, "ERROR: Could not start syslog aggregator.\n");
+			return -1;
+		}
+		idevice_event_subscribe(aggregator_event_cb, NULL);
+	} else {
+		idevice_event_subscribe(device_event_cb, NULL);
+	}
 
 	while (!quit_flag) {
 		sleep(1);
 	}
 	idevice_event_unsubscribe();
+	if (aggregator) {
+		syslog_relay_aggregator_free(aggregator);
+		aggregator = NULL;
+	}
 	stop_logging();
 
+	free_compiled_filters();
+
 	if (num_proc_filters > 0) {
 		int i;
 		for (i = 0; i < num_proc_filters; i++) {
@@ -816,8 +1026,6 @@ int main(int argc, char *argv[])
 		free(untrigger_filters);
 	}
 
-	free(line);
-
 	free(udid);
 
 	return 0;